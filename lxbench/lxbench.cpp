@@ -0,0 +1,590 @@
+// Included first, so that Windows.h is seen with the definitions compat.h needs.
+#include "module_image.h"
+#include "monika_names.h"
+#include "picooffsets_lookup.h"
+
+#include "lxstress.h"
+#include "reality.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// lxbench.cpp
+//
+// Measures the kernel-neutral parts of lxmonika in user mode, against the kernel images on disk.
+//
+// Usage: lxbench [iterations] [ntoskrnl.exe] [lxcore.sys]
+//        lxbench stress <scenario> [count] [workers] [depth]
+//        lxbench self <primitive> [iterations] [workers] [provider]
+//
+// The second form drives the lxstress provider, which has to be installed and running. The third
+// times lxmonika primitives inside the driver, which only allows it when the SelfBenchmark DWORD
+// in its service key is non-zero.
+
+#define LXBENCH_DEFAULT_ITERATIONS      (1000)
+#define LXBENCH_DEFAULT_STRESS_COUNT    (10000)
+#define LXBENCH_DEFAULT_STRESS_DEPTH    (4)
+#define LXBENCH_DEFAULT_SELF_ITERATIONS (100000)
+
+// The architecture names PicoSppGetOffsets uses for the running kernel.
+#if defined(_M_X64)
+#define LXBENCH_ARCHITECTURE            "x64"
+#elif defined(_M_ARM64)
+#define LXBENCH_ARCHITECTURE            "arm64"
+#elif defined(_M_IX86)
+#define LXBENCH_ARCHITECTURE            "x86"
+#elif defined(_M_ARM)
+#define LXBENCH_ARCHITECTURE            "arm"
+#else
+#error Define the identifier for this architecture!
+#endif
+
+struct BenchImage
+{
+    std::string Name;
+    std::shared_ptr<void> View;
+    SIZE_T Size;
+};
+
+static std::vector<BenchImage> BenchImages;
+
+// Called by MdlpGetProcAddress to follow forwarders, which only resolve to the mapped images.
+extern "C"
+NTSTATUS
+MdlpFindModuleByName(
+    _In_ PCSTR pModuleName,
+    _Out_ PHANDLE pHandle,
+    _Out_opt_ PSIZE_T puSize
+)
+{
+    for (const auto& image: BenchImages)
+    {
+        if (_stricmp(image.Name.c_str(), pModuleName) == 0)
+        {
+            if (puSize != NULL)
+            {
+                *puSize = image.Size;
+            }
+            *pHandle = image.View.get();
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_NOT_FOUND;
+}
+
+// Maps the image with the same layout as the kernel loader gives it, without running any of it.
+static
+const BenchImage*
+BenchMapImage(
+    const std::filesystem::path& path
+)
+{
+    HANDLE hdlFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hdlFile == INVALID_HANDLE_VALUE)
+    {
+        return nullptr;
+    }
+    auto file = std::shared_ptr<void>(hdlFile, CloseHandle);
+
+    HANDLE hdlMapping = CreateFileMappingW(file.get(), NULL,
+        PAGE_READONLY | SEC_IMAGE_NO_EXECUTE, 0, 0, NULL);
+    if (hdlMapping == NULL)
+    {
+        return nullptr;
+    }
+    auto mapping = std::shared_ptr<void>(hdlMapping, CloseHandle);
+
+    PVOID pView = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+    if (pView == NULL)
+    {
+        return nullptr;
+    }
+
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pView;
+    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)((PCHAR)pView + pDosHeader->e_lfanew);
+
+    BenchImages.push_back(BenchImage
+    {
+        .Name = path.filename().string(),
+        .View = std::shared_ptr<void>(pView, UnmapViewOfFile),
+        .Size = pPeHeader->OptionalHeader.SizeOfImage
+    });
+
+    return &BenchImages.back();
+}
+
+// The names of all exports, in the order of the name table.
+static
+std::vector<PCSTR>
+BenchGetExportNames(
+    const BenchImage& image
+)
+{
+    PCHAR pStart = (PCHAR)image.View.get();
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pStart;
+    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)(pStart + pDosHeader->e_lfanew);
+
+    PIMAGE_DATA_DIRECTORY pDataDirectory =
+        &pPeHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+
+    std::vector<PCSTR> names;
+
+    if (pDataDirectory->VirtualAddress == 0)
+    {
+        return names;
+    }
+
+    PIMAGE_EXPORT_DIRECTORY pExportDirectory =
+        (PIMAGE_EXPORT_DIRECTORY)(pStart + pDataDirectory->VirtualAddress);
+    PDWORD32 pNameList = (PDWORD32)(pStart + pExportDirectory->AddressOfNames);
+
+    for (DWORD i = 0; i < pExportDirectory->NumberOfNames; ++i)
+    {
+        names.push_back(pStart + pNameList[i]);
+    }
+
+    return names;
+}
+
+// "major.minor.build.revision" of the file, as the driver reads it from the loaded kernel.
+static
+std::string
+BenchGetFileVersion(
+    const std::filesystem::path& path
+)
+{
+    DWORD dwHandle = 0;
+    DWORD dwSize = GetFileVersionInfoSizeW(path.c_str(), &dwHandle);
+    if (dwSize == 0)
+    {
+        return "";
+    }
+
+    std::vector<BYTE> versionInfo(dwSize);
+    VS_FIXEDFILEINFO* pFileInfo = NULL;
+    UINT uFileInfoSize = 0;
+
+    if (!GetFileVersionInfoW(path.c_str(), 0, dwSize, versionInfo.data())
+        || !VerQueryValueW(versionInfo.data(), L"\\", (LPVOID*)&pFileInfo, &uFileInfoSize)
+        || uFileInfoSize < sizeof(VS_FIXEDFILEINFO))
+    {
+        return "";
+    }
+
+    return std::format("{}.{}.{}.{}",
+        HIWORD(pFileInfo->dwProductVersionMS), LOWORD(pFileInfo->dwProductVersionMS),
+        HIWORD(pFileInfo->dwProductVersionLS), LOWORD(pFileInfo->dwProductVersionLS));
+}
+
+// Runs function once to warm up, then iterations times, each doing operations lookups.
+template <typename TFunction>
+static
+void
+BenchRun(
+    const char* pName,
+    size_t iterations,
+    size_t operations,
+    TFunction function
+)
+{
+    if (operations == 0)
+    {
+        std::cout << std::format("{:<24} skipped", pName) << std::endl;
+        return;
+    }
+
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+
+    QueryPerformanceFrequency(&frequency);
+
+    function();
+
+    QueryPerformanceCounter(&start);
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        function();
+    }
+    QueryPerformanceCounter(&end);
+
+    double dNanoseconds = (double)(end.QuadPart - start.QuadPart) * 1e9
+        / (double)frequency.QuadPart / (double)(iterations * operations);
+
+    std::cout << std::format("{:<24} {:>10} {:>12.1f} ns/op", pName, operations, dNanoseconds)
+        << std::endl;
+}
+
+// Opens an NT device path, which neither device has a Win32 link for.
+static
+std::shared_ptr<void>
+BenchOpenDevice(
+    PCWSTR pDeviceName
+)
+{
+    UNICODE_STRING strDevicePath;
+    RtlInitUnicodeString(&strDevicePath, pDeviceName);
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, &strDevicePath, OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    IO_STATUS_BLOCK ioStatus;
+
+    HANDLE hdlDevice = NULL;
+    NTSTATUS status = NtCreateFile(
+        &hdlDevice,
+        FILE_GENERIC_READ | FILE_GENERIC_WRITE,
+        &objAttributes,
+        &ioStatus,
+        NULL,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_OPEN,
+        FILE_SYNCHRONOUS_IO_NONALERT,
+        NULL,
+        0
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        std::wcerr << std::format(L"Cannot open {}, status 0x{:08x}",
+            pDeviceName, (ULONG)status) << std::endl;
+        return nullptr;
+    }
+
+    return std::shared_ptr<void>(hdlDevice, CloseHandle);
+}
+
+// Indexed by LxStressScenario.
+static const wchar_t* const BenchStressScenarios[] =
+{
+    L"process",
+    L"thread",
+    L"syscall",
+    L"exception",
+    L"nested"
+};
+
+static_assert(ARRAYSIZE(BenchStressScenarios) == LxStressScenarioMaxCount);
+
+// Generates load inside lxmonika through the lxstress provider, and reports its throughput.
+static
+int
+BenchStress(
+    int argc,
+    wchar_t** argv
+)
+{
+    if (argc < 1)
+    {
+        std::wcerr << L"Scenario expected." << std::endl;
+        return 1;
+    }
+
+    std::wstring scenarioName = argv[0];
+    auto it = std::ranges::find(BenchStressScenarios, scenarioName);
+    if (it == std::end(BenchStressScenarios))
+    {
+        std::wcerr << L"Unknown scenario " << scenarioName << L"." << std::endl;
+        return 1;
+    }
+
+    LXSTRESS_RUN_INFORMATION information =
+    {
+        .Size = sizeof(LXSTRESS_RUN_INFORMATION),
+        .Scenario = (ULONG)(it - std::begin(BenchStressScenarios)),
+        .Workers = (argc > 2) ? (ULONG)std::stoul(argv[2]) : 0,
+        .Depth = (argc > 3) ? (ULONG)std::stoul(argv[3]) : LXBENCH_DEFAULT_STRESS_DEPTH,
+        .Count = (argc > 1) ? (ULONG64)std::stoull(argv[1]) : LXBENCH_DEFAULT_STRESS_COUNT
+    };
+
+    auto device = BenchOpenDevice(LXSTRESS_DEVICE_NAME);
+    if (device == nullptr)
+    {
+        return 1;
+    }
+
+    LXSTRESS_RUN_RESULT result = { };
+    DWORD dwReturned = 0;
+
+    if (!DeviceIoControl(device.get(), IOCTL_LXSTRESS_RUN, &information, sizeof(information),
+        &result, sizeof(result), &dwReturned, NULL) || dwReturned < sizeof(result))
+    {
+        std::wcerr << L"Run failed, error " << GetLastError() << std::endl;
+        return 1;
+    }
+
+    double dSeconds = (double)result.ElapsedTicks / (double)result.Frequency;
+    double dThroughput = (result.Operations != 0) ? (double)result.Operations / dSeconds : 0.0;
+    // Per worker, as each of them runs its operations one after another.
+    double dNanoseconds = (result.Operations != 0)
+        ? dSeconds * 1e9 * result.Workers / (double)result.Operations : 0.0;
+
+    std::wcout << std::format(L"{:<24} {:>4} workers {:>12} ops {:>8} failed {:>10.3f} s",
+        scenarioName, result.Workers, result.Operations, result.Failures, dSeconds)
+        << std::endl;
+    std::wcout << std::format(L"{:<24} {:>14.0f} ops/s {:>12.1f} ns/op",
+        L"", dThroughput, dNanoseconds) << std::endl;
+
+    return (result.Failures == 0) ? 0 : 1;
+}
+
+// Indexed by RlSelfBenchmarkPrimitives.
+static const wchar_t* const BenchSelfPrimitives[] =
+{
+    L"none",
+    L"get-context",
+    L"context-churn",
+    L"find-provider",
+    L"file-update",
+    L"log"
+};
+
+static_assert(ARRAYSIZE(BenchSelfPrimitives) == RlSelfBenchmarkMaxCount);
+
+// Times one lxmonika primitive inside the driver, and reports its cycle percentiles.
+static
+int
+BenchSelf(
+    int argc,
+    wchar_t** argv
+)
+{
+    if (argc < 1)
+    {
+        std::wcerr << L"Primitive expected." << std::endl;
+        return 1;
+    }
+
+    std::wstring primitiveName = argv[0];
+    auto it = std::ranges::find(BenchSelfPrimitives, primitiveName);
+    if (it == std::end(BenchSelfPrimitives))
+    {
+        std::wcerr << L"Unknown primitive " << primitiveName << L"." << std::endl;
+        return 1;
+    }
+
+    // Large enough that it does not belong on the stack.
+    auto benchmark = std::make_unique<RL_SELF_BENCHMARK>();
+    *benchmark =
+    {
+        .Size = sizeof(RL_SELF_BENCHMARK),
+        .Primitive = (ULONG)(it - std::begin(BenchSelfPrimitives)),
+        .Workers = (argc > 2) ? (ULONG)std::stoul(argv[2]) : 0,
+        .Iterations = (argc > 1) ? (ULONG64)std::stoull(argv[1])
+            : LXBENCH_DEFAULT_SELF_ITERATIONS
+    };
+
+    if (argc > 3)
+    {
+        wcsncpy_s(benchmark->ProviderName, argv[3], _TRUNCATE);
+    }
+
+    auto device = BenchOpenDevice(RL_DEVICE_NAME);
+    if (device == nullptr)
+    {
+        return 1;
+    }
+
+    DWORD dwReturned = 0;
+
+    if (!DeviceIoControl(device.get(), RL_IOCTL_SELF_BENCHMARK,
+        benchmark.get(), sizeof(RL_SELF_BENCHMARK), benchmark.get(), sizeof(RL_SELF_BENCHMARK),
+        &dwReturned, NULL))
+    {
+        std::wcerr << L"Run failed, error " << GetLastError() << std::endl;
+        return 1;
+    }
+
+    const auto Print = [&](std::wstring_view label, const RL_SELF_BENCHMARK_RESULT& result)
+    {
+        std::wcout << std::format(
+            L"{:<16} {:>10} min {:>10} p50 {:>10} p90 {:>10} p99 {:>10} p999 {:>10} max "
+                L"{:>10.1f} mean {:>10} failed",
+            label, result.Minimum, result.Median, result.P90, result.P99, result.P999,
+            result.Maximum, (double)result.Total / (double)result.Samples, result.Failures)
+            << std::endl;
+    };
+
+    double dSeconds = (double)benchmark->ElapsedTicks / (double)benchmark->Frequency;
+
+    std::wcout << std::format(L"{:<24} {:>4} workers {:>12} samples {:>10.3f} s, in cycles",
+        primitiveName, benchmark->Workers, benchmark->Combined.Samples, dSeconds) << std::endl;
+
+    for (ULONG i = 0; i < benchmark->Workers; ++i)
+    {
+        Print(std::format(L"cpu {}", benchmark->PerWorker[i].Processor),
+            benchmark->PerWorker[i]);
+    }
+    Print(L"all", benchmark->Combined);
+
+    return 0;
+}
+
+int
+wmain(
+    int argc,
+    wchar_t** argv
+)
+{
+    if (argc > 1 && wcscmp(argv[1], L"stress") == 0)
+    {
+        return BenchStress(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && wcscmp(argv[1], L"self") == 0)
+    {
+        return BenchSelf(argc - 2, argv + 2);
+    }
+
+    size_t iterations = LXBENCH_DEFAULT_ITERATIONS;
+    if (argc > 1)
+    {
+        iterations = max((size_t)std::stoul(argv[1]), (size_t)1);
+    }
+
+    std::filesystem::path systemRoot = _wgetenv(L"SystemRoot") ? _wgetenv(L"SystemRoot")
+        : L"C:\\Windows";
+    std::filesystem::path kernelPath = (argc > 2) ? std::filesystem::path(argv[2])
+        : systemRoot / L"System32" / L"ntoskrnl.exe";
+    std::filesystem::path lxCorePath = (argc > 3) ? std::filesystem::path(argv[3])
+        : systemRoot / L"System32" / L"drivers" / L"lxcore.sys";
+
+    // Reserved, so that the images do not move while they are referenced.
+    BenchImages.reserve(2);
+
+    const BenchImage* pKernel = BenchMapImage(kernelPath);
+    if (pKernel == nullptr)
+    {
+        std::wcerr << L"Cannot map " << kernelPath.wstring() << L", error "
+            << GetLastError() << std::endl;
+        return 1;
+    }
+
+    // WSL may not be installed, the lxcore.sys cases are skipped then.
+    const BenchImage* pLxCore = BenchMapImage(lxCorePath);
+
+    volatile NTSTATUS status = STATUS_SUCCESS;
+    PVOID pResult = NULL;
+
+    //
+    // PE parsing
+    //
+
+    BenchRun("section-lookup", iterations, 1, [&]()
+    {
+        SIZE_T uSize = pKernel->Size;
+        status = MdlpFindModuleSectionByName(pKernel->View.get(), ".data", &pResult, &uSize);
+    });
+
+    std::vector<PCSTR> kernelExports = BenchGetExportNames(*pKernel);
+
+    BenchRun("export-by-name", iterations, kernelExports.size(), [&]()
+    {
+        for (PCSTR pName: kernelExports)
+        {
+            status = MdlpGetProcAddress(pKernel->View.get(), pName, &pResult);
+        }
+    });
+
+    std::vector<PVOID> procs(kernelExports.size());
+    std::vector<MDL_PROC> procList;
+    for (size_t i = 0; i < kernelExports.size(); ++i)
+    {
+        procList.push_back(MDL_PROC { .Name = kernelExports[i], .Proc = &procs[i] });
+    }
+
+    BenchRun("export-batch", iterations, procList.size(), [&]()
+    {
+        status = MdlpGetProcAddresses(pKernel->View.get(), procList.data(), procList.size());
+    });
+
+    BenchRun("lxcore-routines", iterations, (pLxCore != nullptr) ? 1 : 0, [&]()
+    {
+        status = MdlpGetProcAddress(pLxCore->View.get(), "LxpRoutines", &pResult);
+    });
+
+    //
+    // Offsets
+    //
+
+    std::string kernelVersion = BenchGetFileVersion(kernelPath);
+    ULONG64 uKey = 0;
+
+    BenchRun("offsets-key", iterations, kernelVersion.empty() ? 0 : 1, [&]()
+    {
+        status = PicoSppMakeOffsetsKey(kernelVersion.c_str(), LXBENCH_ARCHITECTURE, &uKey)
+            ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+    });
+
+    std::vector<ULONG64> keys;
+#if MA_PICO_OFFSETS_COUNT > 0
+    for (const auto& offsets: MaPspPicoProviderRoutinesOffsets)
+    {
+        keys.push_back(offsets.Key);
+    }
+#endif
+    // The running kernel is not always in the table.
+    keys.push_back(uKey);
+
+    PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS pOffsets = NULL;
+
+    BenchRun("offsets-lookup", iterations, keys.size(), [&]()
+    {
+        for (ULONG64 uCurrentKey: keys)
+        {
+            status = PicoSppFindOffsets(uCurrentKey, &pOffsets)
+                ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+        }
+    });
+
+    //
+    // Provider names
+    //
+
+    std::vector<std::wstring> providerNames =
+    {
+        L"LXSS", L"Monix", L"WSL", L"linux", L"lxss", L"minix", L"monix", L"wsl"
+    };
+    std::ranges::sort(providerNames);
+
+    std::vector<MA_PROVIDER_NAME_ENTRY> providerEntries;
+    for (auto& name: providerNames)
+    {
+        providerEntries.push_back(MA_PROVIDER_NAME_ENTRY
+        {
+            .Index = providerEntries.size(),
+            .Name =
+            {
+                .Length = (USHORT)(name.size() * sizeof(WCHAR)),
+                .MaximumLength = (USHORT)((name.size() + 1) * sizeof(WCHAR)),
+                .Buffer = name.data()
+            }
+        });
+    }
+
+    // Exact names, prefixes, and names no provider has.
+    const PCWSTR providerQueries[] =
+    {
+        L"LXSS", L"Monix", L"lx", L"mon", L"wsl2", L"windows", L"", L"zzz"
+    };
+
+    BenchRun("provider-name", iterations, ARRAYSIZE(providerQueries), [&]()
+    {
+        for (PCWSTR pQuery: providerQueries)
+        {
+            SIZE_T uIndex = 0;
+            status = MapMatchProviderName(providerEntries.data(), providerEntries.size(),
+                pQuery, &uIndex) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+        }
+    });
+
+    return 0;
+}
@@ -30,6 +30,46 @@ NTSTATUS
     );
 typedef MA_PICO_GET_ALLOCATED_PROVIDER_NAME* PMA_PICO_GET_ALLOCATED_PROVIDER_NAME;
 
+// Flags of MA_PICO_SESSION_PLACEMENT, telling which of its fields are used.
+#define MA_PLACEMENT_AFFINITY (0x1)
+#define MA_PLACEMENT_PREFERRED_NODE (0x2)
+#define MA_PLACEMENT_VALID_FLAGS (MA_PLACEMENT_AFFINITY | MA_PLACEMENT_PREFERRED_NODE)
+
+// Where the threads of a session run. Affinity restricts them to a set of processors of one
+// group. PreferredNode gives them ideal processors on a NUMA node, which is also where their
+// memory comes from by default. When both are set, the node must have processors in Affinity.
+typedef struct _MA_PICO_SESSION_PLACEMENT {
+    ULONG Flags;
+    USHORT PreferredNode;
+    USHORT Reserved;
+    GROUP_AFFINITY Affinity;
+} MA_PICO_SESSION_PLACEMENT, *PMA_PICO_SESSION_PLACEMENT;
+
+// Flags of MA_PICO_SESSION_LIMITS, telling which of its fields are used.
+#define MA_LIMIT_CPU_RATE (0x1)
+#define MA_LIMIT_COMMIT (0x2)
+#define MA_LIMIT_WORKING_SET (0x4)
+#define MA_LIMIT_PROCESS_COUNT (0x8)
+#define MA_LIMIT_VALID_FLAGS \
+    (MA_LIMIT_CPU_RATE | MA_LIMIT_COMMIT | MA_LIMIT_WORKING_SET | MA_LIMIT_PROCESS_COUNT)
+
+// The CpuRate of a session allowed to use every processor of the machine.
+#define MA_CPU_RATE_MAX (10000)
+
+// Resources shared by all the processes of a session, enforced by a job object.
+// CpuRate is a hard cap, in hundredths of a percent of the machine. Commit is in bytes, for the
+// whole session. The working set bounds apply to each process, and ProcessCount caps the
+// processes alive at the same time.
+typedef struct _MA_PICO_SESSION_LIMITS {
+    ULONG Flags;
+    ULONG CpuRate;
+    SIZE_T Commit;
+    SIZE_T MinimumWorkingSet;
+    SIZE_T MaximumWorkingSet;
+    ULONG ProcessCount;
+    ULONG Reserved;
+} MA_PICO_SESSION_LIMITS, *PMA_PICO_SESSION_LIMITS;
+
 typedef struct _MA_PICO_SESSION_ATTRIBUTES {
     SIZE_T Size;
     HANDLE HostProcess;
@@ -44,6 +84,17 @@ typedef struct _MA_PICO_SESSION_ATTRIBUTES {
     PUNICODE_STRING Args;
     SIZE_T EnvironmentCount;
     PUNICODE_STRING Environment;
+    // Initialized to NULL by the caller. When Size covers this field, StartSessionAsync may set
+    // it to the process it has started, with a reference that the caller releases.
+    PEPROCESS Process;
+    // Ignored unless Size covers this field. Applied to the initial process, and inherited by
+    // its threads and the processes it creates. Validated by lxmonika before the provider sees
+    // it.
+    MA_PICO_SESSION_PLACEMENT Placement;
+    // Ignored unless Size covers this field. Validated by lxmonika, which creates the job object
+    // before calling the provider. The provider puts the initial process in it with
+    // MaAssignSessionProcess.
+    MA_PICO_SESSION_LIMITS Limits;
 } MA_PICO_SESSION_ATTRIBUTES, *PMA_PICO_SESSION_ATTRIBUTES;
 
 typedef
@@ -53,6 +104,44 @@ NTSTATUS
     );
 typedef MA_PICO_START_SESSION* PMA_PICO_START_SESSION;
 
+/// <summary>Called once when a session started by <c>StartSessionAsync</c> ends.</summary>
+///
+/// <param name="Status">
+/// The status that the synchronous <c>StartSession</c> routine would have returned.
+/// </param>
+///
+/// <remarks>
+/// May be called at any IRQL up to <c>DISPATCH_LEVEL</c>, from any thread.
+/// </remarks>
+typedef
+VOID
+    MA_PICO_SESSION_COMPLETION(
+        _In_opt_ PVOID Context,
+        _In_ NTSTATUS Status
+    );
+typedef MA_PICO_SESSION_COMPLETION* PMA_PICO_SESSION_COMPLETION;
+
+/// <summary>Starts a session without waiting for it to end.</summary>
+///
+/// <returns>
+/// <c>STATUS_PENDING</c> if the session has been started. <paramref name="Completion"/> is then
+/// called exactly once when it ends. For any other value, <paramref name="Completion"/> is never
+/// called.
+/// </returns>
+///
+/// <remarks>
+/// As with <c>StartSession</c>, the handles and strings in <paramref name="Attributes"/> are only
+/// valid for the duration of the call.
+/// </remarks>
+typedef
+NTSTATUS
+    MA_PICO_START_SESSION_ASYNC(
+        _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+        _In_ PMA_PICO_SESSION_COMPLETION Completion,
+        _In_opt_ PVOID CompletionContext
+    );
+typedef MA_PICO_START_SESSION_ASYNC* PMA_PICO_START_SESSION_ASYNC;
+
 typedef
 NTSTATUS
     MA_PICO_GET_CURRENT_WORKING_DIRECTORY(
@@ -71,6 +160,29 @@ NTSTATUS
     );
 typedef MA_PICO_GET_CONSOLE* PMA_PICO_GET_CONSOLE;
 
+// The largest warm pool lxmonika asks a provider to keep.
+#define MA_WARM_POOL_SIZE_MAX (16)
+
+/// <summary>Sets how many processes the provider keeps ready for new sessions.</summary>
+///
+/// <param name="Size">
+/// The number of processes per executable, at most <c>MA_WARM_POOL_SIZE_MAX</c>. 0 empties the
+/// pool and stops refilling it.
+/// </param>
+///
+/// <remarks>
+/// Called at <c>PASSIVE_LEVEL</c>, possibly before <c>MaRegisterPicoProviderEx</c> returns.
+/// Providers hand a pooled process out from <c>StartSession</c> and <c>StartSessionAsync</c> when
+/// it matches the session, and refill the pool in the background. Which sessions a pooled
+/// process matches is up to the provider, but it must never run on behalf of another user.
+/// </remarks>
+typedef
+NTSTATUS
+    MA_PICO_SET_WARM_POOL_SIZE(
+        _In_ SIZE_T Size
+    );
+typedef MA_PICO_SET_WARM_POOL_SIZE* PMA_PICO_SET_WARM_POOL_SIZE;
+
 typedef struct _MA_PICO_PROVIDER_ROUTINES {
     SIZE_T Size;
     PMA_PICO_GET_ALLOCATED_PROVIDER_NAME GetAllocatedProviderName;
@@ -78,10 +190,42 @@ typedef struct _MA_PICO_PROVIDER_ROUTINES {
     PMA_PICO_GET_CURRENT_WORKING_DIRECTORY GetCurrentWorkingDirectory;
     PMA_PICO_GET_CONSOLE GetConsole;
     ULONG AbiVersion;
+    PMA_PICO_START_SESSION_ASYNC StartSessionAsync;
+    PMA_PICO_SET_WARM_POOL_SIZE SetWarmPoolSize;
 } MA_PICO_PROVIDER_ROUTINES, *PMA_PICO_PROVIDER_ROUTINES;
 
+// How many times a single system call may be forwarded to a parent provider.
+#define MA_FORWARD_SYSTEM_CALL_DEPTH_MAX (4)
+
+/// <summary>
+/// Hands the system call being dispatched on the current thread to the provider that the
+/// current context has been pushed on top of, without returning to user mode.
+/// </summary>
+///
+/// <returns>
+/// <c>STATUS_SUCCESS</c> once the parent provider has dispatched the call and updated
+/// <c>SystemCall->TrapFrame</c>. <c>STATUS_NOT_FOUND</c> if the context has no parent, and
+/// <c>STATUS_NOT_SUPPORTED</c> if the parent does not dispatch system calls. The call must then
+/// be failed by the caller.
+/// </returns>
+///
+/// <remarks>
+/// Must only be called from <c>DispatchSystemCall</c> on the same thread, with the
+/// <paramref name="SystemCall"/> it has received. While the parent dispatches the call, its
+/// <c>GetProcessContext</c> and <c>GetThreadContext</c> routines return its own contexts for the
+/// current thread and process. Parents may forward the call again, up to
+/// <c>MA_FORWARD_SYSTEM_CALL_DEPTH_MAX</c> times in total.
+/// </remarks>
+typedef
+NTSTATUS
+    MA_PICO_FORWARD_SYSTEM_CALL(
+        _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+    );
+typedef MA_PICO_FORWARD_SYSTEM_CALL* PMA_PICO_FORWARD_SYSTEM_CALL;
+
 typedef struct _MA_PICO_ROUTINES {
     SIZE_T Size;
+    PMA_PICO_FORWARD_SYSTEM_CALL ForwardSystemCall;
 } MA_PICO_ROUTINES;
 typedef MA_PICO_ROUTINES* PMA_PICO_ROUTINES;
 
@@ -102,6 +246,19 @@ NTSTATUS NTAPI
         _Out_opt_ PSIZE_T Index
     );
 
+/// <summary>Unregisters a provider previously registered with lxmonika.</summary>
+///
+/// <remarks>
+/// The call waits for any routines currently running on behalf of the provider to return.
+/// It fails with <c>STATUS_DEVICE_BUSY</c> while processes or threads of the provider are still
+/// alive. After it succeeds, the index may be reused by another provider.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaUnregisterPicoProvider(
+        _In_ SIZE_T Index
+    );
+
 /// <summary>Sets the name of the specified provider.</summary>
 ///
 /// <param name="Name">
@@ -128,6 +285,41 @@ NTSTATUS NTAPI
         _Out_ PSIZE_T Index
     );
 
+/// <summary>Tells lxmonika that the name reported by a provider has changed.</summary>
+///
+/// <remarks>
+/// Names are cached for <c>MaFindPicoProvider</c>. Providers that report a different name after
+/// the first successful <c>GetAllocatedProviderName</c> call must call this function.
+/// </remarks>
+MONIKA_EXPORT
+VOID NTAPI
+    MaNotifyPicoProviderRenamed(
+        _In_ SIZE_T Index
+    );
+
+/// <summary>Switches the current thread to the specified provider.</summary>
+///
+/// <param name="Context">
+/// The thread context that the new provider sees through its <c>GetThreadContext</c> routine.
+/// </param>
+///
+/// <returns>
+/// <c>STATUS_NOT_SUPPORTED</c> if the thread is not managed by lxmonika, and
+/// <c>STATUS_INVALID_PARAMETER</c> if it already belongs to <paramref name="Index"/>.
+/// </returns>
+///
+/// <remarks>
+/// Must be called at <c>PASSIVE_LEVEL</c> on a Pico thread, usually from a system call.
+/// The new provider gives the thread back to the current one by calling its
+/// <c>TerminateThread</c> routine on it, as it would for a thread it created itself.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaPushPicoProvider(
+        _In_ SIZE_T Index,
+        _In_opt_ PVOID Context
+    );
+
 MONIKA_EXPORT
 NTSTATUS NTAPI
     MaGetAllocatedPicoProviderName(
@@ -142,6 +334,81 @@ NTSTATUS NTAPI
         _In_ PMA_PICO_SESSION_ATTRIBUTES SessionAttributes
     );
 
+/// <summary>Starts a session of the specified provider without waiting for it to end.</summary>
+///
+/// <returns>
+/// <c>STATUS_NOT_SUPPORTED</c> if the provider does not have a <c>StartSessionAsync</c> routine.
+/// Otherwise, see <c>MA_PICO_START_SESSION_ASYNC</c>.
+/// </returns>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaStartSessionAsync(
+        _In_ SIZE_T Index,
+        _In_ PMA_PICO_SESSION_ATTRIBUTES SessionAttributes,
+        _In_ PMA_PICO_SESSION_COMPLETION Completion,
+        _In_opt_ PVOID CompletionContext
+    );
+
+/// <summary>Applies the placement of a session to one of its threads.</summary>
+///
+/// <returns>
+/// <c>STATUS_INVALID_PARAMETER</c> if the placement names processors or nodes that are not
+/// active.
+/// </returns>
+///
+/// <remarks>
+/// Must be called at <c>PASSIVE_LEVEL</c>. Does nothing when <c>Placement->Flags</c> is 0.
+/// Providers call this for every thread they create for a session, preferably before resuming
+/// it, as NT does not carry the group affinity of a thread over to new threads or processes.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaSetThreadPlacement(
+        _In_ PETHREAD Thread,
+        _In_ const MA_PICO_SESSION_PLACEMENT* Placement
+    );
+
+/// <summary>Puts the initial process of a session in the job object enforcing its limits.</summary>
+///
+/// <param name="Attributes">
+/// The attributes passed to the <c>StartSession</c> or <c>StartSessionAsync</c> routine.
+/// </param>
+///
+/// <returns>
+/// <c>STATUS_INVALID_PARAMETER</c> if the session has limits but <paramref name="Attributes"/>
+/// did not come from lxmonika, or the provider routine has already returned.
+/// </returns>
+///
+/// <remarks>
+/// Must be called at <c>PASSIVE_LEVEL</c>, from the provider routine, before the process runs.
+/// Does nothing for sessions without limits. The processes created by the initial process stay
+/// in the job, as NT does for any process in a job. The provider should fail the session if this
+/// function fails.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaAssignSessionProcess(
+        _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+        _In_ PEPROCESS Process
+    );
+
+/// <summary>Sets the warm pool size of the specified provider.</summary>
+///
+/// <returns>
+/// <c>STATUS_NOT_SUPPORTED</c> if the provider does not have a <c>SetWarmPoolSize</c> routine.
+/// </returns>
+///
+/// <remarks>
+/// Providers that do are told the WarmPoolSize DWORD of the lxmonika service key when they
+/// register.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaSetWarmPoolSize(
+        _In_ SIZE_T Index,
+        _In_ SIZE_T Size
+    );
+
 MONIKA_EXPORT
 NTSTATUS NTAPI
     MaGetConsole(
@@ -151,6 +418,74 @@ NTSTATUS NTAPI
         _Out_opt_ PHANDLE Output
     );
 
+//
+// Monika system call hooks
+//
+
+/// <summary>Called before the provider dispatches a hooked system call.</summary>
+///
+/// <param name="CallState">
+/// Receives a value that is passed to the post-call hook of the same system call.
+/// </param>
+///
+/// <returns>
+/// <c>FALSE</c> if the hook has completed the system call by itself and the provider should not
+/// see it. Post-call hooks are still called.
+/// </returns>
+typedef
+BOOLEAN
+    MA_PICO_SYSTEM_CALL_PRE_HOOK(
+        _In_opt_ PVOID Context,
+        _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+        _Out_ PVOID* CallState
+    );
+typedef MA_PICO_SYSTEM_CALL_PRE_HOOK* PMA_PICO_SYSTEM_CALL_PRE_HOOK;
+
+typedef
+VOID
+    MA_PICO_SYSTEM_CALL_POST_HOOK(
+        _In_opt_ PVOID Context,
+        _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+        _In_opt_ PVOID CallState
+    );
+typedef MA_PICO_SYSTEM_CALL_POST_HOOK* PMA_PICO_SYSTEM_CALL_POST_HOOK;
+
+/// <summary>Hooks a system call of the provider at the specified index.</summary>
+///
+/// <param name="SystemCallNumber">
+/// The architecture-specific system call number, as seen in the trap frame.
+/// </param>
+///
+/// <param name="Cookie">
+/// Receives a value to be passed to <c>MaUnregisterSystemCallHook</c>.
+/// </param>
+///
+/// <remarks>
+/// System calls without any hooks are dispatched directly to the provider after a single bit
+/// test. Hooks of a provider are dropped when the provider is unregistered.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaRegisterSystemCallHook(
+        _In_ SIZE_T Index,
+        _In_ ULONG SystemCallNumber,
+        _In_opt_ PMA_PICO_SYSTEM_CALL_PRE_HOOK PreHook,
+        _In_opt_ PMA_PICO_SYSTEM_CALL_POST_HOOK PostHook,
+        _In_opt_ PVOID Context,
+        _Out_ PVOID* Cookie
+    );
+
+/// <summary>Removes a system call hook.</summary>
+///
+/// <remarks>
+/// The call waits for any running invocations of the hook to return.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaUnregisterSystemCallHook(
+        _In_ PVOID Cookie
+    );
+
 //
 // Monika utilities
 //
@@ -162,6 +497,62 @@ NTSTATUS NTAPI
         _Out_ PHANDLE TargetHandle
     );
 
+/// <summary>Gets new kernel handles to the console of a Win32 host process.</summary>
+///
+/// <remarks>
+/// The console is attached once per host process and cached until that process exits, so
+/// repeated calls only duplicate handles. The caller closes the returned handles.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaUtilGetHostConsole(
+        _In_ PEPROCESS HostProcess,
+        _Out_opt_ PHANDLE Console,
+        _Out_opt_ PHANDLE Input,
+        _Out_opt_ PHANDLE Output
+    );
+
+/// <summary>Queries the console mode of an input or output handle.</summary>
+///
+/// <remarks>
+/// <c>Object</c> must have been opened from <c>Console</c>, such as the handles returned by
+/// <c>MaUtilGetHostConsole</c>. The result is what <c>GetConsoleMode</c> would return.
+/// </remarks>
+MONIKA_EXPORT
+NTSTATUS NTAPI
+    MaUtilGetConsoleMode(
+        _In_ HANDLE Console,
+        _In_ HANDLE Object,
+        _Out_ PULONG Mode
+    );
+
+// Frames returned by MaUtilWalkUserStack at most, whatever the caller asks for.
+#define MA_USER_STACK_WALK_MAX (128)
+// Frame pointers this far above the user stack pointer are no longer followed.
+#define MA_USER_STACK_SPAN_MAX (8 * 1024 * 1024)
+
+/// <summary>Walks the frame pointer chain of the user stack of the current thread.</summary>
+///
+/// <returns>
+/// The number of addresses stored in <paramref name="Callers"/>, starting with the program
+/// counter of <paramref name="TrapFrame"/>.
+/// </returns>
+///
+/// <remarks>
+/// Providers opt in by calling this from their <c>WalkUserStack</c> routine. Only the callers of
+/// code built with frame pointers are found. The walk stops at the first frame that does not
+/// move up the stack, and never faults. At <c>DISPATCH_LEVEL</c> and above, the user stack is not
+/// read and only the program counter is returned.
+/// </remarks>
+MONIKA_EXPORT
+_Ret_range_(<= , FrameCount)
+ULONG NTAPI
+    MaUtilWalkUserStack(
+        _In_ PKTRAP_FRAME TrapFrame,
+        _Out_writes_to_(FrameCount, return) PVOID* Callers,
+        _In_ ULONG FrameCount
+    );
+
 #include "monika_constants.h"
 
 #ifdef __cplusplus
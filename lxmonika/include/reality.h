@@ -24,10 +24,56 @@
 
 enum RlIoctlFunctions
 {
-    RlIoctlPicoStartSession
+    RlIoctlPicoStartSession,
+    RlIoctlTraceControl,
+    RlIoctlTraceRead,
+    RlIoctlStatisticsControl,
+    RlIoctlStatisticsQuery,
+    RlIoctlLogRead,
+    RlIoctlLogFilter,
+    RlIoctlBootProfile,
+    RlIoctlQueryStatistics,
+    RlIoctlPicoStartSessionBatch,
+    RlIoctlEventSubscribe,
+    RlIoctlCountersMap,
+    RlIoctlProcessQuery,
+    RlIoctlTraceFilter,
+    RlIoctlSelfBenchmark,
+    RlIoctlProfileControl,
+    RlIoctlProfileRead
 };
 
-#define RL_IOCTL_PICO_START_SESSION RL_IOCTL_CODE(RlIoctlPicoStartSession)
+#define RL_IOCTL_PICO_START_SESSION       RL_IOCTL_CODE(RlIoctlPicoStartSession)
+#define RL_IOCTL_TRACE_CONTROL            RL_IOCTL_CODE(RlIoctlTraceControl)
+#define RL_IOCTL_TRACE_READ               RL_IOCTL_CODE(RlIoctlTraceRead)
+#define RL_IOCTL_STATISTICS_CONTROL       RL_IOCTL_CODE(RlIoctlStatisticsControl)
+#define RL_IOCTL_STATISTICS_QUERY         RL_IOCTL_CODE(RlIoctlStatisticsQuery)
+#define RL_IOCTL_LOG_READ                 RL_IOCTL_CODE(RlIoctlLogRead)
+#define RL_IOCTL_LOG_FILTER               RL_IOCTL_CODE(RlIoctlLogFilter)
+#define RL_IOCTL_BOOT_PROFILE             RL_IOCTL_CODE(RlIoctlBootProfile)
+#define RL_IOCTL_QUERY_STATISTICS         RL_IOCTL_CODE(RlIoctlQueryStatistics)
+#define RL_IOCTL_PICO_START_SESSION_BATCH RL_IOCTL_CODE(RlIoctlPicoStartSessionBatch)
+#define RL_IOCTL_EVENT_SUBSCRIBE          RL_IOCTL_CODE(RlIoctlEventSubscribe)
+#define RL_IOCTL_COUNTERS_MAP             RL_IOCTL_CODE(RlIoctlCountersMap)
+#define RL_IOCTL_PROCESS_QUERY            RL_IOCTL_CODE(RlIoctlProcessQuery)
+#define RL_IOCTL_TRACE_FILTER             RL_IOCTL_CODE(RlIoctlTraceFilter)
+#define RL_IOCTL_SELF_BENCHMARK           RL_IOCTL_CODE(RlIoctlSelfBenchmark)
+#define RL_IOCTL_PROFILE_CONTROL          RL_IOCTL_CODE(RlIoctlProfileControl)
+#define RL_IOCTL_PROFILE_READ             RL_IOCTL_CODE(RlIoctlProfileRead)
+
+// Flags of RL_PICO_SESSION_PLACEMENT.
+#define RL_PLACEMENT_AFFINITY             (0x1)
+#define RL_PLACEMENT_PREFERRED_NODE       (0x2)
+
+// Where the processes of a session run, inherited by their threads and children. Affinity
+// restricts them to processors of one group, PreferredNode gives them ideal processors, and so
+// memory, on a NUMA node. Fields are only used when their flag is set.
+typedef struct _RL_PICO_SESSION_PLACEMENT {
+    ULONG Flags;
+    USHORT PreferredNode;
+    USHORT Reserved;
+    GROUP_AFFINITY Affinity;
+} RL_PICO_SESSION_PLACEMENT, *PRL_PICO_SESSION_PLACEMENT;
 
 typedef struct _RL_PICO_SESSION_ATTRIBUTES {
     SIZE_T Size;
@@ -45,4 +91,643 @@ typedef struct _RL_PICO_SESSION_ATTRIBUTES {
     PUNICODE_STRING Args;
     SIZE_T EnvironmentCount;
     PUNICODE_STRING Environment;
+    // Optional. Callers that pass RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET as Size leave it
+    // out.
+    RL_PICO_SESSION_PLACEMENT Placement;
 } RL_PICO_SESSION_ATTRIBUTES, *PRL_PICO_SESSION_ATTRIBUTES;
+
+// The size of version 1 before Placement was added.
+#define RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET \
+    FIELD_OFFSET(RL_PICO_SESSION_ATTRIBUTES, Placement)
+
+// Version 2 of the session attributes, selected by its Size.
+// All strings live in a single buffer, so that the driver can copy them at once.
+
+// Selects the provider by ProviderName instead of ProviderIndex.
+#define RL_PICO_PROVIDER_BY_NAME ((SIZE_T)-1)
+
+// In the same order of magnitude as ARG_MAX on Linux.
+#define RL_PICO_SESSION_DATA_MAX (2 << 20)
+
+// Offset and Length are in bytes, relative to the start of Data.
+typedef struct _RL_PICO_PACKED_STRING {
+    ULONG Offset;
+    ULONG Length;
+} RL_PICO_PACKED_STRING, *PRL_PICO_PACKED_STRING;
+
+typedef struct _RL_PICO_SESSION_ATTRIBUTES_V2 {
+    SIZE_T Size;
+    SIZE_T ProviderIndex;
+    // Must be followed by a null terminator in Data.
+    RL_PICO_PACKED_STRING ProviderName;
+    RL_PICO_PACKED_STRING RootDirectory;
+    RL_PICO_PACKED_STRING CurrentWorkingDirectory;
+    ULONG ProviderArgsCount;
+    ULONG ArgsCount;
+    ULONG EnvironmentCount;
+    // Offset of ProviderArgsCount + ArgsCount + EnvironmentCount RL_PICO_PACKED_STRING entries in
+    // Data, in that order. Must be aligned to 4 bytes.
+    ULONG StringsOffset;
+    SIZE_T DataLength;
+    PVOID Data;
+} RL_PICO_SESSION_ATTRIBUTES_V2, *PRL_PICO_SESSION_ATTRIBUTES_V2;
+
+// Version 3 appends ProcessHandle to version 2.
+typedef struct _RL_PICO_SESSION_ATTRIBUTES_V3 {
+    SIZE_T Size;
+    SIZE_T ProviderIndex;
+    RL_PICO_PACKED_STRING ProviderName;
+    RL_PICO_PACKED_STRING RootDirectory;
+    RL_PICO_PACKED_STRING CurrentWorkingDirectory;
+    ULONG ProviderArgsCount;
+    ULONG ArgsCount;
+    ULONG EnvironmentCount;
+    ULONG StringsOffset;
+    SIZE_T DataLength;
+    PVOID Data;
+    // Optional. Receives a handle with SYNCHRONIZE, PROCESS_QUERY_LIMITED_INFORMATION and
+    // PROCESS_TERMINATE access to the Pico process of the session before the ioctl returns, so
+    // that overlapped callers can wait for it while the request is pending. Receives NULL when
+    // the provider does not report its processes.
+    PHANDLE ProcessHandle;
+    // Must be zero. Keeps the size of this version apart from version 1 on 64-bit builds.
+    SIZE_T Reserved;
+} RL_PICO_SESSION_ATTRIBUTES_V3, *PRL_PICO_SESSION_ATTRIBUTES_V3;
+
+// Version 4 appends Placement to version 3.
+typedef struct _RL_PICO_SESSION_ATTRIBUTES_V4 {
+    SIZE_T Size;
+    SIZE_T ProviderIndex;
+    RL_PICO_PACKED_STRING ProviderName;
+    RL_PICO_PACKED_STRING RootDirectory;
+    RL_PICO_PACKED_STRING CurrentWorkingDirectory;
+    ULONG ProviderArgsCount;
+    ULONG ArgsCount;
+    ULONG EnvironmentCount;
+    ULONG StringsOffset;
+    SIZE_T DataLength;
+    PVOID Data;
+    PHANDLE ProcessHandle;
+    SIZE_T Reserved;
+    RL_PICO_SESSION_PLACEMENT Placement;
+} RL_PICO_SESSION_ATTRIBUTES_V4, *PRL_PICO_SESSION_ATTRIBUTES_V4;
+
+#define RL_PICO_SESSION_BATCH_MAX (1024)
+
+typedef struct _RL_PICO_SESSION_BATCH_ENTRY {
+    SIZE_T ProviderArgsCount;
+    PUNICODE_STRING ProviderArgs;
+    SIZE_T ArgsCount;
+    PUNICODE_STRING Args;
+    SIZE_T EnvironmentCount;
+    PUNICODE_STRING Environment;
+} RL_PICO_SESSION_BATCH_ENTRY, *PRL_PICO_SESSION_BATCH_ENTRY;
+
+// Starts Count sessions of the same provider, one after another, sharing the root, the working
+// directory and the console of the caller. A failed entry does not stop the rest of the batch.
+typedef struct _RL_PICO_SESSION_BATCH {
+    SIZE_T Size;
+    // Same as RL_PICO_SESSION_ATTRIBUTES.
+    union {
+        PUNICODE_STRING ProviderName;
+        SIZE_T ProviderIndex;
+    };
+    PUNICODE_STRING RootDirectory;
+    PUNICODE_STRING CurrentWorkingDirectory;
+    SIZE_T Count;
+    PRL_PICO_SESSION_BATCH_ENTRY Entries;
+    // Receives Count NTSTATUS values, one for each entry.
+    PLONG Statuses;
+    // Set by the driver.
+    SIZE_T Started;
+} RL_PICO_SESSION_BATCH, *PRL_PICO_SESSION_BATCH;
+
+//
+// System call tracing
+//
+
+enum RlTraceEvents
+{
+    RlTraceEventSystemCall,
+    RlTraceEventCreateProcess,
+    RlTraceEventCreateThread,
+    RlTraceEventExitProcess,
+    RlTraceEventExitThread,
+    RlTraceEventException,
+    RlTraceEventMaxCount
+};
+
+typedef struct _RL_TRACE_RECORD {
+    LONG64 Sequence;
+    // In units of the performance counter of the host.
+    LONG64 Timestamp;
+    ULONG64 ProcessId;
+    ULONG64 ThreadId;
+    // The system call number for system call records.
+    ULONG64 Number;
+    // The value returned by the system call, or the creation or exit status for process and
+    // thread lifecycle records. For exception records, Number is the exception code and Result
+    // is the chance.
+    ULONG64 Result;
+    USHORT Event;
+    USHORT Provider;
+    ULONG Processor;
+} RL_TRACE_RECORD, *PRL_TRACE_RECORD;
+
+typedef struct _RL_TRACE_CONTROL {
+    SIZE_T Size;
+    BOOLEAN Enable;
+    // Set by the driver.
+    BOOLEAN WasEnabled;
+} RL_TRACE_CONTROL, *PRL_TRACE_CONTROL;
+
+// Records are ordered per processor only. Sort them by Timestamp for a global view.
+typedef struct _RL_TRACE_READ {
+    SIZE_T Size;
+    SIZE_T Count;
+    PRL_TRACE_RECORD Records;
+    // Set by the driver.
+    SIZE_T Read;
+    SIZE_T Lost;
+} RL_TRACE_READ, *PRL_TRACE_READ;
+
+#define RL_TRACE_FILTER_NUMBERS_MAX (16)
+
+// Applied when records are written, so that rejected events never take a place in the rings.
+// A record is traced when it matches every non-zero field.
+typedef struct _RL_TRACE_FILTER {
+    SIZE_T Size;
+    // When FALSE, only queries the current filter into the rest of the structure.
+    BOOLEAN Set;
+    // Bit i selects RlTraceEvents value i.
+    ULONG EventMask;
+    // Bit i selects the provider at index i.
+    ULONG ProviderMask;
+    ULONG64 ProcessId;
+    // Only applies to system call records.
+    ULONG NumberCount;
+    ULONG64 Numbers[RL_TRACE_FILTER_NUMBERS_MAX];
+} RL_TRACE_FILTER, *PRL_TRACE_FILTER;
+
+//
+// Provider statistics
+//
+
+#define RL_LATENCY_BUCKETS (32)
+
+typedef struct _RL_STATISTICS_CONTROL {
+    SIZE_T Size;
+    BOOLEAN Enable;
+    // Set by the driver.
+    BOOLEAN WasEnabled;
+} RL_STATISTICS_CONTROL, *PRL_STATISTICS_CONTROL;
+
+typedef struct _RL_STATISTICS_QUERY {
+    SIZE_T Size;
+    SIZE_T ProviderIndex;
+    // Set by the driver.
+    // Ticks per second of the performance counter used for latencies.
+    LONG64 Frequency;
+    // Indexed by RlTraceEvents.
+    ULONG64 Events[RlTraceEventMaxCount];
+    // Bucket i counts system calls that took [2^i, 2^(i+1)) ticks.
+    ULONG64 Latency[RL_LATENCY_BUCKETS];
+} RL_STATISTICS_QUERY, *PRL_STATISTICS_QUERY;
+
+//
+// Driver log
+//
+
+// Messages are returned as lines of text, oldest first. Pass the returned Sequence back to
+// continue where the last read stopped. Reading does not consume the messages.
+typedef struct _RL_LOG_READ {
+    SIZE_T Size;
+    ULONG64 Sequence;
+    SIZE_T Length;
+    PCHAR Buffer;
+    // Set by the driver.
+    SIZE_T Written;
+} RL_LOG_READ, *PRL_LOG_READ;
+
+enum RlLogLevels
+{
+    RlLogLevelTrace,
+    RlLogLevelInfo,
+    RlLogLevelWarning,
+    RlLogLevelError,
+    RlLogLevelNone
+};
+
+#define RL_LOG_FILTER_MAX       (16)
+#define RL_LOG_FILTER_NAME_SIZE (32)
+
+// See the LogFilter documentation in Logger.h for the matching rules.
+typedef struct _RL_LOG_FILTER_RULE {
+    CHAR File[RL_LOG_FILTER_NAME_SIZE];
+    CHAR Function[RL_LOG_FILTER_NAME_SIZE];
+    ULONG Level;
+} RL_LOG_FILTER_RULE, *PRL_LOG_FILTER_RULE;
+
+typedef struct _RL_LOG_FILTER {
+    SIZE_T Size;
+    // When FALSE, only queries the current filters into the rest of the structure.
+    BOOLEAN Set;
+    ULONG DefaultLevel;
+    ULONG Count;
+    RL_LOG_FILTER_RULE Rules[RL_LOG_FILTER_MAX];
+} RL_LOG_FILTER, *PRL_LOG_FILTER;
+
+//
+// Boot profile
+//
+
+// MapInitialize includes DetermineAbiStatus and MapLxssInitialize includes LxInitialize.
+// LocateProviderRoutines runs inside whichever phase needs it first.
+enum RlBootPhases
+{
+    RlBootPhaseDriverEntry,
+    RlBootPhaseMapInitialize,
+    RlBootPhaseDetermineAbiStatus,
+    RlBootPhaseLocateProviderRoutines,
+    RlBootPhaseMapLxssInitialize,
+    RlBootPhaseLxInitialize,
+    RlBootPhaseRlpInitializeDevices,
+    RlBootPhaseMaxCount
+};
+
+enum RlLocateMethods
+{
+    RlLocateMethodNone,
+    RlLocateMethodOffsets,
+    RlLocateMethodScan,
+    RlLocateMethodCache
+};
+
+typedef struct _RL_BOOT_PROFILE {
+    SIZE_T Size;
+    // Set by the driver.
+    LONG64 Frequency;
+    // In performance counter ticks, indexed by RlBootPhases.
+    LONG64 Ticks[RlBootPhaseMaxCount];
+    LONG Status[RlBootPhaseMaxCount];
+    // Bit i is set if phase i has run.
+    ULONG Recorded;
+    // One of RlLocateMethods.
+    ULONG LocateMethod;
+} RL_BOOT_PROFILE, *PRL_BOOT_PROFILE;
+
+//
+// Driver statistics
+//
+
+// The binary form of the reality file contents.
+// Fields are only ever appended. Version is bumped whenever that happens, and Size must match the
+// layout the caller was built against.
+#define RL_DRIVER_STATISTICS_VERSION    (4)
+
+#define RL_PROVIDER_MAX                 (16)
+#define RL_PROVIDER_NAME_SIZE           (256)
+#define RL_BUILD_STRING_SIZE            (64)
+#define RL_SESSION_MAX                  (64)
+#define RL_POOL_TAG_MAX                 (16)
+
+// Flags of RL_SESSION_STATISTICS, the limits a session was started with.
+#define RL_LIMIT_CPU_RATE               (0x1)
+#define RL_LIMIT_COMMIT                 (0x2)
+#define RL_LIMIT_WORKING_SET            (0x4)
+#define RL_LIMIT_PROCESS_COUNT          (0x8)
+
+typedef struct _RL_PROVIDER_STATISTICS {
+    BOOLEAN Registered;
+    ULONG AbiVersion;
+    // Null-terminated, possibly truncated.
+    WCHAR Name[RL_PROVIDER_NAME_SIZE];
+    // Indexed by RlTraceEvents. Only counted while statistics are enabled.
+    ULONG64 Events[RlTraceEventMaxCount];
+} RL_PROVIDER_STATISTICS, *PRL_PROVIDER_STATISTICS;
+
+// The job accounting of a running session started with limits.
+typedef struct _RL_SESSION_STATISTICS {
+    ULONG64 SessionId;
+    ULONG ProviderIndex;
+    ULONG Limits;
+    ULONG ActiveProcesses;
+    ULONG TotalProcesses;
+    // Processes terminated for exceeding a limit.
+    ULONG TerminatedProcesses;
+    ULONG Reserved;
+    // In 100ns units, for all the processes of the session.
+    ULONG64 UserTime;
+    ULONG64 KernelTime;
+    ULONG64 PeakCommit;
+    ULONG64 ReadBytes;
+    ULONG64 WriteBytes;
+} RL_SESSION_STATISTICS, *PRL_SESSION_STATISTICS;
+
+// Pool used by the driver under one tag, since it was loaded. A Tag of 0 counts together all
+// the tags past the first RL_POOL_TAG_MAX - 1.
+typedef struct _RL_POOL_STATISTICS {
+    ULONG Tag;
+    ULONG Reserved;
+    ULONG64 Allocations;
+    ULONG64 Frees;
+    ULONG64 Failures;
+    // In bytes.
+    ULONG64 BytesInUse;
+    ULONG64 PeakBytesInUse;
+} RL_POOL_STATISTICS, *PRL_POOL_STATISTICS;
+
+typedef struct _RL_DRIVER_STATISTICS {
+    SIZE_T Size;
+    // Set by the driver.
+    ULONG Version;
+    ULONG AbiVersion;
+    BOOLEAN TooLate;
+    BOOLEAN DirectWired;
+    BOOLEAN TraceEnabled;
+    BOOLEAN StatisticsEnabled;
+    ULONG64 DirectWireSwitches;
+    ULONG64 ProvidersCount;
+    // Context allocator.
+    ULONG64 ContextAllocates;
+    ULONG64 ContextAllocateMisses;
+    ULONG64 ContextLongImageNames;
+    ULONG64 ContextDeferredFrees;
+    ULONG64 ContextDeferredOverflows;
+    ULONG64 ContextDeferredBatches;
+    ULONG64 ContextCacheHits;
+    ULONG64 ContextThreadInherits;
+    // Exceptions, by the branch that found their provider.
+    ULONG64 ExceptionsThread;
+    ULONG64 ExceptionsAttached;
+    ULONG64 ExceptionsUnowned;
+    // Null-terminated, empty when not defined by the build.
+    CHAR BuildTime[RL_BUILD_STRING_SIZE];
+    CHAR BuildNumber[RL_BUILD_STRING_SIZE];
+    CHAR BuildHash[RL_BUILD_STRING_SIZE];
+    CHAR BuildTag[RL_BUILD_STRING_SIZE];
+    CHAR BuildOrigin[RL_BUILD_STRING_SIZE];
+    RL_PROVIDER_STATISTICS Providers[RL_PROVIDER_MAX];
+    // Version 2. The number of running sessions with limits, of which the first RL_SESSION_MAX
+    // are in Sessions.
+    ULONG64 SessionsCount;
+    RL_SESSION_STATISTICS Sessions[RL_SESSION_MAX];
+    // Version 3. Time spent in each provider handling system calls, in units of the performance
+    // counter of the host, which ticks Frequency times per second.
+    LONG64 Frequency;
+    ULONG64 ProviderSystemCallTime[RL_PROVIDER_MAX];
+    // Version 4. The number of pool tags in use, of which the first RL_POOL_TAG_MAX are in
+    // Pools.
+    ULONG64 PoolTagsCount;
+    RL_POOL_STATISTICS Pools[RL_POOL_TAG_MAX];
+} RL_DRIVER_STATISTICS, *PRL_DRIVER_STATISTICS;
+
+// The sizes of the structure before versions 2, 3 and 4, still accepted by the driver.
+#define RL_DRIVER_STATISTICS_V1_SIZE    FIELD_OFFSET(RL_DRIVER_STATISTICS, SessionsCount)
+#define RL_DRIVER_STATISTICS_V2_SIZE    FIELD_OFFSET(RL_DRIVER_STATISTICS, Frequency)
+#define RL_DRIVER_STATISTICS_V3_SIZE    FIELD_OFFSET(RL_DRIVER_STATISTICS, PoolTagsCount)
+
+//
+// Lifecycle events
+//
+
+// Process and thread creation and exit events, written by the driver into a ring mapped into the
+// subscriber. Event is one of the process and thread RlTraceEvent values.
+#define RL_EVENT_RING_MAX       (1 << 16)
+// Subscriptions alive at once, in total and per subscribing process.
+#define RL_EVENT_SUBSCRIBERS_MAX            (32)
+#define RL_EVENT_PROCESS_SUBSCRIBERS_MAX    (4)
+
+typedef struct _RL_EVENT_RECORD {
+    // Position of the record plus one. A record is only valid while this matches its position,
+    // so check it again after copying the record out.
+    LONG64 Sequence;
+    // In units of the performance counter of the host.
+    LONG64 Timestamp;
+    ULONG64 ProcessId;
+    ULONG64 ThreadId;
+    // The creation or exit status.
+    LONG Status;
+    USHORT Event;
+    USHORT Provider;
+} RL_EVENT_RECORD, *PRL_EVENT_RECORD;
+
+typedef struct _RL_EVENT_RING {
+    ULONG Capacity;
+    // Set to a non-zero value before waiting on the event. The driver clears it when signalling.
+    volatile LONG Waiting;
+    LONG64 Frequency;
+    // Next position to be written. Positions older than Head - Capacity have been overwritten.
+    volatile LONG64 Head;
+    RL_EVENT_RECORD Records[1];
+} RL_EVENT_RING, *PRL_EVENT_RING;
+
+// One subscription per reality file. It ends when the file is closed, but the view stays mapped
+// until the caller unmaps it with NtUnmapViewOfSection. Subscribing fails with
+// STATUS_QUOTA_EXCEEDED while RL_EVENT_SUBSCRIBERS_MAX subscriptions exist, or
+// RL_EVENT_PROCESS_SUBSCRIBERS_MAX made by the calling process.
+typedef struct _RL_EVENT_SUBSCRIBE {
+    SIZE_T Size;
+    // The number of records, a power of two no larger than RL_EVENT_RING_MAX.
+    ULONG Capacity;
+    // Optional auto-reset or notification event, signalled when records arrive while Waiting is
+    // set.
+    HANDLE Event;
+    // Set by the driver.
+    PRL_EVENT_RING Ring;
+} RL_EVENT_SUBSCRIBE, *PRL_EVENT_SUBSCRIBE;
+
+//
+// Counters page
+//
+
+// A read-only page of live counters, refreshed by the driver every 100 milliseconds. Readers
+// take no locks and make no calls:
+//
+//     do {
+//         seq = page->Sequence;   // retry while odd
+//         ... copy the fields ...
+//     } while (seq & 1 || seq != page->Sequence);
+//
+// Event counters only move while statistics are enabled, see RL_INSTRUMENT_STATISTICS.
+#define RL_INSTRUMENT_TRACE         (0x1)
+#define RL_INSTRUMENT_STATISTICS    (0x2)
+
+typedef struct _RL_COUNTERS_PAGE {
+    volatile LONG64 Sequence;
+    // In units of the performance counter of the host.
+    LONG64 Timestamp;
+    LONG64 Frequency;
+    ULONG Instrumentation;
+    ULONG ProvidersCount;
+    ULONG64 Events[RL_PROVIDER_MAX][RlTraceEventMaxCount];
+} RL_COUNTERS_PAGE, *PRL_COUNTERS_PAGE;
+
+// Every call maps a new view, which stays mapped until the caller unmaps it. Views are
+// read-only, and their protection cannot be changed. The page is refreshed while a handle that
+// mapped it stays open.
+typedef struct _RL_COUNTERS_MAP {
+    SIZE_T Size;
+    // Set by the driver.
+    const RL_COUNTERS_PAGE* Page;
+} RL_COUNTERS_MAP, *PRL_COUNTERS_MAP;
+
+//
+// Process statistics
+//
+
+#define RL_PROCESS_QUERY_MAX    (4096)
+
+// Counters are summed over all threads of the process, running or exited, and only move while
+// statistics are enabled.
+typedef struct _RL_PROCESS_INFORMATION {
+    ULONG64 ProcessId;
+    // The current provider, and the number of providers it is nested in.
+    ULONG Provider;
+    ULONG Depth;
+    ULONG64 SystemCalls;
+    // Time spent in the provider handling system calls, in units of the performance counter of
+    // the host.
+    ULONG64 SystemCallTime;
+    ULONG64 Exceptions;
+} RL_PROCESS_INFORMATION, *PRL_PROCESS_INFORMATION;
+
+typedef struct _RL_PROCESS_QUERY {
+    SIZE_T Size;
+    // A single process, or 0 for all Pico processes managed by lxmonika.
+    ULONG64 ProcessId;
+    // At most RL_PROCESS_QUERY_MAX.
+    SIZE_T Count;
+    PRL_PROCESS_INFORMATION Processes;
+    // Set by the driver.
+    SIZE_T Read;
+    SIZE_T Total;
+    LONG64 Frequency;
+} RL_PROCESS_QUERY, *PRL_PROCESS_QUERY;
+
+//
+// Self benchmark
+//
+
+// Only available when the SelfBenchmark DWORD in the service key is non-zero, as the device is
+// open to every user and a run can take all processors for a while.
+enum RlSelfBenchmarkPrimitives
+{
+    // Only the timing itself, to be taken out of the other results.
+    RlSelfBenchmarkNone,
+    // MapGetObjectContext on the calling thread, which only finds a context for Pico callers.
+    RlSelfBenchmarkGetObjectContext,
+    // MapAllocateContext followed by MapFreeContext, for the provider named by ProviderName.
+    RlSelfBenchmarkContextChurn,
+    // MaFindPicoProvider for ProviderName, registered or not.
+    RlSelfBenchmarkFindProvider,
+    // Formats the reality file of the worker.
+    RlSelfBenchmarkFileUpdate,
+    // Writes a warning to the driver log. Silence RlBenchmarkLog in reality.cpp through
+    // RlIoctlLogFilter to time the filtered path instead, which is counted in Failures.
+    RlSelfBenchmarkLog,
+    RlSelfBenchmarkMaxCount
+};
+
+#define RL_SELF_BENCHMARK_WORKERS_MAX   (64)
+// The product of Iterations and Workers, as every sample is kept for the percentiles.
+#define RL_SELF_BENCHMARK_SAMPLES_MAX   (1 << 22)
+
+// In cycles of the processor timestamp counter.
+typedef struct _RL_SELF_BENCHMARK_RESULT {
+    ULONG64 Samples;
+    // Iterations where the primitive failed. Still counted in the samples.
+    ULONG64 Failures;
+    ULONG64 Minimum;
+    ULONG64 Median;
+    ULONG64 P90;
+    ULONG64 P99;
+    ULONG64 P999;
+    ULONG64 Maximum;
+    ULONG64 Total;
+    // The processor the worker was pinned to, or 0 for the combined result.
+    ULONG Processor;
+} RL_SELF_BENCHMARK_RESULT, *PRL_SELF_BENCHMARK_RESULT;
+
+typedef struct _RL_SELF_BENCHMARK {
+    SIZE_T Size;
+    // One of RlSelfBenchmarkPrimitives.
+    ULONG Primitive;
+    // Pinned round-robin to the active processors. 0 for one per active processor, up to
+    // RL_SELF_BENCHMARK_WORKERS_MAX. Set by the driver to the number used.
+    ULONG Workers;
+    // Per worker.
+    ULONG64 Iterations;
+    // Null-terminated.
+    WCHAR ProviderName[RL_PROVIDER_NAME_SIZE];
+    // Set by the driver.
+    // The wall time of the whole run, in units of the performance counter of the host. Relates
+    // the cycles to time.
+    LONG64 Frequency;
+    LONG64 ElapsedTicks;
+    RL_SELF_BENCHMARK_RESULT Combined;
+    RL_SELF_BENCHMARK_RESULT PerWorker[RL_SELF_BENCHMARK_WORKERS_MAX];
+} RL_SELF_BENCHMARK, *PRL_SELF_BENCHMARK;
+
+//
+// Sampling profiler
+//
+
+#define RL_PROFILE_FREQUENCY_DEFAULT    (1000)
+#define RL_PROFILE_FREQUENCY_MAX        (1000)
+#define RL_PROFILE_PROCESSES_MAX        (16)
+// Frames kept per sample, including the program counter.
+#define RL_PROFILE_FRAMES_MAX           (32)
+
+// Flags of RL_PROFILE_CONTROL.
+// Also walks the user stack of each sample through the WalkUserStack routine of its provider.
+// The walk runs on the sampled thread once it leaves the interrupt, so each processor has one
+// such sample pending at most, and loses the samples taken meanwhile.
+#define RL_PROFILE_FLAG_USER_STACKS     (0x1)
+
+// Samples the Pico threads running on each processor at Frequency samples per second. Only one
+// profile runs at a time. Samples stay readable after the profile is stopped, until the next one
+// is started.
+// Only available when the Profiling DWORD in the service key is non-zero, as the device is open
+// to every user and samples show what the processes of others are running.
+typedef struct _RL_PROFILE_CONTROL {
+    SIZE_T Size;
+    BOOLEAN Enable;
+    // The fields below only apply when Enable is TRUE.
+    ULONG Flags;
+    // Per processor. 0 for RL_PROFILE_FREQUENCY_DEFAULT, up to RL_PROFILE_FREQUENCY_MAX. Set by
+    // the driver to the frequency used, which is rounded to whole milliseconds.
+    ULONG Frequency;
+    // A sample is kept when it matches every non-zero field.
+    // Bit i selects the provider at index i.
+    ULONG ProviderMask;
+    ULONG ProcessCount;
+    ULONG64 ProcessIds[RL_PROFILE_PROCESSES_MAX];
+    // Set by the driver when stopping. Starting while a profile runs fails instead.
+    BOOLEAN WasEnabled;
+} RL_PROFILE_CONTROL, *PRL_PROFILE_CONTROL;
+
+typedef struct _RL_PROFILE_SAMPLE {
+    // In units of the performance counter of the host.
+    LONG64 Timestamp;
+    ULONG64 ProcessId;
+    ULONG64 ThreadId;
+    USHORT Provider;
+    // At least 1, for the user program counter in Frames[0]. Callers follow, innermost first.
+    USHORT FrameCount;
+    ULONG Processor;
+    ULONG64 Frames[RL_PROFILE_FRAMES_MAX];
+} RL_PROFILE_SAMPLE, *PRL_PROFILE_SAMPLE;
+
+// Samples are ordered per processor only. Those with user stacks are queued on the processor
+// that finished the walk, so they may come after later samples.
+typedef struct _RL_PROFILE_READ {
+    SIZE_T Size;
+    SIZE_T Count;
+    PRL_PROFILE_SAMPLE Samples;
+    // Set by the driver.
+    SIZE_T Read;
+    // Samples dropped because the buffer of their processor was full, or because a user stack
+    // walk was still pending there.
+    SIZE_T Lost;
+} RL_PROFILE_READ, *PRL_PROFILE_READ;
@@ -53,3 +53,61 @@ public:
         }
     }
 };
+
+// Reader/writer lock backed by an EX_PUSH_LOCK.
+// Lock/Unlock take the lock exclusively, so this type can be used with Locker.
+// Zero-initialized instances are ready to use.
+class PushLock
+{
+private:
+    EX_PUSH_LOCK m_lock;
+
+public:
+    void Lock()
+    {
+        KeEnterCriticalRegion();
+        ExAcquirePushLockExclusiveEx(&m_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    }
+
+    void Unlock()
+    {
+        ExReleasePushLockExclusiveEx(&m_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+        KeLeaveCriticalRegion();
+    }
+
+    void LockShared()
+    {
+        KeEnterCriticalRegion();
+        ExAcquirePushLockSharedEx(&m_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    }
+
+    void UnlockShared()
+    {
+        ExReleasePushLockSharedEx(&m_lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+        KeLeaveCriticalRegion();
+    }
+};
+
+// Takes a PushLock shared, so that Locker can hold it for readers:
+//     SharedPushLock shared(&lock);
+//     Locker<SharedPushLock> locker(&shared);
+class SharedPushLock
+{
+private:
+    PushLock* m_lock;
+
+public:
+    SharedPushLock(PushLock* lock) : m_lock(lock)
+    {
+    }
+
+    void Lock()
+    {
+        m_lock->LockShared();
+    }
+
+    void Unlock()
+    {
+        m_lock->UnlockShared();
+    }
+};
@@ -8,7 +8,9 @@ enum class LogLevel
     Trace,
     Info,
     Warning,
-    Error
+    Error,
+    // Only used by filters, to silence everything.
+    None
 };
 
 #if DBG
@@ -17,44 +19,122 @@ enum class LogLevel
 #define LOGGER_MINIMUM_LEVEL (LogLevel::Warning)
 #endif
 
+// Messages are formatted on the caller's stack and committed as a single record to a
+// per-processor ring, so logging takes no locks and works at any IRQL.
+// The rings are flushed to DbgPrintEx by a DPC, and can be read through the reality device.
+#define LOGGER_MESSAGE_SIZE (256)
+// Records kept per processor. Must be a power of two.
+#define LOGGER_RING_SIZE    (64)
+
+#define LOGGER_FILTER_MAX       (16)
+#define LOGGER_FILTER_NAME_SIZE (32)
+
+// Sets the minimum level of the messages from matching files and functions.
+// An empty name matches everything, and a name ending with '*' matches by prefix. File names are
+// compared case-insensitively, without their directories.
+// The first matching filter wins. Messages matching no filter use the default level.
+struct LogFilter
+{
+    char File[LOGGER_FILTER_NAME_SIZE];
+    char Function[LOGGER_FILTER_NAME_SIZE];
+    LogLevel Level;
+};
+
 class Logger
 {
 private:
-    static LONG _Initialized;
-    static FAST_MUTEX _Mutex;
+    struct _Message
+    {
+        SIZE_T Length;
+        char Buffer[LOGGER_MESSAGE_SIZE];
+    };
+
+    struct _Record;
+    struct _Ring;
+
+    static _Ring* volatile _Rings;
+    static ULONG _RingsCount;
+    static volatile LONG64 _Sequence;
+    static KDPC _FlushDpc;
+    static volatile LONG _Flushing;
+    static volatile LONG _FlushRequested;
+
+    // The lowest level let through by the default level or any filter.
+    // Checked before anything else, so that disabled messages cost a single comparison.
+    static volatile LONG _Level;
+    static LogLevel _DefaultLevel;
+    static LogFilter _Filters[LOGGER_FILTER_MAX];
+    static ULONG _FiltersCount;
+    // Odd while the filters are being changed.
+    static volatile LONG _FiltersVersion;
 
     template <typename TFirst, typename... TRest>
-    static void _Print(TFirst first, TRest... args)
+    static void _Print(_Message& message, TFirst first, TRest... args)
     {
-        _Print(first);
-        _Print(args...);
+        _Print(message, first);
+        _Print(message, args...);
     }
 
-    static void _Print() {}
+    static void _Print(_Message& message) { UNREFERENCED_PARAMETER(message); }
 
-    static void _Print(bool b);
+    static void _Print(_Message& message, bool b);
 
-    static void _Print(WORD w);
-    static void _Print(DWORD dw);
-    static void _Print(ULONGLONG ull);
+    static void _Print(_Message& message, WORD w);
+    static void _Print(_Message& message, DWORD dw);
+    static void _Print(_Message& message, ULONGLONG ull);
 
-    static void _Print(INT i);
-    static void _Print(UINT ui);
+    static void _Print(_Message& message, INT i);
+    static void _Print(_Message& message, UINT ui);
 
-    static void _Print(PSTR pStr);
-    static void _Print(PCSTR pcStr);
-    static void _Print(PUCHAR pcuStr);
+    static void _Print(_Message& message, PSTR pStr);
+    static void _Print(_Message& message, PCSTR pcStr);
+    static void _Print(_Message& message, PUCHAR pcuStr);
 
-    static void _Print(PVOID p);
+    static void _Print(_Message& message, PVOID p);
     template <typename T>
-    static void _Print(T* ptr) { _Print((PVOID)ptr); }
+    static void _Print(_Message& message, T* ptr) { _Print(message, (PVOID)ptr); }
     template <typename T>
-    static void _Print(const T* ptr) { _Print((PVOID)ptr); }
+    static void _Print(_Message& message, const T* ptr) { _Print(message, (PVOID)ptr); }
+
+    static void _Append(_Message& message, const char* format, ...);
+
+    static bool _IsEnabled(LogLevel level, const char* file, const char* function);
 
-    static void _Lock();
-    static void _Unlock();
+    static bool _Begin(_Message& message, LogLevel level, const char* file, int line,
+        const char* function);
+    static void _Commit(_Message& message);
+
+    static void _Drain(_Ring* rings);
+    static void _Flush(PKDPC dpc, PVOID context, PVOID argument1, PVOID argument2);
 public:
-    static bool _Log(LogLevel level, const char* file, int line, const char* function);
+    // Until Initialize succeeds, and after Cleanup, messages go straight to DbgPrintEx.
+    static NTSTATUS Initialize();
+    static void Cleanup();
+
+    // Replaces all filters. Fails if count exceeds LOGGER_FILTER_MAX.
+    static NTSTATUS SetFilters(LogLevel defaultLevel, const LogFilter* filters, ULONG count);
+    static void QueryFilters(LogLevel* defaultLevel, LogFilter* filters, ULONG* count);
+
+    // Reads the filters from the LogLevel (REG_DWORD) and LogFilters (REG_MULTI_SZ, with entries
+    // like "file.cpp:function=level") values of the driver's service key.
+    static NTSTATUS LoadFilters(PCUNICODE_STRING registryPath);
+
+    // Copies the messages numbered from *sequence onwards, oldest first, as lines of text.
+    // Does not consume them. Sets *sequence past the last message copied.
+    static SIZE_T Read(ULONG64* sequence, char* buffer, SIZE_T length);
+
+    static consteval const char* _BaseName(const char* path)
+    {
+        const char* name = path;
+        for (const char* p = path; *p != '\0'; ++p)
+        {
+            if (*p == '\\' || *p == '/')
+            {
+                name = p + 1;
+            }
+        }
+        return name;
+    }
 
     template <LogLevel level, typename... TRest>
     static bool _Log(const char* file, int line, const char* function,
@@ -69,48 +149,55 @@ public:
         }
         else
         {
-            if (!_Log(level, file, line, function))
+            if ((LONG)level < _Level)
+            {
+                return false;
+            }
+
+            _Message message;
+
+            if (!_Begin(message, level, file, line, function))
             {
                 return false;
             }
 
-            _Print(args...);
-            _Print("\n");
+            _Print(message, args...);
+            _Print(message, "\n");
 
-            _Unlock();
+            _Commit(message);
             return true;
         }
     }
 };
 
-#define LogTrace(...)           \
-    _Log<LogLevel::Trace>(      \
-        __FILE__,               \
-        __LINE__,               \
-        __func__,               \
-        __VA_ARGS__             \
+#define LogTrace(...)                   \
+    _Log<LogLevel::Trace>(              \
+        Logger::_BaseName(__FILE__),    \
+        __LINE__,                       \
+        __func__,                       \
+        __VA_ARGS__                     \
     )
 
-#define LogInfo(...)            \
-    _Log<LogLevel::Info>(       \
-        __FILE__,               \
-        __LINE__,               \
-        __func__,               \
-        __VA_ARGS__             \
+#define LogInfo(...)                    \
+    _Log<LogLevel::Info>(               \
+        Logger::_BaseName(__FILE__),    \
+        __LINE__,                       \
+        __func__,                       \
+        __VA_ARGS__                     \
     )
 
-#define LogWarning(...)         \
-    _Log<LogLevel::Warning>(    \
-        __FILE__,               \
-        __LINE__,               \
-        __func__,               \
-        __VA_ARGS__             \
+#define LogWarning(...)                 \
+    _Log<LogLevel::Warning>(            \
+        Logger::_BaseName(__FILE__),    \
+        __LINE__,                       \
+        __func__,                       \
+        __VA_ARGS__                     \
     )
 
-#define LogError(...)           \
-    _Log<LogLevel::Error>(      \
-        __FILE__,               \
-        __LINE__,               \
-        __func__,               \
-        __VA_ARGS__             \
+#define LogError(...)                   \
+    _Log<LogLevel::Error>(              \
+        Logger::_BaseName(__FILE__),    \
+        __LINE__,                       \
+        __func__,                       \
+        __VA_ARGS__                     \
     )
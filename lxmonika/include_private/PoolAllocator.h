@@ -3,18 +3,48 @@
 #include <ntddk.h>
 #include <intsafe.h>
 
+// Owns one or more pool chunks, freed together on destruction.
+//
+// Constructed with a size, it holds a single block of that size, returned by Get().
+// Allocate() carves further blocks out of the current chunk, and chains a new chunk whenever the
+// current one runs out. Blocks are never freed individually.
 class PoolAllocator
 {
 private:
+    struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) Chunk
+    {
+        Chunk* Next;
+        SIZE_T Size;
+    };
+
+    static constexpr SIZE_T DefaultChunkSize = PAGE_SIZE - sizeof(Chunk);
+
+    // Most recent first.
+    Chunk* m_chunks = NULL;
     PVOID m_ptr = NULL;
-    ULONG m_tag;
+    PUCHAR m_cursor = NULL;
+    PUCHAR m_limit = NULL;
+    SIZE_T m_chunkSize = DefaultChunkSize;
+    POOL_TYPE m_poolType = PagedPool;
+    ULONG m_tag = 'PALL';
+
+    PVOID AllocateChunk(SIZE_T size);
+    VOID Release();
 public:
     PoolAllocator() = default;
     PoolAllocator(POOL_TYPE poolType, SIZE_T size, ULONG tag = 'PALL');
     PoolAllocator(SIZE_T size, ULONG tag = 'PALL');
     PoolAllocator(const PoolAllocator&) = delete;
+    PoolAllocator(PoolAllocator&& other);
     ~PoolAllocator();
 
+    PoolAllocator& operator=(const PoolAllocator&) = delete;
+    PoolAllocator& operator=(PoolAllocator&& other);
+
+    // An empty allocator that only allocates through Allocate(), chunkSize bytes at a time.
+    static PoolAllocator Arena(SIZE_T chunkSize = DefaultChunkSize, ULONG tag = 'PALL',
+        POOL_TYPE poolType = PagedPool);
+
     template <typename T>
     T* Get() const
     {
@@ -25,4 +55,18 @@ public:
     {
         return m_ptr;
     }
+
+    // Returns NULL when out of memory. Blocks larger than the chunk size get a chunk of their
+    // own, without giving up the space left in the current one.
+    PVOID Allocate(SIZE_T size, SIZE_T alignment = MEMORY_ALLOCATION_ALIGNMENT);
+
+    template <typename T>
+    T* Allocate(SIZE_T count = 1)
+    {
+        if (count > MAXSIZE_T / sizeof(T))
+        {
+            return NULL;
+        }
+        return (T*)Allocate(count * sizeof(T), alignof(T));
+    }
 };
@@ -4,6 +4,39 @@
 //
 // Compatibility definitions.
 
+#ifdef MA_HOST
+
+//
+// User-mode builds
+//
+// The kernel-neutral sources, such as module_image.cpp, are also built for user mode by lxbench.
+// This provides what they would otherwise get from the WDK headers.
+
+#define WIN32_NO_STATUS
+#include <Windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <winternl.h>
+
+#include <string.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C"
+#endif
+NTSYSAPI
+LONG
+NTAPI
+RtlCompareUnicodeStrings(
+    _In_reads_(String1Length) PCWCH String1,
+    _In_ SIZE_T String1Length,
+    _In_reads_(String2Length) PCWCH String2,
+    _In_ SIZE_T String2Length,
+    _In_ BOOLEAN CaseInSensitive
+);
+
+#else
+
 //
 // Enclave ID definitions
 //
@@ -28,3 +61,5 @@ typedef struct _KADDRESS_RANGE_DESCRIPTOR
     KADDRESS_RANGE_DESCRIPTOR, *PKADDRESS_RANGE_DESCRIPTOR;
 
 typedef enum _SUBSYSTEM_INFORMATION_TYPE SUBSYSTEM_INFORMATION_TYPE;
+
+#endif
@@ -46,6 +46,28 @@ extern "C"
             _Out_opt_ PHANDLE pHdlOutput
         );
 
+    // Issues ConsolepGetMode for hdlObject, an input or output handle opened from hdlConsole.
+    NTSTATUS
+        CdpKernelConsoleGetMode(
+            _In_ HANDLE hdlConsole,
+            _In_ HANDLE hdlObject,
+            _Out_ PULONG pMode
+        );
+
+    // Returns new kernel handles to the console of pHostProcess and to its standard input and
+    // output. The console is attached and its handles opened only once per host process, and
+    // kept until that process exits.
+    NTSTATUS
+        CdpGetHostConsole(
+            _In_ PEPROCESS pHostProcess,
+            _Out_opt_ PHANDLE pHdlConsole,
+            _Out_opt_ PHANDLE pHdlInput,
+            _Out_opt_ PHANDLE pHdlOutput
+        );
+
+    VOID
+        CdpCleanupConsoleBroker();
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,6 +2,7 @@
 
 #include <ntifs.h>
 
+#include "module_image.h"
 #include "winresource.h"
 
 // module.h
@@ -13,37 +14,18 @@ extern "C"
 {
 #endif
 
-NTSTATUS
-    MdlpFindModuleByName(
-        _In_ PCSTR pModuleName,
-        _Out_ PHANDLE pHandle,
-        _Out_opt_ PSIZE_T puSize
-    );
-
-// MdlpFindModuleSectionByName
+// MdlpTakeModuleSnapshot
 //
-// Finds the PE section with the name pSectionName of the module specified in hdl.
+// Captures the list of loaded modules once, so that MdlpFindModuleByName and
+// MdlpGetProductVersion can answer from it until MdlpReleaseModuleSnapshot is called.
 //
-// The start of the section will be placed in pSection.
-//
-// If puSize is not NULL, it will be interpreted as the size of the PE module.
-// 0 means the size is not specified.
-//
-// If puSize is not NULL, the size of the section will be placed in puSize.
+// Not synchronized, only call this and the functions above from sequential code such as
+// DriverEntry.
 NTSTATUS
-    MdlpFindModuleSectionByName(
-        _In_ HANDLE hdl,
-        _In_ PCSTR pSectionName,
-        _Out_ PVOID* pSection,
-        _Inout_opt_ PSIZE_T puSize
-    );
+    MdlpTakeModuleSnapshot();
 
-NTSTATUS
-    MdlpGetProcAddress(
-        _In_ HANDLE hModule,
-        _In_ PCSTR  lpProcName,
-        _Out_ PVOID* pProc
-    );
+VOID
+    MdlpReleaseModuleSnapshot();
 
 NTSTATUS
     MdlpGetProductVersion(
@@ -52,6 +34,18 @@ NTSTATUS
         _Inout_opt_ PSIZE_T puSize
     );
 
+// MdlpGetImageCheckSum
+//
+// Reads the checksum from the PE optional header, which changes with every rebuild of the image.
+//
+// If uSize is not 0, it is the size of the PE module.
+NTSTATUS
+    MdlpGetImageCheckSum(
+        _In_ HANDLE hModule,
+        _In_ SIZE_T uSize,
+        _Out_ PULONG puCheckSum
+    );
+
 // MdlpPatchImport
 //
 // Patches the target PE module's Import Address Table.
@@ -63,6 +57,9 @@ NTSTATUS
         _Inout_ PVOID* pImportValue
     );
 
+// MdlpPatchTrampoline
+//
+// Patches a single trampoline, as a patch set of its own.
 NTSTATUS
     MdlpPatchTrampoline(
         _In_ PVOID pOriginal,
@@ -83,6 +80,67 @@ NTSTATUS
 #error Define Trampoline size!
 #endif
 
+//
+// Patch sets
+//
+
+#define MDL_PATCH_SET_MAX       8
+#define MDL_PATCH_BYTES_MAX     16
+
+typedef struct _MDL_PATCH {
+    PVOID Address;
+    SIZE_T Size;
+    UCHAR Bytes[MDL_PATCH_BYTES_MAX];
+    // Captured by MdlpApplyPatchSet.
+    UCHAR Original[MDL_PATCH_BYTES_MAX];
+} MDL_PATCH, *PMDL_PATCH;
+
+// A zero-initialized set is empty.
+typedef struct _MDL_PATCH_SET {
+    SIZE_T Count;
+    BOOLEAN Applied;
+    MDL_PATCH Patches[MDL_PATCH_SET_MAX];
+} MDL_PATCH_SET, *PMDL_PATCH_SET;
+
+// MdlpAddPatch
+//
+// Queues a write of szBytes bytes to pAddress. Nothing is written until MdlpApplyPatchSet.
+NTSTATUS
+    MdlpAddPatch(
+        _Inout_ PMDL_PATCH_SET pSet,
+        _In_ PVOID pAddress,
+        _In_reads_bytes_(szBytes) const VOID* pBytes,
+        _In_ SIZE_T szBytes
+    );
+
+// MdlpAddTrampolinePatch
+//
+// Queues a trampoline from pOriginal to pHook.
+NTSTATUS
+    MdlpAddTrampolinePatch(
+        _Inout_ PMDL_PATCH_SET pSet,
+        _In_ PVOID pOriginal,
+        _In_ PVOID pHook
+    );
+
+// MdlpApplyPatchSet
+//
+// Maps every page touched by the set once, then writes all patches and flushes the instruction
+// cache once. If any page cannot be mapped, nothing is written.
+NTSTATUS
+    MdlpApplyPatchSet(
+        _Inout_ PMDL_PATCH_SET pSet
+    );
+
+// MdlpRevertPatchSet
+//
+// Restores the original bytes of every patch in an applied set. Nothing is restored if any page
+// cannot be mapped, or if any patch has since been overwritten by someone else.
+NTSTATUS
+    MdlpRevertPatchSet(
+        _Inout_ PMDL_PATCH_SET pSet
+    );
+
 #ifdef __cplusplus
 }
 #endif
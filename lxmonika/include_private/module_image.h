@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef MA_HOST
+#include <ntifs.h>
+#endif
+
+#include "compat.h"
+
+// module_image.h
+//
+// PE image parsing functions.
+//
+// These only read the image they are given, so they also build for user mode with MA_HOST
+// defined, against images mapped by the host.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// MdlpFindModuleByName
+//
+// Finds a loaded module by its file name, such as "ntoskrnl.exe".
+//
+// Implemented by module.cpp in the driver. User-mode builds provide their own, which
+// MdlpGetProcAddress calls to follow forwarders.
+NTSTATUS
+    MdlpFindModuleByName(
+        _In_ PCSTR pModuleName,
+        _Out_ PHANDLE pHandle,
+        _Out_opt_ PSIZE_T puSize
+    );
+
+// MdlpFindModuleSectionByName
+//
+// Finds the PE section with the name pSectionName of the module specified in hdl.
+//
+// The start of the section will be placed in pSection.
+//
+// If puSize is not NULL, it will be interpreted as the size of the PE module.
+// 0 means the size is not specified.
+//
+// If puSize is not NULL, the size of the section will be placed in puSize.
+NTSTATUS
+    MdlpFindModuleSectionByName(
+        _In_ HANDLE hdl,
+        _In_ PCSTR pSectionName,
+        _Out_ PVOID* pSection,
+        _Inout_opt_ PSIZE_T puSize
+    );
+
+// MDL_ORDINAL
+//
+// Passed as lpProcName to MdlpGetProcAddress to look up an export by ordinal.
+#define MDL_ORDINAL(ordinal)    ((PCSTR)(ULONG_PTR)(WORD)(ordinal))
+
+// MdlpGetProcAddress
+//
+// Finds an export of the PE module by name or by MDL_ORDINAL.
+//
+// Forwarded exports are followed to the target module, which must already be loaded.
+NTSTATUS
+    MdlpGetProcAddress(
+        _In_ HANDLE hModule,
+        _In_ PCSTR  lpProcName,
+        _Out_ PVOID* pProc
+    );
+
+typedef struct _MDL_PROC {
+    PCSTR Name;
+    // Receives the export, or NULL if it has not been found.
+    PVOID* Proc;
+} MDL_PROC, *PMDL_PROC;
+
+// MdlpGetProcAddresses
+//
+// Like MdlpGetProcAddress, but reads the export directory once for all entries of pProcs.
+//
+// Returns STATUS_NOT_FOUND if any of the exports has not been found, the others are still
+// resolved.
+NTSTATUS
+    MdlpGetProcAddresses(
+        _In_ HANDLE hModule,
+        _Inout_updates_(uCount) PMDL_PROC pProcs,
+        _In_ SIZE_T uCount
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#ifndef MA_HOST
+#include <ntifs.h>
+#endif
+
+#include "compat.h"
+
+// monika_names.h
+//
+// Matching of Pico provider names.
+//
+// Kernel-neutral, also built for user mode with MA_HOST defined.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _MA_PROVIDER_NAME_ENTRY {
+    SIZE_T                  Index;
+    // Copy of the reported name, allocated with MA_PROVIDER_NAME_TAG.
+    UNICODE_STRING          Name;
+} MA_PROVIDER_NAME_ENTRY, *PMA_PROVIDER_NAME_ENTRY;
+
+// MapMatchProviderName
+//
+// Finds the entry sharing the longest prefix with ProviderName, the rules
+// MaFindPicoProvider documents. Entries must be sorted by name.
+BOOLEAN
+    MapMatchProviderName(
+        _In_reads_(Count) const MA_PROVIDER_NAME_ENTRY* Entries,
+        _In_ SIZE_T Count,
+        _In_ PCWSTR ProviderName,
+        _Out_ PSIZE_T Index
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,6 +24,14 @@ NTSTATUS
 VOID
     MapCleanup();
 
+/// <summary>
+/// Reads optional settings from the service key. Missing values keep their defaults.
+/// </summary>
+NTSTATUS
+    MapLoadOptions(
+        _In_ PCUNICODE_STRING RegistryPath
+    );
+
 //
 // Monika LXSS hooks
 //
@@ -39,11 +47,6 @@ NTSTATUS
 VOID
     MapLxssCleanup();
 
-VOID
-    MapLxssSystemCallHook(
-        _In_ PPS_PICO_SYSTEM_CALL_INFORMATION pSyscallInfo
-    );
-
 NTSTATUS
     MapLxssGetAllocatedProviderName(
         _Outptr_ PUNICODE_STRING* pOutProviderName
@@ -57,6 +60,21 @@ NTSTATUS
         _Out_opt_ PHANDLE Output
     );
 
+/// <summary>
+/// Informs the LXSS direct wiring logic that a context for <paramref name="Provider"/> has been
+/// created. When the provider is not lxcore, the lxmonika dispatcher is wired back in before
+/// this function returns.
+/// </summary>
+VOID
+    MapLxssContextAttached(
+        _In_ DWORD Provider
+    );
+
+VOID
+    MapLxssContextDetached(
+        _In_ DWORD Provider
+    );
+
 //
 // Monika Pico provider callbacks
 //
@@ -105,25 +123,224 @@ NTSTATUS
         _Outptr_ PUNICODE_STRING* ImageName
     );
 
+typedef struct _MA_DISPATCH_STATISTICS {
+    // Exceptions on Pico threads.
+    ULONG64                 ExceptionsThread;
+    // Exceptions on foreign threads attached to Pico processes.
+    ULONG64                 ExceptionsAttached;
+    // Exceptions passed to the original provider routines.
+    ULONG64                 ExceptionsUnowned;
+} MA_DISPATCH_STATISTICS, *PMA_DISPATCH_STATISTICS;
+
+VOID
+    MapQueryDispatchStatistics(
+        _Out_ PMA_DISPATCH_STATISTICS Statistics
+    );
+
 //
 // Monika-managed context
 //
 
 #define MA_CONTEXT_MAGIC ('moni')
 
+// Image names up to this many characters do not need a separate pool allocation.
+#define MA_CONTEXT_INLINE_NAME_LENGTH (64)
+
+// Shared between a process context and the contexts of all its threads.
+typedef struct _MA_IMAGE_NAME {
+    SIZE_T                  ReferenceCount;
+    // Points to Name for copied names. Lazy names start out NULL and are published with an
+    // interlocked exchange the first time they are needed, see MapGetImageName.
+    PUNICODE_STRING volatile ResolvedName;
+    // Referenced image file of lazy names, NULL for copied names.
+    PFILE_OBJECT            FileObject;
+    UNICODE_STRING          Name;
+    WCHAR                   Buffer[MA_CONTEXT_INLINE_NAME_LENGTH];
+} MA_IMAGE_NAME, *PMA_IMAGE_NAME;
+
+/// <summary>
+/// Returns the name of the image, querying it from the image file object on first use.
+/// Must be called at PASSIVE_LEVEL. Returns NULL if a lazy name cannot be resolved.
+/// </summary>
+PCUNICODE_STRING
+    MapGetImageName(
+        _In_ PMA_IMAGE_NAME ImageName
+    );
+
+// A provider that a context has been switched away from by MapPushContext.
+typedef struct _MA_CONTEXT_FRAME {
+    DWORD                                   Provider;
+    PVOID                                   Context;
+    PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH  DispatchSystemCall;
+    PMA_IMAGE_NAME                          ImageFileName;
+} MA_CONTEXT_FRAME, *PMA_CONTEXT_FRAME;
+
+// Number of parent providers stored inside the context itself.
+// Deeper nesting moves the frames past this depth into a separate allocation.
+#define MA_CONTEXT_INLINE_DEPTH (2)
+
 typedef struct _MA_CONTEXT {
-    ULONG                   Magic;
-    DWORD                   Provider;
-    PVOID                   Context;
-    UNICODE_STRING          ImageFileName;
-    struct _MA_CONTEXT*     Parent;
+    ULONG                                   Magic;
+    // The current provider. Parents are kept in the frames below.
+    DWORD                                   Provider;
+    PVOID                                   Context;
+    // Resolved when the context is allocated, so that the system call path
+    // does not need to index MapProviderRoutines.
+    PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH  DispatchSystemCall;
+    PMA_IMAGE_NAME                          ImageFileName;
+    // Number of parent frames, see MapGetContextParent.
+    ULONG                                   Depth;
+    ULONG                                   OverflowCapacity;
+    MA_CONTEXT_FRAME                        InlineFrames[MA_CONTEXT_INLINE_DEPTH];
+    PMA_CONTEXT_FRAME                       OverflowFrames;
+    // Only used once the context is queued by MapFreeContextDeferred.
+    SLIST_ENTRY                             FreeListEntry;
+    // Links process contexts into the process table, and thread contexts into the Threads of
+    // their ProcessContext. See MapLinkProcessContext and MapLinkThreadContext.
+    LIST_ENTRY                              ProcessLink;
+    ULONG64                                 ProcessId;
+    // Only used by process contexts.
+    LIST_ENTRY                              Threads;
+    // Only used by thread contexts, NULL once unlinked.
+    struct _MA_CONTEXT*                     ProcessContext;
+    // Only used by thread contexts. Number of parent frames the system call running on the
+    // thread has been forwarded through, see MapForwardSystemCall.
+    ULONG                                   ForwardDepth;
+    // Counted while statistics are enabled. A thread context is only written by its own thread,
+    // without atomics, and is added to its process context when it is unlinked. Process contexts
+    // also count the exceptions of threads attached to the process.
+    // SystemCallTime is in performance counter ticks.
+    volatile LONG64                         SystemCalls;
+    volatile LONG64                         SystemCallTime;
+    volatile LONG64                         Exceptions;
 } MA_CONTEXT, *PMA_CONTEXT;
 
+/// <summary>
+/// Returns the parent frame <paramref name="Level"/> levels above the current provider, starting
+/// with 0 for the direct parent, or NULL if the context is not nested that deep.
+/// </summary>
+FORCEINLINE
+PMA_CONTEXT_FRAME
+MapGetContextParent(
+    _In_ PMA_CONTEXT Context,
+    _In_ ULONG Level
+)
+{
+    if (Level >= Context->Depth)
+    {
+        return NULL;
+    }
+
+    // Frames are stored bottom up, the direct parent is the last one pushed.
+    ULONG ulFrame = Context->Depth - 1 - Level;
+
+    if (ulFrame < MA_CONTEXT_INLINE_DEPTH)
+    {
+        return &Context->InlineFrames[ulFrame];
+    }
+
+    return &Context->OverflowFrames[ulFrame - MA_CONTEXT_INLINE_DEPTH];
+}
+
+// Maximum number of context chains waiting to be freed. Exits past that are freed inline.
+#define MA_CONTEXT_DEFERRED_FREE_MAX (4096)
+
+typedef struct _MA_CONTEXT_STATISTICS {
+    SIZE_T                  TotalAllocates;
+    SIZE_T                  AllocateMisses;
+    SIZE_T                  LongImageNames;
+    SIZE_T                  DeferredFrees;
+    SIZE_T                  DeferredOverflows;
+    SIZE_T                  DeferredBatches;
+    // Allocations served by the per-processor context caches.
+    SIZE_T                  CacheHits;
+    // Thread contexts created by MapAllocateThreadContext.
+    SIZE_T                  ThreadInherits;
+} MA_CONTEXT_STATISTICS, *PMA_CONTEXT_STATISTICS;
+
+NTSTATUS
+    MapInitializeContextAllocator();
+
+VOID
+    MapCleanupContextAllocator();
+
+VOID
+    MapQueryContextStatistics(
+        _Out_ PMA_CONTEXT_STATISTICS Statistics
+    );
+
+typedef struct _MA_PROCESS_INFORMATION {
+    ULONG64                 ProcessId;
+    DWORD                   Provider;
+    ULONG                   Depth;
+    ULONG64                 SystemCalls;
+    ULONG64                 SystemCallTime;
+    ULONG64                 Exceptions;
+} MA_PROCESS_INFORMATION, *PMA_PROCESS_INFORMATION;
+
+/// <summary>
+/// Adds a process context to the process table. Its ProcessId is filled in by the caller once
+/// the process exists, and it stays 0 until then.
+/// </summary>
+VOID
+    MapLinkProcessContext(
+        _Inout_ PMA_CONTEXT Context
+    );
+
+/// <summary>
+/// Adds a thread context to the threads of <paramref name="ProcessContext"/>, so that process
+/// queries see its counters while it runs.
+/// </summary>
+VOID
+    MapLinkThreadContext(
+        _Inout_ PMA_CONTEXT Context,
+        _Inout_ PMA_CONTEXT ProcessContext
+    );
+
+/// <summary>
+/// Removes a process context from the process table, or a thread context from its process after
+/// adding its counters to the process, if it is linked. Called when the context is detached from
+/// its providers.
+/// </summary>
+VOID
+    MapUnlinkProcessContext(
+        _Inout_ PMA_CONTEXT Context
+    );
+
+/// <summary>
+/// Copies up to <paramref name="Count"/> entries of the process table, or only the entry of
+/// <paramref name="ProcessId"/> if it is not NULL. <paramref name="Total"/> receives the number
+/// of matching processes.
+/// </summary>
+VOID
+    MapQueryProcesses(
+        _In_opt_ HANDLE ProcessId,
+        _Out_writes_to_(Count, *Read) PMA_PROCESS_INFORMATION Processes,
+        _In_ SIZE_T Count,
+        _Out_ PSIZE_T Read,
+        _Out_ PSIZE_T Total
+    );
+
+/// <summary>
+/// Allocates a new context. If <paramref name="OwnerContext"/> is specified, the new context
+/// shares its image name instead of copying the one in <paramref name="CreateInfo"/>.
+/// </summary>
 PMA_CONTEXT
     MapAllocateContext(
         _In_ DWORD Provider,
         _In_opt_ PVOID OriginalContext,
-        _In_opt_ PPS_PICO_CREATE_INFO CreateInfo
+        _In_opt_ PPS_PICO_CREATE_INFO CreateInfo,
+        _In_opt_ PMA_CONTEXT OwnerContext
+    );
+
+/// <summary>
+/// Allocates a thread context that inherits the provider, dispatcher and image name of
+/// <paramref name="ProcessContext"/>, which must be the current context of the host process.
+/// </summary>
+PMA_CONTEXT
+    MapAllocateThreadContext(
+        _In_ PMA_CONTEXT ProcessContext,
+        _In_opt_ PVOID OriginalContext
     );
 
 VOID
@@ -132,18 +349,29 @@ VOID
     );
 
 /// <summary>
-/// Sets <paramref name="CurrentContext"/> as the parent of <paramref name="NewContext"/>,
-/// then swaps the contents of the two pointed structs.
+/// Detaches <paramref name="Context"/> and its parents from their providers immediately, but
+/// leaves freeing their memory to a system worker thread that frees exited contexts in batches.
+/// </summary>
+VOID
+    MapFreeContextDeferred(
+        _In_ PMA_CONTEXT Context
+    );
+
+/// <summary>
+/// Saves the current provider of <paramref name="CurrentContext"/> as a parent frame and switches
+/// the context to <paramref name="Provider"/>, keeping the image name.
+/// Only allocates when nesting deeper than MA_CONTEXT_INLINE_DEPTH.
 /// </summary>
 NTSTATUS
     MapPushContext(
         _Inout_ PMA_CONTEXT CurrentContext,
-        _In_ PMA_CONTEXT NewContext
+        _In_ DWORD Provider,
+        _In_opt_ PVOID OriginalContext
     );
 
 /// <summary>
-/// Sets <paramref name="CurrentContext"/> to the contents of its own parent,
-/// then destorys the parent's memory.
+/// Detaches <paramref name="CurrentContext"/> from its current provider and switches it back to
+/// its direct parent.
 /// </summary>
 NTSTATUS
     MapPopContext(
@@ -154,30 +382,689 @@ NTSTATUS
 // Monika provider-specific callbacks
 //
 
+// Number of provider slots. Override with /DMA_PICO_PROVIDER_MAX_COUNT=n, up to 32 since the
+// trace and profile filters have one bit per provider. A slot only costs a pointer until a
+// provider registers in it.
+#ifndef MA_PICO_PROVIDER_MAX_COUNT
+#define MA_PICO_PROVIDER_MAX_COUNT      (16)
+#endif
+
+// Room for providers in the layouts shared with user mode through the reality device. Slots past
+// it work, but do not show up in the statistics or the counters page.
+#define MA_PICO_PROVIDER_REPORTED_MAX   (16)
+
 enum
 {
-#define MONIKA_PROVIDER(index) MaPicoProvider##index = index,
-#include "monika_providers.cpp"
-#undef MONIKA_PROVIDER
-    MaPicoProviderMaxCount
+    MaPicoProviderMaxCount = MA_PICO_PROVIDER_MAX_COUNT,
+    MaPicoProviderReportedCount = min(MA_PICO_PROVIDER_MAX_COUNT, MA_PICO_PROVIDER_REPORTED_MAX)
 };
 
-#define MONIKA_PROVIDER(index)                                                          \
-    extern PS_PICO_CREATE_PROCESS               MaPicoCreateProcess##index;             \
-    extern PS_PICO_CREATE_PROCESS_TH1           MaPicoCreateProcessTh1##index;          \
-    extern PS_PICO_CREATE_THREAD                MaPicoCreateThread##index;              \
-    extern PS_PICO_CREATE_THREAD_TH1            MaPicoCreateThreadTh1##index;           \
-    extern PS_PICO_GET_PROCESS_CONTEXT          MaPicoGetProcessContext##index;         \
-    extern PS_PICO_GET_THREAD_CONTEXT           MaPicoGetThreadContext##index;          \
-    extern PS_PICO_SET_THREAD_DESCRIPTOR_BASE   MaPicoSetThreadDescriptorBase##index;   \
-    extern PS_PICO_TERMINATE_PROCESS            MaPicoTerminateProcess##index;          \
-    extern PS_SET_CONTEXT_THREAD_INTERNAL       MaPicoSetContextThreadInternal##index;  \
-    extern PS_GET_CONTEXT_THREAD_INTERNAL       MaPicoGetContextThreadInternal##index;  \
-    extern PS_TERMINATE_THREAD                  MaPicoTerminateThread##index;           \
-    extern PS_SUSPEND_THREAD                    MaPicoSuspendThread##index;             \
-    extern PS_RESUME_THREAD                     MaPicoResumeThread##index;
-#include "monika_providers.cpp"
-#undef MONIKA_PROVIDER
+//
+// Monika system call filtering
+//
+
+// Covers every Linux system call number on all supported architectures.
+#define MA_SYSTEM_CALL_MAX              (512)
+// Maximum number of hooks that may be chained on a single system call.
+#define MA_SYSTEM_CALL_HOOK_MAX_DEPTH   (4)
+
+#ifdef _M_X64
+#define MA_SYSTEM_CALL_NUMBER(info)     ((ULONG_PTR)(info)->TrapFrame->Rax)
+#elif defined(_M_ARM64)
+#define MA_SYSTEM_CALL_NUMBER(info)     ((ULONG_PTR)(info)->TrapFrame->X8)
+#elif defined(_M_IX86)
+#define MA_SYSTEM_CALL_NUMBER(info)     ((ULONG_PTR)(info)->TrapFrame->Eax)
+#elif defined(_M_ARM)
+#define MA_SYSTEM_CALL_NUMBER(info)     ((ULONG_PTR)(info)->R7)
+#else
+#error Detect the system call number for this architecture!
+#endif
+
+#ifdef _M_X64
+#define MA_SYSTEM_CALL_RESULT(info)     ((ULONG_PTR)(info)->TrapFrame->Rax)
+#elif defined(_M_ARM64)
+#define MA_SYSTEM_CALL_RESULT(info)     ((ULONG_PTR)(info)->TrapFrame->X0)
+#elif defined(_M_IX86)
+#define MA_SYSTEM_CALL_RESULT(info)     ((ULONG_PTR)(info)->TrapFrame->Eax)
+#elif defined(_M_ARM)
+#define MA_SYSTEM_CALL_RESULT(info)     ((ULONG_PTR)(info)->TrapFrame->R0)
+#else
+#error Detect the system call result for this architecture!
+#endif
+
+/// <summary>
+/// Runs the hooks registered for the current system call around <paramref name="Dispatch"/>.
+/// Only called when the filter bit of the system call is set.
+/// </summary>
+VOID
+    MapDispatchHookedSystemCall(
+        _In_ DWORD Provider,
+        _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+        _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH Dispatch
+    );
+
+/// <summary>
+/// Drops all system call hooks of a provider that is being unregistered.
+/// </summary>
+VOID
+    MapRemoveSystemCallHooks(
+        _In_ DWORD Provider
+    );
+
+//
+// Monika instrumentation
+//
+
+#define MA_INSTRUMENT_TRACE             (0x1)
+#define MA_INSTRUMENT_STATISTICS        (0x2)
+// Set while any ETW session listens to the lxmonika TraceLogging provider.
+#define MA_INSTRUMENT_ETW               (0x4)
+// Set while any lifecycle event subscriber exists.
+#define MA_INSTRUMENT_EVENTS            (0x8)
+
+// A combination of MA_INSTRUMENT_* flags. Instrumented paths check it once, so that disabled
+// instrumentation costs a single branch.
+extern volatile LONG        MapInstrumentation;
+
+// Number of records kept per processor. Must be a power of two.
+#define MA_TRACE_RING_SIZE              (2048)
+
+typedef enum _MA_TRACE_EVENT {
+    MaTraceEventSystemCall,
+    MaTraceEventCreateProcess,
+    MaTraceEventCreateThread,
+    MaTraceEventExitProcess,
+    MaTraceEventExitThread,
+    MaTraceEventException,
+    MaTraceEventMaxCount
+} MA_TRACE_EVENT;
+
+typedef struct _MA_TRACE_RECORD {
+    // Position of the record in its ring plus one, zero until first written, or -1 while being
+    // written.
+    LONG64                  Sequence;
+    LONG64                  Timestamp;
+    ULONG64                 ProcessId;
+    ULONG64                 ThreadId;
+    ULONG64                 Number;
+    ULONG64                 Result;
+    USHORT                  Event;
+    USHORT                  Provider;
+    ULONG                   Processor;
+} MA_TRACE_RECORD, *PMA_TRACE_RECORD;
+
+/// <summary>
+/// Turns tracing on or off. The per-processor rings are allocated the first time tracing is
+/// enabled and are kept until <see cref="MapCleanupTrace"/>.
+/// </summary>
+NTSTATUS
+    MapSetTraceEnabled(
+        _In_ BOOLEAN Enable,
+        _Out_opt_ PBOOLEAN WasEnabled
+    );
+
+// The most system call numbers a trace filter can select.
+#define MA_TRACE_FILTER_NUMBERS_MAX     (16)
+
+// A record is traced when it matches every non-zero field.
+typedef struct _MA_TRACE_FILTER {
+    // Bit i selects MA_TRACE_EVENT i.
+    ULONG                   EventMask;
+    // Bit i selects provider i.
+    ULONG                   ProviderMask;
+    ULONG64                 ProcessId;
+    // Only applies to system call records.
+    ULONG                   NumberCount;
+    ULONG64                 Numbers[MA_TRACE_FILTER_NUMBERS_MAX];
+} MA_TRACE_FILTER, *PMA_TRACE_FILTER;
+
+/// <summary>
+/// Replaces the trace filter. Records rejected by the filter are dropped by the writers, before
+/// they take a place in the rings.
+/// </summary>
+VOID
+    MapSetTraceFilter(
+        _In_ const MA_TRACE_FILTER* Filter
+    );
+
+VOID
+    MapQueryTraceFilter(
+        _Out_ PMA_TRACE_FILTER Filter
+    );
+
+/// <summary>
+/// Appends a record to the ring of the current processor, unless the trace filter rejects it.
+/// Takes no locks and may be called at any IRQL.
+/// </summary>
+VOID
+    MapTraceEvent(
+        _In_ MA_TRACE_EVENT Event,
+        _In_ DWORD Provider,
+        _In_ HANDLE ProcessId,
+        _In_ HANDLE ThreadId,
+        _In_ ULONG_PTR Number,
+        _In_ ULONG_PTR Result
+    );
+
+/// <summary>
+/// Drains up to <paramref name="Count"/> records from all rings. Records overwritten before they
+/// could be read are counted in <paramref name="Lost"/>.
+/// </summary>
+NTSTATUS
+    MapReadTrace(
+        _Out_writes_to_(Count, *Read) PMA_TRACE_RECORD Records,
+        _In_ SIZE_T Count,
+        _Out_ PSIZE_T Read,
+        _Out_ PSIZE_T Lost
+    );
+
+VOID
+    MapCleanupTrace();
+
+//
+// Monika sampling profiler
+//
+
+// Number of samples kept per processor. Must be a power of two.
+#define MA_PROFILE_RING_SIZE            (512)
+#define MA_PROFILE_FRAMES_MAX           (32)
+#define MA_PROFILE_PROCESSES_MAX        (16)
+
+#define MA_PROFILE_FLAG_USER_STACKS     (0x1)
+
+typedef struct _MA_PROFILE_SETTINGS {
+    ULONG                   Flags;
+    // Milliseconds between two samples on a processor.
+    ULONG                   Interval;
+    // A sample is kept when it matches every non-zero field.
+    // Bit i selects provider i.
+    ULONG                   ProviderMask;
+    ULONG                   ProcessCount;
+    ULONG64                 ProcessIds[MA_PROFILE_PROCESSES_MAX];
+} MA_PROFILE_SETTINGS, *PMA_PROFILE_SETTINGS;
+
+typedef struct _MA_PROFILE_SAMPLE {
+    LONG64                  Timestamp;
+    ULONG64                 ProcessId;
+    ULONG64                 ThreadId;
+    USHORT                  Provider;
+    USHORT                  FrameCount;
+    ULONG                   Processor;
+    ULONG64                 Frames[MA_PROFILE_FRAMES_MAX];
+} MA_PROFILE_SAMPLE, *PMA_PROFILE_SAMPLE;
+
+/// <summary>
+/// Starts a periodic timer on each active processor, whose DPC samples the interrupted thread
+/// when it is a Pico thread matching <paramref name="Settings"/>. Samples of an earlier profile
+/// that have not been read are dropped. Fails with STATUS_DEVICE_BUSY while a profile runs.
+/// </summary>
+NTSTATUS
+    MapStartProfile(
+        _In_ const MA_PROFILE_SETTINGS* Settings
+    );
+
+/// <summary>
+/// Stops the timers and waits for their DPCs. The samples stay readable until the next profile is
+/// started.
+/// </summary>
+VOID
+    MapStopProfile(
+        _Out_opt_ PBOOLEAN WasEnabled
+    );
+
+/// <summary>
+/// Drains up to <paramref name="Count"/> samples from all processors. Samples dropped because
+/// their processor had no room left are counted in <paramref name="Lost"/>.
+/// </summary>
+NTSTATUS
+    MapReadProfile(
+        _Out_writes_to_(Count, *Read) PMA_PROFILE_SAMPLE Samples,
+        _In_ SIZE_T Count,
+        _Out_ PSIZE_T Read,
+        _Out_ PSIZE_T Lost
+    );
+
+VOID
+    MapCleanupProfile();
+
+// Latency bucket i counts system calls that took [2^i, 2^(i+1)) performance counter ticks.
+// Bucket 0 also counts those that took no measurable time.
+#define MA_LATENCY_BUCKETS              (32)
+
+typedef struct _MA_PROVIDER_STATISTICS {
+    ULONG64                 Events[MaTraceEventMaxCount];
+    ULONG64                 Latency[MA_LATENCY_BUCKETS];
+    // In performance counter ticks.
+    ULONG64                 SystemCallTime;
+} MA_PROVIDER_STATISTICS, *PMA_PROVIDER_STATISTICS;
+
+/// <summary>
+/// Turns statistics collection on or off. Counters are allocated the first time collection is
+/// enabled, and keep their values across toggles.
+/// </summary>
+NTSTATUS
+    MapSetStatisticsEnabled(
+        _In_ BOOLEAN Enable,
+        _Out_opt_ PBOOLEAN WasEnabled
+    );
+
+/// <summary>
+/// Sums the per-processor counters of <paramref name="Provider"/>.
+/// </summary>
+VOID
+    MapQueryStatistics(
+        _In_ DWORD Provider,
+        _Out_ PMA_PROVIDER_STATISTICS Statistics
+    );
+
+/// <summary>
+/// Traces and counts an event, depending on the enabled instrumentation.
+/// Only called when <see cref="MapInstrumentation"/> is non-zero.
+/// </summary>
+VOID
+    MapInstrumentEvent(
+        _In_ MA_TRACE_EVENT Event,
+        _In_ DWORD Provider,
+        _In_ HANDLE ProcessId,
+        _In_ HANDLE ThreadId,
+        _In_ ULONG_PTR Number,
+        _In_ ULONG_PTR Result
+    );
+
+/// <summary>
+/// Times, traces and counts a system call around <see cref="MapDispatchUninstrumentedSystemCall"/>.
+/// Only called when <see cref="MapInstrumentation"/> is non-zero.
+/// </summary>
+VOID
+    MapDispatchInstrumentedSystemCall(
+        _In_ DWORD Provider,
+        _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+        _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH Dispatch
+    );
+
+//
+// Monika ETW
+//
+
+// TraceLogging provider "lxmonika", {9d23c750-d6d1-4b99-b028-5b64fe1a6cde}.
+#define MA_ETW_KEYWORD_PROCESS          (0x1)
+#define MA_ETW_KEYWORD_THREAD           (0x2)
+#define MA_ETW_KEYWORD_PROVIDER         (0x4)
+#define MA_ETW_KEYWORD_SESSION          (0x8)
+#define MA_ETW_KEYWORD_EXCEPTION        (0x10)
+// Only logged at the verbose level.
+#define MA_ETW_KEYWORD_SYSTEM_CALL      (0x20)
+
+NTSTATUS
+    MapEtwRegister();
+
+VOID
+    MapEtwUnregister();
+
+/// <summary>
+/// Writes the ETW event corresponding to a dispatcher event.
+/// Only called when <see cref="MapInstrumentation"/> has MA_INSTRUMENT_ETW set.
+/// </summary>
+VOID
+    MapEtwWriteEvent(
+        _In_ MA_TRACE_EVENT Event,
+        _In_ DWORD Provider,
+        _In_ HANDLE ProcessId,
+        _In_ HANDLE ThreadId,
+        _In_ ULONG_PTR Number,
+        _In_ ULONG_PTR Result
+    );
+
+VOID
+    MapEtwWriteProviderRegistered(
+        _In_ SIZE_T Index
+    );
+
+VOID
+    MapEtwWriteSessionStarted(
+        _In_ SIZE_T Index,
+        _In_ NTSTATUS Status
+    );
+
+//
+// Monika lifecycle events
+//
+
+// Largest number of records in a subscriber ring.
+#define MA_EVENT_RING_MAX               (1 << 16)
+// Subscriptions alive at once, in total and per process. Each ring is mapped into system space,
+// and the largest take a few megabytes.
+#define MA_EVENT_SUBSCRIBERS_MAX        (32)
+#define MA_EVENT_PROCESS_SUBSCRIBERS_MAX (4)
+
+typedef struct _MA_EVENT_RECORD {
+    // Position of the record in its ring plus one, or zero while the record is being written.
+    LONG64                  Sequence;
+    LONG64                  Timestamp;
+    ULONG64                 ProcessId;
+    ULONG64                 ThreadId;
+    // The creation status, or the exit status.
+    NTSTATUS                Status;
+    USHORT                  Event;
+    USHORT                  Provider;
+} MA_EVENT_RECORD, *PMA_EVENT_RECORD;
+
+// Shared with the subscriber, which may scribble over it. The driver never trusts its contents.
+typedef struct _MA_EVENT_RING {
+    ULONG                   Capacity;
+    // Set by the subscriber before waiting. Cleared by the driver when it signals the event.
+    volatile LONG           Waiting;
+    LONG64                  Frequency;
+    // Next position to be written.
+    volatile LONG64         Head;
+    MA_EVENT_RECORD         Records[ANYSIZE_ARRAY];
+} MA_EVENT_RING, *PMA_EVENT_RING;
+
+/// <summary>
+/// Creates a ring of <paramref name="Capacity"/> records, maps it into the current process and
+/// starts publishing process and thread lifecycle events to it.
+/// </summary>
+///
+/// <param name="Event">
+/// An optional handle to an event object, signalled when records arrive while the subscriber is
+/// waiting. Referenced with the access checks of the previous mode.
+/// </param>
+///
+/// <remarks>
+/// The user view outlives the subscription, and is only unmapped by the process itself or by its
+/// exit. Fails with <c>STATUS_QUOTA_EXCEEDED</c> beyond <c>MA_EVENT_SUBSCRIBERS_MAX</c>
+/// subscriptions, or <c>MA_EVENT_PROCESS_SUBSCRIBERS_MAX</c> for the current process.
+/// </remarks>
+NTSTATUS
+    MapSubscribeEvents(
+        _In_ ULONG Capacity,
+        _In_opt_ HANDLE Event,
+        _Out_ PVOID* UserRing,
+        _Out_ PVOID* Subscription
+    );
+
+VOID
+    MapUnsubscribeEvents(
+        _In_ PVOID Subscription
+    );
+
+/// <summary>
+/// Appends a lifecycle event to every subscriber ring.
+/// Only called when <see cref="MapInstrumentation"/> has MA_INSTRUMENT_EVENTS set, at or below
+/// APC_LEVEL, since the rings are pageable.
+/// </summary>
+VOID
+    MapPublishEvent(
+        _In_ MA_TRACE_EVENT Event,
+        _In_ DWORD Provider,
+        _In_ HANDLE ProcessId,
+        _In_ HANDLE ThreadId,
+        _In_ NTSTATUS Status
+    );
+
+//
+// Monika session limits
+//
+
+typedef struct _MA_SESSION_INFORMATION {
+    ULONG64                 SessionId;
+    DWORD                   Provider;
+    // The MA_LIMIT_* flags of the session.
+    ULONG                   Limits;
+    ULONG                   ActiveProcesses;
+    ULONG                   TotalProcesses;
+    // Processes terminated by the job for exceeding a limit.
+    ULONG                   TerminatedProcesses;
+    // In 100ns units, for all the processes of the session.
+    ULONG64                 UserTime;
+    ULONG64                 KernelTime;
+    ULONG64                 PeakCommit;
+    ULONG64                 ReadBytes;
+    ULONG64                 WriteBytes;
+} MA_SESSION_INFORMATION, *PMA_SESSION_INFORMATION;
+
+NTSTATUS
+    MapValidateLimits(
+        _In_ const MA_PICO_SESSION_LIMITS* Limits
+    );
+
+/// <summary>
+/// Creates the job object enforcing the limits of a session about to be started, and lets
+/// MaAssignSessionProcess find it through <paramref name="Attributes"/> until
+/// MapSessionReturned. Sets <paramref name="Session"/> to NULL for sessions without limits.
+/// </summary>
+///
+/// <param name="Completion">
+/// Set for asynchronous sessions. MapSessionCompletion must then be passed to the provider
+/// instead, with <paramref name="Session"/> as its context.
+/// </param>
+NTSTATUS
+    MapCreateSession(
+        _In_ DWORD Provider,
+        _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+        _In_opt_ PMA_PICO_SESSION_COMPLETION Completion,
+        _In_opt_ PVOID CompletionContext,
+        _Out_ PVOID* Session
+    );
+
+/// <summary>
+/// Called with the status of the provider routine once it returns. Sessions stay in the
+/// statistics until they end, for asynchronous ones until their completion has been called.
+/// </summary>
+VOID
+    MapSessionReturned(
+        _In_opt_ PVOID Session,
+        _In_ NTSTATUS Status
+    );
+
+MA_PICO_SESSION_COMPLETION MapSessionCompletion;
+
+/// <summary>
+/// Copies the accounting of up to <paramref name="Count"/> running sessions with limits.
+/// <paramref name="Total"/> receives the number of such sessions. Must be called at
+/// PASSIVE_LEVEL.
+/// </summary>
+NTSTATUS
+    MapQuerySessions(
+        _Out_writes_to_(Count, *Read) PMA_SESSION_INFORMATION Sessions,
+        _In_ SIZE_T Count,
+        _Out_ PSIZE_T Read,
+        _Out_ PSIZE_T Total
+    );
+
+//
+// Monika counters page
+//
+
+// How often the counters page is refreshed while it exists.
+#define MA_COUNTERS_REFRESH_MS          (100)
+
+// Shared read-only with every process that mapped it.
+typedef struct _MA_COUNTERS_PAGE {
+    // Odd while the driver is writing the page.
+    volatile LONG64         Sequence;
+    // Performance counter value of the last refresh.
+    LONG64                  Timestamp;
+    LONG64                  Frequency;
+    ULONG                   Instrumentation;
+    ULONG                   ProvidersCount;
+    ULONG64                 Events[MA_PICO_PROVIDER_REPORTED_MAX][MaTraceEventMaxCount];
+} MA_COUNTERS_PAGE, *PMA_COUNTERS_PAGE;
+
+/// <summary>
+/// Maps the counters page read-only into the current process. The page is created on first use,
+/// and refreshed until every view has been released with MapReleaseCountersPage.
+/// </summary>
+///
+/// <remarks>
+/// Event counters only move while statistics collection is enabled.
+/// The view is only unmapped by the process itself or by its exit. Its protection cannot be
+/// changed.
+/// </remarks>
+NTSTATUS
+    MapMapCountersPage(
+        _Out_ PVOID* UserView
+    );
+
+/// <summary>
+/// Stops counting views returned by MapMapCountersPage, once the file they were requested through
+/// is closed. The refresh timer stops with the last of them.
+/// </summary>
+VOID
+    MapReleaseCountersPage(
+        _In_ SIZE_T Views
+    );
+
+VOID
+    MapCleanupCountersPage();
+
+//
+// Monika boot profile
+//
+
+// Phases nest: MapInitialize includes PicoSppDetermineAbiStatus, MapLxssInitialize includes
+// LxInitialize, and PicoSppLocateProviderRoutines runs inside whichever of them needs it first.
+typedef enum _MA_BOOT_PHASE {
+    MaBootPhaseDriverEntry,
+    MaBootPhaseMapInitialize,
+    MaBootPhaseDetermineAbiStatus,
+    MaBootPhaseLocateProviderRoutines,
+    MaBootPhaseMapLxssInitialize,
+    MaBootPhaseLxInitialize,
+    MaBootPhaseRlpInitializeDevices,
+    MaBootPhaseMaxCount
+} MA_BOOT_PHASE;
+
+typedef struct _MA_BOOT_PROFILE {
+    LONG64                  Frequency;
+    // In performance counter ticks.
+    LONG64                  Ticks[MaBootPhaseMaxCount];
+    NTSTATUS                Status[MaBootPhaseMaxCount];
+    // Bit i is set if phase i has run.
+    ULONG                   Recorded;
+    // A PICOSP_LOCATE_METHOD.
+    ULONG                   LocateMethod;
+} MA_BOOT_PROFILE, *PMA_BOOT_PROFILE;
+
+/// <summary>
+/// Records the time since <paramref name="Start"/> as the duration of <paramref name="Phase"/>.
+/// Only the first run of each phase is kept.
+/// </summary>
+VOID
+    MapRecordBootPhase(
+        _In_ MA_BOOT_PHASE Phase,
+        _In_ LONG64 Start,
+        _In_ NTSTATUS Status
+    );
+
+VOID
+    MapQueryBootProfile(
+        _Out_ PMA_BOOT_PROFILE Profile
+    );
+
+//
+// Monika pool accounting
+//
+
+// Tags counted on their own. The last slot counts all further tags together, with a Tag of 0.
+#define MA_POOL_TAGS_MAX                (16)
+
+typedef struct _MA_POOL_STATISTICS {
+    ULONG                   Tag;
+    ULONG64                 Allocations;
+    ULONG64                 Frees;
+    ULONG64                 Failures;
+    ULONG64                 BytesInUse;
+    // The most bytes in use at once since the driver was loaded.
+    ULONG64                 PeakBytesInUse;
+} MA_POOL_STATISTICS, *PMA_POOL_STATISTICS;
+
+/// <summary>
+/// Counts an allocation of <paramref name="Size"/> bytes under <paramref name="Tag"/>, or a
+/// failed one if <paramref name="Block"/> is NULL. Called by MapAllocatePool.
+/// </summary>
+VOID
+    MapRecordPoolAllocate(
+        _In_opt_ PVOID Block,
+        _In_ SIZE_T Size,
+        _In_ ULONG Tag
+    );
+
+/// <summary>
+/// Counts a free of a block allocated by MapAllocatePool. Called by MapFreePool.
+/// </summary>
+VOID
+    MapRecordPoolFree(
+        _In_ SIZE_T Size,
+        _In_ ULONG Tag
+    );
+
+/// <summary>
+/// Copies the counters of the tags seen so far, and returns how many there are.
+/// </summary>
+SIZE_T
+    MapQueryPoolStatistics(
+        _Out_writes_to_(Count, return) PMA_POOL_STATISTICS Statistics,
+        _In_ SIZE_T Count
+    );
+
+//
+// Monika provider descriptors
+//
+
+// Everything known about one provider slot.
+// The routines used on every dispatch come first, and each slot is aligned to a cache line so
+// that registering one provider does not invalidate lines read by dispatchers of another.
+typedef struct DECLSPEC_CACHEALIGN _MA_PROVIDER {
+    PS_PICO_PROVIDER_ROUTINES       ProviderRoutines;
+    // One bit per system call number, set when there are hooks for that system call.
+    LONG                            SystemCallFilter[MA_SYSTEM_CALL_MAX / 32];
+    MA_PICO_PROVIDER_ROUTINES       AdditionalProviderRoutines;
+    PS_PICO_ROUTINES                Routines;
+    PS_PICO_ROUTINES                RoutinesTh1;
+    MA_PICO_ROUTINES                AdditionalRoutines;
+    // Run down while the slot is free, so that lookups fail without taking any locks.
+    EX_RUNDOWN_REF                  Rundown;
+    // Number of MA_CONTEXT structures currently holding this provider.
+    SIZE_T                          ActiveContexts;
+    // Protected by MapProvidersLock.
+    BOOLEAN                         Registered;
+    // List of MA_SYSTEM_CALL_HOOK, protected by the hooks lock in monika_syscall.cpp.
+    LIST_ENTRY                      SystemCallHooks;
+} MA_PROVIDER, *PMA_PROVIDER;
+
+/// <summary>
+/// Prevents the provider at <paramref name="Index"/> from being unregistered.
+/// Returns <c>FALSE</c> if the slot is not occupied by a registered provider.
+/// </summary>
+BOOLEAN
+    MapReferenceProvider(
+        _In_ SIZE_T Index
+    );
+
+VOID
+    MapDereferenceProvider(
+        _In_ SIZE_T Index
+    );
+
+/// <summary>
+/// Fills the Pico routines of a newly allocated slot with the thunks that pass
+/// <paramref name="Index"/> on to the dispatcher.
+/// </summary>
+VOID
+    MapInitializeProviderThunks(
+        _In_ SIZE_T Index,
+        _Out_ PMA_PROVIDER Provider
+    );
+
+/// <summary>
+/// Makes the next <see cref="MaFindPicoProvider"/> call ask all providers for their names again.
+/// </summary>
+VOID
+    MapInvalidateProviderNames();
+
+VOID
+    MapCleanupProviderNames();
 
 //
 // Monika data
@@ -186,18 +1073,38 @@ enum
 extern BOOLEAN MapTooLate;
 extern ULONG MapSystemAbiVersion;
 
+// When set, process contexts keep a reference to the image FILE_OBJECT instead of copying the
+// image name. Set through the LazyImageNames DWORD in the service key.
+extern BOOLEAN MapLazyImageNames;
+
+// Allows RlIoctlSelfBenchmark. Set through the SelfBenchmark DWORD in the service key.
+extern BOOLEAN MapSelfBenchmark;
+
+// Allows RlIoctlProfileControl and RlIoctlProfileRead. Set through the Profiling DWORD in the
+// service key.
+extern BOOLEAN MapProfiling;
+
+// Passed on to every provider with a SetWarmPoolSize routine as it registers. Set through the
+// WarmPoolSize DWORD in the service key.
+extern SIZE_T MapWarmPoolSize;
+
 extern PS_PICO_PROVIDER_ROUTINES MapOriginalProviderRoutines;
 extern PS_PICO_ROUTINES MapOriginalRoutines;
 
 extern BOOLEAN MapPicoRegistrationDisabled;
-extern PS_PICO_PROVIDER_ROUTINES MapProviderRoutines[MaPicoProviderMaxCount];
-extern PS_PICO_ROUTINES MapRoutines[MaPicoProviderMaxCount];
-extern MA_PICO_PROVIDER_ROUTINES MapAdditionalProviderRoutines[MaPicoProviderMaxCount];
+// Allocated as providers first register in them, and kept until MapCleanup, so that lookups
+// never race with a free. Read through MapProviders.
+extern PMA_PROVIDER MapProviderSlots[MaPicoProviderMaxCount];
+// What lookups see for slots without an allocation: run down, without routines, hooks or
+// filter bits. Never written after MapInitialize.
+extern MA_PROVIDER MapFreeProvider;
 extern SIZE_T MapProvidersCount;
 
 extern BOOLEAN MapLxssPatched;
 extern BOOLEAN MapLxssRegistering;
 extern SIZE_T MapLxssProviderIndex;
+extern BOOLEAN MapLxssDirectWired;
+extern SIZE_T MapLxssDirectWireSwitches;
 
 #ifdef __cplusplus
 }
@@ -232,6 +1139,133 @@ extern SIZE_T MapLxssProviderIndex;
     }                                                                           \
     while (FALSE)
 
+//
+// Monika provider views
+//
+
+namespace MaDetails
+{
+    // Presents the slots as an array of MA_PROVIDER, free ones included.
+    struct ProviderTable
+    {
+        FORCEINLINE
+        MA_PROVIDER&
+        operator[](SIZE_T Index) const
+        {
+            // Published with release semantics once the thunks of the slot are in place.
+            PMA_PROVIDER pProvider = (PMA_PROVIDER)ReadPointerAcquire(
+                (PVOID const volatile*)&MapProviderSlots[Index]);
+            return (pProvider != NULL) ? *pProvider : MapFreeProvider;
+        }
+    };
+}
+
+inline constexpr MaDetails::ProviderTable MapProviders;
+
+namespace MaDetails
+{
+    // Presents one member of every MapProviders entry as if it were a standalone array.
+    template <typename T, T MA_PROVIDER::* Member>
+    struct ProviderView
+    {
+        FORCEINLINE
+        T&
+        operator[](SIZE_T Index) const
+        {
+            return MapProviders[Index].*Member;
+        }
+    };
+}
+
+inline constexpr MaDetails::ProviderView<PS_PICO_PROVIDER_ROUTINES, &MA_PROVIDER::ProviderRoutines>
+    MapProviderRoutines;
+inline constexpr MaDetails::ProviderView<PS_PICO_ROUTINES, &MA_PROVIDER::Routines>
+    MapRoutines;
+inline constexpr MaDetails::ProviderView<PS_PICO_ROUTINES, &MA_PROVIDER::RoutinesTh1>
+    MapRoutinesTh1;
+inline constexpr MaDetails::ProviderView<MA_PICO_PROVIDER_ROUTINES,
+    &MA_PROVIDER::AdditionalProviderRoutines> MapAdditionalProviderRoutines;
+inline constexpr MaDetails::ProviderView<MA_PICO_ROUTINES, &MA_PROVIDER::AdditionalRoutines>
+    MapAdditionalRoutines;
+
+//
+// Monika pool helpers
+//
+
+/// <summary>
+/// ExAllocatePool2, counted under <paramref name="Tag"/>. The block must be freed with
+/// MapFreePool, with the same size and tag.
+/// </summary>
+template <typename PoolFlagsT>
+FORCEINLINE
+PVOID
+MapAllocatePool(
+    _In_ PoolFlagsT Flags,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag
+)
+{
+    // Whatever ExAllocatePool2 takes, which is a POOL_TYPE on older WDKs. See compat.h.
+    PVOID pBlock = ExAllocatePool2(Flags, Size, Tag);
+    MapRecordPoolAllocate(pBlock, Size, Tag);
+    return pBlock;
+}
+
+FORCEINLINE
+VOID
+MapFreePool(
+    _In_ PVOID Block,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag
+)
+{
+    MapRecordPoolFree(Size, Tag);
+    ExFreePoolWithTag(Block, Tag);
+}
+
+//
+// Monika system call helpers
+//
+
+FORCEINLINE
+VOID
+MapDispatchUninstrumentedSystemCall(
+    _In_ DWORD Provider,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+    _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH Dispatch
+)
+{
+    ULONG_PTR uNumber = MA_SYSTEM_CALL_NUMBER(SystemCall);
+
+    if (uNumber < MA_SYSTEM_CALL_MAX
+        && BitTest(&MapProviders[Provider].SystemCallFilter[uNumber / 32], (LONG)(uNumber % 32)))
+    {
+        MapDispatchHookedSystemCall(Provider, SystemCall, Dispatch);
+    }
+    else
+    {
+        Dispatch(SystemCall);
+    }
+}
+
+FORCEINLINE
+VOID
+MapDispatchFilteredSystemCall(
+    _In_ DWORD Provider,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+    _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH Dispatch
+)
+{
+    if (MapInstrumentation == 0)
+    {
+        MapDispatchUninstrumentedSystemCall(Provider, SystemCall, Dispatch);
+    }
+    else
+    {
+        MapDispatchInstrumentedSystemCall(Provider, SystemCall, Dispatch);
+    }
+}
+
 //
 // Monika context helpers
 //
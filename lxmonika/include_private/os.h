@@ -89,6 +89,120 @@ typedef struct _SYSTEM_BIGPOOL_INFORMATION {
     SYSTEM_BIGPOOL_ENTRY    AllocatedInfo[ANYSIZE_ARRAY];
 } SYSTEM_BIGPOOL_INFORMATION, *PSYSTEM_BIGPOOL_INFORMATION;
 
+#ifndef JOB_OBJECT_ASSIGN_PROCESS
+#define JOB_OBJECT_ASSIGN_PROCESS               (0x0001)
+#define JOB_OBJECT_SET_ATTRIBUTES               (0x0002)
+#define JOB_OBJECT_QUERY                        (0x0004)
+#define JOB_OBJECT_TERMINATE                    (0x0008)
+#define JOB_OBJECT_ALL_ACCESS                   (STANDARD_RIGHTS_REQUIRED | SYNCHRONIZE | 0x3F)
+#endif
+
+#ifndef JOB_OBJECT_LIMIT_WORKINGSET
+#define JOB_OBJECT_LIMIT_WORKINGSET             (0x00000001)
+#define JOB_OBJECT_LIMIT_ACTIVE_PROCESS         (0x00000008)
+#define JOB_OBJECT_LIMIT_JOB_MEMORY             (0x00000200)
+
+typedef enum _JOBOBJECTINFOCLASS {
+    JobObjectBasicAndIoAccountingInformation = 8,
+    JobObjectExtendedLimitInformation = 9,
+    JobObjectCpuRateControlInformation = 15
+} JOBOBJECTINFOCLASS;
+
+typedef struct _JOBOBJECT_BASIC_ACCOUNTING_INFORMATION {
+    LARGE_INTEGER   TotalUserTime;
+    LARGE_INTEGER   TotalKernelTime;
+    LARGE_INTEGER   ThisPeriodTotalUserTime;
+    LARGE_INTEGER   ThisPeriodTotalKernelTime;
+    ULONG           TotalPageFaultCount;
+    ULONG           TotalProcesses;
+    ULONG           ActiveProcesses;
+    ULONG           TotalTerminatedProcesses;
+} JOBOBJECT_BASIC_ACCOUNTING_INFORMATION, *PJOBOBJECT_BASIC_ACCOUNTING_INFORMATION;
+
+typedef struct _JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION {
+    JOBOBJECT_BASIC_ACCOUNTING_INFORMATION  BasicInfo;
+    IO_COUNTERS                             IoInfo;
+} JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION, *PJOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION;
+
+typedef struct _JOBOBJECT_BASIC_LIMIT_INFORMATION {
+    LARGE_INTEGER   PerProcessUserTimeLimit;
+    LARGE_INTEGER   PerJobUserTimeLimit;
+    ULONG           LimitFlags;
+    SIZE_T          MinimumWorkingSetSize;
+    SIZE_T          MaximumWorkingSetSize;
+    ULONG           ActiveProcessLimit;
+    ULONG_PTR       Affinity;
+    ULONG           PriorityClass;
+    ULONG           SchedulingClass;
+} JOBOBJECT_BASIC_LIMIT_INFORMATION, *PJOBOBJECT_BASIC_LIMIT_INFORMATION;
+
+typedef struct _JOBOBJECT_EXTENDED_LIMIT_INFORMATION {
+    JOBOBJECT_BASIC_LIMIT_INFORMATION   BasicLimitInformation;
+    IO_COUNTERS                         IoInfo;
+    SIZE_T                              ProcessMemoryLimit;
+    SIZE_T                              JobMemoryLimit;
+    SIZE_T                              PeakProcessMemoryUsed;
+    SIZE_T                              PeakJobMemoryUsed;
+} JOBOBJECT_EXTENDED_LIMIT_INFORMATION, *PJOBOBJECT_EXTENDED_LIMIT_INFORMATION;
+#endif
+
+#ifndef SEC_NO_CHANGE
+#define SEC_NO_CHANGE                           (0x00400000)
+#endif
+
+#ifndef JOB_OBJECT_CPU_RATE_CONTROL_ENABLE
+#define JOB_OBJECT_CPU_RATE_CONTROL_ENABLE      (0x1)
+#define JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP    (0x4)
+
+typedef struct _JOBOBJECT_CPU_RATE_CONTROL_INFORMATION {
+    ULONG   ControlFlags;
+    union
+    {
+        ULONG   CpuRate;
+        ULONG   Weight;
+        struct
+        {
+            USHORT  MinRate;
+            USHORT  MaxRate;
+        };
+    };
+} JOBOBJECT_CPU_RATE_CONTROL_INFORMATION, *PJOBOBJECT_CPU_RATE_CONTROL_INFORMATION;
+#endif
+
+__declspec(dllimport)
+NTSTATUS
+    ZwCreateJobObject(
+        _Out_       PHANDLE JobHandle,
+        _In_        ACCESS_MASK DesiredAccess,
+        _In_opt_    POBJECT_ATTRIBUTES ObjectAttributes
+    );
+
+__declspec(dllimport)
+NTSTATUS
+    ZwAssignProcessToJobObject(
+        _In_        HANDLE JobHandle,
+        _In_        HANDLE ProcessHandle
+    );
+
+__declspec(dllimport)
+NTSTATUS
+    ZwSetInformationJobObject(
+        _In_        HANDLE JobHandle,
+        _In_        JOBOBJECTINFOCLASS JobObjectInformationClass,
+        _In_        PVOID JobObjectInformation,
+        _In_        ULONG JobObjectInformationLength
+    );
+
+__declspec(dllimport)
+NTSTATUS
+    ZwQueryInformationJobObject(
+        _In_opt_    HANDLE JobHandle,
+        _In_        JOBOBJECTINFOCLASS JobObjectInformationClass,
+        _Out_       PVOID JobObjectInformation,
+        _In_        ULONG JobObjectInformationLength,
+        _Out_opt_   PULONG ReturnLength
+    );
+
 __declspec(dllimport)
 NTSTATUS
     ZwQuerySection(
@@ -114,6 +228,18 @@ PEPROCESS
         _In_        PETHREAD Thread
     );
 
+__declspec(dllimport)
+NTSTATUS
+    PsGetProcessExitStatus(
+        _In_        PEPROCESS Process
+    );
+
+__declspec(dllimport)
+NTSTATUS
+    PsGetThreadExitStatus(
+        _In_        PETHREAD Thread
+    );
+
 __declspec(dllimport)
 NTSTATUS
     PsLookupProcessByProcessId(
@@ -121,6 +247,59 @@ NTSTATUS
         _Out_       PEPROCESS* Process
     );
 
+typedef enum _KAPC_ENVIRONMENT {
+    OriginalApcEnvironment,
+    AttachedApcEnvironment,
+    CurrentApcEnvironment,
+    InsertApcEnvironment
+} KAPC_ENVIRONMENT;
+
+typedef
+VOID
+(NTAPI *PKNORMAL_ROUTINE)(
+    _In_opt_    PVOID NormalContext,
+    _In_opt_    PVOID SystemArgument1,
+    _In_opt_    PVOID SystemArgument2
+);
+
+typedef
+VOID
+(NTAPI *PKKERNEL_ROUTINE)(
+    _In_        PKAPC Apc,
+    _Inout_     PKNORMAL_ROUTINE* NormalRoutine,
+    _Inout_     PVOID* NormalContext,
+    _Inout_     PVOID* SystemArgument1,
+    _Inout_     PVOID* SystemArgument2
+);
+
+typedef
+VOID
+(NTAPI *PKRUNDOWN_ROUTINE)(
+    _In_        PKAPC Apc
+);
+
+__declspec(dllimport)
+VOID
+    KeInitializeApc(
+        _Out_       PKAPC Apc,
+        _In_        PKTHREAD Thread,
+        _In_        KAPC_ENVIRONMENT Environment,
+        _In_        PKKERNEL_ROUTINE KernelRoutine,
+        _In_opt_    PKRUNDOWN_ROUTINE RundownRoutine,
+        _In_opt_    PKNORMAL_ROUTINE NormalRoutine,
+        _In_opt_    KPROCESSOR_MODE ProcessorMode,
+        _In_opt_    PVOID NormalContext
+    );
+
+__declspec(dllimport)
+BOOLEAN
+    KeInsertQueueApc(
+        _Inout_     PKAPC Apc,
+        _In_opt_    PVOID SystemArgument1,
+        _In_opt_    PVOID SystemArgument2,
+        _In_        KPRIORITY Increment
+    );
+
 #ifdef __cplusplus
 }
 #endif
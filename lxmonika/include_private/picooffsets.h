@@ -4,27 +4,65 @@
 //
 // Generated offsets for important symbols supporting Pico providers.
 
+#ifndef MA_HOST
 #include <ntddk.h>
+#endif
 
+#include "compat.h"
+
+typedef enum _MA_PICO_ARCHITECTURE {
+    MaPicoArchitectureX86 = 1,
+    MaPicoArchitectureX64 = 2,
+    MaPicoArchitectureArm = 3,
+    MaPicoArchitectureArm64 = 4
+} MA_PICO_ARCHITECTURE;
+
+// Packs a version major.minor.build.revision and an architecture into one key, which orders the
+// same way as the version numbers do.
+#define MA_PICO_OFFSETS_KEY(major, minor, build, revision, architecture)                        \
+    (((ULONG64)(major) << 56) | ((ULONG64)(minor) << 48) | ((ULONG64)(build) << 24)           \
+        | ((ULONG64)(revision) << 4) | (ULONG64)(architecture))
+
+// Fields wider than that do not fit in MA_PICO_OFFSETS_KEY.
+#define MA_PICO_OFFSETS_KEY_MAX_MAJOR           0xFF
+#define MA_PICO_OFFSETS_KEY_MAX_MINOR           0xFF
+#define MA_PICO_OFFSETS_KEY_MAX_BUILD           0xFFFFFF
+#define MA_PICO_OFFSETS_KEY_MAX_REVISION        0xFFFFF
+
+// Offsets are relative to the kernel image base, which is far smaller than 4GB.
 typedef struct _MA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS {
-    PCSTR Version;
-    PCSTR Architecture;
+    ULONG64 Key;
     struct {
-        ULONG64 PspPicoRegistrationDisabled;
-        ULONG64 PspPicoProviderRoutines;
-        ULONG64 PspCreatePicoProcess;
-        ULONG64 PspCreatePicoThread;
-        ULONG64 PspGetPicoProcessContext;
-        ULONG64 PspGetPicoThreadContext;
-        ULONG64 PspPicoGetContextThreadEx;
-        ULONG64 PspPicoSetContextThreadEx;
-        ULONG64 PspTerminateThreadByPointer;
-        ULONG64 PsResumeThread;
-        ULONG64 PspSetPicoThreadDescriptorBase;
-        ULONG64 PsSuspendThread;
-        ULONG64 PspTerminatePicoProcess;
+        ULONG PspPicoRegistrationDisabled;
+        ULONG PspPicoProviderRoutines;
+        ULONG PspCreatePicoProcess;
+        ULONG PspCreatePicoThread;
+        ULONG PspGetPicoProcessContext;
+        ULONG PspGetPicoThreadContext;
+        ULONG PspPicoGetContextThreadEx;
+        ULONG PspPicoSetContextThreadEx;
+        ULONG PspTerminateThreadByPointer;
+        ULONG PsResumeThread;
+        ULONG PspSetPicoThreadDescriptorBase;
+        ULONG PsSuspendThread;
+        ULONG PspTerminatePicoProcess;
     } Offsets;
 } MA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS, *PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS;
 
-extern const MA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS MaPspPicoProviderRoutinesOffsets[1325];
+// Each build only carries the offsets for its own architecture.
+#if defined(_M_X64)
+#define MA_PICO_OFFSETS_COUNT                   835
+#elif defined(_M_ARM64)
+#define MA_PICO_OFFSETS_COUNT                   484
+#elif defined(_M_IX86)
+#define MA_PICO_OFFSETS_COUNT                   6
+#else
+#define MA_PICO_OFFSETS_COUNT                   0
+#endif
+
+#if MA_PICO_OFFSETS_COUNT > 0
+// Sorted by Key.
+extern const MA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS
+    MaPspPicoProviderRoutinesOffsets[MA_PICO_OFFSETS_COUNT];
+#endif
 
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "picooffsets.h"
+
+// picooffsets_lookup.h
+//
+// Lookup of the generated offsets.
+//
+// Kernel-neutral, also built for user mode with MA_HOST defined.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// PicoSppMakeOffsetsKey
+//
+// Turns "major.minor.build.revision" and an architecture name into a MA_PICO_OFFSETS_KEY.
+BOOLEAN
+    PicoSppMakeOffsetsKey(
+        _In_ PCSTR pVersion,
+        _In_ PCSTR pArchitecture,
+        _Out_ PULONG64 pKey
+    );
+
+// PicoSppFindOffsets
+//
+// Finds the row of MaPspPicoProviderRoutinesOffsets with the key uKey.
+BOOLEAN
+    PicoSppFindOffsets(
+        _In_ ULONG64 uKey,
+        _Out_ PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS* pPOffsets
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -16,11 +16,44 @@ extern "C"
 {
 #endif
 
+typedef enum _PICOSP_LOCATE_METHOD {
+    PicoSpLocateMethodNone,
+    // Known offsets from the NT kernel base.
+    PicoSpLocateMethodOffsets,
+    // Scanning the .data section of the NT kernel.
+    PicoSpLocateMethodScan,
+    // The result of one of the above, persisted by an earlier boot on the same kernel build.
+    PicoSpLocateMethodCache
+} PICOSP_LOCATE_METHOD, *PPICOSP_LOCATE_METHOD;
+
+/// <summary>
+/// Opens the offset cache under the service key and loads the values that were saved for the
+/// running kernel build. Values of other builds are discarded. Without a cache, every lookup
+/// below does its full discovery.
+/// </summary>
+NTSTATUS
+    PicoSppLoadCache(
+        _In_ PCUNICODE_STRING RegistryPath
+    );
+
+VOID
+    PicoSppCloseCache();
+
 NTSTATUS
     PicoSppLocateProviderRoutines(
         _Out_ PPS_PICO_PROVIDER_ROUTINES* pPpr
     );
 
+/// <summary>
+/// Reports the method that located the provider routines and the total time spent in uncached
+/// lookups, in performance counter ticks.
+/// </summary>
+VOID
+    PicoSppQueryLocateProfile(
+        _Out_ PICOSP_LOCATE_METHOD* pMethod,
+        _Out_ PLONG64 pTicks
+    );
+
 NTSTATUS
     PicoSppLocateRoutines(
         _Out_ PPS_PICO_ROUTINES* pPr
@@ -6,6 +6,8 @@
 
 #include <ntifs.h>
 
+#include "monika.h"
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -47,7 +49,11 @@ typedef struct _RL_FILE {
     FAST_MUTEX  Lock;
     SIZE_T      Length;
     SIZE_T      Offset;
-    CHAR        Data[2048];
+    // Set by RlIoctlEventSubscribe, ended by RlpFileClose.
+    PVOID       EventSubscription;
+    // Counted by RlIoctlCountersMap, released by RlpFileClose.
+    volatile LONG CountersViews;
+    CHAR        Data[4096];
 } RL_FILE, *PRL_FILE;
 
 //
@@ -59,6 +65,11 @@ NTSTATUS
         _Out_ PRL_FILE pPFile
     );
 
+VOID
+    RlpFileClose(
+        _Inout_ PRL_FILE pFile
+    );
+
 NTSTATUS
     RlpFileRead(
         _Inout_ PRL_FILE pFile,
@@ -77,11 +88,25 @@ NTSTATUS
         _Out_opt_ PSIZE_T pBytesTransferred
     );
 
+// szLength is the number of bytes of pData that may be both read and written. Requests too
+// small for their ioctl fail with STATUS_BUFFER_TOO_SMALL.
 NTSTATUS
     RlpFileIoctl(
         _Inout_ PRL_FILE pFile,
         _In_ ULONG ulCode,
-        _Inout_ PVOID pData
+        _Inout_updates_bytes_(szLength) PVOID pData,
+        _In_ SIZE_T szLength
+    );
+
+// Same as RlIoctlPicoStartSession, but returns STATUS_PENDING without waiting for the session
+// when the provider supports it. pCompletion is then called when the session ends. Sessions of
+// other providers are waited for, and their status is returned directly.
+NTSTATUS
+    RlpFileStartSessionAsync(
+        _Inout_ PRL_FILE pFile,
+        _In_ PVOID pData,
+        _In_ PMA_PICO_SESSION_COMPLETION pCompletion,
+        _In_opt_ PVOID pCompletionContext
     );
 
 NTSTATUS
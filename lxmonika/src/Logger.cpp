@@ -2,8 +2,48 @@
 
 #include <ntstrsafe.h>
 
-LONG Logger::_Initialized = 0;
-FAST_MUTEX Logger::_Mutex;
+#include "AutoResource.h"
+#include "Locker.h"
+
+#define LOGGER_TAG ('gLaM')
+
+static_assert((LOGGER_RING_SIZE & (LOGGER_RING_SIZE - 1)) == 0,
+    "LOGGER_RING_SIZE must be a power of two");
+
+struct Logger::_Record
+{
+    // Position of the record in its ring plus one, or zero while the record is being written.
+    volatile LONG64 State;
+    // Global message number, starting from 1.
+    LONG64 Sequence;
+    SIZE_T Length;
+    char Text[LOGGER_MESSAGE_SIZE];
+};
+
+struct DECLSPEC_CACHEALIGN Logger::_Ring
+{
+    // Next position to be written.
+    volatile LONG64 Head;
+    // Next position to be flushed. Only touched by the flusher.
+    DECLSPEC_CACHEALIGN LONG64 Tail;
+    _Record Records[LOGGER_RING_SIZE];
+};
+
+Logger::_Ring* volatile Logger::_Rings = NULL;
+ULONG Logger::_RingsCount = 0;
+volatile LONG64 Logger::_Sequence = 0;
+KDPC Logger::_FlushDpc;
+volatile LONG Logger::_Flushing = FALSE;
+volatile LONG Logger::_FlushRequested = FALSE;
+
+volatile LONG Logger::_Level = (LONG)LOGGER_MINIMUM_LEVEL;
+LogLevel Logger::_DefaultLevel = LOGGER_MINIMUM_LEVEL;
+LogFilter Logger::_Filters[LOGGER_FILTER_MAX];
+ULONG Logger::_FiltersCount = 0;
+volatile LONG Logger::_FiltersVersion = 0;
+
+// Serializes filter writers. Never taken when logging.
+static PushLock LoggerFiltersLock;
 
 #define WRITE(format, ...)                              \
     DbgPrintEx(                                         \
@@ -15,17 +55,386 @@ FAST_MUTEX Logger::_Mutex;
         __VA_ARGS__                                     \
     );
 
+//
+// Lifetime
+//
+
+NTSTATUS
+Logger::Initialize()
+{
+    if (_Rings != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    KeInitializeDpc(&_FlushDpc, _Flush, NULL);
+
+    ULONG count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    // Nonpaged, since messages may be committed at any IRQL.
+    _Ring* rings = (_Ring*)ExAllocatePool2(POOL_FLAG_NON_PAGED, count * sizeof(_Ring),
+        LOGGER_TAG);
+
+    if (rings == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    _RingsCount = count;
+    InterlockedExchangePointer((PVOID volatile*)&_Rings, rings);
+
+    return STATUS_SUCCESS;
+}
+
+void
+Logger::Cleanup()
+{
+    _Ring* rings = (_Ring*)InterlockedExchangePointer((PVOID volatile*)&_Rings, NULL);
+
+    if (rings == NULL)
+    {
+        return;
+    }
+
+    KeRemoveQueueDpc(&_FlushDpc);
+    KeFlushQueuedDpcs();
+
+    // Whatever the DPC did not get to.
+    _Drain(rings);
+
+    ExFreePoolWithTag(rings, LOGGER_TAG);
+}
+
+//
+// Filtering
+//
+
+static
+bool
+LoggerMatchName(const char* pattern, const char* name, bool ignoreCase)
+{
+    for (SIZE_T i = 0; i < LOGGER_FILTER_NAME_SIZE; ++i)
+    {
+        char p = pattern[i];
+        char n = name[i];
+
+        if (p == '*' && (i + 1 == LOGGER_FILTER_NAME_SIZE || pattern[i + 1] == '\0'))
+        {
+            return true;
+        }
+
+        if (ignoreCase)
+        {
+            p = (p >= 'A' && p <= 'Z') ? p - 'A' + 'a' : p;
+            n = (n >= 'A' && n <= 'Z') ? n - 'A' + 'a' : n;
+        }
+
+        if (p != n)
+        {
+            return false;
+        }
+
+        if (p == '\0')
+        {
+            return true;
+        }
+    }
+
+    // Patterns are always null-terminated, so the name is longer than the pattern.
+    return false;
+}
+
 bool
-Logger::_Log(LogLevel level, const char* file, int line, const char* function)
+Logger::_IsEnabled(LogLevel level, const char* file, const char* function)
 {
-    if (level < LOGGER_MINIMUM_LEVEL)
+    // Seqlock read. Never spins, since the writer may be on this very processor: while the
+    // filters are changing, messages that passed the _Level check are let through.
+    LONG version = ReadAcquire(&_FiltersVersion);
+    if (version & 1)
+    {
+        return true;
+    }
+
+    LogLevel minimum = _DefaultLevel;
+
+    for (ULONG i = 0; i < _FiltersCount && i < LOGGER_FILTER_MAX; ++i)
+    {
+        const LogFilter& filter = _Filters[i];
+        if ((filter.File[0] == '\0' || LoggerMatchName(filter.File, file, true))
+            && (filter.Function[0] == '\0' || LoggerMatchName(filter.Function, function, false)))
+        {
+            minimum = filter.Level;
+            break;
+        }
+    }
+
+    MemoryBarrier();
+
+    if (ReadAcquire(&_FiltersVersion) != version)
+    {
+        return true;
+    }
+
+    return level >= minimum;
+}
+
+NTSTATUS
+Logger::SetFilters(LogLevel defaultLevel, const LogFilter* filters, ULONG count)
+{
+    if (count > LOGGER_FILTER_MAX || (count != 0 && filters == NULL)
+        || defaultLevel > LogLevel::None)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    LONG level = (LONG)defaultLevel;
+    for (ULONG i = 0; i < count; ++i)
+    {
+        if (filters[i].Level > LogLevel::None)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        level = min(level, (LONG)filters[i].Level);
+    }
+
+    Locker<PushLock> lock(&LoggerFiltersLock);
+
+    // Readers never wait for the writer, but keep the window where they skip filtering short.
+    KIRQL oldIrql;
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+
+    InterlockedIncrement(&_FiltersVersion);
+
+    _DefaultLevel = defaultLevel;
+    _FiltersCount = count;
+    for (ULONG i = 0; i < count; ++i)
+    {
+        _Filters[i] = filters[i];
+        _Filters[i].File[LOGGER_FILTER_NAME_SIZE - 1] = '\0';
+        _Filters[i].Function[LOGGER_FILTER_NAME_SIZE - 1] = '\0';
+    }
+
+    InterlockedIncrement(&_FiltersVersion);
+
+    KeLowerIrql(oldIrql);
+
+    InterlockedExchange(&_Level, level);
+
+    return STATUS_SUCCESS;
+}
+
+void
+Logger::QueryFilters(LogLevel* defaultLevel, LogFilter* filters, ULONG* count)
+{
+    Locker<PushLock> lock(&LoggerFiltersLock);
+
+    *defaultLevel = _DefaultLevel;
+    *count = _FiltersCount;
+    RtlCopyMemory(filters, _Filters, _FiltersCount * sizeof(LogFilter));
+}
+
+static
+bool
+LoggerParseLevel(const char* str, LogLevel* level)
+{
+    static const char* const names[] = { "trace", "info", "warning", "error", "none" };
+
+    if (str[0] >= '0' && str[0] <= '0' + (int)LogLevel::None && str[1] == '\0')
+    {
+        *level = (LogLevel)(str[0] - '0');
+        return true;
+    }
+
+    for (SIZE_T i = 0; i < ARRAYSIZE(names); ++i)
+    {
+        if (_stricmp(str, names[i]) == 0)
+        {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static
+bool
+LoggerParseFilter(PCWSTR str, SIZE_T length, LogFilter* filter)
+{
+    // "file[:function]=level"
+    char narrow[LOGGER_FILTER_NAME_SIZE * 3];
+    if (length >= sizeof(narrow))
     {
         return false;
     }
 
-    // TODO: File name check.
+    for (SIZE_T i = 0; i < length; ++i)
+    {
+        if (str[i] > 0x7F)
+        {
+            return false;
+        }
+        narrow[i] = (char)str[i];
+    }
+    narrow[length] = '\0';
 
-    _Lock();
+    char* levelStr = strchr(narrow, '=');
+    if (levelStr == NULL)
+    {
+        return false;
+    }
+    *levelStr++ = '\0';
+
+    char* functionStr = strchr(narrow, ':');
+    if (functionStr != NULL)
+    {
+        *functionStr++ = '\0';
+    }
+
+    RtlZeroMemory(filter, sizeof(*filter));
+
+    return LoggerParseLevel(levelStr, &filter->Level)
+        && NT_SUCCESS(RtlStringCbCopyA(filter->File, sizeof(filter->File), narrow))
+        && (functionStr == NULL
+            || NT_SUCCESS(RtlStringCbCopyA(filter->Function, sizeof(filter->Function),
+                functionStr)));
+}
+
+NTSTATUS
+Logger::LoadFilters(PCUNICODE_STRING registryPath)
+{
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(
+        &objectAttributes,
+        (PUNICODE_STRING)registryPath,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+    );
+
+    HANDLE hdlKey = NULL;
+    NTSTATUS status = ZwOpenKey(&hdlKey, KEY_READ, &objectAttributes);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+    AUTO_RESOURCE(hdlKey, ZwClose);
+
+    LogLevel defaultLevel = _DefaultLevel;
+
+    {
+        UNICODE_STRING strName = RTL_CONSTANT_STRING(L"LogLevel");
+        UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD)];
+        PKEY_VALUE_PARTIAL_INFORMATION pInfo = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+        ULONG ulLength = 0;
+
+        if (NT_SUCCESS(ZwQueryValueKey(hdlKey, &strName, KeyValuePartialInformation,
+                pInfo, sizeof(buffer), &ulLength))
+            && pInfo->Type == REG_DWORD
+            && pInfo->DataLength == sizeof(DWORD)
+            && *(DWORD*)pInfo->Data <= (DWORD)LogLevel::None)
+        {
+            defaultLevel = (LogLevel)*(DWORD*)pInfo->Data;
+        }
+    }
+
+    LogFilter filters[LOGGER_FILTER_MAX];
+    ULONG count = 0;
+
+    {
+        UNICODE_STRING strName = RTL_CONSTANT_STRING(L"LogFilters");
+        ULONG ulLength = 0;
+
+        status = ZwQueryValueKey(hdlKey, &strName, KeyValuePartialInformation,
+            NULL, 0, &ulLength);
+
+        if (status == STATUS_BUFFER_TOO_SMALL || status == STATUS_BUFFER_OVERFLOW)
+        {
+            PKEY_VALUE_PARTIAL_INFORMATION pInfo = (PKEY_VALUE_PARTIAL_INFORMATION)
+                ExAllocatePool2(PagedPool, ulLength, LOGGER_TAG);
+
+            if (pInfo == NULL)
+            {
+                return STATUS_NO_MEMORY;
+            }
+            AUTO_RESOURCE(pInfo, [](auto p) { ExFreePoolWithTag(p, LOGGER_TAG); });
+
+            if (NT_SUCCESS(ZwQueryValueKey(hdlKey, &strName, KeyValuePartialInformation,
+                    pInfo, ulLength, &ulLength))
+                && pInfo->Type == REG_MULTI_SZ)
+            {
+                PCWSTR pStr = (PCWSTR)pInfo->Data;
+                SIZE_T uChars = pInfo->DataLength / sizeof(WCHAR);
+                SIZE_T uStart = 0;
+
+                for (SIZE_T i = 0; i < uChars && count < LOGGER_FILTER_MAX; ++i)
+                {
+                    if (pStr[i] != L'\0')
+                    {
+                        continue;
+                    }
+
+                    if (i > uStart)
+                    {
+                        if (LoggerParseFilter(pStr + uStart, i - uStart, &filters[count]))
+                        {
+                            ++count;
+                        }
+                        else
+                        {
+                            WRITE("Logger: Ignoring malformed filter %.*ws\n",
+                                (int)(i - uStart), pStr + uStart);
+                        }
+                    }
+
+                    uStart = i + 1;
+                }
+            }
+        }
+    }
+
+    return SetFilters(defaultLevel, filters, count);
+}
+
+//
+// Message formatting
+//
+
+void
+Logger::_Append(_Message& message, const char* format, ...)
+{
+    // Always leave room for the null terminator.
+    SIZE_T sizeLeft = sizeof(message.Buffer) - 1 - message.Length;
+
+    if (sizeLeft == 0)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int len = _vsnprintf(message.Buffer + message.Length, sizeLeft, format, args);
+    va_end(args);
+
+    // Truncated.
+    if (len < 0 || (SIZE_T)len > sizeLeft)
+    {
+        len = (int)sizeLeft;
+    }
+
+    message.Length += len;
+}
+
+bool
+Logger::_Begin(_Message& message, LogLevel level, const char* file, int line,
+    const char* function)
+{
+    if (!_IsEnabled(level, file, function))
+    {
+        return false;
+    }
+
+    message.Length = 0;
 
     const char* levelStr = "???";
 
@@ -45,125 +454,281 @@ Logger::_Log(LogLevel level, const char* file, int line, const char* function)
         break;
     }
 
-    WRITE("%s ", levelStr);
+    // file is already the base name, see the Log* macros.
+    const int COLUMN_WIDTH = 32;
+
+    char buffer[COLUMN_WIDTH + 1];
+    _snprintf(buffer, COLUMN_WIDTH, "%s:%i", file, line);
+    buffer[COLUMN_WIDTH] = '\0';
+
+    _Append(message, "%s %-*s%-*.*s", levelStr, COLUMN_WIDTH, buffer,
+        COLUMN_WIDTH, COLUMN_WIDTH, function);
 
-    // Extract name from file path.
-    size_t pathLength = strlen(file);
-    int lastComponent = (int)pathLength;
-    while (lastComponent >= 0 && file[lastComponent] != '\\')
+    return true;
+}
+
+void
+Logger::_Commit(_Message& message)
+{
+    // A truncated message still ends its line.
+    if (message.Length == sizeof(message.Buffer) - 1)
     {
-        --lastComponent;
+        message.Buffer[message.Length - 1] = '\n';
     }
-    file = file + lastComponent + 1;
+    message.Buffer[message.Length] = '\0';
 
-    const int COLUMN_WIDTH = 32;
+    _Ring* rings = _Rings;
 
-    char buffer[COLUMN_WIDTH + 1];
-    int len = _snprintf(buffer, COLUMN_WIDTH, "%s:%i", file, line);
-    for (int i = len; i < COLUMN_WIDTH; ++i)
+    if (rings == NULL)
     {
-        buffer[i] = ' ';
+        // Still a single call, so messages from different threads do not interleave.
+        WRITE("%s", message.Buffer);
+        return;
     }
-    buffer[COLUMN_WIDTH] = '\0';
-    WRITE("%s", buffer);
 
-    len = _snprintf(buffer, COLUMN_WIDTH, "%s", function);
-    for (int i = len; i < COLUMN_WIDTH; ++i)
+    // Keep the record from being left half-written while this thread is preempted. Only
+    // interrupts may delay the record from now on, and they are short.
+    KIRQL oldIrql = KeGetCurrentIrql();
+    if (oldIrql < DISPATCH_LEVEL)
     {
-        buffer[i] = ' ';
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
     }
-    buffer[COLUMN_WIDTH] = '\0';
-    WRITE("%s", buffer);
 
-    return true;
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (processor < _RingsCount)
+    {
+        _Ring* ring = &rings[processor];
+        LONG64 position = InterlockedIncrement64(&ring->Head) - 1;
+        _Record* record = &ring->Records[position & (LOGGER_RING_SIZE - 1)];
+
+        InterlockedExchange64(&record->State, 0);
+
+        record->Sequence = InterlockedIncrement64(&_Sequence);
+        record->Length = message.Length;
+        RtlCopyMemory(record->Text, message.Buffer, message.Length + 1);
+
+        InterlockedExchange64(&record->State, position + 1);
+
+        // Does nothing if the flush is already queued.
+        KeInsertQueueDpc(&_FlushDpc, NULL, NULL);
+    }
+    else
+    {
+        WRITE("%s", message.Buffer);
+    }
+
+    if (oldIrql < DISPATCH_LEVEL)
+    {
+        KeLowerIrql(oldIrql);
+    }
 }
 
+//
+// Flushing and reading
+//
+
 void
-Logger::_Lock()
+Logger::_Drain(_Ring* rings)
 {
-    if (InterlockedCompareExchange(&_Initialized, 1, 0))
+    for (ULONG i = 0; i < _RingsCount; ++i)
     {
-        LARGE_INTEGER lInt
+        _Ring* ring = &rings[i];
+        LONG64 head = ReadAcquire64(&ring->Head);
+
+        if (head - ring->Tail > LOGGER_RING_SIZE)
         {
-            .QuadPart = -100000
-        };
-        while (_Initialized == 1)
+            WRITE("Logger: %lld messages lost on processor %u\n",
+                head - LOGGER_RING_SIZE - ring->Tail, i);
+            ring->Tail = head - LOGGER_RING_SIZE;
+        }
+
+        while (ring->Tail < head)
         {
-            KeDelayExecutionThread(KernelMode, FALSE, &lInt);
+            _Record* record = &ring->Records[ring->Tail & (LOGGER_RING_SIZE - 1)];
+            LONG64 expected = ring->Tail + 1;
+            LONG64 state = ReadAcquire64(&record->State);
+
+            if (state == 0 || state < expected)
+            {
+                // Still being written. Its writer queues another flush when done.
+                break;
+            }
+
+            if (state == expected)
+            {
+                char text[LOGGER_MESSAGE_SIZE];
+                RtlCopyMemory(text, record->Text, sizeof(text));
+                MemoryBarrier();
+
+                if (ReadAcquire64(&record->State) == expected)
+                {
+                    text[sizeof(text) - 1] = '\0';
+                    WRITE("%s", text);
+                }
+            }
+
+            ++ring->Tail;
         }
     }
-    else
+}
+
+void
+Logger::_Flush(PKDPC dpc, PVOID context, PVOID argument1, PVOID argument2)
+{
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(argument1);
+    UNREFERENCED_PARAMETER(argument2);
+
+    // The DPC may be queued again, and run on another processor, while it is still running here.
+    // Only one instance drains the rings. The others leave a request for it.
+    InterlockedExchange(&_FlushRequested, TRUE);
+
+    while (InterlockedCompareExchange(&_Flushing, TRUE, FALSE) == FALSE)
     {
-        // Won the race.
-        ExInitializeFastMutex(&_Mutex);
-        _Initialized = 2;
-    }
+        while (InterlockedExchange(&_FlushRequested, FALSE))
+        {
+            _Ring* rings = _Rings;
+            if (rings != NULL)
+            {
+                _Drain(rings);
+            }
+        }
 
-    ExAcquireFastMutex(&_Mutex);
+        InterlockedExchange(&_Flushing, FALSE);
+
+        if (!_FlushRequested)
+        {
+            break;
+        }
+    }
 }
 
-void
-Logger::_Unlock()
+SIZE_T
+Logger::Read(ULONG64* sequence, char* buffer, SIZE_T length)
 {
-    ExReleaseFastMutex(&_Mutex);
+    _Ring* rings = _Rings;
+    SIZE_T written = 0;
+
+    if (rings == NULL)
+    {
+        return 0;
+    }
+
+    for (;;)
+    {
+        // Pick the oldest message not yet returned. Messages are only ordered within a ring, so
+        // every ring has to be searched.
+        _Record oldest;
+        oldest.Sequence = MAXLONG64;
+
+        for (ULONG i = 0; i < _RingsCount; ++i)
+        {
+            for (SIZE_T j = 0; j < LOGGER_RING_SIZE; ++j)
+            {
+                _Record* record = &rings[i].Records[j];
+                LONG64 state = ReadAcquire64(&record->State);
+                LONG64 recordSequence = record->Sequence;
+
+                if (state == 0
+                    || recordSequence < (LONG64)*sequence
+                    || recordSequence >= oldest.Sequence)
+                {
+                    continue;
+                }
+
+                _Record candidate;
+                RtlCopyMemory(&candidate, record, sizeof(candidate));
+                MemoryBarrier();
+
+                // Otherwise overwritten while being copied.
+                if (ReadAcquire64(&record->State) == state)
+                {
+                    RtlCopyMemory(&oldest, &candidate, sizeof(oldest));
+                }
+            }
+        }
+
+        if (oldest.Sequence == MAXLONG64)
+        {
+            break;
+        }
+
+        SIZE_T textLength = min(oldest.Length, sizeof(oldest.Text));
+        if (written + textLength > length)
+        {
+            break;
+        }
+
+        RtlCopyMemory(buffer + written, oldest.Text, textLength);
+        written += textLength;
+        *sequence = (ULONG64)oldest.Sequence + 1;
+    }
+
+    return written;
 }
 
+//
+// Printers
+//
+
 void
-Logger::_Print(bool b)
+Logger::_Print(_Message& message, bool b)
 {
-    WRITE("%s", b ? "true" : "false");
+    _Append(message, "%s", b ? "true" : "false");
 }
 
 void
-Logger::_Print(WORD w)
+Logger::_Print(_Message& message, WORD w)
 {
-    WRITE("%hu", w);
+    _Append(message, "%hu", w);
 }
 
 void
-Logger::_Print(DWORD dw)
+Logger::_Print(_Message& message, DWORD dw)
 {
-    WRITE("%u", dw);
+    _Append(message, "%u", dw);
 }
 
 void
-Logger::_Print(ULONGLONG ull)
+Logger::_Print(_Message& message, ULONGLONG ull)
 {
-    WRITE("%llu", ull);
+    _Append(message, "%llu", ull);
 }
 
 void
-Logger::_Print(INT i)
+Logger::_Print(_Message& message, INT i)
 {
-    WRITE("%i", i);
+    _Append(message, "%i", i);
 }
 
 void
-Logger::_Print(UINT i)
+Logger::_Print(_Message& message, UINT i)
 {
-    WRITE("%u", i);
+    _Append(message, "%u", i);
 }
 
 void
-Logger::_Print(PSTR pStr)
+Logger::_Print(_Message& message, PSTR pStr)
 {
-    WRITE("%s", pStr);
+    _Append(message, "%s", pStr);
 }
 
 void
-Logger::_Print(PCSTR pcStr)
+Logger::_Print(_Message& message, PCSTR pcStr)
 {
-    WRITE("%s", pcStr);
+    _Append(message, "%s", pcStr);
 }
 
 void
-Logger::_Print(PUCHAR pcuStr)
+Logger::_Print(_Message& message, PUCHAR pcuStr)
 {
-    WRITE("%s", (const char*)pcuStr);
+    _Append(message, "%s", (const char*)pcuStr);
 }
 
 void
-Logger::_Print(PVOID p)
+Logger::_Print(_Message& message, PVOID p)
 {
-    WRITE("%p", p);
+    _Append(message, "%p", p);
 }
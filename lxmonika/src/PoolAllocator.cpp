@@ -1,11 +1,12 @@
 #include "PoolAllocator.h"
 
-#include "compat.h"
+#include "monika.h"
 
 PoolAllocator::PoolAllocator(POOL_TYPE poolType, SIZE_T size, ULONG tag)
+    : m_poolType(poolType), m_tag(tag)
 {
-    m_ptr = ExAllocatePool2(poolType, size, tag);
-    m_tag = tag;
+    // The whole chunk belongs to the first block. Later allocations start a new one.
+    m_ptr = AllocateChunk(size);
 }
 
 PoolAllocator::PoolAllocator(SIZE_T size, ULONG tag)
@@ -14,13 +15,135 @@ PoolAllocator::PoolAllocator(SIZE_T size, ULONG tag)
 
 }
 
+PoolAllocator::PoolAllocator(PoolAllocator&& other)
+{
+    *this = (PoolAllocator&&)other;
+}
+
 PoolAllocator::~PoolAllocator()
 {
-    PVOID ptr = NULL;
-    ptr = InterlockedExchangePointer(&m_ptr, ptr);
+    Release();
+}
+
+PoolAllocator&
+PoolAllocator::operator=(PoolAllocator&& other)
+{
+    if (this != &other)
+    {
+        Release();
+
+        m_chunks = other.m_chunks;
+        m_ptr = other.m_ptr;
+        m_cursor = other.m_cursor;
+        m_limit = other.m_limit;
+        m_chunkSize = other.m_chunkSize;
+        m_poolType = other.m_poolType;
+        m_tag = other.m_tag;
+
+        other.m_chunks = NULL;
+        other.m_ptr = NULL;
+        other.m_cursor = NULL;
+        other.m_limit = NULL;
+    }
+
+    return *this;
+}
+
+PoolAllocator
+PoolAllocator::Arena(SIZE_T chunkSize, ULONG tag, POOL_TYPE poolType)
+{
+    PoolAllocator arena;
+    arena.m_chunkSize = chunkSize;
+    arena.m_poolType = poolType;
+    arena.m_tag = tag;
+    return arena;
+}
+
+PVOID
+PoolAllocator::AllocateChunk(SIZE_T size)
+{
+    if (size > MAXSIZE_T - sizeof(Chunk))
+    {
+        return NULL;
+    }
+
+    Chunk* pChunk = (Chunk*)MapAllocatePool(m_poolType, sizeof(Chunk) + size, m_tag);
+    if (pChunk == NULL)
+    {
+        return NULL;
+    }
+
+    pChunk->Next = m_chunks;
+    pChunk->Size = size;
+    m_chunks = pChunk;
+
+    return pChunk + 1;
+}
+
+PVOID
+PoolAllocator::Allocate(SIZE_T size, SIZE_T alignment)
+{
+    PUCHAR pBlock;
+
+    if (m_cursor != NULL)
+    {
+        pBlock = (PUCHAR)ALIGN_UP_POINTER_BY(m_cursor, alignment);
+
+        if (pBlock <= m_limit && size <= (SIZE_T)(m_limit - pBlock))
+        {
+            m_cursor = pBlock + size;
+            return pBlock;
+        }
+    }
+
+    // Chunk data is aligned to MEMORY_ALLOCATION_ALIGNMENT, stricter alignments need slack.
+    SIZE_T uSlack = alignment > MEMORY_ALLOCATION_ALIGNMENT ? alignment : 0;
+
+    if (size > MAXSIZE_T - uSlack)
+    {
+        return NULL;
+    }
+
+    if (size + uSlack > m_chunkSize)
+    {
+        // The cursor stays in the current chunk.
+        PVOID pData = AllocateChunk(size + uSlack);
+        if (pData == NULL)
+        {
+            return NULL;
+        }
+
+        return ALIGN_UP_POINTER_BY(pData, alignment);
+    }
+
+    PUCHAR pData = (PUCHAR)AllocateChunk(m_chunkSize);
+    if (pData == NULL)
+    {
+        return NULL;
+    }
+
+    // Only reached when size + uSlack fits in a chunk.
+    pBlock = (PUCHAR)ALIGN_UP_POINTER_BY(pData, alignment);
+    m_cursor = pBlock + size;
+    m_limit = pData + m_chunkSize;
+
+    return pBlock;
+}
+
+VOID
+PoolAllocator::Release()
+{
+    Chunk* pChunk = m_chunks;
 
-    if (ptr != NULL)
+    while (pChunk != NULL)
     {
-        ExFreePoolWithTag(ptr, m_tag);
+        Chunk* pNext = pChunk->Next;
+        MapFreePool(pChunk, sizeof(Chunk) + pChunk->Size, m_tag);
+        pChunk = pNext;
     }
+
+    m_chunks = NULL;
+    m_ptr = NULL;
+    m_cursor = NULL;
+    m_limit = NULL;
 }
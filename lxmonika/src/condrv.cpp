@@ -2,7 +2,15 @@
 
 #include "monika.h"
 
+#include "os.h"
+
 #include "AutoResource.h"
+#include "Locker.h"
+
+#define CD_BROKER_TAG ('cBaM')
+
+// Hosts past this many are served without caching.
+#define CD_BROKER_MAX_HOSTS (64)
 
 //
 // ConDrv support functions.
@@ -190,3 +198,321 @@ CdpKernelConsoleOpenHandles(
 
     return STATUS_SUCCESS;
 }
+
+extern "C"
+NTSTATUS
+CdpKernelConsoleGetMode(
+    _In_ HANDLE hdlConsole,
+    _In_ HANDLE hdlObject,
+    _Out_ PULONG pMode
+)
+{
+    // Same layout as the requests kernelbase sends: The header and the body go in, the body
+    // alone comes back.
+    CONSOLE_MSG_L1 msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.ApiNumber = ConsolepGetMode;
+    msg.ApiDescriptorSize = sizeof(msg.u.GetConsoleMode);
+
+    struct
+    {
+        CD_USER_DEFINED_IO Header;
+        CD_IO_BUFFER Output;
+    } ioRequest =
+    {
+        .Header =
+        {
+            .Client = hdlObject,
+            .InputCount = 1,
+            .OutputCount = 1,
+            .Buffers =
+            {
+                {
+                    .Size = sizeof(CONSOLE_MSG_HEADER) + sizeof(msg.u.GetConsoleMode),
+                    .Buffer = &msg
+                }
+            }
+        },
+        .Output =
+        {
+            .Size = sizeof(msg.u.GetConsoleMode),
+            .Buffer = &msg.u.GetConsoleMode
+        }
+    };
+
+    static_assert(FIELD_OFFSET(decltype(ioRequest), Output)
+        == FIELD_OFFSET(CD_USER_DEFINED_IO, Buffers) + sizeof(CD_IO_BUFFER));
+
+    IO_STATUS_BLOCK ioStatus;
+    MA_RETURN_IF_FAIL(ZwDeviceIoControlFile(
+        hdlConsole,
+        NULL,
+        NULL,
+        NULL,
+        &ioStatus,
+        IOCTL_CONDRV_ISSUE_USER_IO,
+        &ioRequest,
+        sizeof(ioRequest),
+        NULL,
+        0
+    ));
+
+    *pMode = msg.u.GetConsoleMode.Mode;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Console broker
+//
+// Attaching to a console and opening its handles costs a few round trips to condrv. Keep one
+// set of kernel handles per host process and hand out duplicates instead. The cached handles
+// also keep condrv from cleaning up the connection while duplicates of them come and go.
+//
+
+typedef struct _CD_HOST_CONSOLE {
+    LIST_ENTRY              Link;
+    // Referenced, so that the pointer cannot be reused by another process.
+    PEPROCESS               HostProcess;
+    HANDLE                  Console;
+    HANDLE                  Input;
+    HANDLE                  Output;
+} CD_HOST_CONSOLE, *PCD_HOST_CONSOLE;
+
+static LIST_ENTRY CdpHostConsoles = { &CdpHostConsoles, &CdpHostConsoles };
+static SIZE_T CdpHostConsolesCount = 0;
+static BOOLEAN CdpProcessNotifyRegistered = FALSE;
+static PushLock CdpHostConsolesLock;
+
+static
+VOID
+CdpFreeHostConsole(
+    _In_ PCD_HOST_CONSOLE pEntry
+)
+{
+    if (pEntry->Output != NULL)
+    {
+        ZwClose(pEntry->Output);
+    }
+    if (pEntry->Input != NULL)
+    {
+        ZwClose(pEntry->Input);
+    }
+    if (pEntry->Console != NULL)
+    {
+        ZwClose(pEntry->Console);
+    }
+    ObDereferenceObject(pEntry->HostProcess);
+    MapFreePool(pEntry, sizeof(CD_HOST_CONSOLE), CD_BROKER_TAG);
+}
+
+static
+PCD_HOST_CONSOLE
+CdpFindHostConsole(
+    _In_ PEPROCESS pHostProcess
+)
+{
+    for (PLIST_ENTRY pLink = CdpHostConsoles.Flink; pLink != &CdpHostConsoles;
+        pLink = pLink->Flink)
+    {
+        PCD_HOST_CONSOLE pEntry = CONTAINING_RECORD(pLink, CD_HOST_CONSOLE, Link);
+        if (pEntry->HostProcess == pHostProcess)
+        {
+            return pEntry;
+        }
+    }
+
+    return NULL;
+}
+
+static
+VOID
+CdpConsoleBrokerProcessNotify(
+    _In_ HANDLE hdlParentId,
+    _In_ HANDLE hdlProcessId,
+    _In_ BOOLEAN bCreate
+)
+{
+    UNREFERENCED_PARAMETER(hdlParentId);
+
+    if (bCreate)
+    {
+        return;
+    }
+
+    PCD_HOST_CONSOLE pEntry = NULL;
+
+    {
+        Locker<PushLock> lock(&CdpHostConsolesLock);
+
+        for (PLIST_ENTRY pLink = CdpHostConsoles.Flink; pLink != &CdpHostConsoles;
+            pLink = pLink->Flink)
+        {
+            PCD_HOST_CONSOLE pCurrent = CONTAINING_RECORD(pLink, CD_HOST_CONSOLE, Link);
+            if (PsGetProcessId(pCurrent->HostProcess) == hdlProcessId)
+            {
+                RemoveEntryList(&pCurrent->Link);
+                --CdpHostConsolesCount;
+                pEntry = pCurrent;
+                break;
+            }
+        }
+    }
+
+    if (pEntry != NULL)
+    {
+        CdpFreeHostConsole(pEntry);
+    }
+}
+
+static
+NTSTATUS
+CdpDuplicateHostConsole(
+    _In_ PCD_HOST_CONSOLE pEntry,
+    _Out_opt_ PHANDLE pHdlConsole,
+    _Out_opt_ PHANDLE pHdlInput,
+    _Out_opt_ PHANDLE pHdlOutput
+)
+{
+    HANDLE hdlConsole = NULL;
+    AUTO_RESOURCE(hdlConsole, ZwClose);
+    HANDLE hdlInput = NULL;
+    AUTO_RESOURCE(hdlInput, ZwClose);
+    HANDLE hdlOutput = NULL;
+    AUTO_RESOURCE(hdlOutput, ZwClose);
+
+    if (pHdlConsole != NULL)
+    {
+        MA_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(pEntry->Console, &hdlConsole));
+    }
+    if (pHdlInput != NULL)
+    {
+        MA_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(pEntry->Input, &hdlInput));
+    }
+    if (pHdlOutput != NULL)
+    {
+        MA_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(pEntry->Output, &hdlOutput));
+    }
+
+    if (pHdlConsole != NULL)
+    {
+        *pHdlConsole = hdlConsole;
+        hdlConsole = NULL;
+    }
+    if (pHdlInput != NULL)
+    {
+        *pHdlInput = hdlInput;
+        hdlInput = NULL;
+    }
+    if (pHdlOutput != NULL)
+    {
+        *pHdlOutput = hdlOutput;
+        hdlOutput = NULL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+CdpGetHostConsole(
+    _In_ PEPROCESS pHostProcess,
+    _Out_opt_ PHANDLE pHdlConsole,
+    _Out_opt_ PHANDLE pHdlInput,
+    _Out_opt_ PHANDLE pHdlOutput
+)
+{
+    {
+        CdpHostConsolesLock.LockShared();
+
+        NTSTATUS status = STATUS_NOT_FOUND;
+
+        PCD_HOST_CONSOLE pEntry = CdpFindHostConsole(pHostProcess);
+        if (pEntry != NULL)
+        {
+            status = CdpDuplicateHostConsole(pEntry, pHdlConsole, pHdlInput, pHdlOutput);
+        }
+
+        CdpHostConsolesLock.UnlockShared();
+
+        if (status != STATUS_NOT_FOUND)
+        {
+            return status;
+        }
+    }
+
+    PCD_HOST_CONSOLE pNewEntry = (PCD_HOST_CONSOLE)
+        MapAllocatePool(PagedPool, sizeof(CD_HOST_CONSOLE), CD_BROKER_TAG);
+
+    if (pNewEntry == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    ObReferenceObject(pHostProcess);
+    pNewEntry->HostProcess = pHostProcess;
+    pNewEntry->Console = NULL;
+    pNewEntry->Input = NULL;
+    pNewEntry->Output = NULL;
+
+    AUTO_RESOURCE(pNewEntry, CdpFreeHostConsole);
+
+    MA_RETURN_IF_FAIL(CdpKernelConsoleAttach(PsGetProcessId(pHostProcess),
+        &pNewEntry->Console));
+    MA_RETURN_IF_FAIL(CdpKernelConsoleOpenHandles(pNewEntry->Console,
+        &pNewEntry->Input, &pNewEntry->Output));
+
+    MA_RETURN_IF_FAIL(CdpDuplicateHostConsole(pNewEntry, pHdlConsole, pHdlInput, pHdlOutput));
+
+    Locker<PushLock> lock(&CdpHostConsolesLock);
+
+    // Hosts that are already exiting would never be dropped from the cache. Checked under the
+    // lock, so that an exit notification either sees the new entry or happened before this.
+    if (PsGetProcessExitStatus(pHostProcess) != STATUS_PENDING)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (!CdpProcessNotifyRegistered)
+    {
+        if (!NT_SUCCESS(PsSetCreateProcessNotifyRoutine(CdpConsoleBrokerProcessNotify, FALSE)))
+        {
+            return STATUS_SUCCESS;
+        }
+        CdpProcessNotifyRegistered = TRUE;
+    }
+
+    // Someone else may have cached the same host in the meantime. Theirs wins, ours is freed.
+    if (CdpHostConsolesCount >= CD_BROKER_MAX_HOSTS || CdpFindHostConsole(pHostProcess) != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    InsertTailList(&CdpHostConsoles, &pNewEntry->Link);
+    ++CdpHostConsolesCount;
+    pNewEntry = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+CdpCleanupConsoleBroker()
+{
+    // Waits for running notifications to return.
+    if (CdpProcessNotifyRegistered)
+    {
+        PsSetCreateProcessNotifyRoutine(CdpConsoleBrokerProcessNotify, TRUE);
+        CdpProcessNotifyRegistered = FALSE;
+    }
+
+    Locker<PushLock> lock(&CdpHostConsolesLock);
+
+    while (!IsListEmpty(&CdpHostConsoles))
+    {
+        PLIST_ENTRY pLink = RemoveHeadList(&CdpHostConsoles);
+        CdpFreeHostConsole(CONTAINING_RECORD(pLink, CD_HOST_CONSOLE, Link));
+    }
+
+    CdpHostConsolesCount = 0;
+}
@@ -18,12 +18,52 @@ DriverEntry(
     _In_ PUNICODE_STRING    RegistryPath
 )
 {
-    UNREFERENCED_PARAMETER(RegistryPath);
-
     NTSTATUS status;
 
+    LONG64 iStart = KeQueryPerformanceCounter(NULL).QuadPart;
+    LONG64 iPhaseStart;
+
+    // Without its buffers, the logger still works, just with DbgPrintEx on every message.
+    status = Logger::Initialize();
+
     Logger::LogInfo("Hello World from lxmonika!");
 
+    if (!NT_SUCCESS(status))
+    {
+        Logger::LogWarning("Failed to allocate log buffers, status=", (PVOID)status);
+    }
+
+    // Optional, keeps the compile-time defaults if the service key has no filters.
+    Logger::LoadFilters(RegistryPath);
+
+    // Also optional, events are only written while a trace session enables the provider.
+    status = MapEtwRegister();
+
+    if (!NT_SUCCESS(status))
+    {
+        Logger::LogWarning("Failed to register the ETW provider, status=", (PVOID)status);
+    }
+
+    // Optional as well, the defaults are used if the service key has no options.
+    MapLoadOptions(RegistryPath);
+
+    // The modules we look for are loaded before us. Without the snapshot, every lookup during
+    // initialization queries the system module list again.
+    status = MdlpTakeModuleSnapshot();
+
+    if (!NT_SUCCESS(status))
+    {
+        Logger::LogWarning("Failed to take a module snapshot, status=", (PVOID)status);
+    }
+
+    // Also optional, without the cache the Pico structures are discovered from scratch.
+    status = PicoSppLoadCache(RegistryPath);
+
+    if (!NT_SUCCESS(status))
+    {
+        Logger::LogWarning("Failed to open the offset cache, status=", (PVOID)status);
+    }
+
     // According to Microsoft naming conventions:
     // Ma           => MonikA
     // p            => Private function
@@ -34,11 +74,17 @@ DriverEntry(
     if (!NT_SUCCESS(status))
     {
         Logger::LogError("Failed to initialize lxmonika, status=", (PVOID)status);
+        MdlpReleaseModuleSnapshot();
+        PicoSppCloseCache();
+        MapEtwUnregister();
+        Logger::Cleanup();
         return status;
     }
 
     // Optional step: Patching LXSS.
+    iPhaseStart = KeQueryPerformanceCounter(NULL).QuadPart;
     status = MapLxssInitialize(DriverObject);
+    MapRecordBootPhase(MaBootPhaseMapLxssInitialize, iPhaseStart, status);
 
     if (!NT_SUCCESS(status))
     {
@@ -51,7 +97,12 @@ DriverEntry(
     // As MapInitialize may be indirectly called by other drivers through MaRegisterPicoProvider,
     // we cannot guarantee the availablity of DriverObject when MapInitialize is called.
     // For this reason, RlpInitializeDevices needs to be directly handled by DriverEntry.
+    iPhaseStart = KeQueryPerformanceCounter(NULL).QuadPart;
     status = RlpInitializeDevices(DriverObject);
+    MapRecordBootPhase(MaBootPhaseRlpInitializeDevices, iPhaseStart, status);
+
+    // Later lookups, such as by other drivers registering providers, see the live module list.
+    MdlpReleaseModuleSnapshot();
 
     // Should call this regardless of whether we succeeded.
     NTSTATUS statusUnpatch = MapLxssPrepareForPatchGuard();
@@ -70,11 +121,16 @@ DriverEntry(
         // The reality device (at least the Win32 one) is required for userland hosts to launch
         // Pico processes.
         Logger::LogError("Failed to initialize the reality device, status=", (PVOID)status);
+        PicoSppCloseCache();
+        MapEtwUnregister();
+        Logger::Cleanup();
         return status;
     }
 
     DriverObject->DriverUnload = DriverUnload;
 
+    MapRecordBootPhase(MaBootPhaseDriverEntry, iStart, STATUS_SUCCESS);
+
     return STATUS_SUCCESS;
 }
 
@@ -91,4 +147,10 @@ DriverUnload(
     MapLxssCleanup();
 
     MapCleanup();
+
+    PicoSppCloseCache();
+
+    MapEtwUnregister();
+
+    Logger::Cleanup();
 }
@@ -17,16 +17,31 @@
     }                                           \
     while (FALSE);
 
-extern "C"
+typedef struct _MDL_MODULE_ENTRY {
+    PVOID ImageBase;
+    ULONG ImageSize;
+    ULONG NameHash;
+    // The file name part of FullPathName.
+    PCSTR Name;
+    // Filled in by the first successful MdlpGetProductVersion call.
+    PCWSTR ProductVersion;
+    SIZE_T ProductVersionSize;
+} MDL_MODULE_ENTRY, *PMDL_MODULE_ENTRY;
+
+// Holds the module list, the entries and the index.
+static PoolAllocator MdlpSnapshotAllocator;
+static PMDL_MODULE_ENTRY MdlpSnapshotEntries = NULL;
+static ULONG MdlpSnapshotEntryCount = 0;
+// Open addressing by NameHash, each slot holds an entry index plus one, or 0 if free.
+static PULONG MdlpSnapshotIndex = NULL;
+static ULONG MdlpSnapshotIndexMask = 0;
+
+static
 NTSTATUS
-MdlpFindModuleByName(
-    _In_ PCSTR pModuleName,
-    _Out_ PHANDLE pHandle,
-    _Out_opt_ PSIZE_T puSize
+MdlpQueryModules(
+    _Out_ PoolAllocator& allocator
 )
 {
-    NTSTATUS status;
-
     while (true)
     {
         ULONG uLen = 0;
@@ -35,156 +50,208 @@ MdlpFindModuleByName(
         // As we do not know the size yet, it will return STATUS_INFO_LENGTH_MISMATCH.
         ZwQuerySystemInformation(SystemModuleInformation, (PVOID)&uLen, 0, &uLen);
 
-        PoolAllocator pModulesAllocator(uLen, '--xS');
-        if (pModulesAllocator.Get() == NULL)
+        allocator = PoolAllocator(uLen, '--xS');
+        if (allocator.Get() == NULL)
         {
             return STATUS_NO_MEMORY;
         }
 
-        PRTL_PROCESS_MODULES pModules = pModulesAllocator.Get<RTL_PROCESS_MODULES>();
-
-        status = ZwQuerySystemInformation(SystemModuleInformation, (PVOID)pModules, uLen, &uLen);
-        if (!NT_SUCCESS(status))
+        NTSTATUS status = ZwQuerySystemInformation(SystemModuleInformation, allocator.Get(),
+            uLen, &uLen);
+        if (STATUS_INFO_LENGTH_MISMATCH == status)
         {
-            if (STATUS_INFO_LENGTH_MISMATCH == status)
-            {
-                continue;
-            }
-            return status;
+            continue;
         }
+        return status;
+    }
+}
 
-        for (ULONG i = 0; i < pModules->NumberOfModules; i++)
-        {
-            PCSTR pPath = (PCSTR)&pModules->Modules[i].FullPathName;
-            SIZE_T uPathLength = strnlen(pPath, sizeof(pModules->Modules[i].FullPathName));
+static
+PCSTR
+MdlpGetModuleFileName(
+    _In_ PRTL_PROCESS_MODULE_INFORMATION pModule
+)
+{
+    PCSTR pPath = (PCSTR)&pModule->FullPathName;
+    SIZE_T uPathLength = strnlen(pPath, sizeof(pModule->FullPathName));
 
-            SSIZE_T sLastComponent = (SSIZE_T)uPathLength;
+    SSIZE_T sLastComponent = (SSIZE_T)uPathLength;
 
-            while (sLastComponent >= 0 && pPath[sLastComponent] != '\\')
-            {
-                --sLastComponent;
-            }
+    while (sLastComponent >= 0 && pPath[sLastComponent] != '\\')
+    {
+        --sLastComponent;
+    }
 
-            if (_stricmp(pPath + sLastComponent + 1, pModuleName) != 0)
-            {
-                continue;
-            }
+    return pPath + sLastComponent + 1;
+}
 
-            if (puSize != NULL)
-            {
-                *puSize = pModules->Modules[i].ImageSize;
-            }
-            *pHandle = pModules->Modules[i].ImageBase;
-            return STATUS_SUCCESS;
+// FNV-1a over the lowercase name, to match _stricmp.
+static
+ULONG
+MdlpHashModuleName(
+    _In_ PCSTR pName
+)
+{
+    ULONG uHash = 2166136261;
+
+    for (; *pName != '\0'; ++pName)
+    {
+        CHAR ch = *pName;
+        if (ch >= 'A' && ch <= 'Z')
+        {
+            ch += 'a' - 'A';
         }
 
-        return STATUS_NOT_FOUND;
+        uHash = (uHash ^ (UCHAR)ch) * 16777619;
     }
+
+    return uHash;
 }
 
 extern "C"
 NTSTATUS
-MdlpFindModuleSectionByName(
-    _In_ HANDLE hdl,
-    _In_ PCSTR pSectionName,
-    _Out_ PVOID* pSection,
-    _Inout_opt_ PSIZE_T puSize
-)
+MdlpTakeModuleSnapshot()
 {
-    if (hdl == NULL || pSectionName == NULL || pSection == NULL)
+    MdlpReleaseModuleSnapshot();
+
+    PoolAllocator allocator;
+    NTSTATUS status = MdlpQueryModules(allocator);
+    if (!NT_SUCCESS(status))
     {
-        return STATUS_INVALID_PARAMETER;
+        return status;
     }
 
-    PCHAR pStart = (PCHAR)hdl;
-    PCHAR pEnd = (PCHAR)-1;
+    PRTL_PROCESS_MODULES pModules = allocator.Get<RTL_PROCESS_MODULES>();
+    ULONG uCount = pModules->NumberOfModules;
 
-    if (puSize != NULL && *puSize != 0)
+    // At least twice the entries, so that probe sequences stay short.
+    ULONG uIndexSize = 64;
+    while (uIndexSize < 2 * uCount)
     {
-        pEnd = pStart + *puSize;
+        uIndexSize *= 2;
     }
 
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pStart;
-    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)(pStart + pDosHeader->e_lfanew);
+    PMDL_MODULE_ENTRY pEntries = allocator.Allocate<MDL_MODULE_ENTRY>(uCount);
+    PULONG pIndex = allocator.Allocate<ULONG>(uIndexSize);
 
-    // Check if the end of the PE header is in the module range.
-    MDL_RETURN_IF_OUT_OF_BOUNDS(&pPeHeader[1], STATUS_INVALID_PARAMETER);
+    if ((uCount != 0 && pEntries == NULL) || pIndex == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
 
-    // The section headers array comes right after the PE header.
-    PIMAGE_SECTION_HEADER pSectionHeaders = (PIMAGE_SECTION_HEADER)(&pPeHeader[1]);
+    RtlZeroMemory(pIndex, uIndexSize * sizeof(ULONG));
 
-    // Check if the section headers are in range.
-    MDL_RETURN_IF_OUT_OF_BOUNDS(&pSectionHeaders[pPeHeader->FileHeader.NumberOfSections],
-        STATUS_INVALID_PARAMETER);
+    for (ULONG i = 0; i < uCount; ++i)
+    {
+        PMDL_MODULE_ENTRY pEntry = &pEntries[i];
 
-    PIMAGE_SECTION_HEADER pInterestedSectionHeader = NULL;
+        *pEntry =
+        {
+            .ImageBase = pModules->Modules[i].ImageBase,
+            .ImageSize = pModules->Modules[i].ImageSize,
+            .Name = MdlpGetModuleFileName(&pModules->Modules[i])
+        };
+        pEntry->NameHash = MdlpHashModuleName(pEntry->Name);
 
-    for (SIZE_T i = 0; i < pPeHeader->FileHeader.NumberOfSections; ++i)
-    {
-        if (strncmp(pSectionName, (const char*)pSectionHeaders[i].Name,
-            IMAGE_SIZEOF_SHORT_NAME) == 0)
+        ULONG uSlot = pEntry->NameHash & (uIndexSize - 1);
+        while (pIndex[uSlot] != 0)
         {
-            pInterestedSectionHeader = &pSectionHeaders[i];
+            uSlot = (uSlot + 1) & (uIndexSize - 1);
         }
+        pIndex[uSlot] = i + 1;
     }
 
-    if (pInterestedSectionHeader == NULL)
-    {
-        return STATUS_NOT_FOUND;
-    }
+    MdlpSnapshotAllocator = (PoolAllocator&&)allocator;
+    MdlpSnapshotEntries = pEntries;
+    MdlpSnapshotEntryCount = uCount;
+    MdlpSnapshotIndex = pIndex;
+    MdlpSnapshotIndexMask = uIndexSize - 1;
 
-    MDL_RETURN_IF_OUT_OF_BOUNDS(pStart + pInterestedSectionHeader->VirtualAddress
-                                + pInterestedSectionHeader->Misc.VirtualSize,
-        STATUS_INVALID_PARAMETER);
+    Logger::LogTrace("Took a snapshot of ", uCount, " modules.");
 
-    if (pStart + pInterestedSectionHeader->VirtualAddress
-        + pInterestedSectionHeader->Misc.VirtualSize > pEnd)
-    {
-        return STATUS_INVALID_PARAMETER;
-    }
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MdlpReleaseModuleSnapshot()
+{
+    MdlpSnapshotIndex = NULL;
+    MdlpSnapshotIndexMask = 0;
+    MdlpSnapshotEntries = NULL;
+    MdlpSnapshotEntryCount = 0;
+    MdlpSnapshotAllocator = PoolAllocator();
+}
+
+static
+PMDL_MODULE_ENTRY
+MdlpFindSnapshotEntry(
+    _In_ PCSTR pModuleName
+)
+{
+    ULONG uHash = MdlpHashModuleName(pModuleName);
 
-    if (puSize != NULL)
+    for (ULONG uSlot = uHash & MdlpSnapshotIndexMask;
+        MdlpSnapshotIndex[uSlot] != 0;
+        uSlot = (uSlot + 1) & MdlpSnapshotIndexMask)
     {
-        *puSize = pInterestedSectionHeader->Misc.VirtualSize;
+        PMDL_MODULE_ENTRY pEntry = &MdlpSnapshotEntries[MdlpSnapshotIndex[uSlot] - 1];
+
+        if (pEntry->NameHash == uHash && _stricmp(pEntry->Name, pModuleName) == 0)
+        {
+            return pEntry;
+        }
     }
 
-    *pSection = pStart + pInterestedSectionHeader->VirtualAddress;
-    return STATUS_SUCCESS;
+    return NULL;
 }
 
 extern "C"
 NTSTATUS
-MdlpGetProcAddress(
-    _In_ HANDLE hModule,
-    _In_ PCSTR  lpProcName,
-    _Out_ PVOID* pProc
+MdlpFindModuleByName(
+    _In_ PCSTR pModuleName,
+    _Out_ PHANDLE pHandle,
+    _Out_opt_ PSIZE_T puSize
 )
 {
-    if (hModule == NULL || lpProcName == NULL || pProc == NULL)
+    if (MdlpSnapshotIndex != NULL)
     {
-        return STATUS_INVALID_PARAMETER;
-    }
-
-    PCHAR pStart = (PCHAR)hModule;
+        PMDL_MODULE_ENTRY pEntry = MdlpFindSnapshotEntry(pModuleName);
 
-    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pStart;
-    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)(pStart + pDosHeader->e_lfanew);
+        // Otherwise, the module may have been loaded after the snapshot was taken.
+        if (pEntry != NULL)
+        {
+            if (puSize != NULL)
+            {
+                *puSize = pEntry->ImageSize;
+            }
+            *pHandle = pEntry->ImageBase;
+            return STATUS_SUCCESS;
+        }
+    }
 
-    PIMAGE_EXPORT_DIRECTORY pExportDirectory = (PIMAGE_EXPORT_DIRECTORY)(pStart +
-        pPeHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress);
+    PoolAllocator pModulesAllocator;
+    NTSTATUS status = MdlpQueryModules(pModulesAllocator);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
 
-    SIZE_T uNameCount = pExportDirectory->NumberOfNames;
-    PDWORD32 pNameList = (PDWORD32)(pStart + pExportDirectory->AddressOfNames);
-    PDWORD32 pFuncList = (PDWORD32)(pStart + pExportDirectory->AddressOfFunctions);
-    WORD* pOrdinalList = (WORD*)(pStart + pExportDirectory->AddressOfNameOrdinals);
+    PRTL_PROCESS_MODULES pModules = pModulesAllocator.Get<RTL_PROCESS_MODULES>();
 
-    for (SIZE_T i = 0; i < uNameCount; ++i)
+    for (ULONG i = 0; i < pModules->NumberOfModules; i++)
     {
-        if (strcmp(lpProcName, (PCSTR)(pStart + pNameList[i])) == 0)
+        if (_stricmp(MdlpGetModuleFileName(&pModules->Modules[i]), pModuleName) != 0)
         {
-            *pProc = (PVOID)(pStart + pFuncList[pOrdinalList[i]]);
-            return STATUS_SUCCESS;
+            continue;
+        }
+
+        if (puSize != NULL)
+        {
+            *puSize = pModules->Modules[i].ImageSize;
         }
+        *pHandle = pModules->Modules[i].ImageBase;
+        return STATUS_SUCCESS;
     }
 
     return STATUS_NOT_FOUND;
@@ -295,6 +362,29 @@ MdlpGetProductVersion(
         return STATUS_INVALID_PARAMETER;
     }
 
+    PMDL_MODULE_ENTRY pEntry = NULL;
+
+    for (ULONG i = 0; i < MdlpSnapshotEntryCount; ++i)
+    {
+        if (MdlpSnapshotEntries[i].ImageBase == hModule)
+        {
+            pEntry = &MdlpSnapshotEntries[i];
+            break;
+        }
+    }
+
+    if (pEntry != NULL && pEntry->ProductVersion != NULL)
+    {
+        *pPProductVersion = pEntry->ProductVersion;
+
+        if (puSize != NULL)
+        {
+            *puSize = pEntry->ProductVersionSize;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
     PCHAR pStart = (PCHAR)hModule;
     PCHAR pEnd = (PCHAR)-1;
 
@@ -375,6 +465,12 @@ MdlpGetProductVersion(
 
             *pPProductVersion = pProductVersionValue;
 
+            if (pEntry != NULL)
+            {
+                pEntry->ProductVersion = pProductVersionValue;
+                pEntry->ProductVersionSize = wcslen(pProductVersionValue) * sizeof(WCHAR);
+            }
+
             if (puSize != NULL)
             {
                 *puSize = wcslen(pProductVersionValue) * sizeof(WCHAR);
@@ -389,61 +485,33 @@ MdlpGetProductVersion(
     return STATUS_RESOURCE_LANG_NOT_FOUND;
 }
 
-static
+extern "C"
 NTSTATUS
-MdlpGodMemcpy(
-    _Out_ PVOID pDst,
-    _In_ PVOID pSrc,
-    _In_ SIZE_T szCount
+MdlpGetImageCheckSum(
+    _In_ HANDLE hModule,
+    _In_ SIZE_T uSize,
+    _Out_ PULONG puCheckSum
 )
 {
-    PMDL pMdl = IoAllocateMdl((PCHAR)pDst, (ULONG)szCount, FALSE, FALSE, NULL);
-    if (pMdl == NULL)
+    if (hModule == NULL || puCheckSum == NULL)
     {
-        return STATUS_ACCESS_VIOLATION;
+        return STATUS_INVALID_PARAMETER;
     }
-    AUTO_RESOURCE(pMdl, IoFreeMdl);
 
-    PMDL pLockedMdl = NULL;
-    AUTO_RESOURCE(pLockedMdl, MmUnlockPages);
-
-    PVOID pWritableDst = NULL;
-    AUTO_RESOURCE(pWritableDst, [&](auto p)
-    {
-        MmUnmapLockedPages(p, pLockedMdl);
-    });
-
-    __try
-    {
-        MmProbeAndLockPages(pMdl, KernelMode, IoReadAccess);
-        // Allow the AUTO_RESOURCE to work.
-        pLockedMdl = pMdl;
-
-        pMdl->MdlFlags |= MDL_MAPPING_CAN_FAIL;
-
-        pWritableDst = MmMapLockedPagesSpecifyCache(
-            pMdl,
-            KernelMode,
-            MmNonCached,
-            NULL,
-            FALSE,
-            HighPagePriority
-        );
+    PCHAR pStart = (PCHAR)hModule;
+    PCHAR pEnd = (PCHAR)-1;
 
-        MmProtectMdlSystemAddress(pMdl, PAGE_READWRITE);
-    }
-    __except (EXCEPTION_EXECUTE_HANDLER)
+    if (uSize != 0)
     {
-        return GetExceptionCode();
+        pEnd = pStart + uSize;
     }
 
-    if (pWritableDst == NULL)
-    {
-        return STATUS_ACCESS_VIOLATION;
-    }
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pStart;
+    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)(pStart + pDosHeader->e_lfanew);
 
-    memcpy(pWritableDst, pSrc, szCount);
+    MDL_RETURN_IF_OUT_OF_BOUNDS(&pPeHeader[1], STATUS_INVALID_PARAMETER);
 
+    *puCheckSum = pPeHeader->OptionalHeader.CheckSum;
     return STATUS_SUCCESS;
 }
 
@@ -511,9 +579,13 @@ MdlpPatchImport(
             {
                 Logger::LogTrace("Found import entry for symbol: ", pHintNameEntry->Name);
 
-                // IATs are generally write-protected so we need the God Memcpy for this.
-                PVOID pOldValue = (PVOID)*pFuncRef;
-                MA_RETURN_IF_FAIL(MdlpGodMemcpy(pFuncRef, pImportValue, sizeof(PVOID)));
+                // IATs are generally write-protected so we need a writable mapping for this.
+                MDL_PATCH_SET set = { };
+                MA_RETURN_IF_FAIL(MdlpAddPatch(&set, pFuncRef, pImportValue, sizeof(PVOID)));
+                MA_RETURN_IF_FAIL(MdlpApplyPatchSet(&set));
+
+                PVOID pOldValue = NULL;
+                memcpy(&pOldValue, set.Patches[0].Original, sizeof(PVOID));
                 *pImportValue = pOldValue;
 
                 Logger::LogTrace("Patched entry. Original value was ", pOldValue);
@@ -542,7 +614,7 @@ MdlpPatchTrampoline(
     // It's a bit odd to have it here in module.cpp, since the function does not work directly with
     // PE modules unlike its friends here.
     //
-    // It might make sense to have this and MdlpGodMemcpy as `MaUtil*`, but definitely don't mark
+    // It might make sense to have this and the patch sets as `MaUtil*`, but definitely don't mark
     // these dangerous functions as MONIKA_EXPORT.
 
     if (pOriginal == NULL || pBytes == NULL)
@@ -555,57 +627,440 @@ MdlpPatchTrampoline(
         return STATUS_INFO_LENGTH_MISMATCH;
     }
 
+    MDL_PATCH_SET set = { };
+
     // Hooking
     if (pHook != NULL)
     {
-        UCHAR chShellCode[MDL_TRAMPOLINE_SIZE] =
+        MA_RETURN_IF_FAIL(MdlpAddTrampolinePatch(&set, pOriginal, pHook));
+        MA_RETURN_IF_FAIL(MdlpApplyPatchSet(&set));
+        memcpy(pBytes, set.Patches[0].Original, MDL_TRAMPOLINE_SIZE);
+    }
+    else // pHook == NULL, unhooking
+    {
+        MA_RETURN_IF_FAIL(MdlpAddPatch(&set, pOriginal, pBytes, MDL_TRAMPOLINE_SIZE));
+        MA_RETURN_IF_FAIL(MdlpApplyPatchSet(&set));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Patch sets
+//
+
+static_assert(MDL_TRAMPOLINE_SIZE <= MDL_PATCH_BYTES_MAX,
+    "A trampoline must fit in a single patch");
+static_assert(sizeof(PVOID) <= MDL_PATCH_BYTES_MAX,
+    "An import address must fit in a single patch");
+
+// No patch is larger than a page, so each spans at most two.
+#define MDL_PATCH_PAGES_MAX     (2 * MDL_PATCH_SET_MAX)
+
+typedef struct _MDL_PAGE_MAPPING {
+    PVOID Page;
+    // Only set once the page is locked.
+    PMDL Mdl;
+    PVOID Writable;
+} MDL_PAGE_MAPPING, *PMDL_PAGE_MAPPING;
+
+// Exported by ntoskrnl, but not declared by the WDK headers.
+extern "C"
+NTSYSAPI
+NTSTATUS
+NTAPI
+ZwFlushInstructionCache(
+    _In_ HANDLE ProcessHandle,
+    _In_opt_ PVOID BaseAddress,
+    _In_ SIZE_T Length
+);
+
+static
+NTSTATUS
+MdlpMapPage(
+    _In_ PVOID pPage,
+    _Out_ PMDL_PAGE_MAPPING pMapping
+)
+{
+    *pMapping = { .Page = pPage };
+
+    PMDL pMdl = IoAllocateMdl(pPage, PAGE_SIZE, FALSE, FALSE, NULL);
+    if (pMdl == NULL)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages(pMdl, KernelMode, IoReadAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        IoFreeMdl(pMdl);
+        return GetExceptionCode();
+    }
+
+    // From here on, MdlpUnmapPages cleans up.
+    pMapping->Mdl = pMdl;
+    pMdl->MdlFlags |= MDL_MAPPING_CAN_FAIL;
+
+    PVOID pWritable = NULL;
+
+    __try
+    {
+        pWritable = MmMapLockedPagesSpecifyCache(
+            pMdl,
+            KernelMode,
+            MmNonCached,
+            NULL,
+            FALSE,
+            HighPagePriority
+        );
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return GetExceptionCode();
+    }
+
+    if (pWritable == NULL)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    pMapping->Writable = pWritable;
+
+    return MmProtectMdlSystemAddress(pMdl, PAGE_READWRITE);
+}
+
+static
+VOID
+MdlpUnmapPages(
+    _In_reads_(uCount) PMDL_PAGE_MAPPING pMappings,
+    _In_ SIZE_T uCount
+)
+{
+    for (SIZE_T i = 0; i < uCount; ++i)
+    {
+        if (pMappings[i].Writable != NULL)
         {
+            MmUnmapLockedPages(pMappings[i].Writable, pMappings[i].Mdl);
+        }
+
+        if (pMappings[i].Mdl != NULL)
+        {
+            MmUnlockPages(pMappings[i].Mdl);
+            IoFreeMdl(pMappings[i].Mdl);
+        }
+    }
+}
+
+// Maps the pages of [pAddress, pAddress + szCount) not already in pMappings.
+static
+NTSTATUS
+MdlpMapRange(
+    _In_ PVOID pAddress,
+    _In_ SIZE_T szCount,
+    _Inout_updates_to_(MDL_PATCH_PAGES_MAX, *puCount) PMDL_PAGE_MAPPING pMappings,
+    _Inout_ PSIZE_T puCount
+)
+{
+    ULONG_PTR uFirst = (ULONG_PTR)PAGE_ALIGN(pAddress);
+    ULONG_PTR uLast = (ULONG_PTR)PAGE_ALIGN((PCHAR)pAddress + szCount - 1);
+
+    for (ULONG_PTR uPage = uFirst; uPage <= uLast; uPage += PAGE_SIZE)
+    {
+        SIZE_T i = 0;
+        while (i < *puCount && pMappings[i].Page != (PVOID)uPage)
+        {
+            ++i;
+        }
+
+        if (i < *puCount)
+        {
+            // Shared with an earlier patch.
+            continue;
+        }
+
+        MA_ASSERT(*puCount < MDL_PATCH_PAGES_MAX);
+
+        // Counted even on failure, so that the partial mapping gets cleaned up.
+        NTSTATUS status = MdlpMapPage((PVOID)uPage, &pMappings[*puCount]);
+        ++*puCount;
+        MA_RETURN_IF_FAIL(status);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+MdlpWriteMapped(
+    _In_reads_(uCount) const MDL_PAGE_MAPPING* pMappings,
+    _In_ SIZE_T uCount,
+    _In_ PVOID pDst,
+    _In_reads_bytes_(szCount) const UCHAR* pSrc,
+    _In_ SIZE_T szCount
+)
+{
+    PCHAR pCurrent = (PCHAR)pDst;
+
+    while (szCount > 0)
+    {
+        PVOID pPage = PAGE_ALIGN(pCurrent);
+        SIZE_T szOffset = BYTE_OFFSET(pCurrent);
+        SIZE_T szChunk = min(szCount, PAGE_SIZE - szOffset);
+
+        SIZE_T i = 0;
+        while (i < uCount && pMappings[i].Page != pPage)
+        {
+            ++i;
+        }
+
+        MA_ASSERT(i < uCount);
+
+        memcpy((PCHAR)pMappings[i].Writable + szOffset, pSrc, szChunk);
+
+        pCurrent += szChunk;
+        pSrc += szChunk;
+        szCount -= szChunk;
+    }
+}
+
+static
+VOID
+MdlpFlushInstructionCache()
+{
+    // A NULL base sweeps the whole cache, which is what we want after writing several patches.
+    ZwFlushInstructionCache(ZwCurrentProcess(), NULL, 0);
+}
+
+static
+VOID
+MdlpBuildTrampoline(
+    _In_ PVOID pHook,
+    _Out_writes_bytes_(MDL_TRAMPOLINE_SIZE) PUCHAR pShellCode
+)
+{
+    UCHAR chShellCode[MDL_TRAMPOLINE_SIZE] =
+    {
 #if defined(_M_X64)
-            // movabs rax, [addr]
-            0x48, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            // jmp rax
-            0xff, 0xe0
+        // movabs rax, [addr]
+        0x48, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        // jmp rax
+        0xff, 0xe0
 #elif defined(_M_ARM64)
-            // ldr x9, 8    -> Load the contents 8 bytes ahead of the current PC into x9.
-            0x49, 0x00, 0x00, 0x58,
-            // br x9        -> Jump to x9.
-            0x20, 0x01, 0x1F, 0xD6,
-            // .addr
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+        // ldr x9, 8    -> Load the contents 8 bytes ahead of the current PC into x9.
+        0x49, 0x00, 0x00, 0x58,
+        // br x9        -> Jump to x9.
+        0x20, 0x01, 0x1F, 0xD6,
+        // .addr
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 #elif defined(_M_IX86)
-            // mov eax, [addr]
-            0xB8, 0x00, 0x00, 0x00, 0x00,
-            // jmp eax
-            0xFF, 0xE0
+        // mov eax, [addr]
+        0xB8, 0x00, 0x00, 0x00, 0x00,
+        // jmp eax
+        0xFF, 0xE0
 #elif defined(_M_ARM)
-            // ldr pc, [pc, #-0x4]
-            0x04, 0xF0, 0x1F, 0xE5,
-            // .addr
-            0x00, 0x00, 0x00, 0x00
+        // ldr pc, [pc, #-0x4]
+        0x04, 0xF0, 0x1F, 0xE5,
+        // .addr
+        0x00, 0x00, 0x00, 0x00
 #else
 #error Define Trampoline!
 #endif
-        };
+    };
 
 #if defined(_M_X64)
-        memcpy(chShellCode + 2, &pHook, sizeof(PVOID));
+    memcpy(chShellCode + 2, &pHook, sizeof(PVOID));
 #elif defined(_M_ARM64)
-        memcpy(chShellCode + 8, &pHook, sizeof(PVOID));
+    memcpy(chShellCode + 8, &pHook, sizeof(PVOID));
 #elif defined(_M_IX86)
-        memcpy(chShellCode + 1, &pHook, sizeof(PVOID));
+    memcpy(chShellCode + 1, &pHook, sizeof(PVOID));
 #elif defined(_M_ARM)
-        memcpy(chShellCode + 4, &pHook, sizeof(PVOID));
+    memcpy(chShellCode + 4, &pHook, sizeof(PVOID));
 #else
 #error Put Address into Trampoline!
 #endif
 
-        memcpy(pBytes, pOriginal, MDL_TRAMPOLINE_SIZE);
-        MA_RETURN_IF_FAIL(MdlpGodMemcpy(pOriginal, &chShellCode, MDL_TRAMPOLINE_SIZE));
+    memcpy(pShellCode, chShellCode, MDL_TRAMPOLINE_SIZE);
+}
+
+extern "C"
+NTSTATUS
+MdlpAddPatch(
+    _Inout_ PMDL_PATCH_SET pSet,
+    _In_ PVOID pAddress,
+    _In_reads_bytes_(szBytes) const VOID* pBytes,
+    _In_ SIZE_T szBytes
+)
+{
+    if (pSet == NULL || pAddress == NULL || pBytes == NULL || szBytes == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (szBytes > MDL_PATCH_BYTES_MAX)
+    {
+        return STATUS_INFO_LENGTH_MISMATCH;
     }
-    else // pHook == NULL, unhooking
+
+    if (pSet->Applied)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (pSet->Count == MDL_PATCH_SET_MAX)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // The originals are all captured before anything is written, so overlapping patches would
+    // not revert cleanly.
+    for (SIZE_T i = 0; i < pSet->Count; ++i)
     {
-        MA_RETURN_IF_FAIL(MdlpGodMemcpy(pOriginal, pBytes, MDL_TRAMPOLINE_SIZE));
+        PCHAR pStart = (PCHAR)pSet->Patches[i].Address;
+        PCHAR pEnd = pStart + pSet->Patches[i].Size;
+
+        if ((PCHAR)pAddress < pEnd && pStart < (PCHAR)pAddress + szBytes)
+        {
+            return STATUS_CONFLICTING_ADDRESSES;
+        }
     }
 
+    PMDL_PATCH pPatch = &pSet->Patches[pSet->Count];
+    *pPatch = { .Address = pAddress, .Size = szBytes };
+    memcpy(pPatch->Bytes, pBytes, szBytes);
+
+    ++pSet->Count;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MdlpAddTrampolinePatch(
+    _Inout_ PMDL_PATCH_SET pSet,
+    _In_ PVOID pOriginal,
+    _In_ PVOID pHook
+)
+{
+    if (pHook == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    UCHAR chShellCode[MDL_TRAMPOLINE_SIZE];
+    MdlpBuildTrampoline(pHook, chShellCode);
+
+    return MdlpAddPatch(pSet, pOriginal, chShellCode, MDL_TRAMPOLINE_SIZE);
+}
+
+extern "C"
+NTSTATUS
+MdlpApplyPatchSet(
+    _Inout_ PMDL_PATCH_SET pSet
+)
+{
+    if (pSet == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (pSet->Applied)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    MDL_PAGE_MAPPING mappings[MDL_PATCH_PAGES_MAX];
+    SIZE_T uMapped = 0;
+
+    PMDL_PAGE_MAPPING pMappings = mappings;
+    AUTO_RESOURCE(pMappings, [&](auto p)
+    {
+        MdlpUnmapPages(p, uMapped);
+    });
+
+    for (SIZE_T i = 0; i < pSet->Count; ++i)
+    {
+        MA_RETURN_IF_FAIL(MdlpMapRange(pSet->Patches[i].Address, pSet->Patches[i].Size,
+            pMappings, &uMapped));
+    }
+
+    // Everything is mapped, nothing below can fail.
+
+    for (SIZE_T i = 0; i < pSet->Count; ++i)
+    {
+        memcpy(pSet->Patches[i].Original, pSet->Patches[i].Address, pSet->Patches[i].Size);
+    }
+
+    for (SIZE_T i = 0; i < pSet->Count; ++i)
+    {
+        MdlpWriteMapped(pMappings, uMapped,
+            pSet->Patches[i].Address, pSet->Patches[i].Bytes, pSet->Patches[i].Size);
+    }
+
+    MdlpFlushInstructionCache();
+
+    pSet->Applied = TRUE;
+
+    Logger::LogTrace("Applied ", pSet->Count, " patches on ", uMapped, " pages");
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MdlpRevertPatchSet(
+    _Inout_ PMDL_PATCH_SET pSet
+)
+{
+    if (pSet == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!pSet->Applied)
+    {
+        // Nothing has been written, so there is nothing to restore.
+        return STATUS_SUCCESS;
+    }
+
+    // Someone else has patched over us. Restoring would clobber their code, and restoring only
+    // the other patches would leave the set half applied.
+    for (SIZE_T i = 0; i < pSet->Count; ++i)
+    {
+        if (RtlCompareMemory(pSet->Patches[i].Address, pSet->Patches[i].Bytes,
+            pSet->Patches[i].Size) != pSet->Patches[i].Size)
+        {
+            return STATUS_DATA_ERROR;
+        }
+    }
+
+    MDL_PAGE_MAPPING mappings[MDL_PATCH_PAGES_MAX];
+    SIZE_T uMapped = 0;
+
+    PMDL_PAGE_MAPPING pMappings = mappings;
+    AUTO_RESOURCE(pMappings, [&](auto p)
+    {
+        MdlpUnmapPages(p, uMapped);
+    });
+
+    for (SIZE_T i = 0; i < pSet->Count; ++i)
+    {
+        MA_RETURN_IF_FAIL(MdlpMapRange(pSet->Patches[i].Address, pSet->Patches[i].Size,
+            pMappings, &uMapped));
+    }
+
+    for (SIZE_T i = pSet->Count; i > 0; --i)
+    {
+        MdlpWriteMapped(pMappings, uMapped,
+            pSet->Patches[i - 1].Address, pSet->Patches[i - 1].Original,
+            pSet->Patches[i - 1].Size);
+    }
+
+    MdlpFlushInstructionCache();
+
+    pSet->Applied = FALSE;
+
     return STATUS_SUCCESS;
 }
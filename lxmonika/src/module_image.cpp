@@ -0,0 +1,349 @@
+#include "module_image.h"
+
+// User-mode builds already have these from winnt.h.
+#ifndef MA_HOST
+#include "pe.h"
+
+#include "Logger.h"
+#endif
+
+#define MDL_RETURN_IF_OUT_OF_BOUNDS(ptr, error) \
+    do                                          \
+    {                                           \
+        if ((PCHAR)(ptr) > (PCHAR)(pEnd))       \
+            return (error);                     \
+    }                                           \
+    while (FALSE);
+
+extern "C"
+NTSTATUS
+MdlpFindModuleSectionByName(
+    _In_ HANDLE hdl,
+    _In_ PCSTR pSectionName,
+    _Out_ PVOID* pSection,
+    _Inout_opt_ PSIZE_T puSize
+)
+{
+    if (hdl == NULL || pSectionName == NULL || pSection == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PCHAR pStart = (PCHAR)hdl;
+    PCHAR pEnd = (PCHAR)-1;
+
+    if (puSize != NULL && *puSize != 0)
+    {
+        pEnd = pStart + *puSize;
+    }
+
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pStart;
+    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)(pStart + pDosHeader->e_lfanew);
+
+    // Check if the end of the PE header is in the module range.
+    MDL_RETURN_IF_OUT_OF_BOUNDS(&pPeHeader[1], STATUS_INVALID_PARAMETER);
+
+    // The section headers array comes right after the PE header.
+    PIMAGE_SECTION_HEADER pSectionHeaders = (PIMAGE_SECTION_HEADER)(&pPeHeader[1]);
+
+    // Check if the section headers are in range.
+    MDL_RETURN_IF_OUT_OF_BOUNDS(&pSectionHeaders[pPeHeader->FileHeader.NumberOfSections],
+        STATUS_INVALID_PARAMETER);
+
+    PIMAGE_SECTION_HEADER pInterestedSectionHeader = NULL;
+
+    for (SIZE_T i = 0; i < pPeHeader->FileHeader.NumberOfSections; ++i)
+    {
+        if (strncmp(pSectionName, (const char*)pSectionHeaders[i].Name,
+            IMAGE_SIZEOF_SHORT_NAME) == 0)
+        {
+            pInterestedSectionHeader = &pSectionHeaders[i];
+        }
+    }
+
+    if (pInterestedSectionHeader == NULL)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    MDL_RETURN_IF_OUT_OF_BOUNDS(pStart + pInterestedSectionHeader->VirtualAddress
+                                + pInterestedSectionHeader->Misc.VirtualSize,
+        STATUS_INVALID_PARAMETER);
+
+    if (pStart + pInterestedSectionHeader->VirtualAddress
+        + pInterestedSectionHeader->Misc.VirtualSize > pEnd)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (puSize != NULL)
+    {
+        *puSize = pInterestedSectionHeader->Misc.VirtualSize;
+    }
+
+    *pSection = pStart + pInterestedSectionHeader->VirtualAddress;
+    return STATUS_SUCCESS;
+}
+
+// Forwarders pointing to other forwarders are followed this many times at most.
+#define MDL_MAX_FORWARDER_DEPTH     4
+
+typedef struct _MDL_EXPORTS {
+    PCHAR Start;
+    PIMAGE_EXPORT_DIRECTORY Directory;
+    ULONG DirectorySize;
+    PDWORD32 NameList;
+    PDWORD32 FuncList;
+    WORD* OrdinalList;
+} MDL_EXPORTS, *PMDL_EXPORTS;
+
+static
+NTSTATUS
+MdlpGetExports(
+    _In_ HANDLE hModule,
+    _Out_ PMDL_EXPORTS pExports
+)
+{
+    PCHAR pStart = (PCHAR)hModule;
+
+    PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)pStart;
+    PIMAGE_NT_HEADERS pPeHeader = (PIMAGE_NT_HEADERS)(pStart + pDosHeader->e_lfanew);
+
+    PIMAGE_DATA_DIRECTORY pDataDirectory =
+        &pPeHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+
+    if (pDataDirectory->VirtualAddress == 0)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    PIMAGE_EXPORT_DIRECTORY pExportDirectory =
+        (PIMAGE_EXPORT_DIRECTORY)(pStart + pDataDirectory->VirtualAddress);
+
+    *pExports =
+    {
+        .Start = pStart,
+        .Directory = pExportDirectory,
+        .DirectorySize = pDataDirectory->Size,
+        .NameList = (PDWORD32)(pStart + pExportDirectory->AddressOfNames),
+        .FuncList = (PDWORD32)(pStart + pExportDirectory->AddressOfFunctions),
+        .OrdinalList = (WORD*)(pStart + pExportDirectory->AddressOfNameOrdinals)
+    };
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MdlpResolveExport(
+    _In_ PMDL_EXPORTS pExports,
+    _In_ PCSTR lpProcName,
+    _In_ ULONG uDepth,
+    _Out_ PVOID* pProc
+);
+
+static
+NTSTATUS
+MdlpResolveForwarder(
+    _In_ PCSTR pForwarder,
+    _In_ ULONG uDepth,
+    _Out_ PVOID* pProc
+)
+{
+    if (uDepth >= MDL_MAX_FORWARDER_DEPTH)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    // The forwarder looks like "MODULE.Name" or "MODULE.#Ordinal", with the module extension
+    // left out.
+    PCSTR pDot = strchr(pForwarder, '.');
+    if (pDot == NULL)
+    {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    CHAR pModuleName[64];
+    SIZE_T uModuleNameLength = pDot - pForwarder;
+
+    if (uModuleNameLength + sizeof(".dll") > sizeof(pModuleName))
+    {
+        return STATUS_NAME_TOO_LONG;
+    }
+
+    PCSTR lpProcName = pDot + 1;
+    if (lpProcName[0] == '#')
+    {
+        ULONG uOrdinal = 0;
+        for (PCSTR pDigit = lpProcName + 1; *pDigit >= '0' && *pDigit <= '9'; ++pDigit)
+        {
+            uOrdinal = uOrdinal * 10 + (*pDigit - '0');
+        }
+        lpProcName = MDL_ORDINAL(uOrdinal);
+    }
+
+    const PCSTR pExtensions[] = { ".dll", ".sys", ".exe" };
+
+    for (SIZE_T i = 0; i < ARRAYSIZE(pExtensions); ++i)
+    {
+        memcpy(pModuleName, pForwarder, uModuleNameLength);
+        memcpy(pModuleName + uModuleNameLength, pExtensions[i], sizeof(".dll"));
+
+        HANDLE hdlModule;
+        if (!NT_SUCCESS(MdlpFindModuleByName(pModuleName, &hdlModule, NULL)))
+        {
+            continue;
+        }
+
+        MDL_EXPORTS exports;
+        NTSTATUS status = MdlpGetExports(hdlModule, &exports);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        return MdlpResolveExport(&exports, lpProcName, uDepth + 1, pProc);
+    }
+
+#ifndef MA_HOST
+    Logger::LogWarning("Cannot find the target module of forwarder ", pForwarder);
+#endif
+    return STATUS_NOT_FOUND;
+}
+
+static
+NTSTATUS
+MdlpResolveExport(
+    _In_ PMDL_EXPORTS pExports,
+    _In_ PCSTR lpProcName,
+    _In_ ULONG uDepth,
+    _Out_ PVOID* pProc
+)
+{
+    PIMAGE_EXPORT_DIRECTORY pExportDirectory = pExports->Directory;
+    ULONG uIndex;
+
+    // Same as IS_INTRESOURCE, no names live in the first 64K of the address space.
+    if (((ULONG_PTR)lpProcName >> 16) == 0)
+    {
+        ULONG uOrdinal = (ULONG)(ULONG_PTR)lpProcName;
+
+        if (uOrdinal < pExportDirectory->Base)
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        uIndex = uOrdinal - pExportDirectory->Base;
+    }
+    else
+    {
+        // The name table is sorted, so that loaders can binary search it.
+        SIZE_T uLow = 0;
+        SIZE_T uHigh = pExportDirectory->NumberOfNames;
+
+        while (uLow < uHigh)
+        {
+            SIZE_T uMiddle = uLow + (uHigh - uLow) / 2;
+            int iCompare = strcmp(lpProcName,
+                (PCSTR)(pExports->Start + pExports->NameList[uMiddle]));
+
+            if (iCompare == 0)
+            {
+                uLow = uMiddle;
+                goto found_name;
+            }
+            else if (iCompare < 0)
+            {
+                uHigh = uMiddle;
+            }
+            else
+            {
+                uLow = uMiddle + 1;
+            }
+        }
+
+        return STATUS_NOT_FOUND;
+
+    found_name:
+        uIndex = pExports->OrdinalList[uLow];
+    }
+
+    if (uIndex >= pExportDirectory->NumberOfFunctions || pExports->FuncList[uIndex] == 0)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    ULONG uRva = pExports->FuncList[uIndex];
+    PCHAR pDirectoryStart = (PCHAR)pExportDirectory;
+
+    // Forwarders are strings inside the export directory instead of code.
+    if (pExports->Start + uRva >= pDirectoryStart
+        && pExports->Start + uRva < pDirectoryStart + pExports->DirectorySize)
+    {
+        return MdlpResolveForwarder(pExports->Start + uRva, uDepth, pProc);
+    }
+
+    *pProc = (PVOID)(pExports->Start + uRva);
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MdlpGetProcAddress(
+    _In_ HANDLE hModule,
+    _In_ PCSTR  lpProcName,
+    _Out_ PVOID* pProc
+)
+{
+    if (hModule == NULL || lpProcName == NULL || pProc == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MDL_EXPORTS exports;
+    NTSTATUS status = MdlpGetExports(hModule, &exports);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    return MdlpResolveExport(&exports, lpProcName, 0, pProc);
+}
+
+extern "C"
+NTSTATUS
+MdlpGetProcAddresses(
+    _In_ HANDLE hModule,
+    _Inout_updates_(uCount) PMDL_PROC pProcs,
+    _In_ SIZE_T uCount
+)
+{
+    if (hModule == NULL || (pProcs == NULL && uCount != 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MDL_EXPORTS exports;
+    NTSTATUS status = MdlpGetExports(hModule, &exports);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    for (SIZE_T i = 0; i < uCount; ++i)
+    {
+        if (pProcs[i].Name == NULL || pProcs[i].Proc == NULL)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        *pProcs[i].Proc = NULL;
+
+        if (!NT_SUCCESS(MdlpResolveExport(&exports, pProcs[i].Name, 0, pProcs[i].Proc)))
+        {
+            status = STATUS_NOT_FOUND;
+        }
+    }
+
+    return status;
+}
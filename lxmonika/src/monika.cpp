@@ -1,8 +1,12 @@
 #include "monika.h"
 
+#include "condrv.h"
+#include "monika_names.h"
 #include "os.h"
 #include "picosupport.h"
 
+#include "AutoResource.h"
+#include "Locker.h"
 #include "Logger.h"
 
 //
@@ -19,15 +23,40 @@ PS_PICO_PROVIDER_ROUTINES MapOriginalProviderRoutines;
 PS_PICO_ROUTINES MapOriginalRoutines;
 
 BOOLEAN MapPicoRegistrationDisabled = FALSE;
-PS_PICO_PROVIDER_ROUTINES MapProviderRoutines[MaPicoProviderMaxCount];
-PS_PICO_ROUTINES MapRoutines[MaPicoProviderMaxCount];
-PS_PICO_ROUTINES MapRoutinesTh1[MaPicoProviderMaxCount];
-MA_PICO_PROVIDER_ROUTINES MapAdditionalProviderRoutines[MaPicoProviderMaxCount];
-MA_PICO_ROUTINES MapAdditionalRoutines[MaPicoProviderMaxCount];
+BOOLEAN MapLazyImageNames = FALSE;
+BOOLEAN MapSelfBenchmark = FALSE;
+BOOLEAN MapProfiling = FALSE;
+SIZE_T MapWarmPoolSize = 0;
+PMA_PROVIDER MapProviderSlots[MaPicoProviderMaxCount];
+MA_PROVIDER MapFreeProvider;
 SIZE_T MapProvidersCount = 0;
 
+// Serializes registration and unregistration. Lookups do not take this lock.
+static PushLock MapProvidersLock;
+
 static LONG MaInitialized = FALSE;
 
+static MA_BOOT_PROFILE MapBootProfile;
+
+#define MA_PROVIDER_TAG ('rPaM')
+#define MA_PROVIDER_NAME_TAG ('mNaM')
+
+// Reported provider names, sorted by name, so that lookups do not call into providers.
+// Rebuilt by the first lookup after MapProviderNamesGeneration changes.
+static struct {
+    LONG                    Generation;
+    // FALSE when some provider did not have a name yet, so that it is asked again.
+    BOOLEAN                 Complete;
+    SIZE_T                  Count;
+    MA_PROVIDER_NAME_ENTRY  Entries[MaPicoProviderMaxCount];
+} MapProviderNames;
+
+static PushLock MapProviderNamesLock;
+static volatile LONG MapProviderNamesGeneration = 1;
+
+// Rotates the ideal processors handed out by MaSetThreadPlacement within a node.
+static volatile LONG MapPlacementSequence = 0;
+
 //
 // Monika lifetime functions
 //
@@ -50,6 +79,17 @@ MapInitialize()
 
     NTSTATUS status;
 
+    LONG64 iStart = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    status = MapInitializeContextAllocator();
+
+    if (!NT_SUCCESS(status))
+    {
+        goto fail;
+    }
+
+    LONG64 iAbiStart = KeQueryPerformanceCounter(NULL).QuadPart;
+
     status = PicoSppDetermineAbiStatus(
         &MapSystemProviderRoutinesSize,
         &MapSystemPicoRoutinesSize,
@@ -58,6 +98,8 @@ MapInitialize()
         &MapTooLate
     );
 
+    MapRecordBootPhase(MaBootPhaseDetermineAbiStatus, iAbiStart, status);
+
     if (!NT_SUCCESS(status))
     {
         goto fail;
@@ -163,44 +205,19 @@ MapInitialize()
         Logger::LogTrace("Successfully patched provider routines.");
     }
 
-    // Initialize pico routines
-#define MONIKA_PROVIDER(index)                                                  \
-    MapRoutines[MaPicoProvider##index] =                                        \
-    {                                                                           \
-        .Size = sizeof(PS_PICO_ROUTINES),                                       \
-        .CreateProcess = MaPicoCreateProcess##index,                            \
-        .CreateThread = MaPicoCreateThread##index,                              \
-        .GetProcessContext = MaPicoGetProcessContext##index,                    \
-        .GetThreadContext = MaPicoGetThreadContext##index,                      \
-        .GetContextThreadInternal = MaPicoGetContextThreadInternal##index,      \
-        .SetContextThreadInternal = MaPicoSetContextThreadInternal##index,      \
-        .TerminateThread = MaPicoTerminateThread##index,                        \
-        .ResumeThread = MaPicoResumeThread##index,                              \
-        .SetThreadDescriptorBase = MaPicoSetThreadDescriptorBase##index,        \
-        .SuspendThread = MaPicoSuspendThread##index,                            \
-        .TerminateProcess = MaPicoTerminateProcess##index                       \
-    };                                                                          \
-                                                                                \
-    MapRoutinesTh1[MaPicoProvider##index] = MapRoutines[MaPicoProvider##index]; \
-    MapRoutinesTh1[MaPicoProvider##index].CreateProcess =                       \
-        (PPS_PICO_CREATE_PROCESS)MaPicoCreateProcessTh1##index;                 \
-    MapRoutinesTh1[MaPicoProvider##index].CreateThread =                        \
-        (PPS_PICO_CREATE_THREAD)MaPicoCreateThreadTh1##index;
-#include "monika_providers.cpp"
-#undef MONIKA_PROVIDER
-
-    // Initialize additional pico routines
-#define MONIKA_PROVIDER(index)                                              \
-    MapAdditionalRoutines[MaPicoProvider##index] =                          \
-    {                                                                       \
-        .Size = sizeof(MA_PICO_ROUTINES)                                    \
-    };
-#include "monika_providers.cpp"
-#undef MONIKA_PROVIDER
+    // Stands in for every slot until a provider registers in it.
+    ExInitializeRundownProtection(&MapFreeProvider.Rundown);
+    ExWaitForRundownProtectionRelease(&MapFreeProvider.Rundown);
+    ExRundownCompleted(&MapFreeProvider.Rundown);
+    InitializeListHead(&MapFreeProvider.SystemCallHooks);
+
+    MapRecordBootPhase(MaBootPhaseMapInitialize, iStart, STATUS_SUCCESS);
 
     return STATUS_SUCCESS;
 
 fail:
+    MapRecordBootPhase(MaBootPhaseMapInitialize, iStart, status);
+
     MaInitialized = FALSE;
     return status;
 }
@@ -225,7 +242,128 @@ MapCleanup()
                 *pRoutines = MapOriginalProviderRoutines;
             }
         }
+
+        // The page is refreshed from the statistics blocks, so stop that first.
+        MapCleanupCountersPage();
+        MapCleanupTrace();
+        MapCleanupProfile();
+        MapCleanupProviderNames();
+        MapCleanupContextAllocator();
+
+        for (SIZE_T i = 0; i < MaPicoProviderMaxCount; ++i)
+        {
+            if (MapProviderSlots[i] != NULL)
+            {
+                MapFreePool(MapProviderSlots[i], sizeof(MA_PROVIDER), MA_PROVIDER_TAG);
+                MapProviderSlots[i] = NULL;
+            }
+        }
+    }
+
+    // Consoles may have been brokered for reality callers without lxmonika being initialized.
+    CdpCleanupConsoleBroker();
+}
+
+extern "C"
+NTSTATUS
+MapLoadOptions(
+    _In_ PCUNICODE_STRING RegistryPath
+)
+{
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(
+        &objectAttributes,
+        (PUNICODE_STRING)RegistryPath,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+    );
+
+    HANDLE hdlKey = NULL;
+    MA_RETURN_IF_FAIL(ZwOpenKey(&hdlKey, KEY_READ, &objectAttributes));
+    AUTO_RESOURCE(hdlKey, ZwClose);
+
+    const auto QueryDword = [&](PCWSTR pName, DWORD* pValue)
+    {
+        UNICODE_STRING strName;
+        RtlInitUnicodeString(&strName, pName);
+
+        UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(DWORD)];
+        PKEY_VALUE_PARTIAL_INFORMATION pInfo = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+        ULONG ulLength = 0;
+
+        if (NT_SUCCESS(ZwQueryValueKey(hdlKey, &strName, KeyValuePartialInformation,
+                pInfo, sizeof(buffer), &ulLength))
+            && pInfo->Type == REG_DWORD
+            && pInfo->DataLength == sizeof(DWORD))
+        {
+            *pValue = *(DWORD*)pInfo->Data;
+        }
+    };
+
+    DWORD dwLazyImageNames = MapLazyImageNames;
+    QueryDword(L"LazyImageNames", &dwLazyImageNames);
+    MapLazyImageNames = dwLazyImageNames != 0;
+
+    DWORD dwSelfBenchmark = MapSelfBenchmark;
+    QueryDword(L"SelfBenchmark", &dwSelfBenchmark);
+    MapSelfBenchmark = dwSelfBenchmark != 0;
+
+    DWORD dwProfiling = MapProfiling;
+    QueryDword(L"Profiling", &dwProfiling);
+    MapProfiling = dwProfiling != 0;
+
+    DWORD dwWarmPoolSize = (DWORD)MapWarmPoolSize;
+    QueryDword(L"WarmPoolSize", &dwWarmPoolSize);
+    MapWarmPoolSize = min(dwWarmPoolSize, (DWORD)MA_WARM_POOL_SIZE_MAX);
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapRecordBootPhase(
+    _In_ MA_BOOT_PHASE Phase,
+    _In_ LONG64 Start,
+    _In_ NTSTATUS Status
+)
+{
+    // Boot phases run sequentially during DriverEntry, so no synchronization is needed.
+    if (MapBootProfile.Recorded & (1ul << Phase))
+    {
+        return;
     }
+
+    MapBootProfile.Ticks[Phase] = KeQueryPerformanceCounter(NULL).QuadPart - Start;
+    MapBootProfile.Status[Phase] = Status;
+    MapBootProfile.Recorded |= (1ul << Phase);
+}
+
+extern "C"
+VOID
+MapQueryBootProfile(
+    _Out_ PMA_BOOT_PROFILE Profile
+)
+{
+    *Profile = MapBootProfile;
+
+    LARGE_INTEGER liFrequency;
+    KeQueryPerformanceCounter(&liFrequency);
+    Profile->Frequency = liFrequency.QuadPart;
+
+    // The lookup is timed by picosupport itself, since it may run from several callers.
+    PICOSP_LOCATE_METHOD method;
+    LONG64 iTicks;
+    PicoSppQueryLocateProfile(&method, &iTicks);
+
+    if (iTicks != 0)
+    {
+        Profile->Ticks[MaBootPhaseLocateProviderRoutines] = iTicks;
+        Profile->Status[MaBootPhaseLocateProviderRoutines] =
+            (method != PicoSpLocateMethodNone) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+        Profile->Recorded |= (1ul << MaBootPhaseLocateProviderRoutines);
+    }
+    Profile->LocateMethod = (ULONG)method;
 }
 
 
@@ -244,15 +382,14 @@ MaRegisterPicoProvider(
     return MaRegisterPicoProviderEx(ProviderRoutines, PicoRoutines, NULL, NULL, NULL);
 }
 
-extern "C"
-MONIKA_EXPORT
-NTSTATUS NTAPI
-MaRegisterPicoProviderEx(
+static
+NTSTATUS
+MapRegisterPicoProvider(
     _In_ PPS_PICO_PROVIDER_ROUTINES ProviderRoutines,
     _Inout_ PPS_PICO_ROUTINES PicoRoutines,
     _In_opt_ PMA_PICO_PROVIDER_ROUTINES AdditionalProviderRoutines,
     _Inout_opt_ PMA_PICO_ROUTINES AdditionalPicoRoutines,
-    _Out_opt_ PSIZE_T Index
+    _Out_ PSIZE_T Index
 )
 {
     if (ProviderRoutines->Size > sizeof(PS_PICO_PROVIDER_ROUTINES)
@@ -329,19 +466,46 @@ MaRegisterPicoProviderEx(
         return status;
     }
 
+    Locker<PushLock> lock(&MapProvidersLock);
+
     // Acquire an index for the provider.
-    // Once a provider has been registered, it cannot be unregistered.
-    // This is the same as the NT kernel as PsUnregisterPicoProvider does not exist.
-    SIZE_T uProviderIndex = InterlockedIncrementSizeT(&MapProvidersCount) - 1;
-    if (uProviderIndex >= MaPicoProviderMaxCount)
+    // Unlike the NT kernel, which does not have PsUnregisterPicoProvider, slots can be freed by
+    // MaUnregisterPicoProvider and are then reused here.
+    SIZE_T uProviderIndex = 0;
+    while (uProviderIndex < MaPicoProviderMaxCount && MapProviders[uProviderIndex].Registered)
     {
-        // Prevent SIZE_T overflow (quite hard on 64-bit systems).
-        InterlockedDecrementSizeT(&MapProvidersCount);
+        ++uProviderIndex;
+    }
 
+    if (uProviderIndex >= MaPicoProviderMaxCount)
+    {
         // PsRegisterPicoProvider would return STATUS_TOO_LATE here.
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    // Slots get their storage the first time a provider takes them, and keep it for reuse.
+    if (MapProviderSlots[uProviderIndex] == NULL)
+    {
+        PMA_PROVIDER pProvider = (PMA_PROVIDER)MapAllocatePool(
+            POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, sizeof(MA_PROVIDER), MA_PROVIDER_TAG);
+
+        if (pProvider == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(pProvider, sizeof(MA_PROVIDER));
+        ExInitializeRundownProtection(&pProvider->Rundown);
+        ExWaitForRundownProtectionRelease(&pProvider->Rundown);
+        ExRundownCompleted(&pProvider->Rundown);
+        InitializeListHead(&pProvider->SystemCallHooks);
+        MapInitializeProviderThunks(uProviderIndex, pProvider);
+
+        WritePointerRelease((PVOID volatile*)&MapProviderSlots[uProviderIndex], pProvider);
+    }
+
+    // The slot is still run down, so nobody else can read it while it is being filled.
+
     // Make sure all trailing members are filled with zero.
     memset(&MapProviderRoutines[uProviderIndex], 0, sizeof(PS_PICO_PROVIDER_ROUTINES));
     memcpy(&MapProviderRoutines[uProviderIndex], ProviderRoutines, ProviderRoutines->Size);
@@ -359,6 +523,7 @@ MaRegisterPicoProviderEx(
 
     // Allows compatibility between different versions of lxmonika.
     // (Hopefully, at least when the API becomes stable).
+    memset(&MapAdditionalProviderRoutines[uProviderIndex], 0, sizeof(MA_PICO_PROVIDER_ROUTINES));
     if (AdditionalProviderRoutines != NULL)
     {
         memcpy(&MapAdditionalProviderRoutines[uProviderIndex], AdditionalProviderRoutines,
@@ -374,11 +539,21 @@ MaRegisterPicoProviderEx(
     // Always set the correct detected ABI version.
     MapAdditionalProviderRoutines[uProviderIndex].AbiVersion = dwAbiVersion;
 
-    if (Index != NULL)
+    MapProviders[uProviderIndex].ActiveContexts = 0;
+    MapProviders[uProviderIndex].Registered = TRUE;
+
+    // Publish the slot. Everything written above is visible to anyone who manages to acquire
+    // the rundown protection.
+    KeMemoryBarrier();
+    ExReInitializeRundownProtection(&MapProviders[uProviderIndex].Rundown);
+
+    if (uProviderIndex >= MapProvidersCount)
     {
-        *Index = uProviderIndex;
+        InterlockedExchangePointer((PVOID*)&MapProvidersCount, (PVOID)(uProviderIndex + 1));
     }
 
+    *Index = uProviderIndex;
+
     if (MapLxssRegistering)
     {
         // The hooked built-in function has no way to inform the index.
@@ -388,72 +563,400 @@ MaRegisterPicoProviderEx(
     Logger::LogTrace("Registered Pico provider #", uProviderIndex, ".");
     Logger::LogTrace("Identified ABI version is ", (PVOID)(SIZE_T)dwAbiVersion, ".");
 
+    MapInvalidateProviderNames();
+
+    if (MapInstrumentation & MA_INSTRUMENT_ETW)
+    {
+        MapEtwWriteProviderRegistered(uProviderIndex);
+    }
+
     return STATUS_SUCCESS;
 }
 
 extern "C"
 MONIKA_EXPORT
 NTSTATUS NTAPI
-MaFindPicoProvider(
-    _In_ PCWSTR ProviderName,
-    _Out_ PSIZE_T Index
+MaRegisterPicoProviderEx(
+    _In_ PPS_PICO_PROVIDER_ROUTINES ProviderRoutines,
+    _Inout_ PPS_PICO_ROUTINES PicoRoutines,
+    _In_opt_ PMA_PICO_PROVIDER_ROUTINES AdditionalProviderRoutines,
+    _Inout_opt_ PMA_PICO_ROUTINES AdditionalPicoRoutines,
+    _Out_opt_ PSIZE_T Index
 )
 {
-    if (ProviderName == NULL || Index == NULL)
+    SIZE_T uProviderIndex = 0;
+    MA_RETURN_IF_FAIL(MapRegisterPicoProvider(ProviderRoutines, PicoRoutines,
+        AdditionalProviderRoutines, AdditionalPicoRoutines, &uProviderIndex));
+
+    // Only once the providers lock is released, as this calls back into the provider.
+    if (MapWarmPoolSize != 0)
+    {
+        NTSTATUS status = MaSetWarmPoolSize(uProviderIndex, MapWarmPoolSize);
+
+        if (!NT_SUCCESS(status) && status != STATUS_NOT_SUPPORTED)
+        {
+            Logger::LogWarning("Failed to set the warm pool size of provider #",
+                uProviderIndex, ", status=", (PVOID)status);
+        }
+    }
+
+    if (Index != NULL)
+    {
+        *Index = uProviderIndex;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaUnregisterPicoProvider(
+    _In_ SIZE_T Index
+)
+{
+    if (Index >= MaPicoProviderMaxCount)
     {
         return STATUS_INVALID_PARAMETER;
     }
 
-    // Ignore any potential increments of MapProvidersCount by MaRegisterPicoProvider.
-    // We cannot set a provider's name and then register it!
-    SIZE_T uCurrentProvidersCount = MapProvidersCount;
+    if (MapLxssPatched && Index == MapLxssProviderIndex)
+    {
+        // lxcore cannot be unloaded anyway.
+        return STATUS_ACCESS_DENIED;
+    }
+
+    Locker<PushLock> lock(&MapProvidersLock);
+
+    PMA_PROVIDER pProvider = &MapProviders[Index];
+
+    if (!pProvider->Registered)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    // Fail new lookups and wait for callers that are already inside the provider.
+    ExWaitForRundownProtectionRelease(&pProvider->Rundown);
+
+    // Contexts are only allocated while holding the rundown protection, so this count cannot
+    // increase any more.
+    if (pProvider->ActiveContexts != 0)
+    {
+        Logger::LogWarning("Provider #", Index, " still has ", pProvider->ActiveContexts,
+            " live processes or threads.");
+
+        ExReInitializeRundownProtection(&pProvider->Rundown);
+        return STATUS_DEVICE_BUSY;
+    }
+
+    ExRundownCompleted(&pProvider->Rundown);
+
+    MapRemoveSystemCallHooks((DWORD)Index);
+
+    memset(&pProvider->ProviderRoutines, 0, sizeof(pProvider->ProviderRoutines));
+    memset(&pProvider->AdditionalProviderRoutines, 0,
+        sizeof(pProvider->AdditionalProviderRoutines));
+    pProvider->Registered = FALSE;
+
+    MapInvalidateProviderNames();
+
+    Logger::LogTrace("Unregistered Pico provider #", Index, ".");
+
+    return STATUS_SUCCESS;
+}
 
-    // MapProvidersCount can briefly exceed the max count when drivers are trying to register a
-    // 17th provider. Using min should protect us from this issue.
-    uCurrentProvidersCount = min(uCurrentProvidersCount, MaPicoProviderMaxCount);
+extern "C"
+BOOLEAN
+MapReferenceProvider(
+    _In_ SIZE_T Index
+)
+{
+    if (Index >= MaPicoProviderMaxCount)
+    {
+        return FALSE;
+    }
+
+    return ExAcquireRundownProtection(&MapProviders[Index].Rundown);
+}
+
+extern "C"
+VOID
+MapDereferenceProvider(
+    _In_ SIZE_T Index
+)
+{
+    ExReleaseRundownProtection(&MapProviders[Index].Rundown);
+}
+
+extern "C"
+MONIKA_EXPORT
+VOID NTAPI
+MaNotifyPicoProviderRenamed(
+    _In_ SIZE_T Index
+)
+{
+    UNREFERENCED_PARAMETER(Index);
 
-    SIZE_T uNameLenBytes = (wcslen(ProviderName) + 1) * sizeof(WCHAR);
+    MapInvalidateProviderNames();
+}
 
-    SIZE_T uBestMatchLength = 0;
-    SIZE_T uBestMatchIndex = 0;
+extern "C"
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaPushPicoProvider(
+    _In_ SIZE_T Index,
+    _In_opt_ PVOID Context
+)
+{
+    if (Index >= MaPicoProviderMaxCount)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PMA_CONTEXT pContext = (PMA_CONTEXT)
+        MapOriginalRoutines.GetThreadContext(PsGetCurrentThread());
 
-    for (SIZE_T i = 0; i < uCurrentProvidersCount; ++i)
+    if (pContext == NULL || pContext->Magic != MA_CONTEXT_MAGIC)
     {
-        if (MapAdditionalProviderRoutines[i].GetAllocatedProviderName != NULL)
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (pContext->Provider == Index)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return MapPushContext(pContext, (DWORD)Index, Context);
+}
+
+extern "C"
+VOID
+MapInvalidateProviderNames()
+{
+    InterlockedIncrement(&MapProviderNamesGeneration);
+}
+
+static
+VOID
+MapFreeProviderNames()
+{
+    for (SIZE_T i = 0; i < MapProviderNames.Count; ++i)
+    {
+        MapFreePool(MapProviderNames.Entries[i].Name.Buffer,
+            MapProviderNames.Entries[i].Name.MaximumLength, MA_PROVIDER_NAME_TAG);
+    }
+
+    MapProviderNames.Count = 0;
+    MapProviderNames.Generation = 0;
+}
+
+extern "C"
+VOID
+MapCleanupProviderNames()
+{
+    Locker<PushLock> lock(&MapProviderNamesLock);
+
+    MapFreeProviderNames();
+}
+
+// Must be called with MapProviderNamesLock held exclusively.
+static
+NTSTATUS
+MapRebuildProviderNames()
+{
+    // Read first, so that changes made while rebuilding cause another rebuild.
+    LONG lGeneration = MapProviderNamesGeneration;
+
+    MapFreeProviderNames();
+    MapProviderNames.Complete = TRUE;
+
+    // Ignore any potential increments of MapProvidersCount by MaRegisterPicoProvider.
+    // We cannot set a provider's name and then register it!
+    SIZE_T uCurrentProvidersCount = min(MapProvidersCount, MaPicoProviderMaxCount);
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (SIZE_T i = 0; i < uCurrentProvidersCount && NT_SUCCESS(status); ++i)
+    {
+        // Skips free slots.
+        if (!MapReferenceProvider(i))
         {
-            PUNICODE_STRING pName = NULL;
-            if (!NT_SUCCESS(MapAdditionalProviderRoutines[i].GetAllocatedProviderName(&pName)))
+            continue;
+        }
+
+        PUNICODE_STRING pName = NULL;
+        if (MapAdditionalProviderRoutines[i].GetAllocatedProviderName == NULL)
+        {
+            // Nameless for good.
+        }
+        else if (!NT_SUCCESS(MapAdditionalProviderRoutines[i].GetAllocatedProviderName(&pName)))
+        {
+            MapProviderNames.Complete = FALSE;
+        }
+        else if (pName->Length != 0)
+        {
+            PWCH pBuffer = (PWCH)MapAllocatePool(PagedPool, pName->Length, MA_PROVIDER_NAME_TAG);
+
+            if (pBuffer == NULL)
+            {
+                status = STATUS_NO_MEMORY;
+            }
+            else
             {
-                continue;
+                RtlCopyMemory(pBuffer, pName->Buffer, pName->Length);
+
+                MA_PROVIDER_NAME_ENTRY entry =
+                {
+                    .Index = i,
+                    .Name =
+                    {
+                        .Length = pName->Length,
+                        .MaximumLength = pName->Length,
+                        .Buffer = pBuffer
+                    }
+                };
+
+                // Insertion sort, there are at most MaPicoProviderMaxCount entries.
+                SIZE_T uPosition = MapProviderNames.Count;
+                while (uPosition > 0 && RtlCompareUnicodeString(
+                    &MapProviderNames.Entries[uPosition - 1].Name, &entry.Name, FALSE) > 0)
+                {
+                    MapProviderNames.Entries[uPosition] = MapProviderNames.Entries[uPosition - 1];
+                    --uPosition;
+                }
+
+                MapProviderNames.Entries[uPosition] = entry;
+                ++MapProviderNames.Count;
             }
-            SIZE_T uCurrentMatch = RtlCompareMemory(pName->Buffer, ProviderName,
-                min(pName->Length, uNameLenBytes));
+        }
+
+        MapDereferenceProvider(i);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        MapFreeProviderNames();
+        return status;
+    }
+
+    MapProviderNames.Generation = lGeneration;
 
-            if (uCurrentMatch > uBestMatchLength)
+    return STATUS_SUCCESS;
+}
+
+// Copies the name before MapProviderNamesLock is taken, so that a bad pointer fails the lookup
+// instead of faulting with the lock held.
+static
+NTSTATUS
+MapCaptureProviderName(
+    _In_ PCWSTR ProviderName,
+    _Out_writes_(MA_NAME_MAX + 1) PWSTR Buffer
+)
+{
+    __try
+    {
+        SIZE_T uLength = 0;
+        while (ProviderName[uLength] != L'\0')
+        {
+            if (uLength == MA_NAME_MAX)
             {
-                uBestMatchLength = uCurrentMatch;
-                uBestMatchIndex = i;
+                return STATUS_NAME_TOO_LONG;
             }
+
+            Buffer[uLength] = ProviderName[uLength];
+            ++uLength;
+        }
+
+        Buffer[uLength] = L'\0';
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Must be called with MapProviderNamesLock held.
+static
+BOOLEAN
+MapLookupProviderName(
+    _In_ PCWSTR ProviderName,
+    _Out_ PSIZE_T Index
+)
+{
+    return MapMatchProviderName(MapProviderNames.Entries, MapProviderNames.Count,
+        ProviderName, Index);
+}
+
+extern "C"
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaFindPicoProvider(
+    _In_ PCWSTR ProviderName,
+    _Out_ PSIZE_T Index
+)
+{
+    if (ProviderName == NULL || Index == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WCHAR name[MA_NAME_MAX + 1];
+    MA_RETURN_IF_FAIL(MapCaptureProviderName(ProviderName, name));
+
+    BOOLEAN bFound = FALSE;
+    BOOLEAN bValid;
+
+    {
+        SharedPushLock shared(&MapProviderNamesLock);
+        Locker<SharedPushLock> lock(&shared);
+
+        bValid = MapProviderNames.Complete
+            && MapProviderNames.Generation == MapProviderNamesGeneration;
+
+        if (bValid)
+        {
+            bFound = MapLookupProviderName(name, Index);
+        }
+    }
+
+    if (!bValid)
+    {
+        Locker<PushLock> lock(&MapProviderNamesLock);
+
+        // Another thread may have rebuilt the index in the meantime.
+        if (!MapProviderNames.Complete
+            || MapProviderNames.Generation != MapProviderNamesGeneration)
+        {
+            MA_RETURN_IF_FAIL(MapRebuildProviderNames());
         }
+
+        bFound = MapLookupProviderName(name, Index);
     }
 
-    if (uBestMatchLength == 0)
+    if (!bFound)
     {
         return STATUS_NOT_FOUND;
     }
 
-    *Index = uBestMatchIndex;
     return STATUS_SUCCESS;
 }
 
 #define MA_CALL_IF_SUPPORTED(index, function, ...)                                              \
     do                                                                                          \
     {                                                                                           \
-        if (MapAdditionalProviderRoutines[index].function == NULL)                              \
+        if (!MapReferenceProvider(index))                                                       \
         {                                                                                       \
             return STATUS_INVALID_PARAMETER;                                                    \
         }                                                                                       \
-        return MapAdditionalProviderRoutines[index].function(__VA_ARGS__);                      \
+        NTSTATUS status_ = STATUS_INVALID_PARAMETER;                                            \
+        if (MapAdditionalProviderRoutines[index].function != NULL)                              \
+        {                                                                                       \
+            status_ = MapAdditionalProviderRoutines[index].function(__VA_ARGS__);               \
+        }                                                                                       \
+        MapDereferenceProvider(index);                                                          \
+        return status_;                                                                         \
     }                                                                                           \
     while (TRUE);
 
@@ -464,8 +967,7 @@ MaGetAllocatedPicoProviderName(
     _Out_ PUNICODE_STRING* ProviderName
 )
 {
-    if (Index >= MaPicoProviderMaxCount || Index >= MapProvidersCount
-        || ProviderName == NULL)
+    if (ProviderName == NULL)
     {
         return STATUS_INVALID_PARAMETER;
     }
@@ -473,6 +975,56 @@ MaGetAllocatedPicoProviderName(
     MA_CALL_IF_SUPPORTED(Index, GetAllocatedProviderName, ProviderName);
 }
 
+static
+NTSTATUS
+MapValidatePlacement(
+    _In_ const MA_PICO_SESSION_PLACEMENT* pPlacement
+)
+{
+    if ((pPlacement->Flags & ~MA_PLACEMENT_VALID_FLAGS) != 0 || pPlacement->Reserved != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    const GROUP_AFFINITY& affinity = pPlacement->Affinity;
+
+    if (pPlacement->Flags & MA_PLACEMENT_AFFINITY)
+    {
+        if (affinity.Group >= KeQueryActiveGroupCount() || affinity.Mask == 0
+            || (affinity.Mask & ~KeQueryGroupAffinity(affinity.Group)) != 0
+            || affinity.Reserved[0] != 0 || affinity.Reserved[1] != 0
+            || affinity.Reserved[2] != 0)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if (pPlacement->Flags & MA_PLACEMENT_PREFERRED_NODE)
+    {
+        if (pPlacement->PreferredNode > KeQueryHighestNodeNumber())
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        GROUP_AFFINITY nodeAffinity;
+        USHORT uCount = 0;
+        KeQueryNodeActiveAffinity(pPlacement->PreferredNode, &nodeAffinity, &uCount);
+
+        if (uCount == 0)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if ((pPlacement->Flags & MA_PLACEMENT_AFFINITY)
+            && (nodeAffinity.Group != affinity.Group || (nodeAffinity.Mask & affinity.Mask) == 0))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
 MONIKA_EXPORT
 NTSTATUS NTAPI
 MaStartSession(
@@ -480,13 +1032,210 @@ MaStartSession(
     _In_ PMA_PICO_SESSION_ATTRIBUTES SessionAttributes
 )
 {
-    if (Index >= MaPicoProviderMaxCount || Index >= MapProvidersCount
-        || SessionAttributes == NULL)
+    if (SessionAttributes == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (SessionAttributes->Size
+        >= RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Placement))
+    {
+        MA_RETURN_IF_FAIL(MapValidatePlacement(&SessionAttributes->Placement));
+    }
+
+    if (SessionAttributes->Size >= RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Limits))
+    {
+        MA_RETURN_IF_FAIL(MapValidateLimits(&SessionAttributes->Limits));
+    }
+
+    if (!MapReferenceProvider(Index))
     {
         return STATUS_INVALID_PARAMETER;
     }
 
-    MA_CALL_IF_SUPPORTED(Index, StartSession, SessionAttributes);
+    NTSTATUS status = STATUS_INVALID_PARAMETER;
+    if (MapAdditionalProviderRoutines[Index].StartSession != NULL)
+    {
+        PVOID pSession = NULL;
+        status = MapCreateSession((DWORD)Index, SessionAttributes, NULL, NULL, &pSession);
+
+        if (NT_SUCCESS(status))
+        {
+            status = MapAdditionalProviderRoutines[Index].StartSession(SessionAttributes);
+            MapSessionReturned(pSession, status);
+        }
+    }
+
+    if (MapInstrumentation & MA_INSTRUMENT_ETW)
+    {
+        MapEtwWriteSessionStarted(Index, status);
+    }
+
+    MapDereferenceProvider(Index);
+
+    return status;
+}
+
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaStartSessionAsync(
+    _In_ SIZE_T Index,
+    _In_ PMA_PICO_SESSION_ATTRIBUTES SessionAttributes,
+    _In_ PMA_PICO_SESSION_COMPLETION Completion,
+    _In_opt_ PVOID CompletionContext
+)
+{
+    if (SessionAttributes == NULL || Completion == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (SessionAttributes->Size
+        >= RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Placement))
+    {
+        MA_RETURN_IF_FAIL(MapValidatePlacement(&SessionAttributes->Placement));
+    }
+
+    if (SessionAttributes->Size >= RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Limits))
+    {
+        MA_RETURN_IF_FAIL(MapValidateLimits(&SessionAttributes->Limits));
+    }
+
+    if (!MapReferenceProvider(Index))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The provider cannot be unregistered while the session's processes are alive, so the
+    // reference is not held until the completion.
+    NTSTATUS status = STATUS_NOT_SUPPORTED;
+    if (MapAdditionalProviderRoutines[Index].StartSessionAsync != NULL)
+    {
+        PVOID pSession = NULL;
+        status = MapCreateSession((DWORD)Index, SessionAttributes,
+            Completion, CompletionContext, &pSession);
+
+        if (NT_SUCCESS(status))
+        {
+            // Sessions with limits are accounted for until their completion.
+            status = MapAdditionalProviderRoutines[Index].StartSessionAsync(SessionAttributes,
+                (pSession != NULL) ? MapSessionCompletion : Completion,
+                (pSession != NULL) ? pSession : CompletionContext);
+            MapSessionReturned(pSession, status);
+        }
+    }
+
+    if (status != STATUS_NOT_SUPPORTED && (MapInstrumentation & MA_INSTRUMENT_ETW))
+    {
+        MapEtwWriteSessionStarted(Index, status);
+    }
+
+    MapDereferenceProvider(Index);
+
+    return status;
+}
+
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaSetThreadPlacement(
+    _In_ PETHREAD Thread,
+    _In_ const MA_PICO_SESSION_PLACEMENT* Placement
+)
+{
+    if (Thread == NULL || Placement == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MA_RETURN_IF_FAIL(MapValidatePlacement(Placement));
+
+    if (Placement->Flags == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    HANDLE hdlThread = NULL;
+    MA_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        Thread,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION,
+        *PsThreadType,
+        KernelMode,
+        &hdlThread
+    ));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    if (Placement->Flags & MA_PLACEMENT_AFFINITY)
+    {
+        GROUP_AFFINITY affinity = Placement->Affinity;
+        MA_RETURN_IF_FAIL(ZwSetInformationThread(hdlThread, ThreadGroupInformation,
+            &affinity, sizeof(affinity)));
+    }
+
+    if (Placement->Flags & MA_PLACEMENT_PREFERRED_NODE)
+    {
+        GROUP_AFFINITY nodeAffinity;
+        KeQueryNodeActiveAffinity(Placement->PreferredNode, &nodeAffinity, NULL);
+
+        if (Placement->Flags & MA_PLACEMENT_AFFINITY)
+        {
+            nodeAffinity.Mask &= Placement->Affinity.Mask;
+        }
+
+        // Spread over the node, so that the threads of a session do not all start out on the
+        // same processor.
+        ULONG uIndex = (ULONG)InterlockedIncrement(&MapPlacementSequence)
+            % RtlNumberOfSetBitsUlongPtr(nodeAffinity.Mask);
+
+        UCHAR uNumber = 0;
+        for (ULONG uSeen = 0; ; ++uNumber)
+        {
+            if ((nodeAffinity.Mask & ((KAFFINITY)1 << uNumber)) && uSeen++ == uIndex)
+            {
+                break;
+            }
+        }
+
+        PROCESSOR_NUMBER processor
+        {
+            .Group = nodeAffinity.Group,
+            .Number = uNumber
+        };
+
+        MA_RETURN_IF_FAIL(ZwSetInformationThread(hdlThread, ThreadIdealProcessorEx,
+            &processor, sizeof(processor)));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaSetWarmPoolSize(
+    _In_ SIZE_T Index,
+    _In_ SIZE_T Size
+)
+{
+    if (Size > MA_WARM_POOL_SIZE_MAX)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!MapReferenceProvider(Index))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    NTSTATUS status = STATUS_NOT_SUPPORTED;
+    if (MapAdditionalProviderRoutines[Index].SetWarmPoolSize != NULL)
+    {
+        status = MapAdditionalProviderRoutines[Index].SetWarmPoolSize(Size);
+    }
+
+    MapDereferenceProvider(Index);
+
+    return status;
 }
 
 MONIKA_EXPORT
@@ -523,3 +1272,111 @@ MaUtilDuplicateKernelHandle(
         DUPLICATE_SAME_ACCESS
     );
 }
+
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaUtilGetHostConsole(
+    _In_ PEPROCESS HostProcess,
+    _Out_opt_ PHANDLE Console,
+    _Out_opt_ PHANDLE Input,
+    _Out_opt_ PHANDLE Output
+)
+{
+    return CdpGetHostConsole(HostProcess, Console, Input, Output);
+}
+
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaUtilGetConsoleMode(
+    _In_ HANDLE Console,
+    _In_ HANDLE Object,
+    _Out_ PULONG Mode
+)
+{
+    return CdpKernelConsoleGetMode(Console, Object, Mode);
+}
+
+MONIKA_EXPORT
+_Ret_range_(<= , FrameCount)
+ULONG NTAPI
+MaUtilWalkUserStack(
+    _In_ PKTRAP_FRAME TrapFrame,
+    _Out_writes_to_(FrameCount, return) PVOID* Callers,
+    _In_ ULONG FrameCount
+)
+{
+    if (TrapFrame == NULL || Callers == NULL || FrameCount == 0)
+    {
+        return 0;
+    }
+
+#ifdef _M_AMD64
+    ULONG_PTR uPc = TrapFrame->Rip;
+    ULONG_PTR uFrame = TrapFrame->Rbp;
+    ULONG_PTR uStack = TrapFrame->Rsp;
+#elif defined(_M_ARM64)
+    ULONG_PTR uPc = TrapFrame->Pc;
+    ULONG_PTR uFrame = TrapFrame->Fp;
+    ULONG_PTR uStack = TrapFrame->Sp;
+#else
+#error Walk the frame chain for this architecture!
+#endif
+
+    if (uPc >= MmUserProbeAddress)
+    {
+        return 0;
+    }
+
+    // Bounded, so that a sample stays within a few microseconds.
+    FrameCount = min(FrameCount, MA_USER_STACK_WALK_MAX);
+
+    ULONG uCount = 0;
+    Callers[uCount++] = (PVOID)uPc;
+
+    // Page faults cannot be taken at DISPATCH_LEVEL, not even inside __try, and whether a user
+    // page is resident can change under MmIsAddressValid as another thread of the process unmaps
+    // it.
+    if (KeGetCurrentIrql() >= DISPATCH_LEVEL)
+    {
+        return uCount;
+    }
+
+    ULONG_PTR uStackEnd = (uStack < MmUserProbeAddress - MA_USER_STACK_SPAN_MAX)
+        ? uStack + MA_USER_STACK_SPAN_MAX : MmUserProbeAddress;
+
+    while (uCount < FrameCount)
+    {
+        // Each record holds the next frame pointer and the return address.
+        if (uFrame < uStack || uFrame > uStackEnd - 2 * sizeof(ULONG_PTR)
+            || (uFrame & (sizeof(ULONG_PTR) - 1)) != 0)
+        {
+            break;
+        }
+
+        ULONG_PTR uNextFrame;
+        ULONG_PTR uReturn;
+
+        __try
+        {
+            uNextFrame = ((volatile ULONG_PTR*)uFrame)[0];
+            uReturn = ((volatile ULONG_PTR*)uFrame)[1];
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            break;
+        }
+
+        if (uReturn == 0 || uReturn >= MmUserProbeAddress)
+        {
+            break;
+        }
+
+        Callers[uCount++] = (PVOID)uReturn;
+
+        // Strictly up the stack, so that corrupt chains cannot loop.
+        uStack = uFrame + 2 * sizeof(ULONG_PTR);
+        uFrame = uNextFrame;
+    }
+
+    return uCount;
+}
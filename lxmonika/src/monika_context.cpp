@@ -1,57 +1,531 @@
 #include "monika.h"
 
+#include "Locker.h"
 #include "Logger.h"
 
 #define MA_CONTEXT_TAG ('xCaM')
 
+//
+// Context allocator
+//
+
+static LOOKASIDE_LIST_EX MapContextLookaside;
+static LOOKASIDE_LIST_EX MapImageNameLookaside;
+static BOOLEAN MapContextLookasideInitialized = FALSE;
+
+static SIZE_T MapContextTotalAllocates = 0;
+static SIZE_T MapContextAllocateMisses = 0;
+static SIZE_T MapContextLongImageNames = 0;
+static SIZE_T MapContextDeferredFrees = 0;
+static SIZE_T MapContextDeferredOverflows = 0;
+static SIZE_T MapContextDeferredBatches = 0;
+static SIZE_T MapContextCacheHits = 0;
+static SIZE_T MapContextThreadInherits = 0;
+
+// Per-processor stacks of free contexts, kept in front of the lookaside list. Process and thread
+// churn mostly allocates and frees on the same few processors, so this keeps the hot contexts
+// in the local cache and off the shared lookaside header.
+#define MA_CONTEXT_CACHE_DEPTH (16)
+
+typedef struct DECLSPEC_CACHEALIGN _MA_CONTEXT_CACHE {
+    SLIST_HEADER            Free;
+} MA_CONTEXT_CACHE, *PMA_CONTEXT_CACHE;
+
+static PMA_CONTEXT_CACHE MapContextCaches = NULL;
+static ULONG MapContextCacheCount = 0;
+
+// Exited context chains, linked through the FreeListEntry of their topmost context.
+static SLIST_HEADER MapContextFreeList;
+static WORK_QUEUE_ITEM MapContextFreeWorkItem;
+static volatile LONG MapContextFreeWorkQueued = FALSE;
+static volatile LONG MapContextFreePending = 0;
+static volatile LONG MapContextDeferredFreeEnabled = FALSE;
+
+static WORKER_THREAD_ROUTINE MapContextFreeWorker;
+
+// Contexts of live Pico processes, linked through their ProcessLink.
+static LIST_ENTRY MapProcessContexts = { &MapProcessContexts, &MapProcessContexts };
+static SIZE_T MapProcessContextsCount = 0;
+static PushLock MapProcessContextsLock;
+
+static
+VOID
+    MapDrainContextFreeList();
+
+static
+PVOID
+MapContextLookasideAllocate(
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T NumberOfBytes,
+    _In_ ULONG Tag,
+    _Inout_ PLOOKASIDE_LIST_EX Lookaside
+)
+{
+    // Only called when the list is empty.
+    if (Lookaside == &MapContextLookaside)
+    {
+        InterlockedIncrementSizeT(&MapContextAllocateMisses);
+    }
+
+    return MapAllocatePool(PoolType, NumberOfBytes, Tag);
+}
+
+static
+VOID
+MapContextLookasideFree(
+    _In_ PVOID Buffer,
+    _Inout_ PLOOKASIDE_LIST_EX Lookaside
+)
+{
+    // Both lists hand out blocks of a single size.
+    SIZE_T uSize = (Lookaside == &MapContextLookaside) ? sizeof(MA_CONTEXT) : sizeof(MA_IMAGE_NAME);
+
+    MapFreePool(Buffer, uSize, MA_CONTEXT_TAG);
+}
+
+extern "C"
+NTSTATUS
+MapInitializeContextAllocator()
+{
+    if (MapContextLookasideInitialized)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    MA_RETURN_IF_FAIL(ExInitializeLookasideListEx(
+        &MapContextLookaside,
+        MapContextLookasideAllocate,
+        MapContextLookasideFree,
+        PagedPool,
+        0,
+        sizeof(MA_CONTEXT),
+        MA_CONTEXT_TAG,
+        0
+    ));
+
+    NTSTATUS status = ExInitializeLookasideListEx(
+        &MapImageNameLookaside,
+        MapContextLookasideAllocate,
+        MapContextLookasideFree,
+        PagedPool,
+        0,
+        sizeof(MA_IMAGE_NAME),
+        MA_CONTEXT_TAG,
+        0
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        ExDeleteLookasideListEx(&MapContextLookaside);
+        return status;
+    }
+
+    // Optional, contexts come straight from the lookaside list without it.
+    ULONG ulProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    MapContextCaches = (PMA_CONTEXT_CACHE)MapAllocatePool(POOL_FLAG_NON_PAGED,
+        ulProcessors * sizeof(MA_CONTEXT_CACHE), MA_CONTEXT_TAG);
+
+    if (MapContextCaches != NULL)
+    {
+        for (ULONG i = 0; i < ulProcessors; ++i)
+        {
+            InitializeSListHead(&MapContextCaches[i].Free);
+        }
+        MapContextCacheCount = ulProcessors;
+    }
+
+    InitializeSListHead(&MapContextFreeList);
+    ExInitializeWorkItem(&MapContextFreeWorkItem, MapContextFreeWorker, NULL);
+    InterlockedExchange(&MapContextDeferredFreeEnabled, TRUE);
+
+    MapContextLookasideInitialized = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapCleanupContextAllocator()
+{
+    if (MapContextLookasideInitialized)
+    {
+        // New exits are freed inline from now on. Wait for a queued worker to finish, since it
+        // still uses the lookaside lists, then free whatever it left behind.
+        InterlockedExchange(&MapContextDeferredFreeEnabled, FALSE);
+
+        LARGE_INTEGER liInterval = { .QuadPart = -10 * 1000 };
+        while (MapContextFreeWorkQueued)
+        {
+            KeDelayExecutionThread(KernelMode, FALSE, &liInterval);
+        }
+
+        MapDrainContextFreeList();
+
+        if (MapContextCaches != NULL)
+        {
+            for (ULONG i = 0; i < MapContextCacheCount; ++i)
+            {
+                PSLIST_ENTRY pEntry = InterlockedFlushSList(&MapContextCaches[i].Free);
+                while (pEntry != NULL)
+                {
+                    PSLIST_ENTRY pNextEntry = pEntry->Next;
+                    ExFreeToLookasideListEx(&MapContextLookaside,
+                        CONTAINING_RECORD(pEntry, MA_CONTEXT, FreeListEntry));
+                    pEntry = pNextEntry;
+                }
+            }
+
+            MapFreePool(MapContextCaches, MapContextCacheCount * sizeof(MA_CONTEXT_CACHE),
+                MA_CONTEXT_TAG);
+            MapContextCaches = NULL;
+            MapContextCacheCount = 0;
+        }
+
+        ExDeleteLookasideListEx(&MapImageNameLookaside);
+        ExDeleteLookasideListEx(&MapContextLookaside);
+        MapContextLookasideInitialized = FALSE;
+    }
+}
+
+extern "C"
+VOID
+MapQueryContextStatistics(
+    _Out_ PMA_CONTEXT_STATISTICS Statistics
+)
+{
+    *Statistics = MA_CONTEXT_STATISTICS
+    {
+        .TotalAllocates = MapContextTotalAllocates,
+        .AllocateMisses = MapContextAllocateMisses,
+        .LongImageNames = MapContextLongImageNames,
+        .DeferredFrees = MapContextDeferredFrees,
+        .DeferredOverflows = MapContextDeferredOverflows,
+        .DeferredBatches = MapContextDeferredBatches,
+        .CacheHits = MapContextCacheHits,
+        .ThreadInherits = MapContextThreadInherits
+    };
+}
+
+//
+// Per-processor context cache
+//
+
+static
+PMA_CONTEXT
+MapAllocateContextMemory()
+{
+    ULONG ulProcessor = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (ulProcessor < MapContextCacheCount)
+    {
+        PSLIST_ENTRY pEntry = InterlockedPopEntrySList(&MapContextCaches[ulProcessor].Free);
+        if (pEntry != NULL)
+        {
+            InterlockedIncrementSizeT(&MapContextCacheHits);
+            return CONTAINING_RECORD(pEntry, MA_CONTEXT, FreeListEntry);
+        }
+    }
+
+    return (PMA_CONTEXT)ExAllocateFromLookasideListEx(&MapContextLookaside);
+}
+
+static
+VOID
+MapFreeContextMemory(
+    _In_ PMA_CONTEXT Context
+)
+{
+    ULONG ulProcessor = KeGetCurrentProcessorNumberEx(NULL);
+
+    // The depth is only a hint, a few extra entries do no harm.
+    if (ulProcessor < MapContextCacheCount
+        && QueryDepthSList(&MapContextCaches[ulProcessor].Free) < MA_CONTEXT_CACHE_DEPTH)
+    {
+        InterlockedPushEntrySList(&MapContextCaches[ulProcessor].Free, &Context->FreeListEntry);
+        return;
+    }
+
+    ExFreeToLookasideListEx(&MapContextLookaside, Context);
+}
+
+//
+// Image names
+//
+
+static
+PMA_IMAGE_NAME
+MapAllocateLazyImageName(
+    _In_ PFILE_OBJECT FileObject
+)
+{
+    PMA_IMAGE_NAME pImageName = (PMA_IMAGE_NAME)ExAllocateFromLookasideListEx(
+        &MapImageNameLookaside);
+
+    if (pImageName == NULL)
+    {
+        return NULL;
+    }
+
+    ObReferenceObject(FileObject);
+
+    pImageName->ReferenceCount = 1;
+    pImageName->ResolvedName = NULL;
+    pImageName->FileObject = FileObject;
+    pImageName->Name.Buffer = pImageName->Buffer;
+    pImageName->Name.Length = 0;
+    pImageName->Name.MaximumLength = sizeof(pImageName->Buffer);
+
+    return pImageName;
+}
+
+static
+PMA_IMAGE_NAME
+MapAllocateImageName(
+    _In_ PCUNICODE_STRING Name
+)
+{
+    USHORT uLen = Name->Length;
+    PMA_IMAGE_NAME pImageName = NULL;
+
+    if (uLen <= sizeof(pImageName->Buffer))
+    {
+        pImageName = (PMA_IMAGE_NAME)ExAllocateFromLookasideListEx(&MapImageNameLookaside);
+        uLen = sizeof(pImageName->Buffer);
+    }
+    else
+    {
+        InterlockedIncrementSizeT(&MapContextLongImageNames);
+
+        // Long names simply extend past the end of the inline buffer.
+        pImageName = (PMA_IMAGE_NAME)MapAllocatePool(PagedPool,
+            FIELD_OFFSET(MA_IMAGE_NAME, Buffer) + uLen, MA_CONTEXT_TAG);
+    }
+
+    if (pImageName == NULL)
+    {
+        return NULL;
+    }
+
+    pImageName->ReferenceCount = 1;
+    pImageName->ResolvedName = &pImageName->Name;
+    pImageName->FileObject = NULL;
+    pImageName->Name.Buffer = pImageName->Buffer;
+    pImageName->Name.Length = 0;
+    pImageName->Name.MaximumLength = uLen;
+    RtlCopyUnicodeString(&pImageName->Name, Name);
+
+    return pImageName;
+}
+
+extern "C"
+PCUNICODE_STRING
+MapGetImageName(
+    _In_ PMA_IMAGE_NAME ImageName
+)
+{
+    PUNICODE_STRING pName = ImageName->ResolvedName;
+
+    if (pName != NULL || ImageName->FileObject == NULL)
+    {
+        return pName;
+    }
+
+    ULONG ulLength = 0;
+    NTSTATUS status = ObQueryNameString(ImageName->FileObject, NULL, 0, &ulLength);
+
+    if (status != STATUS_INFO_LENGTH_MISMATCH || ulLength == 0)
+    {
+        return NULL;
+    }
+
+    ULONG ulSize = ulLength;
+
+    POBJECT_NAME_INFORMATION pInfo = (POBJECT_NAME_INFORMATION)MapAllocatePool(PagedPool,
+        ulSize, MA_CONTEXT_TAG);
+
+    if (pInfo == NULL)
+    {
+        return NULL;
+    }
+
+    if (!NT_SUCCESS(ObQueryNameString(ImageName->FileObject, pInfo, ulSize, &ulLength)))
+    {
+        MapFreePool(pInfo, ulSize, MA_CONTEXT_TAG);
+        return NULL;
+    }
+
+    // The name follows the header, so the rest of the block is its buffer. Stored for
+    // MapDereferenceImageName, which frees the block by its size.
+    pInfo->Name.MaximumLength = (USHORT)(ulSize - sizeof(OBJECT_NAME_INFORMATION));
+
+    // Concurrent first queries race to publish. The losers free their copy and use the winner's.
+    pName = (PUNICODE_STRING)InterlockedCompareExchangePointer(
+        (PVOID volatile*)&ImageName->ResolvedName, &pInfo->Name, NULL);
+
+    if (pName != NULL)
+    {
+        MapFreePool(pInfo, ulSize, MA_CONTEXT_TAG);
+        return pName;
+    }
+
+    return &pInfo->Name;
+}
+
+static
+PMA_IMAGE_NAME
+MapReferenceImageName(
+    _In_opt_ PMA_IMAGE_NAME ImageName
+)
+{
+    if (ImageName != NULL)
+    {
+        InterlockedIncrementSizeT(&ImageName->ReferenceCount);
+    }
+
+    return ImageName;
+}
+
+static
+VOID
+MapDereferenceImageName(
+    _In_opt_ PMA_IMAGE_NAME ImageName
+)
+{
+    if (ImageName == NULL || InterlockedDecrementSizeT(&ImageName->ReferenceCount) != 0)
+    {
+        return;
+    }
+
+    if (ImageName->FileObject != NULL)
+    {
+        if (ImageName->ResolvedName != NULL)
+        {
+            MapFreePool(CONTAINING_RECORD(ImageName->ResolvedName, OBJECT_NAME_INFORMATION, Name),
+                sizeof(OBJECT_NAME_INFORMATION) + ImageName->ResolvedName->MaximumLength,
+                MA_CONTEXT_TAG);
+        }
+
+        ObDereferenceObject(ImageName->FileObject);
+    }
+
+    if (ImageName->Name.MaximumLength <= sizeof(ImageName->Buffer))
+    {
+        ExFreeToLookasideListEx(&MapImageNameLookaside, ImageName);
+    }
+    else
+    {
+        MapFreePool(ImageName, FIELD_OFFSET(MA_IMAGE_NAME, Buffer) + ImageName->Name.MaximumLength,
+            MA_CONTEXT_TAG);
+    }
+}
+
+//
+// Context lifetime
+//
+
 extern "C"
 PMA_CONTEXT
 MapAllocateContext(
     _In_ DWORD Provider,
     _In_opt_ PVOID OriginalContext,
-    _In_opt_ PPS_PICO_CREATE_INFO CreateInfo
+    _In_opt_ PPS_PICO_CREATE_INFO CreateInfo,
+    _In_opt_ PMA_CONTEXT OwnerContext
 )
 {
-    PMA_CONTEXT pContext = (PMA_CONTEXT)
-        ExAllocatePool2(PagedPool, sizeof(MA_CONTEXT), MA_CONTEXT_TAG);
+    // Keeps the provider from being unregistered while the context is being attached to it.
+    if (!MapReferenceProvider(Provider))
+    {
+        return NULL;
+    }
+
+    PMA_CONTEXT pContext = MapAllocateContextMemory();
+
+    InterlockedIncrementSizeT(&MapContextTotalAllocates);
 
     if (pContext != NULL)
     {
+        InterlockedIncrementSizeT(&MapProviders[Provider].ActiveContexts);
+        MapLxssContextAttached(Provider);
+
         *pContext = MA_CONTEXT
         {
             .Magic = MA_CONTEXT_MAGIC,
             .Provider = Provider,
             .Context = OriginalContext,
-            .Parent = NULL
+            .DispatchSystemCall = MapProviders[Provider].ProviderRoutines.DispatchSystemCall,
+            .ImageFileName = NULL
         };
 
-        if (CreateInfo != NULL
-            && CreateInfo->ImageFileName != NULL
-            && CreateInfo->ImageFileName->Length != 0)
+        if (OwnerContext != NULL && OwnerContext->ImageFileName != NULL)
         {
-            USHORT uLen = CreateInfo->ImageFileName->Length;
-
-            pContext->ImageFileName.Buffer = (PWSTR)
-                ExAllocatePool2(PagedPool, uLen, MA_CONTEXT_TAG);
+            pContext->ImageFileName = MapReferenceImageName(OwnerContext->ImageFileName);
+        }
+        else if (MapLazyImageNames && CreateInfo != NULL && CreateInfo->FileObject != NULL)
+        {
+            // Almost nothing asks for the name, so only build it once somebody does.
+            pContext->ImageFileName = MapAllocateLazyImageName(CreateInfo->FileObject);
 
-            if (pContext->ImageFileName.Buffer != NULL)
+            if (pContext->ImageFileName == NULL)
             {
-                pContext->ImageFileName.MaximumLength = uLen;
-                RtlCopyUnicodeString(&pContext->ImageFileName, CreateInfo->ImageFileName);
+                Logger::LogWarning("Failed to allocate memory for image file name.");
             }
-            else
+        }
+        else if (CreateInfo != NULL
+            && CreateInfo->ImageFileName != NULL
+            && CreateInfo->ImageFileName->Length != 0)
+        {
+            pContext->ImageFileName = MapAllocateImageName(CreateInfo->ImageFileName);
+
+            if (pContext->ImageFileName == NULL)
             {
                 Logger::LogWarning("Failed to allocate memory for image file name.");
             }
         }
     }
 
+    MapDereferenceProvider(Provider);
+
     return pContext;
 }
 
 extern "C"
+PMA_CONTEXT
+MapAllocateThreadContext(
+    _In_ PMA_CONTEXT ProcessContext,
+    _In_opt_ PVOID OriginalContext
+)
+{
+    PMA_CONTEXT pContext = MapAllocateContextMemory();
+
+    InterlockedIncrementSizeT(&MapContextTotalAllocates);
+
+    if (pContext == NULL)
+    {
+        return NULL;
+    }
+
+    InterlockedIncrementSizeT(&MapContextThreadInherits);
+
+    // The process context is counted in ActiveContexts, so the provider cannot be unregistered
+    // while it is alive. No rundown protection is needed.
+    InterlockedIncrementSizeT(&MapProviders[ProcessContext->Provider].ActiveContexts);
+    MapLxssContextAttached(ProcessContext->Provider);
+
+    *pContext = MA_CONTEXT
+    {
+        .Magic = MA_CONTEXT_MAGIC,
+        .Provider = ProcessContext->Provider,
+        .Context = OriginalContext,
+        .DispatchSystemCall = ProcessContext->DispatchSystemCall,
+        .ImageFileName = MapReferenceImageName(ProcessContext->ImageFileName)
+    };
+
+    return pContext;
+}
+
+static
 VOID
-MapFreeContext(
+MapDetachContextChain(
     _In_ PMA_CONTEXT Context
 )
 {
@@ -62,39 +536,196 @@ MapFreeContext(
     }
 #endif
 
-    do
+    // Done as soon as the context exits, so that provider unregistration never has to wait for
+    // the deferred frees.
+    MapUnlinkProcessContext(Context);
+
+    InterlockedDecrementSizeT(&MapProviders[Context->Provider].ActiveContexts);
+    MapLxssContextDetached(Context->Provider);
+
+    PMA_CONTEXT_FRAME pFrame;
+    for (ULONG i = 0; (pFrame = MapGetContextParent(Context, i)) != NULL; ++i)
+    {
+        InterlockedDecrementSizeT(&MapProviders[pFrame->Provider].ActiveContexts);
+        MapLxssContextDetached(pFrame->Provider);
+    }
+}
+
+static
+VOID
+MapReleaseContextChain(
+    _In_ PMA_CONTEXT Context
+)
+{
+    MapDereferenceImageName(Context->ImageFileName);
+
+    PMA_CONTEXT_FRAME pFrame;
+    for (ULONG i = 0; (pFrame = MapGetContextParent(Context, i)) != NULL; ++i)
+    {
+        MapDereferenceImageName(pFrame->ImageFileName);
+    }
+
+    if (Context->OverflowFrames != NULL)
+    {
+        MapFreePool(Context->OverflowFrames,
+            Context->OverflowCapacity * sizeof(MA_CONTEXT_FRAME), MA_CONTEXT_TAG);
+    }
+
+    MapFreeContextMemory(Context);
+}
+
+extern "C"
+VOID
+MapFreeContext(
+    _In_ PMA_CONTEXT Context
+)
+{
+    MapDetachContextChain(Context);
+    MapReleaseContextChain(Context);
+}
+
+extern "C"
+VOID
+MapFreeContextDeferred(
+    _In_ PMA_CONTEXT Context
+)
+{
+    MapDetachContextChain(Context);
+
+    if (MapContextDeferredFreeEnabled)
     {
-        PMA_CONTEXT pParentContext = Context->Parent;
-        if (Context->ImageFileName.Buffer != NULL)
+        if (InterlockedIncrement(&MapContextFreePending) <= MA_CONTEXT_DEFERRED_FREE_MAX)
         {
-            ExFreePoolWithTag(Context->ImageFileName.Buffer, MA_CONTEXT_TAG);
+            InterlockedIncrementSizeT(&MapContextDeferredFrees);
+            InterlockedPushEntrySList(&MapContextFreeList, &Context->FreeListEntry);
+
+            // Only one worker is queued at a time. Everything pushed until it runs makes up its
+            // batch.
+            if (InterlockedCompareExchange(&MapContextFreeWorkQueued, TRUE, FALSE) == FALSE)
+            {
+                ExQueueWorkItem(&MapContextFreeWorkItem, DelayedWorkQueue);
+            }
+
+            return;
         }
-        ExFreePoolWithTag(Context, MA_CONTEXT_TAG);
-        Context = pParentContext;
+
+        // Too many exits are waiting already. Keep memory bounded by freeing this one inline.
+        InterlockedDecrement(&MapContextFreePending);
+        InterlockedIncrementSizeT(&MapContextDeferredOverflows);
     }
-    while (Context != NULL);
+
+    MapReleaseContextChain(Context);
+}
+
+static
+VOID
+MapDrainContextFreeList()
+{
+    PSLIST_ENTRY pEntry = InterlockedFlushSList(&MapContextFreeList);
+
+    while (pEntry != NULL)
+    {
+        PSLIST_ENTRY pNextEntry = pEntry->Next;
+        MapReleaseContextChain(CONTAINING_RECORD(pEntry, MA_CONTEXT, FreeListEntry));
+        InterlockedDecrement(&MapContextFreePending);
+        pEntry = pNextEntry;
+    }
+}
+
+static
+VOID
+MapContextFreeWorker(
+    _In_ PVOID Parameter
+)
+{
+    UNREFERENCED_PARAMETER(Parameter);
+
+    do
+    {
+        InterlockedIncrementSizeT(&MapContextDeferredBatches);
+        MapDrainContextFreeList();
+
+        InterlockedExchange(&MapContextFreeWorkQueued, FALSE);
+
+        // Contexts pushed after the flush but before the flag was cleared did not queue another
+        // worker. Take care of them here unless a new worker has already been queued.
+    }
+    while (QueryDepthSList(&MapContextFreeList) != 0
+        && InterlockedCompareExchange(&MapContextFreeWorkQueued, TRUE, FALSE) == FALSE);
 }
 
 extern "C"
 NTSTATUS
 MapPushContext(
     _Inout_ PMA_CONTEXT CurrentContext,
-    _In_ PMA_CONTEXT NewContext
+    _In_ DWORD Provider,
+    _In_opt_ PVOID OriginalContext
 )
 {
 #ifdef DBG
-    if (CurrentContext == NULL || CurrentContext->Magic != MA_CONTEXT_MAGIC
-        || NewContext == NULL || NewContext->Magic != MA_CONTEXT_MAGIC)
+    if (CurrentContext == NULL || CurrentContext->Magic != MA_CONTEXT_MAGIC)
     {
         DbgBreakPoint();
         return STATUS_INVALID_PARAMETER;
     }
 #endif
 
-    MA_CONTEXT TempContext = *CurrentContext;
-    *CurrentContext = *NewContext;
-    CurrentContext->Parent = NewContext;
-    *NewContext = TempContext;
+    ULONG ulFrame = CurrentContext->Depth;
+
+    if (ulFrame >= MA_CONTEXT_INLINE_DEPTH + CurrentContext->OverflowCapacity)
+    {
+        // Deep nesting is rare. Grow geometrically so that repeated pushes stay cheap.
+        ULONG ulCapacity = max(CurrentContext->OverflowCapacity * 2, MA_CONTEXT_INLINE_DEPTH);
+
+        PMA_CONTEXT_FRAME pFrames = (PMA_CONTEXT_FRAME)MapAllocatePool(PagedPool,
+            ulCapacity * sizeof(MA_CONTEXT_FRAME), MA_CONTEXT_TAG);
+
+        if (pFrames == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+
+        if (CurrentContext->OverflowFrames != NULL)
+        {
+            RtlCopyMemory(pFrames, CurrentContext->OverflowFrames,
+                CurrentContext->OverflowCapacity * sizeof(MA_CONTEXT_FRAME));
+            MapFreePool(CurrentContext->OverflowFrames,
+                CurrentContext->OverflowCapacity * sizeof(MA_CONTEXT_FRAME), MA_CONTEXT_TAG);
+        }
+
+        CurrentContext->OverflowFrames = pFrames;
+        CurrentContext->OverflowCapacity = ulCapacity;
+    }
+
+    // Keeps the provider from being unregistered while the context is being attached to it.
+    if (!MapReferenceProvider(Provider))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InterlockedIncrementSizeT(&MapProviders[Provider].ActiveContexts);
+    MapLxssContextAttached(Provider);
+
+    PMA_CONTEXT_FRAME pFrame = (ulFrame < MA_CONTEXT_INLINE_DEPTH)
+        ? &CurrentContext->InlineFrames[ulFrame]
+        : &CurrentContext->OverflowFrames[ulFrame - MA_CONTEXT_INLINE_DEPTH];
+
+    *pFrame = MA_CONTEXT_FRAME
+    {
+        .Provider = CurrentContext->Provider,
+        .Context = CurrentContext->Context,
+        .DispatchSystemCall = CurrentContext->DispatchSystemCall,
+        .ImageFileName = CurrentContext->ImageFileName
+    };
+
+    // The parent frame keeps its reference to the image name.
+    CurrentContext->Provider = Provider;
+    CurrentContext->Context = OriginalContext;
+    CurrentContext->DispatchSystemCall = MapProviders[Provider].ProviderRoutines.DispatchSystemCall;
+    CurrentContext->ImageFileName = MapReferenceImageName(pFrame->ImageFileName);
+    CurrentContext->Depth = ulFrame + 1;
+
+    MapDereferenceProvider(Provider);
 
     return STATUS_SUCCESS;
 }
@@ -107,15 +738,190 @@ MapPopContext(
 {
 #ifdef DBG
     if (CurrentContext == NULL || CurrentContext->Magic != MA_CONTEXT_MAGIC
-        || CurrentContext->Parent == NULL)
+        || CurrentContext->Depth == 0)
     {
         return STATUS_INVALID_PARAMETER;
     }
 #endif
 
-    MA_CONTEXT TempContext = *(CurrentContext->Parent);
-    ExFreePoolWithTag(CurrentContext->Parent, MA_CONTEXT_TAG);
-    *CurrentContext = TempContext;
+    PMA_CONTEXT_FRAME pParent = MapGetContextParent(CurrentContext, 0);
+
+    InterlockedDecrementSizeT(&MapProviders[CurrentContext->Provider].ActiveContexts);
+    MapLxssContextDetached(CurrentContext->Provider);
+    MapDereferenceImageName(CurrentContext->ImageFileName);
+
+    CurrentContext->Provider = pParent->Provider;
+    CurrentContext->Context = pParent->Context;
+    CurrentContext->DispatchSystemCall = pParent->DispatchSystemCall;
+    CurrentContext->ImageFileName = pParent->ImageFileName;
+    --CurrentContext->Depth;
 
     return STATUS_SUCCESS;
 }
+
+//
+// Process table
+//
+
+extern "C"
+VOID
+MapLinkProcessContext(
+    _Inout_ PMA_CONTEXT Context
+)
+{
+    Locker<PushLock> lock(&MapProcessContextsLock);
+
+    InsertTailList(&MapProcessContexts, &Context->ProcessLink);
+    ++MapProcessContextsCount;
+}
+
+extern "C"
+VOID
+MapLinkThreadContext(
+    _Inout_ PMA_CONTEXT Context,
+    _Inout_ PMA_CONTEXT ProcessContext
+)
+{
+    Locker<PushLock> lock(&MapProcessContextsLock);
+
+    // Only processes in the table are queried.
+    if (ProcessContext->ProcessLink.Flink == NULL)
+    {
+        return;
+    }
+
+    if (ProcessContext->Threads.Flink == NULL)
+    {
+        InitializeListHead(&ProcessContext->Threads);
+    }
+
+    InsertTailList(&ProcessContext->Threads, &Context->ProcessLink);
+    Context->ProcessContext = ProcessContext;
+}
+
+static
+VOID
+MapRollUpThreadContext(
+    _Inout_ PMA_CONTEXT Context
+)
+{
+    // The thread has exited, so its counters no longer move.
+    PMA_CONTEXT pProcessContext = Context->ProcessContext;
+
+    InterlockedAddNoFence64(&pProcessContext->SystemCalls, Context->SystemCalls);
+    InterlockedAddNoFence64(&pProcessContext->SystemCallTime, Context->SystemCallTime);
+    InterlockedAddNoFence64(&pProcessContext->Exceptions, Context->Exceptions);
+
+    RemoveEntryList(&Context->ProcessLink);
+    Context->ProcessLink.Flink = NULL;
+    Context->ProcessContext = NULL;
+}
+
+extern "C"
+VOID
+MapUnlinkProcessContext(
+    _Inout_ PMA_CONTEXT Context
+)
+{
+    // Contexts start out zeroed, so unlinked ones have no Flink.
+    if (Context->ProcessLink.Flink == NULL)
+    {
+        return;
+    }
+
+    Locker<PushLock> lock(&MapProcessContextsLock);
+
+    if (Context->ProcessLink.Flink == NULL)
+    {
+        return;
+    }
+
+    if (Context->ProcessContext != NULL)
+    {
+        MapRollUpThreadContext(Context);
+        return;
+    }
+
+    // Threads exit before their process does, but do not leave dangling links if one has not.
+    if (Context->Threads.Flink != NULL)
+    {
+        while (!IsListEmpty(&Context->Threads))
+        {
+            MapRollUpThreadContext(
+                CONTAINING_RECORD(Context->Threads.Flink, MA_CONTEXT, ProcessLink));
+        }
+    }
+
+    RemoveEntryList(&Context->ProcessLink);
+    Context->ProcessLink.Flink = NULL;
+    --MapProcessContextsCount;
+}
+
+extern "C"
+VOID
+MapQueryProcesses(
+    _In_opt_ HANDLE ProcessId,
+    _Out_writes_to_(Count, *Read) PMA_PROCESS_INFORMATION Processes,
+    _In_ SIZE_T Count,
+    _Out_ PSIZE_T Read,
+    _Out_ PSIZE_T Total
+)
+{
+    ULONG64 uProcessId = (ULONG64)(ULONG_PTR)ProcessId;
+    SIZE_T uRead = 0;
+    SIZE_T uTotal = 0;
+
+    MapProcessContextsLock.LockShared();
+
+    for (PLIST_ENTRY pEntry = MapProcessContexts.Flink; pEntry != &MapProcessContexts;
+        pEntry = pEntry->Flink)
+    {
+        PMA_CONTEXT pContext = CONTAINING_RECORD(pEntry, MA_CONTEXT, ProcessLink);
+
+        if (uProcessId != 0 && pContext->ProcessId != uProcessId)
+        {
+            continue;
+        }
+
+        ++uTotal;
+
+        if (uRead < Count)
+        {
+            // Counters are read without synchronization, like the per-provider ones.
+            MA_PROCESS_INFORMATION information =
+            {
+                .ProcessId = pContext->ProcessId,
+                .Provider = pContext->Provider,
+                .Depth = pContext->Depth,
+                .SystemCalls = (ULONG64)ReadNoFence64(&pContext->SystemCalls),
+                .SystemCallTime = (ULONG64)ReadNoFence64(&pContext->SystemCallTime),
+                .Exceptions = (ULONG64)ReadNoFence64(&pContext->Exceptions)
+            };
+
+            // Running threads have not been rolled up yet.
+            if (pContext->Threads.Flink != NULL)
+            {
+                for (PLIST_ENTRY pThreadEntry = pContext->Threads.Flink;
+                    pThreadEntry != &pContext->Threads; pThreadEntry = pThreadEntry->Flink)
+                {
+                    PMA_CONTEXT pThreadContext =
+                        CONTAINING_RECORD(pThreadEntry, MA_CONTEXT, ProcessLink);
+
+                    information.SystemCalls +=
+                        (ULONG64)ReadNoFence64(&pThreadContext->SystemCalls);
+                    information.SystemCallTime +=
+                        (ULONG64)ReadNoFence64(&pThreadContext->SystemCallTime);
+                    information.Exceptions +=
+                        (ULONG64)ReadNoFence64(&pThreadContext->Exceptions);
+                }
+            }
+
+            Processes[uRead++] = information;
+        }
+    }
+
+    MapProcessContextsLock.UnlockShared();
+
+    *Read = uRead;
+    *Total = uTotal;
+}
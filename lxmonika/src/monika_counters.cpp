@@ -0,0 +1,255 @@
+#include "monika.h"
+
+#include "os.h"
+
+#include "AutoResource.h"
+#include "Locker.h"
+
+static_assert(sizeof(MA_COUNTERS_PAGE) <= PAGE_SIZE);
+
+//
+// Counters page data
+//
+
+static HANDLE MapCountersSection = NULL;
+static PMA_COUNTERS_PAGE MapCountersPage = NULL;
+
+static KTIMER MapCountersTimer;
+static KDPC MapCountersDpc;
+static WORK_QUEUE_ITEM MapCountersWorkItem;
+static volatile LONG MapCountersWorkQueued = FALSE;
+
+// Views mapped through files that are still open. The timer only runs while there are any.
+static SIZE_T MapCountersViews = 0;
+
+// Guards the creation and destruction of the page, and the timer.
+static PushLock MapCountersLock;
+
+static KDEFERRED_ROUTINE MapCountersTimerDpc;
+static WORKER_THREAD_ROUTINE MapCountersWorker;
+
+//
+// Refresh
+//
+
+static
+VOID
+MapCountersTimerDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    // The page is pageable, so it is written from a worker. A slow worker skips ticks instead of
+    // piling up.
+    if (InterlockedCompareExchange(&MapCountersWorkQueued, TRUE, FALSE) == FALSE)
+    {
+        ExQueueWorkItem(&MapCountersWorkItem, DelayedWorkQueue);
+    }
+}
+
+static
+VOID
+MapCountersWorker(
+    _In_ PVOID Parameter
+)
+{
+    UNREFERENCED_PARAMETER(Parameter);
+
+    PMA_COUNTERS_PAGE pPage = MapCountersPage;
+
+    // Summed outside of the write section, so that readers retry as rarely as possible.
+    // Too large for the stack, and only one worker runs at a time.
+    static MA_PROVIDER_STATISTICS stats[MaPicoProviderReportedCount];
+    for (DWORD i = 0; i < MaPicoProviderReportedCount; ++i)
+    {
+        MapQueryStatistics(i, &stats[i]);
+    }
+
+    // Seqlock: readers retry while the sequence is odd or has changed during their copy.
+    InterlockedIncrement64(&pPage->Sequence);
+
+    pPage->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    pPage->Instrumentation = (ULONG)MapInstrumentation;
+    pPage->ProvidersCount = (ULONG)MapProvidersCount;
+
+    for (DWORD i = 0; i < MaPicoProviderReportedCount; ++i)
+    {
+        RtlCopyMemory(pPage->Events[i], stats[i].Events, sizeof(stats[i].Events));
+    }
+
+    InterlockedIncrement64(&pPage->Sequence);
+
+    InterlockedExchange(&MapCountersWorkQueued, FALSE);
+}
+
+//
+// Mapping
+//
+
+// Must be called with MapCountersLock held.
+static
+VOID
+MapStartCountersTimer()
+{
+    // Fill the page once, since it may have gone stale while nobody was mapping it.
+    MapCountersWorkQueued = TRUE;
+    MapCountersWorker(NULL);
+
+    LARGE_INTEGER liDueTime = { .QuadPart = -10 * 1000 * MA_COUNTERS_REFRESH_MS };
+    KeSetTimerEx(&MapCountersTimer, liDueTime, MA_COUNTERS_REFRESH_MS, &MapCountersDpc);
+}
+
+// Must be called with MapCountersLock held.
+static
+VOID
+MapStopCountersTimer()
+{
+    // A DPC may still queue a worker until all of them have run.
+    KeCancelTimer(&MapCountersTimer);
+    KeFlushQueuedDpcs();
+
+    LARGE_INTEGER liInterval = { .QuadPart = -10 * 1000 };
+    while (MapCountersWorkQueued)
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &liInterval);
+    }
+}
+
+static
+NTSTATUS
+MapCreateCountersPage()
+{
+    LARGE_INTEGER liSize = { .QuadPart = PAGE_SIZE };
+
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlSection = NULL;
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    MA_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objectAttributes,
+        &liSize,
+        PAGE_READWRITE,
+        // Keeps user views from being made writable again with VirtualProtect.
+        SEC_COMMIT | SEC_NO_CHANGE,
+        NULL
+    ));
+
+    PVOID pSection = NULL;
+    MA_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+
+    // The system view keeps its own reference to the section.
+    PVOID pView = NULL;
+    SIZE_T szView = 0;
+    NTSTATUS status = MmMapViewInSystemSpace(pSection, &pView, &szView);
+    ObDereferenceObject(pSection);
+
+    MA_RETURN_IF_FAIL(status);
+
+    PMA_COUNTERS_PAGE pPage = (PMA_COUNTERS_PAGE)pView;
+    KeQueryPerformanceCounter((PLARGE_INTEGER)&pPage->Frequency);
+
+    MapCountersPage = pPage;
+    MapCountersSection = hdlSection;
+    hdlSection = NULL;
+
+    ExInitializeWorkItem(&MapCountersWorkItem, MapCountersWorker, NULL);
+    KeInitializeDpc(&MapCountersDpc, MapCountersTimerDpc, NULL);
+    KeInitializeTimerEx(&MapCountersTimer, NotificationTimer);
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MapMapCountersPage(
+    _Out_ PVOID* UserView
+)
+{
+    *UserView = NULL;
+
+    Locker<PushLock> lock(&MapCountersLock);
+
+    if (MapCountersSection == NULL)
+    {
+        MA_RETURN_IF_FAIL(MapCreateCountersPage());
+    }
+
+    PVOID pView = NULL;
+    SIZE_T szView = 0;
+    MA_RETURN_IF_FAIL(ZwMapViewOfSection(
+        MapCountersSection,
+        ZwCurrentProcess(),
+        &pView,
+        0,
+        0,
+        NULL,
+        &szView,
+        ViewUnmap,
+        0,
+        PAGE_READONLY
+    ));
+
+    if (MapCountersViews++ == 0)
+    {
+        MapStartCountersTimer();
+    }
+
+    *UserView = pView;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapReleaseCountersPage(
+    _In_ SIZE_T Views
+)
+{
+    Locker<PushLock> lock(&MapCountersLock);
+
+    MapCountersViews -= min(Views, MapCountersViews);
+
+    if (MapCountersViews == 0 && MapCountersSection != NULL)
+    {
+        MapStopCountersTimer();
+    }
+}
+
+extern "C"
+VOID
+MapCleanupCountersPage()
+{
+    Locker<PushLock> lock(&MapCountersLock);
+
+    if (MapCountersSection == NULL)
+    {
+        return;
+    }
+
+    MapStopCountersTimer();
+    MapCountersViews = 0;
+
+    MmUnmapViewInSystemSpace(MapCountersPage);
+    MapCountersPage = NULL;
+
+    ZwClose(MapCountersSection);
+    MapCountersSection = NULL;
+}
@@ -4,6 +4,46 @@
 
 #include "AutoResource.h"
 
+//
+// Dispatch statistics
+//
+
+// Counters are spread over a fixed number of cache lines, so that exception-heavy workloads on
+// different processors do not contend on the same line.
+#define MA_DISPATCH_COUNTER_SLOTS   (64)
+
+typedef struct DECLSPEC_CACHEALIGN _MA_DISPATCH_COUNTERS {
+    LONG64 ExceptionsThread;
+    LONG64 ExceptionsAttached;
+    LONG64 ExceptionsUnowned;
+} MA_DISPATCH_COUNTERS, *PMA_DISPATCH_COUNTERS;
+
+static MA_DISPATCH_COUNTERS MapDispatchCounters[MA_DISPATCH_COUNTER_SLOTS];
+
+static
+FORCEINLINE
+PMA_DISPATCH_COUNTERS
+MapGetDispatchCounters()
+{
+    return &MapDispatchCounters[KeGetCurrentProcessorNumberEx(NULL) % MA_DISPATCH_COUNTER_SLOTS];
+}
+
+extern "C"
+VOID
+MapQueryDispatchStatistics(
+    _Out_ PMA_DISPATCH_STATISTICS Statistics
+)
+{
+    *Statistics = { };
+
+    for (SIZE_T i = 0; i < MA_DISPATCH_COUNTER_SLOTS; ++i)
+    {
+        Statistics->ExceptionsThread += (ULONG64)MapDispatchCounters[i].ExceptionsThread;
+        Statistics->ExceptionsAttached += (ULONG64)MapDispatchCounters[i].ExceptionsAttached;
+        Statistics->ExceptionsUnowned += (ULONG64)MapDispatchCounters[i].ExceptionsUnowned;
+    }
+}
+
 //
 // Pico provider dispatchers
 //
@@ -24,24 +64,32 @@ static_assert(!MaDetails::KernelProcessOrThread<PVOID>, "Concept broken");
 #define MA_DISPATCH_FREE            (0x1)
 #define MA_DISPATCH_NO_FALLBACK     (0x2)
 
+// The __try/__finally frame is only set up when the context has to be freed afterwards.
 #define MA_DISPATCH_TO_PROVIDER(type, object, function, ...)                                    \
     do                                                                                          \
     {                                                                                           \
         PMA_CONTEXT pContext_ = NULL;                                                           \
         if (NT_SUCCESS(MapGetObjectContext(object, &pContext_)))                                \
         {                                                                                       \
-            __try                                                                               \
+            if constexpr ((type) & MA_DISPATCH_FREE)                                            \
             {                                                                                   \
-                if (MapProviderRoutines[pContext_->Provider].function != NULL)                  \
+                __try                                                                           \
                 {                                                                               \
-                    return MapProviderRoutines[pContext_->Provider].function(__VA_ARGS__);      \
+                    if (MapProviderRoutines[pContext_->Provider].function != NULL)              \
+                    {                                                                           \
+                        return MapProviderRoutines[pContext_->Provider].function(__VA_ARGS__);  \
+                    }                                                                           \
+                }                                                                               \
+                __finally                                                                       \
+                {                                                                               \
+                    MapFreeContextDeferred(pContext_);                                          \
                 }                                                                               \
             }                                                                                   \
-            __finally                                                                           \
+            else                                                                                \
             {                                                                                   \
-                if constexpr ((type) & MA_DISPATCH_FREE)                                        \
+                if (MapProviderRoutines[pContext_->Provider].function != NULL)                  \
                 {                                                                               \
-                    MapFreeContext(pContext_);                                                  \
+                    return MapProviderRoutines[pContext_->Provider].function(__VA_ARGS__);      \
                 }                                                                               \
             }                                                                                   \
         }                                                                                       \
@@ -63,7 +111,25 @@ MapSystemCallDispatch(
     _In_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
 )
 {
-    MA_DISPATCH_TO_PROVIDER(0, PsGetCurrentThread(), DispatchSystemCall, SystemCall);
+    // Hot path, hit on every single system call.
+    // Skip MA_DISPATCH_TO_PROVIDER and use the routine cached in the context instead.
+    PMA_CONTEXT pContext = (PMA_CONTEXT)MapOriginalRoutines.GetThreadContext(PsGetCurrentThread());
+
+    if (pContext != NULL && pContext->Magic == MA_CONTEXT_MAGIC)
+    {
+        if (pContext->DispatchSystemCall != NULL)
+        {
+            MapDispatchFilteredSystemCall(pContext->Provider, SystemCall,
+                pContext->DispatchSystemCall);
+        }
+        return;
+    }
+
+    MA_ASSERT(!MapTooLate);
+    if (MapOriginalProviderRoutines.DispatchSystemCall != NULL)
+    {
+        MapOriginalProviderRoutines.DispatchSystemCall(SystemCall);
+    }
 }
 
 extern "C"
@@ -72,6 +138,14 @@ MapThreadExit(
     _In_ PETHREAD Thread
 )
 {
+    PMA_CONTEXT pContext = NULL;
+    if (MapInstrumentation != 0 && NT_SUCCESS(MapGetObjectContext(Thread, &pContext)))
+    {
+        MapInstrumentEvent(MaTraceEventExitThread, pContext->Provider,
+            PsGetThreadProcessId(Thread), PsGetThreadId(Thread), 0,
+            (ULONG_PTR)PsGetThreadExitStatus(Thread));
+    }
+
     MA_DISPATCH_TO_PROVIDER(MA_DISPATCH_FREE, Thread, ExitThread, Thread);
 }
 
@@ -81,6 +155,13 @@ MapProcessExit(
     _In_ PEPROCESS Process
 )
 {
+    PMA_CONTEXT pContext = NULL;
+    if (MapInstrumentation != 0 && NT_SUCCESS(MapGetObjectContext(Process, &pContext)))
+    {
+        MapInstrumentEvent(MaTraceEventExitProcess, pContext->Provider,
+            PsGetProcessId(Process), NULL, 0, (ULONG_PTR)PsGetProcessExitStatus(Process));
+    }
+
     MA_DISPATCH_TO_PROVIDER(MA_DISPATCH_FREE, Process, ExitProcess, Process);
 }
 
@@ -94,26 +175,65 @@ MapDispatchException(
     _In_ KPROCESSOR_MODE PreviousMode
 )
 {
-    MA_DISPATCH_TO_PROVIDER(MA_DISPATCH_NO_FALLBACK, PsGetCurrentThread(),
-        DispatchException,
-            ExceptionRecord,
-            ExceptionFrame,
-            TrapFrame,
-            Chance,
-            PreviousMode
-    );
+    PMA_DISPATCH_COUNTERS pCounters = MapGetDispatchCounters();
 
+    // Resolved once, then shared by instrumentation and dispatch.
+    PMA_CONTEXT pContext = NULL;
+    BOOLEAN bOwnContext = FALSE;
+    if (NT_SUCCESS(MapGetObjectContext(PsGetCurrentThread(), &pContext)))
+    {
+        InterlockedIncrementNoFence64(&pCounters->ExceptionsThread);
+        bOwnContext = TRUE;
+    }
     // This happens when a process like taskmgr.exe attachs one of its threads to a Pico process.
     // The current thread would not be a Pico thread (and has no Pico context), but NT still calls
     // the Pico exception dispatcher.
-    MA_DISPATCH_TO_PROVIDER(0, PsGetCurrentProcess(),
-        DispatchException,
-            ExceptionRecord,
-            ExceptionFrame,
-            TrapFrame,
-            Chance,
-            PreviousMode
-    );
+    else if (NT_SUCCESS(MapGetObjectContext(PsGetCurrentProcess(), &pContext)))
+    {
+        InterlockedIncrementNoFence64(&pCounters->ExceptionsAttached);
+    }
+    else
+    {
+        InterlockedIncrementNoFence64(&pCounters->ExceptionsUnowned);
+
+        // Would be impossible for lxmonika-managed processes/threads.
+        // Also, letting this through would cause infinite recursion.
+        MA_ASSERT(!MapTooLate);
+        if (MapOriginalProviderRoutines.DispatchException != NULL)
+        {
+            return MapOriginalProviderRoutines.DispatchException(ExceptionRecord,
+                ExceptionFrame, TrapFrame, Chance, PreviousMode);
+        }
+
+        return FALSE;
+    }
+
+    if (MapInstrumentation != 0)
+    {
+        MapInstrumentEvent(MaTraceEventException, pContext->Provider,
+            PsGetCurrentProcessId(), PsGetCurrentThreadId(),
+            (ULONG_PTR)(ULONG)ExceptionRecord->ExceptionCode, Chance);
+
+        if (MapInstrumentation & MA_INSTRUMENT_STATISTICS)
+        {
+            // Only this thread writes its own context. Attached threads share the context of the
+            // process with its threads instead.
+            if (bOwnContext)
+            {
+                WriteNoFence64(&pContext->Exceptions, ReadNoFence64(&pContext->Exceptions) + 1);
+            }
+            else
+            {
+                InterlockedIncrementNoFence64(&pContext->Exceptions);
+            }
+        }
+    }
+
+    if (MapProviderRoutines[pContext->Provider].DispatchException != NULL)
+    {
+        return MapProviderRoutines[pContext->Provider].DispatchException(ExceptionRecord,
+            ExceptionFrame, TrapFrame, Chance, PreviousMode);
+    }
 
     return FALSE;
 }
@@ -149,6 +269,9 @@ MapWalkUserStack(
     return 0;
 }
 
+// Tag of the UNICODE_STRING headers returned by MapGetAllocatedProcessImageName.
+#define MA_IMAGE_NAME_HEADER_TAG    ('  aM')
+
 extern "C"
 NTSTATUS
 MapGetAllocatedProcessImageName(
@@ -156,38 +279,51 @@ MapGetAllocatedProcessImageName(
     _Outptr_ PUNICODE_STRING* ImageName
 )
 {
-    // Respect any callbacks registered by providers.
-    MA_DISPATCH_TO_PROVIDER(MA_DISPATCH_NO_FALLBACK, Process,
-        GetAllocatedProcessImageName,
-            Process,
-            ImageName
-    );
-
     PMA_CONTEXT pContext = NULL;
-    if (NT_SUCCESS(MapGetObjectContext(Process, &pContext))
-        && pContext->ImageFileName.Buffer != NULL)
+    if (!NT_SUCCESS(MapGetObjectContext(Process, &pContext)))
     {
-        *ImageName = (PUNICODE_STRING)ExAllocatePool2(PagedPool, sizeof(UNICODE_STRING), '  aM');
-
-        if (*ImageName == NULL)
+        // As our last resort, fall back to the original routines.
+        MA_ASSERT(!MapTooLate);
+        if (MapOriginalProviderRoutines.GetAllocatedProcessImageName != NULL)
         {
-            return STATUS_NO_MEMORY;
+            return MapOriginalProviderRoutines.GetAllocatedProcessImageName(Process, ImageName);
         }
 
-        // Shallow copy. Only ImageName will be freed later.
-        **ImageName = pContext->ImageFileName;
+        return STATUS_NOT_FOUND;
+    }
 
-        return STATUS_SUCCESS;
+    // Respect any callbacks registered by providers.
+    if (MapProviderRoutines[pContext->Provider].GetAllocatedProcessImageName != NULL)
+    {
+        return MapProviderRoutines[pContext->Provider].GetAllocatedProcessImageName(Process,
+            ImageName);
     }
 
-    // As our last resort, fall back to the original routines.
-    MA_DISPATCH_TO_PROVIDER(0, Process,
-        GetAllocatedProcessImageName,
-            Process,
-            ImageName
-    );
+    PCUNICODE_STRING pName = (pContext->ImageFileName != NULL)
+        ? MapGetImageName(pContext->ImageFileName)
+        : NULL;
+
+    if (pName == NULL)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    // The caller frees the result with ExFreePool, so the shared name object itself cannot
+    // be handed out, and neither can a header embedded in the context or taken from a lookaside
+    // list, since it would never be given back. The header is the only allocation left.
+    *ImageName = (PUNICODE_STRING)ExAllocatePool2(PagedPool, sizeof(UNICODE_STRING),
+        MA_IMAGE_NAME_HEADER_TAG);
+
+    if (*ImageName == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    // Point to the buffer of the shared name instead, which lives as long as the process
+    // context. Only ImageName will be freed later.
+    **ImageName = *pName;
 
-    return STATUS_NOT_FOUND;
+    return STATUS_SUCCESS;
 }
 
 //
@@ -236,7 +372,7 @@ MapCreateProcess(
     }
 
     PMA_CONTEXT pContext = MapAllocateContext(
-        ProviderIndex, ProcessAttributes->Context, CreateInfo
+        ProviderIndex, ProcessAttributes->Context, CreateInfo, NULL
     );
     if (pContext == NULL)
     {
@@ -244,6 +380,9 @@ MapCreateProcess(
     }
     AUTO_RESOURCE(pContext, MapFreeContext);
 
+    // Linked before the process can exit, and unlinked again when the context is freed.
+    MapLinkProcessContext(pContext);
+
     ProcessAttributes->Context = pContext;
 
     NTSTATUS status;
@@ -330,8 +469,28 @@ MapCreateProcess(
         }
     }
 
+    if (MapInstrumentation != 0)
+    {
+        MapInstrumentEvent(MaTraceEventCreateProcess, ProviderIndex,
+            PsGetCurrentProcessId(), PsGetCurrentThreadId(), 0, (ULONG_PTR)status);
+    }
+
     if (NT_SUCCESS(status))
     {
+        PEPROCESS pProcess = NULL;
+        if (NT_SUCCESS(ObReferenceObjectByHandle(
+            hdlProcess,
+            0,
+            *PsProcessType,
+            KernelMode,
+            (PVOID*)&pProcess,
+            0
+        )))
+        {
+            pContext->ProcessId = (ULONG64)(ULONG_PTR)PsGetProcessId(pProcess);
+            ObDereferenceObject(pProcess);
+        }
+
         *ProcessHandle = hdlProcess;
 
         // Keep the process and its context alive on success.
@@ -358,6 +517,9 @@ MapCreateThread(
 
     BOOLEAN bBelongsToProvider = FALSE;
 
+    // Stays valid after the process is dereferenced below, since the caller holds a handle to it.
+    PMA_CONTEXT pHostProcessContext = NULL;
+
     {
         PEPROCESS pHostProcess = NULL;
         MA_RETURN_IF_FAIL(ObReferenceObjectByHandle(
@@ -370,7 +532,6 @@ MapCreateThread(
         ));
         AUTO_RESOURCE(pHostProcess, ObfDereferenceObject);
 
-        PMA_CONTEXT pHostProcessContext = NULL;
         MA_RETURN_IF_FAIL(MapGetObjectContext(pHostProcess, &pHostProcessContext));
 
         bBelongsToProvider = pHostProcessContext != NULL
@@ -382,15 +543,17 @@ MapCreateThread(
         return STATUS_INVALID_PARAMETER;
     }
 
-    PMA_CONTEXT pContext = MapAllocateContext(
-        ProviderIndex, ThreadAttributes->Context, CreateInfo
-    );
+    // Threads share the provider and image name of their process.
+    PMA_CONTEXT pContext = MapAllocateThreadContext(pHostProcessContext, ThreadAttributes->Context);
     if (pContext == NULL)
     {
         return STATUS_NO_MEMORY;
     }
     AUTO_RESOURCE(pContext, MapFreeContext);
 
+    // Linked before the thread can exit, and rolled up into the process when the context is freed.
+    MapLinkThreadContext(pContext, pHostProcessContext);
+
     ThreadAttributes->Context = pContext;
 
     NTSTATUS status;
@@ -455,6 +618,12 @@ MapCreateThread(
         }
     }
 
+    if (MapInstrumentation != 0)
+    {
+        MapInstrumentEvent(MaTraceEventCreateThread, ProviderIndex,
+            PsGetCurrentProcessId(), PsGetCurrentThreadId(), 0, (ULONG_PTR)status);
+    }
+
     if (NT_SUCCESS(status))
     {
         *ThreadHandle = hdlThread;
@@ -467,6 +636,31 @@ MapCreateThread(
     return status;
 }
 
+static
+PVOID
+MapGetForwardedContext(
+    _In_ DWORD ProviderIndex,
+    _In_ PMA_CONTEXT Context
+)
+{
+    // Only the thread running a forwarded system call sees the parent contexts it went through,
+    // of itself and of its process.
+    PMA_CONTEXT pThreadContext = NULL;
+    if (!NT_SUCCESS(MapGetObjectContext(PsGetCurrentThread(), &pThreadContext))
+        || pThreadContext->ForwardDepth == 0)
+    {
+        return NULL;
+    }
+
+    PMA_CONTEXT_FRAME pFrame = MapGetContextParent(Context, pThreadContext->ForwardDepth - 1);
+    if (pFrame == NULL || pFrame->Provider != ProviderIndex)
+    {
+        return NULL;
+    }
+
+    return pFrame->Context;
+}
+
 static
 PVOID
 MapGetProcessContext(
@@ -475,12 +669,18 @@ MapGetProcessContext(
 )
 {
     PMA_CONTEXT pContext = NULL;
-    if (!NT_SUCCESS(MapGetObjectContext(Process, &pContext))
-        || pContext->Provider != ProviderIndex)
+    if (!NT_SUCCESS(MapGetObjectContext(Process, &pContext)))
     {
         return NULL;
     }
 
+    if (pContext->Provider != ProviderIndex)
+    {
+        return (Process == PsGetCurrentProcess())
+            ? MapGetForwardedContext(ProviderIndex, pContext)
+            : NULL;
+    }
+
     return pContext->Context;
 }
 
@@ -492,15 +692,69 @@ MapGetThreadContext(
 )
 {
     PMA_CONTEXT pContext = NULL;
-    if (!NT_SUCCESS(MapGetObjectContext(Thread, &pContext))
-        || pContext->Provider != ProviderIndex)
+    if (!NT_SUCCESS(MapGetObjectContext(Thread, &pContext)))
     {
         return NULL;
     }
 
+    if (pContext->Provider != ProviderIndex)
+    {
+        return (Thread == PsGetCurrentThread())
+            ? MapGetForwardedContext(ProviderIndex, pContext)
+            : NULL;
+    }
+
     return pContext->Context;
 }
 
+static
+NTSTATUS
+MapForwardSystemCall(
+    _In_ DWORD ProviderIndex,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+)
+{
+    PMA_CONTEXT pContext = NULL;
+    MA_RETURN_IF_FAIL(MapGetObjectContext(PsGetCurrentThread(), &pContext));
+
+    ULONG ulLevel = pContext->ForwardDepth;
+
+    // Only the provider dispatching the call on this thread may pass it on.
+    DWORD dwCurrentProvider = (ulLevel == 0)
+        ? pContext->Provider
+        : MapGetContextParent(pContext, ulLevel - 1)->Provider;
+
+    if (dwCurrentProvider != ProviderIndex)
+    {
+        return STATUS_ACCESS_DENIED;
+    }
+
+    // Every level runs on the same kernel stack.
+    if (ulLevel >= MA_FORWARD_SYSTEM_CALL_DEPTH_MAX)
+    {
+        return STATUS_STACK_OVERFLOW;
+    }
+
+    PMA_CONTEXT_FRAME pParent = MapGetContextParent(pContext, ulLevel);
+    if (pParent == NULL)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    if (pParent->DispatchSystemCall == NULL)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    // Parent frames keep their providers registered, see MapPushContext. Filters and statistics
+    // see the call again, as one of the parent.
+    pContext->ForwardDepth = ulLevel + 1;
+    MapDispatchFilteredSystemCall(pParent->Provider, SystemCall, pParent->DispatchSystemCall);
+    pContext->ForwardDepth = ulLevel;
+
+    return STATUS_SUCCESS;
+}
+
 static
 VOID
 MapSetThreadDescriptorBase(
@@ -532,11 +786,10 @@ MapTerminateProcess(
     // Therefore, instead of directly telling the kernel to dispose of the process, we transfer
     // control to the parent provider and return as normal.
 
-    if (pContext->Parent != NULL)
+    if (pContext->Depth != 0)
     {
-        // Replaces the current context structure with the parent's context structure.
-        // We need do swap the contents in-place since NT does not allow us to change the context
-        // pointer.
+        // Switches the context back to the parent provider.
+        // This happens in place since NT does not allow us to change the context pointer.
         return MapPopContext(pContext);
     }
     else
@@ -593,7 +846,7 @@ MapTerminateThread(
     PMA_CONTEXT pContext = NULL;
     MA_RETURN_IF_FAIL(MapGetObjectContext(Thread, ProviderIndex, &pContext));
 
-    if (pContext->Parent != NULL)
+    if (pContext->Depth != 0)
     {
         return MapPopContext(pContext);
     }
@@ -631,142 +884,234 @@ MapResumeThread(
         ResumeThread, Thread, PreviousSuspendCount);
 }
 
-#define MONIKA_PROVIDER(index)                                                                  \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoCreateProcess##index(                                                             \
-            _In_ PPS_PICO_PROCESS_ATTRIBUTES ProcessAttributes,                                 \
-            _In_opt_ PPS_PICO_CREATE_INFO CreateInfo,                                           \
-            _Outptr_ PHANDLE ProcessHandle                                                      \
-        )                                                                                       \
-    {                                                                                           \
-        return MapCreateProcess(index, ProcessAttributes, CreateInfo, ProcessHandle);           \
-    }                                                                                           \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoCreateProcessTh1##index(                                                          \
-            _In_ PPS_PICO_PROCESS_ATTRIBUTES ProcessAttributes,                                 \
-            _Outptr_ PHANDLE ProcessHandle                                                      \
-        )                                                                                       \
-    {                                                                                           \
-        return MapCreateProcess(index, ProcessAttributes, NULL, ProcessHandle);                 \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoCreateThread##index(                                                              \
-            _In_ PPS_PICO_THREAD_ATTRIBUTES ThreadAttributes,                                   \
-            _In_opt_ PPS_PICO_CREATE_INFO CreateInfo,                                           \
-            _Outptr_ PHANDLE ThreadHandle                                                       \
-        )                                                                                       \
-    {                                                                                           \
-        return MapCreateThread(index, ThreadAttributes, CreateInfo, ThreadHandle);              \
-    }                                                                                           \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoCreateThreadTh1##index(                                                           \
-            _In_ PPS_PICO_THREAD_ATTRIBUTES ThreadAttributes,                                   \
-            _Outptr_ PHANDLE ThreadHandle                                                       \
-        )                                                                                       \
-    {                                                                                           \
-        return MapCreateThread(index, ThreadAttributes, NULL, ThreadHandle);                    \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    PVOID                                                                                       \
-        MaPicoGetProcessContext##index(                                                         \
-            _In_ PEPROCESS Process                                                              \
-        )                                                                                       \
-    {                                                                                           \
-        return MapGetProcessContext(index, Process);                                            \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    PVOID                                                                                       \
-        MaPicoGetThreadContext##index(                                                          \
-            _In_ PETHREAD Thread                                                                \
-        )                                                                                       \
-    {                                                                                           \
-        return MapGetThreadContext(index, Thread);                                              \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    VOID                                                                                        \
-        MaPicoSetThreadDescriptorBase##index(                                                   \
-            _In_ PS_PICO_THREAD_DESCRIPTOR_TYPE Type,                                           \
-            _In_ ULONG_PTR Base                                                                 \
-        )                                                                                       \
-    {                                                                                           \
-        return MapSetThreadDescriptorBase(index, Type, Base);                                   \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoTerminateProcess##index(                                                          \
-            __inout PEPROCESS Process,                                                          \
-            __in NTSTATUS ExitStatus                                                            \
-        )                                                                                       \
-    {                                                                                           \
-        return MapTerminateProcess(index, Process, ExitStatus);                                 \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoSetContextThreadInternal##index(                                                  \
-            __in PETHREAD Thread,                                                               \
-            __in PCONTEXT ThreadContext,                                                        \
-            __in KPROCESSOR_MODE ProbeMode,                                                     \
-            __in KPROCESSOR_MODE CtxMode,                                                       \
-            __in BOOLEAN PerformUnwind                                                          \
-        )                                                                                       \
-    {                                                                                           \
-        return MapSetContextThreadInternal(index,                                               \
-            Thread, ThreadContext, ProbeMode, CtxMode, PerformUnwind);                          \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoGetContextThreadInternal##index(                                                  \
-            __in PETHREAD Thread,                                                               \
-            __inout PCONTEXT ThreadContext,                                                     \
-            __in KPROCESSOR_MODE ProbeMode,                                                     \
-            __in KPROCESSOR_MODE CtxMode,                                                       \
-            __in BOOLEAN PerformUnwind                                                          \
-        )                                                                                       \
-    {                                                                                           \
-        return MapGetContextThreadInternal(index,                                               \
-            Thread, ThreadContext, ProbeMode, CtxMode, PerformUnwind);                          \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoTerminateThread##index(                                                           \
-            __inout PETHREAD Thread,                                                            \
-            __in NTSTATUS ExitStatus,                                                           \
-            __in BOOLEAN DirectTerminate                                                        \
-        )                                                                                       \
-    {                                                                                           \
-        return MapTerminateThread(index, Thread, ExitStatus, DirectTerminate);                  \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoSuspendThread##index(                                                             \
-            _In_ PETHREAD Thread,                                                               \
-            _Out_opt_ PULONG PreviousSuspendCount                                               \
-        )                                                                                       \
-    {                                                                                           \
-        return MapSuspendThread(index, Thread, PreviousSuspendCount);                           \
-    }                                                                                           \
-                                                                                                \
-    extern "C"                                                                                  \
-    NTSTATUS                                                                                    \
-        MaPicoResumeThread##index(                                                              \
-            _In_ PETHREAD Thread,                                                               \
-            _Out_opt_ PULONG PreviousSuspendCount                                               \
-        )                                                                                       \
-    {                                                                                           \
-        return MapResumeThread(index, Thread, PreviousSuspendCount);                            \
-    }
-#include "monika_providers.cpp"
-#undef MONIKA_PROVIDER
+//
+// Per-slot thunks
+//
+
+namespace MaDetails
+{
+    // The Pico routines carry no context, so each slot needs its own copy that knows the index.
+    template <DWORD Index>
+    struct PicoThunks
+    {
+        static
+        NTSTATUS
+        CreateProcess(
+            _In_ PPS_PICO_PROCESS_ATTRIBUTES ProcessAttributes,
+            _In_opt_ PPS_PICO_CREATE_INFO CreateInfo,
+            _Outptr_ PHANDLE ProcessHandle
+        )
+        {
+            return MapCreateProcess(Index, ProcessAttributes, CreateInfo, ProcessHandle);
+        }
+
+        static
+        NTSTATUS
+        CreateProcessTh1(
+            _In_ PPS_PICO_PROCESS_ATTRIBUTES ProcessAttributes,
+            _Outptr_ PHANDLE ProcessHandle
+        )
+        {
+            return MapCreateProcess(Index, ProcessAttributes, NULL, ProcessHandle);
+        }
+
+        static
+        NTSTATUS
+        CreateThread(
+            _In_ PPS_PICO_THREAD_ATTRIBUTES ThreadAttributes,
+            _In_opt_ PPS_PICO_CREATE_INFO CreateInfo,
+            _Outptr_ PHANDLE ThreadHandle
+        )
+        {
+            return MapCreateThread(Index, ThreadAttributes, CreateInfo, ThreadHandle);
+        }
+
+        static
+        NTSTATUS
+        CreateThreadTh1(
+            _In_ PPS_PICO_THREAD_ATTRIBUTES ThreadAttributes,
+            _Outptr_ PHANDLE ThreadHandle
+        )
+        {
+            return MapCreateThread(Index, ThreadAttributes, NULL, ThreadHandle);
+        }
+
+        static
+        PVOID
+        GetProcessContext(
+            _In_ PEPROCESS Process
+        )
+        {
+            return MapGetProcessContext(Index, Process);
+        }
+
+        static
+        PVOID
+        GetThreadContext(
+            _In_ PETHREAD Thread
+        )
+        {
+            return MapGetThreadContext(Index, Thread);
+        }
+
+        static
+        VOID
+        SetThreadDescriptorBase(
+            _In_ PS_PICO_THREAD_DESCRIPTOR_TYPE Type,
+            _In_ ULONG_PTR Base
+        )
+        {
+            return MapSetThreadDescriptorBase(Index, Type, Base);
+        }
+
+        static
+        NTSTATUS
+        TerminateProcess(
+            __inout PEPROCESS Process,
+            __in NTSTATUS ExitStatus
+        )
+        {
+            return MapTerminateProcess(Index, Process, ExitStatus);
+        }
+
+        static
+        NTSTATUS
+        SetContextThreadInternal(
+            __in PETHREAD Thread,
+            __in PCONTEXT ThreadContext,
+            __in KPROCESSOR_MODE ProbeMode,
+            __in KPROCESSOR_MODE CtxMode,
+            __in BOOLEAN PerformUnwind
+        )
+        {
+            return MapSetContextThreadInternal(Index,
+                Thread, ThreadContext, ProbeMode, CtxMode, PerformUnwind);
+        }
+
+        static
+        NTSTATUS
+        GetContextThreadInternal(
+            __in PETHREAD Thread,
+            __inout PCONTEXT ThreadContext,
+            __in KPROCESSOR_MODE ProbeMode,
+            __in KPROCESSOR_MODE CtxMode,
+            __in BOOLEAN PerformUnwind
+        )
+        {
+            return MapGetContextThreadInternal(Index,
+                Thread, ThreadContext, ProbeMode, CtxMode, PerformUnwind);
+        }
+
+        static
+        NTSTATUS
+        TerminateThread(
+            __inout PETHREAD Thread,
+            __in NTSTATUS ExitStatus,
+            __in BOOLEAN DirectTerminate
+        )
+        {
+            return MapTerminateThread(Index, Thread, ExitStatus, DirectTerminate);
+        }
+
+        static
+        NTSTATUS
+        SuspendThread(
+            _In_ PETHREAD Thread,
+            _Out_opt_ PULONG PreviousSuspendCount
+        )
+        {
+            return MapSuspendThread(Index, Thread, PreviousSuspendCount);
+        }
+
+        static
+        NTSTATUS
+        ResumeThread(
+            _In_ PETHREAD Thread,
+            _Out_opt_ PULONG PreviousSuspendCount
+        )
+        {
+            return MapResumeThread(Index, Thread, PreviousSuspendCount);
+        }
+
+        static
+        NTSTATUS
+        ForwardSystemCall(
+            _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+        )
+        {
+            return MapForwardSystemCall(Index, SystemCall);
+        }
+
+        static
+        VOID
+        Initialize(
+            _Out_ PMA_PROVIDER Provider
+        )
+        {
+            Provider->Routines =
+            {
+                .Size = sizeof(PS_PICO_ROUTINES),
+                .CreateProcess = CreateProcess,
+                .CreateThread = CreateThread,
+                .GetProcessContext = GetProcessContext,
+                .GetThreadContext = GetThreadContext,
+                .GetContextThreadInternal = GetContextThreadInternal,
+                .SetContextThreadInternal = SetContextThreadInternal,
+                .TerminateThread = TerminateThread,
+                .ResumeThread = ResumeThread,
+                .SetThreadDescriptorBase = SetThreadDescriptorBase,
+                .SuspendThread = SuspendThread,
+                .TerminateProcess = TerminateProcess
+            };
+
+            Provider->RoutinesTh1 = Provider->Routines;
+            Provider->RoutinesTh1.CreateProcess = (PPS_PICO_CREATE_PROCESS)CreateProcessTh1;
+            Provider->RoutinesTh1.CreateThread = (PPS_PICO_CREATE_THREAD)CreateThreadTh1;
+
+            Provider->AdditionalRoutines =
+            {
+                .Size = sizeof(MA_PICO_ROUTINES),
+                .ForwardSystemCall = ForwardSystemCall
+            };
+        }
+    };
+
+    // Stands in for std::index_sequence, since the driver does not use the standard library.
+    // The compiler builtin expands to IntegerSequence<SIZE_T, 0, 1, ..., Count - 1>.
+    template <typename T, T... Values>
+    struct IntegerSequence
+    {
+    };
+
+    template <SIZE_T Count>
+    using MakeIndexSequence = __make_integer_seq<IntegerSequence, SIZE_T, Count>;
+
+    template <typename Sequence>
+    struct ThunkTable;
+
+    // One initializer per slot. Only the code is instantiated for every slot; the routine
+    // tables themselves live in the slot allocations.
+    template <SIZE_T... Index>
+    struct ThunkTable<IntegerSequence<SIZE_T, Index...>>
+    {
+        static constexpr VOID (*Initializers[])(PMA_PROVIDER) =
+        {
+            PicoThunks<(DWORD)Index>::Initialize...
+        };
+    };
+}
+
+extern "C"
+VOID
+MapInitializeProviderThunks(
+    _In_ SIZE_T Index,
+    _Out_ PMA_PROVIDER Provider
+)
+{
+    using Table = MaDetails::ThunkTable<MaDetails::MakeIndexSequence<MaPicoProviderMaxCount>>;
+
+    static_assert(ARRAYSIZE(Table::Initializers) == MaPicoProviderMaxCount);
+    MA_ASSERT(Index < MaPicoProviderMaxCount);
+
+    Table::Initializers[Index](Provider);
+}
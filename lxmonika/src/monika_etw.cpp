@@ -0,0 +1,233 @@
+#include "monika.h"
+
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+//
+// TraceLogging provider
+//
+
+TRACELOGGING_DEFINE_PROVIDER(
+    MapEtwProvider,
+    "lxmonika",
+    // {9d23c750-d6d1-4b99-b028-5b64fe1a6cde}
+    (0x9d23c750, 0xd6d1, 0x4b99, 0xb0, 0x28, 0x5b, 0x64, 0xfe, 0x1a, 0x6c, 0xde)
+);
+
+static BOOLEAN MapEtwRegistered = FALSE;
+
+static
+VOID NTAPI
+MapEtwEnableCallback(
+    _In_ LPCGUID SourceId,
+    _In_ ULONG ControlCode,
+    _In_ UCHAR Level,
+    _In_ ULONGLONG MatchAnyKeyword,
+    _In_ ULONGLONG MatchAllKeyword,
+    _In_opt_ PEVENT_FILTER_DESCRIPTOR FilterData,
+    _Inout_opt_ PVOID CallbackContext
+)
+{
+    UNREFERENCED_PARAMETER(SourceId);
+    UNREFERENCED_PARAMETER(ControlCode);
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(MatchAnyKeyword);
+    UNREFERENCED_PARAMETER(MatchAllKeyword);
+    UNREFERENCED_PARAMETER(FilterData);
+    UNREFERENCED_PARAMETER(CallbackContext);
+
+    // The provider state has already been updated for all sessions combined.
+    // Mirror it into MapInstrumentation, so that the dispatcher keeps checking a single word.
+    if (TraceLoggingProviderEnabled(MapEtwProvider, 0, 0))
+    {
+        InterlockedOr(&MapInstrumentation, MA_INSTRUMENT_ETW);
+    }
+    else
+    {
+        InterlockedAnd(&MapInstrumentation, ~MA_INSTRUMENT_ETW);
+    }
+}
+
+extern "C"
+NTSTATUS
+MapEtwRegister()
+{
+    if (MapEtwRegistered)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    MA_RETURN_IF_FAIL(TraceLoggingRegisterEx(MapEtwProvider, MapEtwEnableCallback, NULL));
+
+    MapEtwRegistered = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapEtwUnregister()
+{
+    if (MapEtwRegistered)
+    {
+        TraceLoggingUnregister(MapEtwProvider);
+        InterlockedAnd(&MapInstrumentation, ~MA_INSTRUMENT_ETW);
+        MapEtwRegistered = FALSE;
+    }
+}
+
+//
+// Event helpers
+//
+
+extern "C"
+VOID
+MapEtwWriteEvent(
+    _In_ MA_TRACE_EVENT Event,
+    _In_ DWORD Provider,
+    _In_ HANDLE ProcessId,
+    _In_ HANDLE ThreadId,
+    _In_ ULONG_PTR Number,
+    _In_ ULONG_PTR Result
+)
+{
+    switch (Event)
+    {
+    case MaTraceEventSystemCall:
+    {
+        // Provider names are not resolved here, this is hit on every system call.
+        TraceLoggingWrite(MapEtwProvider, "SystemCall",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingKeyword(MA_ETW_KEYWORD_SYSTEM_CALL),
+            TraceLoggingUInt32(Provider, "ProviderIndex"),
+            TraceLoggingPointer(ProcessId, "ProcessId"),
+            TraceLoggingPointer(ThreadId, "ThreadId"),
+            TraceLoggingUIntPtr(Number, "Number"),
+            TraceLoggingUIntPtr(Result, "Result")
+        );
+    }
+    break;
+    case MaTraceEventCreateProcess:
+    case MaTraceEventCreateThread:
+    case MaTraceEventExitProcess:
+    case MaTraceEventExitThread:
+    {
+        BOOLEAN bProcess = Event == MaTraceEventCreateProcess || Event == MaTraceEventExitProcess;
+        UINT64 uKeyword = bProcess ? MA_ETW_KEYWORD_PROCESS : MA_ETW_KEYWORD_THREAD;
+
+        if (!TraceLoggingProviderEnabled(MapEtwProvider, WINEVENT_LEVEL_INFO, uKeyword))
+        {
+            break;
+        }
+
+        // Exit events may run at APC_LEVEL, where providers can still report their names.
+        UNICODE_STRING strName = RTL_CONSTANT_STRING(L"");
+        PUNICODE_STRING pName = NULL;
+        if (NT_SUCCESS(MaGetAllocatedPicoProviderName(Provider, &pName)))
+        {
+            strName = *pName;
+        }
+
+        ULONG ulAbiVersion = MapAdditionalProviderRoutines[Provider].AbiVersion;
+
+#define MA_ETW_WRITE_LIFETIME_EVENT(name, keyword)                                              \
+        TraceLoggingWrite(MapEtwProvider, name,                                                 \
+            TraceLoggingLevel(WINEVENT_LEVEL_INFO),                                             \
+            TraceLoggingKeyword(keyword),                                                       \
+            TraceLoggingUInt32(Provider, "ProviderIndex"),                                      \
+            TraceLoggingCountedWideString(strName.Buffer,                                       \
+                strName.Length / sizeof(WCHAR), "ProviderName"),                                \
+            TraceLoggingHexUInt32(ulAbiVersion, "AbiVersion"),                                  \
+            TraceLoggingPointer(ProcessId, "ProcessId"),                                        \
+            TraceLoggingPointer(ThreadId, "ThreadId"),                                          \
+            TraceLoggingNTStatus((NTSTATUS)Result, "Status")                                    \
+        )
+
+        switch (Event)
+        {
+        case MaTraceEventCreateProcess:
+            MA_ETW_WRITE_LIFETIME_EVENT("CreateProcess", MA_ETW_KEYWORD_PROCESS);
+        break;
+        case MaTraceEventCreateThread:
+            MA_ETW_WRITE_LIFETIME_EVENT("CreateThread", MA_ETW_KEYWORD_THREAD);
+        break;
+        case MaTraceEventExitProcess:
+            MA_ETW_WRITE_LIFETIME_EVENT("ExitProcess", MA_ETW_KEYWORD_PROCESS);
+        break;
+        case MaTraceEventExitThread:
+            MA_ETW_WRITE_LIFETIME_EVENT("ExitThread", MA_ETW_KEYWORD_THREAD);
+        break;
+        }
+
+#undef MA_ETW_WRITE_LIFETIME_EVENT
+    }
+    break;
+    case MaTraceEventException:
+    {
+        TraceLoggingWrite(MapEtwProvider, "Exception",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingKeyword(MA_ETW_KEYWORD_EXCEPTION),
+            TraceLoggingUInt32(Provider, "ProviderIndex"),
+            TraceLoggingPointer(ProcessId, "ProcessId"),
+            TraceLoggingPointer(ThreadId, "ThreadId"),
+            TraceLoggingHexUInt32((ULONG)Number, "ExceptionCode"),
+            TraceLoggingUInt32((ULONG)Result, "Chance")
+        );
+    }
+    break;
+    default:
+    break;
+    }
+}
+
+extern "C"
+VOID
+MapEtwWriteProviderRegistered(
+    _In_ SIZE_T Index
+)
+{
+    if (!TraceLoggingProviderEnabled(MapEtwProvider, WINEVENT_LEVEL_INFO,
+        MA_ETW_KEYWORD_PROVIDER))
+    {
+        return;
+    }
+
+    // The provider usually sets its name only after registration, so it is not logged here.
+    TraceLoggingWrite(MapEtwProvider, "RegisterProvider",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(MA_ETW_KEYWORD_PROVIDER),
+        TraceLoggingUInt64(Index, "ProviderIndex"),
+        TraceLoggingHexUInt32(MapAdditionalProviderRoutines[Index].AbiVersion, "AbiVersion")
+    );
+}
+
+extern "C"
+VOID
+MapEtwWriteSessionStarted(
+    _In_ SIZE_T Index,
+    _In_ NTSTATUS Status
+)
+{
+    if (!TraceLoggingProviderEnabled(MapEtwProvider, WINEVENT_LEVEL_INFO,
+        MA_ETW_KEYWORD_SESSION))
+    {
+        return;
+    }
+
+    UNICODE_STRING strName = RTL_CONSTANT_STRING(L"");
+    PUNICODE_STRING pName = NULL;
+    if (NT_SUCCESS(MaGetAllocatedPicoProviderName(Index, &pName)))
+    {
+        strName = *pName;
+    }
+
+    TraceLoggingWrite(MapEtwProvider, "StartSession",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingKeyword(MA_ETW_KEYWORD_SESSION),
+        TraceLoggingUInt64(Index, "ProviderIndex"),
+        TraceLoggingCountedWideString(strName.Buffer, strName.Length / sizeof(WCHAR),
+            "ProviderName"),
+        TraceLoggingHexUInt32(MapAdditionalProviderRoutines[Index].AbiVersion, "AbiVersion"),
+        TraceLoggingNTStatus(Status, "Status")
+    );
+}
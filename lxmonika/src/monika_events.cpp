@@ -0,0 +1,289 @@
+#include "monika.h"
+
+#include "AutoResource.h"
+#include "Locker.h"
+
+#define MA_EVENT_TAG ('vEaM')
+
+//
+// Subscriber data
+//
+
+typedef struct _MA_EVENT_SUBSCRIBER {
+    LIST_ENTRY              Link;
+    PVOID                   Section;
+    // The system space view of the section.
+    PMA_EVENT_RING          Ring;
+    // Our own copy, since the one in the ring may be changed by the subscriber.
+    ULONG                   Capacity;
+    PKEVENT                 Event;
+    // The subscribing process, only compared against for MA_EVENT_PROCESS_SUBSCRIBERS_MAX.
+    PEPROCESS               Process;
+} MA_EVENT_SUBSCRIBER, *PMA_EVENT_SUBSCRIBER;
+
+static LIST_ENTRY MapEventSubscribers = { &MapEventSubscribers, &MapEventSubscribers };
+static SIZE_T MapEventSubscribersCount = 0;
+
+// Taken shared by publishers and exclusively when subscribers come and go.
+static PushLock MapEventSubscribersLock;
+
+//
+// Subscription
+//
+
+// Must be called with MapEventSubscribersLock held.
+static
+BOOLEAN
+MapEventSubscribersAvailable(
+    _In_ PEPROCESS Process
+)
+{
+    if (MapEventSubscribersCount >= MA_EVENT_SUBSCRIBERS_MAX)
+    {
+        return FALSE;
+    }
+
+    SIZE_T uCount = 0;
+
+    for (PLIST_ENTRY pEntry = MapEventSubscribers.Flink; pEntry != &MapEventSubscribers;
+        pEntry = pEntry->Flink)
+    {
+        PMA_EVENT_SUBSCRIBER pSubscriber = CONTAINING_RECORD(pEntry, MA_EVENT_SUBSCRIBER, Link);
+        if (pSubscriber->Process == Process)
+        {
+            ++uCount;
+        }
+    }
+
+    return uCount < MA_EVENT_PROCESS_SUBSCRIBERS_MAX;
+}
+
+extern "C"
+NTSTATUS
+MapSubscribeEvents(
+    _In_ ULONG Capacity,
+    _In_opt_ HANDLE Event,
+    _Out_ PVOID* UserRing,
+    _Out_ PVOID* Subscription
+)
+{
+    *UserRing = NULL;
+    *Subscription = NULL;
+
+    if (Capacity == 0 || (Capacity & (Capacity - 1)) != 0 || Capacity > MA_EVENT_RING_MAX)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PEPROCESS pProcess = PsGetCurrentProcess();
+
+    // Checked again when inserting, but failing here saves mapping a ring for nothing.
+    {
+        SharedPushLock shared(&MapEventSubscribersLock);
+        Locker<SharedPushLock> lock(&shared);
+
+        if (!MapEventSubscribersAvailable(pProcess))
+        {
+            return STATUS_QUOTA_EXCEEDED;
+        }
+    }
+
+    PKEVENT pEvent = NULL;
+    AUTO_RESOURCE(pEvent, ObDereferenceObject);
+
+    if (Event != NULL)
+    {
+        MA_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+            Event,
+            EVENT_MODIFY_STATE,
+            *ExEventObjectType,
+            ExGetPreviousMode(),
+            (PVOID*)&pEvent,
+            NULL
+        ));
+    }
+
+    // A pagefile-backed section, so that the user view goes away with the process, no matter
+    // what happens to the subscription.
+    LARGE_INTEGER liSize;
+    liSize.QuadPart = FIELD_OFFSET(MA_EVENT_RING, Records) + Capacity * sizeof(MA_EVENT_RECORD);
+
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlSection = NULL;
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    MA_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objectAttributes,
+        &liSize,
+        PAGE_READWRITE,
+        SEC_COMMIT,
+        NULL
+    ));
+
+    PVOID pSection = NULL;
+    AUTO_RESOURCE(pSection, ObDereferenceObject);
+
+    MA_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+
+    PVOID pKernelView = NULL;
+    SIZE_T szKernelView = 0;
+    MA_RETURN_IF_FAIL(MmMapViewInSystemSpace(pSection, &pKernelView, &szKernelView));
+    AUTO_RESOURCE(pKernelView, MmUnmapViewInSystemSpace);
+
+    PVOID pUserView = NULL;
+    SIZE_T szUserView = 0;
+    MA_RETURN_IF_FAIL(ZwMapViewOfSection(
+        hdlSection,
+        ZwCurrentProcess(),
+        &pUserView,
+        0,
+        0,
+        NULL,
+        &szUserView,
+        ViewUnmap,
+        0,
+        PAGE_READWRITE
+    ));
+
+    PMA_EVENT_SUBSCRIBER pSubscriber = (PMA_EVENT_SUBSCRIBER)
+        MapAllocatePool(PagedPool, sizeof(MA_EVENT_SUBSCRIBER), MA_EVENT_TAG);
+
+    if (pSubscriber == NULL)
+    {
+        ZwUnmapViewOfSection(ZwCurrentProcess(), pUserView);
+        return STATUS_NO_MEMORY;
+    }
+
+    // The section is zero-filled, so only the constant fields need to be set.
+    PMA_EVENT_RING pRing = (PMA_EVENT_RING)pKernelView;
+    pRing->Capacity = Capacity;
+    KeQueryPerformanceCounter((PLARGE_INTEGER)&pRing->Frequency);
+
+    pSubscriber->Section = pSection;
+    pSubscriber->Ring = pRing;
+    pSubscriber->Capacity = Capacity;
+    pSubscriber->Event = pEvent;
+    pSubscriber->Process = pProcess;
+
+    {
+        Locker<PushLock> lock(&MapEventSubscribersLock);
+
+        // Concurrent subscribers may have taken the last slots since the first check.
+        if (!MapEventSubscribersAvailable(pProcess))
+        {
+            ZwUnmapViewOfSection(ZwCurrentProcess(), pUserView);
+            MapFreePool(pSubscriber, sizeof(MA_EVENT_SUBSCRIBER), MA_EVENT_TAG);
+            return STATUS_QUOTA_EXCEEDED;
+        }
+
+        // Now owned by the subscriber.
+        pSection = NULL;
+        pKernelView = NULL;
+        pEvent = NULL;
+
+        InsertTailList(&MapEventSubscribers, &pSubscriber->Link);
+
+        if (MapEventSubscribersCount++ == 0)
+        {
+            InterlockedOr(&MapInstrumentation, MA_INSTRUMENT_EVENTS);
+        }
+    }
+
+    *UserRing = pUserView;
+    *Subscription = pSubscriber;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapUnsubscribeEvents(
+    _In_ PVOID Subscription
+)
+{
+    PMA_EVENT_SUBSCRIBER pSubscriber = (PMA_EVENT_SUBSCRIBER)Subscription;
+
+    {
+        Locker<PushLock> lock(&MapEventSubscribersLock);
+
+        RemoveEntryList(&pSubscriber->Link);
+
+        if (--MapEventSubscribersCount == 0)
+        {
+            InterlockedAnd(&MapInstrumentation, ~MA_INSTRUMENT_EVENTS);
+        }
+    }
+
+    // No publisher can see the subscriber anymore.
+    MmUnmapViewInSystemSpace(pSubscriber->Ring);
+    ObDereferenceObject(pSubscriber->Section);
+
+    if (pSubscriber->Event != NULL)
+    {
+        ObDereferenceObject(pSubscriber->Event);
+    }
+
+    MapFreePool(pSubscriber, sizeof(MA_EVENT_SUBSCRIBER), MA_EVENT_TAG);
+}
+
+//
+// Publishing
+//
+
+extern "C"
+VOID
+MapPublishEvent(
+    _In_ MA_TRACE_EVENT Event,
+    _In_ DWORD Provider,
+    _In_ HANDLE ProcessId,
+    _In_ HANDLE ThreadId,
+    _In_ NTSTATUS Status
+)
+{
+    LONG64 iTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    MapEventSubscribersLock.LockShared();
+
+    for (PLIST_ENTRY pEntry = MapEventSubscribers.Flink; pEntry != &MapEventSubscribers;
+        pEntry = pEntry->Flink)
+    {
+        PMA_EVENT_SUBSCRIBER pSubscriber =
+            CONTAINING_RECORD(pEntry, MA_EVENT_SUBSCRIBER, Link);
+        PMA_EVENT_RING pRing = pSubscriber->Ring;
+
+        // Same protocol as the trace rings: the consumer skips records whose sequence does not
+        // match their position, and re-checks it after copying.
+        LONG64 iPosition = InterlockedIncrement64(&pRing->Head) - 1;
+        PMA_EVENT_RECORD pRecord = &pRing->Records[iPosition & (pSubscriber->Capacity - 1)];
+
+        InterlockedExchange64(&pRecord->Sequence, 0);
+
+        pRecord->Timestamp = iTimestamp;
+        pRecord->ProcessId = (ULONG64)(ULONG_PTR)ProcessId;
+        pRecord->ThreadId = (ULONG64)(ULONG_PTR)ThreadId;
+        pRecord->Status = Status;
+        pRecord->Event = (USHORT)Event;
+        pRecord->Provider = (USHORT)Provider;
+
+        InterlockedExchange64(&pRecord->Sequence, iPosition + 1);
+
+        // Only signal consumers that asked for it, so that busy rings cost no event operations.
+        if (pSubscriber->Event != NULL && InterlockedExchange(&pRing->Waiting, 0) != 0)
+        {
+            KeSetEvent(pSubscriber->Event, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    MapEventSubscribersLock.UnlockShared();
+}
@@ -4,6 +4,7 @@
 
 #include "lxss.h"
 #include "module.h"
+#include "picosupport.h"
 
 #include "AutoResource.h"
 #include "Logger.h"
@@ -41,8 +42,27 @@ BOOLEAN MapLxssRegistering = FALSE;
 SIZE_T MapLxssProviderIndex = (SIZE_T)-1;
 
 //static PVOID MaLxssOriginalImportValue = NULL;
-static CHAR MaLxssTrampolineBytes[MDL_TRAMPOLINE_SIZE];
-static PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH MaLxssOriginalDispatchSystemCall = NULL;
+// Everything patched before PatchGuard initializes, reverted together.
+static MDL_PATCH_SET MaLxssPatchSet = { };
+static PVOID MaLxssUnameHookCookie = NULL;
+
+static KSPIN_LOCK MaLxssDirectWireLock;
+// Whether the system provider routines can be rewired. Decided before any provider registers,
+// and so before any context exists, so that the count of foreign contexts starts complete.
+static BOOLEAN MaLxssDirectWireCapable = FALSE;
+static PPS_PICO_PROVIDER_ROUTINES MaLxssLocatedProviderRoutines = NULL;
+
+static
+VOID
+MapLxssEnableDirectWire();
+
+static
+VOID
+MapLxssDisableDirectWire();
+
+static MA_PICO_SYSTEM_CALL_PRE_HOOK MapLxssUnamePreHook;
+static MA_PICO_SYSTEM_CALL_POST_HOOK MapLxssUnamePostHook;
+static PS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH MapLxssDirectSystemCallDispatch;
 
 extern "C"
 NTSTATUS
@@ -50,10 +70,23 @@ MapLxssInitialize(
     _In_ PDRIVER_OBJECT DriverObject
 )
 {
+    // Before anything can fail, so that the lock is usable whatever happens below.
+    KeInitializeSpinLock(&MaLxssDirectWireLock);
+
     // Optional step: Register WSL as a lxmonika client to simplify Pico process routines handling.
     HANDLE hdlLxCore;
     MA_RETURN_IF_FAIL(MdlpFindModuleByName("lxcore.sys", &hdlLxCore, NULL));
 
+    if (NT_SUCCESS(PicoSppLocateProviderRoutines(&MaLxssLocatedProviderRoutines)))
+    {
+        MaLxssDirectWireCapable = TRUE;
+    }
+    else
+    {
+        Logger::LogWarning("Cannot locate the system provider routines, "
+            "LXSS direct wiring will not be available.");
+    }
+
     if (!MapTooLate)
     {
         // We are loaded early and successfully registered ourselves as a Pico provider.
@@ -78,26 +111,24 @@ MapLxssInitialize(
         // not worry about having to patch the kernel. MapLxssPrepareForPatchGuard will
         // restore the original code before DriverEntry returns.
 
-        MA_RETURN_IF_FAIL(MdlpPatchTrampoline(
+        MA_RETURN_IF_FAIL(MdlpAddTrampolinePatch(
+            &MaLxssPatchSet,
             PsRegisterPicoProvider,
-            MaRegisterPicoProvider,
-            MaLxssTrampolineBytes,
-            sizeof(MaLxssTrampolineBytes)
+            MaRegisterPicoProvider
         ));
+        MA_RETURN_IF_FAIL(MdlpApplyPatchSet(&MaLxssPatchSet));
 
         LX_SUBSYSTEM lxSubsystem = { };
 
         MapLxssRegistering = TRUE;
-        MA_RETURN_IF_FAIL(LxInitialize(DriverObject, &lxSubsystem));
+        LONG64 iStart = KeQueryPerformanceCounter(NULL).QuadPart;
+        NTSTATUS status = LxInitialize(DriverObject, &lxSubsystem);
+        MapRecordBootPhase(MaBootPhaseLxInitialize, iStart, status);
+        MA_RETURN_IF_FAIL(status);
         MapLxssRegistering = FALSE;
 
         MA_ASSERT(MapLxssProviderIndex != (SIZE_T)-1);
 
-        // Hook the system call dispatching callback.
-        MaLxssOriginalDispatchSystemCall =
-            MapProviderRoutines[MapLxssProviderIndex].DispatchSystemCall;
-        MapProviderRoutines[MapLxssProviderIndex].DispatchSystemCall = MapLxssSystemCallHook;
-
         // Our own extensions.
         ULONG ulAbiVersion = MapAdditionalProviderRoutines[MapLxssProviderIndex].AbiVersion;
         MapAdditionalProviderRoutines[MapLxssProviderIndex] =
@@ -108,6 +139,9 @@ MapLxssInitialize(
             .AbiVersion = ulAbiVersion
         };
 
+        // lxcore registered itself without a name.
+        MapInvalidateProviderNames();
+
         // To prevent lxcore from registering itself a second time in RlpInitializeDevices,
         // we disable Pico registration for now.
         MapPicoRegistrationDisabled = TRUE;
@@ -124,10 +158,6 @@ MapLxssInitialize(
         // The "original" provider routines in this case are those registered by lxcore.
         PS_PICO_PROVIDER_ROUTINES lxProviderRoutines = MapOriginalProviderRoutines;
 
-        // Hook the system call dispatching callback.
-        MaLxssOriginalDispatchSystemCall = lxProviderRoutines.DispatchSystemCall;
-        lxProviderRoutines.DispatchSystemCall = MapLxssSystemCallHook;
-
         // Our own extensions
         MA_PICO_PROVIDER_ROUTINES lxAdditionalProviderRoutines =
         {
@@ -153,7 +183,36 @@ MapLxssInitialize(
 
     Logger::LogTrace("lxcore.sys successfully registered as a lxmonika provider.");
 
+    // Hook SYS_uname.
+#ifdef _M_X64
+    constexpr ULONG ulUnameNumber = 63;
+#elif defined(_M_ARM64)
+    constexpr ULONG ulUnameNumber = 160;
+#elif defined(_M_IX86) || defined(_M_ARM)
+    constexpr ULONG ulUnameNumber = 122;
+#else
+#error Detect the syscall number for this architecture!
+#endif
+
+    NTSTATUS statusHook = MaRegisterSystemCallHook(
+        MapLxssProviderIndex,
+        ulUnameNumber,
+        MapLxssUnamePreHook,
+        MapLxssUnamePostHook,
+        NULL,
+        &MaLxssUnameHookCookie
+    );
+
+    if (!NT_SUCCESS(statusHook))
+    {
+        // Non-fatal, WSL just sees the real kernel name.
+        Logger::LogWarning("Failed to hook uname, status=", (PVOID)statusHook);
+    }
+
     MapLxssPatched = TRUE;
+
+    MapLxssEnableDirectWire();
+
     return STATUS_SUCCESS;
 }
 
@@ -176,12 +235,8 @@ MapLxssPrepareForPatchGuard()
         //    &MaLxssOriginalImportValue
         //));
 
-        MA_RETURN_IF_FAIL(MdlpPatchTrampoline(
-            PsRegisterPicoProvider,
-            NULL,
-            MaLxssTrampolineBytes,
-            sizeof(MaLxssTrampolineBytes)
-        ));
+        // All or nothing, and a no-op if MapLxssInitialize failed before applying the set.
+        MA_RETURN_IF_FAIL(MdlpRevertPatchSet(&MaLxssPatchSet));
 
         // lxcore should have finished initializing. Enable Pico registration again.
         MapPicoRegistrationDisabled = FALSE;
@@ -203,6 +258,14 @@ MapLxssCleanup()
         return;
     }
 
+    MapLxssDisableDirectWire();
+
+    if (MaLxssUnameHookCookie != NULL)
+    {
+        MaUnregisterSystemCallHook(MaLxssUnameHookCookie);
+        MaLxssUnameHookCookie = NULL;
+    }
+
     PPS_PICO_ROUTINES pLxpRoutines = NULL;
     HANDLE hdlLxCore;
     if (NT_SUCCESS(MdlpFindModuleByName("lxcore.sys", &hdlLxCore, NULL))
@@ -217,46 +280,170 @@ MapLxssCleanup()
     MapLxssPatched = FALSE;
 }
 
-
 //
-// LXSS hooked provider routines
+// LXSS direct wiring
+//
+
+// While lxcore is the only provider with live processes, the system routines in
+// PspPicoProviderRoutines that only forward to the owning provider point straight to lxcore.
+// The lxmonika dispatcher is put back as soon as a context is created for any other provider,
+// so that provider's threads never observe the direct wiring.
 //
+// Process and thread exit routines are never wired directly, since they free our contexts.
+
+BOOLEAN MapLxssDirectWired = FALSE;
+SIZE_T MapLxssDirectWireSwitches = 0;
+
+static SIZE_T MaLxssForeignContexts = 0;
+static PPS_PICO_PROVIDER_ROUTINES MaLxssSystemProviderRoutines = NULL;
+
+static
+VOID
+MapLxssWire(
+    _In_ BOOLEAN Direct
+)
+{
+    // Must be called with MaLxssDirectWireLock held.
+
+    if (MaLxssSystemProviderRoutines == NULL || MapLxssDirectWired == Direct)
+    {
+        return;
+    }
+
+    const PS_PICO_PROVIDER_ROUTINES& lxRoutines = MapProviderRoutines[MapLxssProviderIndex];
+
+    const auto Wire = [](auto* pSlot, auto pfnDispatcher, auto pfnDirect, BOOLEAN bDirect)
+    {
+        // Keep our dispatcher if lxcore does not have the routine.
+        InterlockedExchangePointer((PVOID*)pSlot,
+            (PVOID)((bDirect && pfnDirect != NULL) ? pfnDirect : pfnDispatcher));
+    };
+
+    // System calls still need to pass through the filter.
+    Wire(&MaLxssSystemProviderRoutines->DispatchSystemCall,
+        MapSystemCallDispatch, MapLxssDirectSystemCallDispatch, Direct);
+    Wire(&MaLxssSystemProviderRoutines->DispatchException,
+        MapDispatchException, lxRoutines.DispatchException, Direct);
+    Wire(&MaLxssSystemProviderRoutines->WalkUserStack,
+        MapWalkUserStack, lxRoutines.WalkUserStack, Direct);
+
+    MapLxssDirectWired = Direct;
+    ++MapLxssDirectWireSwitches;
+
+    Logger::LogTrace("LXSS direct wiring ", Direct ? "enabled" : "disabled");
+}
+
+static
+VOID
+MapLxssEnableDirectWire()
+{
+    if (!MaLxssDirectWireCapable)
+    {
+        return;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MaLxssDirectWireLock, &irql);
+
+    MaLxssSystemProviderRoutines = MaLxssLocatedProviderRoutines;
+    MapLxssWire(MaLxssForeignContexts == 0);
+
+    KeReleaseSpinLock(&MaLxssDirectWireLock, irql);
+}
+
+static
+VOID
+MapLxssDisableDirectWire()
+{
+    if (MaLxssSystemProviderRoutines == NULL)
+    {
+        return;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MaLxssDirectWireLock, &irql);
+
+    MapLxssWire(FALSE);
+    MaLxssSystemProviderRoutines = NULL;
+
+    KeReleaseSpinLock(&MaLxssDirectWireLock, irql);
+}
 
 extern "C"
 VOID
-MapLxssSystemCallHook(
-    _In_ PPS_PICO_SYSTEM_CALL_INFORMATION pSyscallInfo
+MapLxssContextAttached(
+    _In_ DWORD Provider
 )
 {
-    struct old_utsname {
-        char sysname[65];
-        char nodename[65];
-        char release[65];
-        char version[65];
-        char machine[65];
-    }* pUtsName = NULL;
-
-    // Check for SYS_uname
-#ifdef _M_X64
-    if (pSyscallInfo->TrapFrame->Rax == 63)
+    if (!MaLxssDirectWireCapable || Provider == MapLxssProviderIndex)
     {
-        pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->Rdi;
+        return;
     }
-#elif defined(_M_ARM64)
-    if (pSyscallInfo->TrapFrame->X8 == 160)
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MaLxssDirectWireLock, &irql);
+
+    if (++MaLxssForeignContexts == 1)
     {
-        pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->X0;
+        MapLxssWire(FALSE);
     }
-#elif defined(_M_IX86)
-    if (pSyscallInfo->TrapFrame->Eax == 122)
+
+    KeReleaseSpinLock(&MaLxssDirectWireLock, irql);
+}
+
+extern "C"
+VOID
+MapLxssContextDetached(
+    _In_ DWORD Provider
+)
+{
+    if (!MaLxssDirectWireCapable || Provider == MapLxssProviderIndex)
     {
-        pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->Ebx;
+        return;
     }
-#elif defined(_M_ARM)
-    if (pSyscallInfo->R7 == 122)
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MaLxssDirectWireLock, &irql);
+
+    if (--MaLxssForeignContexts == 0)
     {
-        pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->R0;
+        MapLxssWire(TRUE);
     }
+
+    KeReleaseSpinLock(&MaLxssDirectWireLock, irql);
+}
+
+//
+// LXSS hooked provider routines
+//
+
+typedef struct old_utsname {
+    char sysname[65];
+    char nodename[65];
+    char release[65];
+    char version[65];
+    char machine[65];
+} old_utsname;
+
+static
+BOOLEAN
+MapLxssUnamePreHook(
+    _In_opt_ PVOID Context,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION pSyscallInfo,
+    _Out_ PVOID* pCallState
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    // The argument register may be overwritten by the return value, so remember it now.
+#ifdef _M_X64
+    old_utsname* pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->Rdi;
+#elif defined(_M_ARM64)
+    old_utsname* pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->X0;
+#elif defined(_M_IX86)
+    old_utsname* pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->Ebx;
+#elif defined(_M_ARM)
+    old_utsname* pUtsName = (old_utsname*)pSyscallInfo->TrapFrame->R0;
 #else
 #error Detect the syscall arguments for this architecture!
 #endif
@@ -268,7 +455,22 @@ MapLxssSystemCallHook(
         Logger::LogTrace("uname(", pUtsName, ")");
     }
 
-    MaLxssOriginalDispatchSystemCall(pSyscallInfo);
+    *pCallState = pUtsName;
+
+    return TRUE;
+}
+
+static
+VOID
+MapLxssUnamePostHook(
+    _In_opt_ PVOID Context,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION pSyscallInfo,
+    _In_opt_ PVOID pCallState
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    old_utsname* pUtsName = (old_utsname*)pCallState;
 
     if (pUtsName != NULL
         // Also check for a success return value.
@@ -305,6 +507,17 @@ MapLxssSystemCallHook(
     }
 }
 
+static
+VOID
+MapLxssDirectSystemCallDispatch(
+    _In_ PPS_PICO_SYSTEM_CALL_INFORMATION pSyscallInfo
+)
+{
+    // Used while lxcore is wired directly. Hooks still apply.
+    MapDispatchFilteredSystemCall((DWORD)MapLxssProviderIndex, pSyscallInfo,
+        MapProviderRoutines[MapLxssProviderIndex].DispatchSystemCall);
+}
+
 // The release string has never been changed since Windows 10,
 // so it is safe to hard code it here.
 // We do not really need the Windows NT build number, otherwise a dynamic query to
@@ -338,7 +551,7 @@ MapLxssGetConsole(
     __try
     {
         PLX_PROCESS pLxProcess = (PLX_PROCESS)
-            MaPicoGetProcessContext0(Process);
+            MapRoutines[MapLxssProviderIndex].GetProcessContext(Process);
 
         PLX_SESSION pLxSession = CONTAINING_RECORD(
             pLxProcess->ThreadGroups.Flink, LX_THREAD_GROUP, ListEntry)
@@ -0,0 +1,107 @@
+#include "monika_names.h"
+
+extern "C"
+BOOLEAN
+MapMatchProviderName(
+    _In_reads_(Count) const MA_PROVIDER_NAME_ENTRY* Entries,
+    _In_ SIZE_T Count,
+    _In_ PCWSTR ProviderName,
+    _Out_ PSIZE_T Index
+)
+{
+    SIZE_T uNameLength = wcslen(ProviderName);
+    SIZE_T uNameLenBytes = (uNameLength + 1) * sizeof(WCHAR);
+
+    // Number of leading characters an entry shares with the queried name.
+    const auto CommonPrefix = [&](SIZE_T uEntry) -> SIZE_T
+    {
+        PCUNICODE_STRING pName = &Entries[uEntry].Name;
+        SIZE_T uLength = min(pName->Length / sizeof(WCHAR), uNameLength);
+        SIZE_T uPrefix = 0;
+        while (uPrefix < uLength && pName->Buffer[uPrefix] == ProviderName[uPrefix])
+        {
+            ++uPrefix;
+        }
+        return uPrefix;
+    };
+
+    SIZE_T uCount = Count;
+
+    // Find where the queried name would be inserted.
+    SIZE_T uLow = 0;
+    SIZE_T uHigh = uCount;
+    while (uLow < uHigh)
+    {
+        SIZE_T uMiddle = uLow + (uHigh - uLow) / 2;
+        PCUNICODE_STRING pName = &Entries[uMiddle].Name;
+
+        if (RtlCompareUnicodeStrings(pName->Buffer, pName->Length / sizeof(WCHAR),
+            ProviderName, uNameLength, FALSE) < 0)
+        {
+            uLow = uMiddle + 1;
+        }
+        else
+        {
+            uHigh = uMiddle;
+        }
+    }
+
+    // In sorted order, the entries sharing the longest prefix with the query are adjacent to
+    // its insertion point.
+    SIZE_T uBestPrefix = 0;
+    if (uLow > 0)
+    {
+        uBestPrefix = CommonPrefix(uLow - 1);
+    }
+    if (uLow < uCount)
+    {
+        uBestPrefix = max(uBestPrefix, CommonPrefix(uLow));
+    }
+
+    SIZE_T uFirst = 0;
+    SIZE_T uLast = uCount;
+    if (uBestPrefix != 0)
+    {
+        uFirst = uLow;
+        while (uFirst > 0 && CommonPrefix(uFirst - 1) >= uBestPrefix)
+        {
+            --uFirst;
+        }
+
+        uLast = uLow;
+        while (uLast < uCount && CommonPrefix(uLast) >= uBestPrefix)
+        {
+            ++uLast;
+        }
+    }
+    // Otherwise, the names may still share the low byte of their first character.
+
+    // Matches are measured in bytes, and ties go to the lowest index, like the scan this
+    // replaces.
+    SIZE_T uBestMatchLength = 0;
+    SIZE_T uBestMatchIndex = 0;
+
+    for (SIZE_T i = uFirst; i < uLast; ++i)
+    {
+        const MA_PROVIDER_NAME_ENTRY* pEntry = &Entries[i];
+
+        SIZE_T uCurrentMatch = RtlCompareMemory(pEntry->Name.Buffer, ProviderName,
+            min(pEntry->Name.Length, uNameLenBytes));
+
+        if (uCurrentMatch > uBestMatchLength
+            || (uCurrentMatch == uBestMatchLength && uCurrentMatch != 0
+                && pEntry->Index < uBestMatchIndex))
+        {
+            uBestMatchLength = uCurrentMatch;
+            uBestMatchIndex = pEntry->Index;
+        }
+    }
+
+    if (uBestMatchLength == 0)
+    {
+        return FALSE;
+    }
+
+    *Index = uBestMatchIndex;
+    return TRUE;
+}
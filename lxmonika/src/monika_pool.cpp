@@ -0,0 +1,133 @@
+#include "monika.h"
+
+//
+// Pool counters
+//
+
+// One cache line per tag, so that busy tags do not slow each other down.
+typedef struct DECLSPEC_CACHEALIGN _MA_POOL_COUNTERS {
+    // 0 while the slot is free. Claimed once, and never released.
+    volatile LONG                       Tag;
+    volatile LONG64                     Allocations;
+    volatile LONG64                     Frees;
+    volatile LONG64                     Failures;
+    volatile LONG64                     BytesInUse;
+    volatile LONG64                     PeakBytesInUse;
+} MA_POOL_COUNTERS, *PMA_POOL_COUNTERS;
+
+// Statically allocated, so that allocations made before MapInitialize are counted too.
+static MA_POOL_COUNTERS MapPoolCounters[MA_POOL_TAGS_MAX];
+
+static
+PMA_POOL_COUNTERS
+MapGetPoolCounters(
+    _In_ ULONG Tag
+)
+{
+    // There are only a few tags, and a miss costs far less than the pool call it is counted for.
+    for (ULONG i = 0; i < MA_POOL_TAGS_MAX - 1; ++i)
+    {
+        PMA_POOL_COUNTERS pCounters = &MapPoolCounters[i];
+
+        LONG lTag = ReadNoFence(&pCounters->Tag);
+        if (lTag == 0)
+        {
+            // Another processor may be claiming the same slot, for the same tag or not.
+            lTag = InterlockedCompareExchange(&pCounters->Tag, (LONG)Tag, 0);
+            if (lTag == 0)
+            {
+                return pCounters;
+            }
+        }
+
+        if (lTag == (LONG)Tag)
+        {
+            return pCounters;
+        }
+    }
+
+    return &MapPoolCounters[MA_POOL_TAGS_MAX - 1];
+}
+
+extern "C"
+VOID
+MapRecordPoolAllocate(
+    _In_opt_ PVOID Block,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag
+)
+{
+    PMA_POOL_COUNTERS pCounters = MapGetPoolCounters(Tag);
+
+    if (Block == NULL)
+    {
+        InterlockedIncrementNoFence64(&pCounters->Failures);
+        return;
+    }
+
+    InterlockedIncrementNoFence64(&pCounters->Allocations);
+    LONG64 iInUse = InterlockedAddNoFence64(&pCounters->BytesInUse, (LONG64)Size);
+
+    // Only contended when the peak actually moves.
+    LONG64 iPeak = ReadNoFence64(&pCounters->PeakBytesInUse);
+    while (iInUse > iPeak)
+    {
+        LONG64 iSeen = InterlockedCompareExchange64(&pCounters->PeakBytesInUse, iInUse, iPeak);
+        if (iSeen == iPeak)
+        {
+            break;
+        }
+        iPeak = iSeen;
+    }
+}
+
+extern "C"
+VOID
+MapRecordPoolFree(
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag
+)
+{
+    PMA_POOL_COUNTERS pCounters = MapGetPoolCounters(Tag);
+
+    InterlockedIncrementNoFence64(&pCounters->Frees);
+    InterlockedAddNoFence64(&pCounters->BytesInUse, -(LONG64)Size);
+}
+
+extern "C"
+SIZE_T
+MapQueryPoolStatistics(
+    _Out_writes_to_(Count, return) PMA_POOL_STATISTICS Statistics,
+    _In_ SIZE_T Count
+)
+{
+    SIZE_T uRead = 0;
+
+    // Counters are read without synchronization, like the per-provider ones.
+    for (ULONG i = 0; i < MA_POOL_TAGS_MAX && uRead < Count; ++i)
+    {
+        PMA_POOL_COUNTERS pCounters = &MapPoolCounters[i];
+
+        LONG lTag = ReadNoFence(&pCounters->Tag);
+        LONG64 iAllocations = ReadNoFence64(&pCounters->Allocations);
+        LONG64 iFailures = ReadNoFence64(&pCounters->Failures);
+
+        // Free slots, and the shared one while no other tag has needed it.
+        if (lTag == 0 && iAllocations == 0 && iFailures == 0)
+        {
+            continue;
+        }
+
+        Statistics[uRead++] = MA_POOL_STATISTICS
+        {
+            .Tag = (ULONG)lTag,
+            .Allocations = (ULONG64)iAllocations,
+            .Frees = (ULONG64)ReadNoFence64(&pCounters->Frees),
+            .Failures = (ULONG64)iFailures,
+            .BytesInUse = (ULONG64)ReadNoFence64(&pCounters->BytesInUse),
+            .PeakBytesInUse = (ULONG64)ReadNoFence64(&pCounters->PeakBytesInUse)
+        };
+    }
+
+    return uRead;
+}
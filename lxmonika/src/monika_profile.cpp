@@ -0,0 +1,488 @@
+#include "monika.h"
+
+#include "os.h"
+
+#include "Locker.h"
+#include "Logger.h"
+
+#define MA_PROFILE_TAG ('fPaM')
+
+static_assert((MA_PROFILE_RING_SIZE & (MA_PROFILE_RING_SIZE - 1)) == 0,
+    "MA_PROFILE_RING_SIZE must be a power of two");
+static_assert(MaPicoProviderMaxCount <= 32,
+    "MA_PROFILE_SETTINGS.ProviderMask must have a bit for each provider");
+
+//
+// Profile data
+//
+
+typedef struct DECLSPEC_CACHEALIGN _MA_PROFILE_PROCESSOR {
+    KTIMER                              Timer;
+    KDPC                                Dpc;
+    // Next position to be written. Only touched at DISPATCH_LEVEL on this processor, by the DPC
+    // or by an APC finishing a sample.
+    volatile LONG64                     Head;
+    // Samples dropped while the ring was full. Reset by readers.
+    volatile LONG64                     Lost;
+    // Next position to be read. Only written by readers, with MapProfileLock held.
+    DECLSPEC_CACHEALIGN volatile LONG64 Tail;
+    ULONG                               Processor;
+    // Whether the timer has been set, since inactive processors have none.
+    BOOLEAN                             Started;
+    // Queued by the DPC to walk the user stack of the sampled thread, which cannot be done at
+    // DISPATCH_LEVEL. Set while queued, during which later samples needing it are lost.
+    volatile LONG                       ApcQueued;
+    KAPC                                Apc;
+    // What the DPC saw, for the APC.
+    LONG64                              ApcTimestamp;
+    ULONG_PTR                           ApcPc;
+    SIZE_T                              ApcProvider;
+    MA_PROFILE_SAMPLE                   Samples[MA_PROFILE_RING_SIZE];
+} MA_PROFILE_PROCESSOR, *PMA_PROFILE_PROCESSOR;
+
+static PMA_PROFILE_PROCESSOR MapProfileProcessors = NULL;
+static ULONG MapProfileProcessorsCount = 0;
+
+// Only changed while no timer is set, so the DPCs read it without synchronization.
+static MA_PROFILE_SETTINGS MapProfileSettings;
+static BOOLEAN MapProfileRunning = FALSE;
+
+// Serializes control and readers. Never taken by the DPCs.
+static PushLock MapProfileLock;
+
+// APCs queued and not yet run or run down. Waited for before the processors are freed.
+static volatile LONG MapProfileApcsPending = 0;
+
+static KDEFERRED_ROUTINE MapProfileDpc;
+
+//
+// Sampling
+//
+
+static
+PKTRAP_FRAME
+MapProfileGetUserTrapFrame()
+{
+    // Entries from user mode save the user state right below the initial kernel stack of the
+    // thread, and it stays there while the thread runs kernel code on its behalf.
+    PKTRAP_FRAME pTrapFrame =
+        (PKTRAP_FRAME)((ULONG_PTR)IoGetInitialStack() - sizeof(KTRAP_FRAME));
+
+#ifdef _M_AMD64
+    BOOLEAN bFromUser = (pTrapFrame->SegCs & MODE_MASK) == UserMode
+        && pTrapFrame->Rip < MmUserProbeAddress;
+#elif defined(_M_ARM64)
+    // EL0 in the mode bits of the saved program status.
+    BOOLEAN bFromUser = (pTrapFrame->Spsr & 0xF) == 0
+        && pTrapFrame->Pc < MmUserProbeAddress;
+#else
+#error Find the user trap frame for this architecture!
+#endif
+
+    return bFromUser ? pTrapFrame : NULL;
+}
+
+static
+ULONG_PTR
+MapProfileGetProgramCounter(
+    _In_ PKTRAP_FRAME TrapFrame
+)
+{
+#ifdef _M_AMD64
+    return TrapFrame->Rip;
+#elif defined(_M_ARM64)
+    return TrapFrame->Pc;
+#endif
+}
+
+// Only called at DISPATCH_LEVEL, on the processor that owns the ring.
+static
+VOID
+MapProfileWriteSample(
+    _In_ PMA_PROFILE_PROCESSOR Ring,
+    _In_ LONG64 Timestamp,
+    _In_ SIZE_T Provider,
+    _In_ ULONG Processor,
+    _In_reads_(Count) PVOID* Callers,
+    _In_ ULONG Count
+)
+{
+    LONG64 iHead = Ring->Head;
+
+    // Dropped rather than overwritten, so that readers never see a sample being written.
+    if (iHead - ReadAcquire64(&Ring->Tail) >= MA_PROFILE_RING_SIZE)
+    {
+        InterlockedIncrement64(&Ring->Lost);
+        return;
+    }
+
+    PMA_PROFILE_SAMPLE pSample = &Ring->Samples[iHead & (MA_PROFILE_RING_SIZE - 1)];
+
+    for (ULONG i = 0; i < Count; ++i)
+    {
+        pSample->Frames[i] = (ULONG64)(ULONG_PTR)Callers[i];
+    }
+
+    pSample->Timestamp = Timestamp;
+    pSample->ProcessId = (ULONG64)(ULONG_PTR)PsGetCurrentProcessId();
+    pSample->ThreadId = (ULONG64)(ULONG_PTR)PsGetCurrentThreadId();
+    pSample->Provider = (USHORT)Provider;
+    pSample->FrameCount = (USHORT)Count;
+    pSample->Processor = Processor;
+
+    WriteRelease64(&Ring->Head, iHead + 1);
+}
+
+static
+VOID
+NTAPI
+MapProfileApcRundown(
+    _In_ PKAPC Apc
+)
+{
+    PMA_PROFILE_PROCESSOR pProcessor = CONTAINING_RECORD(Apc, MA_PROFILE_PROCESSOR, Apc);
+
+    InterlockedExchange(&pProcessor->ApcQueued, FALSE);
+    InterlockedDecrement(&MapProfileApcsPending);
+}
+
+static
+VOID
+NTAPI
+MapProfileApcRoutine(
+    _In_ PKAPC Apc,
+    _Inout_ PKNORMAL_ROUTINE* NormalRoutine,
+    _Inout_ PVOID* NormalContext,
+    _Inout_ PVOID* SystemArgument1,
+    _Inout_ PVOID* SystemArgument2
+)
+{
+    UNREFERENCED_PARAMETER(NormalRoutine);
+    UNREFERENCED_PARAMETER(NormalContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PMA_PROFILE_PROCESSOR pProcessor = CONTAINING_RECORD(Apc, MA_PROFILE_PROCESSOR, Apc);
+
+    LONG64 iTimestamp = pProcessor->ApcTimestamp;
+    ULONG_PTR uPc = pProcessor->ApcPc;
+    SIZE_T uProvider = pProcessor->ApcProvider;
+    ULONG ulProcessor = pProcessor->Processor;
+
+    // The DPC may queue the APC again from here on.
+    InterlockedExchange(&pProcessor->ApcQueued, FALSE);
+
+    PVOID pCallers[MA_PROFILE_FRAMES_MAX];
+    ULONG ulCount = 0;
+
+    // At APC_LEVEL, where user pages can be faulted in. The provider is kept registered, as it
+    // may be unloading while this thread lingers.
+    PKTRAP_FRAME pTrapFrame = MapProfileGetUserTrapFrame();
+    if (pTrapFrame != NULL && MapReferenceProvider(uProvider))
+    {
+        if (MapProviderRoutines[uProvider].WalkUserStack != NULL)
+        {
+            ulCount = MapProviderRoutines[uProvider].WalkUserStack(
+                pTrapFrame, pCallers, MA_PROFILE_FRAMES_MAX);
+            ulCount = min(ulCount, MA_PROFILE_FRAMES_MAX);
+        }
+
+        MapDereferenceProvider(uProvider);
+    }
+
+    if (ulCount == 0)
+    {
+        pCallers[0] = (PVOID)uPc;
+        ulCount = 1;
+    }
+
+    // The thread may have moved, so the sample goes to the ring of the processor it is on now,
+    // whose DPC cannot run in between.
+    KIRQL irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    MapProfileWriteSample(&MapProfileProcessors[KeGetCurrentProcessorNumberEx(NULL)],
+        iTimestamp, uProvider, ulProcessor, pCallers, ulCount);
+
+    KeLowerIrql(irql);
+
+    InterlockedDecrement(&MapProfileApcsPending);
+}
+
+static
+VOID
+MapProfileDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PMA_PROFILE_PROCESSOR pProcessor = (PMA_PROFILE_PROCESSOR)DeferredContext;
+
+    // Timer DPCs run on top of whichever thread the clock interrupted, which is the one sampled.
+    // Idle processors run their idle thread, which never has a context.
+    PMA_CONTEXT pContext = NULL;
+    if (!NT_SUCCESS(MapGetObjectContext(PsGetCurrentThread(), &pContext))
+        && !NT_SUCCESS(MapGetObjectContext(PsGetCurrentProcess(), &pContext)))
+    {
+        return;
+    }
+
+    const MA_PROFILE_SETTINGS& settings = MapProfileSettings;
+
+    if (settings.ProviderMask != 0 && (pContext->Provider >= MaPicoProviderMaxCount
+        || (settings.ProviderMask & (1ul << pContext->Provider)) == 0))
+    {
+        return;
+    }
+
+    ULONG64 uProcessId = (ULONG64)(ULONG_PTR)PsGetCurrentProcessId();
+
+    if (settings.ProcessCount != 0)
+    {
+        ULONG i = 0;
+        while (i < settings.ProcessCount && settings.ProcessIds[i] != uProcessId)
+        {
+            ++i;
+        }
+
+        if (i == settings.ProcessCount)
+        {
+            return;
+        }
+    }
+
+    PKTRAP_FRAME pTrapFrame = MapProfileGetUserTrapFrame();
+    if (pTrapFrame == NULL)
+    {
+        return;
+    }
+
+    LONG64 iTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    ULONG_PTR uPc = MapProfileGetProgramCounter(pTrapFrame);
+
+    if ((settings.Flags & MA_PROFILE_FLAG_USER_STACKS)
+        && MapProviderRoutines[pContext->Provider].WalkUserStack != NULL)
+    {
+        if (InterlockedCompareExchange(&pProcessor->ApcQueued, TRUE, FALSE) != FALSE)
+        {
+            // The thread sampled last has yet to run its APC.
+            InterlockedIncrement64(&pProcessor->Lost);
+            return;
+        }
+
+        pProcessor->ApcTimestamp = iTimestamp;
+        pProcessor->ApcPc = uPc;
+        pProcessor->ApcProvider = pContext->Provider;
+
+        InterlockedIncrement(&MapProfileApcsPending);
+
+        // A special kernel APC, which runs as soon as the thread is below APC_LEVEL. A thread
+        // interrupted in user mode runs it before going back there, with the same user state.
+        KeInitializeApc(&pProcessor->Apc, KeGetCurrentThread(), OriginalApcEnvironment,
+            MapProfileApcRoutine, MapProfileApcRundown, NULL, KernelMode, NULL);
+
+        if (KeInsertQueueApc(&pProcessor->Apc, NULL, NULL, 0))
+        {
+            return;
+        }
+
+        // The thread is exiting. Only the program counter is kept.
+        InterlockedExchange(&pProcessor->ApcQueued, FALSE);
+        InterlockedDecrement(&MapProfileApcsPending);
+    }
+
+    PVOID pCallers[1] = { (PVOID)uPc };
+    MapProfileWriteSample(pProcessor, iTimestamp, pContext->Provider, pProcessor->Processor,
+        pCallers, 1);
+}
+
+//
+// Profile control
+//
+
+extern "C"
+NTSTATUS
+MapStartProfile(
+    _In_ const MA_PROFILE_SETTINGS* Settings
+)
+{
+    if (Settings->Interval == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Locker<PushLock> lock(&MapProfileLock);
+
+    if (MapProfileRunning)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    // The timers of the previous profile have been cancelled and their DPCs flushed.
+    if (MapProfileProcessors != NULL)
+    {
+        MapFreePool(MapProfileProcessors,
+            (SIZE_T)MapProfileProcessorsCount * sizeof(MA_PROFILE_PROCESSOR), MA_PROFILE_TAG);
+        MapProfileProcessors = NULL;
+        MapProfileProcessorsCount = 0;
+    }
+
+    ULONG ulCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    // Nonpaged, since the samples are written at DISPATCH_LEVEL.
+    PMA_PROFILE_PROCESSOR pProcessors = (PMA_PROFILE_PROCESSOR)MapAllocatePool(
+        POOL_FLAG_NON_PAGED, (SIZE_T)ulCount * sizeof(MA_PROFILE_PROCESSOR), MA_PROFILE_TAG);
+
+    if (pProcessors == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    MapProfileProcessors = pProcessors;
+    MapProfileProcessorsCount = ulCount;
+
+    MapProfileSettings = *Settings;
+    MapProfileSettings.ProcessCount =
+        min(MapProfileSettings.ProcessCount, MA_PROFILE_PROCESSES_MAX);
+
+    // The default clock tick is too coarse for the shorter intervals.
+    ExSetTimerResolution(Settings->Interval * 10 * 1000, TRUE);
+
+    LARGE_INTEGER liDueTime = { .QuadPart = -10 * 1000 * (LONG64)Settings->Interval };
+
+    for (ULONG i = 0; i < ulCount; ++i)
+    {
+        PROCESSOR_NUMBER number;
+        if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &number)))
+        {
+            continue;
+        }
+
+        PMA_PROFILE_PROCESSOR pProcessor = &pProcessors[i];
+        pProcessor->Processor = i;
+
+        KeInitializeTimerEx(&pProcessor->Timer, NotificationTimer);
+        KeInitializeDpc(&pProcessor->Dpc, MapProfileDpc, pProcessor);
+        KeSetTargetProcessorDpcEx(&pProcessor->Dpc, &number);
+        // Runs as soon as it reaches the target, while the sampled thread is still there.
+        KeSetImportanceDpc(&pProcessor->Dpc, HighImportance);
+
+        KeSetTimerEx(&pProcessor->Timer, liDueTime, Settings->Interval, &pProcessor->Dpc);
+        pProcessor->Started = TRUE;
+    }
+
+    MapProfileRunning = TRUE;
+
+    Logger::LogTrace("Profiling ", ulCount, " processors every ", Settings->Interval, " ms");
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapStopProfile(
+    _Out_opt_ PBOOLEAN WasEnabled
+)
+{
+    Locker<PushLock> lock(&MapProfileLock);
+
+    if (WasEnabled != NULL)
+    {
+        *WasEnabled = MapProfileRunning;
+    }
+
+    if (!MapProfileRunning)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < MapProfileProcessorsCount; ++i)
+    {
+        if (MapProfileProcessors[i].Started)
+        {
+            KeCancelTimer(&MapProfileProcessors[i].Timer);
+        }
+    }
+
+    KeFlushQueuedDpcs();
+    ExSetTimerResolution(0, FALSE);
+
+    // The APCs queued by the last DPCs still write to the rings.
+    LARGE_INTEGER liInterval = { .QuadPart = -10 * 1000 };
+    while (MapProfileApcsPending != 0)
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &liInterval);
+    }
+
+    MapProfileRunning = FALSE;
+}
+
+extern "C"
+VOID
+MapCleanupProfile()
+{
+    MapStopProfile(NULL);
+
+    Locker<PushLock> lock(&MapProfileLock);
+
+    if (MapProfileProcessors != NULL)
+    {
+        MapFreePool(MapProfileProcessors,
+            (SIZE_T)MapProfileProcessorsCount * sizeof(MA_PROFILE_PROCESSOR), MA_PROFILE_TAG);
+        MapProfileProcessors = NULL;
+        MapProfileProcessorsCount = 0;
+    }
+}
+
+//
+// Profile reading
+//
+
+extern "C"
+NTSTATUS
+MapReadProfile(
+    _Out_writes_to_(Count, *Read) PMA_PROFILE_SAMPLE Samples,
+    _In_ SIZE_T Count,
+    _Out_ PSIZE_T Read,
+    _Out_ PSIZE_T Lost
+)
+{
+    *Read = 0;
+    *Lost = 0;
+
+    Locker<PushLock> lock(&MapProfileLock);
+
+    PMA_PROFILE_PROCESSOR pProcessors = MapProfileProcessors;
+    if (pProcessors == NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    for (ULONG i = 0; i < MapProfileProcessorsCount && *Read < Count; ++i)
+    {
+        PMA_PROFILE_PROCESSOR pProcessor = &pProcessors[i];
+
+        *Lost += (SIZE_T)InterlockedExchange64(&pProcessor->Lost, 0);
+
+        LONG64 iHead = ReadAcquire64(&pProcessor->Head);
+        LONG64 iTail = pProcessor->Tail;
+
+        while (iTail < iHead && *Read < Count)
+        {
+            Samples[*Read] = pProcessor->Samples[iTail & (MA_PROFILE_RING_SIZE - 1)];
+            ++*Read;
+            ++iTail;
+        }
+
+        // Hands the slots back to the DPC only once they have been copied.
+        WriteRelease64(&pProcessor->Tail, iTail);
+    }
+
+    return STATUS_SUCCESS;
+}
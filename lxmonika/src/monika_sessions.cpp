@@ -0,0 +1,429 @@
+#include "monika.h"
+
+#include "os.h"
+
+#include "AutoResource.h"
+
+#define MA_SESSION_TAG ('sSaM')
+
+//
+// Session data
+//
+
+typedef struct _MA_SESSION {
+    LIST_ENTRY                  Link;
+    // One for the provider routine, and one for the completion of asynchronous sessions.
+    volatile LONG               ReferenceCount;
+    ULONG64                     SessionId;
+    DWORD                       Provider;
+    ULONG                       Limits;
+    // The attributes given to the provider, until its routine returns.
+    PMA_PICO_SESSION_ATTRIBUTES Attributes;
+    PVOID                       Job;
+    PMA_PICO_SESSION_COMPLETION Completion;
+    PVOID                       CompletionContext;
+} MA_SESSION, *PMA_SESSION;
+
+static LIST_ENTRY MapSessions = { &MapSessions, &MapSessions };
+
+// A spin lock, as asynchronous sessions may complete at DISPATCH_LEVEL.
+static KSPIN_LOCK MapSessionsLock = 0;
+
+static volatile LONG64 MapSessionSequence = 0;
+
+static
+VOID
+MapReleaseSession(
+    _In_ PMA_SESSION pSession
+)
+{
+    if (InterlockedDecrement(&pSession->ReferenceCount) != 0)
+    {
+        return;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MapSessionsLock, &irql);
+    RemoveEntryList(&pSession->Link);
+    KeReleaseSpinLock(&MapSessionsLock, irql);
+
+    // The processes still in the job keep it, and its limits, alive.
+    ObDereferenceObject(pSession->Job);
+    MapFreePool(pSession, sizeof(MA_SESSION), MA_SESSION_TAG);
+}
+
+//
+// Session lifetime
+//
+
+extern "C"
+NTSTATUS
+MapValidateLimits(
+    _In_ const MA_PICO_SESSION_LIMITS* Limits
+)
+{
+    if ((Limits->Flags & ~MA_LIMIT_VALID_FLAGS) != 0 || Limits->Reserved != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((Limits->Flags & MA_LIMIT_CPU_RATE)
+        && (Limits->CpuRate == 0 || Limits->CpuRate > MA_CPU_RATE_MAX))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((Limits->Flags & MA_LIMIT_COMMIT) && Limits->Commit == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // NT wants both bounds of a working set limit.
+    if ((Limits->Flags & MA_LIMIT_WORKING_SET)
+        && (Limits->MinimumWorkingSet == 0
+            || Limits->MinimumWorkingSet > Limits->MaximumWorkingSet))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if ((Limits->Flags & MA_LIMIT_PROCESS_COUNT) && Limits->ProcessCount == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MapCreateSession(
+    _In_ DWORD Provider,
+    _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+    _In_opt_ PMA_PICO_SESSION_COMPLETION Completion,
+    _In_opt_ PVOID CompletionContext,
+    _Out_ PVOID* Session
+)
+{
+    *Session = NULL;
+
+    if (Attributes->Size < RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Limits)
+        || Attributes->Limits.Flags == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    const MA_PICO_SESSION_LIMITS* pLimits = &Attributes->Limits;
+
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlJob = NULL;
+    AUTO_RESOURCE(hdlJob, ZwClose);
+
+    MA_RETURN_IF_FAIL(ZwCreateJobObject(&hdlJob, JOB_OBJECT_ALL_ACCESS, &objectAttributes));
+
+    // Breakaway is not allowed, so that nothing started by the session escapes its limits.
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limitInformation = { };
+    JOBOBJECT_BASIC_LIMIT_INFORMATION& basicLimits = limitInformation.BasicLimitInformation;
+
+    if (pLimits->Flags & MA_LIMIT_COMMIT)
+    {
+        basicLimits.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        limitInformation.JobMemoryLimit = pLimits->Commit;
+    }
+
+    if (pLimits->Flags & MA_LIMIT_WORKING_SET)
+    {
+        basicLimits.LimitFlags |= JOB_OBJECT_LIMIT_WORKINGSET;
+        basicLimits.MinimumWorkingSetSize = pLimits->MinimumWorkingSet;
+        basicLimits.MaximumWorkingSetSize = pLimits->MaximumWorkingSet;
+    }
+
+    if (pLimits->Flags & MA_LIMIT_PROCESS_COUNT)
+    {
+        basicLimits.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+        basicLimits.ActiveProcessLimit = pLimits->ProcessCount;
+    }
+
+    if (basicLimits.LimitFlags != 0)
+    {
+        MA_RETURN_IF_FAIL(ZwSetInformationJobObject(hdlJob, JobObjectExtendedLimitInformation,
+            &limitInformation, sizeof(limitInformation)));
+    }
+
+    if (pLimits->Flags & MA_LIMIT_CPU_RATE)
+    {
+        JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rateInformation = { };
+        rateInformation.ControlFlags =
+            JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+        rateInformation.CpuRate = pLimits->CpuRate;
+
+        MA_RETURN_IF_FAIL(ZwSetInformationJobObject(hdlJob, JobObjectCpuRateControlInformation,
+            &rateInformation, sizeof(rateInformation)));
+    }
+
+    PVOID pJob = NULL;
+    AUTO_RESOURCE(pJob, ObDereferenceObject);
+
+    MA_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlJob,
+        JOB_OBJECT_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pJob,
+        NULL
+    ));
+
+    // Non-paged, since the last reference may go away at DISPATCH_LEVEL.
+    PMA_SESSION pSession = (PMA_SESSION)
+        MapAllocatePool(POOL_FLAG_NON_PAGED, sizeof(MA_SESSION), MA_SESSION_TAG);
+
+    if (pSession == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    pSession->ReferenceCount = (Completion != NULL) ? 2 : 1;
+    pSession->SessionId = (ULONG64)InterlockedIncrement64(&MapSessionSequence);
+    pSession->Provider = Provider;
+    pSession->Limits = pLimits->Flags;
+    pSession->Attributes = Attributes;
+    pSession->Job = pJob;
+    pSession->Completion = Completion;
+    pSession->CompletionContext = CompletionContext;
+
+    // Now owned by the session.
+    pJob = NULL;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MapSessionsLock, &irql);
+    InsertTailList(&MapSessions, &pSession->Link);
+    KeReleaseSpinLock(&MapSessionsLock, irql);
+
+    *Session = pSession;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapSessionReturned(
+    _In_opt_ PVOID Session,
+    _In_ NTSTATUS Status
+)
+{
+    PMA_SESSION pSession = (PMA_SESSION)Session;
+
+    if (pSession == NULL)
+    {
+        return;
+    }
+
+    // The attributes are only valid for the duration of the provider routine.
+    KIRQL irql;
+    KeAcquireSpinLock(&MapSessionsLock, &irql);
+    pSession->Attributes = NULL;
+    KeReleaseSpinLock(&MapSessionsLock, irql);
+
+    if (pSession->Completion != NULL && Status != STATUS_PENDING)
+    {
+        // The completion is never going to be called.
+        MapReleaseSession(pSession);
+    }
+
+    MapReleaseSession(pSession);
+}
+
+extern "C"
+VOID
+MapSessionCompletion(
+    _In_opt_ PVOID Context,
+    _In_ NTSTATUS Status
+)
+{
+    PMA_SESSION pSession = (PMA_SESSION)Context;
+
+    PMA_PICO_SESSION_COMPLETION pCompletion = pSession->Completion;
+    PVOID pCompletionContext = pSession->CompletionContext;
+
+    MapReleaseSession(pSession);
+
+    pCompletion(pCompletionContext, Status);
+}
+
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaAssignSessionProcess(
+    _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+    _In_ PEPROCESS Process
+)
+{
+    if (Attributes == NULL || Process == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Attributes->Size < RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Limits)
+        || Attributes->Limits.Flags == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    PVOID pJob = NULL;
+    AUTO_RESOURCE(pJob, ObDereferenceObject);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&MapSessionsLock, &irql);
+
+    for (PLIST_ENTRY pEntry = MapSessions.Flink; pEntry != &MapSessions; pEntry = pEntry->Flink)
+    {
+        PMA_SESSION pSession = CONTAINING_RECORD(pEntry, MA_SESSION, Link);
+
+        if (pSession->Attributes == Attributes)
+        {
+            pJob = pSession->Job;
+            ObReferenceObject(pJob);
+            break;
+        }
+    }
+
+    KeReleaseSpinLock(&MapSessionsLock, irql);
+
+    if (pJob == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    HANDLE hdlJob = NULL;
+    AUTO_RESOURCE(hdlJob, ZwClose);
+
+    MA_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        pJob,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        JOB_OBJECT_ASSIGN_PROCESS,
+        NULL,
+        KernelMode,
+        &hdlJob
+    ));
+
+    HANDLE hdlProcess = NULL;
+    AUTO_RESOURCE(hdlProcess, ZwClose);
+
+    MA_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        Process,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        PROCESS_SET_QUOTA | PROCESS_TERMINATE,
+        *PsProcessType,
+        KernelMode,
+        &hdlProcess
+    ));
+
+    return ZwAssignProcessToJobObject(hdlJob, hdlProcess);
+}
+
+//
+// Accounting
+//
+
+extern "C"
+NTSTATUS
+MapQuerySessions(
+    _Out_writes_to_(Count, *Read) PMA_SESSION_INFORMATION Sessions,
+    _In_ SIZE_T Count,
+    _Out_ PSIZE_T Read,
+    _Out_ PSIZE_T Total
+)
+{
+    *Read = 0;
+    *Total = 0;
+
+    PMA_SESSION* pSnapshot = NULL;
+
+    if (Count != 0)
+    {
+        pSnapshot = (PMA_SESSION*)
+            MapAllocatePool(PagedPool, Count * sizeof(PMA_SESSION), MA_SESSION_TAG);
+
+        if (pSnapshot == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    SIZE_T uRead = 0;
+    SIZE_T uTotal = 0;
+
+    // Jobs can only be queried at PASSIVE_LEVEL, so the sessions are referenced and queried
+    // after the lock is dropped.
+    KIRQL irql;
+    KeAcquireSpinLock(&MapSessionsLock, &irql);
+
+    for (PLIST_ENTRY pEntry = MapSessions.Flink; pEntry != &MapSessions; pEntry = pEntry->Flink)
+    {
+        PMA_SESSION pSession = CONTAINING_RECORD(pEntry, MA_SESSION, Link);
+
+        ++uTotal;
+
+        if (uRead < Count)
+        {
+            InterlockedIncrement(&pSession->ReferenceCount);
+            pSnapshot[uRead++] = pSession;
+        }
+    }
+
+    KeReleaseSpinLock(&MapSessionsLock, irql);
+
+    for (SIZE_T i = 0; i < uRead; ++i)
+    {
+        PMA_SESSION pSession = pSnapshot[i];
+
+        Sessions[i] = MA_SESSION_INFORMATION
+        {
+            .SessionId = pSession->SessionId,
+            .Provider = pSession->Provider,
+            .Limits = pSession->Limits
+        };
+
+        HANDLE hdlJob = NULL;
+        if (NT_SUCCESS(ObOpenObjectByPointer(pSession->Job, OBJ_KERNEL_HANDLE, NULL,
+            JOB_OBJECT_QUERY, NULL, KernelMode, &hdlJob)))
+        {
+            JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting;
+            if (NT_SUCCESS(ZwQueryInformationJobObject(hdlJob,
+                JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting), NULL)))
+            {
+                Sessions[i].ActiveProcesses = accounting.BasicInfo.ActiveProcesses;
+                Sessions[i].TotalProcesses = accounting.BasicInfo.TotalProcesses;
+                Sessions[i].TerminatedProcesses = accounting.BasicInfo.TotalTerminatedProcesses;
+                Sessions[i].UserTime = (ULONG64)accounting.BasicInfo.TotalUserTime.QuadPart;
+                Sessions[i].KernelTime = (ULONG64)accounting.BasicInfo.TotalKernelTime.QuadPart;
+                Sessions[i].ReadBytes = accounting.IoInfo.ReadTransferCount;
+                Sessions[i].WriteBytes = accounting.IoInfo.WriteTransferCount;
+            }
+
+            JOBOBJECT_EXTENDED_LIMIT_INFORMATION limitInformation;
+            if (NT_SUCCESS(ZwQueryInformationJobObject(hdlJob,
+                JobObjectExtendedLimitInformation, &limitInformation, sizeof(limitInformation),
+                NULL)))
+            {
+                Sessions[i].PeakCommit = limitInformation.PeakJobMemoryUsed;
+            }
+
+            ZwClose(hdlJob);
+        }
+
+        MapReleaseSession(pSession);
+    }
+
+    if (pSnapshot != NULL)
+    {
+        MapFreePool(pSnapshot, Count * sizeof(PMA_SESSION), MA_SESSION_TAG);
+    }
+
+    *Read = uRead;
+    *Total = uTotal;
+
+    return STATUS_SUCCESS;
+}
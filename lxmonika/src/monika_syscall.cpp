@@ -0,0 +1,299 @@
+#include "monika.h"
+
+#include "Locker.h"
+#include "Logger.h"
+
+#define MA_SYSTEM_CALL_HOOK_TAG ('hSaM')
+
+//
+// System call hook data
+//
+
+typedef struct _MA_SYSTEM_CALL_HOOK {
+    LIST_ENTRY                      ListEntry;
+    EX_RUNDOWN_REF                  Rundown;
+    DWORD                           Provider;
+    ULONG                           Number;
+    PMA_PICO_SYSTEM_CALL_PRE_HOOK   PreHook;
+    PMA_PICO_SYSTEM_CALL_POST_HOOK  PostHook;
+    PVOID                           Context;
+} MA_SYSTEM_CALL_HOOK, *PMA_SYSTEM_CALL_HOOK;
+
+// Guards the SystemCallHooks lists of all providers.
+static PushLock MapSystemCallHooksLock;
+
+static
+SIZE_T
+MapCountSystemCallHooks(
+    _In_ DWORD Provider,
+    _In_ ULONG Number
+)
+{
+    // Must be called with MapSystemCallHooksLock held.
+
+    SIZE_T uCount = 0;
+    PLIST_ENTRY pHead = &MapProviders[Provider].SystemCallHooks;
+
+    for (PLIST_ENTRY pEntry = pHead->Flink; pEntry != pHead; pEntry = pEntry->Flink)
+    {
+        PMA_SYSTEM_CALL_HOOK pHook = CONTAINING_RECORD(pEntry, MA_SYSTEM_CALL_HOOK, ListEntry);
+        if (pHook->Number == Number)
+        {
+            ++uCount;
+        }
+    }
+
+    return uCount;
+}
+
+static
+VOID
+MapFreeSystemCallHook(
+    _In_ PMA_SYSTEM_CALL_HOOK Hook
+)
+{
+    // The hook must already be unlinked. Wait for callers still running it.
+    ExWaitForRundownProtectionRelease(&Hook->Rundown);
+    ExRundownCompleted(&Hook->Rundown);
+
+    MapFreePool(Hook, sizeof(MA_SYSTEM_CALL_HOOK), MA_SYSTEM_CALL_HOOK_TAG);
+}
+
+//
+// System call hook registration
+//
+
+extern "C"
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaRegisterSystemCallHook(
+    _In_ SIZE_T Index,
+    _In_ ULONG SystemCallNumber,
+    _In_opt_ PMA_PICO_SYSTEM_CALL_PRE_HOOK PreHook,
+    _In_opt_ PMA_PICO_SYSTEM_CALL_POST_HOOK PostHook,
+    _In_opt_ PVOID Context,
+    _Out_ PVOID* Cookie
+)
+{
+    if (SystemCallNumber >= MA_SYSTEM_CALL_MAX
+        || (PreHook == NULL && PostHook == NULL)
+        || Cookie == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PMA_SYSTEM_CALL_HOOK pHook = (PMA_SYSTEM_CALL_HOOK)
+        MapAllocatePool(PagedPool, sizeof(MA_SYSTEM_CALL_HOOK), MA_SYSTEM_CALL_HOOK_TAG);
+
+    if (pHook == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    *pHook = MA_SYSTEM_CALL_HOOK
+    {
+        .Provider = (DWORD)Index,
+        .Number = SystemCallNumber,
+        .PreHook = PreHook,
+        .PostHook = PostHook,
+        .Context = Context
+    };
+    ExInitializeRundownProtection(&pHook->Rundown);
+
+    // Keeps the provider from being unregistered, and its hooks from being dropped, while the
+    // new hook is being inserted.
+    if (!MapReferenceProvider(Index))
+    {
+        MapFreePool(pHook, sizeof(MA_SYSTEM_CALL_HOOK), MA_SYSTEM_CALL_HOOK_TAG);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    {
+        Locker<PushLock> lock(&MapSystemCallHooksLock);
+
+        if (MapCountSystemCallHooks((DWORD)Index, SystemCallNumber)
+            >= MA_SYSTEM_CALL_HOOK_MAX_DEPTH)
+        {
+            status = STATUS_QUOTA_EXCEEDED;
+        }
+        else
+        {
+            InsertTailList(&MapProviders[Index].SystemCallHooks, &pHook->ListEntry);
+
+            // Only now may the dispatcher start looking for the hook.
+            InterlockedBitTestAndSet(
+                &MapProviders[Index].SystemCallFilter[SystemCallNumber / 32],
+                SystemCallNumber % 32
+            );
+        }
+    }
+
+    MapDereferenceProvider(Index);
+
+    if (!NT_SUCCESS(status))
+    {
+        MapFreePool(pHook, sizeof(MA_SYSTEM_CALL_HOOK), MA_SYSTEM_CALL_HOOK_TAG);
+        return status;
+    }
+
+    Logger::LogTrace("Hooked system call ", SystemCallNumber, " of provider #", Index);
+
+    *Cookie = pHook;
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+MONIKA_EXPORT
+NTSTATUS NTAPI
+MaUnregisterSystemCallHook(
+    _In_ PVOID Cookie
+)
+{
+    if (Cookie == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PMA_SYSTEM_CALL_HOOK pHook = NULL;
+
+    {
+        Locker<PushLock> lock(&MapSystemCallHooksLock);
+
+        // Look the cookie up instead of trusting it, since the hooks of an unregistered provider
+        // have already been freed.
+        for (SIZE_T i = 0; i < MaPicoProviderMaxCount && pHook == NULL; ++i)
+        {
+            PLIST_ENTRY pHead = &MapProviders[i].SystemCallHooks;
+            for (PLIST_ENTRY pEntry = pHead->Flink; pEntry != pHead; pEntry = pEntry->Flink)
+            {
+                if (pEntry == &((PMA_SYSTEM_CALL_HOOK)Cookie)->ListEntry)
+                {
+                    pHook = (PMA_SYSTEM_CALL_HOOK)Cookie;
+                    break;
+                }
+            }
+        }
+
+        if (pHook == NULL)
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        RemoveEntryList(&pHook->ListEntry);
+
+        if (MapCountSystemCallHooks(pHook->Provider, pHook->Number) == 0)
+        {
+            InterlockedBitTestAndReset(
+                &MapProviders[pHook->Provider].SystemCallFilter[pHook->Number / 32],
+                pHook->Number % 32
+            );
+        }
+    }
+
+    MapFreeSystemCallHook(pHook);
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapRemoveSystemCallHooks(
+    _In_ DWORD Provider
+)
+{
+    LIST_ENTRY listRemoved;
+    InitializeListHead(&listRemoved);
+
+    {
+        Locker<PushLock> lock(&MapSystemCallHooksLock);
+
+        PLIST_ENTRY pHead = &MapProviders[Provider].SystemCallHooks;
+        while (!IsListEmpty(pHead))
+        {
+            InsertTailList(&listRemoved, RemoveHeadList(pHead));
+        }
+
+        RtlZeroMemory(MapProviders[Provider].SystemCallFilter,
+            sizeof(MapProviders[Provider].SystemCallFilter));
+    }
+
+    while (!IsListEmpty(&listRemoved))
+    {
+        MapFreeSystemCallHook(
+            CONTAINING_RECORD(RemoveHeadList(&listRemoved), MA_SYSTEM_CALL_HOOK, ListEntry));
+    }
+}
+
+//
+// Hooked system call dispatch
+//
+
+extern "C"
+VOID
+MapDispatchHookedSystemCall(
+    _In_ DWORD Provider,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+    _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH Dispatch
+)
+{
+    ULONG ulNumber = (ULONG)MA_SYSTEM_CALL_NUMBER(SystemCall);
+
+    struct
+    {
+        PMA_SYSTEM_CALL_HOOK Hook;
+        PVOID State;
+    } calls[MA_SYSTEM_CALL_HOOK_MAX_DEPTH];
+    SIZE_T uCallsCount = 0;
+
+    // Collect the hooks, keeping each of them alive with its rundown protection so that the
+    // lock does not have to be held while the system call itself runs.
+    MapSystemCallHooksLock.LockShared();
+
+    PLIST_ENTRY pHead = &MapProviders[Provider].SystemCallHooks;
+    for (PLIST_ENTRY pEntry = pHead->Flink;
+        pEntry != pHead && uCallsCount < MA_SYSTEM_CALL_HOOK_MAX_DEPTH;
+        pEntry = pEntry->Flink)
+    {
+        PMA_SYSTEM_CALL_HOOK pHook = CONTAINING_RECORD(pEntry, MA_SYSTEM_CALL_HOOK, ListEntry);
+        if (pHook->Number == ulNumber && ExAcquireRundownProtection(&pHook->Rundown))
+        {
+            calls[uCallsCount++] = { .Hook = pHook, .State = NULL };
+        }
+    }
+
+    MapSystemCallHooksLock.UnlockShared();
+
+    BOOLEAN bDispatch = TRUE;
+    SIZE_T uEnteredCount = 0;
+
+    while (uEnteredCount < uCallsCount && bDispatch)
+    {
+        PMA_SYSTEM_CALL_HOOK pHook = calls[uEnteredCount++].Hook;
+        if (pHook->PreHook != NULL)
+        {
+            bDispatch = pHook->PreHook(pHook->Context, SystemCall,
+                &calls[uEnteredCount - 1].State);
+        }
+    }
+
+    if (bDispatch)
+    {
+        Dispatch(SystemCall);
+    }
+
+    // Unwind in reverse order, only for hooks whose pre-call hooks got to run.
+    for (SIZE_T i = uEnteredCount - 1; i != (SIZE_T)-1; --i)
+    {
+        if (calls[i].Hook->PostHook != NULL)
+        {
+            calls[i].Hook->PostHook(calls[i].Hook->Context, SystemCall, calls[i].State);
+        }
+    }
+
+    for (SIZE_T i = 0; i < uCallsCount; ++i)
+    {
+        ExReleaseRundownProtection(&calls[i].Hook->Rundown);
+    }
+}
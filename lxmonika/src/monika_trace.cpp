@@ -0,0 +1,595 @@
+#include "monika.h"
+
+#include "Locker.h"
+#include "Logger.h"
+
+#define MA_TRACE_TAG ('rTaM')
+
+// Sequence of a record while a writer owns it.
+#define MA_TRACE_RECORD_BUSY (-1)
+
+static_assert((MA_TRACE_RING_SIZE & (MA_TRACE_RING_SIZE - 1)) == 0,
+    "MA_TRACE_RING_SIZE must be a power of two");
+static_assert(MaPicoProviderMaxCount <= 32 && MaTraceEventMaxCount <= 32,
+    "MA_TRACE_FILTER masks must have a bit for each provider and event");
+
+//
+// Trace data
+//
+
+typedef struct DECLSPEC_CACHEALIGN _MA_TRACE_RING {
+    // Next position to be written. Shared by all writers on the processor.
+    volatile LONG64                     Head;
+    // Next position to be read. Only touched by readers, with MapTraceReaderLock held.
+    DECLSPEC_CACHEALIGN LONG64          Tail;
+    MA_TRACE_RECORD                     Records[MA_TRACE_RING_SIZE];
+} MA_TRACE_RING, *PMA_TRACE_RING;
+
+volatile LONG MapInstrumentation = 0;
+
+// Held by everything that touches the rings or the statistics blocks without MapTraceReaderLock,
+// so that MapCleanupTrace can wait for them before freeing either. Zero is the initialized state.
+static EX_RUNDOWN_REF MapTraceRundown;
+
+static PMA_TRACE_RING volatile MapTraceRings = NULL;
+static ULONG MapTraceRingsCount = 0;
+
+// Serializes readers, filter changes and the allocation of the rings. Never taken by writers.
+static PushLock MapTraceReaderLock;
+
+// Read by writers without synchronization, so records traced while the filter changes may be
+// matched against a mix of the old and the new one.
+static MA_TRACE_FILTER MapTraceFilter;
+// Whether MapTraceFilter has any non-zero field, so that unfiltered tracing skips the checks.
+static volatile LONG MapTraceFilterActive = FALSE;
+
+//
+// Statistics data
+//
+
+// The counters of one provider on one processor. Only written from that processor, so the
+// interlocked operations below never contend across processors.
+typedef struct DECLSPEC_CACHEALIGN _MA_STATISTICS_BLOCK {
+    volatile LONG64                     Events[MaTraceEventMaxCount];
+    volatile LONG64                     Latency[MA_LATENCY_BUCKETS];
+    volatile LONG64                     SystemCallTime;
+} MA_STATISTICS_BLOCK, *PMA_STATISTICS_BLOCK;
+
+// MapStatisticsBlocksCount rows of MaPicoProviderMaxCount blocks each.
+static PMA_STATISTICS_BLOCK volatile MapStatisticsBlocks = NULL;
+static ULONG MapStatisticsBlocksCount = 0;
+
+//
+// Trace control
+//
+
+extern "C"
+NTSTATUS
+MapSetTraceEnabled(
+    _In_ BOOLEAN Enable,
+    _Out_opt_ PBOOLEAN WasEnabled
+)
+{
+    if (Enable && MapTraceRings == NULL)
+    {
+        Locker<PushLock> lock(&MapTraceReaderLock);
+
+        if (MapTraceRings == NULL)
+        {
+            ULONG ulCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+            // Nonpaged, since system call dispatchers may run at raised IRQLs.
+            PMA_TRACE_RING pRings = (PMA_TRACE_RING)MapAllocatePool(POOL_FLAG_NON_PAGED,
+                ulCount * sizeof(MA_TRACE_RING), MA_TRACE_TAG);
+
+            if (pRings == NULL)
+            {
+                return STATUS_NO_MEMORY;
+            }
+
+            MapTraceRingsCount = ulCount;
+            InterlockedExchangePointer((PVOID volatile*)&MapTraceRings, pRings);
+
+            Logger::LogTrace("Allocated trace rings for ", ulCount, " processors");
+        }
+    }
+
+    LONG lOldFlags = Enable
+        ? InterlockedOr(&MapInstrumentation, MA_INSTRUMENT_TRACE)
+        : InterlockedAnd(&MapInstrumentation, ~MA_INSTRUMENT_TRACE);
+
+    if (WasEnabled != NULL)
+    {
+        *WasEnabled = (lOldFlags & MA_INSTRUMENT_TRACE) != 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapCleanupTrace()
+{
+    InterlockedExchange(&MapInstrumentation, 0);
+    InterlockedExchange(&MapTraceFilterActive, FALSE);
+    RtlZeroMemory(&MapTraceFilter, sizeof(MapTraceFilter));
+
+    // Writers that saw the flags before they were cleared may still be using the buffers.
+    ExWaitForRundownProtectionRelease(&MapTraceRundown);
+
+    Locker<PushLock> lock(&MapTraceReaderLock);
+
+    PMA_TRACE_RING pRings = (PMA_TRACE_RING)
+        InterlockedExchangePointer((PVOID volatile*)&MapTraceRings, NULL);
+
+    if (pRings != NULL)
+    {
+        MapFreePool(pRings, MapTraceRingsCount * sizeof(MA_TRACE_RING), MA_TRACE_TAG);
+    }
+
+    PMA_STATISTICS_BLOCK pBlocks = (PMA_STATISTICS_BLOCK)
+        InterlockedExchangePointer((PVOID volatile*)&MapStatisticsBlocks, NULL);
+
+    if (pBlocks != NULL)
+    {
+        MapFreePool(pBlocks,
+            (SIZE_T)MapStatisticsBlocksCount * MaPicoProviderMaxCount * sizeof(MA_STATISTICS_BLOCK),
+            MA_TRACE_TAG);
+    }
+
+    ExReInitializeRundownProtection(&MapTraceRundown);
+}
+
+//
+// Trace filtering
+//
+
+extern "C"
+VOID
+MapSetTraceFilter(
+    _In_ const MA_TRACE_FILTER* Filter
+)
+{
+    Locker<PushLock> lock(&MapTraceReaderLock);
+
+    InterlockedExchange(&MapTraceFilterActive, FALSE);
+
+    MapTraceFilter = *Filter;
+    MapTraceFilter.NumberCount = min(MapTraceFilter.NumberCount, MA_TRACE_FILTER_NUMBERS_MAX);
+
+    InterlockedExchange(&MapTraceFilterActive, Filter->EventMask != 0
+        || Filter->ProviderMask != 0
+        || Filter->ProcessId != 0
+        || Filter->NumberCount != 0);
+}
+
+extern "C"
+VOID
+MapQueryTraceFilter(
+    _Out_ PMA_TRACE_FILTER Filter
+)
+{
+    Locker<PushLock> lock(&MapTraceReaderLock);
+
+    *Filter = MapTraceFilter;
+}
+
+static
+BOOLEAN
+MapTraceFilterMatches(
+    _In_ MA_TRACE_EVENT Event,
+    _In_ DWORD Provider,
+    _In_ HANDLE ProcessId,
+    _In_ ULONG_PTR Number
+)
+{
+    const MA_TRACE_FILTER& filter = MapTraceFilter;
+
+    if (filter.EventMask != 0 && (filter.EventMask & (1ul << Event)) == 0)
+    {
+        return FALSE;
+    }
+
+    if (filter.ProviderMask != 0
+        && (Provider >= MaPicoProviderMaxCount || (filter.ProviderMask & (1ul << Provider)) == 0))
+    {
+        return FALSE;
+    }
+
+    if (filter.ProcessId != 0 && filter.ProcessId != (ULONG64)(ULONG_PTR)ProcessId)
+    {
+        return FALSE;
+    }
+
+    if (filter.NumberCount != 0 && Event == MaTraceEventSystemCall)
+    {
+        ULONG ulCount = min(filter.NumberCount, MA_TRACE_FILTER_NUMBERS_MAX);
+
+        for (ULONG i = 0; i < ulCount; ++i)
+        {
+            if (filter.Numbers[i] == Number)
+            {
+                return TRUE;
+            }
+        }
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// Trace recording
+//
+
+// Must be called with MapTraceRundown held.
+static
+VOID
+MapWriteTraceRecord(
+    _In_ PMA_TRACE_RING Rings,
+    _In_ MA_TRACE_EVENT Event,
+    _In_ DWORD Provider,
+    _In_ HANDLE ProcessId,
+    _In_ HANDLE ThreadId,
+    _In_ ULONG_PTR Number,
+    _In_ ULONG_PTR Result
+)
+{
+    if (MapTraceFilterActive && !MapTraceFilterMatches(Event, Provider, ProcessId, Number))
+    {
+        return;
+    }
+
+    ULONG ulProcessor = KeGetCurrentProcessorNumberEx(NULL);
+    if (ulProcessor >= MapTraceRingsCount)
+    {
+        return;
+    }
+
+    // The thread may be rescheduled to another processor past this point. The reservation is
+    // still atomic, so that only costs some contention on the old processor's ring.
+    PMA_TRACE_RING pRing = &Rings[ulProcessor];
+    LONG64 iPosition = InterlockedIncrement64(&pRing->Head) - 1;
+    PMA_TRACE_RECORD pRecord = &pRing->Records[iPosition & (MA_TRACE_RING_SIZE - 1)];
+    LONG64 iSequence = iPosition + 1;
+
+    // Writers a lap apart share the record. Only one of them writes it at a time, and never over
+    // a newer record, so that the fields always match the sequence readers check. A writer that
+    // loses drops its record, which readers count as lost once the ring moves past it.
+    LONG64 iOldSequence = ReadAcquire64(&pRecord->Sequence);
+    if (iOldSequence == MA_TRACE_RECORD_BUSY || iOldSequence >= iSequence
+        || InterlockedCompareExchange64(&pRecord->Sequence, MA_TRACE_RECORD_BUSY, iOldSequence)
+            != iOldSequence)
+    {
+        return;
+    }
+
+    pRecord->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    pRecord->ProcessId = (ULONG64)(ULONG_PTR)ProcessId;
+    pRecord->ThreadId = (ULONG64)(ULONG_PTR)ThreadId;
+    pRecord->Number = Number;
+    pRecord->Result = Result;
+    pRecord->Event = (USHORT)Event;
+    pRecord->Provider = (USHORT)Provider;
+    pRecord->Processor = ulProcessor;
+
+    InterlockedExchange64(&pRecord->Sequence, iSequence);
+}
+
+extern "C"
+VOID
+MapTraceEvent(
+    _In_ MA_TRACE_EVENT Event,
+    _In_ DWORD Provider,
+    _In_ HANDLE ProcessId,
+    _In_ HANDLE ThreadId,
+    _In_ ULONG_PTR Number,
+    _In_ ULONG_PTR Result
+)
+{
+    if (!ExAcquireRundownProtection(&MapTraceRundown))
+    {
+        return;
+    }
+
+    PMA_TRACE_RING pRings = MapTraceRings;
+    if (pRings != NULL)
+    {
+        MapWriteTraceRecord(pRings, Event, Provider, ProcessId, ThreadId, Number, Result);
+    }
+
+    ExReleaseRundownProtection(&MapTraceRundown);
+}
+
+//
+// Trace reading
+//
+
+extern "C"
+NTSTATUS
+MapReadTrace(
+    _Out_writes_to_(Count, *Read) PMA_TRACE_RECORD Records,
+    _In_ SIZE_T Count,
+    _Out_ PSIZE_T Read,
+    _Out_ PSIZE_T Lost
+)
+{
+    *Read = 0;
+    *Lost = 0;
+
+    Locker<PushLock> lock(&MapTraceReaderLock);
+
+    PMA_TRACE_RING pRings = MapTraceRings;
+    if (pRings == NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    for (ULONG i = 0; i < MapTraceRingsCount && *Read < Count; ++i)
+    {
+        PMA_TRACE_RING pRing = &pRings[i];
+        LONG64 iHead = ReadAcquire64(&pRing->Head);
+
+        // The writers have lapped the reader.
+        if (iHead - pRing->Tail > MA_TRACE_RING_SIZE)
+        {
+            *Lost += (SIZE_T)(iHead - MA_TRACE_RING_SIZE - pRing->Tail);
+            pRing->Tail = iHead - MA_TRACE_RING_SIZE;
+        }
+
+        while (pRing->Tail < iHead && *Read < Count)
+        {
+            PMA_TRACE_RECORD pRecord = &pRing->Records[pRing->Tail & (MA_TRACE_RING_SIZE - 1)];
+            LONG64 iExpected = pRing->Tail + 1;
+            LONG64 iSequence = ReadAcquire64(&pRecord->Sequence);
+
+            // Also catches MA_TRACE_RECORD_BUSY. A record dropped by its writer stays older until
+            // the ring is lapped, which the check above then counts as lost.
+            if (iSequence < iExpected)
+            {
+                // Still being written. Pick it up on the next read.
+                break;
+            }
+
+            if (iSequence == iExpected)
+            {
+                Records[*Read] = *pRecord;
+                MemoryBarrier();
+
+                if (ReadAcquire64(&pRecord->Sequence) == iExpected)
+                {
+                    ++*Read;
+                    ++pRing->Tail;
+                    continue;
+                }
+            }
+
+            // Overwritten by a newer record, before or while being copied.
+            ++*Lost;
+            ++pRing->Tail;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Statistics
+//
+
+extern "C"
+NTSTATUS
+MapSetStatisticsEnabled(
+    _In_ BOOLEAN Enable,
+    _Out_opt_ PBOOLEAN WasEnabled
+)
+{
+    if (Enable && MapStatisticsBlocks == NULL)
+    {
+        Locker<PushLock> lock(&MapTraceReaderLock);
+
+        if (MapStatisticsBlocks == NULL)
+        {
+            ULONG ulCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+            PMA_STATISTICS_BLOCK pBlocks = (PMA_STATISTICS_BLOCK)MapAllocatePool(
+                POOL_FLAG_NON_PAGED,
+                (SIZE_T)ulCount * MaPicoProviderMaxCount * sizeof(MA_STATISTICS_BLOCK),
+                MA_TRACE_TAG
+            );
+
+            if (pBlocks == NULL)
+            {
+                return STATUS_NO_MEMORY;
+            }
+
+            MapStatisticsBlocksCount = ulCount;
+            InterlockedExchangePointer((PVOID volatile*)&MapStatisticsBlocks, pBlocks);
+        }
+    }
+
+    LONG lOldFlags = Enable
+        ? InterlockedOr(&MapInstrumentation, MA_INSTRUMENT_STATISTICS)
+        : InterlockedAnd(&MapInstrumentation, ~MA_INSTRUMENT_STATISTICS);
+
+    if (WasEnabled != NULL)
+    {
+        *WasEnabled = (lOldFlags & MA_INSTRUMENT_STATISTICS) != 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MapQueryStatistics(
+    _In_ DWORD Provider,
+    _Out_ PMA_PROVIDER_STATISTICS Statistics
+)
+{
+    RtlZeroMemory(Statistics, sizeof(*Statistics));
+
+    if (Provider >= MaPicoProviderMaxCount || !ExAcquireRundownProtection(&MapTraceRundown))
+    {
+        return;
+    }
+
+    PMA_STATISTICS_BLOCK pBlocks = MapStatisticsBlocks;
+    if (pBlocks == NULL)
+    {
+        ExReleaseRundownProtection(&MapTraceRundown);
+        return;
+    }
+
+    // Counters are read without synchronization, so the sums may be off by the events that
+    // happen during the query.
+    for (ULONG i = 0; i < MapStatisticsBlocksCount; ++i)
+    {
+        PMA_STATISTICS_BLOCK pBlock = &pBlocks[(SIZE_T)i * MaPicoProviderMaxCount + Provider];
+
+        for (SIZE_T j = 0; j < MaTraceEventMaxCount; ++j)
+        {
+            Statistics->Events[j] += (ULONG64)ReadNoFence64(&pBlock->Events[j]);
+        }
+
+        for (SIZE_T j = 0; j < MA_LATENCY_BUCKETS; ++j)
+        {
+            Statistics->Latency[j] += (ULONG64)ReadNoFence64(&pBlock->Latency[j]);
+        }
+
+        Statistics->SystemCallTime += (ULONG64)ReadNoFence64(&pBlock->SystemCallTime);
+    }
+
+    ExReleaseRundownProtection(&MapTraceRundown);
+}
+
+// Must be called with MapTraceRundown held, for as long as the block is used.
+static
+PMA_STATISTICS_BLOCK
+MapGetStatisticsBlock(
+    _In_ DWORD Provider
+)
+{
+    PMA_STATISTICS_BLOCK pBlocks = MapStatisticsBlocks;
+    if (pBlocks == NULL || Provider >= MaPicoProviderMaxCount)
+    {
+        return NULL;
+    }
+
+    ULONG ulProcessor = KeGetCurrentProcessorNumberEx(NULL);
+    if (ulProcessor >= MapStatisticsBlocksCount)
+    {
+        return NULL;
+    }
+
+    return &pBlocks[(SIZE_T)ulProcessor * MaPicoProviderMaxCount + Provider];
+}
+
+//
+// Instrumented dispatch
+//
+
+extern "C"
+VOID
+MapInstrumentEvent(
+    _In_ MA_TRACE_EVENT Event,
+    _In_ DWORD Provider,
+    _In_ HANDLE ProcessId,
+    _In_ HANDLE ThreadId,
+    _In_ ULONG_PTR Number,
+    _In_ ULONG_PTR Result
+)
+{
+    LONG lFlags = MapInstrumentation;
+
+    if ((lFlags & MA_INSTRUMENT_STATISTICS) && ExAcquireRundownProtection(&MapTraceRundown))
+    {
+        PMA_STATISTICS_BLOCK pBlock = MapGetStatisticsBlock(Provider);
+        if (pBlock != NULL)
+        {
+            InterlockedIncrementNoFence64(&pBlock->Events[Event]);
+        }
+
+        ExReleaseRundownProtection(&MapTraceRundown);
+    }
+
+    if (lFlags & MA_INSTRUMENT_TRACE)
+    {
+        MapTraceEvent(Event, Provider, ProcessId, ThreadId, Number, Result);
+    }
+    if (lFlags & MA_INSTRUMENT_ETW)
+    {
+        MapEtwWriteEvent(Event, Provider, ProcessId, ThreadId, Number, Result);
+    }
+    if ((lFlags & MA_INSTRUMENT_EVENTS) && Event != MaTraceEventSystemCall
+        && Event != MaTraceEventException)
+    {
+        MapPublishEvent(Event, Provider, ProcessId, ThreadId, (NTSTATUS)Result);
+    }
+}
+
+extern "C"
+VOID
+MapDispatchInstrumentedSystemCall(
+    _In_ DWORD Provider,
+    _Inout_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall,
+    _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH Dispatch
+)
+{
+    LONG lFlags = MapInstrumentation;
+
+    // Read before dispatching, since the result may overwrite the number.
+    ULONG_PTR uNumber = MA_SYSTEM_CALL_NUMBER(SystemCall);
+    LONG64 iStart = (lFlags & MA_INSTRUMENT_STATISTICS)
+        ? KeQueryPerformanceCounter(NULL).QuadPart
+        : 0;
+
+    MapDispatchUninstrumentedSystemCall(Provider, SystemCall, Dispatch);
+
+    if (lFlags & MA_INSTRUMENT_STATISTICS)
+    {
+        ULONG64 uElapsed = (ULONG64)(KeQueryPerformanceCounter(NULL).QuadPart - iStart);
+
+        // The thread may have moved to another processor. Count it on the new one.
+        if (ExAcquireRundownProtection(&MapTraceRundown))
+        {
+            PMA_STATISTICS_BLOCK pBlock = MapGetStatisticsBlock(Provider);
+            if (pBlock != NULL)
+            {
+                ULONG ulBucket = 0;
+                BitScanReverse64(&ulBucket, uElapsed | 1);
+                ulBucket = min(ulBucket, MA_LATENCY_BUCKETS - 1);
+
+                InterlockedIncrementNoFence64(&pBlock->Events[MaTraceEventSystemCall]);
+                InterlockedIncrementNoFence64(&pBlock->Latency[ulBucket]);
+                InterlockedAddNoFence64(&pBlock->SystemCallTime, (LONG64)uElapsed);
+            }
+
+            ExReleaseRundownProtection(&MapTraceRundown);
+        }
+
+        // Only this thread writes its own context, so plain increments do. The process sees
+        // them through MapQueryProcesses, and for good once the thread exits.
+        PMA_CONTEXT pThreadContext = NULL;
+        if (NT_SUCCESS(MapGetObjectContext(PsGetCurrentThread(), &pThreadContext)))
+        {
+            WriteNoFence64(&pThreadContext->SystemCalls,
+                ReadNoFence64(&pThreadContext->SystemCalls) + 1);
+            WriteNoFence64(&pThreadContext->SystemCallTime,
+                ReadNoFence64(&pThreadContext->SystemCallTime) + (LONG64)uElapsed);
+        }
+    }
+
+    if (lFlags & MA_INSTRUMENT_TRACE)
+    {
+        MapTraceEvent(MaTraceEventSystemCall, Provider, PsGetCurrentProcessId(),
+            PsGetCurrentThreadId(), uNumber, MA_SYSTEM_CALL_RESULT(SystemCall));
+    }
+
+    if (lFlags & MA_INSTRUMENT_ETW)
+    {
+        MapEtwWriteEvent(MaTraceEventSystemCall, Provider, PsGetCurrentProcessId(),
+            PsGetCurrentThreadId(), uNumber, MA_SYSTEM_CALL_RESULT(SystemCall));
+    }
+}
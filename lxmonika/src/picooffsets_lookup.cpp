@@ -0,0 +1,121 @@
+#include "picooffsets_lookup.h"
+
+extern "C"
+BOOLEAN
+PicoSppMakeOffsetsKey(
+    _In_ PCSTR pVersion,
+    _In_ PCSTR pArchitecture,
+    _Out_ PULONG64 pKey
+)
+{
+    static constexpr struct
+    {
+        PCSTR Name;
+        MA_PICO_ARCHITECTURE Architecture;
+    } architectures[] =
+    {
+        { "x86", MaPicoArchitectureX86 },
+        { "x64", MaPicoArchitectureX64 },
+        { "arm", MaPicoArchitectureArm },
+        { "arm64", MaPicoArchitectureArm64 }
+    };
+
+    static constexpr ULONG64 maxParts[] =
+    {
+        MA_PICO_OFFSETS_KEY_MAX_MAJOR,
+        MA_PICO_OFFSETS_KEY_MAX_MINOR,
+        MA_PICO_OFFSETS_KEY_MAX_BUILD,
+        MA_PICO_OFFSETS_KEY_MAX_REVISION
+    };
+
+    *pKey = 0;
+
+    MA_PICO_ARCHITECTURE architecture = (MA_PICO_ARCHITECTURE)0;
+    for (const auto& entry : architectures)
+    {
+        if (strcmp(pArchitecture, entry.Name) == 0)
+        {
+            architecture = entry.Architecture;
+            break;
+        }
+    }
+
+    if (architecture == (MA_PICO_ARCHITECTURE)0)
+    {
+        return FALSE;
+    }
+
+    ULONG64 parts[ARRAYSIZE(maxParts)] = { 0 };
+    PCSTR pCurrent = pVersion;
+
+    for (SIZE_T i = 0; i < ARRAYSIZE(parts); ++i)
+    {
+        if (*pCurrent < '0' || *pCurrent > '9')
+        {
+            return FALSE;
+        }
+
+        while (*pCurrent >= '0' && *pCurrent <= '9')
+        {
+            parts[i] = parts[i] * 10 + (*pCurrent - '0');
+
+            if (parts[i] > maxParts[i])
+            {
+                return FALSE;
+            }
+
+            ++pCurrent;
+        }
+
+        // Dots between the parts, and nothing after the last one.
+        if (*pCurrent != ((i + 1 < ARRAYSIZE(parts)) ? '.' : '\0'))
+        {
+            return FALSE;
+        }
+
+        ++pCurrent;
+    }
+
+    *pKey = MA_PICO_OFFSETS_KEY(parts[0], parts[1], parts[2], parts[3], architecture);
+    return TRUE;
+}
+
+extern "C"
+BOOLEAN
+PicoSppFindOffsets(
+    _In_ ULONG64 uKey,
+    _Out_ PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS* pPOffsets
+)
+{
+#if MA_PICO_OFFSETS_COUNT > 0
+    SIZE_T uLow = 0;
+    SIZE_T uHigh = ARRAYSIZE(MaPspPicoProviderRoutinesOffsets);
+
+    while (uLow < uHigh)
+    {
+        SIZE_T uMid = uLow + (uHigh - uLow) / 2;
+        ULONG64 uMidKey = MaPspPicoProviderRoutinesOffsets[uMid].Key;
+
+        if (uMidKey == uKey)
+        {
+            *pPOffsets =
+                (PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS)&MaPspPicoProviderRoutinesOffsets[uMid];
+            return TRUE;
+        }
+
+        if (uMidKey < uKey)
+        {
+            uLow = uMid + 1;
+        }
+        else
+        {
+            uHigh = uMid;
+        }
+    }
+#else
+    UNREFERENCED_PARAMETER(uKey);
+    UNREFERENCED_PARAMETER(pPOffsets);
+#endif
+
+    return FALSE;
+}
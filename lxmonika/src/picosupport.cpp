@@ -4,6 +4,7 @@
 #include <wdm.h>
 
 #include "module.h"
+#include "picooffsets_lookup.h"
 
 #include "AutoResource.h"
 #include "Logger.h"
@@ -14,6 +15,23 @@ static PS_PICO_ROUTINES PspPicoRoutines
     .Size = 0
 };
 
+static PICOSP_LOCATE_METHOD PspLocateMethod = PicoSpLocateMethodNone;
+static LONG64 PspLocateTicks = 0;
+
+// The OffsetCache subkey of the service key, holding results of earlier boots on the kernel
+// build identified by its KernelVersion and KernelCheckSum values.
+static HANDLE PspCacheKey = NULL;
+// Values loaded from PspCacheKey, 0 if they have not been saved.
+static struct {
+    ULONG LocateMethod;
+    ULONG ProviderRoutinesSize;
+    ULONG PicoRoutinesSize;
+    // Offsets.PspPicoProviderRoutines is saved by the driver itself. The other offsets are only
+    // saved by "monika offsets", which resolves them from the kernel symbols.
+    BOOLEAN HasOffsets;
+    MA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS Offsets;
+} PspCache;
+
 static
 VOID
 PicoSpStringUnicodeToAnsi(
@@ -35,26 +53,441 @@ PicoSpStringUnicodeToAnsi(
 
 extern "C"
 NTSTATUS
-PicoSppLocateProviderRoutines(
+PicoSppLoadCache(
+    _In_ PCUNICODE_STRING RegistryPath
+)
+{
+    NTSTATUS status;
+
+    HANDLE hdlNtKernel = NULL;
+    SIZE_T uNtKernelSize = 0;
+    status = MdlpFindModuleByName("ntoskrnl.exe", &hdlNtKernel, &uNtKernelSize);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    PCWSTR pVersion = NULL;
+    SIZE_T uVersionBytes = uNtKernelSize;
+    status = MdlpGetProductVersion(hdlNtKernel, &pVersion, &uVersionBytes);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    ULONG uCheckSum = 0;
+    status = MdlpGetImageCheckSum(hdlNtKernel, uNtKernelSize, &uCheckSum);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    OBJECT_ATTRIBUTES objectAttributes;
+    InitializeObjectAttributes(
+        &objectAttributes,
+        (PUNICODE_STRING)RegistryPath,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+    );
+
+    HANDLE hdlServiceKey = NULL;
+    status = ZwOpenKey(&hdlServiceKey, KEY_CREATE_SUB_KEY, &objectAttributes);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    AUTO_RESOURCE(hdlServiceKey, ZwClose);
+
+    UNICODE_STRING strCacheKey = RTL_CONSTANT_STRING(L"OffsetCache");
+    InitializeObjectAttributes(
+        &objectAttributes,
+        &strCacheKey,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        hdlServiceKey,
+        NULL
+    );
+
+    HANDLE hdlCacheKey = NULL;
+    ULONG ulDisposition = 0;
+    status = ZwCreateKey(&hdlCacheKey, KEY_READ | KEY_WRITE | DELETE, &objectAttributes, 0, NULL,
+        REG_OPTION_NON_VOLATILE, &ulDisposition);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    AUTO_RESOURCE(hdlCacheKey, ZwClose);
+
+    const auto QueryDword = [&](PCWSTR pName, PULONG pValue) -> BOOLEAN
+    {
+        UNICODE_STRING strName;
+        RtlInitUnicodeString(&strName, pName);
+
+        UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+        PKEY_VALUE_PARTIAL_INFORMATION pInfo = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+        ULONG ulLength = 0;
+
+        if (NT_SUCCESS(ZwQueryValueKey(hdlCacheKey, &strName, KeyValuePartialInformation,
+                pInfo, sizeof(buffer), &ulLength))
+            && pInfo->Type == REG_DWORD
+            && pInfo->DataLength == sizeof(ULONG))
+        {
+            *pValue = *(PULONG)pInfo->Data;
+            return TRUE;
+        }
+
+        return FALSE;
+    };
+
+    // Both strings include their terminator.
+    const auto MatchesVersion = [&]() -> BOOLEAN
+    {
+        UNICODE_STRING strName = RTL_CONSTANT_STRING(L"KernelVersion");
+
+        UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + 64 * sizeof(WCHAR)];
+        PKEY_VALUE_PARTIAL_INFORMATION pInfo = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+        ULONG ulLength = 0;
+
+        return NT_SUCCESS(ZwQueryValueKey(hdlCacheKey, &strName, KeyValuePartialInformation,
+                pInfo, sizeof(buffer), &ulLength))
+            && pInfo->Type == REG_SZ
+            && pInfo->DataLength == uVersionBytes + sizeof(WCHAR)
+            && memcmp(pInfo->Data, pVersion, pInfo->DataLength) == 0;
+    };
+
+    ULONG uCachedCheckSum = 0;
+
+    if (ulDisposition == REG_OPENED_EXISTING_KEY
+        && QueryDword(L"KernelCheckSum", &uCachedCheckSum)
+        && uCachedCheckSum == uCheckSum
+        && MatchesVersion())
+    {
+        QueryDword(L"LocateMethod", &PspCache.LocateMethod);
+        QueryDword(L"ProviderRoutinesSize", &PspCache.ProviderRoutinesSize);
+        QueryDword(L"PicoRoutinesSize", &PspCache.PicoRoutinesSize);
+
+        // Each offset is stored under the name of its symbol.
+#define PICO_SPP_WIDEN(s) L ## s
+#define PICO_SPP_QUERY_OFFSET(symbol)                                                           \
+        QueryDword(PICO_SPP_WIDEN(#symbol), &PspCache.Offsets.Offsets.symbol)
+
+        PICO_SPP_QUERY_OFFSET(PspPicoRegistrationDisabled);
+        PICO_SPP_QUERY_OFFSET(PspPicoProviderRoutines);
+        PICO_SPP_QUERY_OFFSET(PspCreatePicoProcess);
+        PICO_SPP_QUERY_OFFSET(PspCreatePicoThread);
+        PICO_SPP_QUERY_OFFSET(PspGetPicoProcessContext);
+        PICO_SPP_QUERY_OFFSET(PspGetPicoThreadContext);
+        PICO_SPP_QUERY_OFFSET(PspPicoGetContextThreadEx);
+        PICO_SPP_QUERY_OFFSET(PspPicoSetContextThreadEx);
+        PICO_SPP_QUERY_OFFSET(PspTerminateThreadByPointer);
+        PICO_SPP_QUERY_OFFSET(PsResumeThread);
+        PICO_SPP_QUERY_OFFSET(PspSetPicoThreadDescriptorBase);
+        PICO_SPP_QUERY_OFFSET(PsSuspendThread);
+        PICO_SPP_QUERY_OFFSET(PspTerminatePicoProcess);
+
+#undef PICO_SPP_QUERY_OFFSET
+#undef PICO_SPP_WIDEN
+
+        // The driver never saves the routine offsets, so any of them marks a symbol lookup.
+        PspCache.HasOffsets = PspCache.Offsets.Offsets.PspCreatePicoProcess != 0;
+
+        // The values are still sanity checked before use, this only rejects what cannot have
+        // been saved by us.
+        if (PspCache.LocateMethod != PicoSpLocateMethodOffsets
+            && PspCache.LocateMethod != PicoSpLocateMethodScan)
+        {
+            PspCache.Offsets.Offsets.PspPicoProviderRoutines = 0;
+        }
+
+        if (PspCache.ProviderRoutinesSize > sizeof(PS_PICO_PROVIDER_ROUTINES)
+            || PspCache.PicoRoutinesSize > sizeof(PS_PICO_ROUTINES))
+        {
+            PspCache.ProviderRoutinesSize = 0;
+            PspCache.PicoRoutinesSize = 0;
+        }
+
+        Logger::LogTrace("Loaded offset cache: PspPicoProviderRoutines=",
+            (PVOID)(ULONG_PTR)PspCache.Offsets.Offsets.PspPicoProviderRoutines,
+            " sizes=", PspCache.ProviderRoutinesSize, ", ", PspCache.PicoRoutinesSize);
+    }
+    else
+    {
+        if (ulDisposition == REG_OPENED_EXISTING_KEY)
+        {
+            // Saved for another kernel build. Start over, so that no stale value survives.
+            Logger::LogInfo("Discarding the offset cache of another kernel build.");
+
+            ZwDeleteKey(hdlCacheKey);
+            ZwClose(hdlCacheKey);
+            hdlCacheKey = NULL;
+
+            status = ZwCreateKey(&hdlCacheKey, KEY_READ | KEY_WRITE | DELETE, &objectAttributes,
+                0, NULL, REG_OPTION_NON_VOLATILE, &ulDisposition);
+
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+        }
+
+        UNICODE_STRING strName = RTL_CONSTANT_STRING(L"KernelVersion");
+        status = ZwSetValueKey(hdlCacheKey, &strName, 0, REG_SZ, (PVOID)pVersion,
+            (ULONG)(uVersionBytes + sizeof(WCHAR)));
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        strName = RTL_CONSTANT_STRING(L"KernelCheckSum");
+        status = ZwSetValueKey(hdlCacheKey, &strName, 0, REG_DWORD, &uCheckSum,
+            sizeof(uCheckSum));
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    PspCacheKey = hdlCacheKey;
+    hdlCacheKey = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+PicoSppCloseCache()
+{
+    if (PspCacheKey != NULL)
+    {
+        ZwClose(PspCacheKey);
+        PspCacheKey = NULL;
+    }
+}
+
+static
+VOID
+PicoSppSaveCacheValue(
+    _In_ PCWSTR pName,
+    _In_ ULONG uValue
+)
+{
+    if (PspCacheKey == NULL)
+    {
+        return;
+    }
+
+    UNICODE_STRING strName;
+    RtlInitUnicodeString(&strName, pName);
+
+    NTSTATUS status = ZwSetValueKey(PspCacheKey, &strName, 0, REG_DWORD, &uValue,
+        sizeof(uValue));
+
+    if (!NT_SUCCESS(status))
+    {
+        Logger::LogWarning("Failed to update the offset cache, status=", (PVOID)status);
+    }
+}
+
+// Do a size check first. This reduces the chance of wrong version handling code bootlooping
+// Windows.
+//
+// ExitThread is chosen because it is the member right after DispatchSystemCall.
+// DispatchSystemCall is absolutely necessary for any Pico provider to function.
+static
+BOOLEAN
+PicoSppCheckProviderRoutinesSize(
+    _In_ PPS_PICO_PROVIDER_ROUTINES pRoutines
+)
+{
+    return pRoutines->Size >= FIELD_OFFSET(PS_PICO_PROVIDER_ROUTINES, ExitThread)
+        && pRoutines->Size <= sizeof(PS_PICO_PROVIDER_ROUTINES) * 16;
+}
+
+// Checks that the routines point into lxcore and that the other members have sane values.
+static
+BOOLEAN
+PicoSppCheckProviderRoutinesLxCore(
+    _In_ PPS_PICO_PROVIDER_ROUTINES pTestRoutines,
+    _In_ PCHAR pLxCoreModuleStart,
+    _In_ PCHAR pLxCoreModuleEnd
+)
+{
+    const auto CheckLxCoreAddress = [&](PVOID ptr) -> bool
+    {
+        return pLxCoreModuleStart <= (PCHAR)ptr &&
+            (PCHAR)ptr < pLxCoreModuleEnd;
+    };
+
+    // Check routines
+    if (!CheckLxCoreAddress(pTestRoutines->DispatchSystemCall))
+    {
+        return FALSE;
+    }
+
+    if (!CheckLxCoreAddress(pTestRoutines->ExitThread))
+    {
+        return FALSE;
+    }
+
+    if (!CheckLxCoreAddress(pTestRoutines->ExitProcess))
+    {
+        return FALSE;
+    }
+
+    if (!CheckLxCoreAddress(pTestRoutines->DispatchException))
+    {
+        return FALSE;
+    }
+
+    if (!CheckLxCoreAddress(pTestRoutines->TerminateProcess))
+    {
+        return FALSE;
+    }
+
+    if (!CheckLxCoreAddress(pTestRoutines->WalkUserStack))
+    {
+        return FALSE;
+    }
+
+    // TODO: Is this supposed to be inside the driver?
+    if (!CheckLxCoreAddress((PVOID)pTestRoutines->ProtectedRanges))
+    {
+        return FALSE;
+    }
+
+    // This member is NULL in newer Windows versions
+    // (Tested on Windows 11 23H2)
+    if (pTestRoutines->GetAllocatedProcessImageName != NULL &&
+        !CheckLxCoreAddress(pTestRoutines->GetAllocatedProcessImageName))
+    {
+        return FALSE;
+    }
+
+    if ((pTestRoutines->OpenProcess & (~PROCESS_ALL_ACCESS)) != 0)
+    {
+        return FALSE;
+    }
+
+    if ((pTestRoutines->OpenThread & (~THREAD_ALL_ACCESS)) != 0)
+    {
+        return FALSE;
+    }
+
+    if (pTestRoutines->SubsystemInformationType != 1 /* SubsystemInformationTypeWSL */)
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Runs the tests of the method that originally found the cached routines again. Matching the
+// kernel version and checksum alone is not trusted enough to patch the structure.
+static
+BOOLEAN
+PicoSppLocateCachedProviderRoutines(
+    _In_ HANDLE hdlNtKernel,
+    _In_ SIZE_T uNtKernelSize,
     _Out_ PPS_PICO_PROVIDER_ROUTINES* pPpr
 )
 {
-    NTSTATUS status = STATUS_SUCCESS;
+    ULONG uOffset = PspCache.Offsets.Offsets.PspPicoProviderRoutines;
 
-    if (pPpr == NULL)
+    if (uOffset == 0 || uOffset + sizeof(PS_PICO_PROVIDER_ROUTINES) > uNtKernelSize)
     {
-        return STATUS_INVALID_PARAMETER;
+        return FALSE;
     }
 
-    // Method 0: Cached value
-    if (PspPicoProviderRoutines != NULL)
+    PPS_PICO_PROVIDER_ROUTINES pCachedRoutines = (PPS_PICO_PROVIDER_ROUTINES)
+        ((PCHAR)hdlNtKernel + uOffset);
+
+    Logger::LogTrace("Cached PspPicoProviderRoutines at ", pCachedRoutines);
+
+    if (PspCache.LocateMethod == PicoSpLocateMethodOffsets)
     {
-        *pPpr = PspPicoProviderRoutines;
+        if (!PicoSppCheckProviderRoutinesSize(pCachedRoutines))
+        {
+            return FALSE;
+        }
+    }
+    else
+    {
+        HANDLE hdlLxCore = NULL;
+        SIZE_T uLxCoreSize = 0;
+
+        if (!NT_SUCCESS(MdlpFindModuleByName("lxcore.sys", &hdlLxCore, &uLxCoreSize)))
+        {
+            return FALSE;
+        }
+
+        if (pCachedRoutines->Size > sizeof(PPS_PICO_PROVIDER_ROUTINES) * 16
+            || uOffset + pCachedRoutines->Size > uNtKernelSize)
+        {
+            return FALSE;
+        }
+
+        if (!PicoSppCheckProviderRoutinesLxCore(pCachedRoutines,
+            (PCHAR)hdlLxCore, (PCHAR)hdlLxCore + uLxCoreSize))
+        {
+            return FALSE;
+        }
+    }
+
+    *pPpr = pCachedRoutines;
+    return TRUE;
+}
+
+static
+VOID
+PicoSppSaveProviderRoutines(
+    _In_ HANDLE hdlNtKernel,
+    _In_ PPS_PICO_PROVIDER_ROUTINES pPpr,
+    _In_ PICOSP_LOCATE_METHOD method
+)
+{
+    PicoSppSaveCacheValue(L"LocateMethod", (ULONG)method);
+    PicoSppSaveCacheValue(L"PspPicoProviderRoutines",
+        (ULONG)((PCHAR)pPpr - (PCHAR)hdlNtKernel));
+}
+
+// Offsets resolved from the symbols of this exact kernel build take precedence over the
+// built-in table, which may not know the build yet.
+static
+NTSTATUS
+PicoSppGetKernelOffsets(
+    _In_ PCSTR pVersion,
+    _Out_ PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS* pPOffsets
+)
+{
+    if (PspCache.HasOffsets)
+    {
+        Logger::LogTrace("Using offsets resolved from the kernel symbols.");
+        *pPOffsets = &PspCache.Offsets;
         return STATUS_SUCCESS;
     }
 
-    // Method 1: Known offsets from the NT Kernel base.
-    // TODO: Method 1+: Fetch and read from symbol files.
+    return PicoSppGetOffsets(pVersion, NULL, pPOffsets);
+}
+
+static
+NTSTATUS
+PicoSppLocateProviderRoutinesUncached(
+    _Out_ PPS_PICO_PROVIDER_ROUTINES* pPpr,
+    _Out_ PICOSP_LOCATE_METHOD* pMethod
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // Method 1: Known offsets from the NT Kernel base, from symbol files or the built-in table.
     HANDLE hdlNtKernel = NULL;
     SIZE_T uNtKernelSize = 0;
     status = MdlpFindModuleByName("ntoskrnl.exe", &hdlNtKernel, &uNtKernelSize);
@@ -67,6 +500,18 @@ PicoSppLocateProviderRoutines(
         return status;
     }
 
+    // Method 0+: Saved by an earlier boot on the same kernel build.
+    if (PicoSppLocateCachedProviderRoutines(hdlNtKernel, uNtKernelSize, pPpr))
+    {
+        PspPicoProviderRoutines = *pPpr;
+        *pMethod = PicoSpLocateMethodCache;
+        return STATUS_SUCCESS;
+    }
+    else if (PspCache.Offsets.Offsets.PspPicoProviderRoutines != 0)
+    {
+        Logger::LogWarning("Disregarding cached offset that no longer passes the checks.");
+    }
+
     PCWSTR pVersionInfoStringUnicode;
     SIZE_T uVersionInfoStringBytes = uNtKernelSize;
     status = MdlpGetProductVersion(hdlNtKernel,
@@ -81,7 +526,7 @@ PicoSppLocateProviderRoutines(
         Logger::LogTrace("Detected Windows NT version ", pVersionInfoStringAnsi);
 
         PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS pOffsets = NULL;
-        status = PicoSppGetOffsets(pVersionInfoStringAnsi, NULL, &pOffsets);
+        status = PicoSppGetKernelOffsets(pVersionInfoStringAnsi, &pOffsets);
 
         if (NT_SUCCESS(status) && pOffsets->Offsets.PspPicoProviderRoutines != 0)
         {
@@ -91,19 +536,11 @@ PicoSppLocateProviderRoutines(
 
             Logger::LogTrace("PspPicoProviderRoutines found at ", pMaybeTheRightRoutines);
 
-            // Do a size check first. This reduces the chance of wrong version handling code
-            // bootlooping Windows.
-            //
             // It might be a good idea to check for the pointers in Lxss as well, however, this
             // would defeat the purpose of using known offsets: To support situations where
             // other drivers have patched the routines beforehand.
-            //
-            // ExitThread is chosen because it is the member right after DispatchSystemCall.
-            // DispatchSystemCall is absolutely necessary for any Pico provider to function.
 
-            if (pMaybeTheRightRoutines->Size <
-                FIELD_OFFSET(PS_PICO_PROVIDER_ROUTINES, ExitThread)
-                || pMaybeTheRightRoutines->Size > sizeof(PS_PICO_PROVIDER_ROUTINES) * 16)
+            if (!PicoSppCheckProviderRoutinesSize(pMaybeTheRightRoutines))
             {
                 Logger::LogWarning("Disregarding known offset due to size being suspicious: ",
                     pMaybeTheRightRoutines->Size);
@@ -111,6 +548,8 @@ PicoSppLocateProviderRoutines(
             else
             {
                 *pPpr = PspPicoProviderRoutines = pMaybeTheRightRoutines;
+                *pMethod = PicoSpLocateMethodOffsets;
+                PicoSppSaveProviderRoutines(hdlNtKernel, pMaybeTheRightRoutines, *pMethod);
                 return STATUS_SUCCESS;
             }
         }
@@ -154,89 +593,73 @@ PicoSppLocateProviderRoutines(
     PCHAR pLxCoreModuleStart = (PCHAR)hdlLxCore;
     PCHAR pLxCoreModuleEnd = pLxCoreModuleStart + uLxCoreSize;
 
-    const auto CheckLxCoreAddress = [&](PVOID ptr) -> bool
-    {
-        return pLxCoreModuleStart <= (PCHAR)ptr &&
-            (PCHAR)ptr < pLxCoreModuleEnd;
-    };
-
-    for (; pSearchStart < pSearchEnd; pSearchStart += alignof(PS_PICO_PROVIDER_ROUTINES))
-    {
-        PPS_PICO_PROVIDER_ROUTINES pTestRoutines = (PPS_PICO_PROVIDER_ROUTINES)pSearchStart;
+    // The routines from DispatchSystemCall to WalkUserStack must all point into lxcore. Rather
+    // than testing them again for every offset, each pointer-sized slot is tested once, and a
+    // run of that many consecutive matching slots marks the only offsets worth checking fully.
+    static_assert(alignof(PS_PICO_PROVIDER_ROUTINES) == sizeof(ULONG_PTR));
+    constexpr SIZE_T uRoutineSlots =
+        (FIELD_OFFSET(PS_PICO_PROVIDER_ROUTINES, WalkUserStack)
+            - FIELD_OFFSET(PS_PICO_PROVIDER_ROUTINES, DispatchSystemCall)) / sizeof(ULONG_PTR) + 1;
 
-        // Check size.
+    LONG64 iScanStart = KeQueryPerformanceCounter(NULL).QuadPart;
+    SIZE_T uCandidates = 0;
 
-        if (pTestRoutines->Size > sizeof(PPS_PICO_PROVIDER_ROUTINES) * 16)
-        {
-            // The struct may grow over time, but it is unlikely to grow that large.
-            continue;
-        }
+    const auto LogScanTime = [&]()
+    {
+        LARGE_INTEGER liFrequency;
+        LONG64 iTicks = KeQueryPerformanceCounter(&liFrequency).QuadPart - iScanStart;
 
-        if (pSearchStart + pTestRoutines->Size > pSearchEnd)
-        {
-            // Otherwise, we cannot read the rest of the structure.
-            continue;
-        }
+        Logger::LogInfo("Scanned ", uNtKernelDataSize, " bytes of ntoskrnl .data in ",
+            (ULONGLONG)(iTicks * 1000000 / liFrequency.QuadPart), "us, ", uCandidates,
+            " candidate(s).");
+    };
 
-        // Check routines
-        if (!CheckLxCoreAddress(pTestRoutines->DispatchSystemCall))
-        {
-            continue;
-        }
+    PULONG_PTR pSlotEnd = (PULONG_PTR)ALIGN_DOWN_POINTER_BY(pSearchEnd, sizeof(ULONG_PTR));
+    SIZE_T uRun = 0;
 
-        if (!CheckLxCoreAddress(pTestRoutines->ExitThread))
-        {
-            continue;
-        }
+    for (PULONG_PTR pSlot = (PULONG_PTR)pSearchStart; pSlot < pSlotEnd; ++pSlot)
+    {
+        // Unsigned, so that addresses below lxcore wrap around and fail too.
+        uRun = (*pSlot - (ULONG_PTR)pLxCoreModuleStart < uLxCoreSize) ? uRun + 1 : 0;
 
-        if (!CheckLxCoreAddress(pTestRoutines->ExitProcess))
+        if (uRun < uRoutineSlots)
         {
             continue;
         }
 
-        if (!CheckLxCoreAddress(pTestRoutines->DispatchException))
-        {
-            continue;
-        }
+        // The current slot is the WalkUserStack member of the candidate.
+        PPS_PICO_PROVIDER_ROUTINES pTestRoutines =
+            CONTAINING_RECORD(pSlot, PS_PICO_PROVIDER_ROUTINES, WalkUserStack);
 
-        if (!CheckLxCoreAddress(pTestRoutines->TerminateProcess))
+        if ((PCHAR)pTestRoutines < pSearchStart || (PCHAR)&pTestRoutines[1] > pSearchEnd)
         {
+            // Otherwise, we cannot read the whole structure.
             continue;
         }
 
-        if (!CheckLxCoreAddress(pTestRoutines->WalkUserStack))
-        {
-            continue;
-        }
+        ++uCandidates;
 
-        // TODO: Is this supposed to be inside the driver?
-        if (!CheckLxCoreAddress((PVOID)pTestRoutines->ProtectedRanges))
-        {
-            continue;
-        }
+        // Check size.
 
-        // This member is NULL in newer Windows versions
-        // (Tested on Windows 11 23H2)
-        if (pTestRoutines->GetAllocatedProcessImageName != NULL &&
-            !CheckLxCoreAddress(pTestRoutines->GetAllocatedProcessImageName))
+        if (pTestRoutines->Size > sizeof(PPS_PICO_PROVIDER_ROUTINES) * 16)
         {
+            // The struct may grow over time, but it is unlikely to grow that large.
             continue;
         }
 
-        if ((pTestRoutines->OpenProcess & (~PROCESS_ALL_ACCESS)) != 0)
+        if ((PCHAR)pTestRoutines + pTestRoutines->Size > pSearchEnd)
         {
+            // Otherwise, we cannot read the rest of the structure.
             continue;
         }
 
-        if ((pTestRoutines->OpenThread & (~THREAD_ALL_ACCESS)) != 0)
+        if (!PicoSppCheckProviderRoutinesLxCore(pTestRoutines,
+            pLxCoreModuleStart, pLxCoreModuleEnd))
         {
             continue;
         }
 
-        if (pTestRoutines->SubsystemInformationType != 1 /* SubsystemInformationTypeWSL */)
-        {
-            continue;
-        }
+        LogScanTime();
 
         // The current routines match the criteria. Store it.
         PspPicoProviderRoutines = pTestRoutines;
@@ -244,16 +667,61 @@ PicoSppLocateProviderRoutines(
         Logger::LogTrace("PspPicoProviderRoutines found at ", pTestRoutines);
 
         *pPpr = pTestRoutines;
+        *pMethod = PicoSpLocateMethodScan;
+        PicoSppSaveProviderRoutines(hdlNtKernel, pTestRoutines, *pMethod);
 
         return STATUS_SUCCESS;
     }
 
+    LogScanTime();
+
     Logger::LogError("Cannot find Pico provider routines.");
     Logger::LogError("Make sure WSL is enabled and LXCORE.SYS is loaded.");
 
     return STATUS_NOT_FOUND;
 }
 
+extern "C"
+NTSTATUS
+PicoSppLocateProviderRoutines(
+    _Out_ PPS_PICO_PROVIDER_ROUTINES* pPpr
+)
+{
+    if (pPpr == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Method 0: Cached value
+    if (PspPicoProviderRoutines != NULL)
+    {
+        *pPpr = PspPicoProviderRoutines;
+        return STATUS_SUCCESS;
+    }
+
+    LONG64 iStart = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    PICOSP_LOCATE_METHOD method = PicoSpLocateMethodNone;
+    NTSTATUS status = PicoSppLocateProviderRoutinesUncached(pPpr, &method);
+
+    // Failed attempts count too, they are part of the time spent before the lookup succeeds.
+    PspLocateTicks += KeQueryPerformanceCounter(NULL).QuadPart - iStart;
+    PspLocateMethod = method;
+
+    return status;
+}
+
+extern "C"
+VOID
+PicoSppQueryLocateProfile(
+    _Out_ PICOSP_LOCATE_METHOD* pMethod,
+    _Out_ PLONG64 pTicks
+)
+{
+    *pMethod = PspLocateMethod;
+    *pTicks = PspLocateTicks;
+}
+
 extern "C"
 NTSTATUS
 PicoSppLocateRoutines(
@@ -327,7 +795,7 @@ PicoSppLocateRoutines(
         Logger::LogTrace("Detected Windows NT version ", pVersionInfoStringAnsi);
 
         PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS pOffsets = NULL;
-        status = PicoSppGetOffsets(pVersionInfoStringAnsi, NULL, &pOffsets);
+        status = PicoSppGetKernelOffsets(pVersionInfoStringAnsi, &pOffsets);
 
         if (!NT_SUCCESS(status))
         {
@@ -408,29 +876,17 @@ PicoSppGetOffsets(
     Logger::LogTrace("Finding offsets for Windows version ", pVersion,
         " of architecture ", pArchitecture);
 
-    for (SIZE_T i = 0; i < ARRAYSIZE(MaPspPicoProviderRoutinesOffsets); ++i)
+    ULONG64 uKey = 0;
+    if (!PicoSppMakeOffsetsKey(pVersion, pArchitecture, &uKey))
     {
-        PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS pCurrentOffsets =
-            (PMA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS)&MaPspPicoProviderRoutinesOffsets[i];
-
-        if (pCurrentOffsets->Version == NULL)
-        {
-            Logger::LogTrace("Wait, why is the version NULL? (i=", i, ")");
-            continue;
-        }
-
-        if (pCurrentOffsets->Architecture == NULL)
-        {
-            Logger::LogTrace("Wait, why is the architecture NULL? (i=", i, ")");
-            continue;
-        }
+        Logger::LogWarning("Cannot parse Windows version ", pVersion,
+            " of architecture ", pArchitecture);
+        return STATUS_INVALID_PARAMETER;
+    }
 
-        if (strcmp(pVersion, pCurrentOffsets->Version) == 0
-            && strcmp(pArchitecture, pCurrentOffsets->Architecture) == 0)
-        {
-            *pPOffsets = pCurrentOffsets;
-            return STATUS_SUCCESS;
-        }
+    if (PicoSppFindOffsets(uKey, pPOffsets))
+    {
+        return STATUS_SUCCESS;
     }
 
     Logger::LogInfo("Failed to find suitable offsets for this Windows version.");
@@ -516,6 +972,60 @@ PicoSppDetermineAbiStatus(
         // Expected to reach here.
     }
 
+    // Sizes saved by an earlier boot on the same kernel build. The system rejects sizes that it
+    // does not expect, so a single registration attempt is enough to confirm them. Only builds
+    // with size checks are ever saved.
+    if (PspCache.ProviderRoutinesSize != 0 && PspCache.PicoRoutinesSize != 0)
+    {
+        psTestProviderRoutines.Size = PspCache.ProviderRoutinesSize;
+        psTestProviderRoutines.OpenProcess = PROCESS_ALL_ACCESS;
+        psTestProviderRoutines.OpenThread = THREAD_ALL_ACCESS;
+        psTestRoutines.Size = PspCache.PicoRoutinesSize;
+
+        status = PsRegisterPicoProvider(&psTestProviderRoutines, &psTestRoutines);
+
+        if (status != STATUS_INFO_LENGTH_MISMATCH)
+        {
+            *pProviderRoutinesSize = PspCache.ProviderRoutinesSize;
+            *pPicoRoutinesSize = PspCache.PicoRoutinesSize;
+            *pHasSizeChecks = TRUE;
+
+            Logger::LogTrace("Using cached sizes: ", *pProviderRoutinesSize, ", ",
+                *pPicoRoutinesSize);
+            Logger::LogTrace("The return status is: ", (PVOID)status);
+
+            if (!NT_SUCCESS(status))
+            {
+                if (status != STATUS_TOO_LATE)
+                {
+                    Logger::LogWarning("Got an unexpected error code: ", (PVOID)status);
+                }
+                *pTooLate = TRUE;
+            }
+            else
+            {
+                *pTooLate = FALSE;
+            }
+
+            return PicoSppDetermineAbiVersion(
+                *pProviderRoutinesSize,
+                *pPicoRoutinesSize,
+                pAbiVersion
+            );
+        }
+
+        Logger::LogWarning("Disregarding cached Pico structure sizes.");
+
+        psTestProviderRoutines = PS_PICO_PROVIDER_ROUTINES
+        {
+            .Size = 0
+        };
+        psTestRoutines = PS_PICO_ROUTINES
+        {
+            .Size = 0
+        };
+    }
+
     status = PsRegisterPicoProvider(&psTestProviderRoutines, &psTestRoutines);
 
     if (NT_SUCCESS(status))
@@ -542,11 +1052,9 @@ PicoSppDetermineAbiStatus(
             return status;
         }
 
-        BOOLEAN found = FALSE;
-
-        for (SIZE_T szTestSize = 0;
-            szTestSize <= sizeof(PS_PICO_PROVIDER_ROUTINES);
-            szTestSize += sizeof(PVOID))
+        // Sizes smaller than the real one make the system read into the uncommitted page, all
+        // others are accepted. That is monotonic, so binary search for the smallest accepted one.
+        const auto ProbeProviderRoutinesSize = [&](SIZE_T szTestSize) -> BOOLEAN
         {
             PVOID pStartAddress = (PCHAR)pTestPages + szTestPagesWritableSize - szTestSize;
 
@@ -563,17 +1071,44 @@ PicoSppDetermineAbiStatus(
             __except (EXCEPTION_EXECUTE_HANDLER)
             {
                 // szTestSize is too small. The system would try to read into uncommitted memory.
-                continue;
+                return FALSE;
             }
 
-            *pProviderRoutinesSize = szTestSize;
-
             if (!NT_SUCCESS(status))
             {
                 Logger::LogWarning("Unexpected error code: ", (PVOID)status);
             }
 
-            break;
+            return TRUE;
+        };
+
+        // In pointers. Sizes below uLow are too small, uHigh is accepted or one past the largest
+        // size that we can test.
+        SIZE_T uLow = 0;
+        SIZE_T uHigh = sizeof(PS_PICO_PROVIDER_ROUTINES) / sizeof(PVOID) + 1;
+
+        while (uLow < uHigh)
+        {
+            SIZE_T uMiddle = uLow + (uHigh - uLow) / 2;
+
+            if (ProbeProviderRoutinesSize(uMiddle * sizeof(PVOID)))
+            {
+                uHigh = uMiddle;
+            }
+            else
+            {
+                uLow = uMiddle + 1;
+            }
+        }
+
+        // The last probe may have been a rejected one, so register once more at the right size
+        // to get the routines filled in.
+        BOOLEAN found = uLow * sizeof(PVOID) <= sizeof(PS_PICO_PROVIDER_ROUTINES)
+            && ProbeProviderRoutinesSize(uLow * sizeof(PVOID));
+
+        if (found)
+        {
+            *pProviderRoutinesSize = uLow * sizeof(PVOID);
         }
 
         if (!found)
@@ -603,12 +1138,10 @@ PicoSppDetermineAbiStatus(
         // The size checks are done. Exploit that to determine the sizes.
         *pHasSizeChecks = TRUE;
 
-        BOOLEAN found = FALSE;
-
-        // Decrease the first struct size until the system starts to read the second struct.
-        for (SIZE_T szTestSize = sizeof(PS_PICO_PROVIDER_ROUTINES);
-            szTestSize > 0;
-            szTestSize -= sizeof(PVOID))
+        // The system only accepts the exact size, and reads the second struct once it does. Each
+        // probe thus only tells whether one size is right, so try the sizes of the known ABI
+        // versions first, newest first. The walk covers the sizes of builds not known yet.
+        const auto ProbeProviderRoutinesSize = [&](SIZE_T szTestSize) -> BOOLEAN
         {
             __try
             {
@@ -621,9 +1154,38 @@ PicoSppDetermineAbiStatus(
             __except (EXCEPTION_EXECUTE_HANDLER)
             {
                 // Access violation occurred, we have the correct size.
+                return TRUE;
+            }
+
+            return FALSE;
+        };
+
+        const SIZE_T szKnownProviderRoutinesSizes[] =
+        {
+            sizeof(PS_PICO_PROVIDER_ROUTINES),
+            FIELD_OFFSET(PS_PICO_PROVIDER_ROUTINES, OpenProcess)
+        };
+
+        BOOLEAN found = FALSE;
+
+        for (SIZE_T i = 0; !found && i < ARRAYSIZE(szKnownProviderRoutinesSizes); ++i)
+        {
+            if (ProbeProviderRoutinesSize(szKnownProviderRoutinesSizes[i]))
+            {
+                *pProviderRoutinesSize = szKnownProviderRoutinesSizes[i];
+                found = TRUE;
+            }
+        }
+
+        // Decrease the first struct size until the system starts to read the second struct.
+        for (SIZE_T szTestSize = sizeof(PS_PICO_PROVIDER_ROUTINES);
+            !found && szTestSize > 0;
+            szTestSize -= sizeof(PVOID))
+        {
+            if (ProbeProviderRoutinesSize(szTestSize))
+            {
                 *pProviderRoutinesSize = szTestSize;
                 found = TRUE;
-                break;
             }
         }
 
@@ -686,6 +1248,9 @@ PicoSppDetermineAbiStatus(
             return STATUS_INFO_LENGTH_MISMATCH;
         }
 
+        PicoSppSaveCacheValue(L"ProviderRoutinesSize", (ULONG)*pProviderRoutinesSize);
+        PicoSppSaveCacheValue(L"PicoRoutinesSize", (ULONG)*pPicoRoutinesSize);
+
         return PicoSppDetermineAbiVersion(
             *pProviderRoutinesSize,
             *pPicoRoutinesSize,
@@ -2,6 +2,7 @@
 
 #include <ntifs.h>
 #include <ntstrsafe.h>
+#include <stdlib.h>
 
 #include "condrv.h"
 #include "lxerrno.h"
@@ -9,12 +10,98 @@
 #include "module.h"
 #include "monika.h"
 #include "os.h"
+#include "picosupport.h"
 
 #include "AutoResource.h"
 #include "Locker.h"
 #include "Logger.h"
 #include "PoolAllocator.h"
 
+// Trace records are handed to user mode as is.
+static_assert(sizeof(RL_TRACE_RECORD) == sizeof(MA_TRACE_RECORD));
+static_assert(FIELD_OFFSET(RL_TRACE_RECORD, Result) == FIELD_OFFSET(MA_TRACE_RECORD, Result));
+static_assert(FIELD_OFFSET(RL_TRACE_RECORD, Processor)
+    == FIELD_OFFSET(MA_TRACE_RECORD, Processor));
+static_assert((int)RlTraceEventMaxCount == (int)MaTraceEventMaxCount);
+static_assert(RL_TRACE_FILTER_NUMBERS_MAX == MA_TRACE_FILTER_NUMBERS_MAX);
+static_assert(RL_LATENCY_BUCKETS == MA_LATENCY_BUCKETS);
+
+// Profile samples are handed to user mode as is.
+static_assert(sizeof(RL_PROFILE_SAMPLE) == sizeof(MA_PROFILE_SAMPLE));
+static_assert(FIELD_OFFSET(RL_PROFILE_SAMPLE, Frames) == FIELD_OFFSET(MA_PROFILE_SAMPLE, Frames));
+static_assert(RL_PROFILE_FRAMES_MAX == MA_PROFILE_FRAMES_MAX);
+static_assert(RL_PROFILE_PROCESSES_MAX == MA_PROFILE_PROCESSES_MAX);
+static_assert(RL_PROFILE_FLAG_USER_STACKS == MA_PROFILE_FLAG_USER_STACKS);
+
+// Log filters are copied as is.
+static_assert(sizeof(RL_LOG_FILTER_RULE) == sizeof(LogFilter));
+static_assert(RL_LOG_FILTER_MAX == LOGGER_FILTER_MAX);
+static_assert((int)RlLogLevelNone == (int)LogLevel::None);
+
+static_assert((int)RlBootPhaseMaxCount == (int)MaBootPhaseMaxCount);
+static_assert((int)RlLocateMethodCache == (int)PicoSpLocateMethodCache);
+
+static_assert((int)RL_PROVIDER_MAX == (int)MA_PICO_PROVIDER_REPORTED_MAX);
+static_assert(RL_PROVIDER_NAME_SIZE == MA_NAME_MAX + 1);
+
+static_assert(RL_EVENT_SUBSCRIBERS_MAX == MA_EVENT_SUBSCRIBERS_MAX);
+static_assert(RL_EVENT_PROCESS_SUBSCRIBERS_MAX == MA_EVENT_PROCESS_SUBSCRIBERS_MAX);
+
+// Event rings are mapped into the subscriber as is.
+static_assert(sizeof(RL_EVENT_RECORD) == sizeof(MA_EVENT_RECORD));
+static_assert(FIELD_OFFSET(RL_EVENT_RECORD, Provider) == FIELD_OFFSET(MA_EVENT_RECORD, Provider));
+static_assert(FIELD_OFFSET(RL_EVENT_RING, Records) == FIELD_OFFSET(MA_EVENT_RING, Records));
+static_assert(RL_EVENT_RING_MAX == MA_EVENT_RING_MAX);
+
+// The counters page is mapped as is.
+static_assert(sizeof(RL_COUNTERS_PAGE) == sizeof(MA_COUNTERS_PAGE));
+static_assert(FIELD_OFFSET(RL_COUNTERS_PAGE, Events) == FIELD_OFFSET(MA_COUNTERS_PAGE, Events));
+static_assert(RL_INSTRUMENT_TRACE == MA_INSTRUMENT_TRACE);
+static_assert(RL_INSTRUMENT_STATISTICS == MA_INSTRUMENT_STATISTICS);
+
+// Process information is copied as is.
+static_assert(sizeof(RL_PROCESS_INFORMATION) == sizeof(MA_PROCESS_INFORMATION));
+static_assert(FIELD_OFFSET(RL_PROCESS_INFORMATION, Exceptions)
+    == FIELD_OFFSET(MA_PROCESS_INFORMATION, Exceptions));
+
+// Session accounting is copied as is.
+static_assert(sizeof(RL_SESSION_STATISTICS) == sizeof(MA_SESSION_INFORMATION));
+static_assert(FIELD_OFFSET(RL_SESSION_STATISTICS, UserTime)
+    == FIELD_OFFSET(MA_SESSION_INFORMATION, UserTime));
+static_assert(RL_LIMIT_CPU_RATE == MA_LIMIT_CPU_RATE);
+static_assert(RL_LIMIT_COMMIT == MA_LIMIT_COMMIT);
+static_assert(RL_LIMIT_WORKING_SET == MA_LIMIT_WORKING_SET);
+static_assert(RL_LIMIT_PROCESS_COUNT == MA_LIMIT_PROCESS_COUNT);
+
+// Pool accounting is copied as is.
+static_assert(sizeof(RL_POOL_STATISTICS) == sizeof(MA_POOL_STATISTICS));
+static_assert(FIELD_OFFSET(RL_POOL_STATISTICS, Allocations)
+    == FIELD_OFFSET(MA_POOL_STATISTICS, Allocations));
+static_assert(RL_POOL_TAG_MAX == MA_POOL_TAGS_MAX);
+
+// Session attribute versions are told apart by their size.
+static_assert(sizeof(RL_PICO_SESSION_ATTRIBUTES) != sizeof(RL_PICO_SESSION_ATTRIBUTES_V2));
+static_assert(sizeof(RL_PICO_SESSION_ATTRIBUTES) != sizeof(RL_PICO_SESSION_ATTRIBUTES_V3));
+static_assert(sizeof(RL_PICO_SESSION_ATTRIBUTES_V2) != sizeof(RL_PICO_SESSION_ATTRIBUTES_V3));
+static_assert(sizeof(RL_PICO_SESSION_ATTRIBUTES) != sizeof(RL_PICO_SESSION_ATTRIBUTES_V4));
+static_assert(sizeof(RL_PICO_SESSION_ATTRIBUTES_V2) != sizeof(RL_PICO_SESSION_ATTRIBUTES_V4));
+static_assert(sizeof(RL_PICO_SESSION_ATTRIBUTES_V3) != sizeof(RL_PICO_SESSION_ATTRIBUTES_V4));
+static_assert(RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET != sizeof(RL_PICO_SESSION_ATTRIBUTES_V2)
+    && RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET != sizeof(RL_PICO_SESSION_ATTRIBUTES_V3)
+    && RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET != sizeof(RL_PICO_SESSION_ATTRIBUTES_V4));
+// Versions 3 and 4 are read as version 2, followed by their own fields.
+static_assert(FIELD_OFFSET(RL_PICO_SESSION_ATTRIBUTES_V3, Data)
+    == FIELD_OFFSET(RL_PICO_SESSION_ATTRIBUTES_V2, Data));
+static_assert(FIELD_OFFSET(RL_PICO_SESSION_ATTRIBUTES_V4, Reserved)
+    == FIELD_OFFSET(RL_PICO_SESSION_ATTRIBUTES_V3, Reserved));
+
+// Placements are passed on as is.
+static_assert(sizeof(RL_PICO_SESSION_PLACEMENT) == sizeof(MA_PICO_SESSION_PLACEMENT));
+static_assert(FIELD_OFFSET(RL_PICO_SESSION_PLACEMENT, Affinity)
+    == FIELD_OFFSET(MA_PICO_SESSION_PLACEMENT, Affinity));
+static_assert(RL_PLACEMENT_AFFINITY == MA_PLACEMENT_AFFINITY);
+static_assert(RL_PLACEMENT_PREFERRED_NODE == MA_PLACEMENT_PREFERRED_NODE);
+
 //
 // Utility forward declarations
 //
@@ -25,9 +112,116 @@ NTSTATUS
         _Inout_ PRL_FILE pFile
     );
 
+static
+VOID
+    RlFormatStaticInformation();
+
+static
+NTSTATUS
+    RlStartSession(
+        _In_ PRL_PICO_SESSION_ATTRIBUTES pUserAttributes,
+        _In_opt_ PMA_PICO_SESSION_COMPLETION pCompletion,
+        _In_opt_ PVOID pCompletionContext
+    );
+
+static
+NTSTATUS
+    RlStartPackedSession(
+        _In_ PRL_PICO_SESSION_ATTRIBUTES_V2 pUserAttributes,
+        _In_ SIZE_T uSize,
+        _In_opt_ PMA_PICO_SESSION_COMPLETION pCompletion,
+        _In_opt_ PVOID pCompletionContext
+    );
+
+static
+NTSTATUS
+    RlLaunchSession(
+        _In_ SIZE_T uProviderIndex,
+        _Inout_ PMA_PICO_SESSION_ATTRIBUTES pAttributes,
+        _In_opt_ PMA_PICO_SESSION_COMPLETION pCompletion,
+        _In_opt_ PVOID pCompletionContext,
+        _Out_opt_ PHANDLE pUserProcessHandle
+    );
+
+static
+VOID
+    RlReturnSessionProcess(
+        _In_opt_ PEPROCESS pProcess,
+        _Out_opt_ PHANDLE pUserProcessHandle
+    );
+
+static
+NTSTATUS
+    RlOpenSessionDirectory(
+        _In_ PUNICODE_STRING pPath,
+        _Out_ PHANDLE pHandle
+    );
+
+static
+NTSTATUS
+    RlOpenSessionConsole(
+        _Out_ PHANDLE pHostProcess,
+        _Out_ PHANDLE pConsole,
+        _Out_ PHANDLE pInput,
+        _Out_ PHANDLE pOutput
+    );
+
+static
+NTSTATUS
+    RlRunSelfBenchmark(
+        _Inout_ PRL_SELF_BENCHMARK pBenchmark
+    );
+
 NTSTATUS
     RlEscape();
 
+//
+// Static information
+//
+
+// Build fields of the reality file, formatted once by RlpInitializeDevices.
+static CHAR RlStaticInformation[512];
+static SIZE_T RlStaticInformationLength = 0;
+
+//
+// Session strings
+//
+
+// Sanitized copies of strings passed to the session ioctls.
+// Their memory belongs to the arena of the request, so a session costs a pool allocation or two
+// instead of one per string.
+#define RL_SESSION_ARENA_CHUNK_SIZE (PAGE_SIZE - MEMORY_ALLOCATION_ALIGNMENT)
+
+struct _RL_UNICODE_STRING_LIST
+{
+    PUNICODE_STRING Strings = NULL;
+    SIZE_T Length = 0;
+};
+
+static
+NTSTATUS
+    RlCopySessionString(
+        _Inout_ PoolAllocator& arena,
+        _Out_ UNICODE_STRING& dstString,
+        _In_ PUNICODE_STRING src
+    );
+
+static
+NTSTATUS
+    RlCopySessionStringList(
+        _Inout_ PoolAllocator& arena,
+        _Inout_ _RL_UNICODE_STRING_LIST& dstStringList,
+        _In_reads_(srcCount) PUNICODE_STRING src,
+        _In_ SIZE_T srcCount
+    );
+
+static
+NTSTATUS
+    RlCopyProviderName(
+        _Out_writes_(RL_PROVIDER_NAME_SIZE) PWSTR dst,
+        _In_ PUNICODE_STRING src
+    );
+
 //
 // Lifetime functions
 //
@@ -40,6 +234,8 @@ RlpInitializeDevices(
 {
     NTSTATUS status;
 
+    RlFormatStaticInformation();
+
     status = RlpInitializeWin32Device(DriverObject);
 
     if (!NT_SUCCESS(status))
@@ -88,6 +284,8 @@ RlpFileOpen(
 
     pFile->Length = 0;
     pFile->Offset = 0;
+    pFile->EventSubscription = NULL;
+    pFile->CountersViews = 0;
     pFile->Data[0] = '\0';
 
     MA_RETURN_IF_FAIL(RlFileUpdateInformation(pFile));
@@ -95,6 +293,25 @@ RlpFileOpen(
     return STATUS_SUCCESS;
 }
 
+extern "C"
+VOID
+RlpFileClose(
+    _Inout_ PRL_FILE pFile
+)
+{
+    if (pFile->EventSubscription != NULL)
+    {
+        MapUnsubscribeEvents(pFile->EventSubscription);
+        pFile->EventSubscription = NULL;
+    }
+
+    if (pFile->CountersViews != 0)
+    {
+        MapReleaseCountersPage((SIZE_T)pFile->CountersViews);
+        pFile->CountersViews = 0;
+    }
+}
+
 extern "C"
 NTSTATUS
 RlpFileRead(
@@ -115,8 +332,9 @@ RlpFileRead(
         *pBytesTransferred = 0;
     }
 
-    MA_RETURN_IF_FAIL(RlFileUpdateInformation(pFile));
-
+    // The snapshot is only rebuilt by RlpFileOpen and rewinding RlpFileSeek, which rebuilds it
+    // in place with the lock held. Holding it here too keeps reads from seeing parts of both
+    // snapshots, and concurrent reads from moving the offset under each other.
     ExAcquireFastMutex(&pFile->Lock);
 
     __try
@@ -232,26 +450,95 @@ RlpFileWrite(
     return STATUS_SUCCESS;
 }
 
+// The smallest buffer each ioctl can work with. Larger versions of the same ioctl are checked
+// against the actual length by their handlers.
+static
+SIZE_T
+RlpFileIoctlMinimumLength(
+    _In_ ULONG ulCode
+)
+{
+    switch (ulCode)
+    {
+    case RlIoctlPicoStartSession:
+        return sizeof(SIZE_T);
+    case RlIoctlPicoStartSessionBatch:
+        return sizeof(RL_PICO_SESSION_BATCH);
+    case RlIoctlTraceControl:
+        return sizeof(RL_TRACE_CONTROL);
+    case RlIoctlTraceFilter:
+        return sizeof(RL_TRACE_FILTER);
+    case RlIoctlTraceRead:
+        return sizeof(RL_TRACE_READ);
+    case RlIoctlStatisticsControl:
+        return sizeof(RL_STATISTICS_CONTROL);
+    case RlIoctlStatisticsQuery:
+        return sizeof(RL_STATISTICS_QUERY);
+    case RlIoctlLogRead:
+        return sizeof(RL_LOG_READ);
+    case RlIoctlLogFilter:
+        return sizeof(RL_LOG_FILTER);
+    case RlIoctlBootProfile:
+        return sizeof(RL_BOOT_PROFILE);
+    case RlIoctlQueryStatistics:
+        return RL_DRIVER_STATISTICS_V1_SIZE;
+    case RlIoctlEventSubscribe:
+        return sizeof(RL_EVENT_SUBSCRIBE);
+    case RlIoctlCountersMap:
+        return sizeof(RL_COUNTERS_MAP);
+    case RlIoctlProcessQuery:
+        return sizeof(RL_PROCESS_QUERY);
+    case RlIoctlSelfBenchmark:
+        return sizeof(RL_SELF_BENCHMARK);
+    case RlIoctlProfileControl:
+        return sizeof(RL_PROFILE_CONTROL);
+    case RlIoctlProfileRead:
+        return sizeof(RL_PROFILE_READ);
+    default:
+        return 0;
+    }
+}
+
 extern "C"
 NTSTATUS
 RlpFileIoctl(
     _Inout_ PRL_FILE pFile,
     _In_ ULONG ulCode,
-    _Inout_ PVOID pData
+    _Inout_updates_bytes_(szLength) PVOID pData,
+    _In_ SIZE_T szLength
 )
 {
-    UNREFERENCED_PARAMETER(pFile);
+    // The structures below only ever grow, and the Size they carry is chosen by the caller.
+    // Nothing past szLength may be touched, it may well be the end of a pool or stack buffer.
+    if (szLength < RlpFileIoctlMinimumLength(ulCode))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
     switch (ulCode)
     {
     case RlIoctlPicoStartSession:
     {
-        PRL_PICO_SESSION_ATTRIBUTES pUserAttributes = (PRL_PICO_SESSION_ATTRIBUTES)pData;
+        __try
+        {
+            if (((PRL_PICO_SESSION_ATTRIBUTES)pData)->Size > szLength)
+            {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
 
-        OBJECT_ATTRIBUTES objectAttributes;
-        IO_STATUS_BLOCK ioStatus;
+        return RlStartSession((PRL_PICO_SESSION_ATTRIBUTES)pData, NULL, NULL);
+    }
+    break;
+    case RlIoctlPicoStartSessionBatch:
+    {
+        PRL_PICO_SESSION_BATCH pUserBatch = (PRL_PICO_SESSION_BATCH)pData;
 
-        // Declare handles and their cleaners.
+        // These handles are shared by all sessions of the batch.
 
         HANDLE hdlHostProcess = NULL;
         HANDLE hdlConsole = NULL;
@@ -267,428 +554,2441 @@ RlpFileIoctl(
         AUTO_RESOURCE(hdlRootDirectory, ZwClose);
         AUTO_RESOURCE(hdlCurrentWorkingDirectory, ZwClose);
 
-        // Declare strings and their cleaners.
-
-        UNICODE_STRING strRootDirectory = { 0 };
-        UNICODE_STRING strCurrentWorkingDirectory = { 0 };
-
-        // Make some pointers, since AUTO_RESOURCE only works with pointers.
-        PUNICODE_STRING pStrRootDirectory = &strRootDirectory;
-        PUNICODE_STRING pStrCurrentWorkingDirectory = &strCurrentWorkingDirectory;
+        SIZE_T uProviderIndex;
+        SIZE_T uCount;
+        PRL_PICO_SESSION_BATCH_ENTRY pUserEntries;
+        PLONG pUserStatuses;
 
-        static constexpr auto FreeString = [](auto pStr)
+        __try
         {
-            if (pStr->Buffer != NULL)
+            if (pUserBatch->Size != sizeof(RL_PICO_SESSION_BATCH))
             {
-                ExFreePoolWithTag(pStr->Buffer, MA_REALITY_TAG);
+                return STATUS_INFO_LENGTH_MISMATCH;
             }
-        };
-        AUTO_RESOURCE(pStrRootDirectory, FreeString);
-        AUTO_RESOURCE(pStrCurrentWorkingDirectory, FreeString);
 
-        struct _MA_UNICODE_STRING_LIST
-        {
-            PUNICODE_STRING Strings = NULL;
-            SIZE_T Length = 0;
+            pUserBatch->Started = 0;
+
+            uCount = pUserBatch->Count;
+            pUserEntries = pUserBatch->Entries;
+            pUserStatuses = pUserBatch->Statuses;
 
-            ~_MA_UNICODE_STRING_LIST()
+            if (uCount > RL_PICO_SESSION_BATCH_MAX)
             {
-                if (Strings != NULL)
-                {
-                    for (SIZE_T i = Length - 1; i != (SIZE_T)-1; --i)
-                    {
-                        FreeString(&Strings[i]);
-                    }
-                    ExFreePoolWithTag(Strings, MA_REALITY_TAG);
-                }
+                return STATUS_INVALID_PARAMETER;
             }
-        } strListProviderArgs, strListArgs, strListEnvironment;
-
-        SIZE_T uProviderIndex;
 
-        __try
-        {
-            if (pUserAttributes->Size != sizeof(RL_PICO_SESSION_ATTRIBUTES))
+            if (ExGetPreviousMode() != KernelMode)
             {
-                return STATUS_INFO_LENGTH_MISMATCH;
+                ProbeForRead(pUserEntries, uCount * sizeof(RL_PICO_SESSION_BATCH_ENTRY),
+                    TYPE_ALIGNMENT(RL_PICO_SESSION_BATCH_ENTRY));
+                ProbeForWrite(pUserStatuses, uCount * sizeof(LONG), sizeof(LONG));
             }
 
-            if (pUserAttributes->ProviderIndex < MaPicoProviderMaxCount)
+            if (pUserBatch->ProviderIndex < MaPicoProviderMaxCount)
             {
-                uProviderIndex = pUserAttributes->ProviderIndex;
+                uProviderIndex = pUserBatch->ProviderIndex;
             }
             else
             {
-                MA_RETURN_IF_FAIL(MaFindPicoProvider(
-                    pUserAttributes->ProviderName->Buffer,
-                    &uProviderIndex)
-                );
+                WCHAR providerName[RL_PROVIDER_NAME_SIZE];
+                MA_RETURN_IF_FAIL(RlCopyProviderName(providerName, pUserBatch->ProviderName));
+                MA_RETURN_IF_FAIL(MaFindPicoProvider(providerName, &uProviderIndex));
             }
 
-            // Convert these paths into handles
-
-            InitializeObjectAttributes(
-                &objectAttributes,
-                pUserAttributes->RootDirectory,
-                OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
-                NULL,
-                NULL
-            );
+            MA_RETURN_IF_FAIL(RlOpenSessionDirectory(pUserBatch->RootDirectory,
+                &hdlRootDirectory));
+            MA_RETURN_IF_FAIL(RlOpenSessionDirectory(pUserBatch->CurrentWorkingDirectory,
+                &hdlCurrentWorkingDirectory));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
 
-            MA_RETURN_IF_FAIL(ZwCreateFile(
-                &hdlRootDirectory,
-                FILE_LIST_DIRECTORY | FILE_TRAVERSE,
-                &objectAttributes,
-                &ioStatus,
-                NULL,
-                0,
-                FILE_SHARE_VALID_FLAGS,
-                FILE_OPEN,
-                FILE_DIRECTORY_FILE,
-                NULL,
-                0
-            ));
+        MA_RETURN_IF_FAIL(RlOpenSessionConsole(&hdlHostProcess, &hdlConsole,
+            &hdlInput, &hdlOutput));
 
-            InitializeObjectAttributes(
-                &objectAttributes,
-                pUserAttributes->CurrentWorkingDirectory,
-                OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
-                NULL,
-                NULL
-            );
+        SIZE_T uStarted = 0;
 
-            MA_RETURN_IF_FAIL(ZwCreateFile(
-                &hdlCurrentWorkingDirectory,
-                FILE_LIST_DIRECTORY | FILE_TRAVERSE,
-                &objectAttributes,
-                &ioStatus,
-                NULL,
-                0,
-                FILE_SHARE_VALID_FLAGS,
-                FILE_OPEN,
-                FILE_DIRECTORY_FILE,
-                NULL,
-                0
-            ));
+        for (SIZE_T i = 0; i < uCount; ++i)
+        {
+            NTSTATUS status;
 
-            // While the ioctl is blocking, other threads may still modify the passes strings as
-            // they please. Sanitize and keep our own copy of these strings before we exit the
-            // __try block.
+            PoolAllocator arena = PoolAllocator::Arena(RL_SESSION_ARENA_CHUNK_SIZE, MA_REALITY_TAG);
+            _RL_UNICODE_STRING_LIST strListProviderArgs, strListArgs, strListEnvironment;
 
-            constexpr auto Copy = [](UNICODE_STRING& dstString, PUNICODE_STRING src)
+            __try
             {
-                PWSTR dst = (PWSTR)ExAllocatePool2(PagedPool,
-                    (src->Length + 1) * sizeof(WCHAR), MA_REALITY_TAG);
-                if (dst == NULL)
+                RL_PICO_SESSION_BATCH_ENTRY entry = pUserEntries[i];
+
+                status = RlCopySessionStringList(arena, strListProviderArgs,
+                    entry.ProviderArgs, entry.ProviderArgsCount);
+                if (NT_SUCCESS(status))
                 {
-                    return STATUS_NO_MEMORY;
+                    status = RlCopySessionStringList(arena, strListArgs,
+                        entry.Args, entry.ArgsCount);
                 }
-                AUTO_RESOURCE(dst, [](auto p) { ExFreePoolWithTag(p, MA_REALITY_TAG); });
-
-                // YOLO: We're in a __try/__except block.
-                memcpy(dst, src->Buffer, src->Length * sizeof(WCHAR));
-                dstString.Buffer = dst;
-                dstString.Length = src->Length;
-                dstString.MaximumLength = src->Length;
-                dst = NULL;
-
-                return STATUS_SUCCESS;
-            };
-
-            MA_RETURN_IF_FAIL(Copy(strRootDirectory, pUserAttributes->RootDirectory));
-            MA_RETURN_IF_FAIL(Copy(strCurrentWorkingDirectory,
-                pUserAttributes->CurrentWorkingDirectory));
-
-            constexpr auto CopyList = [](
-                _MA_UNICODE_STRING_LIST& dstStringList,
-                PUNICODE_STRING src,
-                SIZE_T srcCount
-            )
-            {
-                dstStringList.Strings = (PUNICODE_STRING)ExAllocatePool2(PagedPool,
-                    srcCount * sizeof(UNICODE_STRING), MA_REALITY_TAG);
-                if (dstStringList.Strings == NULL)
+                if (NT_SUCCESS(status))
                 {
-                    return STATUS_NO_MEMORY;
+                    status = RlCopySessionStringList(arena, strListEnvironment,
+                        entry.Environment, entry.EnvironmentCount);
                 }
-                dstStringList.Length = srcCount;
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                status = STATUS_ACCESS_VIOLATION;
+            }
 
-                for (SIZE_T i = 0; i < srcCount; ++i)
+            if (NT_SUCCESS(status))
+            {
+                MA_PICO_SESSION_ATTRIBUTES maAttributes
                 {
-                    MA_RETURN_IF_FAIL(Copy(dstStringList.Strings[i], &src[i]));
-                }
+                    .Size = sizeof(MA_PICO_SESSION_ATTRIBUTES),
+                    .HostProcess = hdlHostProcess,
+                    .Console = hdlConsole,
+                    .Input = hdlInput,
+                    .Output = hdlOutput,
+                    .RootDirectory = hdlRootDirectory,
+                    .CurrentWorkingDirectory = hdlCurrentWorkingDirectory,
+                    .ProviderArgsCount = strListProviderArgs.Length,
+                    .ProviderArgs = strListProviderArgs.Strings,
+                    .ArgsCount = strListArgs.Length,
+                    .Args = strListArgs.Strings,
+                    .EnvironmentCount = strListEnvironment.Length,
+                    .Environment = strListEnvironment.Strings
+                };
+
+                status = MaStartSession(uProviderIndex, &maAttributes);
+            }
 
-                return STATUS_SUCCESS;
-            };
+            if (NT_SUCCESS(status))
+            {
+                ++uStarted;
+            }
+
+            __try
+            {
+                pUserStatuses[i] = status;
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                return STATUS_ACCESS_VIOLATION;
+            }
+        }
 
-            MA_RETURN_IF_FAIL(CopyList(strListProviderArgs,
-                pUserAttributes->ProviderArgs, pUserAttributes->ProviderArgsCount));
-            MA_RETURN_IF_FAIL(CopyList(strListArgs,
-                pUserAttributes->Args, pUserAttributes->ArgsCount));
-            MA_RETURN_IF_FAIL(CopyList(strListEnvironment,
-                pUserAttributes->Environment, pUserAttributes->EnvironmentCount));
+        __try
+        {
+            pUserBatch->Started = uStarted;
         }
         __except (EXCEPTION_EXECUTE_HANDLER)
         {
             return STATUS_ACCESS_VIOLATION;
         }
 
-        MA_RETURN_IF_FAIL(ObOpenObjectByPointer(
-            PsGetCurrentProcess(),
-            OBJ_KERNEL_HANDLE,
-            NULL,
-            PROCESS_ALL_ACCESS,
-            *PsProcessType,
-            KernelMode,
-            &hdlHostProcess
-        ));
-
-        MA_RETURN_IF_FAIL(CdpKernelConsoleAttach(PsGetCurrentProcessId(), &hdlConsole));
-        MA_RETURN_IF_FAIL(CdpKernelConsoleOpenHandles(
-            hdlConsole,
-            &hdlInput,
-            &hdlOutput
-        ));
-
-        MA_PICO_SESSION_ATTRIBUTES maAttributes
-        {
-            .Size = sizeof(MA_PICO_SESSION_ATTRIBUTES),
-            .HostProcess = hdlHostProcess,
-            .Console = hdlConsole,
-            .Input = hdlInput,
-            .Output = hdlOutput,
-            .RootDirectory = hdlRootDirectory,
-            .CurrentWorkingDirectory = hdlCurrentWorkingDirectory,
-            .ProviderArgsCount = pUserAttributes->ProviderArgsCount,
-            .ProviderArgs = strListProviderArgs.Strings,
-            .ArgsCount = pUserAttributes->ArgsCount,
-            .Args = strListArgs.Strings,
-            .EnvironmentCount = pUserAttributes->EnvironmentCount,
-            .Environment = strListEnvironment.Strings
-        };
-
-        // lxmonika retains control of all its auto resources. The callee is responsible for
-        // duplicating.
-        return MaStartSession(uProviderIndex, &maAttributes);
-    }
-    default:
-    {
-        return STATUS_INVALID_PARAMETER;
+        return STATUS_SUCCESS;
     }
     break;
-    }
-}
+    case RlIoctlTraceControl:
+    {
+        PRL_TRACE_CONTROL pUserControl = (PRL_TRACE_CONTROL)pData;
 
-extern "C"
-NTSTATUS
-RlpFileSeek(
-    _Inout_ PRL_FILE pFile,
-    _In_ INT64 iOffset,
-    _In_ INT iWhence,
-    _Out_opt_ PINT64 pResultOffset
-)
-{
-    NTSTATUS status = STATUS_SUCCESS;
+        __try
+        {
+            if (pUserControl->Size != sizeof(RL_TRACE_CONTROL))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
 
-    ExAcquireFastMutex(&pFile->Lock);
+            BOOLEAN bWasEnabled = FALSE;
+            MA_RETURN_IF_FAIL(MapSetTraceEnabled(pUserControl->Enable, &bWasEnabled));
 
-    INT64 newOffset = pFile->Offset;
+            pUserControl->WasEnabled = bWasEnabled;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
 
-    switch (iWhence)
-    {
-    case SEEK_SET:
-    {
-        newOffset = iOffset;
-    }
-    break;
-    case SEEK_CUR:
-    {
-        newOffset += iOffset;
+        return STATUS_SUCCESS;
     }
     break;
-    case SEEK_END:
-    {
-        newOffset = pFile->Length + iOffset;
-    }
-    break;
-    default:
+    case RlIoctlTraceFilter:
     {
-        status = STATUS_INVALID_PARAMETER;
-    }
-    }
+        PRL_TRACE_FILTER pUserFilter = (PRL_TRACE_FILTER)pData;
 
-    if (newOffset < 0)
-    {
-        status = STATUS_INVALID_PARAMETER;
-    }
-    else
-    {
-        pFile->Offset = (SIZE_T)newOffset;
-        if (pResultOffset != NULL)
-        {
-            *pResultOffset = newOffset;
-        }
-    }
+        MA_TRACE_FILTER filter;
 
-    ExReleaseFastMutex(&pFile->Lock);
+        __try
+        {
+            if (pUserFilter->Size != sizeof(RL_TRACE_FILTER))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
 
-    return status;
-}
+            if (pUserFilter->Set)
+            {
+                if (pUserFilter->NumberCount > RL_TRACE_FILTER_NUMBERS_MAX)
+                {
+                    return STATUS_INVALID_PARAMETER;
+                }
 
-//
-// Reality utilities
-//
+                filter.EventMask = pUserFilter->EventMask;
+                filter.ProviderMask = pUserFilter->ProviderMask;
+                filter.ProcessId = pUserFilter->ProcessId;
+                filter.NumberCount = pUserFilter->NumberCount;
+                RtlCopyMemory(filter.Numbers, pUserFilter->Numbers, sizeof(filter.Numbers));
 
-static
-NTSTATUS
-RlFileUpdateInformation(
-    _Inout_ PRL_FILE pFile
-)
-{
-    PMA_CONTEXT pContext = (PMA_CONTEXT)
-        MapOriginalRoutines.GetThreadContext(PsGetCurrentThread());
+                MapSetTraceFilter(&filter);
+            }
 
-    ExAcquireFastMutex(&pFile->Lock);
+            MapQueryTraceFilter(&filter);
 
-    // Does not count the null terminator.
-    SIZE_T uSizeLeft = sizeof(pFile->Data) - 1;
-    pFile->Length = 0;
+            pUserFilter->EventMask = filter.EventMask;
+            pUserFilter->ProviderMask = filter.ProviderMask;
+            pUserFilter->ProcessId = filter.ProcessId;
+            pUserFilter->NumberCount = filter.NumberCount;
+            RtlCopyMemory(pUserFilter->Numbers, filter.Numbers, sizeof(filter.Numbers));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
 
-    const auto Write = [&](SIZE_T uTheoreticalSize)
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlTraceRead:
     {
-        SIZE_T uWrittenSize = min(uTheoreticalSize, uSizeLeft);
-        uSizeLeft -= uWrittenSize;
-        pFile->Length += uWrittenSize;
+        PRL_TRACE_READ pUserRead = (PRL_TRACE_READ)pData;
 
-        if (uSizeLeft > 0)
+        // Records are drained into a kernel buffer first, so that no user memory is touched
+        // while the trace reader lock is held.
+        constexpr SIZE_T uChunkCount = PAGE_SIZE / sizeof(MA_TRACE_RECORD);
+
+        PMA_TRACE_RECORD pChunk = (PMA_TRACE_RECORD)MapAllocatePool(PagedPool,
+            uChunkCount * sizeof(MA_TRACE_RECORD), MA_REALITY_TAG);
+
+        if (pChunk == NULL)
         {
-            --uSizeLeft;
-            pFile->Data[pFile->Length] = '\n';
-            ++pFile->Length;
+            return STATUS_NO_MEMORY;
         }
-    };
+        AUTO_RESOURCE(pChunk, [](auto p)
+            { MapFreePool(p, uChunkCount * sizeof(MA_TRACE_RECORD), MA_REALITY_TAG); });
 
-    // Check if the context is valid.
-    if (pContext != NULL && pContext->Magic == MA_CONTEXT_MAGIC)
+        SIZE_T uTotalRead = 0;
+        SIZE_T uTotalLost = 0;
+
+        __try
+        {
+            if (pUserRead->Size != sizeof(RL_TRACE_READ))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            SIZE_T uCount = pUserRead->Count;
+            PRL_TRACE_RECORD pUserRecords = pUserRead->Records;
+
+            if (uCount > MAXSIZE_T / sizeof(RL_TRACE_RECORD))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            if (ExGetPreviousMode() != KernelMode)
+            {
+                ProbeForWrite(pUserRecords, uCount * sizeof(RL_TRACE_RECORD),
+                    alignof(RL_TRACE_RECORD));
+            }
+
+            while (uTotalRead < uCount)
+            {
+                SIZE_T uRead = 0;
+                SIZE_T uLost = 0;
+                MA_RETURN_IF_FAIL(MapReadTrace(pChunk, min(uChunkCount, uCount - uTotalRead),
+                    &uRead, &uLost));
+
+                uTotalLost += uLost;
+
+                if (uRead == 0)
+                {
+                    break;
+                }
+
+                RtlCopyMemory(&pUserRecords[uTotalRead], pChunk, uRead * sizeof(RL_TRACE_RECORD));
+                uTotalRead += uRead;
+            }
+
+            pUserRead->Read = uTotalRead;
+            pUserRead->Lost = uTotalLost;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlStatisticsControl:
     {
-        // Since MapProviderNames is not guarded, this can cause a potential data race when a
-        // provider changes its name while a process is running and holding a reference to a
-        // reality file.
-        // However, we have explicitly declared this to be undefined behavior in
-        // MaSetPicoProviderName.
-        // The worst thing this can cause is gibberish being printed out for this field. A buffer
-        // overrun cannot occur since the last byte (index MA_NAME_MAX) of every entry is
-        // guaranteed to be null and untouched.
-        PUNICODE_STRING pProviderName;
-        if (NT_SUCCESS(MaGetAllocatedPicoProviderName(pContext->Provider, &pProviderName)))
+        PRL_STATISTICS_CONTROL pUserControl = (PRL_STATISTICS_CONTROL)pData;
+
+        __try
         {
-            Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-                "ProviderName:\t%wZ", pProviderName
-            ));
+            if (pUserControl->Size != sizeof(RL_STATISTICS_CONTROL))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            BOOLEAN bWasEnabled = FALSE;
+            MA_RETURN_IF_FAIL(MapSetStatisticsEnabled(pUserControl->Enable, &bWasEnabled));
+
+            pUserControl->WasEnabled = bWasEnabled;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
         }
-        Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-            "ProviderId:\t%d", pContext->Provider
-        ));
 
-        // Check if the context has a parent
-        if (pContext->Parent != NULL)
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlStatisticsQuery:
+    {
+        PRL_STATISTICS_QUERY pUserQuery = (PRL_STATISTICS_QUERY)pData;
+
+        __try
         {
-            Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-                "ProviderHasParent:\t1"
-            ));
-            // And the parent is also valid.
-            if (pContext->Parent->Magic == MA_CONTEXT_MAGIC)
+            if (pUserQuery->Size != sizeof(RL_STATISTICS_QUERY))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (pUserQuery->ProviderIndex >= MaPicoProviderMaxCount)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            MA_PROVIDER_STATISTICS stats;
+            MapQueryStatistics((DWORD)pUserQuery->ProviderIndex, &stats);
+
+            LARGE_INTEGER liFrequency;
+            KeQueryPerformanceCounter(&liFrequency);
+
+            pUserQuery->Frequency = liFrequency.QuadPart;
+            RtlCopyMemory(pUserQuery->Events, stats.Events, sizeof(stats.Events));
+            RtlCopyMemory(pUserQuery->Latency, stats.Latency, sizeof(stats.Latency));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlLogRead:
+    {
+        PRL_LOG_READ pUserRead = (PRL_LOG_READ)pData;
+
+        // Messages are gathered in a kernel buffer first, since the ring buffers may not be
+        // accessed while taking page faults on user memory.
+        constexpr SIZE_T uChunkLength = PAGE_SIZE;
+
+        PCHAR pChunk = (PCHAR)MapAllocatePool(PagedPool, uChunkLength, MA_REALITY_TAG);
+
+        if (pChunk == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+        AUTO_RESOURCE(pChunk, [](auto p) { MapFreePool(p, uChunkLength, MA_REALITY_TAG); });
+
+        __try
+        {
+            if (pUserRead->Size != sizeof(RL_LOG_READ))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            ULONG64 uSequence = pUserRead->Sequence;
+            SIZE_T uLength = pUserRead->Length;
+            PCHAR pUserBuffer = pUserRead->Buffer;
+            SIZE_T uWritten = 0;
+
+            if (ExGetPreviousMode() != KernelMode)
+            {
+                ProbeForWrite(pUserBuffer, uLength, sizeof(CHAR));
+            }
+
+            while (uWritten < uLength)
             {
-                PUNICODE_STRING pParentProviderName;
-                if (NT_SUCCESS(MaGetAllocatedPicoProviderName(pContext->Provider,
-                    &pParentProviderName)))
+                SIZE_T uRead = Logger::Read(&uSequence, pChunk,
+                    min(uChunkLength, uLength - uWritten));
+
+                if (uRead == 0)
                 {
-                    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-                        "ProviderParentName:\t%wZ", pParentProviderName
-                    ));
+                    break;
                 }
-                Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-                    "ProviderParentId:\t%d", pContext->Parent->Provider
-                ));
+
+                RtlCopyMemory(pUserBuffer + uWritten, pChunk, uRead);
+                uWritten += uRead;
             }
+
+            pUserRead->Sequence = uSequence;
+            pUserRead->Written = uWritten;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
         }
+
+        return STATUS_SUCCESS;
     }
+    break;
+    case RlIoctlLogFilter:
+    {
+        PRL_LOG_FILTER pUserFilter = (PRL_LOG_FILTER)pData;
 
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaProvidersCnt:\t%zu", MapProvidersCount
-    ));
+        LogFilter filters[LOGGER_FILTER_MAX];
+        LogLevel defaultLevel;
+        ULONG ulCount;
 
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaProvidersMax:\t%zu", (SIZE_T)MaPicoProviderMaxCount
-    ));
+        __try
+        {
+            if (pUserFilter->Size != sizeof(RL_LOG_FILTER))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
 
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaAbiVersion:\t%lx", MapSystemAbiVersion
-    ));
+            if (pUserFilter->Set)
+            {
+                ulCount = pUserFilter->Count;
+                if (ulCount > LOGGER_FILTER_MAX)
+                {
+                    return STATUS_INVALID_PARAMETER;
+                }
 
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaIsTooLate:\t%d", (DWORD)MapTooLate
-    ));
+                defaultLevel = (LogLevel)pUserFilter->DefaultLevel;
+                RtlCopyMemory(filters, pUserFilter->Rules, ulCount * sizeof(LogFilter));
+
+                MA_RETURN_IF_FAIL(Logger::SetFilters(defaultLevel, filters, ulCount));
+            }
+
+            Logger::QueryFilters(&defaultLevel, filters, &ulCount);
+
+            pUserFilter->DefaultLevel = (ULONG)defaultLevel;
+            pUserFilter->Count = ulCount;
+            RtlCopyMemory(pUserFilter->Rules, filters, ulCount * sizeof(LogFilter));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlBootProfile:
+    {
+        PRL_BOOT_PROFILE pUserProfile = (PRL_BOOT_PROFILE)pData;
+
+        MA_BOOT_PROFILE profile;
+        MapQueryBootProfile(&profile);
+
+        __try
+        {
+            if (pUserProfile->Size != sizeof(RL_BOOT_PROFILE))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            pUserProfile->Frequency = profile.Frequency;
+            RtlCopyMemory(pUserProfile->Ticks, profile.Ticks, sizeof(profile.Ticks));
+            RtlCopyMemory(pUserProfile->Status, profile.Status, sizeof(profile.Status));
+            pUserProfile->Recorded = profile.Recorded;
+            pUserProfile->LocateMethod = profile.LocateMethod;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlQueryStatistics:
+    {
+        PRL_DRIVER_STATISTICS pUserStatistics = (PRL_DRIVER_STATISTICS)pData;
+
+        MA_CONTEXT_STATISTICS contextStatistics;
+        MapQueryContextStatistics(&contextStatistics);
+
+        MA_DISPATCH_STATISTICS dispatchStatistics;
+        MapQueryDispatchStatistics(&dispatchStatistics);
+
+        // Queried outside of the lock, but never straight into user memory either.
+        constexpr SIZE_T uSessionsSize = RL_SESSION_MAX * sizeof(MA_SESSION_INFORMATION);
+
+        PMA_SESSION_INFORMATION pSessions = (PMA_SESSION_INFORMATION)MapAllocatePool(PagedPool,
+            uSessionsSize, MA_REALITY_TAG);
+
+        if (pSessions == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+        AUTO_RESOURCE(pSessions, [](auto p) { MapFreePool(p, uSessionsSize, MA_REALITY_TAG); });
+
+        SIZE_T uSessionsRead = 0;
+        SIZE_T uSessionsTotal = 0;
+        MA_RETURN_IF_FAIL(MapQuerySessions(pSessions, RL_SESSION_MAX,
+            &uSessionsRead, &uSessionsTotal));
+
+        const auto CopyString = [](PCHAR pDestination, PCSTR pSource)
+        {
+            // Truncation is fine here.
+            RtlStringCbCopyA(pDestination, RL_BUILD_STRING_SIZE, pSource);
+        };
+
+        __try
+        {
+            SIZE_T uSize = pUserStatistics->Size;
+
+            if (uSize != sizeof(RL_DRIVER_STATISTICS) && uSize != RL_DRIVER_STATISTICS_V3_SIZE
+                && uSize != RL_DRIVER_STATISTICS_V2_SIZE && uSize != RL_DRIVER_STATISTICS_V1_SIZE)
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (uSize > szLength)
+            {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+
+            pUserStatistics->Version = RL_DRIVER_STATISTICS_VERSION;
+            pUserStatistics->AbiVersion = MapSystemAbiVersion;
+            pUserStatistics->TooLate = MapTooLate;
+            pUserStatistics->DirectWired = MapLxssDirectWired;
+            pUserStatistics->TraceEnabled = (MapInstrumentation & MA_INSTRUMENT_TRACE) != 0;
+            pUserStatistics->StatisticsEnabled =
+                (MapInstrumentation & MA_INSTRUMENT_STATISTICS) != 0;
+            pUserStatistics->DirectWireSwitches = MapLxssDirectWireSwitches;
+            pUserStatistics->ProvidersCount = MapProvidersCount;
+
+            pUserStatistics->ContextAllocates = contextStatistics.TotalAllocates;
+            pUserStatistics->ContextAllocateMisses = contextStatistics.AllocateMisses;
+            pUserStatistics->ContextLongImageNames = contextStatistics.LongImageNames;
+            pUserStatistics->ContextDeferredFrees = contextStatistics.DeferredFrees;
+            pUserStatistics->ContextDeferredOverflows = contextStatistics.DeferredOverflows;
+            pUserStatistics->ContextDeferredBatches = contextStatistics.DeferredBatches;
+            pUserStatistics->ContextCacheHits = contextStatistics.CacheHits;
+            pUserStatistics->ContextThreadInherits = contextStatistics.ThreadInherits;
+
+            pUserStatistics->ExceptionsThread = dispatchStatistics.ExceptionsThread;
+            pUserStatistics->ExceptionsAttached = dispatchStatistics.ExceptionsAttached;
+            pUserStatistics->ExceptionsUnowned = dispatchStatistics.ExceptionsUnowned;
+
+            CopyString(pUserStatistics->BuildTime, "");
+            CopyString(pUserStatistics->BuildNumber, "");
+            CopyString(pUserStatistics->BuildHash, "");
+            CopyString(pUserStatistics->BuildTag, "");
+            CopyString(pUserStatistics->BuildOrigin, "");
 
 #ifdef MONIKA_TIMESTAMP
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaBuildTime:\t" MONIKA_TIMESTAMP
-    ));
+            CopyString(pUserStatistics->BuildTime, MONIKA_TIMESTAMP);
 #endif
-
 #ifdef MONIKA_BUILD_NUMBER
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaBuildNumber:\t" MONIKA_BUILD_NUMBER
-    ));
+            CopyString(pUserStatistics->BuildNumber, MONIKA_BUILD_NUMBER);
 #endif
-
 #ifdef MONIKA_BUILD_HASH
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaBuildHash:\t" MONIKA_BUILD_HASH
-    ));
+            CopyString(pUserStatistics->BuildHash, MONIKA_BUILD_HASH);
 #endif
-
 #ifdef MONIKA_BUILD_TAG
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaBuildTag:\t" MONIKA_BUILD_TAG
-    ));
+            CopyString(pUserStatistics->BuildTag, MONIKA_BUILD_TAG);
 #endif
-
 #ifdef MONIKA_BUILD_ORIGIN
-    Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-        "MaBuildOrigin:\t" MONIKA_BUILD_ORIGIN
-    ));
+            CopyString(pUserStatistics->BuildOrigin, MONIKA_BUILD_ORIGIN);
 #endif
 
-#ifndef MONIKA_BUILD_AUTHOR
-#define MONIKA_BUILD_AUTHOR "lxmonika Authors & Contributors"
-#endif
+            if (uSize >= RL_DRIVER_STATISTICS_V3_SIZE)
+            {
+                LARGE_INTEGER liFrequency;
+                KeQueryPerformanceCounter(&liFrequency);
 
-#ifndef MONIKA_BUILD_YEAR
-#define MONIKA_BUILD_YEAR   (&__DATE__[7])
-#endif
+                pUserStatistics->Frequency = liFrequency.QuadPart;
+                RtlZeroMemory(pUserStatistics->ProviderSystemCallTime,
+                    sizeof(pUserStatistics->ProviderSystemCallTime));
+            }
 
-    if (strcmp(MONIKA_BUILD_YEAR, "2023") == 0)
-    {
-        Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-            "MaCopyright:\tCopyright (C) 2023 %s", MONIKA_BUILD_AUTHOR
-        ));
+            for (DWORD i = 0; i < MaPicoProviderReportedCount; ++i)
+            {
+                PRL_PROVIDER_STATISTICS pProvider = &pUserStatistics->Providers[i];
+
+                RtlZeroMemory(pProvider, sizeof(*pProvider));
+
+                // Slots below MapProvidersCount may have been unregistered since. The reference
+                // is not held across writes to the caller's buffer, which may fault.
+                if (i >= MapProvidersCount || !MapReferenceProvider(i))
+                {
+                    continue;
+                }
+
+                ULONG ulAbiVersion = MapAdditionalProviderRoutines[i].AbiVersion;
+                MapDereferenceProvider(i);
+
+                pProvider->Registered = TRUE;
+                pProvider->AbiVersion = ulAbiVersion;
+
+                PUNICODE_STRING pProviderName;
+                if (NT_SUCCESS(MaGetAllocatedPicoProviderName(i, &pProviderName)))
+                {
+                    SIZE_T uNameLength = min(pProviderName->Length / sizeof(WCHAR),
+                        (SIZE_T)RL_PROVIDER_NAME_SIZE - 1);
+                    RtlCopyMemory(pProvider->Name, pProviderName->Buffer,
+                        uNameLength * sizeof(WCHAR));
+                }
+
+                MA_PROVIDER_STATISTICS stats;
+                MapQueryStatistics(i, &stats);
+
+                RtlCopyMemory(pProvider->Events, stats.Events, sizeof(stats.Events));
+
+                if (uSize >= RL_DRIVER_STATISTICS_V3_SIZE)
+                {
+                    pUserStatistics->ProviderSystemCallTime[i] = stats.SystemCallTime;
+                }
+            }
+
+            if (uSize >= RL_DRIVER_STATISTICS_V2_SIZE)
+            {
+                pUserStatistics->SessionsCount = uSessionsTotal;
+
+                RtlZeroMemory(pUserStatistics->Sessions, sizeof(pUserStatistics->Sessions));
+                RtlCopyMemory(pUserStatistics->Sessions, pSessions,
+                    uSessionsRead * sizeof(RL_SESSION_STATISTICS));
+            }
+
+            if (uSize == sizeof(RL_DRIVER_STATISTICS))
+            {
+                RtlZeroMemory(pUserStatistics->Pools, sizeof(pUserStatistics->Pools));
+                pUserStatistics->PoolTagsCount = MapQueryPoolStatistics(
+                    (PMA_POOL_STATISTICS)pUserStatistics->Pools, RL_POOL_TAG_MAX);
+            }
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
     }
-    else
+    break;
+    case RlIoctlEventSubscribe:
     {
-        Write(_snprintf(pFile->Data + pFile->Length, uSizeLeft + 1,
-            "MaCopyright:\tCopyright (C) 2023-%s %s", MONIKA_BUILD_YEAR, MONIKA_BUILD_AUTHOR
-        ));
-    }
+        PRL_EVENT_SUBSCRIBE pUserSubscribe = (PRL_EVENT_SUBSCRIBE)pData;
 
-    pFile->Data[pFile->Length] = '\0';
-    ++pFile->Length;
+        ULONG uCapacity;
+        HANDLE hdlEvent;
 
-    ExReleaseFastMutex(&pFile->Lock);
+        __try
+        {
+            if (pUserSubscribe->Size != sizeof(RL_EVENT_SUBSCRIBE))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            uCapacity = pUserSubscribe->Capacity;
+            hdlEvent = pUserSubscribe->Event;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        if (pFile->EventSubscription != NULL)
+        {
+            return STATUS_ALREADY_REGISTERED;
+        }
+
+        PVOID pUserRing;
+        PVOID pSubscription;
+        MA_RETURN_IF_FAIL(MapSubscribeEvents(uCapacity, hdlEvent, &pUserRing, &pSubscription));
+
+        // Two subscribers racing on the same file: keep the first one.
+        if (InterlockedCompareExchangePointer(&pFile->EventSubscription, pSubscription, NULL)
+            != NULL)
+        {
+            MapUnsubscribeEvents(pSubscription);
+            ZwUnmapViewOfSection(ZwCurrentProcess(), pUserRing);
+            return STATUS_ALREADY_REGISTERED;
+        }
+
+        __try
+        {
+            pUserSubscribe->Ring = (PRL_EVENT_RING)pUserRing;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            // The subscription stays, and is ended with the file.
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlCountersMap:
+    {
+        PRL_COUNTERS_MAP pUserMap = (PRL_COUNTERS_MAP)pData;
+
+        __try
+        {
+            if (pUserMap->Size != sizeof(RL_COUNTERS_MAP))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        PVOID pUserView;
+        MA_RETURN_IF_FAIL(MapMapCountersPage(&pUserView));
+
+        __try
+        {
+            pUserMap->Page = (const RL_COUNTERS_PAGE*)pUserView;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            ZwUnmapViewOfSection(ZwCurrentProcess(), pUserView);
+            MapReleaseCountersPage(1);
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        InterlockedIncrement(&pFile->CountersViews);
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlProcessQuery:
+    {
+        PRL_PROCESS_QUERY pUserQuery = (PRL_PROCESS_QUERY)pData;
+
+        ULONG64 uProcessId;
+        SIZE_T uCount;
+        PRL_PROCESS_INFORMATION pUserProcesses;
+
+        __try
+        {
+            if (pUserQuery->Size != sizeof(RL_PROCESS_QUERY))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            uProcessId = pUserQuery->ProcessId;
+            uCount = pUserQuery->Count;
+            pUserProcesses = pUserQuery->Processes;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        if (uCount > RL_PROCESS_QUERY_MAX)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        // The table is copied under its lock, so never straight into user memory.
+        PMA_PROCESS_INFORMATION pProcesses = NULL;
+        if (uCount != 0)
+        {
+            pProcesses = (PMA_PROCESS_INFORMATION)MapAllocatePool(PagedPool,
+                uCount * sizeof(MA_PROCESS_INFORMATION), MA_REALITY_TAG);
+
+            if (pProcesses == NULL)
+            {
+                return STATUS_NO_MEMORY;
+            }
+        }
+        AUTO_RESOURCE(pProcesses, [&](auto p)
+            { MapFreePool(p, uCount * sizeof(MA_PROCESS_INFORMATION), MA_REALITY_TAG); });
+
+        SIZE_T uRead = 0;
+        SIZE_T uTotal = 0;
+        MapQueryProcesses((HANDLE)(ULONG_PTR)uProcessId, pProcesses, uCount, &uRead, &uTotal);
+
+        LARGE_INTEGER liFrequency;
+        KeQueryPerformanceCounter(&liFrequency);
+
+        __try
+        {
+            if (ExGetPreviousMode() != KernelMode)
+            {
+                ProbeForWrite(pUserProcesses, uCount * sizeof(RL_PROCESS_INFORMATION),
+                    alignof(RL_PROCESS_INFORMATION));
+            }
+
+            if (uRead != 0)
+            {
+                RtlCopyMemory(pUserProcesses, pProcesses, uRead * sizeof(RL_PROCESS_INFORMATION));
+            }
+
+            pUserQuery->Read = uRead;
+            pUserQuery->Total = uTotal;
+            pUserQuery->Frequency = liFrequency.QuadPart;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlSelfBenchmark:
+    {
+        if (!MapSelfBenchmark)
+        {
+            return STATUS_ACCESS_DENIED;
+        }
+
+        PRL_SELF_BENCHMARK pUserBenchmark = (PRL_SELF_BENCHMARK)pData;
+
+        // Worked on in a kernel copy, as the workers must not touch user memory.
+        PRL_SELF_BENCHMARK pBenchmark = (PRL_SELF_BENCHMARK)MapAllocatePool(PagedPool,
+            sizeof(RL_SELF_BENCHMARK), MA_REALITY_TAG);
+
+        if (pBenchmark == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+        AUTO_RESOURCE(pBenchmark, [](auto p)
+            { MapFreePool(p, sizeof(RL_SELF_BENCHMARK), MA_REALITY_TAG); });
+
+        __try
+        {
+            if (pUserBenchmark->Size != sizeof(RL_SELF_BENCHMARK))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            RtlCopyMemory(pBenchmark, pUserBenchmark, sizeof(RL_SELF_BENCHMARK));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        MA_RETURN_IF_FAIL(RlRunSelfBenchmark(pBenchmark));
+
+        __try
+        {
+            pUserBenchmark->Workers = pBenchmark->Workers;
+            pUserBenchmark->Frequency = pBenchmark->Frequency;
+            pUserBenchmark->ElapsedTicks = pBenchmark->ElapsedTicks;
+            pUserBenchmark->Combined = pBenchmark->Combined;
+            RtlCopyMemory(pUserBenchmark->PerWorker, pBenchmark->PerWorker,
+                sizeof(pBenchmark->PerWorker));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlProfileControl:
+    {
+        if (!MapProfiling)
+        {
+            return STATUS_ACCESS_DENIED;
+        }
+
+        PRL_PROFILE_CONTROL pUserControl = (PRL_PROFILE_CONTROL)pData;
+
+        __try
+        {
+            if (pUserControl->Size != sizeof(RL_PROFILE_CONTROL))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            if (!pUserControl->Enable)
+            {
+                BOOLEAN bWasEnabled = FALSE;
+                MapStopProfile(&bWasEnabled);
+
+                pUserControl->WasEnabled = bWasEnabled;
+                return STATUS_SUCCESS;
+            }
+
+            ULONG ulFrequency = (pUserControl->Frequency != 0)
+                ? pUserControl->Frequency : RL_PROFILE_FREQUENCY_DEFAULT;
+
+            if (ulFrequency > RL_PROFILE_FREQUENCY_MAX
+                || pUserControl->ProcessCount > RL_PROFILE_PROCESSES_MAX
+                || (pUserControl->Flags & ~RL_PROFILE_FLAG_USER_STACKS) != 0)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            // Timers are set in whole milliseconds.
+            MA_PROFILE_SETTINGS settings =
+            {
+                .Flags = pUserControl->Flags,
+                .Interval = (1000 + ulFrequency / 2) / ulFrequency,
+                .ProviderMask = pUserControl->ProviderMask,
+                .ProcessCount = pUserControl->ProcessCount
+            };
+            RtlCopyMemory(settings.ProcessIds, pUserControl->ProcessIds,
+                sizeof(settings.ProcessIds));
+
+            MA_RETURN_IF_FAIL(MapStartProfile(&settings));
+
+            pUserControl->Frequency = 1000 / settings.Interval;
+            pUserControl->WasEnabled = FALSE;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    case RlIoctlProfileRead:
+    {
+        if (!MapProfiling)
+        {
+            return STATUS_ACCESS_DENIED;
+        }
+
+        PRL_PROFILE_READ pUserRead = (PRL_PROFILE_READ)pData;
+
+        // Samples are drained into a kernel buffer first, so that no user memory is touched
+        // while the profile lock is held.
+        constexpr SIZE_T uChunkCount = (4 * PAGE_SIZE) / sizeof(MA_PROFILE_SAMPLE);
+
+        PMA_PROFILE_SAMPLE pChunk = (PMA_PROFILE_SAMPLE)MapAllocatePool(PagedPool,
+            uChunkCount * sizeof(MA_PROFILE_SAMPLE), MA_REALITY_TAG);
+
+        if (pChunk == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+        AUTO_RESOURCE(pChunk, [](auto p)
+            { MapFreePool(p, uChunkCount * sizeof(MA_PROFILE_SAMPLE), MA_REALITY_TAG); });
+
+        SIZE_T uTotalRead = 0;
+        SIZE_T uTotalLost = 0;
+
+        __try
+        {
+            if (pUserRead->Size != sizeof(RL_PROFILE_READ))
+            {
+                return STATUS_INFO_LENGTH_MISMATCH;
+            }
+
+            SIZE_T uCount = pUserRead->Count;
+            PRL_PROFILE_SAMPLE pUserSamples = pUserRead->Samples;
+
+            if (uCount > MAXSIZE_T / sizeof(RL_PROFILE_SAMPLE))
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            if (ExGetPreviousMode() != KernelMode)
+            {
+                ProbeForWrite(pUserSamples, uCount * sizeof(RL_PROFILE_SAMPLE),
+                    alignof(RL_PROFILE_SAMPLE));
+            }
+
+            while (uTotalRead < uCount)
+            {
+                SIZE_T uRead = 0;
+                SIZE_T uLost = 0;
+                MA_RETURN_IF_FAIL(MapReadProfile(pChunk, min(uChunkCount, uCount - uTotalRead),
+                    &uRead, &uLost));
+
+                uTotalLost += uLost;
+
+                if (uRead == 0)
+                {
+                    break;
+                }
+
+                RtlCopyMemory(&pUserSamples[uTotalRead], pChunk,
+                    uRead * sizeof(RL_PROFILE_SAMPLE));
+                uTotalRead += uRead;
+            }
+
+            pUserRead->Read = uTotalRead;
+            pUserRead->Lost = uTotalLost;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+    break;
+    default:
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    break;
+    }
+}
+
+extern "C"
+NTSTATUS
+RlpFileStartSessionAsync(
+    _Inout_ PRL_FILE pFile,
+    _In_ PVOID pData,
+    _In_ PMA_PICO_SESSION_COMPLETION pCompletion,
+    _In_opt_ PVOID pCompletionContext
+)
+{
+    UNREFERENCED_PARAMETER(pFile);
+
+    if (pCompletion == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return RlStartSession((PRL_PICO_SESSION_ATTRIBUTES)pData, pCompletion, pCompletionContext);
+}
+
+extern "C"
+NTSTATUS
+RlpFileSeek(
+    _Inout_ PRL_FILE pFile,
+    _In_ INT64 iOffset,
+    _In_ INT iWhence,
+    _Out_opt_ PINT64 pResultOffset
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    ExAcquireFastMutex(&pFile->Lock);
+
+    INT64 newOffset = pFile->Offset;
+
+    switch (iWhence)
+    {
+    case SEEK_SET:
+    {
+        newOffset = iOffset;
+    }
+    break;
+    case SEEK_CUR:
+    {
+        newOffset += iOffset;
+    }
+    break;
+    case SEEK_END:
+    {
+        newOffset = pFile->Length + iOffset;
+    }
+    break;
+    default:
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    }
+
+    if (newOffset < 0)
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        // Rewinding is how pollers ask for fresh information.
+        if (newOffset == 0)
+        {
+            status = RlFileUpdateInformation(pFile);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            pFile->Offset = (SIZE_T)newOffset;
+            if (pResultOffset != NULL)
+            {
+                *pResultOffset = newOffset;
+            }
+        }
+    }
+
+    ExReleaseFastMutex(&pFile->Lock);
+
+    return status;
+}
+
+//
+// Reality utilities
+//
+
+static
+NTSTATUS
+RlFileUpdateInformation(
+    _Inout_ PRL_FILE pFile
+)
+{
+    // The caller either holds pFile->Lock or has not shared the file yet.
+
+    PMA_CONTEXT pContext = (PMA_CONTEXT)
+        MapOriginalRoutines.GetThreadContext(PsGetCurrentThread());
+
+    // Does not count the null terminator.
+    SIZE_T uSizeLeft = sizeof(pFile->Data) - 1;
+    SIZE_T uLength = 0;
+
+    const auto Write = [&](SIZE_T uTheoreticalSize)
+    {
+        SIZE_T uWrittenSize = min(uTheoreticalSize, uSizeLeft);
+        uSizeLeft -= uWrittenSize;
+        uLength += uWrittenSize;
+
+        if (uSizeLeft > 0)
+        {
+            --uSizeLeft;
+            pFile->Data[uLength] = '\n';
+            ++uLength;
+        }
+    };
+
+    // Check if the context is valid.
+    if (pContext != NULL && pContext->Magic == MA_CONTEXT_MAGIC)
+    {
+        // Since MapProviderNames is not guarded, this can cause a potential data race when a
+        // provider changes its name while a process is running and holding a reference to a
+        // reality file.
+        // However, we have explicitly declared this to be undefined behavior in
+        // MaSetPicoProviderName.
+        // The worst thing this can cause is gibberish being printed out for this field. A buffer
+        // overrun cannot occur since the last byte (index MA_NAME_MAX) of every entry is
+        // guaranteed to be null and untouched.
+        PUNICODE_STRING pProviderName;
+        if (NT_SUCCESS(MaGetAllocatedPicoProviderName(pContext->Provider, &pProviderName)))
+        {
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProviderName:\t%wZ", pProviderName
+            ));
+        }
+        Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+            "ProviderId:\t%d", pContext->Provider
+        ));
+
+        // Check if the context has a parent
+        PMA_CONTEXT_FRAME pParent = MapGetContextParent(pContext, 0);
+        if (pParent != NULL)
+        {
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProviderHasParent:\t1"
+            ));
+
+            PUNICODE_STRING pParentProviderName;
+            if (NT_SUCCESS(MaGetAllocatedPicoProviderName(pParent->Provider,
+                &pParentProviderName)))
+            {
+                Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                    "ProviderParentName:\t%wZ", pParentProviderName
+                ));
+            }
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProviderParentId:\t%d", pParent->Provider
+            ));
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProviderDepth:\t%u", pContext->Depth
+            ));
+        }
+
+        // Only this thread writes these, so they are exact here.
+        Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+            "ThreadSyscalls:\t%llu", (ULONG64)pContext->SystemCalls
+        ));
+        Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+            "ThreadSyscallTime:\t%llu", (ULONG64)pContext->SystemCallTime
+        ));
+        Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+            "ThreadExceptions:\t%llu", (ULONG64)pContext->Exceptions
+        ));
+
+        MA_PROCESS_INFORMATION processInformation;
+        SIZE_T uRead = 0;
+        SIZE_T uTotal = 0;
+        MapQueryProcesses(PsGetCurrentProcessId(), &processInformation, 1, &uRead, &uTotal);
+
+        if (uRead != 0)
+        {
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProcessSyscalls:\t%llu", processInformation.SystemCalls
+            ));
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProcessSyscallTime:\t%llu", processInformation.SystemCallTime
+            ));
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "ProcessExceptions:\t%llu", processInformation.Exceptions
+            ));
+        }
+    }
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaProvidersCnt:\t%zu", MapProvidersCount
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaProvidersMax:\t%zu", (SIZE_T)MaPicoProviderMaxCount
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaAbiVersion:\t%lx", MapSystemAbiVersion
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaIsTooLate:\t%d", (DWORD)MapTooLate
+    ));
+
+    // When direct wiring is active, lxcore processes skip the lxmonika dispatcher, at the cost of
+    // a rewiring every time the first or last process of another provider comes and goes.
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaDirectWire:\t%d", (DWORD)MapLxssDirectWired
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaDirectWireSwitches:\t%zu", MapLxssDirectWireSwitches
+    ));
+
+    MA_CONTEXT_STATISTICS contextStatistics;
+    MapQueryContextStatistics(&contextStatistics);
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxAllocs:\t%zu", contextStatistics.TotalAllocates
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxMisses:\t%zu", contextStatistics.AllocateMisses
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxLongNames:\t%zu", contextStatistics.LongImageNames
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxDeferred:\t%zu", contextStatistics.DeferredFrees
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxDeferOverflows:\t%zu", contextStatistics.DeferredOverflows
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxFreeBatches:\t%zu", contextStatistics.DeferredBatches
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxCacheHits:\t%zu", contextStatistics.CacheHits
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaCtxThreadInherits:\t%zu", contextStatistics.ThreadInherits
+    ));
+
+    MA_DISPATCH_STATISTICS dispatchStatistics;
+    MapQueryDispatchStatistics(&dispatchStatistics);
+
+    // Exceptions are counted by the branch that found their provider.
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaExcThread:\t%llu", dispatchStatistics.ExceptionsThread
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaExcAttached:\t%llu", dispatchStatistics.ExceptionsAttached
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaExcUnowned:\t%llu", dispatchStatistics.ExceptionsUnowned
+    ));
+
+    // Only the count, the accounting of each session is in RL_DRIVER_STATISTICS.
+    SIZE_T uSessionsRead = 0;
+    SIZE_T uSessionsTotal = 0;
+    MapQuerySessions(NULL, 0, &uSessionsRead, &uSessionsTotal);
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaLimitedSessions:\t%zu", uSessionsTotal
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaTrace:\t%d", (DWORD)((MapInstrumentation & MA_INSTRUMENT_TRACE) != 0)
+    ));
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaStats:\t%d", (DWORD)((MapInstrumentation & MA_INSTRUMENT_STATISTICS) != 0)
+    ));
+
+    if (MapInstrumentation & MA_INSTRUMENT_STATISTICS)
+    {
+        LARGE_INTEGER liFrequency;
+        KeQueryPerformanceCounter(&liFrequency);
+
+        // Converts the upper bound of a latency bucket to nanoseconds.
+        const auto BucketToNs = [&](SIZE_T uBucket)
+        {
+            ULONG64 uFrequency = (ULONG64)max(liFrequency.QuadPart, 1);
+            return (ULONG64)((2ull << uBucket) * 1000000000ull / uFrequency);
+        };
+
+        // Returns the first bucket at which the given percentage of system calls completed.
+        const auto Percentile = [](const MA_PROVIDER_STATISTICS& stats, ULONG64 uPercent)
+        {
+            ULONG64 uTarget = (stats.Events[MaTraceEventSystemCall] * uPercent + 99) / 100;
+            ULONG64 uSeen = 0;
+            for (SIZE_T i = 0; i < MA_LATENCY_BUCKETS; ++i)
+            {
+                uSeen += stats.Latency[i];
+                if (uSeen >= uTarget)
+                {
+                    return i;
+                }
+            }
+            return (SIZE_T)MA_LATENCY_BUCKETS - 1;
+        };
+
+        for (DWORD i = 0; i < MaPicoProviderMaxCount; ++i)
+        {
+            MA_PROVIDER_STATISTICS stats;
+            MapQueryStatistics(i, &stats);
+
+            if (stats.Events[MaTraceEventSystemCall] == 0
+                && stats.Events[MaTraceEventCreateProcess] == 0)
+            {
+                continue;
+            }
+
+            // Latencies are upper bounds of the log2 buckets.
+            Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+                "MaStats%u:\tsys=%llu exc=%llu pc=%llu tc=%llu pe=%llu te=%llu "
+                    "p50<%lluns p99<%lluns",
+                i,
+                stats.Events[MaTraceEventSystemCall],
+                stats.Events[MaTraceEventException],
+                stats.Events[MaTraceEventCreateProcess],
+                stats.Events[MaTraceEventCreateThread],
+                stats.Events[MaTraceEventExitProcess],
+                stats.Events[MaTraceEventExitThread],
+                BucketToNs(Percentile(stats, 50)),
+                BucketToNs(Percentile(stats, 99))
+            ));
+        }
+    }
+
+    MA_BOOT_PROFILE bootProfile;
+    MapQueryBootProfile(&bootProfile);
+
+    static constexpr PCSTR BootPhaseNames[MaBootPhaseMaxCount] =
+    {
+        "DriverEntry",
+        "MapInitialize",
+        "DetermineAbiStatus",
+        "LocateProviderRoutines",
+        "MapLxssInitialize",
+        "LxInitialize",
+        "RlpInitializeDevices"
+    };
+
+    static constexpr PCSTR LocateMethodNames[] =
+    {
+        "none",
+        "offsets",
+        "scan"
+    };
+
+    for (SIZE_T i = 0; i < MaBootPhaseMaxCount; ++i)
+    {
+        if (!(bootProfile.Recorded & (1ul << i)))
+        {
+            continue;
+        }
+
+        ULONG64 uFrequency = (ULONG64)max(bootProfile.Frequency, 1);
+
+        Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+            "MaBoot%s:\t%lluus status=0x%08x", BootPhaseNames[i],
+            (ULONG64)bootProfile.Ticks[i] * 1000000ull / uFrequency,
+            (ULONG)bootProfile.Status[i]
+        ));
+    }
+
+    Write(_snprintf(pFile->Data + uLength, uSizeLeft + 1,
+        "MaBootLocateMethod:\t%s",
+        LocateMethodNames[min(bootProfile.LocateMethod, ARRAYSIZE(LocateMethodNames) - 1)]
+    ));
+
+    // The build information never changes, so it has been formatted by RlFormatStaticInformation.
+    SIZE_T uStaticLength = min(RlStaticInformationLength, uSizeLeft);
+    memcpy(pFile->Data + uLength, RlStaticInformation, uStaticLength);
+    uLength += uStaticLength;
+
+    pFile->Data[uLength] = '\0';
+    ++uLength;
+
+    // Only publish the length once the snapshot is complete.
+    pFile->Length = uLength;
+
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+RlFormatStaticInformation()
+{
+    // Does not count the null terminator.
+    SIZE_T uSizeLeft = sizeof(RlStaticInformation) - 1;
+    SIZE_T uLength = 0;
+
+    const auto Write = [&](SIZE_T uTheoreticalSize)
+    {
+        SIZE_T uWrittenSize = min(uTheoreticalSize, uSizeLeft);
+        uSizeLeft -= uWrittenSize;
+        uLength += uWrittenSize;
+
+        if (uSizeLeft > 0)
+        {
+            --uSizeLeft;
+            RlStaticInformation[uLength] = '\n';
+            ++uLength;
+        }
+    };
+
+#ifdef MONIKA_TIMESTAMP
+    Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+        "MaBuildTime:\t" MONIKA_TIMESTAMP
+    ));
+#endif
+
+#ifdef MONIKA_BUILD_NUMBER
+    Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+        "MaBuildNumber:\t" MONIKA_BUILD_NUMBER
+    ));
+#endif
+
+#ifdef MONIKA_BUILD_HASH
+    Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+        "MaBuildHash:\t" MONIKA_BUILD_HASH
+    ));
+#endif
+
+#ifdef MONIKA_BUILD_TAG
+    Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+        "MaBuildTag:\t" MONIKA_BUILD_TAG
+    ));
+#endif
+
+#ifdef MONIKA_BUILD_ORIGIN
+    Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+        "MaBuildOrigin:\t" MONIKA_BUILD_ORIGIN
+    ));
+#endif
+
+#ifndef MONIKA_BUILD_AUTHOR
+#define MONIKA_BUILD_AUTHOR "lxmonika Authors & Contributors"
+#endif
+
+#ifndef MONIKA_BUILD_YEAR
+#define MONIKA_BUILD_YEAR   (&__DATE__[7])
+#endif
+
+    if (strcmp(MONIKA_BUILD_YEAR, "2023") == 0)
+    {
+        Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+            "MaCopyright:\tCopyright (C) 2023 %s", MONIKA_BUILD_AUTHOR
+        ));
+    }
+    else
+    {
+        Write(_snprintf(RlStaticInformation + uLength, uSizeLeft + 1,
+            "MaCopyright:\tCopyright (C) 2023-%s %s", MONIKA_BUILD_YEAR, MONIKA_BUILD_AUTHOR
+        ));
+    }
+
+    RlStaticInformation[uLength] = '\0';
+    RlStaticInformationLength = uLength;
+}
+
+static
+NTSTATUS
+RlStartSession(
+    _In_ PRL_PICO_SESSION_ATTRIBUTES pUserAttributes,
+    _In_opt_ PMA_PICO_SESSION_COMPLETION pCompletion,
+    _In_opt_ PVOID pCompletionContext
+)
+{
+    SIZE_T uSize;
+
+    __try
+    {
+        uSize = pUserAttributes->Size;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    if (uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES_V2)
+        || uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES_V3)
+        || uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES_V4))
+    {
+        return RlStartPackedSession((PRL_PICO_SESSION_ATTRIBUTES_V2)pUserAttributes, uSize,
+            pCompletion, pCompletionContext);
+    }
+
+    // Declare handles and their cleaners.
+
+    HANDLE hdlRootDirectory = NULL;
+    HANDLE hdlCurrentWorkingDirectory = NULL;
+
+    AUTO_RESOURCE(hdlRootDirectory, ZwClose);
+    AUTO_RESOURCE(hdlCurrentWorkingDirectory, ZwClose);
+
+    // Declare strings and the arena that owns them.
+
+    PoolAllocator arena = PoolAllocator::Arena(RL_SESSION_ARENA_CHUNK_SIZE, MA_REALITY_TAG);
+
+    UNICODE_STRING strRootDirectory = { 0 };
+    UNICODE_STRING strCurrentWorkingDirectory = { 0 };
+
+    _RL_UNICODE_STRING_LIST strListProviderArgs, strListArgs, strListEnvironment;
+
+    SIZE_T uProviderIndex;
+    RL_PICO_SESSION_PLACEMENT placement = { 0 };
+
+    __try
+    {
+        if (uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES))
+        {
+            placement = pUserAttributes->Placement;
+        }
+        else if (uSize != RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET)
+        {
+            return STATUS_INFO_LENGTH_MISMATCH;
+        }
+
+        if (pUserAttributes->ProviderIndex < MaPicoProviderMaxCount)
+        {
+            uProviderIndex = pUserAttributes->ProviderIndex;
+        }
+        else
+        {
+            WCHAR providerName[RL_PROVIDER_NAME_SIZE];
+            MA_RETURN_IF_FAIL(RlCopyProviderName(providerName, pUserAttributes->ProviderName));
+            MA_RETURN_IF_FAIL(MaFindPicoProvider(providerName, &uProviderIndex));
+        }
+
+        // Convert these paths into handles
+
+        MA_RETURN_IF_FAIL(RlOpenSessionDirectory(pUserAttributes->RootDirectory,
+            &hdlRootDirectory));
+        MA_RETURN_IF_FAIL(RlOpenSessionDirectory(pUserAttributes->CurrentWorkingDirectory,
+            &hdlCurrentWorkingDirectory));
+
+        // While the ioctl is blocking, other threads may still modify the passes strings as
+        // they please. Sanitize and keep our own copy of these strings before we exit the
+        // __try block.
+
+        MA_RETURN_IF_FAIL(RlCopySessionString(arena, strRootDirectory,
+            pUserAttributes->RootDirectory));
+        MA_RETURN_IF_FAIL(RlCopySessionString(arena, strCurrentWorkingDirectory,
+            pUserAttributes->CurrentWorkingDirectory));
+
+        MA_RETURN_IF_FAIL(RlCopySessionStringList(arena, strListProviderArgs,
+            pUserAttributes->ProviderArgs, pUserAttributes->ProviderArgsCount));
+        MA_RETURN_IF_FAIL(RlCopySessionStringList(arena, strListArgs,
+            pUserAttributes->Args, pUserAttributes->ArgsCount));
+        MA_RETURN_IF_FAIL(RlCopySessionStringList(arena, strListEnvironment,
+            pUserAttributes->Environment, pUserAttributes->EnvironmentCount));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    MA_PICO_SESSION_ATTRIBUTES maAttributes
+    {
+        .Size = sizeof(MA_PICO_SESSION_ATTRIBUTES),
+        .RootDirectory = hdlRootDirectory,
+        .CurrentWorkingDirectory = hdlCurrentWorkingDirectory,
+        .ProviderArgsCount = strListProviderArgs.Length,
+        .ProviderArgs = strListProviderArgs.Strings,
+        .ArgsCount = strListArgs.Length,
+        .Args = strListArgs.Strings,
+        .EnvironmentCount = strListEnvironment.Length,
+        .Environment = strListEnvironment.Strings
+    };
+    RtlCopyMemory(&maAttributes.Placement, &placement, sizeof(placement));
+
+    return RlLaunchSession(uProviderIndex, &maAttributes, pCompletion, pCompletionContext,
+        NULL);
+}
+
+static
+NTSTATUS
+RlStartPackedSession(
+    _In_ PRL_PICO_SESSION_ATTRIBUTES_V2 pUserAttributes,
+    _In_ SIZE_T uSize,
+    _In_opt_ PMA_PICO_SESSION_COMPLETION pCompletion,
+    _In_opt_ PVOID pCompletionContext
+)
+{
+    RL_PICO_SESSION_ATTRIBUTES_V2 attributes;
+    PHANDLE pUserProcessHandle = NULL;
+    RL_PICO_SESSION_PLACEMENT placement = { 0 };
+
+    // Holds the UNICODE_STRINGs of all list entries, followed by a copy of the caller's data.
+    PUCHAR pBuffer = NULL;
+    SIZE_T uBufferSize = 0;
+    AUTO_RESOURCE(pBuffer, [&](auto p) { MapFreePool(p, uBufferSize, MA_REALITY_TAG); });
+
+    SIZE_T uCount;
+    PUNICODE_STRING pStrings;
+    PUCHAR pData;
+
+    __try
+    {
+        attributes = *pUserAttributes;
+
+        if (attributes.Size != uSize)
+        {
+            return STATUS_INFO_LENGTH_MISMATCH;
+        }
+
+        if (uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES_V3)
+            || uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES_V4))
+        {
+            PRL_PICO_SESSION_ATTRIBUTES_V3 pUserAttributesV3 =
+                (PRL_PICO_SESSION_ATTRIBUTES_V3)pUserAttributes;
+
+            if (pUserAttributesV3->Reserved != 0)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            pUserProcessHandle = pUserAttributesV3->ProcessHandle;
+        }
+
+        if (uSize == sizeof(RL_PICO_SESSION_ATTRIBUTES_V4))
+        {
+            placement = ((PRL_PICO_SESSION_ATTRIBUTES_V4)pUserAttributes)->Placement;
+        }
+
+        if (attributes.DataLength == 0 || attributes.DataLength > RL_PICO_SESSION_DATA_MAX)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        uCount = (SIZE_T)attributes.ProviderArgsCount + attributes.ArgsCount
+            + attributes.EnvironmentCount;
+
+        if (attributes.StringsOffset % TYPE_ALIGNMENT(RL_PICO_PACKED_STRING) != 0
+            || attributes.StringsOffset + uCount * sizeof(RL_PICO_PACKED_STRING)
+                > attributes.DataLength)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        uBufferSize = uCount * sizeof(UNICODE_STRING) + attributes.DataLength;
+        pBuffer = (PUCHAR)MapAllocatePool(PagedPool, uBufferSize, MA_REALITY_TAG);
+        if (pBuffer == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+
+        pStrings = (PUNICODE_STRING)pBuffer;
+        pData = pBuffer + uCount * sizeof(UNICODE_STRING);
+
+        if (ExGetPreviousMode() != KernelMode)
+        {
+            ProbeForRead(attributes.Data, attributes.DataLength, sizeof(WCHAR));
+        }
+
+        RtlCopyMemory(pData, attributes.Data, attributes.DataLength);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    // From here on, only the kernel copy is used, so it cannot change behind our back.
+
+    const auto Unpack = [&](const RL_PICO_PACKED_STRING& packed, UNICODE_STRING& str)
+    {
+        if (packed.Offset % sizeof(WCHAR) != 0 || packed.Length % sizeof(WCHAR) != 0
+            || packed.Length > MAXUSHORT
+            || (SIZE_T)packed.Offset + packed.Length > attributes.DataLength)
+        {
+            return false;
+        }
+
+        str.Buffer = (PWCH)(pData + packed.Offset);
+        str.Length = (USHORT)packed.Length;
+        str.MaximumLength = (USHORT)packed.Length;
+
+        return true;
+    };
+
+    PRL_PICO_PACKED_STRING pPackedStrings = (PRL_PICO_PACKED_STRING)
+        (pData + attributes.StringsOffset);
+
+    for (SIZE_T i = 0; i < uCount; ++i)
+    {
+        if (!Unpack(pPackedStrings[i], pStrings[i]))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    UNICODE_STRING strRootDirectory;
+    UNICODE_STRING strCurrentWorkingDirectory;
+
+    if (!Unpack(attributes.RootDirectory, strRootDirectory)
+        || !Unpack(attributes.CurrentWorkingDirectory, strCurrentWorkingDirectory))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SIZE_T uProviderIndex;
+
+    if (attributes.ProviderIndex < MaPicoProviderMaxCount)
+    {
+        uProviderIndex = attributes.ProviderIndex;
+    }
+    else
+    {
+        // MaFindPicoProvider wants a null-terminated string.
+        UNICODE_STRING strProviderName;
+        if (!Unpack(attributes.ProviderName, strProviderName)
+            || (SIZE_T)attributes.ProviderName.Offset + attributes.ProviderName.Length
+                + sizeof(WCHAR) > attributes.DataLength
+            || strProviderName.Buffer[strProviderName.Length / sizeof(WCHAR)] != L'\0')
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        MA_RETURN_IF_FAIL(MaFindPicoProvider(strProviderName.Buffer, &uProviderIndex));
+    }
+
+    HANDLE hdlRootDirectory = NULL;
+    HANDLE hdlCurrentWorkingDirectory = NULL;
+
+    AUTO_RESOURCE(hdlRootDirectory, ZwClose);
+    AUTO_RESOURCE(hdlCurrentWorkingDirectory, ZwClose);
+
+    MA_RETURN_IF_FAIL(RlOpenSessionDirectory(&strRootDirectory, &hdlRootDirectory));
+    MA_RETURN_IF_FAIL(RlOpenSessionDirectory(&strCurrentWorkingDirectory,
+        &hdlCurrentWorkingDirectory));
+
+    MA_PICO_SESSION_ATTRIBUTES maAttributes
+    {
+        .Size = sizeof(MA_PICO_SESSION_ATTRIBUTES),
+        .RootDirectory = hdlRootDirectory,
+        .CurrentWorkingDirectory = hdlCurrentWorkingDirectory,
+        .ProviderArgsCount = attributes.ProviderArgsCount,
+        .ProviderArgs = pStrings,
+        .ArgsCount = attributes.ArgsCount,
+        .Args = pStrings + attributes.ProviderArgsCount,
+        .EnvironmentCount = attributes.EnvironmentCount,
+        .Environment = pStrings + attributes.ProviderArgsCount + attributes.ArgsCount
+    };
+    RtlCopyMemory(&maAttributes.Placement, &placement, sizeof(placement));
+
+    return RlLaunchSession(uProviderIndex, &maAttributes, pCompletion, pCompletionContext,
+        pUserProcessHandle);
+}
+
+static
+NTSTATUS
+RlLaunchSession(
+    _In_ SIZE_T uProviderIndex,
+    _Inout_ PMA_PICO_SESSION_ATTRIBUTES pAttributes,
+    _In_opt_ PMA_PICO_SESSION_COMPLETION pCompletion,
+    _In_opt_ PVOID pCompletionContext,
+    _Out_opt_ PHANDLE pUserProcessHandle
+)
+{
+    HANDLE hdlHostProcess = NULL;
+    HANDLE hdlConsole = NULL;
+    HANDLE hdlInput = NULL;
+    HANDLE hdlOutput = NULL;
+
+    AUTO_RESOURCE(hdlHostProcess, ZwClose);
+    AUTO_RESOURCE(hdlConsole, ZwClose);
+    AUTO_RESOURCE(hdlInput, ZwClose);
+    AUTO_RESOURCE(hdlOutput, ZwClose);
+
+    MA_RETURN_IF_FAIL(RlOpenSessionConsole(&hdlHostProcess, &hdlConsole,
+        &hdlInput, &hdlOutput));
+
+    pAttributes->HostProcess = hdlHostProcess;
+    pAttributes->Console = hdlConsole;
+    pAttributes->Input = hdlInput;
+    pAttributes->Output = hdlOutput;
+
+    pAttributes->Process = NULL;
+
+    // lxmonika retains control of all its auto resources. The callee is responsible for
+    // duplicating.
+    if (pCompletion != NULL)
+    {
+        NTSTATUS status = MaStartSessionAsync(uProviderIndex, pAttributes,
+            pCompletion, pCompletionContext);
+
+        if (status != STATUS_NOT_SUPPORTED)
+        {
+            RlReturnSessionProcess(pAttributes->Process, pUserProcessHandle);
+            return status;
+        }
+
+        // The provider only knows how to start sessions synchronously.
+    }
+
+    RlReturnSessionProcess(NULL, pUserProcessHandle);
+    return MaStartSession(uProviderIndex, pAttributes);
+}
+
+static
+VOID
+RlReturnSessionProcess(
+    _In_opt_ PEPROCESS pProcess,
+    _Out_opt_ PHANDLE pUserProcessHandle
+)
+{
+    HANDLE hdlProcess = NULL;
+
+    if (pProcess != NULL)
+    {
+        // Opened in the caller's handle table, for the caller to wait on or terminate.
+        if (pUserProcessHandle != NULL)
+        {
+            NTSTATUS status = ObOpenObjectByPointer(
+                pProcess,
+                0,
+                NULL,
+                SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_TERMINATE,
+                *PsProcessType,
+                KernelMode,
+                &hdlProcess
+            );
+
+            if (!NT_SUCCESS(status))
+            {
+                Logger::LogWarning("Failed to open the session process, status=", (PVOID)status);
+                hdlProcess = NULL;
+            }
+        }
+
+        ObDereferenceObject(pProcess);
+    }
+
+    if (pUserProcessHandle == NULL)
+    {
+        return;
+    }
+
+    __try
+    {
+        if (ExGetPreviousMode() != KernelMode)
+        {
+            ProbeForWrite(pUserProcessHandle, sizeof(HANDLE), TYPE_ALIGNMENT(HANDLE));
+        }
+
+        *pUserProcessHandle = hdlProcess;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        // The session is already running, so only the handle is given up.
+        if (hdlProcess != NULL)
+        {
+            ZwClose(hdlProcess);
+        }
+    }
+}
+
+static
+NTSTATUS
+RlCopySessionString(
+    _Inout_ PoolAllocator& arena,
+    _Out_ UNICODE_STRING& dstString,
+    _In_ PUNICODE_STRING src
+)
+{
+    // Callers are in a __try/__except block. Like RlCopyProviderName, the string is captured
+    // once, and only its user copy is probed.
+    if (ExGetPreviousMode() != KernelMode)
+    {
+        ProbeForRead(src, sizeof(UNICODE_STRING), TYPE_ALIGNMENT(UNICODE_STRING));
+    }
+
+    UNICODE_STRING strSource = *src;
+    SIZE_T uLength = strSource.Length / sizeof(WCHAR);
+
+    if (ExGetPreviousMode() != KernelMode)
+    {
+        ProbeForRead(strSource.Buffer, uLength * sizeof(WCHAR), sizeof(WCHAR));
+    }
+
+    PWSTR dst = arena.Allocate<WCHAR>(uLength + 1);
+    if (dst == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    memcpy(dst, strSource.Buffer, uLength * sizeof(WCHAR));
+    dst[uLength] = L'\0';
+    dstString.Buffer = dst;
+    dstString.Length = (USHORT)(uLength * sizeof(WCHAR));
+    dstString.MaximumLength = (USHORT)((uLength + 1) * sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+RlCopySessionStringList(
+    _Inout_ PoolAllocator& arena,
+    _Inout_ _RL_UNICODE_STRING_LIST& dstStringList,
+    _In_reads_(srcCount) PUNICODE_STRING src,
+    _In_ SIZE_T srcCount
+)
+{
+    if (srcCount > MAXSIZE_T / sizeof(UNICODE_STRING))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (ExGetPreviousMode() != KernelMode)
+    {
+        ProbeForRead(src, srcCount * sizeof(UNICODE_STRING), TYPE_ALIGNMENT(UNICODE_STRING));
+    }
+
+    dstStringList.Strings = arena.Allocate<UNICODE_STRING>(srcCount);
+    if (dstStringList.Strings == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    dstStringList.Length = srcCount;
+
+    for (SIZE_T i = 0; i < srcCount; ++i)
+    {
+        MA_RETURN_IF_FAIL(RlCopySessionString(arena, dstStringList.Strings[i], &src[i]));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+RlCopyProviderName(
+    _Out_writes_(RL_PROVIDER_NAME_SIZE) PWSTR dst,
+    _In_ PUNICODE_STRING src
+)
+{
+    // Callers are in a __try/__except block. The name is probed here, since MaFindPicoProvider
+    // takes kernel pointers as well.
+    if (ExGetPreviousMode() != KernelMode)
+    {
+        ProbeForRead(src, sizeof(UNICODE_STRING), TYPE_ALIGNMENT(UNICODE_STRING));
+    }
+
+    UNICODE_STRING strName = *src;
+    SIZE_T uLength = strName.Length / sizeof(WCHAR);
+
+    if (uLength >= RL_PROVIDER_NAME_SIZE)
+    {
+        return STATUS_NAME_TOO_LONG;
+    }
+
+    if (ExGetPreviousMode() != KernelMode)
+    {
+        ProbeForRead(strName.Buffer, uLength * sizeof(WCHAR), sizeof(WCHAR));
+    }
+
+    memcpy(dst, strName.Buffer, uLength * sizeof(WCHAR));
+    dst[uLength] = L'\0';
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+RlOpenSessionDirectory(
+    _In_ PUNICODE_STRING pPath,
+    _Out_ PHANDLE pHandle
+)
+{
+    OBJECT_ATTRIBUTES objectAttributes;
+    IO_STATUS_BLOCK ioStatus;
+
+    InitializeObjectAttributes(
+        &objectAttributes,
+        pPath,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+        NULL,
+        NULL
+    );
+
+    return ZwCreateFile(
+        pHandle,
+        FILE_LIST_DIRECTORY | FILE_TRAVERSE,
+        &objectAttributes,
+        &ioStatus,
+        NULL,
+        0,
+        FILE_SHARE_VALID_FLAGS,
+        FILE_OPEN,
+        FILE_DIRECTORY_FILE,
+        NULL,
+        0
+    );
+}
+
+static
+NTSTATUS
+RlOpenSessionConsole(
+    _Out_ PHANDLE pHostProcess,
+    _Out_ PHANDLE pConsole,
+    _Out_ PHANDLE pInput,
+    _Out_ PHANDLE pOutput
+)
+{
+    // The caller closes whatever has been opened, even on failure.
+    *pHostProcess = NULL;
+    *pConsole = NULL;
+    *pInput = NULL;
+    *pOutput = NULL;
+
+    MA_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        PsGetCurrentProcess(),
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        PROCESS_ALL_ACCESS,
+        *PsProcessType,
+        KernelMode,
+        pHostProcess
+    ));
+
+    // Repeated sessions from the same host reuse its console attachment.
+    MA_RETURN_IF_FAIL(CdpGetHostConsole(
+        PsGetCurrentProcess(),
+        pConsole,
+        pInput,
+        pOutput
+    ));
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Self benchmark
+//
+
+typedef struct _RL_SELF_BENCHMARK_RUN RL_SELF_BENCHMARK_RUN, *PRL_SELF_BENCHMARK_RUN;
+
+typedef struct _RL_SELF_BENCHMARK_WORKER {
+    PRL_SELF_BENCHMARK_RUN Run;
+    PETHREAD Thread;
+    PROCESSOR_NUMBER Processor;
+    // Iterations samples in cycles, sorted once the worker is done.
+    PULONG Samples;
+    ULONG64 Failures;
+    // Never shared, so it is formatted without its lock.
+    RL_FILE File;
+} RL_SELF_BENCHMARK_WORKER, *PRL_SELF_BENCHMARK_WORKER;
+
+typedef NTSTATUS RL_SELF_BENCHMARK_ROUTINE(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+);
+typedef RL_SELF_BENCHMARK_ROUTINE *PRL_SELF_BENCHMARK_ROUTINE;
+
+struct _RL_SELF_BENCHMARK_RUN {
+    PRL_SELF_BENCHMARK_ROUTINE Routine;
+    ULONG64 Iterations;
+    // Waits for the workers in the ioctl, so it outlives the run without a reference.
+    PETHREAD CallerThread;
+    PCWSTR ProviderName;
+    DWORD ProviderIndex;
+    KEVENT Start;
+};
+
+// Runs time lxmonika, not each other.
+static volatile LONG RlSelfBenchmarkRunning = FALSE;
+
+static
+NTSTATUS
+RlBenchmarkNone(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+)
+{
+    UNREFERENCED_PARAMETER(pWorker);
+    UNREFERENCED_PARAMETER(uIteration);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+RlBenchmarkGetObjectContext(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+)
+{
+    UNREFERENCED_PARAMETER(uIteration);
+
+    PMA_CONTEXT pContext;
+    return MapGetObjectContext(pWorker->Run->CallerThread, &pContext);
+}
+
+static
+NTSTATUS
+RlBenchmarkContextChurn(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+)
+{
+    UNREFERENCED_PARAMETER(uIteration);
+
+    // Also fails once the provider has been unregistered.
+    PMA_CONTEXT pContext = MapAllocateContext(pWorker->Run->ProviderIndex, NULL, NULL, NULL);
+
+    if (pContext == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    MapFreeContext(pContext);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+RlBenchmarkFindProvider(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+)
+{
+    UNREFERENCED_PARAMETER(uIteration);
+
+    SIZE_T uIndex;
+    return MaFindPicoProvider(pWorker->Run->ProviderName, &uIndex);
+}
+
+static
+NTSTATUS
+RlBenchmarkFileUpdate(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+)
+{
+    UNREFERENCED_PARAMETER(uIteration);
+
+    return RlFileUpdateInformation(&pWorker->File);
+}
+
+static
+NTSTATUS
+RlBenchmarkLog(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker,
+    _In_ ULONG64 uIteration
+)
+{
+    UNREFERENCED_PARAMETER(pWorker);
+
+    if (!Logger::LogWarning("Self benchmark iteration ", uIteration, "."))
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Indexed by RlSelfBenchmarkPrimitives.
+static const PRL_SELF_BENCHMARK_ROUTINE RlSelfBenchmarkRoutines[] =
+{
+    RlBenchmarkNone,
+    RlBenchmarkGetObjectContext,
+    RlBenchmarkContextChurn,
+    RlBenchmarkFindProvider,
+    RlBenchmarkFileUpdate,
+    RlBenchmarkLog
+};
+
+static_assert(ARRAYSIZE(RlSelfBenchmarkRoutines) == RlSelfBenchmarkMaxCount);
+
+static
+int
+__cdecl
+RlCompareSamples(
+    _In_ const void* pLeft,
+    _In_ const void* pRight
+)
+{
+    ULONG uLeft = *(const ULONG*)pLeft;
+    ULONG uRight = *(const ULONG*)pRight;
+
+    return (uLeft > uRight) - (uLeft < uRight);
+}
+
+static
+VOID
+RlSummarizeSamples(
+    _In_reads_(uCount) const ULONG* pSorted,
+    _In_ SIZE_T uCount,
+    _In_ ULONG64 uFailures,
+    _Out_ PRL_SELF_BENCHMARK_RESULT pResult
+)
+{
+    const auto Percentile = [&](SIZE_T uPerMille)
+    {
+        return (ULONG64)pSorted[(uCount - 1) * uPerMille / 1000];
+    };
+
+    ULONG64 uTotal = 0;
+    for (SIZE_T i = 0; i < uCount; ++i)
+    {
+        uTotal += pSorted[i];
+    }
+
+    *pResult = RL_SELF_BENCHMARK_RESULT
+    {
+        .Samples = uCount,
+        .Failures = uFailures,
+        .Minimum = pSorted[0],
+        .Median = Percentile(500),
+        .P90 = Percentile(900),
+        .P99 = Percentile(990),
+        .P999 = Percentile(999),
+        .Maximum = pSorted[uCount - 1],
+        .Total = uTotal
+    };
+}
+
+static
+VOID
+RlSelfBenchmarkWorker(
+    _In_ PVOID pContext
+)
+{
+    PRL_SELF_BENCHMARK_WORKER pWorker = (PRL_SELF_BENCHMARK_WORKER)pContext;
+    PRL_SELF_BENCHMARK_RUN pRun = pWorker->Run;
+
+    GROUP_AFFINITY affinity =
+    {
+        .Mask = (KAFFINITY)1 << pWorker->Processor.Number,
+        .Group = pWorker->Processor.Group
+    };
+    KeSetSystemGroupAffinityThread(&affinity, NULL);
+
+    KeWaitForSingleObject(&pRun->Start, Executive, KernelMode, FALSE, NULL);
+
+    for (ULONG64 i = 0; i < pRun->Iterations; ++i)
+    {
+        ULONG64 uStart = ReadTimeStampCounter();
+
+        NTSTATUS status = pRun->Routine(pWorker, i);
+
+        ULONG64 uCycles = ReadTimeStampCounter() - uStart;
+
+        pWorker->Samples[i] = (ULONG)min(uCycles, (ULONG64)MAXULONG);
+
+        if (!NT_SUCCESS(status))
+        {
+            ++pWorker->Failures;
+        }
+    }
+
+    // Here rather than after the run, so that the workers sort in parallel.
+    qsort(pWorker->Samples, (SIZE_T)pRun->Iterations, sizeof(ULONG), RlCompareSamples);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static
+NTSTATUS
+RlStartSelfBenchmarkWorker(
+    _Inout_ PRL_SELF_BENCHMARK_WORKER pWorker
+)
+{
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlThread = NULL;
+    MA_RETURN_IF_FAIL(PsCreateSystemThread(
+        &hdlThread,
+        THREAD_ALL_ACCESS,
+        &objAttributes,
+        NULL,
+        NULL,
+        RlSelfBenchmarkWorker,
+        pWorker
+    ));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    return ObReferenceObjectByHandle(
+        hdlThread,
+        THREAD_ALL_ACCESS,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&pWorker->Thread,
+        NULL
+    );
+}
+
+static
+NTSTATUS
+RlRunSelfBenchmarkWorkers(
+    _Inout_ PRL_SELF_BENCHMARK pBenchmark,
+    _Inout_ PRL_SELF_BENCHMARK_RUN pRun
+)
+{
+    ULONG uWorkers = pBenchmark->Workers;
+    ULONG uProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    SIZE_T uSamplesSize = (SIZE_T)uWorkers * pRun->Iterations * sizeof(ULONG);
+
+    PULONG pSamples = (PULONG)MapAllocatePool(PagedPool, uSamplesSize, MA_REALITY_TAG);
+
+    if (pSamples == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pSamples, [&](auto p) { MapFreePool(p, uSamplesSize, MA_REALITY_TAG); });
+
+    // The scratch files hold fast mutexes, which must not be paged.
+    SIZE_T uWorkersSize = uWorkers * sizeof(RL_SELF_BENCHMARK_WORKER);
+
+    PRL_SELF_BENCHMARK_WORKER pWorkers = (PRL_SELF_BENCHMARK_WORKER)MapAllocatePool(
+        POOL_FLAG_NON_PAGED, uWorkersSize, MA_REALITY_TAG);
+
+    if (pWorkers == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pWorkers, [&](auto p) { MapFreePool(p, uWorkersSize, MA_REALITY_TAG); });
+
+    for (ULONG i = 0; i < uWorkers; ++i)
+    {
+        pWorkers[i].Run = pRun;
+        pWorkers[i].Samples = pSamples + i * pRun->Iterations;
+        MA_RETURN_IF_FAIL(KeGetProcessorNumberFromIndex(i % uProcessors,
+            &pWorkers[i].Processor));
+        MA_RETURN_IF_FAIL(RlpFileOpen(&pWorkers[i].File));
+    }
+
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG uStarted = 0;
+
+    // Workers that did start still have to be let go and waited for.
+    for (; uStarted < uWorkers && NT_SUCCESS(status); ++uStarted)
+    {
+        status = RlStartSelfBenchmarkWorker(&pWorkers[uStarted]);
+    }
+
+    LARGE_INTEGER liFrequency;
+    LARGE_INTEGER liStart = KeQueryPerformanceCounter(&liFrequency);
+
+    KeSetEvent(&pRun->Start, IO_NO_INCREMENT, FALSE);
+
+    for (ULONG i = 0; i < uStarted; ++i)
+    {
+        if (pWorkers[i].Thread != NULL)
+        {
+            KeWaitForSingleObject(pWorkers[i].Thread, Executive, KernelMode, FALSE, NULL);
+            ObDereferenceObject(pWorkers[i].Thread);
+        }
+    }
+
+    LARGE_INTEGER liEnd = KeQueryPerformanceCounter(NULL);
+
+    MA_RETURN_IF_FAIL(status);
+
+    pBenchmark->Frequency = liFrequency.QuadPart;
+    pBenchmark->ElapsedTicks = liEnd.QuadPart - liStart.QuadPart;
+
+    RtlZeroMemory(pBenchmark->PerWorker, sizeof(pBenchmark->PerWorker));
+
+    ULONG64 uFailures = 0;
+    for (ULONG i = 0; i < uWorkers; ++i)
+    {
+        RlSummarizeSamples(pWorkers[i].Samples, (SIZE_T)pRun->Iterations,
+            pWorkers[i].Failures, &pBenchmark->PerWorker[i]);
+        pBenchmark->PerWorker[i].Processor = KeGetProcessorIndexFromNumber(
+            &pWorkers[i].Processor);
+
+        uFailures += pWorkers[i].Failures;
+    }
+
+    SIZE_T uSamples = (SIZE_T)(uWorkers * pRun->Iterations);
+    qsort(pSamples, uSamples, sizeof(ULONG), RlCompareSamples);
+    RlSummarizeSamples(pSamples, uSamples, uFailures, &pBenchmark->Combined);
 
     return STATUS_SUCCESS;
 }
 
+static
+NTSTATUS
+RlRunSelfBenchmark(
+    _Inout_ PRL_SELF_BENCHMARK pBenchmark
+)
+{
+    if (pBenchmark->Workers == 0)
+    {
+        pBenchmark->Workers = min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+            (ULONG)RL_SELF_BENCHMARK_WORKERS_MAX);
+    }
+
+    if (pBenchmark->Primitive >= RlSelfBenchmarkMaxCount
+        || pBenchmark->Iterations == 0
+        || pBenchmark->Workers > RL_SELF_BENCHMARK_WORKERS_MAX
+        || pBenchmark->Iterations > RL_SELF_BENCHMARK_SAMPLES_MAX / pBenchmark->Workers)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pBenchmark->ProviderName[RL_PROVIDER_NAME_SIZE - 1] = L'\0';
+
+    RL_SELF_BENCHMARK_RUN run
+    {
+        .Routine = RlSelfBenchmarkRoutines[pBenchmark->Primitive],
+        .Iterations = pBenchmark->Iterations,
+        .CallerThread = PsGetCurrentThread(),
+        .ProviderName = pBenchmark->ProviderName
+    };
+
+    if (pBenchmark->Primitive == RlSelfBenchmarkContextChurn)
+    {
+        SIZE_T uIndex;
+        MA_RETURN_IF_FAIL(MaFindPicoProvider(pBenchmark->ProviderName, &uIndex));
+        run.ProviderIndex = (DWORD)uIndex;
+    }
+
+    KeInitializeEvent(&run.Start, NotificationEvent, FALSE);
+
+    if (InterlockedCompareExchange(&RlSelfBenchmarkRunning, TRUE, FALSE) != FALSE)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    NTSTATUS status = RlRunSelfBenchmarkWorkers(pBenchmark, &run);
+
+    InterlockedExchange(&RlSelfBenchmarkRunning, FALSE);
+
+    return status;
+}
+
 NTSTATUS
 RlEscape()
 {
@@ -81,15 +81,7 @@ static LX_FILE_SEEK                             RlLxssFileSeek;
 // Lifetime functions
 //
 
-#define MA_TRY_RESOLVE_SYMBOL(name)                                                             \
-    do                                                                                          \
-    {                                                                                           \
-        status = MdlpGetProcAddress(hdlLxCore, #name, (PVOID*)&name);                           \
-        if (!NT_SUCCESS(status))                                                                \
-        {                                                                                       \
-            Logger::LogError("Failed to resolve " #name);                                       \
-        }                                                                                       \
-    } while (false)
+#define MA_LXCORE_PROC(name)    { #name, (PVOID*)&name }
 
 extern "C"
 NTSTATUS
@@ -108,11 +100,24 @@ RlpInitializeLxssDevice(
         return status;
     }
 
-    MA_TRY_RESOLVE_SYMBOL(LxpDevMiscRegister);
-    MA_TRY_RESOLVE_SYMBOL(LxpUtilTranslateStatus);
-    MA_TRY_RESOLVE_SYMBOL(VfsDeviceMinorAllocate);
-    MA_TRY_RESOLVE_SYMBOL(VfsDeviceMinorDereference);
-    MA_TRY_RESOLVE_SYMBOL(VfsFileAllocate);
+    MDL_PROC pLxCoreProcs[] =
+    {
+        MA_LXCORE_PROC(LxpDevMiscRegister),
+        MA_LXCORE_PROC(LxpUtilTranslateStatus),
+        MA_LXCORE_PROC(VfsDeviceMinorAllocate),
+        MA_LXCORE_PROC(VfsDeviceMinorDereference),
+        MA_LXCORE_PROC(VfsFileAllocate)
+    };
+
+    status = MdlpGetProcAddresses(hdlLxCore, pLxCoreProcs, ARRAYSIZE(pLxCoreProcs));
+
+    for (SIZE_T i = 0; i < ARRAYSIZE(pLxCoreProcs); ++i)
+    {
+        if (*pLxCoreProcs[i].Proc == NULL)
+        {
+            Logger::LogError("Failed to resolve ", pLxCoreProcs[i].Name);
+        }
+    }
 
     LX_SUBSYSTEM subsystem =
     {
@@ -261,7 +266,9 @@ RlLxssFileDelete(
 )
 {
     UNREFERENCED_PARAMETER(pContext);
-    UNREFERENCED_PARAMETER(pFile);
+
+    PMA_FILE pMaFile = (PMA_FILE)pFile;
+    RlpFileClose(&pMaFile->File);
 
     return 0;
 }
@@ -345,15 +352,17 @@ RlLxssFileIoctl(
                 NULL, 0, &ulByteCount, pRequestedProvider, ulRequestByteCount
             );
 
+            // The second conversion updates ulByteCount, the allocation keeps its own size.
             PWSTR pUnicodeRequestedProvider = NULL;
+            ULONG ulAllocatedByteCount = ulByteCount;
             AUTO_RESOURCE(pUnicodeRequestedProvider,
-                [](auto p) { ExFreePoolWithTag(p, MA_REALITY_TAG); }
+                [&](auto p) { MapFreePool(p, ulAllocatedByteCount, MA_REALITY_TAG); }
             );
 
             if (NT_SUCCESS(status))
             {
-                pUnicodeRequestedProvider = (PWSTR)ExAllocatePool2(
-                    PagedPool, ulByteCount, MA_REALITY_TAG
+                pUnicodeRequestedProvider = (PWSTR)MapAllocatePool(
+                    PagedPool, ulAllocatedByteCount, MA_REALITY_TAG
                 );
 
                 if (pUnicodeRequestedProvider == NULL)
@@ -390,13 +399,8 @@ RlLxssFileIoctl(
             {
                 if (pMaContext->Provider != uNewIndex)
                 {
-                    PMA_CONTEXT pNewContext = MapAllocateContext((DWORD)uNewIndex, NULL, NULL);
-                    if (pNewContext == NULL)
-                    {
-                        return -LINUX_ENOMEM;
-                    }
-
-                    status = MapPushContext(pMaContext, pNewContext);
+                    // Keeps the image name across the switch.
+                    status = MapPushContext(pMaContext, (DWORD)uNewIndex, NULL);
 
                     if (!NT_SUCCESS(status))
                     {
@@ -427,7 +431,9 @@ RlLxssFileIoctl(
     {
         PMA_FILE pMaFile = (PMA_FILE)pFile;
 
-        NTSTATUS status = RlpFileIoctl(&pMaFile->File, uCode, pBuffer);
+        // Linux ioctls carry no length. pBuffer is caller memory, which every handler only
+        // accesses under __try.
+        NTSTATUS status = RlpFileIoctl(&pMaFile->File, uCode, pBuffer, MAXSIZE_T);
 
         if (!NT_SUCCESS(status))
         {
@@ -29,6 +29,32 @@ static PDRIVER_DISPATCH RlNextDeviceWrite           = NULL;
 static PDRIVER_DISPATCH RlNextDeviceControl         = NULL;
 static PDRIVER_DISPATCH RlNextDeviceSetInformation  = NULL;
 
+static DRIVER_CANCEL RlWin32CancelSession;
+static MA_PICO_SESSION_COMPLETION RlWin32CompleteSession;
+
+static FAST_IO_DEVICE_CONTROL RlWin32FastIoDeviceControl;
+
+// Starts as a copy of the dispatch table of lxss, if it has one, so that its other routines keep
+// working. Only the entries below are replaced.
+static FAST_IO_DISPATCH RlFastIoDispatch;
+static PFAST_IO_DISPATCH RlNextFastIoDispatch = NULL;
+
+// Larger requests take the IRP path, which allocates their system buffer.
+#define RL_WIN32_FAST_IO_BUFFER_SIZE (512)
+
+//
+// Pending sessions
+//
+
+typedef struct _RL_WIN32_SESSION_REQUEST {
+    // One reference for the session completion, one for the cancel routine.
+    LONG ReferenceCount;
+    KSPIN_LOCK Lock;
+    // Cleared by whoever completes the IRP.
+    PIRP Irp;
+    ULONG OutputLength;
+} RL_WIN32_SESSION_REQUEST, *PRL_WIN32_SESSION_REQUEST;
+
 //
 // Lifetime functions
 // Not thread-safe, but this should be fine since they are only called by DriverEntry/DriverUnload.
@@ -71,6 +97,18 @@ RlpInitializeWin32Device(
     RlNextDeviceSetInformation = DriverObject->MajorFunction[IRP_MJ_SET_INFORMATION];
     DriverObject->MajorFunction[IRP_MJ_SET_INFORMATION] = RlWin32DeviceSetInformation;
 
+    // fast I/O, for ioctls that fit on the stack. Reads would never get there: the I/O manager
+    // only tries fast reads on cached files, and reality files have no cache map.
+    RlNextFastIoDispatch = DriverObject->FastIoDispatch;
+    if (RlNextFastIoDispatch != NULL)
+    {
+        RtlCopyMemory(&RlFastIoDispatch, RlNextFastIoDispatch,
+            min(RlNextFastIoDispatch->SizeOfFastIoDispatch, sizeof(FAST_IO_DISPATCH)));
+    }
+    RlFastIoDispatch.SizeOfFastIoDispatch = sizeof(FAST_IO_DISPATCH);
+    RlFastIoDispatch.FastIoDeviceControl = RlWin32FastIoDeviceControl;
+    DriverObject->FastIoDispatch = &RlFastIoDispatch;
+
     NTSTATUS status;
 
     status = IoCreateDeviceSecure(
@@ -87,6 +125,8 @@ RlpInitializeWin32Device(
 
     if (!NT_SUCCESS(status))
     {
+        DriverObject->FastIoDispatch = RlNextFastIoDispatch;
+
         if (RlDeviceObject != NULL)
         {
             IoDeleteDevice(RlDeviceObject);
@@ -104,6 +144,7 @@ RlpCleanupWin32Device()
 {
     if (RlDeviceObject != NULL)
     {
+        RlDeviceObject->DriverObject->FastIoDispatch = RlNextFastIoDispatch;
         IoDeleteDevice(RlDeviceObject);
         RlDeviceObject = NULL;
     }
@@ -157,12 +198,12 @@ RlWin32DeviceCreate(
 
     NTSTATUS status = STATUS_SUCCESS;
 
-    PRL_FILE pNewFile = (PRL_FILE)ExAllocatePool2(PagedPool, sizeof(RL_FILE), MA_REALITY_TAG);
+    PRL_FILE pNewFile = (PRL_FILE)MapAllocatePool(PagedPool, sizeof(RL_FILE), MA_REALITY_TAG);
     if (pNewFile == NULL)
     {
         return RlWin32CompleteRequest(pIrp, STATUS_NO_MEMORY);
     }
-    AUTO_RESOURCE(pNewFile, [](auto p) { ExFreePoolWithTag(p, MA_REALITY_TAG); });
+    AUTO_RESOURCE(pNewFile, [](auto p) { MapFreePool(p, sizeof(RL_FILE), MA_REALITY_TAG); });
 
     status = RlpFileOpen(pNewFile);
 
@@ -190,7 +231,8 @@ RlWin32DeviceClose(
     RL_TRY_DISPATCH_TO_NEXT(Close);
 
     PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
-    ExFreePoolWithTag(pIrpStack->FileObject->FsContext, MA_REALITY_TAG);
+    RlpFileClose((PRL_FILE)pIrpStack->FileObject->FsContext);
+    MapFreePool(pIrpStack->FileObject->FsContext, sizeof(RL_FILE), MA_REALITY_TAG);
 
     return RlWin32CompleteRequest(pIrp, STATUS_SUCCESS);
 }
@@ -260,6 +302,175 @@ RlWin32DeviceWrite(
     return RlWin32CompleteRequest(pIrp, status, szBytesTransfered);
 }
 
+static
+VOID
+RlWin32ReleaseSessionRequest(
+    _Inout_ PRL_WIN32_SESSION_REQUEST pRequest
+)
+{
+    if (InterlockedDecrement(&pRequest->ReferenceCount) == 0)
+    {
+        MapFreePool(pRequest, sizeof(RL_WIN32_SESSION_REQUEST), MA_REALITY_TAG);
+    }
+}
+
+static
+NTSTATUS
+RlWin32DeviceStartSession(
+    _Inout_ PIRP pIrp,
+    _In_ PIO_STACK_LOCATION pIrpStack,
+    _Inout_ PRL_FILE pFile
+)
+{
+    // The IRP may be cancelled, and its system buffer freed, while the session is being set up.
+    // Work on a copy of the attributes. The strings they point to are not part of the IRP.
+    union
+    {
+        SIZE_T Size;
+        RL_PICO_SESSION_ATTRIBUTES V1;
+        RL_PICO_SESSION_ATTRIBUTES_V2 V2;
+        RL_PICO_SESSION_ATTRIBUTES_V3 V3;
+        RL_PICO_SESSION_ATTRIBUTES_V4 V4;
+    } attributes;
+
+    ULONG ulInputLength = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+
+    if (ulInputLength < sizeof(SIZE_T))
+    {
+        return RlWin32CompleteRequest(pIrp, STATUS_INFO_LENGTH_MISMATCH);
+    }
+
+    attributes.Size = *(PSIZE_T)pIrp->AssociatedIrp.SystemBuffer;
+
+    if ((attributes.Size != sizeof(attributes.V1)
+            && attributes.Size != RL_PICO_SESSION_ATTRIBUTES_PLACEMENT_OFFSET
+            && attributes.Size != sizeof(attributes.V2) && attributes.Size != sizeof(attributes.V3)
+            && attributes.Size != sizeof(attributes.V4))
+        || ulInputLength < attributes.Size)
+    {
+        return RlWin32CompleteRequest(pIrp, STATUS_INFO_LENGTH_MISMATCH);
+    }
+
+    RtlCopyMemory(&attributes, pIrp->AssociatedIrp.SystemBuffer, attributes.Size);
+
+    PRL_WIN32_SESSION_REQUEST pRequest = (PRL_WIN32_SESSION_REQUEST)
+        MapAllocatePool(POOL_FLAG_NON_PAGED, sizeof(RL_WIN32_SESSION_REQUEST), MA_REALITY_TAG);
+
+    if (pRequest == NULL)
+    {
+        return RlWin32CompleteRequest(pIrp, STATUS_NO_MEMORY);
+    }
+
+    pRequest->ReferenceCount = 2;
+    KeInitializeSpinLock(&pRequest->Lock);
+    pRequest->Irp = pIrp;
+    pRequest->OutputLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    pIrp->Tail.Overlay.DriverContext[0] = pRequest;
+
+    IoMarkIrpPending(pIrp);
+    IoSetCancelRoutine(pIrp, RlWin32CancelSession);
+
+    if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL) != NULL)
+    {
+        // Cancelled before the routine could be set. Nobody else has seen the request.
+        MapFreePool(pRequest, sizeof(RL_WIN32_SESSION_REQUEST), MA_REALITY_TAG);
+        (VOID)RlWin32CompleteRequest(pIrp, STATUS_CANCELLED);
+        return STATUS_PENDING;
+    }
+
+    NTSTATUS status = RlpFileStartSessionAsync(pFile, &attributes,
+        RlWin32CompleteSession, pRequest);
+
+    if (status != STATUS_PENDING)
+    {
+        // Either the session failed to start, or the provider has already waited for it.
+        RlWin32CompleteSession(pRequest, status);
+    }
+
+    // The caller sees the final status through the IRP. Synchronous handles are waited for by
+    // the I/O manager, as before.
+    return STATUS_PENDING;
+}
+
+static
+VOID
+RlWin32CompleteSession(
+    _In_opt_ PVOID pContext,
+    _In_ NTSTATUS status
+)
+{
+    PRL_WIN32_SESSION_REQUEST pRequest = (PRL_WIN32_SESSION_REQUEST)pContext;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&pRequest->Lock, &irql);
+
+    PIRP pIrp = pRequest->Irp;
+    BOOLEAN bCancelRoutineOwned = FALSE;
+
+    if (pIrp != NULL)
+    {
+        if (IoSetCancelRoutine(pIrp, NULL) != NULL)
+        {
+            // The cancel routine will never run.
+            pRequest->Irp = NULL;
+            bCancelRoutineOwned = TRUE;
+        }
+        else
+        {
+            // The cancel routine is about to run and waits for the lock to complete the IRP.
+            pIrp = NULL;
+        }
+    }
+
+    KeReleaseSpinLock(&pRequest->Lock, irql);
+
+    if (pIrp != NULL)
+    {
+        // Exit statuses are mostly success codes, which only reach the caller this way.
+        ULONG_PTR uInfo = 0;
+        if (NT_SUCCESS(status) && pRequest->OutputLength >= sizeof(NTSTATUS))
+        {
+            *(PNTSTATUS)pIrp->AssociatedIrp.SystemBuffer = status;
+            uInfo = sizeof(NTSTATUS);
+        }
+
+        (VOID)RlWin32CompleteRequest(pIrp, status, uInfo);
+    }
+
+    if (bCancelRoutineOwned)
+    {
+        RlWin32ReleaseSessionRequest(pRequest);
+    }
+
+    RlWin32ReleaseSessionRequest(pRequest);
+}
+
+static
+VOID
+RlWin32CancelSession(
+    _Inout_ PDEVICE_OBJECT pDeviceObject,
+    _Inout_ _IRQL_uses_cancel_ PIRP pIrp
+)
+{
+    UNREFERENCED_PARAMETER(pDeviceObject);
+
+    IoReleaseCancelSpinLock(pIrp->CancelIrql);
+
+    PRL_WIN32_SESSION_REQUEST pRequest =
+        (PRL_WIN32_SESSION_REQUEST)pIrp->Tail.Overlay.DriverContext[0];
+
+    // The session keeps running. Its completion finds no IRP and only drops its reference.
+    KIRQL irql;
+    KeAcquireSpinLock(&pRequest->Lock, &irql);
+    pRequest->Irp = NULL;
+    KeReleaseSpinLock(&pRequest->Lock, irql);
+
+    (VOID)RlWin32CompleteRequest(pIrp, STATUS_CANCELLED);
+
+    RlWin32ReleaseSessionRequest(pRequest);
+}
+
 static
 NTSTATUS
 RlWin32DeviceControl(
@@ -281,13 +492,27 @@ RlWin32DeviceControl(
     // we want to be able to allow both the driver and the user code to share
     // a single buffer for input and output.
 
+    ULONG ulFunction =
+        0x800 ^ IoGetFunctionCodeFromCtlCode(pIrpStack->Parameters.DeviceIoControl.IoControlCode);
+
+    if (ulFunction == RlIoctlPicoStartSession)
+    {
+        return RlWin32DeviceStartSession(pIrp, pIrpStack, pFile);
+    }
+
+    // The system buffer is as large as the larger of the two lengths, but only the input has been
+    // copied into it, and only the output is copied back.
     NTSTATUS status = RlpFileIoctl(
         pFile,
-        0x800 ^ IoGetFunctionCodeFromCtlCode(pIrpStack->Parameters.DeviceIoControl.IoControlCode),
-        pIrp->AssociatedIrp.SystemBuffer
+        ulFunction,
+        pIrp->AssociatedIrp.SystemBuffer,
+        min(pIrpStack->Parameters.DeviceIoControl.InputBufferLength,
+            pIrpStack->Parameters.DeviceIoControl.OutputBufferLength)
     );
 
-    return RlWin32CompleteRequest(pIrp, status);
+    // Some ioctls report results in the shared buffer, so copy it back to the caller.
+    return RlWin32CompleteRequest(pIrp, status,
+        NT_SUCCESS(status) ? pIrpStack->Parameters.DeviceIoControl.OutputBufferLength : 0);
 }
 
 static
@@ -328,3 +553,106 @@ RlWin32DeviceSetInformation(
     }
     }
 }
+
+//
+// Fast I/O functions
+//
+// Returning FALSE sends the request down the IRP path, which dispatches to the next device when
+// needed.
+//
+
+static
+BOOLEAN
+RlWin32FastIoDeviceControl(
+    _In_ PFILE_OBJECT pFileObject,
+    _In_ BOOLEAN bWait,
+    _In_opt_ PVOID pInputBuffer,
+    _In_ ULONG ulInputBufferLength,
+    _Out_opt_ PVOID pOutputBuffer,
+    _In_ ULONG ulOutputBufferLength,
+    _In_ ULONG ulIoControlCode,
+    _Out_ PIO_STATUS_BLOCK pIoStatus,
+    _In_ PDEVICE_OBJECT pDeviceObject
+)
+{
+    if (pDeviceObject != RlDeviceObject)
+    {
+        if (RlNextFastIoDispatch != NULL && RlNextFastIoDispatch->FastIoDeviceControl != NULL)
+        {
+            return RlNextFastIoDispatch->FastIoDeviceControl(pFileObject, bWait,
+                pInputBuffer, ulInputBufferLength, pOutputBuffer, ulOutputBufferLength,
+                ulIoControlCode, pIoStatus, pDeviceObject);
+        }
+        return FALSE;
+    }
+
+    ULONG ulFunction = 0x800 ^ IoGetFunctionCodeFromCtlCode(ulIoControlCode);
+
+    // Session starts may pend, which only IRPs can do.
+    if (ulFunction == RlIoctlPicoStartSession
+        || ulInputBufferLength > RL_WIN32_FAST_IO_BUFFER_SIZE
+        || ulOutputBufferLength > RL_WIN32_FAST_IO_BUFFER_SIZE)
+    {
+        return FALSE;
+    }
+
+    PRL_FILE pFile = (PRL_FILE)pFileObject->FsContext;
+
+    // Same semantics as METHOD_BUFFERED: one buffer, holding the input on entry and the output
+    // on return.
+    // Zeroed whole, so that nothing left on the stack can be returned to the caller.
+    DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) UCHAR buffer[RL_WIN32_FAST_IO_BUFFER_SIZE];
+    RtlZeroMemory(buffer, sizeof(buffer));
+
+    __try
+    {
+        if (ulInputBufferLength != 0)
+        {
+            if (ExGetPreviousMode() != KernelMode)
+            {
+                ProbeForRead(pInputBuffer, ulInputBufferLength, sizeof(CHAR));
+            }
+            RtlCopyMemory(buffer, pInputBuffer, ulInputBufferLength);
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        pIoStatus->Status = STATUS_ACCESS_VIOLATION;
+        pIoStatus->Information = 0;
+        return TRUE;
+    }
+
+    NTSTATUS status = RlpFileIoctl(pFile, ulFunction, buffer,
+        min(ulInputBufferLength, ulOutputBufferLength));
+
+    if (!NT_SUCCESS(status))
+    {
+        pIoStatus->Status = status;
+        pIoStatus->Information = 0;
+        return TRUE;
+    }
+
+    __try
+    {
+        if (ulOutputBufferLength != 0)
+        {
+            if (ExGetPreviousMode() != KernelMode)
+            {
+                ProbeForWrite(pOutputBuffer, ulOutputBufferLength, sizeof(CHAR));
+            }
+            RtlCopyMemory(pOutputBuffer, buffer, ulOutputBufferLength);
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        // The request has already taken effect, exactly like a failed buffered copy-out.
+        pIoStatus->Status = STATUS_ACCESS_VIOLATION;
+        pIoStatus->Information = 0;
+        return TRUE;
+    }
+
+    pIoStatus->Status = status;
+    pIoStatus->Information = ulOutputBufferLength;
+
+    return TRUE;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <ntifs.h>
+
+// device.h
+//
+// lxstress control device
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+NTSTATUS
+    DeviceInit(
+        _In_ PDRIVER_OBJECT pDriverObject
+    );
+
+VOID
+    DeviceCleanup(
+        _In_ PDRIVER_OBJECT pDriverObject
+    );
+
+#ifdef __cplusplus
+}
+#endif
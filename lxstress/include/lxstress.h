@@ -0,0 +1,56 @@
+#pragma once
+
+// lxstress.h
+//
+// Control interface of the lxstress provider, shared with user-mode clients.
+
+#define LXSTRESS_DEVICE_NAME L"\\Device\\lxstress"
+
+#define IOCTL_LXSTRESS_RUN \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x900, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+enum LxStressScenario
+{
+    // Each operation creates a Pico process with one thread, which exits on its first system call.
+    LxStressScenarioProcess,
+    // Each operation creates a thread in a long-lived Pico process, which exits the same way.
+    LxStressScenarioThread,
+    // Each operation is one system call, made in a loop by one Pico thread per worker.
+    LxStressScenarioSystemCall,
+    // Each operation is one illegal instruction, which the provider steps over.
+    LxStressScenarioException,
+    // Each operation switches the thread Depth providers deep with MaPushPicoProvider, one
+    // system call per level, and back out again.
+    LxStressScenarioNested,
+    LxStressScenarioMaxCount
+};
+
+// Switching between more providers than this does not exercise anything new, as the frames
+// past the inline ones are always kept in a single allocation.
+#define LXSTRESS_MAX_DEPTH                  (16)
+
+// Each worker is a system thread that waits for its Pico processes.
+#define LXSTRESS_MAX_WORKERS                (256)
+
+typedef struct _LXSTRESS_RUN_INFORMATION
+{
+    ULONG Size;
+    ULONG Scenario;
+    // Zero for one per active processor.
+    ULONG Workers;
+    ULONG Depth;
+    // Operations per worker.
+    ULONG64 Count;
+} LXSTRESS_RUN_INFORMATION, *PLXSTRESS_RUN_INFORMATION;
+
+typedef struct _LXSTRESS_RUN_RESULT
+{
+    ULONG Size;
+    ULONG Workers;
+    ULONG64 Operations;
+    // Processes and threads that could not be created, or did not exit in time.
+    ULONG64 Failures;
+    // From the first worker starting to the last one finishing, in units of Frequency.
+    LONG64 ElapsedTicks;
+    LONG64 Frequency;
+} LXSTRESS_RUN_RESULT, *PLXSTRESS_RUN_RESULT;
@@ -0,0 +1,32 @@
+#pragma once
+
+// provider.h
+//
+// The two lxstress Pico providers.
+//
+// Scenario threads are created by the outer provider. The nested provider only exists so
+// that threads have somewhere to be pushed to, and gives them back on its next system call.
+
+#include <ntifs.h>
+#include <monika.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+extern PS_PICO_ROUTINES LsRoutines;
+extern PS_PICO_ROUTINES LsNestedRoutines;
+
+extern SIZE_T LsProviderIndex;
+extern SIZE_T LsNestedProviderIndex;
+
+NTSTATUS
+    LsRegisterProviders();
+
+VOID
+    LsUnregisterProviders();
+
+#ifdef __cplusplus
+}
+#endif
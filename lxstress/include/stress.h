@@ -0,0 +1,49 @@
+#pragma once
+
+// stress.h
+//
+// Load generation for the lxstress scenarios.
+
+#include <ntifs.h>
+
+#include "lxstress.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Shared by a scenario process and all its threads. Only one thread runs at a time in every
+// scenario that counts inside the process, so the counters need no interlocked operations.
+typedef struct _LS_PROCESS {
+    ULONG Scenario;
+    ULONG Depth;
+    ULONG64 Count;
+    // Operations completed by the thread itself.
+    ULONG64 Completed;
+    ULONG64 Failures;
+    // Number of providers the thread has been pushed to, and whether it is on its way back.
+    ULONG Level;
+    BOOLEAN Unwinding;
+    PVOID CodeBase;
+    PVOID StackTop;
+} LS_PROCESS, *PLS_PROCESS;
+
+// Offsets of the scenario programs in the code page mapped into every process.
+#define LS_CODE_SYSTEM_CALL_LOOP            (0x00)
+#define LS_CODE_EXCEPTION_LOOP              (0x10)
+
+NTSTATUS
+    LsStressRun(
+        _In_ PEPROCESS pParentProcess,
+        _In_ const LXSTRESS_RUN_INFORMATION* pInformation,
+        _Out_ PLXSTRESS_RUN_RESULT pResult
+    );
+
+// Called from the dispatch routines of either provider, on the scenario thread itself.
+VOID
+    LsExitCurrentProcess();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,148 @@
+#include "device.h"
+
+#include <wdmsec.h>
+
+#include "lxstress.h"
+#include "stress.h"
+
+static DRIVER_DISPATCH LsControlDeviceNoOp;
+static DRIVER_DISPATCH LsControlDeviceIoctl;
+
+CONST UNICODE_STRING LsDeviceName = RTL_CONSTANT_STRING(LXSTRESS_DEVICE_NAME);
+static PDEVICE_OBJECT LsDeviceObject = NULL;
+
+extern "C"
+NTSTATUS
+DeviceInit(
+    _In_ PDRIVER_OBJECT pDriverObject
+)
+{
+    if (LsDeviceObject != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    pDriverObject->MajorFunction[IRP_MJ_CREATE] = LsControlDeviceNoOp;
+    pDriverObject->MajorFunction[IRP_MJ_CLOSE] = LsControlDeviceNoOp;
+    pDriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = LsControlDeviceIoctl;
+
+    // Runs can take the whole machine, so only administrators may start them.
+    NTSTATUS status = IoCreateDeviceSecure(
+        pDriverObject,
+        0,
+        (PUNICODE_STRING)&LsDeviceName,
+        FILE_DEVICE_UNKNOWN,
+        FILE_DEVICE_SECURE_OPEN,
+        FALSE,
+        &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+        NULL,
+        &LsDeviceObject
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        if (LsDeviceObject != NULL)
+        {
+            IoDeleteDevice(LsDeviceObject);
+            LsDeviceObject = NULL;
+        }
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+DeviceCleanup(
+    _In_ PDRIVER_OBJECT DriverObject
+)
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+
+    if (LsDeviceObject != NULL)
+    {
+        IoDeleteDevice(LsDeviceObject);
+        LsDeviceObject = NULL;
+    }
+}
+
+static
+NTSTATUS
+LsControlDeviceNoOp(
+    _In_ PDEVICE_OBJECT pDeviceObject,
+    _Inout_ PIRP pIrp
+)
+{
+    UNREFERENCED_PARAMETER(pDeviceObject);
+    pIrp->IoStatus.Status = STATUS_SUCCESS;
+    pIrp->IoStatus.Information = 0;
+
+    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+LsControlDeviceIoctl(
+    _In_ PDEVICE_OBJECT pDeviceObject,
+    _Inout_ PIRP pIrp
+)
+{
+    UNREFERENCED_PARAMETER(pDeviceObject);
+
+    NTSTATUS status = STATUS_SUCCESS;
+    pIrp->IoStatus.Information = 0;
+
+    PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+    SIZE_T uInLen = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+    SIZE_T uOutLen = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    switch (pIrpStack->Parameters.DeviceIoControl.IoControlCode)
+    {
+        case IOCTL_LXSTRESS_RUN:
+        {
+            if (uInLen < sizeof(LXSTRESS_RUN_INFORMATION)
+                || uOutLen < sizeof(LXSTRESS_RUN_RESULT))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+                break;
+            }
+
+            // Copied out first, as the result goes to the same system buffer.
+            LXSTRESS_RUN_INFORMATION information =
+                *(PLXSTRESS_RUN_INFORMATION)pIrp->AssociatedIrp.SystemBuffer;
+
+            if (information.Size != sizeof(LXSTRESS_RUN_INFORMATION))
+            {
+                status = STATUS_INFO_LENGTH_MISMATCH;
+                break;
+            }
+
+            LXSTRESS_RUN_RESULT result;
+            status = LsStressRun(PsGetCurrentProcess(), &information, &result);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            memcpy(pIrp->AssociatedIrp.SystemBuffer, &result, sizeof(result));
+            pIrp->IoStatus.Information = sizeof(result);
+        }
+        break;
+        default:
+        {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+        }
+        break;
+    }
+
+    pIrp->IoStatus.Status = status;
+
+    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+    return status;
+}
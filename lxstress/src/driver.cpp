@@ -0,0 +1,53 @@
+#include "driver.h"
+
+#include <monika.h>
+
+#include "device.h"
+#include "provider.h"
+
+extern "C"
+NTSTATUS
+DriverEntry(
+    _In_ PDRIVER_OBJECT     DriverObject,
+    _In_ PUNICODE_STRING    RegistryPath
+)
+{
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    NTSTATUS status = LsRegisterProviders();
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "Failed to register lxstress providers, status=%x\n", status));
+        return status;
+    }
+
+    status = DeviceInit(DriverObject);
+
+    if (!NT_SUCCESS(status))
+    {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "Failed to initialize control driver, status=%x\n", status));
+        LsUnregisterProviders();
+        return status;
+    }
+
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+        "Initialized lxstress as providers #%Iu and #%Iu\n",
+        LsProviderIndex, LsNestedProviderIndex));
+
+    DriverObject->DriverUnload = DriverUnload;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+DriverUnload(
+    _In_ PDRIVER_OBJECT DriverObject
+)
+{
+    DeviceCleanup(DriverObject);
+    LsUnregisterProviders();
+}
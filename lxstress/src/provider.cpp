@@ -0,0 +1,367 @@
+#include "provider.h"
+
+#include <monika.h>
+
+#include "stress.h"
+
+PS_PICO_ROUTINES LsRoutines
+{
+    .Size = sizeof(PS_PICO_ROUTINES)
+};
+
+PS_PICO_ROUTINES LsNestedRoutines
+{
+    .Size = sizeof(PS_PICO_ROUTINES)
+};
+
+static MA_PICO_ROUTINES LsAdditionalRoutines
+{
+    .Size = sizeof(MA_PICO_ROUTINES)
+};
+
+static MA_PICO_ROUTINES LsNestedAdditionalRoutines
+{
+    .Size = sizeof(MA_PICO_ROUTINES)
+};
+
+SIZE_T LsProviderIndex = (SIZE_T)-1;
+SIZE_T LsNestedProviderIndex = (SIZE_T)-1;
+
+static UNICODE_STRING LsProviderName = RTL_CONSTANT_STRING(L"lxstress");
+static UNICODE_STRING LsNestedProviderName = RTL_CONSTANT_STRING(L"lxstress-nested");
+
+extern "C"
+VOID
+LsExitCurrentProcess()
+{
+    // Neither call kills the thread right away, both take effect on the way back to user mode.
+    LsRoutines.TerminateProcess(PsGetCurrentProcess(), STATUS_SUCCESS);
+    LsRoutines.TerminateThread(PsGetCurrentThread(), STATUS_SUCCESS, TRUE);
+}
+
+// One step of a round trip through Depth providers, alternating between the two, as a thread
+// cannot be pushed to the provider it is already on.
+static
+VOID
+LsNestedStep(
+    _Inout_ PLS_PROCESS pLsProcess,
+    _In_ BOOLEAN bOuter
+)
+{
+    if (!pLsProcess->Unwinding)
+    {
+        NTSTATUS status = MaPushPicoProvider(
+            bOuter ? LsNestedProviderIndex : LsProviderIndex, pLsProcess);
+
+        if (!NT_SUCCESS(status))
+        {
+            ++pLsProcess->Failures;
+            LsExitCurrentProcess();
+            return;
+        }
+
+        if (++pLsProcess->Level == pLsProcess->Depth)
+        {
+            pLsProcess->Unwinding = TRUE;
+        }
+        return;
+    }
+
+    // Gives the thread back to the provider below, as lxmonika does for each terminated
+    // thread that still has a parent.
+    (bOuter ? LsRoutines : LsNestedRoutines).TerminateThread(
+        PsGetCurrentThread(), STATUS_SUCCESS, TRUE);
+
+    if (--pLsProcess->Level != 0)
+    {
+        return;
+    }
+
+    pLsProcess->Unwinding = FALSE;
+
+    if (++pLsProcess->Completed >= pLsProcess->Count)
+    {
+        LsExitCurrentProcess();
+    }
+}
+
+static
+VOID
+LsSystemCallDispatch(
+    _In_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+)
+{
+    UNREFERENCED_PARAMETER(SystemCall);
+
+    PLS_PROCESS pLsProcess = (PLS_PROCESS)LsRoutines.GetThreadContext(PsGetCurrentThread());
+
+    if (pLsProcess == NULL)
+    {
+        return;
+    }
+
+    switch (pLsProcess->Scenario)
+    {
+        case LxStressScenarioProcess:
+        {
+            LsExitCurrentProcess();
+        }
+        break;
+        case LxStressScenarioThread:
+        {
+            LsRoutines.TerminateThread(PsGetCurrentThread(), STATUS_SUCCESS, TRUE);
+        }
+        break;
+        case LxStressScenarioSystemCall:
+        {
+            if (++pLsProcess->Completed >= pLsProcess->Count)
+            {
+                LsExitCurrentProcess();
+            }
+        }
+        break;
+        case LxStressScenarioNested:
+        {
+            LsNestedStep(pLsProcess, TRUE);
+        }
+        break;
+        default:
+        {
+            ++pLsProcess->Failures;
+            LsExitCurrentProcess();
+        }
+        break;
+    }
+}
+
+static
+VOID
+LsNestedSystemCallDispatch(
+    _In_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+)
+{
+    UNREFERENCED_PARAMETER(SystemCall);
+
+    PLS_PROCESS pLsProcess = (PLS_PROCESS)
+        LsNestedRoutines.GetThreadContext(PsGetCurrentThread());
+
+    if (pLsProcess == NULL)
+    {
+        // Not pushed by us, so there is nobody to give the thread back to.
+        LsNestedRoutines.TerminateThread(PsGetCurrentThread(), STATUS_UNSUCCESSFUL, TRUE);
+        return;
+    }
+
+    LsNestedStep(pLsProcess, FALSE);
+}
+
+static
+VOID
+LsThreadExit(
+    _In_ PETHREAD Thread
+)
+{
+    UNREFERENCED_PARAMETER(Thread);
+}
+
+static
+VOID
+LsProcessExit(
+    _In_ PEPROCESS Process
+)
+{
+    // The workers wait for the process object, and free the context once it is signaled.
+    UNREFERENCED_PARAMETER(Process);
+}
+
+static
+BOOLEAN
+LsDispatchException(
+    _Inout_ PEXCEPTION_RECORD ExceptionRecord,
+    _Inout_ PKEXCEPTION_FRAME ExceptionFrame,
+    _Inout_ PKTRAP_FRAME TrapFrame,
+    _In_ ULONG Chance,
+    _In_ KPROCESSOR_MODE PreviousMode
+)
+{
+    UNREFERENCED_PARAMETER(ExceptionFrame);
+    UNREFERENCED_PARAMETER(Chance);
+
+    if (PreviousMode != UserMode || ExceptionRecord->ExceptionCode != STATUS_ILLEGAL_INSTRUCTION)
+    {
+        return FALSE;
+    }
+
+    PLS_PROCESS pLsProcess = (PLS_PROCESS)LsRoutines.GetThreadContext(PsGetCurrentThread());
+
+    if (pLsProcess == NULL || pLsProcess->Scenario != LxStressScenarioException)
+    {
+        return FALSE;
+    }
+
+    // Steps over the instruction, onto the branch back to it.
+#ifdef _M_AMD64
+    TrapFrame->Rip += 2;
+#elif defined(_M_ARM64)
+    TrapFrame->Pc += 4;
+#else
+#error Step over the illegal instruction for this architecture!
+#endif
+
+    if (++pLsProcess->Completed >= pLsProcess->Count)
+    {
+        LsExitCurrentProcess();
+    }
+
+    return TRUE;
+}
+
+static
+BOOLEAN
+LsNestedDispatchException(
+    _Inout_ PEXCEPTION_RECORD ExceptionRecord,
+    _Inout_ PKEXCEPTION_FRAME ExceptionFrame,
+    _Inout_ PKTRAP_FRAME TrapFrame,
+    _In_ ULONG Chance,
+    _In_ KPROCESSOR_MODE PreviousMode
+)
+{
+    UNREFERENCED_PARAMETER(ExceptionRecord);
+    UNREFERENCED_PARAMETER(ExceptionFrame);
+    UNREFERENCED_PARAMETER(TrapFrame);
+    UNREFERENCED_PARAMETER(Chance);
+    UNREFERENCED_PARAMETER(PreviousMode);
+
+    return FALSE;
+}
+
+static
+NTSTATUS
+LsTerminateProcess(
+    _In_ PEPROCESS Process,
+    _In_ NTSTATUS TerminateStatus
+)
+{
+    UNREFERENCED_PARAMETER(Process);
+    UNREFERENCED_PARAMETER(TerminateStatus);
+
+    return STATUS_NOT_IMPLEMENTED;
+}
+
+static
+_Ret_range_(<= , FrameCount)
+ULONG
+LsWalkUserStack(
+    _In_ PKTRAP_FRAME TrapFrame,
+    _Out_writes_to_(FrameCount, return) PVOID* Callers,
+    _In_ ULONG FrameCount
+)
+{
+    UNREFERENCED_PARAMETER(TrapFrame);
+    UNREFERENCED_PARAMETER(Callers);
+    UNREFERENCED_PARAMETER(FrameCount);
+
+    return 0;
+}
+
+static
+NTSTATUS
+LsGetAllocatedProviderName(
+    _Outptr_ PUNICODE_STRING* pOutProviderName
+)
+{
+    *pOutProviderName = &LsProviderName;
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+LsNestedGetAllocatedProviderName(
+    _Outptr_ PUNICODE_STRING* pOutProviderName
+)
+{
+    *pOutProviderName = &LsNestedProviderName;
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+LsRegisterProvider(
+    _In_ PPS_PICO_PROVIDER_SYSTEM_CALL_DISPATCH pDispatchSystemCall,
+    _In_ PPS_PICO_PROVIDER_DISPATCH_EXCEPTION pDispatchException,
+    _In_ PMA_PICO_GET_ALLOCATED_PROVIDER_NAME pGetAllocatedProviderName,
+    _Inout_ PPS_PICO_ROUTINES pRoutines,
+    _Inout_ PMA_PICO_ROUTINES pAdditionalRoutines,
+    _Out_ PSIZE_T pUIndex
+)
+{
+    PS_PICO_PROVIDER_ROUTINES providerRoutines =
+    {
+        .Size = sizeof(PS_PICO_PROVIDER_ROUTINES),
+        .DispatchSystemCall = pDispatchSystemCall,
+        .ExitThread = LsThreadExit,
+        .ExitProcess = LsProcessExit,
+        .DispatchException = pDispatchException,
+        .TerminateProcess = LsTerminateProcess,
+        .WalkUserStack = LsWalkUserStack,
+        .ProtectedRanges = NULL,
+        .GetAllocatedProcessImageName = NULL,
+        .OpenProcess = SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_TERMINATE,
+        .OpenThread = SYNCHRONIZE | THREAD_QUERY_LIMITED_INFORMATION | THREAD_TERMINATE,
+        .SubsystemInformationType = SubsystemInformationTypeWSL
+    };
+
+    MA_PICO_PROVIDER_ROUTINES additionalProviderRoutines =
+    {
+        .Size = sizeof(MA_PICO_PROVIDER_ROUTINES),
+        .GetAllocatedProviderName = pGetAllocatedProviderName,
+        .AbiVersion = NTDDI_WIN10_RS1
+    };
+
+    return MaRegisterPicoProviderEx(&providerRoutines, pRoutines,
+        &additionalProviderRoutines, pAdditionalRoutines, pUIndex);
+}
+
+extern "C"
+NTSTATUS
+LsRegisterProviders()
+{
+    NTSTATUS status = LsRegisterProvider(LsSystemCallDispatch, LsDispatchException,
+        LsGetAllocatedProviderName, &LsRoutines, &LsAdditionalRoutines, &LsProviderIndex);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = LsRegisterProvider(LsNestedSystemCallDispatch, LsNestedDispatchException,
+        LsNestedGetAllocatedProviderName, &LsNestedRoutines, &LsNestedAdditionalRoutines,
+        &LsNestedProviderIndex);
+
+    if (!NT_SUCCESS(status))
+    {
+        MaUnregisterPicoProvider(LsProviderIndex);
+        LsProviderIndex = (SIZE_T)-1;
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+LsUnregisterProviders()
+{
+    // Runs are synchronous, so no scenario process outlives the control device.
+    if (LsNestedProviderIndex != (SIZE_T)-1)
+    {
+        MaUnregisterPicoProvider(LsNestedProviderIndex);
+        LsNestedProviderIndex = (SIZE_T)-1;
+    }
+
+    if (LsProviderIndex != (SIZE_T)-1)
+    {
+        MaUnregisterPicoProvider(LsProviderIndex);
+        LsProviderIndex = (SIZE_T)-1;
+    }
+}
@@ -0,0 +1,639 @@
+#include "stress.h"
+
+#include "provider.h"
+
+#include "AutoResource.h"
+
+#define LS_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define LS_POOL_TAG                         ('  sL')
+
+#define LS_STACK_SIZE                       (PAGE_SIZE)
+
+// Scenario processes that take longer than this are considered stuck and terminated.
+#define LS_WAIT_TIMEOUT                     (-30LL * 1000 * 1000 * 10)
+
+// The scenario programs. Each one loops forever, the providers end the process when it is done.
+#if defined(_M_AMD64)
+static const UCHAR LsSystemCallLoop[] =
+{
+    0x0F, 0x05,                 // syscall
+    0xEB, 0xFC                  // jmp -4
+};
+static const UCHAR LsExceptionLoop[] =
+{
+    0x0F, 0x0B,                 // ud2
+    0xEB, 0xFC                  // jmp -4
+};
+#elif defined(_M_ARM64)
+static const ULONG LsSystemCallLoop[] =
+{
+    0xD4000001,                 // svc #0
+    0x17FFFFFF                  // b -4
+};
+static const ULONG LsExceptionLoop[] =
+{
+    0x00000000,                 // udf #0
+    0x17FFFFFF                  // b -4
+};
+#else
+#error Define the scenario programs for this architecture!
+#endif
+
+static_assert(sizeof(LsSystemCallLoop) <= LS_CODE_EXCEPTION_LOOP - LS_CODE_SYSTEM_CALL_LOOP);
+
+// Pico processes need an image file, but nothing is ever mapped from it.
+static UNICODE_STRING LsImageFileName =
+    RTL_CONSTANT_STRING(L"\\SystemRoot\\System32\\ntoskrnl.exe");
+
+typedef struct _LS_RUN {
+    LXSTRESS_RUN_INFORMATION Information;
+    PEPROCESS ParentProcess;
+    PFILE_OBJECT ImageFile;
+    HANDLE CodeSection;
+    KEVENT Start;
+    volatile LONG64 Operations;
+    volatile LONG64 Failures;
+} LS_RUN, *PLS_RUN;
+
+typedef struct _LS_WORKER {
+    PLS_RUN Run;
+    PETHREAD Thread;
+} LS_WORKER, *PLS_WORKER;
+
+static volatile LONG LsRunning = FALSE;
+
+static
+NTSTATUS
+LsCreateCodeSection(
+    _Out_ PHANDLE pHdlSection
+)
+{
+    *pHdlSection = NULL;
+
+    LARGE_INTEGER liSize
+    {
+        .QuadPart = PAGE_SIZE
+    };
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlSection = NULL;
+    LS_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objAttributes,
+        &liSize,
+        PAGE_EXECUTE_READWRITE,
+        SEC_COMMIT,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PVOID pSection = NULL;
+    LS_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+    AUTO_RESOURCE(pSection, ObDereferenceObject);
+
+    PVOID pSystemView = NULL;
+    SIZE_T szSystemView = PAGE_SIZE;
+    LS_RETURN_IF_FAIL(MmMapViewInSystemSpace(pSection, &pSystemView, &szSystemView));
+
+    RtlCopyMemory((PUCHAR)pSystemView + LS_CODE_SYSTEM_CALL_LOOP,
+        LsSystemCallLoop, sizeof(LsSystemCallLoop));
+    RtlCopyMemory((PUCHAR)pSystemView + LS_CODE_EXCEPTION_LOOP,
+        LsExceptionLoop, sizeof(LsExceptionLoop));
+
+    MmUnmapViewInSystemSpace(pSystemView);
+
+    *pHdlSection = hdlSection;
+    hdlSection = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+LsOpenImageFile(
+    _Out_ PFILE_OBJECT* pPFileObject
+)
+{
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, &LsImageFileName,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+    IO_STATUS_BLOCK ioStatus;
+
+    HANDLE hdlFile = NULL;
+    LS_RETURN_IF_FAIL(ZwOpenFile(
+        &hdlFile,
+        FILE_GENERIC_READ,
+        &objAttributes,
+        &ioStatus,
+        FILE_SHARE_READ,
+        FILE_SYNCHRONOUS_IO_NONALERT
+    ));
+    AUTO_RESOURCE(hdlFile, ZwClose);
+
+    return ObReferenceObjectByHandle(
+        hdlFile,
+        FILE_GENERIC_READ,
+        *IoFileObjectType,
+        KernelMode,
+        (PVOID*)pPFileObject,
+        NULL
+    );
+}
+
+// Waits for a scenario process or thread, terminating the process if it gets stuck.
+static
+NTSTATUS
+LsWaitForObject(
+    _In_ PVOID pObject,
+    _In_ PEPROCESS pProcess
+)
+{
+    LARGE_INTEGER liTimeout
+    {
+        .QuadPart = LS_WAIT_TIMEOUT
+    };
+
+    NTSTATUS status = KeWaitForSingleObject(pObject, Executive, KernelMode, FALSE, &liTimeout);
+
+    if (status == STATUS_TIMEOUT)
+    {
+        LsRoutines.TerminateProcess(pProcess, STATUS_TIMEOUT);
+        // The context may only be freed once nothing runs on its behalf anymore.
+        KeWaitForSingleObject(pObject, Executive, KernelMode, FALSE, NULL);
+    }
+
+    return status;
+}
+
+// Creates a Pico process with the code page and a stack, but without any threads.
+static
+NTSTATUS
+LsCreateProcess(
+    _In_ PLS_RUN pRun,
+    _Inout_ PLS_PROCESS pLsProcess,
+    _Out_ PHANDLE pHdlProcess,
+    _Out_ PEPROCESS* pPProcess
+)
+{
+    *pHdlProcess = NULL;
+    *pPProcess = NULL;
+
+    HANDLE hdlParentProcess = NULL;
+    LS_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        pRun->ParentProcess,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        PROCESS_ALL_ACCESS,
+        *PsProcessType,
+        KernelMode,
+        &hdlParentProcess
+    ));
+    AUTO_RESOURCE(hdlParentProcess, ZwClose);
+
+    PS_PICO_PROCESS_ATTRIBUTES psPicoProcessAttributes
+    {
+        .ParentProcess = hdlParentProcess,
+        .Context = pLsProcess
+    };
+
+    PS_PICO_CREATE_INFO psPicoCreateInfo
+    {
+        .FileObject = pRun->ImageFile,
+        .ImageFileName = &LsImageFileName
+    };
+
+    HANDLE hdlProcess = NULL;
+    LS_RETURN_IF_FAIL(LsRoutines.CreateProcess(&psPicoProcessAttributes,
+        &psPicoCreateInfo, &hdlProcess));
+    AUTO_RESOURCE(hdlProcess, ZwClose);
+
+    PEPROCESS pProcess = NULL;
+    LS_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlProcess,
+        PROCESS_ALL_ACCESS,
+        *PsProcessType,
+        KernelMode,
+        (PVOID*)&pProcess,
+        NULL
+    ));
+    AUTO_RESOURCE(pProcess, [](auto pProcess)
+    {
+        LsRoutines.TerminateProcess(pProcess, STATUS_UNSUCCESSFUL);
+        ObDereferenceObject(pProcess);
+    });
+
+    PVOID pCodeBase = NULL;
+    SIZE_T szView = PAGE_SIZE;
+    LS_RETURN_IF_FAIL(ZwMapViewOfSection(
+        pRun->CodeSection,
+        hdlProcess,
+        &pCodeBase,
+        0,
+        PAGE_SIZE,
+        NULL,
+        &szView,
+        ViewUnmap,
+        0,
+        PAGE_EXECUTE_READ
+    ));
+
+    PVOID pStackBase = NULL;
+    SIZE_T szStack = LS_STACK_SIZE;
+    LS_RETURN_IF_FAIL(ZwAllocateVirtualMemory(
+        hdlProcess,
+        &pStackBase,
+        0,
+        &szStack,
+        MEM_RESERVE | MEM_COMMIT,
+        PAGE_READWRITE
+    ));
+
+    pLsProcess->CodeBase = pCodeBase;
+    pLsProcess->StackTop = (PUCHAR)pStackBase + szStack;
+
+    *pHdlProcess = hdlProcess;
+    hdlProcess = NULL;
+    *pPProcess = pProcess;
+    pProcess = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+LsCreateThread(
+    _In_ PLS_RUN pRun,
+    _In_ PLS_PROCESS pLsProcess,
+    _In_ HANDLE hdlProcess,
+    _Out_ PETHREAD* pPThread
+)
+{
+    *pPThread = NULL;
+
+    ULONG_PTR uStart = (ULONG_PTR)pLsProcess->CodeBase
+        + ((pLsProcess->Scenario == LxStressScenarioException)
+            ? LS_CODE_EXCEPTION_LOOP : LS_CODE_SYSTEM_CALL_LOOP);
+
+    // The programs never touch the stack, so all threads of a process share it.
+    PS_PICO_THREAD_ATTRIBUTES psPicoThreadAttributes
+    {
+        .Process = hdlProcess,
+        .UserStack = (ULONG_PTR)pLsProcess->StackTop,
+        .StartRoutine = uStart,
+        .Context = pLsProcess
+    };
+
+    PS_PICO_CREATE_INFO psPicoCreateInfo
+    {
+        .FileObject = pRun->ImageFile,
+        .ImageFileName = &LsImageFileName
+    };
+
+    HANDLE hdlThread = NULL;
+    LS_RETURN_IF_FAIL(LsRoutines.CreateThread(&psPicoThreadAttributes,
+        &psPicoCreateInfo, &hdlThread));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    PETHREAD pThread = NULL;
+    LS_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlThread,
+        THREAD_ALL_ACCESS,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&pThread,
+        NULL
+    ));
+
+    LsRoutines.ResumeThread(pThread, NULL);
+
+    *pPThread = pThread;
+
+    return STATUS_SUCCESS;
+}
+
+// Runs one process with one thread to completion. Returns the operations it completed.
+static
+ULONG64
+LsRunProcess(
+    _In_ PLS_RUN pRun,
+    _In_ ULONG64 uCount,
+    _Inout_ PULONG64 pUFailures
+)
+{
+    // Stays resident, as the worker only ever waits in kernel mode.
+    LS_PROCESS lsProcess
+    {
+        .Scenario = pRun->Information.Scenario,
+        .Depth = pRun->Information.Depth,
+        .Count = uCount
+    };
+
+    HANDLE hdlProcess = NULL;
+    PEPROCESS pProcess = NULL;
+    NTSTATUS status = LsCreateProcess(pRun, &lsProcess, &hdlProcess, &pProcess);
+
+    if (!NT_SUCCESS(status))
+    {
+        ++*pUFailures;
+        return 0;
+    }
+    AUTO_RESOURCE(hdlProcess, ZwClose);
+    AUTO_RESOURCE(pProcess, ObDereferenceObject);
+
+    PETHREAD pThread = NULL;
+    status = LsCreateThread(pRun, &lsProcess, hdlProcess, &pThread);
+
+    if (!NT_SUCCESS(status))
+    {
+        LsRoutines.TerminateProcess(pProcess, status);
+        KeWaitForSingleObject(pProcess, Executive, KernelMode, FALSE, NULL);
+        ++*pUFailures;
+        return 0;
+    }
+    ObDereferenceObject(pThread);
+
+    if (LsWaitForObject(pProcess, pProcess) == STATUS_TIMEOUT)
+    {
+        ++*pUFailures;
+    }
+
+    *pUFailures += lsProcess.Failures;
+
+    // The process scenario counts processes, which only exit by themselves after starting.
+    if (lsProcess.Scenario == LxStressScenarioProcess)
+    {
+        return (lsProcess.Failures == 0) ? 1 : 0;
+    }
+
+    return lsProcess.Completed;
+}
+
+// Creates and waits for threads one after another in a single process.
+static
+ULONG64
+LsRunThreads(
+    _In_ PLS_RUN pRun,
+    _In_ ULONG64 uCount,
+    _Inout_ PULONG64 pUFailures
+)
+{
+    // Stays resident, as the worker only ever waits in kernel mode.
+    LS_PROCESS lsProcess
+    {
+        .Scenario = pRun->Information.Scenario,
+        .Depth = pRun->Information.Depth,
+        .Count = uCount
+    };
+
+    HANDLE hdlProcess = NULL;
+    PEPROCESS pProcess = NULL;
+    NTSTATUS status = LsCreateProcess(pRun, &lsProcess, &hdlProcess, &pProcess);
+
+    if (!NT_SUCCESS(status))
+    {
+        ++*pUFailures;
+        return 0;
+    }
+    AUTO_RESOURCE(hdlProcess, ZwClose);
+    AUTO_RESOURCE(pProcess, ObDereferenceObject);
+
+    ULONG64 uCompleted = 0;
+
+    for (ULONG64 i = 0; i < uCount; ++i)
+    {
+        PETHREAD pThread = NULL;
+        status = LsCreateThread(pRun, &lsProcess, hdlProcess, &pThread);
+
+        if (!NT_SUCCESS(status))
+        {
+            ++*pUFailures;
+            continue;
+        }
+
+        status = LsWaitForObject(pThread, pProcess);
+        ObDereferenceObject(pThread);
+
+        if (status == STATUS_TIMEOUT)
+        {
+            // The thread has taken the process down with it.
+            KeWaitForSingleObject(pProcess, Executive, KernelMode, FALSE, NULL);
+            ++*pUFailures;
+            return uCompleted;
+        }
+
+        ++uCompleted;
+    }
+
+    LsRoutines.TerminateProcess(pProcess, STATUS_SUCCESS);
+    KeWaitForSingleObject(pProcess, Executive, KernelMode, FALSE, NULL);
+
+    return uCompleted;
+}
+
+static
+VOID
+LsWorkerRoutine(
+    _In_ PVOID pContext
+)
+{
+    PLS_WORKER pWorker = (PLS_WORKER)pContext;
+    PLS_RUN pRun = pWorker->Run;
+    ULONG64 uCount = pRun->Information.Count;
+
+    ULONG64 uOperations = 0;
+    ULONG64 uFailures = 0;
+
+    KeWaitForSingleObject(&pRun->Start, Executive, KernelMode, FALSE, NULL);
+
+    switch (pRun->Information.Scenario)
+    {
+        case LxStressScenarioProcess:
+        {
+            for (ULONG64 i = 0; i < uCount; ++i)
+            {
+                uOperations += LsRunProcess(pRun, 1, &uFailures);
+            }
+        }
+        break;
+        case LxStressScenarioThread:
+        {
+            uOperations = LsRunThreads(pRun, uCount, &uFailures);
+        }
+        break;
+        default:
+        {
+            uOperations = LsRunProcess(pRun, uCount, &uFailures);
+        }
+        break;
+    }
+
+    // Once per worker, so that the totals are not a contention point of their own.
+    InterlockedAdd64(&pRun->Operations, (LONG64)uOperations);
+    InterlockedAdd64(&pRun->Failures, (LONG64)uFailures);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static
+NTSTATUS
+LsStartWorker(
+    _Inout_ PLS_WORKER pWorker
+)
+{
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlThread = NULL;
+    LS_RETURN_IF_FAIL(PsCreateSystemThread(
+        &hdlThread,
+        THREAD_ALL_ACCESS,
+        &objAttributes,
+        NULL,
+        NULL,
+        LsWorkerRoutine,
+        pWorker
+    ));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    return ObReferenceObjectByHandle(
+        hdlThread,
+        THREAD_ALL_ACCESS,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&pWorker->Thread,
+        NULL
+    );
+}
+
+static
+NTSTATUS
+LsStressRunWorkers(
+    _In_ PEPROCESS pParentProcess,
+    _In_ const LXSTRESS_RUN_INFORMATION* pInformation,
+    _In_ ULONG uWorkers,
+    _Out_ PLXSTRESS_RUN_RESULT pResult
+)
+{
+    PFILE_OBJECT pImageFile = NULL;
+    LS_RETURN_IF_FAIL(LsOpenImageFile(&pImageFile));
+    AUTO_RESOURCE(pImageFile, ObDereferenceObject);
+
+    HANDLE hdlCodeSection = NULL;
+    LS_RETURN_IF_FAIL(LsCreateCodeSection(&hdlCodeSection));
+    AUTO_RESOURCE(hdlCodeSection, ZwClose);
+
+    LS_RUN lsRun
+    {
+        .Information = *pInformation,
+        .ParentProcess = pParentProcess,
+        .ImageFile = pImageFile,
+        .CodeSection = hdlCodeSection
+    };
+
+    KeInitializeEvent(&lsRun.Start, NotificationEvent, FALSE);
+
+    PLS_WORKER pWorkers = (PLS_WORKER)ExAllocatePoolZero(PagedPool,
+        uWorkers * sizeof(LS_WORKER), LS_POOL_TAG);
+
+    if (pWorkers == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pWorkers, [](auto p) { ExFreePoolWithTag(p, LS_POOL_TAG); });
+
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG uStarted = 0;
+
+    // Workers that did start still have to be let go and waited for.
+    for (; uStarted < uWorkers && NT_SUCCESS(status); ++uStarted)
+    {
+        pWorkers[uStarted].Run = &lsRun;
+        status = LsStartWorker(&pWorkers[uStarted]);
+    }
+
+    // Started together, so that the elapsed time covers the whole load and nothing else.
+    LARGE_INTEGER liFrequency;
+    LARGE_INTEGER liStart = KeQueryPerformanceCounter(&liFrequency);
+
+    KeSetEvent(&lsRun.Start, IO_NO_INCREMENT, FALSE);
+
+    for (ULONG i = 0; i < uStarted; ++i)
+    {
+        if (pWorkers[i].Thread != NULL)
+        {
+            KeWaitForSingleObject(pWorkers[i].Thread, Executive, KernelMode, FALSE, NULL);
+            ObDereferenceObject(pWorkers[i].Thread);
+        }
+    }
+
+    LARGE_INTEGER liEnd = KeQueryPerformanceCounter(NULL);
+
+    LS_RETURN_IF_FAIL(status);
+
+    *pResult = LXSTRESS_RUN_RESULT
+    {
+        .Size = sizeof(LXSTRESS_RUN_RESULT),
+        .Workers = uWorkers,
+        .Operations = (ULONG64)lsRun.Operations,
+        .Failures = (ULONG64)lsRun.Failures,
+        .ElapsedTicks = liEnd.QuadPart - liStart.QuadPart,
+        .Frequency = liFrequency.QuadPart
+    };
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+LsStressRun(
+    _In_ PEPROCESS pParentProcess,
+    _In_ const LXSTRESS_RUN_INFORMATION* pInformation,
+    _Out_ PLXSTRESS_RUN_RESULT pResult
+)
+{
+    ULONG uWorkers = pInformation->Workers;
+    if (uWorkers == 0)
+    {
+        uWorkers = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    }
+
+    if (pInformation->Scenario >= LxStressScenarioMaxCount
+        || pInformation->Count == 0
+        || uWorkers > LXSTRESS_MAX_WORKERS
+        || (pInformation->Scenario == LxStressScenarioNested
+            && (pInformation->Depth == 0 || pInformation->Depth > LXSTRESS_MAX_DEPTH)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Runs measure lxmonika, not each other.
+    if (InterlockedCompareExchange(&LsRunning, TRUE, FALSE) != FALSE)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    NTSTATUS status = LsStressRunWorkers(pParentProcess, pInformation, uWorkers, pResult);
+
+    InterlockedExchange(&LsRunning, FALSE);
+
+    return status;
+}
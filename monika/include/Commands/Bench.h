@@ -0,0 +1,29 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include "Command.h"
+#include "Switch.h"
+
+class Bench : public Command<>
+{
+private:
+    const Switch<std::optional<std::wstring>> _suiteSwitch;
+    const Switch<size_t> _iterationsSwitch;
+    const Switch<size_t> _warmupSwitch;
+    const Switch<std::optional<std::wstring>> _providerNameSwitch;
+    const Switch<std::optional<std::filesystem::path>> _rootSwitch;
+    const Switch<bool> _jsonSwitch;
+    std::optional<std::wstring> _suite;
+    size_t _iterations = 1000;
+    size_t _warmup = 100;
+    std::optional<std::wstring> _providerName;
+    std::optional<std::filesystem::path> _root;
+    bool _json = false;
+public:
+    Bench(const CommandBase* parentCommand = nullptr);
+
+    virtual int Execute() const override;
+};
@@ -5,9 +5,13 @@
 #include <string>
 #include <vector>
 
+#include <Windows.h>
+
 #include "Command.h"
 #include "Switch.h"
 
+struct ExecBatchSession;
+
 class Exec : public Command<std::vector<std::wstring>>
 {
 private:
@@ -17,11 +21,28 @@ private:
     const Switch<std::optional<std::filesystem::path>> _rootSwitch;
     const Switch<std::optional<std::filesystem::path>> _currentDirectorySwitch;
     const Switch<std::vector<std::wstring>> _argumentsSwitch;
+    const Switch<std::optional<std::filesystem::path>> _batchSwitch;
+    const Switch<bool> _detachSwitch;
+    const Switch<size_t> _parallelSwitch;
+    const Switch<std::optional<std::wstring>> _affinitySwitch;
+    const Switch<std::optional<size_t>> _nodeSwitch;
     std::vector<std::wstring> _arguments;
     std::optional<std::wstring> _providerName;
     std::vector<std::wstring> _providerArgs;
     std::optional<std::filesystem::path> _root;
     std::optional<std::filesystem::path> _currentDirectory;
+    std::optional<std::filesystem::path> _batch;
+    bool _detach = false;
+    size_t _parallel = 1;
+    std::optional<std::wstring> _affinity;
+    std::optional<size_t> _node;
+
+    int ExecuteBatch() const;
+    int ExecuteConcurrent(
+        HANDLE hdlReality,
+        const std::vector<ExecBatchSession>& sessions,
+        const std::vector<std::wstring>& environment
+    ) const;
 public:
     Exec(const CommandBase* parentCommand = nullptr);
 
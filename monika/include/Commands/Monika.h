@@ -2,15 +2,23 @@
 
 #include "Command.h"
 
+#include "Commands/Bench.h"
 #include "Commands/Exec.h"
 #include "Commands/Install.h"
+#include "Commands/Offsets.h"
+#include "Commands/Top.h"
+#include "Commands/Trace.h"
 #include "Commands/Uninstall.h"
 
 class Monika : public Command<>
 {
 private:
+    const Bench _benchCommand;
     const Exec _execCommand;
     const Install _installCommand;
+    const Offsets _offsetsCommand;
+    const Top _topCommand;
+    const Trace _traceCommand;
     const Uninstall _uninstallCommand;
     bool _shouldPrintInfo = false;
     const Switch<bool> _infoSwitch;
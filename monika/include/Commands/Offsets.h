@@ -0,0 +1,18 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+
+#include "Command.h"
+#include "Switch.h"
+
+class Offsets : public Command<std::optional<std::filesystem::path>>
+{
+private:
+    const Switch<std::optional<std::filesystem::path>> _rest;
+    std::optional<std::filesystem::path> _path;
+public:
+    Offsets(const CommandBase* parentCommand = nullptr);
+
+    virtual int Execute() const override;
+};
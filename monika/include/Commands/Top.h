@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Command.h"
+#include "Switch.h"
+
+class Top : public Command<>
+{
+private:
+    const Switch<size_t> _intervalSwitch;
+    const Switch<size_t> _countSwitch;
+    const Switch<size_t> _processesSwitch;
+    // In milliseconds.
+    size_t _interval = 1000;
+    // 0 runs until interrupted.
+    size_t _count = 0;
+    size_t _processes = 10;
+public:
+    Top(const CommandBase* parentCommand = nullptr);
+
+    virtual int Execute() const override;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include <Windows.h>
+
+#include <lxmonika/reality.h>
+
+#include "Command.h"
+#include "Switch.h"
+
+#include "Commands/TraceDecode.h"
+
+// Trace files start with this header, followed by TraceFileRecord entries in the order they were
+// drained from the driver, which is only ordered per processor.
+struct TraceFileHeader
+{
+    // TraceFileMagic.
+    ULONG Magic;
+    // TraceFileVersion.
+    ULONG Version;
+    // sizeof(TraceFileRecord), so that readers can skip fields appended by later versions.
+    ULONG RecordSize;
+    ULONG Reserved;
+    // Of the performance counter used for the timestamps.
+    LONG64 Frequency;
+    // The performance counter when recording started.
+    LONG64 StartTimestamp;
+    // Written when recording stops, zero in files of interrupted recordings.
+    ULONG64 RecordsCount;
+    ULONG64 LostCount;
+    // Indexed by the Provider field of the records.
+    WCHAR ProviderNames[RL_PROVIDER_MAX][RL_PROVIDER_NAME_SIZE];
+};
+
+// RL_TRACE_RECORD without the ring sequence, which means nothing outside of the driver.
+struct TraceFileRecord
+{
+    LONG64 Timestamp;
+    ULONG64 ProcessId;
+    ULONG64 ThreadId;
+    ULONG64 Number;
+    ULONG64 Result;
+    USHORT Event;
+    USHORT Provider;
+    ULONG Processor;
+};
+
+// Used by both commands when no path is given.
+#define MA_TRACE_DEFAULT_PATH           L"monika.trace"
+// Used by trace --profile when no path is given.
+#define MA_TRACE_DEFAULT_PROFILE_PATH   L"monika.folded"
+
+// "MTRC" in the file.
+constexpr ULONG TraceFileMagic = 'CRTM';
+constexpr ULONG TraceFileVersion = 1;
+
+class Trace : public Command<std::optional<std::filesystem::path>>
+{
+private:
+    const TraceDecode _traceDecodeCommand;
+    const Switch<std::optional<std::filesystem::path>> _rest;
+    const Switch<std::optional<std::wstring>> _providerNameSwitch;
+    const Switch<size_t> _processIdSwitch;
+    const Switch<std::optional<std::wstring>> _systemCallsSwitch;
+    const Switch<size_t> _durationSwitch;
+    const Switch<bool> _profileSwitch;
+    const Switch<size_t> _frequencySwitch;
+    std::optional<std::filesystem::path> _path;
+    std::optional<std::wstring> _providerName;
+    // 0 records all processes.
+    size_t _processId = 0;
+    // A comma-separated list of numbers.
+    std::optional<std::wstring> _systemCalls;
+    // In seconds, 0 runs until interrupted.
+    size_t _duration = 0;
+    bool _profile = false;
+    // In samples per second on each processor, 0 for the driver default.
+    size_t _frequency = 0;
+
+    // Samples the selected Pico processes instead of tracing them, and writes folded stacks.
+    int Profile(
+        HANDLE reality,
+        const RL_DRIVER_STATISTICS& statistics,
+        ULONG providerMask
+    ) const;
+public:
+    Trace(const CommandBase* parentCommand = nullptr);
+
+    virtual int Execute() const override;
+};
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+
+#include "Command.h"
+#include "Switch.h"
+
+class TraceDecode : public Command<std::optional<std::filesystem::path>>
+{
+private:
+    const Switch<std::optional<std::filesystem::path>> _rest;
+    const Switch<bool> _csvSwitch;
+    std::optional<std::filesystem::path> _path;
+    bool _csv = false;
+public:
+    TraceDecode(const CommandBase* parentCommand = nullptr);
+
+    virtual int Execute() const override;
+};
@@ -23,6 +23,7 @@ public:
 extern const Parameter& NullParameter;
 extern const Parameter& ArgumentsParameter;
 extern const Parameter& DriverPathParameter;
+extern const Parameter& NumberParameter;
 extern const Parameter& PathParameter;
 extern const Parameter& ServiceNameParameter;
 extern const Parameter& StringParameter;
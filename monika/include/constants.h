@@ -7,3 +7,10 @@
 #define MA_SERVICE_NAME             L"lxmonika"
 #define MA_SERVICE_DISPLAY_NAME     L"Just Monika"
 #define MA_SERVICE_DRIVER_NAME      L"lxmonika.sys"
+
+// Results of the Pico structure lookups, saved by lxmonika.sys and by 'monika offsets'.
+#define MA_SERVICE_OFFSET_CACHE_KEY L"SYSTEM\\CurrentControlSet\\Services\\" MA_SERVICE_NAME \
+                                    L"\\OffsetCache"
+
+// Used when _NT_SYMBOL_PATH is not set.
+#define MA_DEFAULT_SYMBOL_PATH      L"srv**https://msdl.microsoft.com/download/symbols"
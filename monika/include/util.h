@@ -40,3 +40,8 @@ std::wstring
     UtilWin32ToNtPath(
         const std::filesystem::path& win32Path
     );
+
+std::wstring
+    UtilUtf8ToWide(
+        std::string_view utf8
+    );
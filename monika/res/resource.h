@@ -61,6 +61,85 @@
 #define MA_STRING_UNINSTALL_PROVIDER_COMMAND_NAME 157
 #define MA_STRING_UNINSTALL_PROVIDER_COMMAND_DESCRIPTION 158
 #define MA_STRING_UNINSTALL_PROVIDER_COMMAND_ARGUMENT_DESCRIPTION 159
+#define MA_STRING_OFFSETS_COMMAND_NAME 160
+#define MA_STRING_OFFSETS_COMMAND_DESCRIPTION 161
+#define MA_STRING_OFFSETS_COMMAND_ARGUMENT_DESCRIPTION 162
+#define MA_STRING_OFFSETS_SYMBOL_NOT_FOUND 163
+#define MA_STRING_EXCEPTION_SYMBOLS_NOT_FOUND 164
+#define MA_STRING_BENCH_COMMAND_NAME 165
+#define MA_STRING_BENCH_COMMAND_DESCRIPTION 166
+#define MA_STRING_BENCH_SWITCH_SUITE_NAME 167
+#define MA_STRING_BENCH_SWITCH_SUITE_DESCRIPTION 168
+#define MA_STRING_BENCH_SWITCH_ITERATIONS_NAME 169
+#define MA_STRING_BENCH_SWITCH_ITERATIONS_DESCRIPTION 170
+#define MA_STRING_BENCH_SWITCH_WARMUP_NAME 171
+#define MA_STRING_BENCH_SWITCH_WARMUP_DESCRIPTION 172
+#define MA_STRING_BENCH_SWITCH_ROOT_DESCRIPTION 173
+#define MA_STRING_BENCH_SWITCH_JSON_NAME 174
+#define MA_STRING_BENCH_SWITCH_JSON_DESCRIPTION 175
+#define MA_STRING_BENCH_RESULT 176
+#define MA_STRING_PARAMETER_NAME_NUMBER 177
+#define MA_STRING_EXCEPTION_INVALID_NUMBER 178
+#define MA_STRING_EXCEPTION_UNKNOWN_BENCH_SUITE 179
+#define MA_STRING_TOP_COMMAND_NAME 180
+#define MA_STRING_TOP_COMMAND_DESCRIPTION 181
+#define MA_STRING_TOP_SWITCH_INTERVAL_NAME 182
+#define MA_STRING_TOP_SWITCH_INTERVAL_DESCRIPTION 183
+#define MA_STRING_TOP_SWITCH_COUNT_NAME 184
+#define MA_STRING_TOP_SWITCH_COUNT_DESCRIPTION 185
+#define MA_STRING_TOP_SWITCH_PROCESSES_NAME 186
+#define MA_STRING_TOP_SWITCH_PROCESSES_DESCRIPTION 187
+#define MA_STRING_TOP_SUMMARY 188
+#define MA_STRING_TOP_STATISTICS_DISABLED 189
+#define MA_STRING_TOP_COLUMN_PROVIDER 190
+#define MA_STRING_TOP_COLUMN_SYSTEM_CALLS 191
+#define MA_STRING_TOP_COLUMN_EXCEPTIONS 192
+#define MA_STRING_TOP_COLUMN_PROCESSES 193
+#define MA_STRING_TOP_COLUMN_THREADS 194
+#define MA_STRING_TOP_COLUMN_P50 195
+#define MA_STRING_TOP_COLUMN_P99 196
+#define MA_STRING_TOP_COLUMN_PROCESS_ID 197
+#define MA_STRING_TOP_COLUMN_DEPTH 198
+#define MA_STRING_TOP_COLUMN_BUSY 199
+#define MA_STRING_EXCEPTION_LXMONIKA_NOT_RUNNING 200
+#define MA_STRING_TRACE_COMMAND_NAME 201
+#define MA_STRING_TRACE_COMMAND_DESCRIPTION 202
+#define MA_STRING_TRACE_COMMAND_ARGUMENT_DESCRIPTION 203
+#define MA_STRING_TRACE_SWITCH_PROVIDER_NAME_DESCRIPTION 204
+#define MA_STRING_TRACE_SWITCH_PROCESS_ID_NAME 205
+#define MA_STRING_TRACE_SWITCH_PROCESS_ID_DESCRIPTION 206
+#define MA_STRING_TRACE_SWITCH_SYSTEM_CALLS_NAME 207
+#define MA_STRING_TRACE_SWITCH_SYSTEM_CALLS_DESCRIPTION 208
+#define MA_STRING_TRACE_SWITCH_DURATION_NAME 209
+#define MA_STRING_TRACE_SWITCH_DURATION_DESCRIPTION 210
+#define MA_STRING_TRACE_RECORDING 211
+#define MA_STRING_TRACE_SUMMARY 212
+#define MA_STRING_TRACE_DECODE_COMMAND_NAME 213
+#define MA_STRING_TRACE_DECODE_COMMAND_DESCRIPTION 214
+#define MA_STRING_TRACE_DECODE_COMMAND_ARGUMENT_DESCRIPTION 215
+#define MA_STRING_TRACE_DECODE_SWITCH_CSV_NAME 216
+#define MA_STRING_TRACE_DECODE_SWITCH_CSV_DESCRIPTION 217
+#define MA_STRING_EXCEPTION_UNKNOWN_PROVIDER 218
+#define MA_STRING_EXCEPTION_INVALID_TRACE_FILE 219
+#define MA_STRING_EXEC_SWITCH_BATCH_NAME 220
+#define MA_STRING_EXEC_SWITCH_BATCH_DESCRIPTION 221
+#define MA_STRING_EXEC_BATCH_SESSION_FAILED 222
+#define MA_STRING_EXEC_BATCH_SUMMARY 223
+#define MA_STRING_EXCEPTION_INVALID_MANIFEST_LINE 224
+#define MA_STRING_EXEC_SWITCH_DETACH_NAME 225
+#define MA_STRING_EXEC_SWITCH_DETACH_DESCRIPTION 226
+#define MA_STRING_EXEC_SWITCH_PARALLEL_NAME 227
+#define MA_STRING_EXEC_SWITCH_PARALLEL_DESCRIPTION 228
+#define MA_STRING_EXEC_DETACHED 229
+#define MA_STRING_EXEC_SWITCH_AFFINITY_NAME 230
+#define MA_STRING_EXEC_SWITCH_AFFINITY_DESCRIPTION 231
+#define MA_STRING_EXEC_SWITCH_NODE_NAME 232
+#define MA_STRING_EXEC_SWITCH_NODE_DESCRIPTION 233
+#define MA_STRING_TRACE_SWITCH_PROFILE_NAME 234
+#define MA_STRING_TRACE_SWITCH_PROFILE_DESCRIPTION 235
+#define MA_STRING_TRACE_SWITCH_FREQUENCY_NAME 236
+#define MA_STRING_TRACE_SWITCH_FREQUENCY_DESCRIPTION 237
+#define MA_STRING_TRACE_PROFILE_SUMMARY 238
 
 // Next default values for new objects
 //
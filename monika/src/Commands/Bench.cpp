@@ -0,0 +1,390 @@
+#include "Commands/Bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <Windows.h>
+#include <winternl.h>
+
+#include <lxmonika/reality.h>
+
+#include "resource.h"
+#include "service.h"
+#include "util.h"
+
+#include "Exception.h"
+#include "Parameter.h"
+
+// Monix programs from mxss/monix, looked up in the bin directory of the root.
+#define MA_BENCH_EXIT_PROBE             L"benchexit"
+#define MA_BENCH_SYSCALL_PROBE          L"benchsyscall"
+
+// Must match SYSCALL_COUNT in mxss/monix/src/benchsyscall.cpp.
+#define MA_BENCH_SYSCALL_PROBE_CALLS    10000
+
+static constexpr std::wstring_view BenchSuites[] =
+{
+    L"session",
+    L"read",
+    L"ioctl",
+    L"syscall"
+};
+
+struct BenchResult
+{
+    std::wstring_view Suite;
+    // In microseconds, sorted.
+    std::vector<double> Latencies;
+    double Throughput;
+
+    double Percentile(double dFraction) const
+    {
+        return Latencies[(size_t)(dFraction * (Latencies.size() - 1))];
+    }
+};
+
+Bench::Bench(const CommandBase* parentCommand)
+  : Command(
+        MA_STRING_BENCH_COMMAND_NAME,
+        MA_STRING_BENCH_COMMAND_DESCRIPTION,
+        NullSwitch,
+        parentCommand
+    ),
+    _suiteSwitch(
+        MA_STRING_BENCH_SWITCH_SUITE_NAME, -1,
+        MA_STRING_BENCH_SWITCH_SUITE_DESCRIPTION,
+        StringParameter, _suite, true
+    ),
+    _iterationsSwitch(
+        MA_STRING_BENCH_SWITCH_ITERATIONS_NAME, -1,
+        MA_STRING_BENCH_SWITCH_ITERATIONS_DESCRIPTION,
+        NumberParameter, _iterations, true
+    ),
+    _warmupSwitch(
+        MA_STRING_BENCH_SWITCH_WARMUP_NAME, -1,
+        MA_STRING_BENCH_SWITCH_WARMUP_DESCRIPTION,
+        NumberParameter, _warmup, true
+    ),
+    _providerNameSwitch(
+        MA_STRING_EXEC_SWITCH_PROVIDER_NAME_NAME, -1,
+        MA_STRING_EXEC_SWITCH_PROVIDER_NAME_DESCRIPTION,
+        StringParameter, _providerName, true
+    ),
+    _rootSwitch(
+        MA_STRING_EXEC_SWITCH_ROOT_NAME, -1,
+        MA_STRING_BENCH_SWITCH_ROOT_DESCRIPTION,
+        PathParameter, _root, true
+    ),
+    _jsonSwitch(
+        MA_STRING_BENCH_SWITCH_JSON_NAME, -1,
+        MA_STRING_BENCH_SWITCH_JSON_DESCRIPTION,
+        NullParameter, _json, true
+    )
+{
+    AddSwitch(_suiteSwitch);
+    AddSwitch(_iterationsSwitch);
+    AddSwitch(_warmupSwitch);
+    AddSwitch(_providerNameSwitch);
+    AddSwitch(_rootSwitch);
+    AddSwitch(_jsonSwitch);
+}
+
+int
+Bench::Execute() const
+{
+    if (_suite.has_value()
+        && std::find(std::begin(BenchSuites), std::end(BenchSuites), _suite.value())
+            == std::end(BenchSuites))
+    {
+        throw MonikaException(
+            MA_STRING_EXCEPTION_UNKNOWN_BENCH_SUITE,
+            HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER),
+            _suite.value()
+        );
+    }
+
+    if (_iterations == 0)
+    {
+        throw Win32Exception(ERROR_INVALID_PARAMETER);
+    }
+
+    auto manager = UtilGetSharedServiceHandle(OpenSCManagerW(
+        NULL, NULL, GENERIC_READ
+    ));
+
+    if (!SvIsLxMonikaInstalled(manager))
+    {
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_INSTALLED);
+    }
+
+    auto reality = UtilGetSharedWin32Handle(CreateFileW(
+        L"\\\\?\\GLOBALROOT" RL_DEVICE_NAME,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    ));
+
+    using Clock = std::chrono::steady_clock;
+
+    const auto Measure = [&](std::wstring_view suite, const std::function<void()>& operation)
+    {
+        for (size_t i = 0; i < _warmup; ++i)
+        {
+            operation();
+        }
+
+        BenchResult result = { .Suite = suite };
+        result.Latencies.reserve(_iterations);
+
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < _iterations; ++i)
+        {
+            Clock::time_point operationStart = Clock::now();
+            operation();
+            result.Latencies.push_back(std::chrono::duration<double, std::micro>(
+                Clock::now() - operationStart).count());
+        }
+
+        double dSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::sort(result.Latencies.begin(), result.Latencies.end());
+        result.Throughput = _iterations / dSeconds;
+
+        return result;
+    };
+
+    // Sessions run the probes from the bin directory of the root, and return when they exit.
+
+    std::filesystem::path root = _root.value_or(std::filesystem::current_path());
+    std::wstring rootNt = UtilWin32ToNtPath(root);
+    std::wstring binNt = UtilWin32ToNtPath(root / L"bin");
+
+    const auto StartSession = [&](std::wstring_view probe)
+    {
+        std::vector<BYTE> data;
+
+        const auto Pack = [&](std::wstring_view str)
+        {
+            RL_PICO_PACKED_STRING packed =
+            {
+                .Offset = (ULONG)data.size(),
+                .Length = (ULONG)(str.size() * sizeof(WCHAR))
+            };
+
+            const BYTE* pBytes = (const BYTE*)str.data();
+            data.insert(data.end(), pBytes, pBytes + packed.Length);
+            data.insert(data.end(), sizeof(WCHAR), 0);
+
+            return packed;
+        };
+
+        RL_PICO_SESSION_ATTRIBUTES_V2 picoSessionAttributes =
+        {
+            .Size = sizeof(RL_PICO_SESSION_ATTRIBUTES_V2)
+        };
+
+        if (_providerName.has_value())
+        {
+            picoSessionAttributes.ProviderIndex = RL_PICO_PROVIDER_BY_NAME;
+            picoSessionAttributes.ProviderName = Pack(_providerName.value());
+        }
+
+        picoSessionAttributes.RootDirectory = Pack(rootNt);
+        picoSessionAttributes.CurrentWorkingDirectory = Pack(binNt);
+
+        RL_PICO_PACKED_STRING argument = Pack(probe);
+        picoSessionAttributes.ArgsCount = 1;
+
+        data.resize((data.size() + alignof(RL_PICO_PACKED_STRING) - 1)
+            & ~(alignof(RL_PICO_PACKED_STRING) - 1));
+        picoSessionAttributes.StringsOffset = (ULONG)data.size();
+
+        const BYTE* pArgument = (const BYTE*)&argument;
+        data.insert(data.end(), pArgument, pArgument + sizeof(argument));
+
+        picoSessionAttributes.DataLength = data.size();
+        picoSessionAttributes.Data = data.data();
+
+        NTSTATUS statusExecute = 0;
+        DWORD dwBytesReturned = 0;
+
+        Win32Exception::ThrowIfFalse(DeviceIoControl(
+            reality.get(),
+            RL_IOCTL_PICO_START_SESSION,
+            &picoSessionAttributes,
+            sizeof(picoSessionAttributes),
+            &statusExecute,
+            sizeof(statusExecute),
+            &dwBytesReturned,
+            NULL
+        ));
+
+        if (statusExecute != 0)
+        {
+            throw NTException(statusExecute);
+        }
+    };
+
+    std::vector<BenchResult> results;
+
+    const auto ShouldRun = [&](std::wstring_view suite)
+    {
+        return !_suite.has_value() || _suite.value() == suite;
+    };
+
+    if (ShouldRun(L"session"))
+    {
+        results.push_back(Measure(L"session", [&]() { StartSession(MA_BENCH_EXIT_PROBE); }));
+    }
+
+    if (ShouldRun(L"read"))
+    {
+        std::string buffer;
+        buffer.resize(4096);
+
+        results.push_back(Measure(L"read", [&]()
+        {
+            OVERLAPPED offset;
+            memset(&offset, 0, sizeof(offset));
+
+            DWORD cbBytesRead = 0;
+
+            std::ignore = ReadFile(
+                reality.get(),
+                buffer.data(),
+                (DWORD)buffer.size(),
+                &cbBytesRead,
+                &offset
+            );
+            Win32Exception::ThrowUnless(ERROR_HANDLE_EOF);
+        }));
+    }
+
+    if (ShouldRun(L"ioctl"))
+    {
+        // One of the cheapest ioctls, it only copies a few counters.
+        RL_BOOT_PROFILE profile;
+
+        results.push_back(Measure(L"ioctl", [&]()
+        {
+            profile = { .Size = sizeof(RL_BOOT_PROFILE) };
+            DWORD dwBytesReturned = 0;
+
+            Win32Exception::ThrowIfFalse(DeviceIoControl(
+                reality.get(),
+                RL_IOCTL_BOOT_PROFILE,
+                &profile,
+                sizeof(profile),
+                &profile,
+                sizeof(profile),
+                &dwBytesReturned,
+                NULL
+            ));
+        }));
+    }
+
+    if (ShouldRun(L"syscall"))
+    {
+        // The cost of a session that exits right away is taken out of every sample, leaving
+        // the system calls of the probe.
+        double dBaseline = (!results.empty() && results.front().Suite == L"session")
+            ? results.front().Percentile(0.5)
+            : Measure(L"session", [&]() { StartSession(MA_BENCH_EXIT_PROBE); })
+                .Percentile(0.5);
+
+        BenchResult result =
+            Measure(L"syscall", [&]() { StartSession(MA_BENCH_SYSCALL_PROBE); });
+
+        double dTotal = 0;
+        for (double& dLatency : result.Latencies)
+        {
+            dLatency = max(dLatency - dBaseline, 0.0) / MA_BENCH_SYSCALL_PROBE_CALLS;
+            dTotal += dLatency;
+        }
+
+        result.Throughput = (dTotal > 0) ? result.Latencies.size() / (dTotal / 1e6) : 0;
+
+        results.push_back(std::move(result));
+    }
+
+    if (!_json)
+    {
+        for (const BenchResult& result : results)
+        {
+            double dP50 = result.Percentile(0.5);
+            double dP99 = result.Percentile(0.99);
+            double dP999 = result.Percentile(0.999);
+
+            std::wcout << std::vformat(
+                UtilGetResourceString(MA_STRING_BENCH_RESULT),
+                std::make_wformat_args(result.Suite, dP50, dP99, dP999, result.Throughput)
+            ) << std::endl;
+        }
+
+        return 0;
+    }
+
+    // Tells apart the driver builds the results are compared across.
+    RL_DRIVER_STATISTICS statistics = { .Size = sizeof(RL_DRIVER_STATISTICS) };
+    DWORD dwBytesReturned = 0;
+
+    if (!DeviceIoControl(reality.get(), RL_IOCTL_QUERY_STATISTICS,
+        &statistics, sizeof(statistics), &statistics, sizeof(statistics),
+        &dwBytesReturned, NULL))
+    {
+        statistics = { };
+    }
+
+    const auto JsonString = [](std::string_view str)
+    {
+        std::wstring escaped = L"\"";
+        for (char ch : str)
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                escaped += L'\\';
+            }
+            escaped += (wchar_t)(unsigned char)ch;
+        }
+        return escaped + L"\"";
+    };
+
+    std::wcout << L"{" << std::endl;
+    std::wcout << L"  \"build\": { \"number\": " << JsonString(statistics.BuildNumber)
+        << L", \"hash\": " << JsonString(statistics.BuildHash)
+        << L", \"tag\": " << JsonString(statistics.BuildTag) << L" }," << std::endl;
+    std::wcout << std::format(L"  \"iterations\": {},", _iterations) << std::endl;
+    std::wcout << std::format(L"  \"warmup\": {},", _warmup) << std::endl;
+    std::wcout << L"  \"suites\": [" << std::endl;
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& result = results[i];
+
+        std::wcout << std::format(
+            L"    {{ \"name\": \"{}\", \"p50_us\": {}, \"p99_us\": {}, \"p999_us\": {}, "
+                L"\"throughput_per_s\": {} }}{}",
+            result.Suite,
+            result.Percentile(0.5),
+            result.Percentile(0.99),
+            result.Percentile(0.999),
+            result.Throughput,
+            (i + 1 < results.size()) ? L"," : L""
+        ) << std::endl;
+    }
+
+    std::wcout << L"  ]" << std::endl;
+    std::wcout << L"}" << std::endl;
+
+    return 0;
+}
@@ -1,7 +1,20 @@
 #include "Commands/Exec.h"
 
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <Windows.h>
 #include <winternl.h>
+#include <shellapi.h>
 
 #include <lxmonika/reality.h>
 
@@ -11,6 +24,303 @@
 
 #include "Exception.h"
 
+// One line of a batch manifest, with the defaults from the command line filled in.
+struct ExecBatchSession
+{
+    size_t Line;
+    // Empty for the default provider.
+    std::wstring ProviderName;
+    // NT paths.
+    std::wstring RootDirectory;
+    std::wstring CurrentDirectory;
+    std::vector<std::wstring> Arguments;
+};
+
+// A session started through its own overlapped request, so that several can run at once.
+// Referenced by the driver until the request completes, so it is never moved.
+struct ExecSession
+{
+    size_t Line = 0;
+    RL_PICO_SESSION_ATTRIBUTES_V4 Attributes = { };
+    std::vector<BYTE> Data;
+    OVERLAPPED Overlapped = { };
+    std::shared_ptr<void> Event;
+    // Written by the driver before the request goes pending.
+    HANDLE ProcessHandle = NULL;
+    std::shared_ptr<void> Process;
+    NTSTATUS Status = 0;
+    bool Running = false;
+};
+
+static
+std::vector<std::wstring>
+ExecGetEnvironment()
+{
+    std::vector<std::wstring> environment;
+
+    auto ptrEnvStrings = std::shared_ptr<WCHAR>(
+        GetEnvironmentStringsW(), FreeEnvironmentStringsW
+    );
+    LPWCH lpwEnvStrings = ptrEnvStrings.get();
+    while (*lpwEnvStrings != L'\0')
+    {
+        environment.emplace_back(lpwEnvStrings);
+        lpwEnvStrings += environment.back().size() + 1;
+    }
+
+    return environment;
+}
+
+// Checked by the driver against the processors and nodes that are actually there.
+static
+RL_PICO_SESSION_PLACEMENT
+ExecGetPlacement(
+    const std::optional<std::wstring>& affinity,
+    const std::optional<size_t>& node
+)
+{
+    RL_PICO_SESSION_PLACEMENT placement = { };
+
+    if (affinity.has_value())
+    {
+        size_t uSeparator = affinity->find(L':');
+        if (uSeparator == std::wstring::npos)
+        {
+            throw Win32Exception(ERROR_INVALID_PARAMETER);
+        }
+
+        try
+        {
+            size_t uGroupEnd = 0;
+            size_t uMaskEnd = 0;
+            std::wstring group = affinity->substr(0, uSeparator);
+            std::wstring mask = affinity->substr(uSeparator + 1);
+
+            unsigned long ulGroup = std::stoul(group, &uGroupEnd);
+            unsigned long long ullMask = std::stoull(mask, &uMaskEnd, 16);
+
+            if (uGroupEnd != group.size() || uMaskEnd != mask.size() || ulGroup > MAXUSHORT
+                || ullMask > (KAFFINITY)-1)
+            {
+                throw Win32Exception(ERROR_INVALID_PARAMETER);
+            }
+
+            placement.Flags |= RL_PLACEMENT_AFFINITY;
+            placement.Affinity.Group = (USHORT)ulGroup;
+            placement.Affinity.Mask = (KAFFINITY)ullMask;
+        }
+        catch (const std::logic_error&)
+        {
+            throw Win32Exception(ERROR_INVALID_PARAMETER);
+        }
+    }
+
+    if (node.has_value())
+    {
+        if (node.value() > MAXUSHORT)
+        {
+            throw Win32Exception(ERROR_INVALID_PARAMETER);
+        }
+
+        placement.Flags |= RL_PLACEMENT_PREFERRED_NODE;
+        placement.PreferredNode = (USHORT)node.value();
+    }
+
+    return placement;
+}
+
+static
+void
+ExecPackSession(
+    ExecSession& session,
+    const std::wstring& providerName,
+    const std::wstring& rootNt,
+    const std::wstring& currentDirectoryNt,
+    const std::vector<std::wstring>& providerArgs,
+    const std::vector<std::wstring>& arguments,
+    const std::vector<std::wstring>& environment,
+    const RL_PICO_SESSION_PLACEMENT& placement
+)
+{
+    // All strings are packed into a single buffer, so the driver can copy them at once.
+
+    std::vector<BYTE>& data = session.Data;
+    data.clear();
+
+    const auto Pack = [&](const std::wstring& str)
+    {
+        RL_PICO_PACKED_STRING packed =
+        {
+            .Offset = (ULONG)data.size(),
+            .Length = (ULONG)(str.size() * sizeof(WCHAR))
+        };
+
+        const BYTE* pBytes = (const BYTE*)str.c_str();
+        // Also copy the null terminator.
+        data.insert(data.end(), pBytes, pBytes + packed.Length + sizeof(WCHAR));
+
+        return packed;
+    };
+
+    RL_PICO_SESSION_ATTRIBUTES_V4& picoSessionAttributes = session.Attributes;
+    picoSessionAttributes =
+    {
+        .Size = sizeof(RL_PICO_SESSION_ATTRIBUTES_V4),
+        .Placement = placement
+    };
+
+    // Provider Name
+
+    if (!providerName.empty())
+    {
+        picoSessionAttributes.ProviderIndex = RL_PICO_PROVIDER_BY_NAME;
+        picoSessionAttributes.ProviderName = Pack(providerName);
+    }
+    else
+    {
+        picoSessionAttributes.ProviderIndex = 0;
+    }
+
+    // Root Directory
+
+    picoSessionAttributes.RootDirectory = Pack(rootNt);
+
+    // Current Directory
+
+    picoSessionAttributes.CurrentWorkingDirectory = Pack(currentDirectoryNt);
+
+    std::vector<RL_PICO_PACKED_STRING> strings;
+
+    // Provider Arguments
+
+    picoSessionAttributes.ProviderArgsCount = (ULONG)providerArgs.size();
+    for (auto& arg: providerArgs)
+    {
+        strings.push_back(Pack(arg));
+    }
+
+    // Process Arguments
+
+    picoSessionAttributes.ArgsCount = (ULONG)arguments.size();
+    for (auto& arg: arguments)
+    {
+        strings.push_back(Pack(arg));
+    }
+
+    // Environment Variables
+
+    picoSessionAttributes.EnvironmentCount = (ULONG)environment.size();
+    for (auto& variable: environment)
+    {
+        strings.push_back(Pack(variable));
+    }
+
+    // String Table
+
+    data.resize((data.size() + alignof(RL_PICO_PACKED_STRING) - 1)
+        & ~(alignof(RL_PICO_PACKED_STRING) - 1));
+    picoSessionAttributes.StringsOffset = (ULONG)data.size();
+
+    const BYTE* pStrings = (const BYTE*)strings.data();
+    data.insert(data.end(), pStrings, pStrings + strings.size() * sizeof(RL_PICO_PACKED_STRING));
+
+    picoSessionAttributes.DataLength = data.size();
+    picoSessionAttributes.Data = data.data();
+
+    picoSessionAttributes.ProcessHandle = &session.ProcessHandle;
+}
+
+static
+void
+ExecStartSession(
+    HANDLE hdlReality,
+    ExecSession& session
+)
+{
+    session.Event = UtilGetSharedWin32Handle(Win32Exception::ThrowIfNull(
+        CreateEventW(NULL, TRUE, FALSE, NULL)
+    ));
+    session.Overlapped = { .hEvent = session.Event.get() };
+    session.ProcessHandle = NULL;
+
+    BOOL bCompleted = DeviceIoControl(
+        hdlReality,
+        RL_IOCTL_PICO_START_SESSION,
+        &session.Attributes,
+        sizeof(session.Attributes),
+        &session.Status,
+        sizeof(session.Status),
+        NULL,
+        &session.Overlapped
+    );
+
+    if (session.ProcessHandle != NULL)
+    {
+        session.Process = UtilGetSharedWin32Handle(session.ProcessHandle);
+    }
+
+    if (!bCompleted && GetLastError() == ERROR_IO_PENDING)
+    {
+        session.Running = true;
+
+        // Sessions that fail to start are completed before the request returns.
+        if (!HasOverlappedIoCompleted(&session.Overlapped))
+        {
+            return;
+        }
+
+        DWORD dwBytesReturned = 0;
+        bCompleted = GetOverlappedResult(hdlReality, &session.Overlapped, &dwBytesReturned,
+            FALSE);
+        session.Running = false;
+    }
+
+    // Failures leave the output buffer alone, only the request carries their status.
+    session.Status = bCompleted ? session.Status : (NTSTATUS)session.Overlapped.Internal;
+}
+
+static
+void
+ExecFinishSession(
+    HANDLE hdlReality,
+    ExecSession& session
+)
+{
+    if (!session.Running)
+    {
+        return;
+    }
+
+    DWORD dwBytesReturned = 0;
+    if (!GetOverlappedResult(hdlReality, &session.Overlapped, &dwBytesReturned, TRUE))
+    {
+        session.Status = (NTSTATUS)session.Overlapped.Internal;
+    }
+
+    session.Running = false;
+}
+
+static
+void
+ExecDetachSession(
+    HANDLE hdlReality,
+    ExecSession& session
+)
+{
+    // Cancelling the request leaves the session running.
+    CancelIoEx(hdlReality, &session.Overlapped);
+    ExecFinishSession(hdlReality, session);
+
+    if (session.Process)
+    {
+        DWORD dwProcessId = GetProcessId(session.Process.get());
+        std::wcout << std::vformat(
+            UtilGetResourceString(MA_STRING_EXEC_DETACHED),
+            std::make_wformat_args(dwProcessId)
+        ) << std::endl;
+    }
+}
+
 Exec::Exec(const CommandBase* parentCommand)
   : Command(
         MA_STRING_EXEC_COMMAND_NAME,
@@ -46,6 +356,31 @@ Exec::Exec(const CommandBase* parentCommand)
         MA_STRING_EXEC_SWITCH_ARGUMENTS_NAME, -1,
         MA_STRING_EXEC_SWITCH_ARGUMENTS_DESCRIPTION,
         ArgumentsParameter, _arguments, false
+    ),
+    _batchSwitch(
+        MA_STRING_EXEC_SWITCH_BATCH_NAME, -1,
+        MA_STRING_EXEC_SWITCH_BATCH_DESCRIPTION,
+        PathParameter, _batch, true
+    ),
+    _detachSwitch(
+        MA_STRING_EXEC_SWITCH_DETACH_NAME, -1,
+        MA_STRING_EXEC_SWITCH_DETACH_DESCRIPTION,
+        NullParameter, _detach, true
+    ),
+    _parallelSwitch(
+        MA_STRING_EXEC_SWITCH_PARALLEL_NAME, -1,
+        MA_STRING_EXEC_SWITCH_PARALLEL_DESCRIPTION,
+        NumberParameter, _parallel, true
+    ),
+    _affinitySwitch(
+        MA_STRING_EXEC_SWITCH_AFFINITY_NAME, -1,
+        MA_STRING_EXEC_SWITCH_AFFINITY_DESCRIPTION,
+        StringParameter, _affinity, true
+    ),
+    _nodeSwitch(
+        MA_STRING_EXEC_SWITCH_NODE_NAME, -1,
+        MA_STRING_EXEC_SWITCH_NODE_DESCRIPTION,
+        NumberParameter, _node, true
     )
 {
     AddSwitch(_providerNameSwitch);
@@ -53,11 +388,21 @@ Exec::Exec(const CommandBase* parentCommand)
     AddSwitch(_rootSwitch);
     AddSwitch(_currentDirectorySwitch);
     AddSwitch(_argumentsSwitch);
+    AddSwitch(_batchSwitch);
+    AddSwitch(_detachSwitch);
+    AddSwitch(_parallelSwitch);
+    AddSwitch(_affinitySwitch);
+    AddSwitch(_nodeSwitch);
 }
 
 int
 Exec::Execute() const
 {
+    if (_batch.has_value())
+    {
+        return ExecuteBatch();
+    }
+
     auto manager = UtilGetSharedServiceHandle(OpenSCManagerW(
         NULL, NULL, GENERIC_READ
     ));
@@ -73,101 +418,482 @@ Exec::Execute() const
         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
         NULL,
         OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
         NULL
     ));
 
-    RL_PICO_SESSION_ATTRIBUTES picoSessionAttributes =
-    {
-        .Size = sizeof(RL_PICO_SESSION_ATTRIBUTES)
-    };
+    auto session = std::make_unique<ExecSession>();
 
-    // Provider Name
+    ExecPackSession(
+        *session,
+        _providerName.value_or(L""),
+        UtilWin32ToNtPath(_root.value_or(std::filesystem::current_path())),
+        UtilWin32ToNtPath(_currentDirectory.value_or(std::filesystem::current_path())),
+        _providerArgs,
+        _arguments,
+        ExecGetEnvironment(),
+        ExecGetPlacement(_affinity, _node)
+    );
 
-    UNICODE_STRING strProviderName;
-    if (_providerName.has_value())
+    // IOCTL to launch the process.
+
+    ExecStartSession(reality.get(), *session);
+
+    if (session->Running && _detach)
     {
-        RtlInitUnicodeString(&strProviderName, _providerName.value().c_str());
-        picoSessionAttributes.ProviderName = &strProviderName;
+        ExecDetachSession(reality.get(), *session);
+        return 0;
     }
-    else
+
+    if (session->Process)
     {
-        picoSessionAttributes.ProviderIndex = 0;
+        WaitForSingleObject(session->Process.get(), INFINITE);
     }
 
-    // Root Directory
+    ExecFinishSession(reality.get(), *session);
 
-    UNICODE_STRING strRoot;
-    std::wstring rootNt = UtilWin32ToNtPath(_root.value_or(std::filesystem::current_path()));
-    RtlInitUnicodeString(&strRoot, rootNt.c_str());
-    picoSessionAttributes.RootDirectory = &strRoot;
+    if (!NT_SUCCESS(session->Status))
+    {
+        throw NTException(session->Status);
+    }
 
-    // Current Directory
+    // For Monix and most other providers, this is the exit status of the process.
+    return (int)session->Status;
+}
 
-    UNICODE_STRING strCurrentDirectory;
-    std::wstring currentDirectoryNt =
-        UtilWin32ToNtPath(_currentDirectory.value_or(std::filesystem::current_path()));
-    RtlInitUnicodeString(&strCurrentDirectory, currentDirectoryNt.c_str());
-    picoSessionAttributes.CurrentWorkingDirectory = &strCurrentDirectory;
+int
+Exec::ExecuteBatch() const
+{
+    // Sessions are started one by one and supervised here, rather than batched in the driver.
+    // Batches do not carry a placement, so placed sessions are also started one by one.
+    bool bConcurrent = _detach || _parallel > 1 || _affinity.has_value() || _node.has_value();
 
-    // Provider Arguments
+    if (_parallel == 0 || _parallel >= MAXIMUM_WAIT_OBJECTS)
+    {
+        throw Win32Exception(ERROR_INVALID_PARAMETER);
+    }
 
-    picoSessionAttributes.ProviderArgsCount = _providerArgs.size();
-    std::vector<UNICODE_STRING> strProviderArgs(_providerArgs.size());
-    for (size_t i = 0; auto& strArg: strProviderArgs)
+    // Everything below is done once for the whole manifest, however many sessions it has.
+    auto manager = UtilGetSharedServiceHandle(OpenSCManagerW(
+        NULL, NULL, GENERIC_READ
+    ));
+
+    if (!SvIsLxMonikaInstalled(manager))
     {
-        RtlInitUnicodeString(&strArg, _providerArgs[i].c_str());
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_INSTALLED);
     }
-    picoSessionAttributes.ProviderArgs = strProviderArgs.data();
 
-    // Process Arguments
+    auto reality = UtilGetSharedWin32Handle(CreateFileW(
+        L"\\\\?\\GLOBALROOT" RL_DEVICE_NAME,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | (bConcurrent ? FILE_FLAG_OVERLAPPED : 0),
+        NULL
+    ));
 
-    picoSessionAttributes.ArgsCount = _arguments.size();
-    std::vector<UNICODE_STRING> strArgs(_arguments.size());
-    for (size_t i = 0; auto& strArg: strArgs)
+    // Manifest
+
+    std::wstring manifest;
     {
-        RtlInitUnicodeString(&strArg, _arguments[i].c_str());
+        std::ifstream file(_batch.value(), std::ios::binary);
+        if (!file)
+        {
+            throw Win32Exception(ERROR_FILE_NOT_FOUND);
+        }
+
+        std::stringstream contents;
+        contents << file.rdbuf();
+
+        std::string utf8 = contents.str();
+        if (utf8.starts_with("\xEF\xBB\xBF"))
+        {
+            utf8.erase(0, 3);
+        }
+
+        manifest = UtilUtf8ToWide(utf8);
     }
-    picoSessionAttributes.Args = strArgs.data();
 
-    // Environment Variables
+    // Many lines usually share a few directories, each of which costs a file open to convert.
+    std::unordered_map<std::wstring, std::wstring> ntPaths;
 
-    std::vector<std::wstring> environment;
+    const auto ToNtPath = [&](const std::filesystem::path& path) -> const std::wstring&
+    {
+        auto it = ntPaths.find(path.wstring());
+        if (it == ntPaths.end())
+        {
+            it = ntPaths.emplace(path.wstring(), UtilWin32ToNtPath(path)).first;
+        }
+        return it->second;
+    };
+
+    std::wstring_view providerSwitchName =
+        UtilGetResourceString(MA_STRING_EXEC_SWITCH_PROVIDER_NAME_NAME);
+    std::wstring_view rootSwitchName = UtilGetResourceString(MA_STRING_EXEC_SWITCH_ROOT_NAME);
+    std::wstring_view currentDirectorySwitchName =
+        UtilGetResourceString(MA_STRING_EXEC_SWITCH_CURRENT_DIRECTORY_NAME);
+    std::wstring_view argumentsSwitchName =
+        UtilGetResourceString(MA_STRING_EXEC_SWITCH_ARGUMENTS_NAME);
+
+    std::vector<ExecBatchSession> sessions;
+
+    std::wistringstream lines(manifest);
+    std::wstring line;
+    size_t uLine = 0;
+
+    while (std::getline(lines, line))
     {
-        auto ptrEnvStrings = std::shared_ptr<WCHAR>(
-            GetEnvironmentStringsW(), FreeEnvironmentStringsW
+        ++uLine;
+
+        if (!line.empty() && line.back() == L'\r')
+        {
+            line.pop_back();
+        }
+
+        size_t uStart = line.find_first_not_of(L" \t");
+        if (uStart == std::wstring::npos || line[uStart] == L'#')
+        {
+            continue;
+        }
+
+        // Each line takes the same --provider, --root and --cd switches as the command line,
+        // followed by the command. The placeholder keeps CommandLineToArgvW from parsing the
+        // first real argument as a program name.
+        std::wstring commandLine = L"monika " + line.substr(uStart);
+
+        int argc = 0;
+        auto argv = std::shared_ptr<LPWSTR>(
+            Win32Exception::ThrowIfNull(CommandLineToArgvW(commandLine.c_str(), &argc)),
+            [](LPWSTR* p) { LocalFree(p); }
         );
-        LPWCH lpwEnvStrings = ptrEnvStrings.get();
-        while (*lpwEnvStrings != L'\0')
+
+        ExecBatchSession session =
+        {
+            .Line = uLine,
+            .ProviderName = _providerName.value_or(L"")
+        };
+
+        std::optional<std::filesystem::path> root = _root;
+        std::optional<std::filesystem::path> currentDirectory = _currentDirectory;
+
+        int i = 1;
+        bool bValid = true;
+
+        for (; i < argc; ++i)
         {
-            environment.emplace_back(lpwEnvStrings);
-            lpwEnvStrings += environment.back().size() + 1;
+            std::wstring_view arg = argv.get()[i];
+
+            if (arg == argumentsSwitchName)
+            {
+                ++i;
+                break;
+            }
+            else if (arg != providerSwitchName && arg != rootSwitchName
+                && arg != currentDirectorySwitchName)
+            {
+                break;
+            }
+
+            if (i + 1 >= argc)
+            {
+                bValid = false;
+                break;
+            }
+
+            std::wstring value = argv.get()[++i];
+
+            if (arg == providerSwitchName)
+            {
+                session.ProviderName = value;
+            }
+            else if (arg == rootSwitchName)
+            {
+                root = value;
+            }
+            else
+            {
+                currentDirectory = value;
+            }
         }
+
+        if (!bValid || i >= argc)
+        {
+            throw MonikaException(
+                MA_STRING_EXCEPTION_INVALID_MANIFEST_LINE,
+                HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+                uLine
+            );
+        }
+
+        session.Arguments.assign(argv.get() + i, argv.get() + argc);
+        session.RootDirectory = ToNtPath(root.value_or(std::filesystem::current_path()));
+        session.CurrentDirectory =
+            ToNtPath(currentDirectory.value_or(std::filesystem::current_path()));
+
+        sessions.push_back(std::move(session));
     }
 
-    picoSessionAttributes.EnvironmentCount = environment.size();
-    std::vector<UNICODE_STRING> strEnvironment(environment.size());
-    for (size_t i = 0; auto& strArg: strEnvironment)
+    std::vector<std::wstring> environment = ExecGetEnvironment();
+
+    if (bConcurrent)
     {
-        RtlInitUnicodeString(&strArg, environment[i].c_str());
+        return ExecuteConcurrent(reality.get(), sessions, environment);
     }
-    picoSessionAttributes.Environment = strEnvironment.data();
 
-    // IOCTL to launch the process.
+    // Shared by all sessions. Strings are referenced, not copied, until the driver reads them.
 
-    NTSTATUS statusExecute = 0;
-    DWORD dwBytesReturned = 0;
+    const auto MakeString = [](const std::wstring& str)
+    {
+        return UNICODE_STRING
+        {
+            .Length = (USHORT)(str.size() * sizeof(WCHAR)),
+            .MaximumLength = (USHORT)((str.size() + 1) * sizeof(WCHAR)),
+            .Buffer = (PWSTR)str.c_str()
+        };
+    };
 
-    Win32Exception::ThrowIfFalse(DeviceIoControl(
-        reality.get(),
-        RL_IOCTL_PICO_START_SESSION,
-        &picoSessionAttributes,
-        sizeof(picoSessionAttributes),
-        &statusExecute,
-        sizeof(statusExecute),
-        &dwBytesReturned,
-        NULL
-    ));
+    std::vector<UNICODE_STRING> providerArgs;
+    std::transform(_providerArgs.begin(), _providerArgs.end(),
+        std::back_inserter(providerArgs), MakeString);
+
+
+    std::vector<UNICODE_STRING> environmentStrings;
+    std::transform(environment.begin(), environment.end(),
+        std::back_inserter(environmentStrings), MakeString);
+
+    // Consecutive lines with the same provider and directories go to the driver in one call.
+
+    std::vector<RL_PICO_SESSION_BATCH_ENTRY> entries;
+    std::vector<std::vector<UNICODE_STRING>> arguments;
+    std::vector<LONG> statuses;
+
+    NTSTATUS statusFirstFailure = 0;
+    size_t uStarted = 0;
+
+    for (size_t uFirst = 0; uFirst < sessions.size(); )
+    {
+        const ExecBatchSession& first = sessions[uFirst];
+
+        size_t uEnd = uFirst + 1;
+        while (uEnd < sessions.size() && uEnd - uFirst < RL_PICO_SESSION_BATCH_MAX
+            && sessions[uEnd].ProviderName == first.ProviderName
+            && sessions[uEnd].RootDirectory == first.RootDirectory
+            && sessions[uEnd].CurrentDirectory == first.CurrentDirectory)
+        {
+            ++uEnd;
+        }
+
+        size_t uCount = uEnd - uFirst;
+
+        entries.resize(uCount);
+        arguments.resize(uCount);
+        statuses.assign(uCount, 0);
+
+        for (size_t i = 0; i < uCount; ++i)
+        {
+            const ExecBatchSession& session = sessions[uFirst + i];
+
+            arguments[i].clear();
+            std::transform(session.Arguments.begin(), session.Arguments.end(),
+                std::back_inserter(arguments[i]), MakeString);
+
+            entries[i] =
+            {
+                .ProviderArgsCount = providerArgs.size(),
+                .ProviderArgs = providerArgs.data(),
+                .ArgsCount = arguments[i].size(),
+                .Args = arguments[i].data(),
+                .EnvironmentCount = environmentStrings.size(),
+                .Environment = environmentStrings.data()
+            };
+        }
+
+        UNICODE_STRING providerName = MakeString(first.ProviderName);
+        UNICODE_STRING rootDirectory = MakeString(first.RootDirectory);
+        UNICODE_STRING currentDirectory = MakeString(first.CurrentDirectory);
+
+        RL_PICO_SESSION_BATCH batch =
+        {
+            .Size = sizeof(RL_PICO_SESSION_BATCH)
+        };
+
+        if (first.ProviderName.empty())
+        {
+            batch.ProviderIndex = 0;
+        }
+        else
+        {
+            batch.ProviderName = &providerName;
+        }
+
+        batch.RootDirectory = &rootDirectory;
+        batch.CurrentWorkingDirectory = &currentDirectory;
+        batch.Count = uCount;
+        batch.Entries = entries.data();
+        batch.Statuses = statuses.data();
+
+        DWORD dwBytesReturned = 0;
+
+        Win32Exception::ThrowIfFalse(DeviceIoControl(
+            reality.get(),
+            RL_IOCTL_PICO_START_SESSION_BATCH,
+            &batch,
+            sizeof(batch),
+            &batch,
+            sizeof(batch),
+            &dwBytesReturned,
+            NULL
+        ));
+
+        uStarted += batch.Started;
+
+        for (size_t i = 0; i < uCount; ++i)
+        {
+            if (NT_SUCCESS(statuses[i]))
+            {
+                continue;
+            }
+
+            if (NT_SUCCESS(statusFirstFailure))
+            {
+                statusFirstFailure = statuses[i];
+            }
+
+            size_t uFailedLine = sessions[uFirst + i].Line;
+            ULONG ulStatus = (ULONG)statuses[i];
+            std::wcerr << std::vformat(
+                UtilGetResourceString(MA_STRING_EXEC_BATCH_SESSION_FAILED),
+                std::make_wformat_args(uFailedLine, ulStatus)
+            ) << std::endl;
+        }
+
+        uFirst = uEnd;
+    }
+
+    size_t uTotal = sessions.size();
+    std::wcerr << std::vformat(
+        UtilGetResourceString(MA_STRING_EXEC_BATCH_SUMMARY),
+        std::make_wformat_args(uStarted, uTotal)
+    ) << std::endl;
+
+    return RtlNtStatusToDosError(statusFirstFailure);
+}
+
+int
+Exec::ExecuteConcurrent(
+    HANDLE hdlReality,
+    const std::vector<ExecBatchSession>& sessions,
+    const std::vector<std::wstring>& environment
+) const
+{
+    std::vector<std::unique_ptr<ExecSession>> running;
+    std::vector<HANDLE> waitHandles;
+
+    RL_PICO_SESSION_PLACEMENT placement = ExecGetPlacement(_affinity, _node);
+
+    NTSTATUS statusFirstFailure = 0;
+    size_t uStarted = 0;
+
+    const auto Report = [&](const ExecSession& session)
+    {
+        if (NT_SUCCESS(session.Status))
+        {
+            return;
+        }
+
+        if (NT_SUCCESS(statusFirstFailure))
+        {
+            statusFirstFailure = session.Status;
+        }
+
+        size_t uFailedLine = session.Line;
+        ULONG ulStatus = (ULONG)session.Status;
+        std::wcerr << std::vformat(
+            UtilGetResourceString(MA_STRING_EXEC_BATCH_SESSION_FAILED),
+            std::make_wformat_args(uFailedLine, ulStatus)
+        ) << std::endl;
+    };
+
+    // Waits for any of the running sessions, and reports it.
+    const auto WaitAny = [&]()
+    {
+        waitHandles.clear();
+        for (auto& session: running)
+        {
+            waitHandles.push_back(session->Process ? session->Process.get()
+                : session->Event.get());
+        }
+
+        DWORD dwWait = WaitForMultipleObjects(
+            (DWORD)waitHandles.size(), waitHandles.data(), FALSE, INFINITE
+        );
+
+        if (dwWait >= WAIT_OBJECT_0 + waitHandles.size())
+        {
+            throw Win32Exception();
+        }
+
+        auto it = running.begin() + (dwWait - WAIT_OBJECT_0);
+        ExecFinishSession(hdlReality, **it);
+        Report(**it);
+        running.erase(it);
+    };
+
+    for (const ExecBatchSession& batchSession: sessions)
+    {
+        if (!_detach && running.size() >= _parallel)
+        {
+            WaitAny();
+        }
+
+        auto session = std::make_unique<ExecSession>();
+        session->Line = batchSession.Line;
+
+        ExecPackSession(
+            *session,
+            batchSession.ProviderName,
+            batchSession.RootDirectory,
+            batchSession.CurrentDirectory,
+            _providerArgs,
+            batchSession.Arguments,
+            environment,
+            placement
+        );
+
+        ExecStartSession(hdlReality, *session);
+
+        if (!session->Running)
+        {
+            Report(*session);
+            if (NT_SUCCESS(session->Status))
+            {
+                ++uStarted;
+            }
+            continue;
+        }
+
+        ++uStarted;
+
+        if (_detach)
+        {
+            ExecDetachSession(hdlReality, *session);
+            continue;
+        }
+
+        running.push_back(std::move(session));
+    }
+
+    while (!running.empty())
+    {
+        WaitAny();
+    }
+
+    size_t uTotal = sessions.size();
+    std::wcerr << std::vformat(
+        UtilGetResourceString(MA_STRING_EXEC_BATCH_SUMMARY),
+        std::make_wformat_args(uStarted, uTotal)
+    ) << std::endl;
 
-    return RtlNtStatusToDosError(statusExecute);
+    return RtlNtStatusToDosError(statusFirstFailure);
 }
@@ -19,8 +19,12 @@ Monika::Monika()
         MA_STRING_MONIKA_COMMAND_DESCRIPTION,
         NullSwitch
     ),
+    _benchCommand(this),
     _execCommand(this),
     _installCommand(this),
+    _offsetsCommand(this),
+    _topCommand(this),
+    _traceCommand(this),
     _uninstallCommand(this),
     _infoSwitch(
         MA_STRING_MONIKA_SWITCH_INFO_NAME,
@@ -31,8 +35,12 @@ Monika::Monika()
         false
     )
 {
+    AddCommand(_benchCommand);
     AddCommand(_execCommand);
     AddCommand(_installCommand);
+    AddCommand(_offsetsCommand);
+    AddCommand(_topCommand);
+    AddCommand(_traceCommand);
     AddCommand(_uninstallCommand);
 
     AddSwitch(_infoSwitch);
@@ -107,26 +115,7 @@ Monika::Execute() const
 
         buffer = streamContents.str();
 
-        int cbMultiByte = Win32Exception::ThrowIfNull(MultiByteToWideChar(
-            CP_UTF8,
-            MB_ERR_INVALID_CHARS,
-            buffer.c_str(),
-            (int)buffer.size(),
-            nullptr,
-            0
-        ));
-
-        std::wstring wideBuffer;
-        wideBuffer.resize(cbMultiByte);
-
-        std::ignore = Win32Exception::ThrowIfNull(MultiByteToWideChar(
-            CP_UTF8,
-            MB_ERR_INVALID_CHARS,
-            buffer.c_str(),
-            (int)buffer.size(),
-            wideBuffer.data(),
-            (int)wideBuffer.size()
-        ));
+        std::wstring wideBuffer = UtilUtf8ToWide(buffer);
 
         std::wcout << wideBuffer << std::flush;
 
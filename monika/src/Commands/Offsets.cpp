@@ -0,0 +1,231 @@
+#include "Commands/Offsets.h"
+
+#include <array>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Windows.h>
+#include <DbgHelp.h>
+
+#include <lxmonika/reality.h>
+
+#include "constants.h"
+#include "resource.h"
+#include "service.h"
+#include "util.h"
+
+#include "Exception.h"
+#include "Parameter.h"
+#include "Switch.h"
+
+// The members of MA_PSP_PICO_PROVIDER_ROUTINES_OFFSETS. lxmonika.sys reads each offset from the
+// value of the same name.
+static constexpr std::array OffsetsSymbols =
+{
+    L"PspPicoRegistrationDisabled",
+    L"PspPicoProviderRoutines",
+    L"PspCreatePicoProcess",
+    L"PspCreatePicoThread",
+    L"PspGetPicoProcessContext",
+    L"PspGetPicoThreadContext",
+    L"PspPicoGetContextThreadEx",
+    L"PspPicoSetContextThreadEx",
+    L"PspTerminateThreadByPointer",
+    L"PsResumeThread",
+    L"PspSetPicoThreadDescriptorBase",
+    L"PsSuspendThread",
+    L"PspTerminatePicoProcess"
+};
+
+Offsets::Offsets(const CommandBase* parentCommand)
+  : Command(
+        MA_STRING_OFFSETS_COMMAND_NAME,
+        MA_STRING_OFFSETS_COMMAND_DESCRIPTION,
+        _rest,
+        parentCommand
+    ),
+    _rest(
+        -1, -1, MA_STRING_OFFSETS_COMMAND_ARGUMENT_DESCRIPTION,
+        PathParameter, _path, true
+    )
+{
+    // Currently no-op.
+}
+
+int
+Offsets::Execute() const
+{
+    auto manager = UtilGetSharedServiceHandle(OpenSCManagerW(
+        NULL, NULL, GENERIC_READ
+    ));
+
+    if (!SvIsLxMonikaInstalled(manager))
+    {
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_INSTALLED);
+    }
+
+    std::filesystem::path kernelPath = _path.has_value()
+        ? std::filesystem::canonical(_path.value())
+        : std::filesystem::path(UtilGetSystemDirectory()) / L"ntoskrnl.exe";
+
+    // lxmonika.sys identifies the kernel build by its product version and image checksum.
+    DWORD dwVersionInfoSize = Win32Exception::ThrowIfNull(
+        GetFileVersionInfoSizeW(kernelPath.c_str(), NULL)
+    );
+
+    std::vector<char> versionInfo(dwVersionInfoSize);
+    Win32Exception::ThrowIfFalse(GetFileVersionInfoW(
+        kernelPath.c_str(), 0, dwVersionInfoSize, versionInfo.data()
+    ));
+
+    struct
+    {
+        WORD wLanguage;
+        WORD wCodePage;
+    }* pTranslation = nullptr;
+    UINT uLength = 0;
+
+    Win32Exception::ThrowIfFalse(VerQueryValueW(
+        versionInfo.data(), L"\\VarFileInfo\\Translation", (LPVOID*)&pTranslation, &uLength
+    ));
+
+    LPCWSTR lpProductVersion = nullptr;
+    Win32Exception::ThrowIfFalse(VerQueryValueW(
+        versionInfo.data(),
+        std::format(L"\\StringFileInfo\\{:04x}{:04x}\\ProductVersion",
+            pTranslation->wLanguage, pTranslation->wCodePage).c_str(),
+        (LPVOID*)&lpProductVersion,
+        &uLength
+    ));
+
+    std::wstring productVersion(lpProductVersion);
+
+    HANDLE hdlProcess = GetCurrentProcess();
+
+    SymSetOptions(SymGetOptions() | SYMOPT_UNDNAME | SYMOPT_FAIL_CRITICAL_ERRORS);
+
+    // DbgHelp reads _NT_SYMBOL_PATH by itself when no search path is given.
+    Win32Exception::ThrowIfFalse(SymInitializeW(
+        hdlProcess,
+        (GetEnvironmentVariableW(L"_NT_SYMBOL_PATH", NULL, 0) != 0)
+            ? NULL : MA_DEFAULT_SYMBOL_PATH,
+        FALSE
+    ));
+
+    auto symbols = std::shared_ptr<std::remove_pointer_t<HANDLE>>(
+        hdlProcess, [](HANDLE hdl) { SymCleanup(hdl); }
+    );
+
+    DWORD64 uBase = Win32Exception::ThrowIfNull(SymLoadModuleExW(
+        hdlProcess, NULL, kernelPath.c_str(), NULL, 0, 0, NULL, 0
+    ));
+
+    IMAGEHLP_MODULEW64 moduleInfo =
+    {
+        .SizeOfStruct = sizeof(moduleInfo)
+    };
+    Win32Exception::ThrowIfFalse(SymGetModuleInfoW64(hdlProcess, uBase, &moduleInfo));
+
+    if (moduleInfo.SymType != SymPdb)
+    {
+        std::wstring kernelPathString = kernelPath.wstring();
+        throw MonikaException(
+            MA_STRING_EXCEPTION_SYMBOLS_NOT_FOUND,
+            HRESULT_FROM_WIN32(ERROR_NOT_FOUND),
+            kernelPathString
+        );
+    }
+
+    std::vector<char> symbolBuffer(sizeof(SYMBOL_INFOW) + MAX_SYM_NAME * sizeof(WCHAR));
+    PSYMBOL_INFOW pSymbol = (PSYMBOL_INFOW)symbolBuffer.data();
+
+    std::array<DWORD, OffsetsSymbols.size()> offsets = { };
+
+    for (size_t i = 0; i < OffsetsSymbols.size(); ++i)
+    {
+        memset(pSymbol, 0, sizeof(SYMBOL_INFOW));
+        pSymbol->SizeOfStruct = sizeof(SYMBOL_INFOW);
+        pSymbol->MaxNameLen = MAX_SYM_NAME;
+
+        std::wstring qualifiedName =
+            std::format(L"{}!{}", moduleInfo.ModuleName, OffsetsSymbols[i]);
+
+        if (!SymFromNameW(hdlProcess, qualifiedName.c_str(), pSymbol))
+        {
+            // Left out of the cache, the driver treats missing offsets as unknown.
+            std::wcerr << std::vformat(
+                UtilGetResourceString(MA_STRING_OFFSETS_SYMBOL_NOT_FOUND),
+                std::make_wformat_args(OffsetsSymbols[i])
+            ) << std::endl;
+            continue;
+        }
+
+        offsets[i] = (DWORD)(pSymbol->Address - pSymbol->ModBase);
+
+        std::wcout << std::format(L"{}: 0x{:x}", OffsetsSymbols[i], offsets[i]) << std::endl;
+    }
+
+    // Start over, so that no value saved for another kernel build survives.
+    LSTATUS lStatus = RegDeleteTreeW(HKEY_LOCAL_MACHINE, MA_SERVICE_OFFSET_CACHE_KEY);
+
+    if (lStatus != ERROR_SUCCESS && lStatus != ERROR_FILE_NOT_FOUND)
+    {
+        throw Win32Exception(lStatus);
+    }
+
+    HKEY hKey = NULL;
+    lStatus = RegCreateKeyExW(
+        HKEY_LOCAL_MACHINE,
+        MA_SERVICE_OFFSET_CACHE_KEY,
+        0,
+        NULL,
+        REG_OPTION_NON_VOLATILE,
+        KEY_SET_VALUE,
+        NULL,
+        &hKey,
+        NULL
+    );
+
+    if (lStatus != ERROR_SUCCESS)
+    {
+        throw Win32Exception(lStatus);
+    }
+
+    auto key = std::shared_ptr<std::remove_pointer_t<HKEY>>(hKey, RegCloseKey);
+
+    const auto SetValue = [&](LPCWSTR lpName, DWORD dwType, const void* pData, DWORD cbData)
+    {
+        lStatus = RegSetValueExW(key.get(), lpName, 0, dwType, (const BYTE*)pData, cbData);
+
+        if (lStatus != ERROR_SUCCESS)
+        {
+            throw Win32Exception(lStatus);
+        }
+    };
+
+    const auto SetDword = [&](LPCWSTR lpName, DWORD dwValue)
+    {
+        SetValue(lpName, REG_DWORD, &dwValue, sizeof(dwValue));
+    };
+
+    SetValue(L"KernelVersion", REG_SZ, productVersion.c_str(),
+        (DWORD)((productVersion.size() + 1) * sizeof(WCHAR)));
+    SetDword(L"KernelCheckSum", moduleInfo.CheckSum);
+
+    for (size_t i = 0; i < OffsetsSymbols.size(); ++i)
+    {
+        if (offsets[i] != 0)
+        {
+            SetDword(OffsetsSymbols[i], offsets[i]);
+        }
+    }
+
+    // Tells the driver to check PspPicoProviderRoutines the way it checks known offsets.
+    SetDword(L"LocateMethod", RlLocateMethodOffsets);
+
+    return 0;
+}
@@ -0,0 +1,353 @@
+#include "Commands/Top.h"
+
+#include <algorithm>
+#include <array>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Windows.h>
+
+#include <lxmonika/reality.h>
+
+#include "resource.h"
+#include "service.h"
+#include "util.h"
+
+#include "Exception.h"
+#include "Parameter.h"
+
+// One reading of the driver counters. Rates are computed from two of them.
+struct TopSample
+{
+    LONG64 Timestamp;
+    LONG64 Frequency;
+    ULONG Instrumentation;
+    ULONG ProvidersCount;
+    ULONG64 Events[RL_PROVIDER_MAX][RlTraceEventMaxCount];
+    // Not on the counters page, queried for each provider.
+    std::array<std::array<ULONG64, RL_LATENCY_BUCKETS>, RL_PROVIDER_MAX> Latency;
+    std::unordered_map<ULONG64, RL_PROCESS_INFORMATION> Processes;
+    SIZE_T ProcessesTotal;
+};
+
+Top::Top(const CommandBase* parentCommand)
+  : Command(
+        MA_STRING_TOP_COMMAND_NAME,
+        MA_STRING_TOP_COMMAND_DESCRIPTION,
+        NullSwitch,
+        parentCommand
+    ),
+    _intervalSwitch(
+        MA_STRING_TOP_SWITCH_INTERVAL_NAME, -1,
+        MA_STRING_TOP_SWITCH_INTERVAL_DESCRIPTION,
+        NumberParameter, _interval, true
+    ),
+    _countSwitch(
+        MA_STRING_TOP_SWITCH_COUNT_NAME, -1,
+        MA_STRING_TOP_SWITCH_COUNT_DESCRIPTION,
+        NumberParameter, _count, true
+    ),
+    _processesSwitch(
+        MA_STRING_TOP_SWITCH_PROCESSES_NAME, -1,
+        MA_STRING_TOP_SWITCH_PROCESSES_DESCRIPTION,
+        NumberParameter, _processes, true
+    )
+{
+    AddSwitch(_intervalSwitch);
+    AddSwitch(_countSwitch);
+    AddSwitch(_processesSwitch);
+}
+
+int
+Top::Execute() const
+{
+    if (_interval == 0)
+    {
+        throw Win32Exception(ERROR_INVALID_PARAMETER);
+    }
+
+    auto manager = UtilGetSharedServiceHandle(OpenSCManagerW(
+        NULL, NULL, GENERIC_READ
+    ));
+
+    if (!SvIsLxMonikaInstalled(manager))
+    {
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_INSTALLED);
+    }
+
+    // Watching a host must not change it, so the driver is never started from here.
+    if (!SvIsLxMonikaRunning(manager))
+    {
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_RUNNING);
+    }
+
+    auto reality = UtilGetSharedWin32Handle(CreateFileW(
+        L"\\\\?\\GLOBALROOT" RL_DEVICE_NAME,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    ));
+
+    const auto Ioctl = [&](DWORD dwCode, auto* pData)
+    {
+        DWORD dwBytesReturned = 0;
+
+        Win32Exception::ThrowIfFalse(DeviceIoControl(
+            reality.get(),
+            dwCode,
+            pData,
+            sizeof(*pData),
+            pData,
+            sizeof(*pData),
+            &dwBytesReturned,
+            NULL
+        ));
+    };
+
+    // Only for the provider names, which do not change while providers stay registered.
+    auto statistics = std::make_unique<RL_DRIVER_STATISTICS>();
+    statistics->Size = sizeof(RL_DRIVER_STATISTICS);
+    Ioctl(RL_IOCTL_QUERY_STATISTICS, statistics.get());
+
+    // The counters page is refreshed by the driver, reading it costs no calls at all.
+    RL_COUNTERS_MAP countersMap = { .Size = sizeof(RL_COUNTERS_MAP) };
+    Ioctl(RL_IOCTL_COUNTERS_MAP, &countersMap);
+
+    auto page = std::shared_ptr<const RL_COUNTERS_PAGE>(
+        countersMap.Page, [](const RL_COUNTERS_PAGE* p) { UnmapViewOfFile(p); }
+    );
+
+    std::vector<RL_PROCESS_INFORMATION> processes(RL_PROCESS_QUERY_MAX);
+
+    const auto TakeSample = [&](TopSample& sample)
+    {
+        LONG64 iSequence;
+
+        do
+        {
+            iSequence = page->Sequence;
+
+            sample.Timestamp = page->Timestamp;
+            sample.Frequency = page->Frequency;
+            sample.Instrumentation = page->Instrumentation;
+            sample.ProvidersCount = min(page->ProvidersCount, RL_PROVIDER_MAX);
+            memcpy(sample.Events, page->Events, sizeof(sample.Events));
+        }
+        while ((iSequence & 1) || iSequence != page->Sequence);
+
+        for (ULONG i = 0; i < sample.ProvidersCount; ++i)
+        {
+            RL_STATISTICS_QUERY query = { .Size = sizeof(RL_STATISTICS_QUERY), .ProviderIndex = i };
+            Ioctl(RL_IOCTL_STATISTICS_QUERY, &query);
+
+            std::copy(std::begin(query.Latency), std::end(query.Latency),
+                sample.Latency[i].begin());
+        }
+
+        RL_PROCESS_QUERY query =
+        {
+            .Size = sizeof(RL_PROCESS_QUERY),
+            .Count = processes.size(),
+            .Processes = processes.data()
+        };
+        Ioctl(RL_IOCTL_PROCESS_QUERY, &query);
+
+        sample.Processes.clear();
+        for (SIZE_T i = 0; i < query.Read; ++i)
+        {
+            sample.Processes[processes[i].ProcessId] = processes[i];
+        }
+        sample.ProcessesTotal = query.Total;
+    };
+
+    // Clear the screen between refreshes when the console understands escape sequences.
+    bool bCanClear = false;
+    {
+        HANDLE hdlOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD dwMode = 0;
+
+        if (GetConsoleMode(hdlOutput, &dwMode))
+        {
+            bCanClear = SetConsoleMode(hdlOutput, dwMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+        }
+    }
+
+    const auto ProviderName = [&](ULONG uProvider) -> std::wstring
+    {
+        if (uProvider >= RL_PROVIDER_MAX)
+        {
+            return std::to_wstring(uProvider);
+        }
+        return statistics->Providers[uProvider].Name;
+    };
+
+    auto previous = std::make_unique<TopSample>();
+    auto current = std::make_unique<TopSample>();
+
+    TakeSample(*previous);
+
+    for (size_t uRefresh = 0; _count == 0 || uRefresh < _count; ++uRefresh)
+    {
+        Sleep((DWORD)_interval);
+
+        TakeSample(*current);
+
+        // The page timestamp only moves every 100ms, so fall back to the requested interval.
+        double dSeconds = (current->Timestamp > previous->Timestamp)
+            ? (double)(current->Timestamp - previous->Timestamp) / current->Frequency
+            : _interval / 1000.0;
+
+        const auto Rate = [&](ULONG uProvider, int iEvent)
+        {
+            return (current->Events[uProvider][iEvent] - previous->Events[uProvider][iEvent])
+                / dSeconds;
+        };
+
+        // The upper bound of the bucket holding the given fraction of the system calls made
+        // since the last refresh.
+        const auto Percentile = [&](ULONG uProvider, double dFraction)
+        {
+            ULONG64 uTotal = 0;
+            for (int i = 0; i < RL_LATENCY_BUCKETS; ++i)
+            {
+                uTotal += current->Latency[uProvider][i] - previous->Latency[uProvider][i];
+            }
+
+            if (uTotal == 0)
+            {
+                return 0.0;
+            }
+
+            ULONG64 uTarget = max((ULONG64)(dFraction * uTotal), 1);
+            ULONG64 uSeen = 0;
+
+            for (int i = 0; i < RL_LATENCY_BUCKETS; ++i)
+            {
+                uSeen += current->Latency[uProvider][i] - previous->Latency[uProvider][i];
+                if (uSeen >= uTarget)
+                {
+                    return (double)(2ULL << i) * 1e6 / current->Frequency;
+                }
+            }
+
+            return (double)(2ULL << (RL_LATENCY_BUCKETS - 1)) * 1e6 / current->Frequency;
+        };
+
+        std::wstring output;
+
+        if (bCanClear)
+        {
+            output += L"\x1b[H\x1b[J";
+        }
+
+        output += std::vformat(
+            UtilGetResourceString(MA_STRING_TOP_SUMMARY),
+            std::make_wformat_args(current->ProvidersCount, current->ProcessesTotal, _interval)
+        );
+        output += L"\n";
+
+        if (!(current->Instrumentation & RL_INSTRUMENT_STATISTICS))
+        {
+            output += UtilGetResourceString(MA_STRING_TOP_STATISTICS_DISABLED);
+            output += L"\n";
+        }
+
+        output += L"\n";
+        output += std::format(L"{:<16} {:>12} {:>12} {:>15} {:>15} {:>10} {:>10}\n",
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_PROVIDER),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_SYSTEM_CALLS),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_EXCEPTIONS),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_PROCESSES),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_THREADS),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_P50),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_P99));
+
+        for (ULONG i = 0; i < current->ProvidersCount; ++i)
+        {
+            output += std::format(
+                L"{:<16.16} {:>12.0f} {:>12.0f} {:>15} {:>15} {:>10.1f} {:>10.1f}\n",
+                ProviderName(i),
+                Rate(i, RlTraceEventSystemCall),
+                Rate(i, RlTraceEventException),
+                std::format(L"{:.0f}/{:.0f}",
+                    Rate(i, RlTraceEventCreateProcess), Rate(i, RlTraceEventExitProcess)),
+                std::format(L"{:.0f}/{:.0f}",
+                    Rate(i, RlTraceEventCreateThread), Rate(i, RlTraceEventExitThread)),
+                Percentile(i, 0.5),
+                Percentile(i, 0.99));
+        }
+
+        // Processes that started since the last refresh count from zero.
+        struct ProcessRate
+        {
+            const RL_PROCESS_INFORMATION* Information;
+            double SystemCalls;
+            double Busy;
+            double Exceptions;
+        };
+
+        std::vector<ProcessRate> rates;
+        rates.reserve(current->Processes.size());
+
+        for (const auto& [uProcessId, information] : current->Processes)
+        {
+            RL_PROCESS_INFORMATION before = { };
+
+            auto it = previous->Processes.find(uProcessId);
+            if (it != previous->Processes.end())
+            {
+                before = it->second;
+            }
+
+            rates.push_back(ProcessRate
+            {
+                .Information = &information,
+                .SystemCalls = (information.SystemCalls - before.SystemCalls) / dSeconds,
+                .Busy = (double)(information.SystemCallTime - before.SystemCallTime)
+                    / current->Frequency / dSeconds * 100,
+                .Exceptions = (information.Exceptions - before.Exceptions) / dSeconds
+            });
+        }
+
+        size_t uShown = min(_processes, rates.size());
+
+        std::partial_sort(rates.begin(), rates.begin() + uShown, rates.end(),
+            [](const ProcessRate& a, const ProcessRate& b)
+            {
+                return a.SystemCalls > b.SystemCalls;
+            });
+
+        output += L"\n";
+        output += std::format(L"{:>10} {:<16} {:>6} {:>12} {:>8} {:>12}\n",
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_PROCESS_ID),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_PROVIDER),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_DEPTH),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_SYSTEM_CALLS),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_BUSY),
+            UtilGetResourceString(MA_STRING_TOP_COLUMN_EXCEPTIONS));
+
+        for (size_t i = 0; i < uShown; ++i)
+        {
+            output += std::format(L"{:>10} {:<16.16} {:>6} {:>12.0f} {:>8.1f} {:>12.0f}\n",
+                rates[i].Information->ProcessId,
+                ProviderName(rates[i].Information->Provider),
+                rates[i].Information->Depth,
+                rates[i].SystemCalls,
+                rates[i].Busy,
+                rates[i].Exceptions);
+        }
+
+        std::wcout << output << std::flush;
+
+        std::swap(previous, current);
+    }
+
+    return 0;
+}
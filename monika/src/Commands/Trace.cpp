@@ -0,0 +1,575 @@
+#include "Commands/Trace.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Windows.h>
+
+#include <lxmonika/reality.h>
+
+#include "resource.h"
+#include "service.h"
+#include "util.h"
+
+#include "Exception.h"
+#include "Parameter.h"
+
+#include "Commands/TraceDecode.h"
+
+// Records drained by one read. Large reads keep the number of calls low on busy hosts.
+#define MA_TRACE_READ_COUNT             (16384)
+
+// How long to wait for the rings to fill up again after a read that did not fill the buffer.
+#define MA_TRACE_IDLE_INTERVAL          (20)
+
+// Samples drained by one read. Each processor keeps a few hundred, which last half a second at
+// the default frequency.
+#define MA_TRACE_PROFILE_READ_COUNT     (4096)
+
+// Signaled by Ctrl+C and Ctrl+Break, so that the file is completed before exiting.
+static HANDLE TraceStopEvent = NULL;
+
+static
+BOOL
+WINAPI
+TraceConsoleCtrlHandler(
+    DWORD dwCtrlType
+)
+{
+    if (dwCtrlType == CTRL_C_EVENT || dwCtrlType == CTRL_BREAK_EVENT)
+    {
+        SetEvent(TraceStopEvent);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+Trace::Trace(const CommandBase* parentCommand)
+  : Command(
+        MA_STRING_TRACE_COMMAND_NAME,
+        MA_STRING_TRACE_COMMAND_DESCRIPTION,
+        _rest,
+        parentCommand
+    ),
+    _traceDecodeCommand(this),
+    _rest(
+        -1, -1, MA_STRING_TRACE_COMMAND_ARGUMENT_DESCRIPTION,
+        PathParameter, _path, true
+    ),
+    _providerNameSwitch(
+        MA_STRING_EXEC_SWITCH_PROVIDER_NAME_NAME, -1,
+        MA_STRING_TRACE_SWITCH_PROVIDER_NAME_DESCRIPTION,
+        StringParameter, _providerName, true
+    ),
+    _processIdSwitch(
+        MA_STRING_TRACE_SWITCH_PROCESS_ID_NAME, -1,
+        MA_STRING_TRACE_SWITCH_PROCESS_ID_DESCRIPTION,
+        NumberParameter, _processId, true
+    ),
+    _systemCallsSwitch(
+        MA_STRING_TRACE_SWITCH_SYSTEM_CALLS_NAME, -1,
+        MA_STRING_TRACE_SWITCH_SYSTEM_CALLS_DESCRIPTION,
+        StringParameter, _systemCalls, true
+    ),
+    _durationSwitch(
+        MA_STRING_TRACE_SWITCH_DURATION_NAME, -1,
+        MA_STRING_TRACE_SWITCH_DURATION_DESCRIPTION,
+        NumberParameter, _duration, true
+    ),
+    _profileSwitch(
+        MA_STRING_TRACE_SWITCH_PROFILE_NAME, -1,
+        MA_STRING_TRACE_SWITCH_PROFILE_DESCRIPTION,
+        NullParameter, _profile, true
+    ),
+    _frequencySwitch(
+        MA_STRING_TRACE_SWITCH_FREQUENCY_NAME, -1,
+        MA_STRING_TRACE_SWITCH_FREQUENCY_DESCRIPTION,
+        NumberParameter, _frequency, true
+    )
+{
+    AddCommand(_traceDecodeCommand);
+    AddSwitch(_providerNameSwitch);
+    AddSwitch(_processIdSwitch);
+    AddSwitch(_systemCallsSwitch);
+    AddSwitch(_durationSwitch);
+    AddSwitch(_profileSwitch);
+    AddSwitch(_frequencySwitch);
+}
+
+int
+Trace::Execute() const
+{
+    auto manager = UtilGetSharedServiceHandle(OpenSCManagerW(
+        NULL, NULL, GENERIC_READ
+    ));
+
+    if (!SvIsLxMonikaInstalled(manager))
+    {
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_INSTALLED);
+    }
+
+    if (!SvIsLxMonikaRunning(manager))
+    {
+        throw MonikaException(MA_STRING_EXCEPTION_LXMONIKA_NOT_RUNNING);
+    }
+
+    auto reality = UtilGetSharedWin32Handle(CreateFileW(
+        L"\\\\?\\GLOBALROOT" RL_DEVICE_NAME,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    ));
+
+    const auto Ioctl = [&](DWORD dwCode, auto* pData)
+    {
+        DWORD dwBytesReturned = 0;
+
+        return DeviceIoControl(
+            reality.get(),
+            dwCode,
+            pData,
+            sizeof(*pData),
+            pData,
+            sizeof(*pData),
+            &dwBytesReturned,
+            NULL
+        );
+    };
+
+    // The filter is applied by the driver as events happen, so that rejected events cost
+    // neither ring space nor copies.
+    RL_TRACE_FILTER filter = { .Size = sizeof(RL_TRACE_FILTER), .Set = TRUE };
+
+    auto statistics = std::make_unique<RL_DRIVER_STATISTICS>();
+    statistics->Size = sizeof(RL_DRIVER_STATISTICS);
+    Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_QUERY_STATISTICS, statistics.get()));
+
+    ULONG ulProvidersCount = (ULONG)min(statistics->ProvidersCount, RL_PROVIDER_MAX);
+
+    if (_providerName.has_value())
+    {
+        for (ULONG i = 0; i < ulProvidersCount; ++i)
+        {
+            if (_wcsicmp(statistics->Providers[i].Name, _providerName.value().c_str()) == 0)
+            {
+                filter.ProviderMask |= 1ul << i;
+            }
+        }
+
+        if (filter.ProviderMask == 0)
+        {
+            throw MonikaException(
+                MA_STRING_EXCEPTION_UNKNOWN_PROVIDER,
+                HRESULT_FROM_WIN32(ERROR_NOT_FOUND),
+                _providerName.value()
+            );
+        }
+    }
+
+    if (_profile)
+    {
+        return Profile(reality.get(), *statistics, filter.ProviderMask);
+    }
+
+    filter.ProcessId = _processId;
+
+    if (_systemCalls.has_value())
+    {
+        std::wstring_view list = _systemCalls.value();
+
+        while (!list.empty())
+        {
+            size_t uComma = list.find(L',');
+            std::wstring_view number = list.substr(0, uComma);
+            list = (uComma == std::wstring_view::npos)
+                ? std::wstring_view() : list.substr(uComma + 1);
+
+            if (number.empty() || number.size() > 18
+                || !std::all_of(number.begin(), number.end(),
+                    [](wchar_t wc) { return wc >= L'0' && wc <= L'9'; })
+                || filter.NumberCount == RL_TRACE_FILTER_NUMBERS_MAX)
+            {
+                throw MonikaException(
+                    MA_STRING_EXCEPTION_INVALID_NUMBER,
+                    HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER),
+                    number
+                );
+            }
+
+            filter.Numbers[filter.NumberCount++] = std::stoull(std::wstring(number));
+        }
+    }
+
+    std::filesystem::path path = _path.value_or(MA_TRACE_DEFAULT_PATH);
+
+    // Overlapped, so that the file is written while the next batch is drained.
+    auto file = UtilGetSharedWin32Handle(CreateFileW(
+        path.c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL
+    ));
+
+    auto header = std::make_unique<TraceFileHeader>();
+    header->Magic = TraceFileMagic;
+    header->Version = TraceFileVersion;
+    header->RecordSize = sizeof(TraceFileRecord);
+
+    for (ULONG i = 0; i < ulProvidersCount; ++i)
+    {
+        wcscpy_s(header->ProviderNames[i], statistics->Providers[i].Name);
+    }
+
+    LARGE_INTEGER liValue;
+    QueryPerformanceFrequency(&liValue);
+    header->Frequency = liValue.QuadPart;
+    QueryPerformanceCounter(&liValue);
+    header->StartTimestamp = liValue.QuadPart;
+
+    // One buffer is being written while the other one is filled.
+    struct TraceWriteBuffer
+    {
+        std::vector<TraceFileRecord> Records;
+        OVERLAPPED Overlapped;
+        std::shared_ptr<std::remove_pointer_t<HANDLE>> Event;
+        bool Pending;
+    };
+
+    TraceWriteBuffer buffers[2];
+    for (auto& buffer: buffers)
+    {
+        buffer.Records.reserve(MA_TRACE_READ_COUNT);
+        buffer.Event = UtilGetSharedWin32Handle(Win32Exception::ThrowIfNull(
+            CreateEventW(NULL, TRUE, FALSE, NULL)
+        ));
+        buffer.Pending = false;
+    }
+
+    ULONG64 uOffset = 0;
+
+    const auto Write = [&](TraceWriteBuffer& buffer, const void* pData, DWORD dwSize)
+    {
+        buffer.Overlapped = { };
+        buffer.Overlapped.Offset = (DWORD)uOffset;
+        buffer.Overlapped.OffsetHigh = (DWORD)(uOffset >> 32);
+        buffer.Overlapped.hEvent = buffer.Event.get();
+
+        if (!WriteFile(file.get(), pData, dwSize, NULL, &buffer.Overlapped)
+            && GetLastError() != ERROR_IO_PENDING)
+        {
+            throw Win32Exception();
+        }
+
+        buffer.Pending = true;
+        uOffset += dwSize;
+    };
+
+    const auto Wait = [&](TraceWriteBuffer& buffer)
+    {
+        if (buffer.Pending)
+        {
+            DWORD dwWritten = 0;
+            buffer.Pending = false;
+            Win32Exception::ThrowIfFalse(GetOverlappedResult(
+                file.get(), &buffer.Overlapped, &dwWritten, TRUE
+            ));
+        }
+    };
+
+    Write(buffers[0], header.get(), sizeof(TraceFileHeader));
+    Wait(buffers[0]);
+
+    TraceStopEvent = Win32Exception::ThrowIfNull(CreateEventW(NULL, TRUE, FALSE, NULL));
+    auto stopEvent = UtilGetSharedWin32Handle(TraceStopEvent);
+    Win32Exception::ThrowIfFalse(SetConsoleCtrlHandler(TraceConsoleCtrlHandler, TRUE));
+
+    // The previous filter and trace state are put back however recording ends.
+    RL_TRACE_FILTER previousFilter = { .Size = sizeof(RL_TRACE_FILTER), .Set = FALSE };
+    Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_TRACE_FILTER, &previousFilter));
+    Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_TRACE_FILTER, &filter));
+
+    RL_TRACE_CONTROL control = { .Size = sizeof(RL_TRACE_CONTROL), .Enable = TRUE };
+    Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_TRACE_CONTROL, &control));
+
+    auto restore = std::shared_ptr<void>(nullptr, [&](void*)
+    {
+        SetConsoleCtrlHandler(TraceConsoleCtrlHandler, FALSE);
+
+        if (!control.WasEnabled)
+        {
+            RL_TRACE_CONTROL disable = { .Size = sizeof(RL_TRACE_CONTROL), .Enable = FALSE };
+            Ioctl(RL_IOCTL_TRACE_CONTROL, &disable);
+        }
+
+        previousFilter.Set = TRUE;
+        Ioctl(RL_IOCTL_TRACE_FILTER, &previousFilter);
+    });
+
+    {
+        std::wstring pathString = path.wstring();
+        std::wcerr << std::vformat(
+            UtilGetResourceString(MA_STRING_TRACE_RECORDING),
+            std::make_wformat_args(pathString)
+        ) << std::endl;
+    }
+
+    std::vector<RL_TRACE_RECORD> records(MA_TRACE_READ_COUNT);
+    ULONG64 uRecordsCount = 0;
+    ULONG64 uLostCount = 0;
+    ULONGLONG uDeadline = (_duration != 0) ? GetTickCount64() + _duration * 1000 : 0;
+    size_t uCurrent = 0;
+    bool bStopping = false;
+
+    while (true)
+    {
+        RL_TRACE_READ read =
+        {
+            .Size = sizeof(RL_TRACE_READ),
+            .Count = records.size(),
+            .Records = records.data()
+        };
+        Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_TRACE_READ, &read));
+
+        uLostCount += read.Lost;
+
+        if (read.Read != 0)
+        {
+            TraceWriteBuffer& buffer = buffers[uCurrent];
+            Wait(buffer);
+
+            buffer.Records.resize(read.Read);
+            for (SIZE_T i = 0; i < read.Read; ++i)
+            {
+                const RL_TRACE_RECORD& record = records[i];
+                buffer.Records[i] =
+                {
+                    .Timestamp = record.Timestamp,
+                    .ProcessId = record.ProcessId,
+                    .ThreadId = record.ThreadId,
+                    .Number = record.Number,
+                    .Result = record.Result,
+                    .Event = record.Event,
+                    .Provider = record.Provider,
+                    .Processor = record.Processor
+                };
+            }
+
+            Write(buffer, buffer.Records.data(),
+                (DWORD)(buffer.Records.size() * sizeof(TraceFileRecord)));
+
+            uRecordsCount += read.Read;
+            uCurrent ^= 1;
+        }
+
+        if (read.Read == read.Count)
+        {
+            continue;
+        }
+
+        // The rings have been emptied once after being asked to stop.
+        if (bStopping)
+        {
+            break;
+        }
+
+        bStopping = WaitForSingleObject(stopEvent.get(), MA_TRACE_IDLE_INTERVAL) == WAIT_OBJECT_0
+            || (uDeadline != 0 && GetTickCount64() >= uDeadline);
+    }
+
+    restore.reset();
+
+    Wait(buffers[0]);
+    Wait(buffers[1]);
+
+    // Counts are only known now, the header goes back to the start of the file.
+    header->RecordsCount = uRecordsCount;
+    header->LostCount = uLostCount;
+
+    uOffset = 0;
+    Write(buffers[0], header.get(), sizeof(TraceFileHeader));
+    Wait(buffers[0]);
+
+    std::wstring pathString = path.wstring();
+    std::wcout << std::vformat(
+        UtilGetResourceString(MA_STRING_TRACE_SUMMARY),
+        std::make_wformat_args(uRecordsCount, pathString, uLostCount)
+    ) << std::endl;
+
+    return 0;
+}
+
+int
+Trace::Profile(
+    HANDLE reality,
+    const RL_DRIVER_STATISTICS& statistics,
+    ULONG providerMask
+) const
+{
+    const auto Ioctl = [&](DWORD dwCode, auto* pData)
+    {
+        DWORD dwBytesReturned = 0;
+
+        return DeviceIoControl(
+            reality,
+            dwCode,
+            pData,
+            sizeof(*pData),
+            pData,
+            sizeof(*pData),
+            &dwBytesReturned,
+            NULL
+        );
+    };
+
+    if (_frequency > RL_PROFILE_FREQUENCY_MAX)
+    {
+        throw MonikaException(
+            MA_STRING_EXCEPTION_INVALID_NUMBER,
+            HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER),
+            std::to_wstring(_frequency)
+        );
+    }
+
+    // Written as UTF-8 text once recording stops, so the file is created first to fail early.
+    std::filesystem::path path = _path.value_or(MA_TRACE_DEFAULT_PROFILE_PATH);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+        throw Win32Exception(ERROR_CANNOT_MAKE);
+    }
+
+    TraceStopEvent = Win32Exception::ThrowIfNull(CreateEventW(NULL, TRUE, FALSE, NULL));
+    auto stopEvent = UtilGetSharedWin32Handle(TraceStopEvent);
+    Win32Exception::ThrowIfFalse(SetConsoleCtrlHandler(TraceConsoleCtrlHandler, TRUE));
+
+    RL_PROFILE_CONTROL control =
+    {
+        .Size = sizeof(RL_PROFILE_CONTROL),
+        .Enable = TRUE,
+        .Flags = RL_PROFILE_FLAG_USER_STACKS,
+        .Frequency = (ULONG)_frequency,
+        .ProviderMask = providerMask,
+        .ProcessCount = (_processId != 0) ? 1ul : 0ul,
+        .ProcessIds = { _processId }
+    };
+    Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_PROFILE_CONTROL, &control));
+
+    auto stop = std::shared_ptr<void>(nullptr, [&](void*)
+    {
+        SetConsoleCtrlHandler(TraceConsoleCtrlHandler, FALSE);
+
+        RL_PROFILE_CONTROL disable = { .Size = sizeof(RL_PROFILE_CONTROL), .Enable = FALSE };
+        Ioctl(RL_IOCTL_PROFILE_CONTROL, &disable);
+    });
+
+    {
+        std::wstring pathString = path.wstring();
+        std::wcerr << std::vformat(
+            UtilGetResourceString(MA_STRING_TRACE_RECORDING),
+            std::make_wformat_args(pathString)
+        ) << std::endl;
+    }
+
+    // Folded stacks: the frames from the outermost caller to the sampled instruction, separated
+    // by semicolons, under the provider and the process. Without symbols for the ELF images, the
+    // frames are addresses.
+    std::map<std::wstring, ULONG64> stacks;
+
+    const auto Fold = [&](const RL_PROFILE_SAMPLE& sample)
+    {
+        std::wstring stack = (sample.Provider < RL_PROVIDER_MAX)
+            ? statistics.Providers[sample.Provider].Name : L"?";
+        stack += std::format(L";{}", sample.ProcessId);
+
+        for (USHORT i = min(sample.FrameCount, RL_PROFILE_FRAMES_MAX); i > 0; --i)
+        {
+            stack += std::format(L";0x{:x}", sample.Frames[i - 1]);
+        }
+
+        ++stacks[stack];
+    };
+
+    std::vector<RL_PROFILE_SAMPLE> samples(MA_TRACE_PROFILE_READ_COUNT);
+    ULONG64 uSamplesCount = 0;
+    ULONG64 uLostCount = 0;
+    ULONGLONG uDeadline = (_duration != 0) ? GetTickCount64() + _duration * 1000 : 0;
+    bool bStopping = false;
+
+    while (true)
+    {
+        RL_PROFILE_READ read =
+        {
+            .Size = sizeof(RL_PROFILE_READ),
+            .Count = samples.size(),
+            .Samples = samples.data()
+        };
+        Win32Exception::ThrowIfFalse(Ioctl(RL_IOCTL_PROFILE_READ, &read));
+
+        uLostCount += read.Lost;
+        uSamplesCount += read.Read;
+
+        for (SIZE_T i = 0; i < read.Read; ++i)
+        {
+            Fold(samples[i]);
+        }
+
+        if (read.Read == read.Count)
+        {
+            continue;
+        }
+
+        // The buffers have been emptied once after the profile stopped.
+        if (bStopping)
+        {
+            break;
+        }
+
+        if (WaitForSingleObject(stopEvent.get(), MA_TRACE_IDLE_INTERVAL) == WAIT_OBJECT_0
+            || (uDeadline != 0 && GetTickCount64() >= uDeadline))
+        {
+            // Samples stay readable once stopped, so the last ones are drained afterwards.
+            stop.reset();
+            bStopping = true;
+        }
+    }
+
+    for (const auto& [stack, count]: stacks)
+    {
+        int iSize = WideCharToMultiByte(CP_UTF8, 0, stack.data(), (int)stack.size(),
+            NULL, 0, NULL, NULL);
+        std::string line(iSize, '\0');
+        WideCharToMultiByte(CP_UTF8, 0, stack.data(), (int)stack.size(),
+            line.data(), iSize, NULL, NULL);
+
+        file << line << ' ' << count << '\n';
+    }
+
+    file.close();
+    if (!file)
+    {
+        throw Win32Exception(ERROR_WRITE_FAULT);
+    }
+
+    std::wstring pathString = path.wstring();
+    size_t uStacksCount = stacks.size();
+    std::wcout << std::vformat(
+        UtilGetResourceString(MA_STRING_TRACE_PROFILE_SUMMARY),
+        std::make_wformat_args(uSamplesCount, uStacksCount, pathString, uLostCount)
+    ) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "Commands/TraceDecode.h"
+
+#include <array>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Windows.h>
+
+#include <lxmonika/reality.h>
+
+#include "resource.h"
+#include "util.h"
+
+#include "Exception.h"
+#include "Parameter.h"
+
+#include "Commands/Trace.h"
+
+// Records decoded at once.
+#define MA_TRACE_DECODE_COUNT           (16384)
+
+// Indexed by RlTraceEvents. Not localized, so that the output stays easy to parse.
+static constexpr std::array<const wchar_t*, RlTraceEventMaxCount> TraceEventNames =
+{
+    L"syscall",
+    L"create-process",
+    L"create-thread",
+    L"exit-process",
+    L"exit-thread",
+    L"exception"
+};
+
+TraceDecode::TraceDecode(const CommandBase* parentCommand)
+  : Command(
+        MA_STRING_TRACE_DECODE_COMMAND_NAME,
+        MA_STRING_TRACE_DECODE_COMMAND_DESCRIPTION,
+        _rest,
+        parentCommand
+    ),
+    _rest(
+        -1, -1, MA_STRING_TRACE_DECODE_COMMAND_ARGUMENT_DESCRIPTION,
+        PathParameter, _path, true
+    ),
+    _csvSwitch(
+        MA_STRING_TRACE_DECODE_SWITCH_CSV_NAME, -1,
+        MA_STRING_TRACE_DECODE_SWITCH_CSV_DESCRIPTION,
+        NullParameter, _csv, true
+    )
+{
+    AddSwitch(_csvSwitch);
+}
+
+int
+TraceDecode::Execute() const
+{
+    std::filesystem::path path = _path.value_or(MA_TRACE_DEFAULT_PATH);
+    std::wstring pathString = path.wstring();
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw Win32Exception(ERROR_FILE_NOT_FOUND);
+    }
+
+    auto header = std::make_unique<TraceFileHeader>();
+    file.read((char*)header.get(), sizeof(TraceFileHeader));
+
+    if (!file || header->Magic != TraceFileMagic || header->Version < TraceFileVersion
+        || header->RecordSize < sizeof(TraceFileRecord) || header->RecordSize > 1024
+        || header->Frequency <= 0)
+    {
+        throw MonikaException(
+            MA_STRING_EXCEPTION_INVALID_TRACE_FILE,
+            HRESULT_FROM_WIN32(ERROR_INVALID_DATA),
+            pathString
+        );
+    }
+
+    // Names are trusted no further than their buffers.
+    for (auto& name: header->ProviderNames)
+    {
+        name[RL_PROVIDER_NAME_SIZE - 1] = L'\0';
+    }
+
+    const auto ProviderName = [&](USHORT uProvider) -> std::wstring
+    {
+        if (uProvider >= RL_PROVIDER_MAX || header->ProviderNames[uProvider][0] == L'\0')
+        {
+            return std::to_wstring(uProvider);
+        }
+        return header->ProviderNames[uProvider];
+    };
+
+    const auto EventName = [&](USHORT uEvent) -> std::wstring
+    {
+        if (uEvent >= TraceEventNames.size())
+        {
+            return std::to_wstring(uEvent);
+        }
+        return TraceEventNames[uEvent];
+    };
+
+    if (_csv)
+    {
+        std::wcout << L"timestamp_us,processor,provider,process_id,thread_id,event,number,result"
+            << L'\n';
+    }
+
+    double dTickMicroseconds = 1e6 / (double)header->Frequency;
+    std::vector<char> buffer((size_t)header->RecordSize * MA_TRACE_DECODE_COUNT);
+
+    while (file)
+    {
+        file.read(buffer.data(), buffer.size());
+        size_t uCount = (size_t)file.gcount() / header->RecordSize;
+
+        for (size_t i = 0; i < uCount; ++i)
+        {
+            // Fields appended by later versions are skipped along with the rest of the record.
+            TraceFileRecord record;
+            memcpy(&record, buffer.data() + i * header->RecordSize, sizeof(record));
+
+            double dTime = (double)(record.Timestamp - header->StartTimestamp) * dTickMicroseconds;
+            std::wstring provider = ProviderName(record.Provider);
+            std::wstring event = EventName(record.Event);
+
+            if (_csv)
+            {
+                std::wcout << std::format(L"{:.3f},{},{},{},{},{},{},{}",
+                    dTime, record.Processor, provider, record.ProcessId, record.ThreadId,
+                    event, record.Number, record.Result) << L'\n';
+            }
+            else
+            {
+                std::wcout << std::format(
+                    L"{:>14.3f} {:>3} {:<12} {:>6} {:>6} {:<14} 0x{:x} 0x{:x}",
+                    dTime, record.Processor, provider, record.ProcessId, record.ThreadId,
+                    event, record.Number, record.Result) << L'\n';
+            }
+        }
+    }
+
+    std::wcout.flush();
+
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <filesystem>
 #include <fstream>
+#include <string>
 #include <vector>
 
 #include "resource.h"
@@ -322,6 +323,54 @@ extern const Parameter& DriverPathParameter = ([]()
     return DriverPathParameter;
 })();
 
+//
+// NumberParameter
+//
+
+extern const Parameter& NumberParameter = ([]()
+{
+    static const class NumberParameter : public AbstractStringParameter
+    {
+    public:
+        NumberParameter() : AbstractStringParameter(MA_STRING_PARAMETER_NAME_NUMBER) { }
+    protected:
+        virtual bool Validate(const std::wstring_view& arg) const override
+        {
+            if (arg.empty() || arg.size() > 18
+                || !std::all_of(arg.begin(), arg.end(),
+                    [](wchar_t wc) { return wc >= L'0' && wc <= L'9'; }))
+            {
+                throw MonikaException(
+                    MA_STRING_EXCEPTION_INVALID_NUMBER,
+                    HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER),
+                    arg
+                );
+            }
+
+            return AbstractStringParameter::Validate(arg);
+        }
+        virtual std::any Convert(const std::optional<std::wstring_view>& arg,
+            const std::type_info& type) const override
+        {
+            if (type == typeid(size_t))
+            {
+                return (size_t)std::stoull(std::wstring(EnsureHasValue(arg)));
+            }
+            else if (type == typeid(std::optional<size_t>))
+            {
+                return arg.has_value() ?
+                    std::optional((size_t)std::stoull(std::wstring(arg.value()))) : std::nullopt;
+            }
+            else
+            {
+                return AbstractStringParameter::Convert(arg, type);
+            }
+        }
+    } NumberParameter;
+
+    return NumberParameter;
+})();
+
 //
 // PathParameter
 //
@@ -1,5 +1,7 @@
 #include "util.h"
 
+#include <string>
+#include <tuple>
 #include <unordered_map>
 
 #include <comdef.h>
@@ -153,3 +155,37 @@ UtilWin32ToNtPath(
 
     return result;
 }
+
+std::wstring
+UtilUtf8ToWide(
+    std::string_view utf8
+)
+{
+    if (utf8.empty())
+    {
+        return std::wstring();
+    }
+
+    int cchWideChar = Win32Exception::ThrowIfNull(MultiByteToWideChar(
+        CP_UTF8,
+        MB_ERR_INVALID_CHARS,
+        utf8.data(),
+        (int)utf8.size(),
+        nullptr,
+        0
+    ));
+
+    std::wstring result;
+    result.resize(cchWideChar);
+
+    std::ignore = Win32Exception::ThrowIfNull(MultiByteToWideChar(
+        CP_UTF8,
+        MB_ERR_INVALID_CHARS,
+        utf8.data(),
+        (int)utf8.size(),
+        result.data(),
+        (int)result.size()
+    ));
+
+    return result;
+}
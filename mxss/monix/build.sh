@@ -45,6 +45,7 @@ for filename in src/*; do
     filenamenoext="${filename%.*}"
     $CXX src/$filename                      \
         -o obj/$ARCH/bin/$filenamenoext     \
+        -I include                          \
         -I ../../lxmonika/include           \
         -nostdlib -static -s                \
         -Werror -Wall -Wextra -Wpedantic    \
@@ -0,0 +1,10 @@
+#include "monix.h"
+
+// Exits right away. 'monika bench' times sessions of this program to measure the cost of
+// starting and tearing down a Pico process.
+
+extern "C"
+void _start()
+{
+    MonixSyscall(SYSCALL_EXIT, 0);
+}
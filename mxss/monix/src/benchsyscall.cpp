@@ -0,0 +1,19 @@
+#include "monix.h"
+
+// Makes a fixed number of cheap system calls, then exits. 'monika bench' subtracts the cost of
+// a benchexit session to get the cost of a round trip through the Pico dispatch path.
+
+// Must match MA_BENCH_SYSCALL_PROBE_CALLS in monika/src/Commands/Bench.cpp.
+#define SYSCALL_COUNT                           10000
+
+extern "C"
+void _start()
+{
+    for (int i = 0; i < SYSCALL_COUNT; ++i)
+    {
+        // Only reads the current break.
+        MonixSyscall(SYSCALL_BRK, 0);
+    }
+
+    MonixSyscall(SYSCALL_EXIT, 0);
+}
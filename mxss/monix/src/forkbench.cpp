@@ -0,0 +1,102 @@
+#include "monix.h"
+
+// Forks and reaps children in a loop, and reports the average cost of a fork. Run it under
+// poolmon to see the pool traffic of the mxss tag.
+
+#define STRING_AND_SIZE(str) (str), (sizeof(str) - 1)
+
+#define FORK_COUNT                              10000
+
+// Must match MX_SHARED_PAGE_ADDRESS and MX_SHARED_PAGE_DATA in mxss/include/shared.h.
+#define SHARED_PAGE_ADDRESS                     0x7FFD0000
+
+struct SharedPageData
+{
+    volatile uint32_t Sequence;
+    uint32_t ProcessId;
+    int64_t BootTime;
+    int64_t PerformanceFrequency;
+    volatile int64_t InterruptTime;
+    volatile int64_t SystemTime;
+    volatile int64_t PerformanceCounter;
+};
+
+// In 100ns units, refreshed every 10ms, which is plenty over thousands of forks.
+static
+int64_t
+ReadInterruptTime()
+{
+    const SharedPageData* pData = (const SharedPageData*)SHARED_PAGE_ADDRESS;
+
+    while (true)
+    {
+        uint32_t sequence = pData->Sequence;
+        if (sequence & 1)
+        {
+            continue;
+        }
+
+        int64_t time = pData->InterruptTime;
+        if (pData->Sequence == sequence)
+        {
+            return time;
+        }
+    }
+}
+
+static
+void
+WriteNumber(
+    uint64_t value
+)
+{
+    char buffer[20];
+    size_t index = sizeof(buffer);
+
+    do
+    {
+        buffer[--index] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    while (value != 0);
+
+    MonixSyscall(SYSCALL_WRITE, 1, buffer + index, sizeof(buffer) - index);
+}
+
+extern "C"
+void _start()
+{
+    int64_t start = ReadInterruptTime();
+    uint64_t forks = 0;
+
+    for (int i = 0; i < FORK_COUNT; ++i)
+    {
+        intptr_t pid = MonixSyscall(SYSCALL_FORK);
+
+        if (pid == 0)
+        {
+            MonixSyscall(SYSCALL_EXIT, 0);
+        }
+
+        if (pid < 0)
+        {
+            MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("fork failed\n"));
+            break;
+        }
+
+        MonixSyscall(SYSCALL_WAITPID, pid, 0, 0);
+        ++forks;
+    }
+
+    uint64_t elapsed = (uint64_t)(ReadInterruptTime() - start);
+
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("forks: "));
+    WriteNumber(forks);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("\ntotal: "));
+    WriteNumber(elapsed / 10);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" us\nper fork and wait: "));
+    WriteNumber(forks != 0 ? elapsed * 100 / forks : 0);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" ns\n"));
+
+    MonixSyscall(SYSCALL_EXIT, 0);
+}
@@ -0,0 +1,196 @@
+#include "monix.h"
+
+// Streams "y\n" lines from a forked child to its parent through a pipe, like `yes | head -c`,
+// and compares the throughput with writing the same lines to the console.
+
+#define STRING_AND_SIZE(str) (str), (sizeof(str) - 1)
+
+// Bytes the parent reads before closing its end, which stops the child the way head stops yes.
+#define PIPE_BYTES                              (256 * 1024 * 1024)
+// Much less, since every one of these ends up on the screen.
+#define CONSOLE_BYTES                           (256 * 1024)
+
+// Like the buffer of GNU yes, these go through the ring of the pipe.
+#define SMALL_WRITE                             (8 * 1024)
+// At least MX_PIPE_LOAN_THRESHOLD in mxss/include/pipe.h, so that readers copy straight from the
+// pages of the writer.
+#define LARGE_WRITE                             (1024 * 1024)
+
+// Must match MX_SHARED_PAGE_ADDRESS and MX_SHARED_PAGE_DATA in mxss/include/shared.h.
+#define SHARED_PAGE_ADDRESS                     0x7FFD0000
+
+struct SharedPageData
+{
+    volatile uint32_t Sequence;
+    uint32_t ProcessId;
+    int64_t BootTime;
+    int64_t PerformanceFrequency;
+    volatile int64_t InterruptTime;
+    volatile int64_t SystemTime;
+    volatile int64_t PerformanceCounter;
+};
+
+static char WriteBuffer[LARGE_WRITE];
+static char ReadBuffer[LARGE_WRITE];
+
+// In 100ns units, refreshed every 10ms, which is plenty over hundreds of megabytes.
+static
+int64_t
+ReadInterruptTime()
+{
+    const SharedPageData* pData = (const SharedPageData*)SHARED_PAGE_ADDRESS;
+
+    while (true)
+    {
+        uint32_t sequence = pData->Sequence;
+        if (sequence & 1)
+        {
+            continue;
+        }
+
+        int64_t time = pData->InterruptTime;
+        if (pData->Sequence == sequence)
+        {
+            return time;
+        }
+    }
+}
+
+static
+void
+WriteNumber(
+    uint64_t value
+)
+{
+    char buffer[20];
+    size_t index = sizeof(buffer);
+
+    do
+    {
+        buffer[--index] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    while (value != 0);
+
+    MonixSyscall(SYSCALL_WRITE, 1, buffer + index, sizeof(buffer) - index);
+}
+
+// Bytes per microsecond are megabytes per second.
+static
+void
+WriteResult(
+    uint64_t bytes,
+    int64_t elapsed
+)
+{
+    WriteNumber(bytes);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" bytes in "));
+    WriteNumber((uint64_t)elapsed / 10);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" us, "));
+    WriteNumber(elapsed > 0 ? bytes * 10 / (uint64_t)elapsed : 0);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" MB/s\n"));
+}
+
+static
+void
+RunPipe(
+    size_t writeSize
+)
+{
+    int fds[2];
+    if (MonixSyscall(SYSCALL_PIPE, fds) < 0)
+    {
+        MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("pipe failed\n"));
+        return;
+    }
+
+    intptr_t pid = MonixSyscall(SYSCALL_FORK);
+
+    if (pid == 0)
+    {
+        // yes, until the reader goes away.
+        MonixSyscall(SYSCALL_CLOSE, fds[0]);
+
+        while (MonixSyscall(SYSCALL_WRITE, fds[1], WriteBuffer, writeSize) > 0)
+        {
+        }
+
+        MonixSyscall(SYSCALL_EXIT, 0);
+    }
+
+    MonixSyscall(SYSCALL_CLOSE, fds[1]);
+
+    if (pid < 0)
+    {
+        MonixSyscall(SYSCALL_CLOSE, fds[0]);
+        MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("fork failed\n"));
+        return;
+    }
+
+    int64_t start = ReadInterruptTime();
+    uint64_t received = 0;
+
+    // head -c, which reads in large blocks whatever the writer does.
+    while (received < PIPE_BYTES)
+    {
+        intptr_t read = MonixSyscall(SYSCALL_READ, fds[0], ReadBuffer, sizeof(ReadBuffer));
+        if (read <= 0)
+        {
+            break;
+        }
+
+        received += (uint64_t)read;
+    }
+
+    int64_t elapsed = ReadInterruptTime() - start;
+
+    MonixSyscall(SYSCALL_CLOSE, fds[0]);
+    MonixSyscall(SYSCALL_WAITPID, pid, 0, 0);
+
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("pipe, "));
+    WriteNumber(writeSize);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" byte writes: "));
+    WriteResult(received, elapsed);
+}
+
+static
+void
+RunConsole()
+{
+    int64_t start = ReadInterruptTime();
+    uint64_t sent = 0;
+
+    while (sent < CONSOLE_BYTES)
+    {
+        intptr_t written = MonixSyscall(SYSCALL_WRITE, 1, WriteBuffer, SMALL_WRITE);
+        if (written <= 0)
+        {
+            break;
+        }
+
+        sent += (uint64_t)written;
+    }
+
+    int64_t elapsed = ReadInterruptTime() - start;
+
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("\nconsole, "));
+    WriteNumber(SMALL_WRITE);
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE(" byte writes: "));
+    WriteResult(sent, elapsed);
+}
+
+extern "C"
+void _start()
+{
+    for (size_t i = 0; i < sizeof(WriteBuffer); i += 2)
+    {
+        WriteBuffer[i] = 'y';
+        WriteBuffer[i + 1] = '\n';
+    }
+
+    RunConsole();
+    RunPipe(SMALL_WRITE);
+    RunPipe(LARGE_WRITE);
+
+    MonixSyscall(SYSCALL_EXIT, 0);
+}
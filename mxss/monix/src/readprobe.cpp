@@ -0,0 +1,96 @@
+#include "monix.h"
+
+// Hands kernel addresses to read and write, which must fail with -1 instead of copying. Exits with
+// the number of checks that did not.
+
+#define STRING_AND_SIZE(str) (str), (sizeof(str) - 1)
+
+// 32-bit programs have no pointer that reaches the kernel, and nothing to check.
+#if UINTPTR_MAX == UINT64_MAX
+// Above the user range of both x86_64 and arm64 Windows.
+#define KERNEL_ADDRESS                          ((void*)(uintptr_t)0xFFFF800000001000)
+// Runs from the top of the user range into the kernel.
+#define WRAPPING_ADDRESS                        ((void*)(uintptr_t)0x00007FFFFFFFF000)
+#define WRAPPING_SIZE                           ((size_t)0x0000800000002000)
+
+// Relative to the session root, which is where the tarball gets extracted.
+#define SELF_PATH                               "/bin/readprobe"
+
+static char Buffer[4096];
+static int Failures = 0;
+
+static
+void
+Check(
+    bool passed,
+    const char* message,
+    size_t length
+)
+{
+    if (!passed)
+    {
+        MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("FAIL: "));
+        MonixSyscall(SYSCALL_WRITE, 1, message, length);
+        ++Failures;
+    }
+}
+
+#define CHECK(expr) Check((expr), STRING_AND_SIZE(#expr "\n"))
+
+extern "C"
+void
+_start()
+{
+    int fds[2];
+    if (MonixSyscall(SYSCALL_PIPE, fds) < 0)
+    {
+        MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("pipe failed\n"));
+        MonixSyscall(SYSCALL_EXIT, 1);
+    }
+
+    // Pipe writes, from the ring and from a kernel source.
+    CHECK(MonixSyscall(SYSCALL_WRITE, fds[1], KERNEL_ADDRESS, 16) == -1);
+    CHECK(MonixSyscall(SYSCALL_WRITE, fds[1], STRING_AND_SIZE("probe")) == 5);
+
+    // Pipe reads, with bytes ready to be copied out.
+    CHECK(MonixSyscall(SYSCALL_READ, fds[0], KERNEL_ADDRESS, 16) == -1);
+    CHECK(MonixSyscall(SYSCALL_READ, fds[0], WRAPPING_ADDRESS, WRAPPING_SIZE) == -1);
+    CHECK(MonixSyscall(SYSCALL_READ, fds[0], Buffer, sizeof(Buffer)) == 5);
+
+    MonixSyscall(SYSCALL_CLOSE, fds[0]);
+    MonixSyscall(SYSCALL_CLOSE, fds[1]);
+
+    // The console, never reached once the buffer is refused.
+    CHECK(MonixSyscall(SYSCALL_WRITE, 1, KERNEL_ADDRESS, 16) == -1);
+    CHECK(MonixSyscall(SYSCALL_READ, 0, KERNEL_ADDRESS, 16) == -1);
+
+    // Files come from the page cache, which copies straight into the buffer.
+    intptr_t fd = MonixSyscall(SYSCALL_OPEN, SELF_PATH, 0);
+    if (fd >= 0)
+    {
+        CHECK(MonixSyscall(SYSCALL_READ, fd, Buffer, sizeof(Buffer)) > 0);
+        CHECK(MonixSyscall(SYSCALL_READ, fd, KERNEL_ADDRESS, sizeof(Buffer)) == -1);
+        MonixSyscall(SYSCALL_CLOSE, fd);
+    }
+    else
+    {
+        MonixSyscall(SYSCALL_WRITE, 1,
+            STRING_AND_SIZE("No session root, skipping the page cache checks.\n"));
+    }
+
+    if (Failures == 0)
+    {
+        MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("All checks passed.\n"));
+    }
+
+    MonixSyscall(SYSCALL_EXIT, Failures);
+}
+#else
+extern "C"
+void
+_start()
+{
+    MonixSyscall(SYSCALL_WRITE, 1, STRING_AND_SIZE("Nothing to check on 32-bit.\n"));
+    MonixSyscall(SYSCALL_EXIT, 0);
+}
+#endif
@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Windows.h>
 #include <winternl.h>
@@ -18,6 +24,64 @@ typedef struct _MX_EXECUTE_INFORMATION
     UNICODE_STRING ExecutablePath;
 } MX_EXECUTE_INFORMATION, *PMX_EXECUTE_INFORMATION;
 
+#define IOCTL_MX_EXECUTE_ASYNC \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x903, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _MX_EXECUTE_ASYNC_INFORMATION
+{
+    HANDLE Process;
+    ULONG ProcessId;
+} MX_EXECUTE_ASYNC_INFORMATION, *PMX_EXECUTE_ASYNC_INFORMATION;
+
+#define IOCTL_MX_EXECUTE_DIRECT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x904, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+#define IOCTL_MX_RESTORE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x905, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MX_OUTPUT_RING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x901, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _MX_OUTPUT_RING_INFORMATION
+{
+    ULONG Size;
+    HANDLE Event;
+    PVOID Ring;
+} MX_OUTPUT_RING_INFORMATION, *PMX_OUTPUT_RING_INFORMATION;
+
+// Must match mxss/include/ring.h.
+typedef struct _MX_OUTPUT_RING_HEADER {
+    volatile ULONG Head;
+    volatile ULONG Tail;
+    volatile LONG Waiting;
+    ULONG Size;
+    CHAR Data[ANYSIZE_ARRAY];
+} MX_OUTPUT_RING_HEADER, *PMX_OUTPUT_RING_HEADER;
+
+#define MX_OUTPUT_RING_SIZE (1024 * 1024)
+
+#define IOCTL_MX_QUERY_SYSCALL_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x902, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _MX_SYSCALL_STATISTICS_INFORMATION
+{
+    UINT64 Unknown;
+    UINT64 HandledFaults;
+    UINT32 Count;
+} MX_SYSCALL_STATISTICS_INFORMATION, *PMX_SYSCALL_STATISTICS_INFORMATION;
+
+// Must match mxss/include/provider.h.
+typedef struct _MX_SYSCALL_STATISTICS {
+    INT32 Number;
+    UINT32 Arity;
+    CHAR Name[16];
+    UINT64 Calls;
+    UINT64 Cycles;
+} MX_SYSCALL_STATISTICS, *PMX_SYSCALL_STATISTICS;
+
+// Far more than mxss implements, whatever does not fit is simply left out.
+#define MX_SYSCALL_STATISTICS_MAX 256
+
 template <typename... Args>
 void Print(Args&&... arg)
 {
@@ -93,6 +157,310 @@ BOOL IntializeRootDirectory(PCSTR pUserParameter, WSTRING* pDosDirectory)
     return TRUE;
 }
 
+// Writes whatever Monix processes put in the ring to our own standard output.
+void DrainOutputRing(PMX_OUTPUT_RING_HEADER pRing, HANDLE hdlEvent)
+{
+    HANDLE hdlOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    while (TRUE)
+    {
+        ULONG uHead = ReadULongAcquire(&pRing->Head);
+        ULONG uTail = pRing->Tail;
+
+        if (uHead != uTail)
+        {
+            ULONG uOffset = uTail & (pRing->Size - 1);
+            ULONG uCount = min(uHead - uTail, pRing->Size - uOffset);
+
+            DWORD dwWritten = 0;
+            WriteFile(hdlOutput, pRing->Data + uOffset, uCount, &dwWritten, NULL);
+
+            WriteULongRelease(&pRing->Tail, uTail + uCount);
+            continue;
+        }
+
+        // Announce the wait, then check again so that a write in between is not missed.
+        InterlockedExchange(&pRing->Waiting, TRUE);
+
+        if (ReadULongAcquire(&pRing->Head) != uTail)
+        {
+            InterlockedExchange(&pRing->Waiting, FALSE);
+            continue;
+        }
+
+        WaitForSingleObject(hdlEvent, INFINITE);
+    }
+}
+
+void PrintSyscallStatistics(HANDLE hdlDevice)
+{
+    std::vector<BYTE> vecBuffer(sizeof(MX_SYSCALL_STATISTICS_INFORMATION)
+        + MX_SYSCALL_STATISTICS_MAX * sizeof(MX_SYSCALL_STATISTICS));
+
+    IO_STATUS_BLOCK ioStatus;
+    NTSTATUS status = NtDeviceIoControlFile(
+        hdlDevice,
+        NULL,
+        NULL,
+        NULL,
+        &ioStatus,
+        IOCTL_MX_QUERY_SYSCALL_STATISTICS,
+        NULL,
+        0,
+        vecBuffer.data(),
+        (ULONG)vecBuffer.size()
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        MX_ERROR("Cannot query syscall statistics: ", (LPVOID)(ULONG_PTR)status);
+        return;
+    }
+
+    PMX_SYSCALL_STATISTICS_INFORMATION pInfo =
+        (PMX_SYSCALL_STATISTICS_INFORMATION)vecBuffer.data();
+    PMX_SYSCALL_STATISTICS pEntries = (PMX_SYSCALL_STATISTICS)(pInfo + 1);
+
+    for (UINT32 i = 0; i < pInfo->Count; ++i)
+    {
+        if (pEntries[i].Calls == 0)
+        {
+            continue;
+        }
+
+        Print(L"0x", std::hex, pEntries[i].Number, std::dec, L" ", pEntries[i].Name,
+            L"/", pEntries[i].Arity, L": ", pEntries[i].Calls, L" calls, ",
+            pEntries[i].Cycles / pEntries[i].Calls, L" cycles per call");
+    }
+
+    Print(pInfo->Unknown, L" unknown syscalls");
+    Print(pInfo->HandledFaults, L" page faults handled by Monix");
+}
+
+// Starts a process from a checkpoint written by a Monix program, like a binary it returns
+// without waiting for it.
+NTSTATUS RestoreCheckpoint(HANDLE hdlDevice, const WSTRING& strPath,
+    PMX_EXECUTE_ASYNC_INFORMATION pInfo)
+{
+    HANDLE hdlWin32File = CreateFileW(
+        strPath.data(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (hdlWin32File == INVALID_HANDLE_VALUE)
+    {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    WSTRING strNtPath = Win32HandleToPath(hdlWin32File, VOLUME_NAME_NT);
+    CloseHandle(hdlWin32File);
+
+    IO_STATUS_BLOCK ioStatus;
+    return NtDeviceIoControlFile(
+        hdlDevice,
+        NULL,
+        NULL,
+        NULL,
+        &ioStatus,
+        IOCTL_MX_RESTORE,
+        strNtPath.data(),
+        (ULONG)(strNtPath.size() * sizeof(WCHAR)),
+        pInfo,
+        sizeof(*pInfo)
+    );
+}
+
+// Runs every binary in the manifest uRepeat times, with up to uJobs of them in flight at once
+// over the one device handle, which must have been opened for overlapped I/O.
+int RunBatch(HANDLE hdlDevice, const WSTRING& strDosBinDir, PCSTR pManifestPath,
+    SIZE_T uJobs, SIZE_T uRepeat)
+{
+    std::ifstream manifest(pManifestPath);
+    if (!manifest)
+    {
+        MX_ERROR("Cannot open manifest ", pManifestPath);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    std::vector<WSTRING> vecNtPaths;
+    std::vector<WSTRING> vecNames;
+    bool bWarnedArgs = false;
+
+    std::string strLine;
+    while (std::getline(manifest, strLine))
+    {
+        std::istringstream line(strLine);
+        std::string strName;
+        if (!(line >> strName) || strName[0] == '#')
+        {
+            continue;
+        }
+
+        std::string strArg;
+        if (line >> strArg && !bWarnedArgs)
+        {
+            // MX_EXECUTE_INFORMATION has no room for them either.
+            MX_WARN("Arguments are not supported by mxss yet and are ignored");
+            bWarnedArgs = true;
+        }
+
+        WSTRING strWideName(strName.begin(), strName.end());
+
+        HANDLE hdlWin32BinFile = CreateFileW(
+            (strDosBinDir + strWideName).data(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL
+        );
+
+        if (hdlWin32BinFile == INVALID_HANDLE_VALUE)
+        {
+            MX_ERROR("Binary ", strWideName, " not found");
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        vecNtPaths.push_back(Win32HandleToPath(hdlWin32BinFile, VOLUME_NAME_NT));
+        vecNames.push_back(std::move(strWideName));
+        CloseHandle(hdlWin32BinFile);
+    }
+
+    if (vecNtPaths.empty())
+    {
+        MX_ERROR("Manifest ", pManifestPath, " lists no binaries");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    HANDLE hdlPort = CreateIoCompletionPort(hdlDevice, NULL, 0, 0);
+    if (hdlPort == NULL)
+    {
+        MX_ERROR("Cannot create completion port: ", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+    std::shared_ptr<VOID> _hdlPort(hdlPort, CloseHandle);
+
+    using Clock = std::chrono::steady_clock;
+
+    struct BatchRun
+    {
+        // First, so that the OVERLAPPED pointer from the port is the run itself.
+        OVERLAPPED Overlapped;
+        NTSTATUS ExitStatus;
+        SIZE_T Index;
+        Clock::time_point Start;
+    };
+
+    SIZE_T uTotal = vecNtPaths.size() * uRepeat;
+    uJobs = max(1, min(uJobs, uTotal));
+
+    std::vector<BatchRun> vecRuns(uJobs);
+    std::vector<double> vecLatencies;
+    vecLatencies.reserve(uTotal);
+
+    SIZE_T uSubmitted = 0;
+    SIZE_T uInFlight = 0;
+    SIZE_T uFailed = 0;
+    SIZE_T uNonZero = 0;
+
+    const auto Submit = [&](BatchRun& run)
+    {
+        while (uSubmitted < uTotal)
+        {
+            run = BatchRun{};
+            run.Index = uSubmitted++ % vecNtPaths.size();
+            run.Start = Clock::now();
+
+            const WSTRING& strNtPath = vecNtPaths[run.Index];
+            if (DeviceIoControl(hdlDevice, IOCTL_MX_EXECUTE_DIRECT, (LPVOID)strNtPath.data(),
+                (DWORD)(strNtPath.size() * sizeof(WCHAR)), &run.ExitStatus,
+                sizeof(run.ExitStatus), NULL, &run.Overlapped)
+                || GetLastError() == ERROR_IO_PENDING)
+            {
+                // Either way, the result arrives through the port.
+                ++uInFlight;
+                return;
+            }
+
+            MX_ERROR("Cannot create process ", vecNames[run.Index], ": ", GetLastError());
+            ++uFailed;
+        }
+    };
+
+    MX_INFO("running ", uTotal, " programs, ", uJobs, " at a time");
+
+    Clock::time_point batchStart = Clock::now();
+
+    for (BatchRun& run : vecRuns)
+    {
+        Submit(run);
+    }
+
+    while (uInFlight > 0)
+    {
+        DWORD dwTransferred = 0;
+        ULONG_PTR uKey = 0;
+        LPOVERLAPPED pOverlapped = NULL;
+        BOOL bSuccess = GetQueuedCompletionStatus(hdlPort, &dwTransferred, &uKey,
+            &pOverlapped, INFINITE);
+
+        if (pOverlapped == NULL)
+        {
+            MX_ERROR("Cannot wait for programs: ", GetLastError());
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        BatchRun& run = *CONTAINING_RECORD(pOverlapped, BatchRun, Overlapped);
+        --uInFlight;
+
+        if (!bSuccess)
+        {
+            MX_ERROR("Program ", vecNames[run.Index], " failed: ", GetLastError());
+            ++uFailed;
+        }
+        else
+        {
+            vecLatencies.push_back(std::chrono::duration<double, std::micro>(
+                Clock::now() - run.Start).count());
+
+            if (run.ExitStatus != 0)
+            {
+                ++uNonZero;
+            }
+        }
+
+        Submit(run);
+    }
+
+    double dSeconds = std::chrono::duration<double>(Clock::now() - batchStart).count();
+
+    Print(vecLatencies.size(), L" completed, ", uFailed, L" failed, ", uNonZero,
+        L" with a non-zero exit status");
+
+    if (!vecLatencies.empty())
+    {
+        std::sort(vecLatencies.begin(), vecLatencies.end());
+
+        const auto Percentile = [&](double dFraction)
+        {
+            return vecLatencies[(SIZE_T)(dFraction * (vecLatencies.size() - 1))];
+        };
+
+        Print(L"latency (us): p50 ", Percentile(0.5), L", p90 ", Percentile(0.9),
+            L", p99 ", Percentile(0.99), L", max ", vecLatencies.back());
+        Print(L"throughput: ", vecLatencies.size() / dSeconds, L" programs/s over ",
+            dSeconds, L" s");
+    }
+
+    return uFailed == 0 ? 0 : STATUS_UNSUCCESSFUL;
+}
+
 class ConsoleCPSetter
 {
 private:
@@ -113,6 +481,34 @@ int main(int argc, const char** argv)
 {
     auto _ConsoleCP = ConsoleCPSetter(CP_WINUNICODE);
 
+    // mxhost [root] [--batch manifest] [--jobs N] [--repeat N]
+    PCSTR pRootPath = NULL;
+    PCSTR pManifestPath = NULL;
+    SIZE_T uJobs = 16;
+    SIZE_T uRepeat = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view strArg = argv[i];
+
+        if (strArg == "--batch" && i + 1 < argc)
+        {
+            pManifestPath = argv[++i];
+        }
+        else if (strArg == "--jobs" && i + 1 < argc)
+        {
+            uJobs = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strArg == "--repeat" && i + 1 < argc)
+        {
+            uRepeat = strtoull(argv[++i], NULL, 10);
+        }
+        else
+        {
+            pRootPath = argv[i];
+        }
+    }
+
     MX_INFO(L"Monix version 0.0.1 prealpha (compiled ", __DATE__, " ", __TIME__, ")");
     MX_INFO(L"Copyright <C> 2023 Trung Nguyen (trungnt2910)");
 
@@ -142,7 +538,8 @@ int main(int argc, const char** argv)
         0,
         FILE_SHARE_READ | FILE_SHARE_WRITE,
         FILE_CREATE,
-        FILE_SYNCHRONOUS_IO_NONALERT,
+        // Batch runs keep many requests pending on this one handle.
+        (pManifestPath != NULL) ? 0 : FILE_SYNCHRONOUS_IO_NONALERT,
         NULL,
         0
     );
@@ -155,14 +552,56 @@ int main(int argc, const char** argv)
 
     std::shared_ptr<VOID> _hdlDevice(hdlDevice, [](HANDLE hdl) { NtClose(hdl); });
 
-    MX_INFO(L"initializing system root");
+    MX_INFO(L"initializing output ring");
 
-    PCSTR pRootPath = NULL;
-    if (argc >= 2)
+    // Lets "\n" from Monix programs start a new line without any translation.
+    HANDLE hdlStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD dwMode = 0;
+    if (GetConsoleMode(hdlStdOutput, &dwMode))
+    {
+        SetConsoleMode(hdlStdOutput, (dwMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)
+            & ~DISABLE_NEWLINE_AUTO_RETURN);
+    }
+
+    PMX_OUTPUT_RING_HEADER pOutputRing = NULL;
+    HANDLE hdlRingEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+    if (hdlRingEvent != NULL)
+    {
+        MX_OUTPUT_RING_INFORMATION mxRingInformation
+        {
+            .Size = MX_OUTPUT_RING_SIZE,
+            .Event = hdlRingEvent
+        };
+
+        status = NtDeviceIoControlFile(
+            hdlDevice,
+            NULL,
+            NULL,
+            NULL,
+            &ioStatus,
+            IOCTL_MX_OUTPUT_RING,
+            &mxRingInformation,
+            sizeof(mxRingInformation),
+            &mxRingInformation,
+            sizeof(mxRingInformation)
+        );
+
+        if (NT_SUCCESS(status))
+        {
+            pOutputRing = (PMX_OUTPUT_RING_HEADER)mxRingInformation.Ring;
+            std::thread(DrainOutputRing, pOutputRing, hdlRingEvent).detach();
+        }
+    }
+
+    if (pOutputRing == NULL)
     {
-        pRootPath = argv[1];
+        // Programs still write to the console directly, just slower.
+        MX_WARN("Cannot initialize output ring: ", (LPVOID)(ULONG_PTR)status);
     }
 
+    MX_INFO(L"initializing system root");
+
     WSTRING strDosRootDir;
 
     if (!IntializeRootDirectory(pRootPath, &strDosRootDir))
@@ -173,6 +612,11 @@ int main(int argc, const char** argv)
 
     WSTRING strDosBinDir = strDosRootDir + L"bin\\";
 
+    if (pManifestPath != NULL)
+    {
+        return RunBatch(hdlDevice, strDosBinDir, pManifestPath, uJobs, uRepeat);
+    }
+
     std::wcout << L"Available binaries: " << std::endl;
     bool bFirstFile = true;
     for (const auto& entry : std::filesystem::directory_iterator(strDosBinDir))
@@ -192,6 +636,19 @@ int main(int argc, const char** argv)
     }
     std::wcout << L"." << std::endl;
 
+    // Let the output of the program reach the screen before the next prompt.
+    const auto WaitForProgram = [&](HANDLE hdlProcess)
+    {
+        WaitForSingleObject(hdlProcess, INFINITE);
+        CloseHandle(hdlProcess);
+
+        while (pOutputRing != NULL
+            && ReadULongAcquire(&pOutputRing->Tail) != ReadULongAcquire(&pOutputRing->Head))
+        {
+            Sleep(1);
+        }
+    };
+
     while (TRUE)
     {
         std::wcout.put(L'>');
@@ -202,6 +659,30 @@ int main(int argc, const char** argv)
             continue;
         }
 
+        // Never shadows a binary, since file names cannot contain ':'.
+        if (strInput == L":stats")
+        {
+            PrintSyscallStatistics(hdlDevice);
+            continue;
+        }
+
+        // The checkpoint path is taken as is, relative to the current directory.
+        if (strInput.starts_with(L":restore "))
+        {
+            MX_EXECUTE_ASYNC_INFORMATION mxExecuteAsyncInformation{};
+
+            status = RestoreCheckpoint(hdlDevice, strInput.substr(9), &mxExecuteAsyncInformation);
+
+            if (!NT_SUCCESS(status))
+            {
+                MX_ERROR("Cannot restore checkpoint: ", (LPVOID)(ULONG_PTR)status, "\n");
+                continue;
+            }
+
+            WaitForProgram(mxExecuteAsyncInformation.Process);
+            continue;
+        }
+
         HANDLE hdlWin32BinFile = CreateFileW(
             (strDosBinDir + strInput).data(),
             GENERIC_READ,
@@ -231,19 +712,20 @@ int main(int argc, const char** argv)
                 .Buffer = strNtFilePath.data()
             }
         };
-        NTSTATUS statusExecute = 0;
+        MX_EXECUTE_ASYNC_INFORMATION mxExecuteAsyncInformation{};
 
+        // Returns right away, the process handle is what tells us that the program is done.
         status = NtDeviceIoControlFile(
             hdlDevice,
             NULL,
             NULL,
             NULL,
             &ioStatus,
-            IOCTL_MX_METHOD_BUFFERED,
+            IOCTL_MX_EXECUTE_ASYNC,
             &mxExecuteInformation,
             sizeof(mxExecuteInformation),
-            &statusExecute,
-            sizeof(statusExecute)
+            &mxExecuteAsyncInformation,
+            sizeof(mxExecuteAsyncInformation)
         );
 
         if (!NT_SUCCESS(status))
@@ -251,6 +733,8 @@ int main(int argc, const char** argv)
             MX_ERROR("Cannot create process: ", (LPVOID)(ULONG_PTR)status, "\n");
             continue;
         }
+
+        WaitForProgram(mxExecuteAsyncInformation.Process);
     }
 
     return 0;
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <ntifs.h>
+
+#include "image.h"
+#include "ring.h"
+
+// checkpoint.h
+//
+// Saving Monix processes to files, and starting new ones from them
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _MX_PROCESS *PMX_PROCESS;
+
+#define MX_CHECKPOINT_MAGIC                     'PCxM'
+#define MX_CHECKPOINT_VERSION                   1
+
+// IMAGE_FILE_MACHINE_*, contexts are only restored on the architecture they were taken on.
+#ifdef _M_AMD64
+#define MX_CHECKPOINT_MACHINE                   0x8664
+#elif defined(_M_ARM64)
+#define MX_CHECKPOINT_MACHINE                   0xAA64
+#else
+#error Pick a checkpoint machine for this architecture!
+#endif
+
+// Memory goes to and comes from the file in writes and reads of this size.
+#define MX_CHECKPOINT_CHUNK_SIZE                (1024 * 1024)
+
+// Limits on what a checkpoint may describe, so that restores never trust sizes from a file.
+#define MX_CHECKPOINT_REGIONS_MAX               4096
+#define MX_CHECKPOINT_NAME_MAX                  UNICODE_STRING_MAX_BYTES
+
+// Kinds of MX_CHECKPOINT_REGION, besides the MX_MEMORY_REGION_* ones. Writable segments of the
+// executable, copied back over a fresh mapping of the same executable.
+#define MX_CHECKPOINT_REGION_SEGMENT            0x100
+
+// Fixed-size types only, so that the layout does not depend on the build.
+typedef struct _MX_CHECKPOINT_REGION {
+    UINT32 Kind;
+    UINT32 Protect;
+    UINT64 Base;
+    UINT64 Size;
+    UINT64 DataStart;
+    UINT64 DataEnd;
+    UINT64 Break;
+    // Where the contents of [DataStart, DataEnd) are in the file, page aligned. Pages that were
+    // never committed are holes in the file, and read back as zeros.
+    UINT64 FileOffset;
+} MX_CHECKPOINT_REGION, *PMX_CHECKPOINT_REGION;
+
+// Followed by the NT path of the executable, then by the regions, then by their contents from
+// DataOffset on.
+typedef struct _MX_CHECKPOINT_HEADER {
+    UINT32 Magic;
+    UINT32 Version;
+    UINT32 Machine;
+    UINT32 ExecuteFlags;
+    INT32 ExitStatus;
+    // One bit per open descriptor. Only the console ones can be open, and they are attached to
+    // the console of whichever host restores the process.
+    UINT32 OpenFiles;
+    UINT32 NameLength;
+    UINT32 RegionCount;
+    // The executable has to be the very same file on restore.
+    MX_IMAGE_KEY ExecutableKey;
+    UINT64 DataOffset;
+    UINT64 DataEnd;
+    // The calling thread, as it returns from SYSCALL_CHECKPOINT with 1.
+    CONTEXT Context;
+} MX_CHECKPOINT_HEADER, *PMX_CHECKPOINT_HEADER;
+
+// Writes the calling process to pPath, overwriting any file there. Only processes with a single
+// thread, no children, no io_uring and only console descriptors open are supported.
+NTSTATUS
+    MxProcessCheckpoint(
+        _In_ PMX_PROCESS pMxProcess,
+        _In_ PCUNICODE_STRING pPath
+    );
+
+// Starts a process from a checkpoint, like MxProcessExecute does from an executable. Memory is
+// mapped from the checkpoint, which therefore has to stay in place while the process runs.
+NTSTATUS
+    MxProcessRestore(
+        _In_ PUNICODE_STRING pCheckpointPath,
+        _In_ PEPROCESS pParentProcess,
+        _In_ PEPROCESS pHostProcess,
+        _In_opt_ PMX_OUTPUT_RING pOutputRing,
+        _In_ ULONG uFlags,
+        _Out_ PMX_PROCESS* pPMxProcess
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,6 +24,14 @@ NTSTATUS
         _Out_opt_ PHANDLE pHdlOutput
     );
 
+// Keeps track of wsl.exe instances as they come and go. Without it, CoOpenNewestWslHandle falls
+// back to scanning the process list.
+VOID
+    CoInitializeWslTracking();
+
+VOID
+    CoCleanupWslTracking();
+
 DECLSPEC_DEPRECATED
 NTSTATUS
     CoOpenNewestWslHandle(
@@ -272,6 +272,25 @@ typedef struct {
 #define PF_MASKOS       0x0ff00000      /* Operating system-specific. */
 #define PF_MASKPROC     0xf0000000      /* Processor-specific. */
 
+/* Values for a_type, as numbered by Linux, which differs from FreeBSD past AT_ENTRY. */
+#define AT_NULL         0       /* Terminates the vector. */
+#define AT_IGNORE       1       /* Ignored entry. */
+#define AT_EXECFD       2       /* File descriptor of program to load. */
+#define AT_PHDR         3       /* Program header of program already loaded. */
+#define AT_PHENT        4       /* Size of each program header entry. */
+#define AT_PHNUM        5       /* Number of program header entries. */
+#define AT_PAGESZ       6       /* Page size in bytes. */
+#define AT_BASE         7       /* Interpreter's base address. */
+#define AT_FLAGS        8       /* Flags (unused). */
+#define AT_ENTRY        9       /* Where interpreter should transfer control. */
+#define AT_UID          11      /* Real uid. */
+#define AT_EUID         12      /* Effective uid. */
+#define AT_GID          13      /* Real gid. */
+#define AT_EGID         14      /* Effective gid. */
+#define AT_RANDOM       25      /* Address of 16 random bytes. */
+#define AT_EXECFN       31      /* Filename of program. */
+#define AT_SYSINFO_EHDR 33      /* Address of the vDSO. */
+
 /* Values for d_tag. */
 #define DT_NULL         0       /* Terminating entry. */
 /* String table offset of a needed shared library. */
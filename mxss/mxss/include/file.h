@@ -0,0 +1,177 @@
+#pragma once
+
+#include <ntifs.h>
+
+#include "pagecache.h"
+#include "pipe.h"
+#include "ring.h"
+
+// file.h
+//
+// File descriptor table
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define MX_FILE_TABLE_SIZE                      16
+
+#define MX_FD_STDIN                             0
+#define MX_FD_STDOUT                            1
+#define MX_FD_STDERR                            2
+
+// Data goes through as is, without translating "\n" to "\r\n" on writes and back on reads.
+#define MX_FILE_RAW                             0x1
+// A regular file opened by MxFileOpen, read at Offset instead of as a stream.
+#define MX_FILE_SEEKABLE                        0x2
+// One end of a Pipe, which never has a Handle.
+#define MX_FILE_PIPE_READER                     0x4
+#define MX_FILE_PIPE_WRITER                     0x8
+
+// From the Linux lseek(2).
+#define MX_SEEK_SET                             0
+#define MX_SEEK_CUR                             1
+#define MX_SEEK_END                             2
+
+// Output console modes, from wincon.h.
+#define MX_CONSOLE_VIRTUAL_TERMINAL_PROCESSING  0x4
+#define MX_CONSOLE_DISABLE_NEWLINE_AUTO_RETURN  0x8
+
+// Reads are served from a buffer of this size, filled by one ZwReadFile at a time.
+#define MX_FILE_READ_BUFFER_SIZE                PAGE_SIZE
+
+typedef struct _MX_FILE {
+    HANDLE Handle;
+    ULONG Flags;
+    // Read-ahead, allocated on the first read of the descriptor and only used with the table
+    // locked. Console reads take the buffer out of the descriptor while filling it.
+    ULONG ReadOffset;
+    ULONG ReadLength;
+    PCHAR ReadBuffer;
+    // Writes go here instead of Handle, for as long as mxhost keeps draining it.
+    PMX_OUTPUT_RING OutputRing;
+    // For MX_FILE_SEEKABLE descriptors. Reads are copied from the page cache when the file is
+    // in it, and go through Handle otherwise.
+    PMX_CACHED_FILE CachedFile;
+    // Unlike on Linux, not shared with the copies made for forked children.
+    ULONG64 Offset;
+    // For MX_FILE_PIPE_* descriptors, holding the end the flag names.
+    PMX_PIPE Pipe;
+} MX_FILE, *PMX_FILE;
+
+// Descriptors hold kernel handles, opened once and reused by every system call on them.
+// Processes sharing descriptors (threads, in the future) share the whole table by reference.
+typedef struct _MX_FILE_TABLE {
+    ULONG_PTR ReferenceCount;
+    // Taken by the functions below that open, close or move within MX_FILE_SEEKABLE descriptors,
+    // use pipes or read ahead. Never held while blocking on a pipe or the console.
+    EX_PUSH_LOCK Lock;
+    // What MxFileOpen resolves paths against, inherited by copies of the table. NULL for
+    // processes started outside of a session, which cannot open files.
+    HANDLE RootDirectory;
+    MX_FILE Files[MX_FILE_TABLE_SIZE];
+} MX_FILE_TABLE, *PMX_FILE_TABLE;
+
+NTSTATUS
+    MxFileTableAllocate(
+        _Out_ PMX_FILE_TABLE* pPFileTable
+    );
+
+NTSTATUS
+    MxFileTableReference(
+        _Inout_ PMX_FILE_TABLE pFileTable
+    );
+
+VOID
+    MxFileTableFree(
+        _Inout_ PMX_FILE_TABLE pFileTable
+    );
+
+NTSTATUS
+    MxFileTableOpenConsole(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ PEPROCESS pHostProcess
+    );
+
+NTSTATUS
+    MxFileTableCopy(
+        _In_ PMX_FILE_TABLE pFileTable,
+        _Out_ PMX_FILE_TABLE* pPNewFileTable
+    );
+
+NTSTATUS
+    MxFileTableAttachOutputRing(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ PMX_OUTPUT_RING pRing
+    );
+
+// Takes a reference of its own to hdlRoot, a kernel handle to a directory.
+NTSTATUS
+    MxFileTableSetRoot(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ HANDLE hdlRoot
+    );
+
+// Copies the descriptor as it is with the table locked. Only the console stays open for as long
+// as the table, so the copy may only be used for the console and to tell what else fd is.
+NTSTATUS
+    MxFileTableGet(
+        _In_ PMX_FILE_TABLE pFileTable,
+        _In_ INT fd,
+        _Out_ PMX_FILE pFile
+    );
+
+NTSTATUS
+    MxFileRead(
+        _In_ PMX_FILE_TABLE pFileTable,
+        _In_ INT fd,
+        _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+        _In_ SIZE_T uSize,
+        _Out_ PSIZE_T pURead
+    );
+
+// Opens a regular file for reading, at pPath relative to the root directory of the table, into
+// the lowest free descriptor.
+NTSTATUS
+    MxFileOpen(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ PCUNICODE_STRING pPath,
+        _Out_ PINT pFd
+    );
+
+// Creates a pipe, with its read end at the lowest free descriptor and its write end at the next.
+NTSTATUS
+    MxFileCreatePipe(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _Out_writes_(2) PINT pFds
+    );
+
+// Reads go through MxFileRead, the console is written to by SyscallWrite itself.
+NTSTATUS
+    MxFileWritePipe(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ INT fd,
+        _In_reads_bytes_(uSize) PVOID pBuffer,
+        _In_ SIZE_T uSize,
+        _Out_ PSIZE_T pUWritten
+    );
+
+NTSTATUS
+    MxFileClose(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ INT fd
+    );
+
+NTSTATUS
+    MxFileSeek(
+        _Inout_ PMX_FILE_TABLE pFileTable,
+        _In_ INT fd,
+        _In_ LONG64 iOffset,
+        _In_ INT iWhence,
+        _Out_ PULONG64 pUNewOffset
+    );
+
+#ifdef __cplusplus
+}
+#endif
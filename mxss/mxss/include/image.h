@@ -0,0 +1,89 @@
+#pragma once
+
+#include <ntifs.h>
+
+#include "elf.h"
+
+// image.h
+//
+// Cache of parsed Monix executables
+
+#ifdef _WIN64
+#define ElfW(type) Elf64_##type
+#elif defined(_WIN32)
+#define ElfW(type) Elf32_##type
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Beyond this, the least recently used image is evicted.
+#define MX_IMAGE_CACHE_MAX_ENTRIES              32
+
+// The smallest large page size on every supported architecture.
+#define MX_IMAGE_LARGE_PAGE_SIZE                (2 * 1024 * 1024)
+
+typedef struct _MX_IMAGE_KEY {
+    FILE_ID_INFORMATION FileId;
+    LARGE_INTEGER LastWriteTime;
+    LARGE_INTEGER EndOfFile;
+} MX_IMAGE_KEY, *PMX_IMAGE_KEY;
+
+typedef struct _MX_IMAGE {
+    LIST_ENTRY Link;
+    ULONG_PTR ReferenceCount;
+    MX_IMAGE_KEY Key;
+    ElfW(Ehdr) Header;
+    ElfW(Phdr)* ProgramHeaders;
+    // Span of all PT_LOAD segments, unrelocated.
+    ElfW(Addr) Start;
+    ElfW(Addr) End;
+    // A data section over the whole file, segments are mapped as copy-on-write views of it.
+    PVOID Section;
+    // One per program header, large-page copies of read-only text, created on first use.
+    PVOID* LargePageSections;
+} MX_IMAGE, *PMX_IMAGE;
+
+NTSTATUS
+    MxInitializeImageCache();
+
+VOID
+    MxCleanupImageCache();
+
+// Identifies a version of an executable, so that changed files are never taken for old ones.
+NTSTATUS
+    MxImageQueryKey(
+        _In_ HANDLE hdlFile,
+        _Out_ PMX_IMAGE_KEY pKey
+    );
+
+// Returns a referenced image for the executable, parsing it only if it has not been seen with
+// the same identity, size and last write time before.
+NTSTATUS
+    MxImageGet(
+        _In_ HANDLE hdlFile,
+        _Out_ PMX_IMAGE* pPImage
+    );
+
+// Returns a large-page section holding the first large pages of a read-only executable segment
+// and their size, or STATUS_NOT_SUPPORTED if the segment is too small or misaligned for it. The
+// section lives as long as the image.
+NTSTATUS
+    MxImageGetLargePages(
+        _In_ PMX_IMAGE pImage,
+        _In_ HANDLE hdlFile,
+        _In_ SIZE_T uIndex,
+        _Out_ PVOID* pPSection,
+        _Out_ PSIZE_T pSize
+    );
+
+VOID
+    MxImageFree(
+        _In_ PMX_IMAGE pImage
+    );
+
+#ifdef __cplusplus
+}
+#endif
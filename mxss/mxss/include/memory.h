@@ -0,0 +1,190 @@
+#pragma once
+
+#include <ntifs.h>
+
+// memory.h
+//
+// Anonymous memory of Monix processes
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// An unofficial, more descriptive name for the flag.
+// This undocumented flag used to be there to allow compatibility with 16-bit applications only on
+// 32-bit x86 Windows.
+// It forces pages to be allocated with a granularity equal to the processor page boundary (4KB).
+// Recently, the flag has been enabled on all architectures, but only for Pico processes, hence the
+// unofficial name.
+#define MX_MEM_PICO MEM_DOS_LIM
+
+#define MX_PROT_NONE                            0x0
+#define MX_PROT_READ                            0x1
+#define MX_PROT_WRITE                           0x2
+#define MX_PROT_EXEC                            0x4
+
+#define MX_MAP_SHARED                           0x01
+#define MX_MAP_PRIVATE                          0x02
+#define MX_MAP_FIXED                            0x10
+#define MX_MAP_ANONYMOUS                        0x20
+
+// Kinds of faulting accesses, as in the first parameter of an access violation exception.
+#define MX_MEMORY_ACCESS_READ                   0
+#define MX_MEMORY_ACCESS_WRITE                  1
+#define MX_MEMORY_ACCESS_EXECUTE                8
+
+// Address space set aside for brk(), committed only as it is touched.
+#define MX_MEMORY_BREAK_RESERVE                 (256 * 1024 * 1024)
+
+// Pages committed at once when a process touches reserved memory.
+#define MX_MEMORY_COMMIT_CHUNK                  (16 * PAGE_SIZE)
+
+// Address space set aside for the stack of the main thread, committed as it grows.
+#define MX_MEMORY_STACK_RESERVE                 (32 * 1024 * 1024)
+
+// Kinds of MX_MEMORY_REGION.
+#define MX_MEMORY_REGION_MAPPING                0
+#define MX_MEMORY_REGION_BREAK                  1
+#define MX_MEMORY_REGION_STACK                  2
+
+typedef struct _MX_MAPPING {
+    LIST_ENTRY Link;
+    ULONG_PTR Base;
+    SIZE_T Size;
+    // Page protection for newly committed pages.
+    ULONG Protect;
+} MX_MAPPING, *PMX_MAPPING;
+
+// Shared by all threads of the process. Every function below takes Lock, except MxMemoryFree.
+typedef struct _MX_MEMORY {
+    EX_PUSH_LOCK Lock;
+    LIST_ENTRY Mappings;
+    // The reserved region behind the program break, not in Mappings. Empty until the main
+    // executable has been mapped.
+    MX_MAPPING Break;
+    ULONG_PTR BreakCurrent;
+    // End of the committed part of Break.
+    ULONG_PTR BreakCommitted;
+    // The stack reservation, committed from the top down to StackBottom, the guard page.
+    MX_MAPPING Stack;
+    ULONG_PTR StackBottom;
+} MX_MEMORY, *PMX_MEMORY;
+
+// A tracked reservation, as seen by checkpoints.
+typedef struct _MX_MEMORY_REGION {
+    ULONG Kind;
+    // Page protection for newly committed pages.
+    ULONG Protect;
+    ULONG_PTR Base;
+    SIZE_T Size;
+    // The part that may be committed: the whole of a mapping, the break up to BreakCommitted,
+    // and the stack from StackBottom up.
+    ULONG_PTR DataStart;
+    ULONG_PTR DataEnd;
+    // The program break, for MX_MEMORY_REGION_BREAK.
+    ULONG_PTR Break;
+} MX_MEMORY_REGION, *PMX_MEMORY_REGION;
+
+NTSTATUS
+    MxMemoryAllocate(
+        _Out_ PMX_MEMORY* pPMemory
+    );
+
+// The views themselves go away with the process.
+VOID
+    MxMemoryFree(
+        _In_ PMX_MEMORY pMemory
+    );
+
+// For a forked child, whose address space already has the same views as the parent's.
+NTSTATUS
+    MxMemoryCopy(
+        _In_ PMX_MEMORY pMemory,
+        _Out_ PMX_MEMORY* pPNewMemory
+    );
+
+NTSTATUS
+    MxMemoryInitializeBreak(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ HANDLE hdlProcess,
+        _In_ ULONG_PTR uImageEnd
+    );
+
+// Reserves the stack and commits its top pages. Returns the initial stack pointer.
+NTSTATUS
+    MxMemoryInitializeStack(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ HANDLE hdlProcess,
+        _Out_ PVOID* pStackTop
+    );
+
+NTSTATUS
+    MxMemoryMap(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ HANDLE hdlProcess,
+        _In_opt_ PVOID pAddress,
+        _In_ SIZE_T uSize,
+        _In_ ULONG uProtection,
+        _In_ ULONG uFlags,
+        _Out_ PVOID* pMapped
+    );
+
+// Mappings partly inside the range are not split, and fail the whole call instead.
+NTSTATUS
+    MxMemoryUnmap(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ HANDLE hdlProcess,
+        _In_ PVOID pAddress,
+        _In_ SIZE_T uSize
+    );
+
+// Must be called in the context of the process. Returns the break in effect afterwards.
+ULONG_PTR
+    MxMemorySetBreak(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ ULONG_PTR uBreak
+    );
+
+// Commits the reserved pages of the current process in the given range, so that they can be
+// accessed by the kernel. Memory outside of the tracked mappings is left alone.
+NTSTATUS
+    MxMemoryPrepare(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ PVOID pAddress,
+        _In_ SIZE_T uSize
+    );
+
+// Commits the reserved pages around an address the current process has faulted on, or grows
+// the stack past its guard page. uAccess is one of MX_MEMORY_ACCESS_*.
+NTSTATUS
+    MxMemoryHandleFault(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ ULONG_PTR uAddress,
+        _In_ ULONG_PTR uAccess
+    );
+
+// Lists the regions of the process, or returns STATUS_BUFFER_TOO_SMALL with the number there
+// are in *pUCount.
+NTSTATUS
+    MxMemoryQueryRegions(
+        _In_ PMX_MEMORY pMemory,
+        _Out_writes_to_opt_(uCount, *pUCount) PMX_MEMORY_REGION pRegions,
+        _In_ ULONG uCount,
+        _Out_ PULONG pUCount
+    );
+
+// Recreates a region in a new process. The data part becomes a copy-on-write view of hdlSection
+// at uSectionOffset, so that its pages are only read when touched, and the rest is reserved.
+NTSTATUS
+    MxMemoryRestoreRegion(
+        _Inout_ PMX_MEMORY pMemory,
+        _In_ HANDLE hdlProcess,
+        _In_ const MX_MEMORY_REGION* pRegion,
+        _In_opt_ HANDLE hdlSection,
+        _In_ ULONG64 uSectionOffset
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -23,8 +23,18 @@ NTSYSAPI NTAPI
         _Out_opt_ PULONG OldAccessProtection
     );
 
+NTSTATUS
+NTKERNELAPI
+    PsGetProcessExitStatus(
+        _In_ PEPROCESS Process
+    );
+
 #define MEM_DOS_LIM 0x40000000
 
+#ifndef SEC_LARGE_PAGES
+#define SEC_LARGE_PAGES 0x80000000
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <ntifs.h>
+
+#include "image.h"
+
+// pagecache.h
+//
+// Cache of regular files mapped in system space, shared by all Monix processes
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Beyond either, the least recently used files are evicted.
+#define MX_PAGE_CACHE_MAX_ENTRIES               64
+#define MX_PAGE_CACHE_MAX_BYTES                 (256 * 1024 * 1024)
+
+// Larger files are read through the file system, a view of them would crowd out the others.
+#define MX_PAGE_CACHE_MAX_FILE_SIZE             (16 * 1024 * 1024)
+
+typedef struct _MX_CACHED_FILE {
+    LIST_ENTRY Link;
+    ULONG_PTR ReferenceCount;
+    // The same identity as executables, changed files are never taken for old ones.
+    MX_IMAGE_KEY Key;
+    // A read-only data section over the whole file, sharing its pages with the cache manager.
+    PVOID Section;
+    // Of the whole section in system space. Both NULL for empty files, which cannot be mapped.
+    PVOID View;
+    SIZE_T Size;
+} MX_CACHED_FILE, *PMX_CACHED_FILE;
+
+NTSTATUS
+    MxInitializePageCache();
+
+VOID
+    MxCleanupPageCache();
+
+// Returns a referenced mapping of the file, creating one only if it has not been seen with the
+// same identity, size and last write time before. Fails for files without a stable identity or
+// larger than MX_PAGE_CACHE_MAX_FILE_SIZE, which callers read through the file system instead.
+NTSTATUS
+    MxPageCacheGet(
+        _In_ HANDLE hdlFile,
+        _Out_ PMX_CACHED_FILE* pPCachedFile
+    );
+
+// Copies from the view into a buffer that may belong to user mode. Returns STATUS_END_OF_FILE
+// at or past the end of the file.
+NTSTATUS
+    MxCachedFileRead(
+        _In_ PMX_CACHED_FILE pCachedFile,
+        _In_ ULONG64 uOffset,
+        _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+        _In_ SIZE_T uSize,
+        _Out_ PSIZE_T pURead
+    );
+
+VOID
+    MxCachedFileReference(
+        _Inout_ PMX_CACHED_FILE pCachedFile
+    );
+
+VOID
+    MxCachedFileFree(
+        _In_ PMX_CACHED_FILE pCachedFile
+    );
+
+#ifdef __cplusplus
+}
+#endif
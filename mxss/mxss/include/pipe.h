@@ -0,0 +1,106 @@
+#pragma once
+
+#include <ntifs.h>
+
+// pipe.h
+//
+// Pipes between Monix processes, kept entirely within the provider
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Like the default pipe capacity on Linux.
+#define MX_PIPE_RING_SIZE                       (64 * 1024)
+
+// Writes at least this large lend their pages to readers instead of going through the ring.
+#define MX_PIPE_LOAN_THRESHOLD                  MX_PIPE_RING_SIZE
+// Most bytes locked in memory for a single loan.
+#define MX_PIPE_LOAN_MAX                        (1024 * 1024)
+
+// How often blocked readers and writers check whether their thread is being terminated.
+#define MX_PIPE_WAIT_POLL_INTERVAL              50 // ms
+
+// A write too large for the ring, locked and mapped in system space for as long as it is posted.
+// Lives on the stack of the writer, which waits until it has been taken or takes it back.
+typedef struct _MX_PIPE_LOAN {
+    PCHAR Buffer;
+    SIZE_T Size;
+    SIZE_T Taken;
+} MX_PIPE_LOAN, *PMX_PIPE_LOAN;
+
+typedef struct _MX_PIPE {
+    ULONG_PTR ReferenceCount;
+    // Every field below is guarded by Lock.
+    EX_PUSH_LOCK Lock;
+    // Open ends, held by descriptors. Readers see the end of the file once all writers are gone,
+    // and writers a broken pipe once all readers are.
+    ULONG Readers;
+    ULONG Writers;
+    // Bytes ever written to and read from Ring.
+    ULONG64 Head;
+    ULONG64 Tail;
+    PCHAR Ring;
+    // Only one at a time. Readers take it once the ring is empty, and writers wait until it is
+    // gone, so that data still comes out in order.
+    PMX_PIPE_LOAN Loan;
+    // Notification events, cleared under Lock by whoever is about to wait on them.
+    KEVENT Readable;
+    KEVENT Writable;
+    KEVENT LoanDone;
+} MX_PIPE, *PMX_PIPE;
+
+// Returns a pipe holding one reference and no open ends.
+NTSTATUS
+    MxPipeCreate(
+        _Out_ PMX_PIPE* pPPipe
+    );
+
+VOID
+    MxPipeReference(
+        _Inout_ PMX_PIPE pPipe
+    );
+
+VOID
+    MxPipeFree(
+        _In_ PMX_PIPE pPipe
+    );
+
+// Each open end holds a reference of its own, released by MxPipeCloseEnd.
+VOID
+    MxPipeOpenEnd(
+        _Inout_ PMX_PIPE pPipe,
+        _In_ BOOLEAN bWriter
+    );
+
+VOID
+    MxPipeCloseEnd(
+        _Inout_ PMX_PIPE pPipe,
+        _In_ BOOLEAN bWriter
+    );
+
+// Blocks until there is something to read, then returns what is there. Returns
+// STATUS_END_OF_FILE once the pipe is empty and has no writers left. pBuffer must be a user-mode
+// address of the current process.
+NTSTATUS
+    MxPipeRead(
+        _Inout_ PMX_PIPE pPipe,
+        _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+        _In_ SIZE_T uSize,
+        _Out_ PSIZE_T pURead
+    );
+
+// Blocks until everything has been written, or the pipe has no readers left. pBuffer must be a
+// user-mode address of the current process.
+NTSTATUS
+    MxPipeWrite(
+        _Inout_ PMX_PIPE pPipe,
+        _In_reads_bytes_(uSize) PVOID pBuffer,
+        _In_ SIZE_T uSize,
+        _Out_ PSIZE_T pUWritten
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <ntifs.h>
+#include <monika.h>
 
 // process.h
 //
@@ -12,27 +13,129 @@ extern "C"
 #endif
 
 typedef struct _MX_THREAD *PMX_THREAD;
+typedef struct _MX_FILE_TABLE *PMX_FILE_TABLE;
+typedef struct _MX_OUTPUT_RING *PMX_OUTPUT_RING;
+typedef struct _MX_URING *PMX_URING;
+typedef struct _MX_SHARED_PAGE *PMX_SHARED_PAGE;
+typedef struct _MX_MEMORY *PMX_MEMORY;
+
+// Reads the file-backed parts of the executable ahead, instead of one fault at a time.
+#define MX_EXECUTE_PREFAULT                     0x1
+// Maps large enough read-only text with large pages where the alignment allows it.
+#define MX_EXECUTE_LARGE_PAGES                  0x2
+// Leaves the main thread suspended, for the caller to resume. Not inherited.
+#define MX_EXECUTE_SUSPENDED                    0x4
+
+// Bytes of argv, envp, the auxiliary vector and their strings a new process may start with, as
+// ARG_MAX on Linux.
+#define MX_INITIAL_STACK_MAX                    (128 * 1024)
+
+// What a new process finds on its initial stack. Without any Args, argv only holds the path of
+// the executable.
+typedef struct _MX_PROCESS_ARGUMENTS {
+    SIZE_T ArgsCount;
+    const UNICODE_STRING* Args;
+    SIZE_T EnvironmentCount;
+    const UNICODE_STRING* Environment;
+} MX_PROCESS_ARGUMENTS, *PMX_PROCESS_ARGUMENTS;
+
+// The full NT path of a main executable, shared by a process and its forked children.
+typedef struct _MX_EXECUTABLE_NAME {
+    ULONG_PTR ReferenceCount;
+    UNICODE_STRING Name;
+} MX_EXECUTABLE_NAME, *PMX_EXECUTABLE_NAME;
 
 typedef struct _MX_PROCESS {
     ULONG_PTR ReferenceCount;
     PEPROCESS Process;
+    // The main thread.
     PETHREAD Thread;
     PMX_THREAD MxThread;
+    // Every thread, the main one included, each holding a reference for the list.
+    LIST_ENTRY Threads;
+    FAST_MUTEX ThreadsLock;
     PEPROCESS HostProcess;
     PFILE_OBJECT MainExecutable;
+    PMX_EXECUTABLE_NAME ExecutableName;
     NTSTATUS ExitStatus;
     PVOID UserStack;
+    // For the auxiliary vector, set once the main executable has been mapped.
+    ULONG_PTR EntryPoint;
+    ULONG_PTR ProgramHeaders;
+    SIZE_T ProgramHeadersCount;
+    PMX_FILE_TABLE Files;
+    PMX_URING Uring;
+    PMX_SHARED_PAGE SharedPage;
+    PMX_MEMORY Memory;
+    // MX_EXECUTE_* flags, inherited by forked children.
+    ULONG ExecuteFlags;
+    // Applied to every thread, and inherited by forked and spawned children.
+    MA_PICO_SESSION_PLACEMENT Placement;
+    // Faults on reserved memory and the stack guard page, resolved by MxDispatchException.
+    ULONG_PTR HandledFaults;
+    // The process tree, guarded by one lock for all processes. A child holds a reference to its
+    // parent until the parent exits, and the parent to each child until it is waited for.
+    struct _MX_PROCESS* Parent;
+    // Linked through SiblingLink, exited children move over to ExitedChildren.
+    LIST_ENTRY Children;
+    LIST_ENTRY ExitedChildren;
+    LIST_ENTRY SiblingLink;
+    // Set whenever a child exits, so that waiters need no wait block per child.
+    KEVENT ChildExited;
+    BOOLEAN Exited;
 } MX_PROCESS, *PMX_PROCESS;
 
+NTSTATUS
+    MxInitializeProcessLookaside();
+
+VOID
+    MxCleanupProcessLookaside();
+
+// Returns an empty process holding one reference, for the functions building one.
+PMX_PROCESS
+    MxProcessAllocate();
+
+NTSTATUS
+    MxExecutableNameCreate(
+        _In_ PFILE_OBJECT pFileObject,
+        _Out_ PMX_EXECUTABLE_NAME* pPName
+    );
+
+VOID
+    MxExecutableNameFree(
+        _In_ PMX_EXECUTABLE_NAME pName
+    );
+
+// The new process gets a copy of pFiles if given, or the console of the host otherwise.
 NTSTATUS
     MxProcessExecute(
         _In_ PUNICODE_STRING pExecutablePath,
         _In_ PEPROCESS pParentProcess,
         _In_ PEPROCESS pHostProcess,
         _In_opt_ HANDLE hdlCwd,
+        _In_opt_ PMX_OUTPUT_RING pOutputRing,
+        _In_opt_ PMX_FILE_TABLE pFiles,
+        _In_opt_ const MX_PROCESS_ARGUMENTS* pArguments,
+        _In_ ULONG uFlags,
+        _In_opt_ const MA_PICO_SESSION_PLACEMENT* pPlacement,
         _Out_ PMX_PROCESS* pPMxProcess
     );
 
+// For processes whose main thread has not run yet, such as those of the warm pool.
+VOID
+    MxProcessSetPlacement(
+        _Inout_ PMX_PROCESS pMxProcess,
+        _In_ const MA_PICO_SESSION_PLACEMENT* pPlacement
+    );
+
+// Rebuilds the initial stack and moves the main thread to it. Only for processes whose main
+// thread has not run yet, such as those of the warm pool.
+NTSTATUS
+    MxProcessSetArguments(
+        _Inout_ PMX_PROCESS pMxProcess,
+        _In_ const MX_PROCESS_ARGUMENTS* pArguments
+    );
+
 VOID
     MxProcessFree(
         _In_ PMX_PROCESS pMxProcess
@@ -44,6 +147,55 @@ NTSTATUS
         _Out_ PVOID* pEntryPoint
     );
 
+// Starts another thread on the given stack, passing it uArgument like a function argument.
+NTSTATUS
+    MxProcessCreateThread(
+        _Inout_ PMX_PROCESS pMxProcess,
+        _In_ ULONG_PTR uStartRoutine,
+        _In_ ULONG_PTR uArgument,
+        _In_ ULONG_PTR uStackBase,
+        _In_ SIZE_T uStackSize,
+        _Out_ PHANDLE pThreadId
+    );
+
+// Makes a newly created process show up in MxProcessWaitChild of its parent.
+VOID
+    MxProcessAddChild(
+        _Inout_ PMX_PROCESS pMxParentProcess,
+        _Inout_ PMX_PROCESS pMxChildProcess
+    );
+
+// Whether the process has children, running or not yet waited for.
+BOOLEAN
+    MxProcessHasChildren(
+        _In_ PMX_PROCESS pMxProcess
+    );
+
+// Publishes ExitStatus to the parent, and lets go of the children, which nobody waits for then.
+VOID
+    MxProcessNotifyExit(
+        _Inout_ PMX_PROCESS pMxProcess
+    );
+
+// Reaps an exited child with the given ID, or any child if iPid is -1. Returns STATUS_NOT_FOUND
+// if there is no such child, and STATUS_TIMEOUT if it is still running and bWait is FALSE.
+NTSTATUS
+    MxProcessWaitChild(
+        _Inout_ PMX_PROCESS pMxProcess,
+        _In_ INT iPid,
+        _In_ BOOLEAN bWait,
+        _Out_ PINT pIChildPid,
+        _Out_ PNTSTATUS pChildExitStatus
+    );
+
+// The user-mode context of the calling thread, as it will be when its current system call
+// returns uReturnValue.
+NTSTATUS
+    MxProcessGetCallerContext(
+        _In_ ULONG_PTR uReturnValue,
+        _Out_ PCONTEXT pContext
+    );
+
 NTSTATUS
     MxProcessFork(
         _In_ PMX_PROCESS pMxParentProcess,
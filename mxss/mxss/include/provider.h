@@ -7,14 +7,45 @@
 #include <ntifs.h>
 #include <monika.h>
 
+#include "syscall.h"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+typedef struct _MX_PROCESS *PMX_PROCESS;
+
 extern PS_PICO_ROUTINES MxRoutines;
 extern MA_PICO_ROUTINES MxAdditionalRoutines;
 
+#define MX_SYSCALL_COUNT                        (SYSCALL_SYSX_COUNT + SYSCALL_MONIX_COUNT)
+
+// Also returned to mxhost through the control device, hence the fixed-size types.
+typedef struct _MX_SYSCALL_STATISTICS {
+    INT32 Number;
+    UINT32 Arity;
+    CHAR Name[16];
+    // Summed over all processors.
+    UINT64 Calls;
+    UINT64 Cycles;
+} MX_SYSCALL_STATISTICS, *PMX_SYSCALL_STATISTICS;
+
+NTSTATUS
+    MxInitializeSystemCallStatistics();
+
+VOID
+    MxCleanupSystemCallStatistics();
+
+NTSTATUS
+    MxQuerySystemCallStatistics(
+        _Out_writes_to_(uCount, *pUReturned) PMX_SYSCALL_STATISTICS pEntries,
+        _In_ ULONG uCount,
+        _Out_ PULONG pUReturned,
+        _Out_ PULONG64 pUUnknown,
+        _Out_ PULONG64 pUHandledFaults
+    );
+
 VOID
     MxSystemCallDispatch(
         _In_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
@@ -63,6 +94,23 @@ NTSTATUS
         _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes
     );
 
+// Takes over the reference to a process created with MX_EXECUTE_SUSPENDED and resumes it, or
+// leaves both to the caller on failure. pCompletion is called once the process exits.
+NTSTATUS
+    MxSessionStartProcess(
+        _In_ PMX_PROCESS pMxProcess,
+        _In_ PMA_PICO_SESSION_COMPLETION pCompletion,
+        _In_opt_ PVOID pCompletionContext
+    );
+
+// Completes from MxProcessExit, so that no thread has to wait for the session to end.
+NTSTATUS
+    MxStartSessionAsync(
+        _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+        _In_ PMA_PICO_SESSION_COMPLETION Completion,
+        _In_opt_ PVOID CompletionContext
+    );
+
 NTSTATUS
     MxGetConsole(
         _In_ PEPROCESS Process,
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <ntifs.h>
+
+// ring.h
+//
+// Output ring shared with mxhost
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define MX_OUTPUT_RING_MIN_SIZE                 PAGE_SIZE
+#define MX_OUTPUT_RING_MAX_SIZE                 (16 * 1024 * 1024)
+
+// How long a writer waits for mxhost to make room before going back to the console.
+#define MX_OUTPUT_RING_FULL_TIMEOUT_MS          1000
+
+// The shared section, as seen by both mxss and mxhost.
+typedef struct _MX_OUTPUT_RING_HEADER {
+    // Free-running byte counters. Head is only advanced by mxss, Tail only by mxhost.
+    volatile ULONG Head;
+    volatile ULONG Tail;
+    // Set by mxhost before waiting on the event, cleared by whoever signals it.
+    volatile LONG Waiting;
+    // A power of two.
+    ULONG Size;
+    CHAR Data[ANYSIZE_ARRAY];
+} MX_OUTPUT_RING_HEADER, *PMX_OUTPUT_RING_HEADER;
+
+typedef struct _MX_OUTPUT_RING {
+    ULONG_PTR ReferenceCount;
+    PVOID Section;
+    // The system space view of the section.
+    PMX_OUTPUT_RING_HEADER Header;
+    // Our own copies, since the ones in the section may be changed by mxhost.
+    ULONG Size;
+    ULONG Head;
+    PKEVENT Event;
+    // Serializes writers, which may be any process sharing the descriptors.
+    FAST_MUTEX Lock;
+    // Set once mxhost has closed its device handle.
+    volatile LONG Detached;
+} MX_OUTPUT_RING, *PMX_OUTPUT_RING;
+
+NTSTATUS
+    MxOutputRingCreate(
+        _In_ ULONG uSize,
+        _In_ HANDLE hdlEvent,
+        _Out_ PMX_OUTPUT_RING* pPRing,
+        _Out_ PVOID* pUserView
+    );
+
+NTSTATUS
+    MxOutputRingReference(
+        _Inout_ PMX_OUTPUT_RING pRing
+    );
+
+VOID
+    MxOutputRingFree(
+        _Inout_ PMX_OUTPUT_RING pRing
+    );
+
+VOID
+    MxOutputRingDetach(
+        _Inout_ PMX_OUTPUT_RING pRing
+    );
+
+NTSTATUS
+    MxOutputRingWrite(
+        _Inout_ PMX_OUTPUT_RING pRing,
+        _In_reads_bytes_(uSize) PVOID pBuffer,
+        _In_ SIZE_T uSize,
+        _Out_ PSIZE_T pUWritten
+    );
+
+#ifdef __cplusplus
+}
+#endif
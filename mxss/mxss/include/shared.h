@@ -0,0 +1,67 @@
+#pragma once
+
+#include <ntifs.h>
+
+// shared.h
+//
+// Read-only page shared with every Monix process
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Fixed, like KUSER_SHARED_DATA, so that programs do not need a system call to find it.
+#define MX_SHARED_PAGE_ADDRESS                  ((PVOID)0x7FFD0000)
+
+// How often the time fields are refreshed, in 100ns units.
+#define MX_SHARED_PAGE_UPDATE_INTERVAL          (10 * 1000 * 10)
+
+// Fixed-size types only, this is read by Monix programs as is.
+//
+// Sequence is odd while the kernel is updating the time fields. Readers should read it, read
+// the fields, then read it again and retry if it was odd or has changed.
+//
+// All times are in 100ns units. BootTime and SystemTime count from January 1, 1601 (UTC),
+// InterruptTime from boot. PerformanceCounter was sampled at the same time as InterruptTime,
+// and ticks PerformanceFrequency times per second.
+typedef struct _MX_SHARED_PAGE_DATA {
+    volatile UINT32 Sequence;
+    UINT32 ProcessId;
+    INT64 BootTime;
+    INT64 PerformanceFrequency;
+    volatile INT64 InterruptTime;
+    volatile INT64 SystemTime;
+    volatile INT64 PerformanceCounter;
+} MX_SHARED_PAGE_DATA, *PMX_SHARED_PAGE_DATA;
+
+typedef struct _MX_SHARED_PAGE {
+    LIST_ENTRY Link;
+    PVOID Section;
+    // The system space view of the section.
+    PMX_SHARED_PAGE_DATA Data;
+} MX_SHARED_PAGE, *PMX_SHARED_PAGE;
+
+NTSTATUS
+    MxInitializeSharedPages();
+
+VOID
+    MxCleanupSharedPages();
+
+// Maps a new page for pProcess, which hdlProcess refers to, at MX_SHARED_PAGE_ADDRESS.
+NTSTATUS
+    MxSharedPageCreate(
+        _In_ HANDLE hdlProcess,
+        _In_ PEPROCESS pProcess,
+        _Out_ PMX_SHARED_PAGE* pPSharedPage
+    );
+
+// The user view goes away with the process.
+VOID
+    MxSharedPageFree(
+        _In_ PMX_SHARED_PAGE pSharedPage
+    );
+
+#ifdef __cplusplus
+}
+#endif
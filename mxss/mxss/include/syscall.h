@@ -18,11 +18,48 @@ extern "C"
 #define SYSCALL_WRITE                           2 // arg1 = size, arg2 = buffer ptr, arg3 = fd
 #define SYSCALL_FORK                            3
 
+#define SYSCALL_SYSX_COUNT                      4
+
+// Monix extensions, kept well away from the SysX numbers.
+#define SYSCALL_MONIX_BASE                      0x1000
+#define SYSCALL_URING_SETUP                     0x1000 // arg1 = entries, returns ring address
+#define SYSCALL_URING_ENTER                     0x1001 // arg1 = max entries to submit
+#define SYSCALL_MMAP                            0x1002 // Like mmap(2), anonymous memory only
+#define SYSCALL_MUNMAP                          0x1003 // arg1 = address, arg2 = length
+#define SYSCALL_BRK                             0x1004 // arg1 = new break, returns the break
+#define SYSCALL_SPAWN                           0x1005 // arg1 = path, arg2 = MX_SPAWN_* flags
+#define SYSCALL_THREAD_CREATE                   0x1006 // arg1 = entry, arg2 = arg, arg3 = stack
+#define SYSCALL_THREAD_EXIT                     0x1007 // arg1 = return code
+#define SYSCALL_WAITPID                         0x1008 // arg1 = pid, arg2 = status, arg3 = flags
+#define SYSCALL_CHECKPOINT                      0x1009 // arg1 = path, returns 1 once restored
+#define SYSCALL_OPEN                            0x100A // arg1 = path, arg2 = flags, read only
+#define SYSCALL_CLOSE                           0x100B // arg1 = fd
+#define SYSCALL_LSEEK                           0x100C // arg1 = fd, arg2 = offset, arg3 = whence
+#define SYSCALL_PIPE                            0x100D // arg1 = int[2], read end first
+#define SYSCALL_MONIX_COUNT                     14
+
+// Blocks until the spawned child exits, and returns its exit status instead of its ID.
+#define MX_SPAWN_WAIT                           0x1
+
+// Longest path accepted by SYSCALL_SPAWN, SYSCALL_CHECKPOINT and SYSCALL_OPEN, in bytes,
+// including the terminating NUL.
+#define MX_SPAWN_PATH_MAX                       1024
+
+// Returns 0 instead of blocking when no matching child has exited yet.
+#define MX_WAIT_NOHANG                          0x1
+
 INT
     SyscallExit(
         _In_ INT status
     );
 
+INT_PTR
+    SyscallRead(
+        _In_ INT fd,
+        _Out_writes_bytes_opt_(size) PVOID buffer,
+        _In_ SIZE_T size
+    );
+
 INT_PTR
     SyscallWrite(
         _In_ INT fd,
@@ -33,6 +70,104 @@ INT_PTR
 INT
     SyscallFork();
 
+INT_PTR
+    SyscallUringSetup(
+        _In_ UINT entries
+    );
+
+INT_PTR
+    SyscallUringEnter(
+        _In_ UINT toSubmit
+    );
+
+INT_PTR
+    SyscallMmap(
+        _In_opt_ PVOID address,
+        _In_ SIZE_T length,
+        _In_ INT prot,
+        _In_ INT flags,
+        _In_ INT fd,
+        _In_ INT_PTR offset
+    );
+
+INT
+    SyscallMunmap(
+        _In_ PVOID address,
+        _In_ SIZE_T length
+    );
+
+INT_PTR
+    SyscallBrk(
+        _In_opt_ PVOID address
+    );
+
+// Like posix_spawn(3). Relative paths start from the directory of the calling executable.
+INT
+    SyscallSpawn(
+        _In_z_ PCSTR path,
+        _In_ INT flags
+    );
+
+// Returns the ID of the new thread. A stack size of 0 picks MX_THREAD_DEFAULT_STACK_SIZE.
+INT
+    SyscallThreadCreate(
+        _In_ PVOID entry,
+        _In_opt_ PVOID argument,
+        _In_ SIZE_T stackSize
+    );
+
+// Ends only the calling thread, or the whole process if it is the last one.
+INT
+    SyscallThreadExit(
+        _In_ INT status
+    );
+
+// Like waitpid(2), for children forked or spawned without MX_SPAWN_WAIT. A pid of -1 waits for
+// any child. Returns the ID of the reaped child.
+INT
+    SyscallWaitPid(
+        _In_ INT pid,
+        _Out_opt_ PINT status,
+        _In_ INT options
+    );
+
+// Saves the calling process to a file, for mxhost to restore any number of times later. Returns
+// 0 in the calling process, and 1 in each restored one. Paths are resolved like SyscallSpawn.
+INT
+    SyscallCheckpoint(
+        _In_z_ PCSTR path
+    );
+
+// Like open(2) with O_RDONLY, the only flags supported. Paths are relative to the root directory
+// of the session, whether they start with '/' or not, and may not contain "..". Returns the
+// lowest free descriptor, to be read with SYSCALL_READ.
+INT
+    SyscallOpen(
+        _In_z_ PCSTR path,
+        _In_ INT flags
+    );
+
+// Only for descriptors returned by SyscallOpen and SyscallPipe, the console ones stay open.
+INT
+    SyscallClose(
+        _In_ INT fd
+    );
+
+// Like lseek(2), for descriptors returned by SyscallOpen.
+INT64
+    SyscallLseek(
+        _In_ INT fd,
+        _In_ INT64 offset,
+        _In_ INT whence
+    );
+
+// Like pipe(2). Both ends are inherited by forked and spawned children, reads block until there
+// is data and writes until all of it has been taken in.
+INT
+    SyscallPipe(
+        _Out_writes_(2) PINT fds
+    );
+
 #ifdef __cplusplus
 }
 #endif
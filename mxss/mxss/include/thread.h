@@ -13,11 +13,31 @@ extern "C"
 
 typedef struct _PS_PICO_SYSTEM_CALL_INFORMATION *PPS_PICO_SYSTEM_CALL_INFORMATION;
 
+// Staging buffer for translated writes, allocated on the first write of the thread.
+#define MX_THREAD_WRITE_BUFFER_SIZE             (4 * PAGE_SIZE)
+
+// Used when SYSCALL_THREAD_CREATE is not given a stack size.
+#define MX_THREAD_DEFAULT_STACK_SIZE            (1024 * 1024)
+
 typedef struct _MX_THREAD {
     ULONG_PTR ReferenceCount;
     PPS_PICO_SYSTEM_CALL_INFORMATION CurrentSystemCall;
+    PCHAR WriteBuffer;
+    // In MX_PROCESS::Threads.
+    LIST_ENTRY Link;
+    // Referenced, set for threads created after the main one.
+    PETHREAD Thread;
+    // Anonymous mapping serving as the user stack of threads created after the main one.
+    ULONG_PTR StackBase;
+    SIZE_T StackSize;
 } MX_THREAD, *PMX_THREAD;
 
+NTSTATUS
+    MxInitializeThreadLookaside();
+
+VOID
+    MxCleanupThreadLookaside();
+
 NTSTATUS
     MxThreadAllocate(
         _Out_ PMX_THREAD* pPMxThread
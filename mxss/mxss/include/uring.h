@@ -0,0 +1,87 @@
+#pragma once
+
+#include <ntifs.h>
+
+// uring.h
+//
+// Submission and completion rings shared with a Monix process
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define MX_URING_MAX_ENTRIES                    4096
+
+#define MX_URING_OP_NOP                         0
+#define MX_URING_OP_READ                        1
+#define MX_URING_OP_WRITE                       2
+
+// Fixed-size types only, this is read by Monix programs as is.
+typedef struct _MX_URING_SQE {
+    UINT32 Opcode;
+    INT32 Fd;
+    UINT64 Buffer;
+    UINT64 Size;
+    UINT64 UserData;
+} MX_URING_SQE, *PMX_URING_SQE;
+
+typedef struct _MX_URING_CQE {
+    UINT64 UserData;
+    // What the equivalent system call would have returned.
+    INT64 Result;
+} MX_URING_CQE, *PMX_URING_CQE;
+
+// Heads are advanced by the consumer of a queue, tails by its producer. All four are
+// free-running. Both queues have Entries slots, at the given offsets from the header.
+typedef struct _MX_URING_HEADER {
+    volatile UINT32 SqHead;
+    volatile UINT32 SqTail;
+    volatile UINT32 CqHead;
+    volatile UINT32 CqTail;
+    UINT32 Entries;
+    UINT32 SqOffset;
+    UINT32 CqOffset;
+} MX_URING_HEADER, *PMX_URING_HEADER;
+
+typedef struct _MX_URING {
+    PVOID Section;
+    // The system space view of the section.
+    PMX_URING_HEADER Header;
+    PMX_URING_SQE Sq;
+    PMX_URING_CQE Cq;
+    // Our own copies, since the ones in the section may be changed by the process. SqHead,
+    // CqTail and InFlight are guarded by Lock, which is never held while an entry is submitted.
+    ULONG Entries;
+    EX_PUSH_LOCK Lock;
+    ULONG SqHead;
+    ULONG CqTail;
+    // Entries taken off the submission queue by threads that have yet to post their completion.
+    ULONG InFlight;
+} MX_URING, *PMX_URING;
+
+NTSTATUS
+    MxUringCreate(
+        _In_ ULONG uEntries,
+        _Out_ PMX_URING* pPUring,
+        _Out_ PVOID* pUserView
+    );
+
+VOID
+    MxUringFree(
+        _In_ PMX_URING pUring
+    );
+
+// Calls pfnSubmit on up to uMaxSubmit queued entries, stopping early if the completion queue
+// is full. Returns the number of entries consumed. Threads may enter the same ring at once, each
+// submitting different entries, and completions are posted in the order they finish.
+ULONG
+    MxUringEnter(
+        _Inout_ PMX_URING pUring,
+        _In_ ULONG uMaxSubmit,
+        _In_ INT64 (*pfnSubmit)(_In_ PMX_URING_SQE pSqe)
+    );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <ntifs.h>
+
+// warmpool.h
+//
+// Pre-created session processes, handed out by MxStartSession
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _MX_PROCESS *PMX_PROCESS;
+
+// Beyond this, the least recently started executable loses its processes.
+#define MX_WARM_POOL_MAX_ENTRIES                8
+
+NTSTATUS
+    MxInitializeWarmPool();
+
+// Terminates every pooled process. The pool stays empty afterwards.
+VOID
+    MxCleanupWarmPool();
+
+// Processes to keep ready per executable, up to MA_WARM_POOL_SIZE_MAX, 0 to disable the pool.
+// Shrinking empties the pool, which fills up again as sessions ask for executables.
+NTSTATUS
+    MxWarmPoolSetSize(
+        _In_ SIZE_T Size
+    );
+
+// Returns a suspended process for the executable, attached to the console of the host, or
+// STATUS_NOT_FOUND if none is ready. Processes are only shared between hosts of the same logon
+// session, and the first miss for an executable makes the pool start keeping it ready.
+NTSTATUS
+    MxWarmPoolTake(
+        _In_ PUNICODE_STRING pExecutablePath,
+        _In_opt_ HANDLE hdlCwd,
+        _In_ PEPROCESS pHostProcess,
+        _In_ ULONG uFlags,
+        _Out_ PMX_PROCESS* pPMxProcess
+    );
+
+#ifdef __cplusplus
+}
+#endif
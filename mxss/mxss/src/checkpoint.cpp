@@ -0,0 +1,923 @@
+#include "checkpoint.h"
+
+#include "elf.h"
+#include "file.h"
+#include "image.h"
+#include "memory.h"
+#include "process.h"
+#include "provider.h"
+#include "shared.h"
+#include "thread.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+//
+// Writing
+//
+
+typedef struct _MX_CHECKPOINT_WRITER {
+    HANDLE File;
+    PUCHAR Buffer;
+    // Bytes of Buffer in use, written at Offset on the next flush.
+    SIZE_T Used;
+    ULONG64 Offset;
+} MX_CHECKPOINT_WRITER, *PMX_CHECKPOINT_WRITER;
+
+static
+NTSTATUS
+MxCheckpointFlush(
+    _Inout_ PMX_CHECKPOINT_WRITER pWriter
+)
+{
+    if (pWriter->Used == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    IO_STATUS_BLOCK ioStatus;
+    LARGE_INTEGER liOffset
+    {
+        .QuadPart = (LONGLONG)pWriter->Offset
+    };
+
+    MX_RETURN_IF_FAIL(ZwWriteFile(
+        pWriter->File,
+        NULL,
+        NULL,
+        NULL,
+        &ioStatus,
+        pWriter->Buffer,
+        (ULONG)pWriter->Used,
+        &liOffset,
+        NULL
+    ));
+
+    pWriter->Offset += pWriter->Used;
+    pWriter->Used = 0;
+
+    return STATUS_SUCCESS;
+}
+
+// Appends to the file through the buffer, so that the file system sees few, large writes.
+static
+NTSTATUS
+MxCheckpointWrite(
+    _Inout_ PMX_CHECKPOINT_WRITER pWriter,
+    _In_reads_bytes_(uSize) const VOID* pData,
+    _In_ SIZE_T uSize
+)
+{
+    const UCHAR* pBytes = (const UCHAR*)pData;
+
+    while (uSize != 0)
+    {
+        if (pWriter->Used == MX_CHECKPOINT_CHUNK_SIZE)
+        {
+            MX_RETURN_IF_FAIL(MxCheckpointFlush(pWriter));
+        }
+
+        SIZE_T uCopy = min(uSize, MX_CHECKPOINT_CHUNK_SIZE - pWriter->Used);
+
+        // pData may be user memory, which the process can still unmap from under us.
+        __try
+        {
+            memcpy(pWriter->Buffer + pWriter->Used, pBytes, uCopy);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            return GetExceptionCode();
+        }
+
+        pWriter->Used += uCopy;
+        pBytes += uCopy;
+        uSize -= uCopy;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Leaves a hole, which reads back as zeros.
+static
+NTSTATUS
+MxCheckpointSkip(
+    _Inout_ PMX_CHECKPOINT_WRITER pWriter,
+    _In_ ULONG64 uSize
+)
+{
+    MX_RETURN_IF_FAIL(MxCheckpointFlush(pWriter));
+    pWriter->Offset += uSize;
+
+    return STATUS_SUCCESS;
+}
+
+// Writes the committed pages of [uStart, uEnd) of the current process, and holes for the rest.
+static
+NTSTATUS
+MxCheckpointWriteMemory(
+    _Inout_ PMX_CHECKPOINT_WRITER pWriter,
+    _In_ ULONG_PTR uStart,
+    _In_ ULONG_PTR uEnd
+)
+{
+    ULONG_PTR uAddress = uStart;
+
+    while (uAddress < uEnd)
+    {
+        MEMORY_BASIC_INFORMATION mbi;
+        MX_RETURN_IF_FAIL(ZwQueryVirtualMemory(ZwCurrentProcess(), (PVOID)uAddress,
+            MemoryBasicInformation, &mbi, sizeof(mbi), NULL));
+
+        ULONG_PTR uRunEnd = min((ULONG_PTR)mbi.BaseAddress + mbi.RegionSize, uEnd);
+
+        // Reading the stack guard page would set it off. It is put back on restore anyway.
+        if (mbi.State == MEM_COMMIT && !(mbi.Protect & (PAGE_GUARD | PAGE_NOACCESS)))
+        {
+            MX_RETURN_IF_FAIL(MxCheckpointWrite(pWriter, (PVOID)uAddress, uRunEnd - uAddress));
+        }
+        else
+        {
+            MX_RETURN_IF_FAIL(MxCheckpointSkip(pWriter, uRunEnd - uAddress));
+        }
+
+        uAddress = uRunEnd;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Deletes a checkpoint that could not be written completely.
+static
+VOID
+MxCheckpointDiscard(
+    _In_ HANDLE hdlFile
+)
+{
+    IO_STATUS_BLOCK ioStatus;
+    FILE_DISPOSITION_INFORMATION dispositionInfo
+    {
+        .DeleteFile = TRUE
+    };
+
+    ZwSetInformationFile(hdlFile, &ioStatus, &dispositionInfo, sizeof(dispositionInfo),
+        FileDispositionInformation);
+}
+
+extern "C"
+NTSTATUS
+MxProcessCheckpoint(
+    _In_ PMX_PROCESS pMxProcess,
+    _In_ PCUNICODE_STRING pPath
+)
+{
+    // Memory is read through the current address space.
+    if (pMxProcess->Process != PsGetCurrentProcess() || pMxProcess->Memory == NULL)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Other threads would change memory while it is written, and nothing could bring back
+    // children or the io_uring pages the kernel shares with the process.
+    ExAcquireFastMutex(&pMxProcess->ThreadsLock);
+    BOOLEAN bSingleThread = pMxProcess->Threads.Flink == pMxProcess->Threads.Blink;
+    ExReleaseFastMutex(&pMxProcess->ThreadsLock);
+
+    if (!bSingleThread || pMxProcess->Uring != NULL || MxProcessHasChildren(pMxProcess))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    UINT32 uOpenFiles = 0;
+
+    for (INT fd = 0; fd < MX_FILE_TABLE_SIZE; ++fd)
+    {
+        MX_FILE file;
+        if (!NT_SUCCESS(MxFileTableGet(pMxProcess->Files, fd, &file)))
+        {
+            continue;
+        }
+
+        // Only the console can be opened again elsewhere. Files and pipes may take the lowest
+        // descriptors too, when there is no console.
+        if (fd > MX_FD_STDERR
+            || (file.Flags & (MX_FILE_SEEKABLE | MX_FILE_PIPE_READER | MX_FILE_PIPE_WRITER)))
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        uOpenFiles |= 1u << fd;
+    }
+
+    PMX_CHECKPOINT_HEADER pHeader = (PMX_CHECKPOINT_HEADER)ExAllocatePoolZero(PagedPool,
+        sizeof(MX_CHECKPOINT_HEADER), MX_POOL_TAG);
+    if (pHeader == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pHeader, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    MX_RETURN_IF_FAIL(MxProcessGetCallerContext(1, &pHeader->Context));
+
+    HANDLE hdlMainExecutable = NULL;
+    MX_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        pMxProcess->MainExecutable,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        FILE_GENERIC_READ,
+        *IoFileObjectType,
+        KernelMode,
+        &hdlMainExecutable
+    ));
+    AUTO_RESOURCE(hdlMainExecutable, ZwClose);
+
+    // Without a stable identity, a restore could not tell a changed executable apart.
+    if (!NT_SUCCESS(MxImageQueryKey(hdlMainExecutable, &pHeader->ExecutableKey)))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    PMX_IMAGE pImage = NULL;
+    MX_RETURN_IF_FAIL(MxImageGet(hdlMainExecutable, &pImage));
+    AUTO_RESOURCE(pImage, MxImageFree);
+
+    const ElfW(Phdr)* pProgramHeaders = pImage->ProgramHeaders;
+    SIZE_T szPhdrsCount = pImage->Header.e_phnum;
+
+    const auto IsWritableSegment = [](const ElfW(Phdr)& phdr)
+    {
+        return phdr.p_type == PT_LOAD && (phdr.p_flags & PF_W) && phdr.p_memsz != 0;
+    };
+
+    ULONG uSegmentCount = 0;
+    for (SIZE_T i = 0; i < szPhdrsCount; ++i)
+    {
+        if (IsWritableSegment(pProgramHeaders[i]))
+        {
+            ++uSegmentCount;
+        }
+    }
+
+    ULONG uMemoryCount = 0;
+    MxMemoryQueryRegions(pMxProcess->Memory, NULL, 0, &uMemoryCount);
+
+    ULONG uRegionCount = uMemoryCount + uSegmentCount;
+    if (uRegionCount > MX_CHECKPOINT_REGIONS_MAX)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    PMX_MEMORY_REGION pMemoryRegions = (PMX_MEMORY_REGION)ExAllocatePoolZero(PagedPool,
+        max(uMemoryCount, 1) * sizeof(MX_MEMORY_REGION), MX_POOL_TAG);
+    if (pMemoryRegions == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pMemoryRegions, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    // Nothing else runs in the process, so the count cannot have changed.
+    MX_RETURN_IF_FAIL(MxMemoryQueryRegions(pMxProcess->Memory, pMemoryRegions, uMemoryCount,
+        &uMemoryCount));
+
+    PMX_CHECKPOINT_REGION pRegions = (PMX_CHECKPOINT_REGION)ExAllocatePoolZero(PagedPool,
+        max(uRegionCount, 1) * sizeof(MX_CHECKPOINT_REGION), MX_POOL_TAG);
+    if (pRegions == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pRegions, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    for (ULONG i = 0; i < uMemoryCount; ++i)
+    {
+        const MX_MEMORY_REGION& region = pMemoryRegions[i];
+
+        pRegions[i] = MX_CHECKPOINT_REGION
+        {
+            .Kind = region.Kind,
+            .Protect = region.Protect,
+            .Base = region.Base,
+            .Size = region.Size,
+            .DataStart = region.DataStart,
+            .DataEnd = region.DataEnd,
+            .Break = region.Break
+        };
+    }
+
+    // TODO: Relocate the image, like MxProcessMapMainExecutable.
+    ElfW(Addr) pImageBase = 0;
+
+    for (SIZE_T i = 0, j = uMemoryCount; i < szPhdrsCount; ++i)
+    {
+        const ElfW(Phdr)& phdr = pProgramHeaders[i];
+
+        if (!IsWritableSegment(phdr))
+        {
+            continue;
+        }
+
+        ElfW(Addr) pStart = ALIGN_DOWN_BY(pImageBase + phdr.p_vaddr, PAGE_SIZE);
+        ElfW(Addr) pEnd = ALIGN_UP_BY(pImageBase + phdr.p_vaddr + phdr.p_memsz, PAGE_SIZE);
+
+        pRegions[j++] = MX_CHECKPOINT_REGION
+        {
+            .Kind = MX_CHECKPOINT_REGION_SEGMENT,
+            .Base = pStart,
+            .Size = pEnd - pStart,
+            .DataStart = pStart,
+            .DataEnd = pEnd
+        };
+    }
+
+    const UNICODE_STRING& strName = pMxProcess->ExecutableName->Name;
+
+    // Page aligned, so that every region can be mapped straight from the file.
+    ULONG64 uOffset = ALIGN_UP_BY(sizeof(MX_CHECKPOINT_HEADER) + strName.Length
+        + (SIZE_T)uRegionCount * sizeof(MX_CHECKPOINT_REGION), PAGE_SIZE);
+
+    pHeader->DataOffset = uOffset;
+
+    for (ULONG i = 0; i < uRegionCount; ++i)
+    {
+        pRegions[i].FileOffset = uOffset;
+        uOffset += pRegions[i].DataEnd - pRegions[i].DataStart;
+    }
+
+    pHeader->Magic = MX_CHECKPOINT_MAGIC;
+    pHeader->Version = MX_CHECKPOINT_VERSION;
+    pHeader->Machine = MX_CHECKPOINT_MACHINE;
+    pHeader->ExecuteFlags = pMxProcess->ExecuteFlags;
+    pHeader->ExitStatus = pMxProcess->ExitStatus;
+    pHeader->OpenFiles = uOpenFiles;
+    pHeader->NameLength = strName.Length;
+    pHeader->RegionCount = uRegionCount;
+    pHeader->DataEnd = uOffset;
+
+    // The kernel handle would otherwise let any Monix process write anywhere.
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(
+        &objAttributes,
+        (PUNICODE_STRING)pPath,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE | OBJ_FORCE_ACCESS_CHECK,
+        NULL,
+        NULL
+    );
+
+    IO_STATUS_BLOCK ioStatus;
+
+    HANDLE hdlFile = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateFile(
+        &hdlFile,
+        FILE_GENERIC_WRITE | DELETE,
+        &objAttributes,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        0,
+        FILE_OVERWRITE_IF,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY,
+        NULL,
+        0
+    ));
+    AUTO_RESOURCE(hdlFile, ZwClose);
+
+    // Until it has all been written.
+    HANDLE hdlIncomplete = hdlFile;
+    AUTO_RESOURCE(hdlIncomplete, MxCheckpointDiscard);
+
+    // Most of a large reservation is usually never touched. File systems without sparse files
+    // just fill the holes with zeros.
+    ZwFsControlFile(hdlFile, NULL, NULL, NULL, &ioStatus, FSCTL_SET_SPARSE,
+        NULL, 0, NULL, 0);
+
+    PUCHAR pBuffer = (PUCHAR)ExAllocatePoolZero(PagedPool, MX_CHECKPOINT_CHUNK_SIZE,
+        MX_POOL_TAG);
+    if (pBuffer == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pBuffer, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    MX_CHECKPOINT_WRITER writer
+    {
+        .File = hdlFile,
+        .Buffer = pBuffer
+    };
+
+    MX_RETURN_IF_FAIL(MxCheckpointWrite(&writer, pHeader, sizeof(MX_CHECKPOINT_HEADER)));
+    MX_RETURN_IF_FAIL(MxCheckpointWrite(&writer, strName.Buffer, strName.Length));
+    MX_RETURN_IF_FAIL(MxCheckpointWrite(&writer, pRegions,
+        (SIZE_T)uRegionCount * sizeof(MX_CHECKPOINT_REGION)));
+    MX_RETURN_IF_FAIL(MxCheckpointSkip(&writer,
+        pHeader->DataOffset - (writer.Offset + writer.Used)));
+
+    for (ULONG i = 0; i < uRegionCount; ++i)
+    {
+        MX_RETURN_IF_FAIL(MxCheckpointWriteMemory(&writer, (ULONG_PTR)pRegions[i].DataStart,
+            (ULONG_PTR)pRegions[i].DataEnd));
+    }
+
+    MX_RETURN_IF_FAIL(MxCheckpointFlush(&writer));
+
+    // Trailing holes are only there once the file is long enough.
+    FILE_END_OF_FILE_INFORMATION endOfFileInfo
+    {
+        .EndOfFile =
+        {
+            .QuadPart = (LONGLONG)pHeader->DataEnd
+        }
+    };
+    MX_RETURN_IF_FAIL(ZwSetInformationFile(hdlFile, &ioStatus, &endOfFileInfo,
+        sizeof(endOfFileInfo), FileEndOfFileInformation));
+
+    hdlIncomplete = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Restoring
+//
+
+static
+NTSTATUS
+MxCheckpointRead(
+    _In_ HANDLE hdlFile,
+    _In_ ULONG64 uOffset,
+    _Out_writes_bytes_(uSize) PVOID pBuffer,
+    _In_ ULONG uSize
+)
+{
+    IO_STATUS_BLOCK ioStatus;
+    LARGE_INTEGER liOffset
+    {
+        .QuadPart = (LONGLONG)uOffset
+    };
+
+    MX_RETURN_IF_FAIL(ZwReadFile(
+        hdlFile,
+        NULL,
+        NULL,
+        NULL,
+        &ioStatus,
+        pBuffer,
+        uSize,
+        &liOffset,
+        NULL
+    ));
+
+    if (ioStatus.Information != uSize)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Copies into the user memory of the process the caller is attached to.
+static
+NTSTATUS
+MxCheckpointCopyToUser(
+    _Out_writes_bytes_(uSize) PVOID pDestination,
+    _In_reads_bytes_(uSize) const VOID* pSource,
+    _In_ SIZE_T uSize
+)
+{
+    __try
+    {
+        ProbeForWrite(pDestination, uSize, 1);
+        memcpy(pDestination, pSource, uSize);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return GetExceptionCode();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Writes the saved contents of a writable segment over the fresh mapping of the executable.
+// Unlike the other regions, these are copied, since they are already views of the executable.
+static
+NTSTATUS
+MxCheckpointRestoreSegment(
+    _In_ HANDLE hdlFile,
+    _In_ PEPROCESS pProcess,
+    _In_ const MX_CHECKPOINT_REGION* pRegion,
+    _Inout_updates_bytes_(MX_CHECKPOINT_CHUNK_SIZE) PUCHAR pBuffer
+)
+{
+    ULONG64 uDone = 0;
+    ULONG64 uSize = pRegion->DataEnd - pRegion->DataStart;
+
+    while (uDone < uSize)
+    {
+        ULONG uChunk = (ULONG)min(uSize - uDone, MX_CHECKPOINT_CHUNK_SIZE);
+        MX_RETURN_IF_FAIL(MxCheckpointRead(hdlFile, pRegion->FileOffset + uDone, pBuffer,
+            uChunk));
+
+        KAPC_STATE apcState;
+        KeStackAttachProcess(pProcess, &apcState);
+        NTSTATUS status = MxCheckpointCopyToUser((PVOID)(pRegion->DataStart + uDone), pBuffer,
+            uChunk);
+        KeUnstackDetachProcess(&apcState);
+
+        MX_RETURN_IF_FAIL(status);
+
+        uDone += uChunk;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MxProcessRestore(
+    _In_ PUNICODE_STRING pCheckpointPath,
+    _In_ PEPROCESS pParentProcess,
+    _In_ PEPROCESS pHostProcess,
+    _In_opt_ PMX_OUTPUT_RING pOutputRing,
+    _In_ ULONG uFlags,
+    _Out_ PMX_PROCESS* pPMxProcess
+)
+{
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(
+        &objAttributes,
+        pCheckpointPath,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE | OBJ_FORCE_ACCESS_CHECK,
+        NULL,
+        NULL
+    );
+
+    IO_STATUS_BLOCK ioStatus;
+
+    // Executable too, the regions are mapped as views of it.
+    HANDLE hdlFile = NULL;
+    MX_RETURN_IF_FAIL(ZwOpenFile(
+        &hdlFile,
+        FILE_GENERIC_READ | FILE_GENERIC_EXECUTE,
+        &objAttributes,
+        &ioStatus,
+        FILE_SHARE_READ,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT
+    ));
+    AUTO_RESOURCE(hdlFile, ZwClose);
+
+    PMX_CHECKPOINT_HEADER pHeader = (PMX_CHECKPOINT_HEADER)ExAllocatePoolZero(PagedPool,
+        sizeof(MX_CHECKPOINT_HEADER), MX_POOL_TAG);
+    if (pHeader == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pHeader, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    MX_RETURN_IF_FAIL(MxCheckpointRead(hdlFile, 0, pHeader, sizeof(MX_CHECKPOINT_HEADER)));
+
+    if (pHeader->Magic != MX_CHECKPOINT_MAGIC
+        || pHeader->Version != MX_CHECKPOINT_VERSION
+        || pHeader->Machine != MX_CHECKPOINT_MACHINE
+        || pHeader->NameLength == 0 || pHeader->NameLength > MX_CHECKPOINT_NAME_MAX
+        || pHeader->NameLength % sizeof(WCHAR) != 0
+        || pHeader->RegionCount == 0 || pHeader->RegionCount > MX_CHECKPOINT_REGIONS_MAX
+        || pHeader->DataOffset != ALIGN_UP_BY(sizeof(MX_CHECKPOINT_HEADER) + pHeader->NameLength
+            + (SIZE_T)pHeader->RegionCount * sizeof(MX_CHECKPOINT_REGION), PAGE_SIZE)
+        || pHeader->DataEnd < pHeader->DataOffset)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    UNICODE_STRING strName
+    {
+        .Length = (USHORT)pHeader->NameLength,
+        .MaximumLength = (USHORT)pHeader->NameLength,
+        .Buffer = (PWCH)ExAllocatePoolZero(PagedPool, pHeader->NameLength, MX_POOL_TAG)
+    };
+    if (strName.Buffer == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    PWCH pNameBuffer = strName.Buffer;
+    AUTO_RESOURCE(pNameBuffer, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    MX_RETURN_IF_FAIL(MxCheckpointRead(hdlFile, sizeof(MX_CHECKPOINT_HEADER), strName.Buffer,
+        pHeader->NameLength));
+
+    ULONG uRegionsSize = pHeader->RegionCount * sizeof(MX_CHECKPOINT_REGION);
+
+    PMX_CHECKPOINT_REGION pRegions = (PMX_CHECKPOINT_REGION)ExAllocatePoolZero(PagedPool,
+        uRegionsSize, MX_POOL_TAG);
+    if (pRegions == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pRegions, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    MX_RETURN_IF_FAIL(MxCheckpointRead(hdlFile,
+        sizeof(MX_CHECKPOINT_HEADER) + pHeader->NameLength, pRegions, uRegionsSize));
+
+    // The memory layout itself is checked by MxMemoryRestoreRegion.
+    for (ULONG i = 0; i < pHeader->RegionCount; ++i)
+    {
+        const MX_CHECKPOINT_REGION& region = pRegions[i];
+
+        if (region.DataEnd < region.DataStart
+            || region.FileOffset != ALIGN_DOWN_BY(region.FileOffset, PAGE_SIZE)
+            || region.FileOffset < pHeader->DataOffset
+            || region.FileOffset > pHeader->DataEnd
+            || region.DataEnd - region.DataStart > pHeader->DataEnd - region.FileOffset
+            || (region.Kind == MX_CHECKPOINT_REGION_SEGMENT
+                && (region.DataStart != region.Base || region.Size != region.DataEnd - region.Base
+                    || region.DataEnd > MmUserProbeAddress)))
+        {
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+    }
+
+    InitializeObjectAttributes(
+        &objAttributes,
+        &strName,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE | OBJ_FORCE_ACCESS_CHECK,
+        NULL,
+        NULL
+    );
+
+    HANDLE hdlExecutable = NULL;
+    MX_RETURN_IF_FAIL(ZwOpenFile(
+        &hdlExecutable,
+        FILE_GENERIC_READ | FILE_GENERIC_EXECUTE,
+        &objAttributes,
+        &ioStatus,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_SYNCHRONOUS_IO_NONALERT
+    ));
+    AUTO_RESOURCE(hdlExecutable, ZwClose);
+
+    // The saved memory only makes sense on top of the very same executable.
+    MX_IMAGE_KEY key;
+    MX_RETURN_IF_FAIL(MxImageQueryKey(hdlExecutable, &key));
+
+    if (!RtlEqualMemory(&key, &pHeader->ExecutableKey, sizeof(key)))
+    {
+        return STATUS_IMAGE_CHECKSUM_MISMATCH;
+    }
+
+    PMX_PROCESS pMxProcess = MxProcessAllocate();
+    if (pMxProcess == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pMxProcess, MxProcessFree);
+    pMxProcess->ExecuteFlags = pHeader->ExecuteFlags
+        & (MX_EXECUTE_PREFAULT | MX_EXECUTE_LARGE_PAGES);
+    pMxProcess->ExitStatus = pHeader->ExitStatus;
+
+    MX_RETURN_IF_FAIL(MxFileTableAllocate(&pMxProcess->Files));
+    MxFileTableOpenConsole(pMxProcess->Files, pHostProcess);
+
+    if (pOutputRing != NULL)
+    {
+        MX_RETURN_IF_FAIL(MxFileTableAttachOutputRing(pMxProcess->Files, pOutputRing));
+    }
+
+    // Descriptors closed before the checkpoint stay closed.
+    for (INT fd = 0; fd <= MX_FD_STDERR; ++fd)
+    {
+        PMX_FILE pFile = &pMxProcess->Files->Files[fd];
+
+        if (pHeader->OpenFiles & (1u << fd))
+        {
+            continue;
+        }
+
+        if (pFile->Handle != NULL)
+        {
+            ZwClose(pFile->Handle);
+            pFile->Handle = NULL;
+        }
+
+        if (pFile->OutputRing != NULL)
+        {
+            MxOutputRingFree(pFile->OutputRing);
+            pFile->OutputRing = NULL;
+        }
+    }
+
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlExecutable,
+        FILE_GENERIC_READ | FILE_GENERIC_EXECUTE,
+        *IoFileObjectType,
+        KernelMode,
+        (PVOID*)&pMxProcess->MainExecutable,
+        NULL
+    ));
+
+    MX_RETURN_IF_FAIL(MxExecutableNameCreate(pMxProcess->MainExecutable,
+        &pMxProcess->ExecutableName));
+
+    HANDLE hdlParentProcess = NULL;
+    MX_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        pParentProcess,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        PROCESS_ALL_ACCESS,
+        *PsProcessType,
+        KernelMode,
+        &hdlParentProcess
+    ));
+    AUTO_RESOURCE(hdlParentProcess, ZwClose);
+
+    PS_PICO_PROCESS_ATTRIBUTES psPicoProcessAttributes
+    {
+        .ParentProcess = hdlParentProcess,
+        .Context = pMxProcess
+    };
+
+    PS_PICO_CREATE_INFO psPicoCreateInfo
+    {
+        .FileObject = pMxProcess->MainExecutable,
+        .ImageFileName = &pMxProcess->ExecutableName->Name
+    };
+
+    HANDLE hdlProcess = NULL;
+    MX_RETURN_IF_FAIL(MxRoutines.CreateProcess(&psPicoProcessAttributes,
+        &psPicoCreateInfo, &hdlProcess));
+    AUTO_RESOURCE(hdlProcess, ZwClose);
+
+    PEPROCESS pProcess = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlProcess,
+        PROCESS_ALL_ACCESS,
+        *PsProcessType,
+        KernelMode,
+        (PVOID*)&pProcess,
+        NULL
+    ));
+    AUTO_RESOURCE(pProcess, [](auto pProcess)
+    {
+        MxRoutines.TerminateProcess(pProcess, STATUS_UNSUCCESSFUL);
+        ObDereferenceObject(pProcess);
+    });
+
+    PVOID pEntryPoint = NULL;
+
+    // Mapped before there is any MX_MEMORY, so that no new break is set up over the saved one.
+    pMxProcess->Process = pProcess;
+    NTSTATUS status = MxProcessMapMainExecutable(pMxProcess, &pEntryPoint);
+    pMxProcess->Process = NULL;
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    MX_RETURN_IF_FAIL(MxMemoryAllocate(&pMxProcess->Memory));
+    MX_RETURN_IF_FAIL(MxSharedPageCreate(hdlProcess, pProcess, &pMxProcess->SharedPage));
+
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY,
+        NULL,
+        NULL,
+        PAGE_EXECUTE_WRITECOPY,
+        SEC_COMMIT,
+        hdlFile
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PUCHAR pBuffer = NULL;
+    AUTO_RESOURCE(pBuffer, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    for (ULONG i = 0; i < pHeader->RegionCount; ++i)
+    {
+        const MX_CHECKPOINT_REGION& region = pRegions[i];
+
+        if (region.Kind != MX_CHECKPOINT_REGION_SEGMENT)
+        {
+            // Views of the checkpoint, so that pages are only read once they are touched.
+            MX_MEMORY_REGION memoryRegion
+            {
+                .Kind = region.Kind,
+                .Protect = region.Protect,
+                .Base = (ULONG_PTR)region.Base,
+                .Size = (SIZE_T)region.Size,
+                .DataStart = (ULONG_PTR)region.DataStart,
+                .DataEnd = (ULONG_PTR)region.DataEnd,
+                .Break = (ULONG_PTR)region.Break
+            };
+
+            MX_RETURN_IF_FAIL(MxMemoryRestoreRegion(pMxProcess->Memory, hdlProcess,
+                &memoryRegion, hdlSection, region.FileOffset));
+            continue;
+        }
+
+        if (pBuffer == NULL)
+        {
+            pBuffer = (PUCHAR)ExAllocatePoolZero(PagedPool, MX_CHECKPOINT_CHUNK_SIZE,
+                MX_POOL_TAG);
+            if (pBuffer == NULL)
+            {
+                return STATUS_NO_MEMORY;
+            }
+        }
+
+        MX_RETURN_IF_FAIL(MxCheckpointRestoreSegment(hdlFile, pProcess, &region, pBuffer));
+    }
+
+    if (pMxProcess->Memory->Stack.Size == 0)
+    {
+        return STATUS_FILE_CORRUPT_ERROR;
+    }
+
+    CONTEXT* pContext = &pHeader->Context;
+    pContext->ContextFlags = CONTEXT_FULL;
+
+    PMX_THREAD pMxThread = NULL;
+    MX_RETURN_IF_FAIL(MxThreadAllocate(&pMxThread));
+    AUTO_RESOURCE(pMxThread, MxThreadFree);
+
+    PS_PICO_THREAD_ATTRIBUTES psPicoThreadAttributes
+    {
+        .Process = hdlProcess,
+#ifdef _M_AMD64
+        .UserStack = (ULONG_PTR)pContext->Rsp,
+        .StartRoutine = (ULONG_PTR)pContext->Rip,
+#elif defined(_M_ARM64)
+        .UserStack = (ULONG_PTR)pContext->Sp,
+        .StartRoutine = (ULONG_PTR)pContext->Pc,
+#else
+#error Copy the stack and instruction pointers for this architecture!
+#endif
+        .Context = pMxThread
+    };
+
+    HANDLE hdlThread = NULL;
+    MX_RETURN_IF_FAIL(MxRoutines.CreateThread(&psPicoThreadAttributes,
+        &psPicoCreateInfo, &hdlThread));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    // One more reference that NT holds.
+    MxThreadReference(pMxThread);
+
+    PETHREAD pThread = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlThread,
+        THREAD_ALL_ACCESS,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&pThread,
+        NULL
+    ));
+    AUTO_RESOURCE(pThread, [](auto pThread)
+    {
+        MxThreadFree((PMX_THREAD)MxRoutines.GetThreadContext(pThread));
+        MxRoutines.TerminateThread(pThread, STATUS_UNSUCCESSFUL, TRUE);
+        ObDereferenceObject(pThread);
+    });
+
+    // Set as coming from user mode, so that nothing privileged is taken from the file.
+    MX_RETURN_IF_FAIL(MxRoutines.SetContextThreadInternal(
+        pThread,
+        pContext,
+        KernelMode,
+        UserMode,
+        FALSE
+    ));
+
+    ObReferenceObject(pHostProcess);
+    pMxProcess->HostProcess = pHostProcess;
+
+    // One more reference for the output. The other reference is given to NT.
+    InterlockedIncrementSizeT(&pMxProcess->ReferenceCount);
+
+    pMxProcess->UserStack = (PVOID)pMxProcess->Memory->Stack.Base;
+
+    pMxProcess->Process = pProcess;
+    pProcess = NULL;
+    pMxProcess->Thread = pThread;
+    pThread = NULL;
+    // One more reference for the thread list.
+    MxThreadReference(pMxThread);
+    InsertTailList(&pMxProcess->Threads, &pMxThread->Link);
+    pMxProcess->MxThread = pMxThread;
+    pMxThread = NULL;
+
+    if (!(uFlags & MX_EXECUTE_SUSPENDED))
+    {
+        MxRoutines.ResumeThread(pMxProcess->Thread, NULL);
+    }
+
+    *pPMxProcess = pMxProcess;
+    pMxProcess = NULL;
+
+    return STATUS_SUCCESS;
+}
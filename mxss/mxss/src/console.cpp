@@ -190,10 +190,122 @@ fail:
     return status;
 }
 
-extern "C"
-DECLSPEC_DEPRECATED
+// Recently created wsl.exe processes, oldest first, so that the newest is found without walking
+// the whole process list. Older instances fall out when more than CO_WSL_TRACKED_MAX are alive.
+#define CO_WSL_TRACKED_MAX                      8
+
+static HANDLE CoWslProcessIds[CO_WSL_TRACKED_MAX];
+static SIZE_T CoWslProcessCount = 0;
+static EX_PUSH_LOCK CoWslLock = 0;
+static BOOLEAN CoWslNotifyRegistered = FALSE;
+
+static
+VOID
+CoLockWslProcesses()
+{
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&CoWslLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+}
+
+static
+VOID
+CoUnlockWslProcesses()
+{
+    ExReleasePushLockExclusiveEx(&CoWslLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+static
+VOID
+CoTrackWslProcess(
+    _In_ HANDLE hdlProcessId
+)
+{
+    if (CoWslProcessCount == CO_WSL_TRACKED_MAX)
+    {
+        memmove(&CoWslProcessIds[0], &CoWslProcessIds[1],
+            (CO_WSL_TRACKED_MAX - 1) * sizeof(HANDLE));
+        --CoWslProcessCount;
+    }
+
+    CoWslProcessIds[CoWslProcessCount++] = hdlProcessId;
+}
+
+static
+VOID
+CoUntrackWslProcess(
+    _In_ HANDLE hdlProcessId
+)
+{
+    for (SIZE_T i = 0; i < CoWslProcessCount; ++i)
+    {
+        if (CoWslProcessIds[i] == hdlProcessId)
+        {
+            memmove(&CoWslProcessIds[i], &CoWslProcessIds[i + 1],
+                (CoWslProcessCount - i - 1) * sizeof(HANDLE));
+            --CoWslProcessCount;
+            return;
+        }
+    }
+}
+
+static
+BOOLEAN
+CoIsWslImage(
+    _In_opt_ PCUNICODE_STRING pImageFileName
+)
+{
+    static UNICODE_STRING strWsl = RTL_CONSTANT_STRING(L"\\wsl.exe");
+
+    if (pImageFileName == NULL || pImageFileName->Length < strWsl.Length)
+    {
+        return FALSE;
+    }
+
+    // The full path is given, only the last component matters.
+    UNICODE_STRING strSuffix
+    {
+        .Length = strWsl.Length,
+        .MaximumLength = strWsl.Length,
+        .Buffer = (PWCH)((PCHAR)pImageFileName->Buffer + pImageFileName->Length - strWsl.Length)
+    };
+
+    return RtlEqualUnicodeString(&strSuffix, &strWsl, TRUE);
+}
+
+static
+VOID
+CoWslProcessNotify(
+    _Inout_ PEPROCESS pProcess,
+    _In_ HANDLE hdlProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO pCreateInfo
+)
+{
+    UNREFERENCED_PARAMETER(pProcess);
+
+    if (pCreateInfo != NULL && !CoIsWslImage(pCreateInfo->ImageFileName))
+    {
+        return;
+    }
+
+    CoLockWslProcesses();
+
+    if (pCreateInfo != NULL)
+    {
+        CoTrackWslProcess(hdlProcessId);
+    }
+    else
+    {
+        // Most exits are not of wsl.exe, and find nothing here.
+        CoUntrackWslProcess(hdlProcessId);
+    }
+
+    CoUnlockWslProcesses();
+}
+
+static
 NTSTATUS
-CoOpenNewestWslHandle(
+CoScanNewestWslProcess(
     _Out_ PHANDLE pHdlWsl
 )
 {
@@ -313,3 +425,66 @@ end:
 
     return status;
 }
+
+extern "C"
+VOID
+CoInitializeWslTracking()
+{
+    // Requires the driver to be linked with /INTEGRITYCHECK.
+    if (!NT_SUCCESS(PsSetCreateProcessNotifyRoutineEx(CoWslProcessNotify, FALSE)))
+    {
+        return;
+    }
+
+    // Registered first, so that only instances from before then need to be looked for. All
+    // those that the notification has seen are newer.
+    HANDLE hdlExisting = NULL;
+    if (NT_SUCCESS(CoScanNewestWslProcess(&hdlExisting)))
+    {
+        CoLockWslProcesses();
+        if (CoWslProcessCount == 0)
+        {
+            CoTrackWslProcess(hdlExisting);
+        }
+        CoUnlockWslProcesses();
+    }
+
+    CoWslNotifyRegistered = TRUE;
+}
+
+extern "C"
+VOID
+CoCleanupWslTracking()
+{
+    // Waits for running notifications to return.
+    if (CoWslNotifyRegistered)
+    {
+        PsSetCreateProcessNotifyRoutineEx(CoWslProcessNotify, TRUE);
+        CoWslNotifyRegistered = FALSE;
+    }
+}
+
+extern "C"
+DECLSPEC_DEPRECATED
+NTSTATUS
+CoOpenNewestWslHandle(
+    _Out_ PHANDLE pHdlWsl
+)
+{
+    if (!CoWslNotifyRegistered)
+    {
+        return CoScanNewestWslProcess(pHdlWsl);
+    }
+
+    NTSTATUS status = STATUS_NOT_FOUND;
+
+    CoLockWslProcesses();
+    if (CoWslProcessCount != 0)
+    {
+        *pHdlWsl = CoWslProcessIds[CoWslProcessCount - 1];
+        status = STATUS_SUCCESS;
+    }
+    CoUnlockWslProcesses();
+
+    return status;
+}
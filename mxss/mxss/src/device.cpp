@@ -2,7 +2,10 @@
 
 #include <wdmsec.h>
 
+#include "checkpoint.h"
 #include "process.h"
+#include "provider.h"
+#include "ring.h"
 
 #define IOCTL_MX_METHOD_BUFFERED \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x900, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -12,7 +15,55 @@ typedef struct _MX_EXECUTE_INFORMATION
     UNICODE_STRING ExecutablePath;
 } MX_EXECUTE_INFORMATION, *PMX_EXECUTE_INFORMATION;
 
+#define IOCTL_MX_OUTPUT_RING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x901, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Programs executed through the same device handle afterwards write their standard output and
+// error to the ring, which the caller drains when Event is signaled.
+typedef struct _MX_OUTPUT_RING_INFORMATION
+{
+    ULONG Size;
+    HANDLE Event;
+    PVOID Ring;
+} MX_OUTPUT_RING_INFORMATION, *PMX_OUTPUT_RING_INFORMATION;
+
+#define IOCTL_MX_QUERY_SYSCALL_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x902, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Followed by as many MX_SYSCALL_STATISTICS entries as fit in the output buffer.
+typedef struct _MX_SYSCALL_STATISTICS_INFORMATION
+{
+    UINT64 Unknown;
+    UINT64 HandledFaults;
+    UINT32 Count;
+} MX_SYSCALL_STATISTICS_INFORMATION, *PMX_SYSCALL_STATISTICS_INFORMATION;
+
+#define IOCTL_MX_EXECUTE_ASYNC \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x903, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// Takes an MX_EXECUTE_INFORMATION and returns without waiting for the program. The process
+// handle is signaled on exit, carries the exit status, and can terminate the program.
+typedef struct _MX_EXECUTE_ASYNC_INFORMATION
+{
+    HANDLE Process;
+    ULONG ProcessId;
+} MX_EXECUTE_ASYNC_INFORMATION, *PMX_EXECUTE_ASYNC_INFORMATION;
+
+#define IOCTL_MX_EXECUTE_DIRECT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x904, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+// The input buffer holds the NT path of the executable itself, without a terminating NUL. The
+// request stays pending until the program exits, then the output buffer receives its NTSTATUS.
+// Cancelling the request terminates the program.
+
+#define IOCTL_MX_RESTORE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x905, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// The input buffer holds the NT path of a checkpoint written by SYSCALL_CHECKPOINT, without a
+// terminating NUL. Returns an MX_EXECUTE_ASYNC_INFORMATION for the restored process.
+
 static DRIVER_DISPATCH MxControlDeviceNoOp;
+static DRIVER_DISPATCH MxControlDeviceClose;
 static DRIVER_DISPATCH MxControlDeviceIoctl;
 
 CONST UNICODE_STRING MxDeviceName = RTL_CONSTANT_STRING(L"\\Device\\mxss");
@@ -30,7 +81,7 @@ DeviceInit(
     }
 
     pDriverObject->MajorFunction[IRP_MJ_CREATE] = MxControlDeviceNoOp;
-    pDriverObject->MajorFunction[IRP_MJ_CLOSE] = MxControlDeviceNoOp;
+    pDriverObject->MajorFunction[IRP_MJ_CLOSE] = MxControlDeviceClose;
     pDriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = MxControlDeviceIoctl;
 
     NTSTATUS status;
@@ -93,13 +144,276 @@ MxControlDeviceNoOp(
 
 static
 NTSTATUS
-MxControlDeviceIoctl(
+MxControlDeviceClose(
     _In_ PDEVICE_OBJECT pDeviceObject,
     _Inout_ PIRP pIrp
 )
 {
     UNREFERENCED_PARAMETER(pDeviceObject);
 
+    PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+    // Processes started through this handle may outlive it, but they cannot write to a ring
+    // that nobody drains anymore.
+    PMX_OUTPUT_RING pRing = (PMX_OUTPUT_RING)pIrpStack->FileObject->FsContext;
+    if (pRing != NULL)
+    {
+        pIrpStack->FileObject->FsContext = NULL;
+        MxOutputRingDetach(pRing);
+        MxOutputRingFree(pRing);
+    }
+
+    pIrp->IoStatus.Status = STATUS_SUCCESS;
+    pIrp->IoStatus.Information = 0;
+
+    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
+typedef struct _MX_EXECUTE_REQUEST
+{
+    // One for the completion, one for the cancellation.
+    volatile LONG ReferenceCount;
+    PIRP Irp;
+    PEPROCESS Process;
+    PIO_WORKITEM CancelWorkItem;
+} MX_EXECUTE_REQUEST, *PMX_EXECUTE_REQUEST;
+
+static
+VOID
+MxExecuteRequestFree(
+    _In_ PMX_EXECUTE_REQUEST pRequest
+)
+{
+    if (InterlockedDecrement(&pRequest->ReferenceCount) != 0)
+    {
+        return;
+    }
+
+    if (pRequest->Process != NULL)
+    {
+        ObDereferenceObject(pRequest->Process);
+    }
+
+    IoFreeWorkItem(pRequest->CancelWorkItem);
+    ExFreePoolWithTag(pRequest, '  xM');
+}
+
+static
+VOID
+MxExecuteRequestTerminate(
+    _In_ PDEVICE_OBJECT pDeviceObject,
+    _In_opt_ PVOID pContext
+)
+{
+    UNREFERENCED_PARAMETER(pDeviceObject);
+
+    PMX_EXECUTE_REQUEST pRequest = (PMX_EXECUTE_REQUEST)pContext;
+
+    // Completes the request through the exit of the process.
+    MxRoutines.TerminateProcess(pRequest->Process, STATUS_CANCELLED);
+    MxExecuteRequestFree(pRequest);
+}
+
+static
+VOID
+MxExecuteRequestCancel(
+    _Inout_ PDEVICE_OBJECT pDeviceObject,
+    _Inout_ _IRQL_uses_cancel_ PIRP pIrp
+)
+{
+    UNREFERENCED_PARAMETER(pDeviceObject);
+
+    IoReleaseCancelSpinLock(pIrp->CancelIrql);
+
+    // Possibly at DISPATCH_LEVEL, too high to terminate processes.
+    PMX_EXECUTE_REQUEST pRequest = (PMX_EXECUTE_REQUEST)
+        pIrp->Tail.Overlay.DriverContext[0];
+    IoQueueWorkItem(pRequest->CancelWorkItem, MxExecuteRequestTerminate, DelayedWorkQueue,
+        pRequest);
+}
+
+static
+VOID
+MxExecuteRequestComplete(
+    _In_opt_ PVOID pContext,
+    _In_ NTSTATUS statusExecute
+)
+{
+    PMX_EXECUTE_REQUEST pRequest = (PMX_EXECUTE_REQUEST)pContext;
+    PIRP pIrp = pRequest->Irp;
+
+    // A cancel routine that has been called holds on to its reference until it is done.
+    if (IoSetCancelRoutine(pIrp, NULL) != NULL)
+    {
+        MxExecuteRequestFree(pRequest);
+    }
+
+    PNTSTATUS pOutStatus = (PNTSTATUS)MmGetSystemAddressForMdlSafe(pIrp->MdlAddress,
+        NormalPagePriority | MdlMappingNoExecute);
+
+    if (pIrp->Cancel)
+    {
+        pIrp->IoStatus.Status = STATUS_CANCELLED;
+        pIrp->IoStatus.Information = 0;
+    }
+    else if (pOutStatus == NULL)
+    {
+        pIrp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        pIrp->IoStatus.Information = 0;
+    }
+    else
+    {
+        *pOutStatus = statusExecute;
+        pIrp->IoStatus.Status = STATUS_SUCCESS;
+        pIrp->IoStatus.Information = sizeof(NTSTATUS);
+    }
+
+    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+
+    MxExecuteRequestFree(pRequest);
+}
+
+static
+NTSTATUS
+MxControlDeviceExecuteDirect(
+    _In_ PDEVICE_OBJECT pDeviceObject,
+    _Inout_ PIRP pIrp
+)
+{
+    PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+    SIZE_T uInLen = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+    SIZE_T uOutLen = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    // The I/O manager has captured and probed both buffers, the path cannot change under us.
+    if (uInLen == 0 || uInLen > UNICODE_STRING_MAX_BYTES || uInLen % sizeof(WCHAR) != 0
+        || uOutLen != sizeof(NTSTATUS) || pIrp->MdlAddress == NULL)
+    {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    UNICODE_STRING strPath
+    {
+        .Length = (USHORT)uInLen,
+        .MaximumLength = (USHORT)uInLen,
+        .Buffer = (PWCH)pIrp->AssociatedIrp.SystemBuffer
+    };
+
+    PMX_EXECUTE_REQUEST pRequest = (PMX_EXECUTE_REQUEST)
+        ExAllocatePoolZero(NonPagedPoolNx, sizeof(MX_EXECUTE_REQUEST), '  xM');
+    if (pRequest == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    pRequest->CancelWorkItem = IoAllocateWorkItem(pDeviceObject);
+    if (pRequest->CancelWorkItem == NULL)
+    {
+        ExFreePoolWithTag(pRequest, '  xM');
+        return STATUS_NO_MEMORY;
+    }
+
+    pRequest->ReferenceCount = 2;
+    pRequest->Irp = pIrp;
+    pIrp->Tail.Overlay.DriverContext[0] = pRequest;
+
+    PMX_PROCESS pNewProcess;
+    NTSTATUS status = MxProcessExecute(
+        &strPath,
+        PsGetCurrentProcess(),
+        PsGetCurrentProcess(),
+        NULL,
+        (PMX_OUTPUT_RING)pIrpStack->FileObject->FsContext,
+        NULL,
+        NULL,
+        MX_EXECUTE_SUSPENDED,
+        NULL,
+        &pNewProcess
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        pRequest->ReferenceCount = 1;
+        MxExecuteRequestFree(pRequest);
+        return status;
+    }
+
+    ObReferenceObject(pNewProcess->Process);
+    pRequest->Process = pNewProcess->Process;
+
+    IoMarkIrpPending(pIrp);
+    IoSetCancelRoutine(pIrp, MxExecuteRequestCancel);
+
+    // Cancelled before the routine was set. It runs straight into its exit then.
+    if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL) != NULL)
+    {
+        InterlockedDecrement(&pRequest->ReferenceCount);
+        MxRoutines.TerminateProcess(pRequest->Process, STATUS_CANCELLED);
+    }
+
+    status = MxSessionStartProcess(pNewProcess, MxExecuteRequestComplete, pRequest);
+
+    if (!NT_SUCCESS(status))
+    {
+        // Never resumed, there is no exit to complete the request.
+        if (IoSetCancelRoutine(pIrp, NULL) != NULL)
+        {
+            MxExecuteRequestFree(pRequest);
+        }
+
+        MxRoutines.TerminateProcess(pRequest->Process, status);
+        MxProcessFree(pNewProcess);
+
+        pIrp->IoStatus.Status = status;
+        IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+        MxExecuteRequestFree(pRequest);
+    }
+
+    return STATUS_PENDING;
+}
+
+// Gives the caller a handle to a process it has just started, or terminates the process if
+// that fails, since nobody could wait for it then.
+static
+NTSTATUS
+MxControlDeviceReturnProcess(
+    _In_ PMX_PROCESS pMxProcess,
+    _Out_ PMX_EXECUTE_ASYNC_INFORMATION pOutInfo
+)
+{
+    // The same access NT hands out for Pico processes to everyone else.
+    HANDLE hdlProcess = NULL;
+    NTSTATUS status = ObOpenObjectByPointer(
+        pMxProcess->Process,
+        0,
+        NULL,
+        SYNCHRONIZE | PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_TERMINATE,
+        *PsProcessType,
+        UserMode,
+        &hdlProcess
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        MxRoutines.TerminateProcess(pMxProcess->Process, status);
+        return status;
+    }
+
+    pOutInfo->Process = hdlProcess;
+    pOutInfo->ProcessId = HandleToULong(PsGetProcessId(pMxProcess->Process));
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxControlDeviceIoctl(
+    _In_ PDEVICE_OBJECT pDeviceObject,
+    _Inout_ PIRP pIrp
+)
+{
     NTSTATUS status = STATUS_SUCCESS;
     pIrp->IoStatus.Information = 0;
 
@@ -142,6 +456,11 @@ MxControlDeviceIoctl(
                 PsGetCurrentProcess(),
                 PsGetCurrentProcess(),
                 NULL,
+                (PMX_OUTPUT_RING)pIrpStack->FileObject->FsContext,
+                NULL,
+                NULL,
+                0,
+                NULL,
                 &pNewProcess
             );
 
@@ -150,7 +469,8 @@ MxControlDeviceIoctl(
                 break;
             }
 
-            status = KeWaitForSingleObject(pNewProcess->Thread,
+            // Not the main thread, which can exit before the others.
+            status = KeWaitForSingleObject(pNewProcess->Process,
                 Executive, KernelMode, FALSE, NULL);
 
             NTSTATUS statusExecute = pNewProcess->ExitStatus;
@@ -168,9 +488,187 @@ MxControlDeviceIoctl(
             status = STATUS_SUCCESS;
         }
         break;
+        case IOCTL_MX_EXECUTE_ASYNC:
+        {
+            if (uInLen != sizeof(MX_EXECUTE_INFORMATION)
+                || uOutLen != sizeof(MX_EXECUTE_ASYNC_INFORMATION))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+                break;
+            }
+
+            PMX_EXECUTE_INFORMATION pInfo = (PMX_EXECUTE_INFORMATION)
+                pIrp->AssociatedIrp.SystemBuffer;
+
+            __try
+            {
+                ProbeForRead(pInfo->ExecutablePath.Buffer, pInfo->ExecutablePath.Length, 1);
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                status = STATUS_ACCESS_VIOLATION;
+                break;
+            }
+
+            PMX_PROCESS pNewProcess;
+            status = MxProcessExecute(
+                &pInfo->ExecutablePath,
+                PsGetCurrentProcess(),
+                PsGetCurrentProcess(),
+                NULL,
+                (PMX_OUTPUT_RING)pIrpStack->FileObject->FsContext,
+                NULL,
+                NULL,
+                0,
+                NULL,
+                &pNewProcess
+            );
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            status = MxControlDeviceReturnProcess(pNewProcess,
+                (PMX_EXECUTE_ASYNC_INFORMATION)pIrp->AssociatedIrp.SystemBuffer);
+            MxProcessFree(pNewProcess);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            pIrp->IoStatus.Information = sizeof(MX_EXECUTE_ASYNC_INFORMATION);
+        }
+        break;
+        case IOCTL_MX_RESTORE:
+        {
+            // Captured by the I/O manager, like the path of IOCTL_MX_EXECUTE_DIRECT.
+            if (uInLen == 0 || uInLen > UNICODE_STRING_MAX_BYTES || uInLen % sizeof(WCHAR) != 0
+                || uOutLen != sizeof(MX_EXECUTE_ASYNC_INFORMATION))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+                break;
+            }
+
+            UNICODE_STRING strPath
+            {
+                .Length = (USHORT)uInLen,
+                .MaximumLength = (USHORT)uInLen,
+                .Buffer = (PWCH)pIrp->AssociatedIrp.SystemBuffer
+            };
+
+            PMX_PROCESS pNewProcess;
+            status = MxProcessRestore(
+                &strPath,
+                PsGetCurrentProcess(),
+                PsGetCurrentProcess(),
+                (PMX_OUTPUT_RING)pIrpStack->FileObject->FsContext,
+                0,
+                &pNewProcess
+            );
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            // The path is not needed anymore, the output goes over it.
+            status = MxControlDeviceReturnProcess(pNewProcess,
+                (PMX_EXECUTE_ASYNC_INFORMATION)pIrp->AssociatedIrp.SystemBuffer);
+            MxProcessFree(pNewProcess);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            pIrp->IoStatus.Information = sizeof(MX_EXECUTE_ASYNC_INFORMATION);
+        }
+        break;
+        case IOCTL_MX_OUTPUT_RING:
+        {
+            if (uInLen != sizeof(MX_OUTPUT_RING_INFORMATION)
+                || uOutLen != sizeof(MX_OUTPUT_RING_INFORMATION))
+            {
+                status = STATUS_INVALID_BUFFER_SIZE;
+                break;
+            }
+
+            PMX_OUTPUT_RING_INFORMATION pInfo = (PMX_OUTPUT_RING_INFORMATION)
+                pIrp->AssociatedIrp.SystemBuffer;
+
+            PMX_OUTPUT_RING pRing = NULL;
+            PVOID pUserView = NULL;
+            status = MxOutputRingCreate(pInfo->Size, pInfo->Event, &pRing, &pUserView);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            // One ring per handle.
+            if (InterlockedCompareExchangePointer(
+                &pIrpStack->FileObject->FsContext, pRing, NULL) != NULL)
+            {
+                MxOutputRingFree(pRing);
+                ZwUnmapViewOfSection(ZwCurrentProcess(), pUserView);
+                status = STATUS_ALREADY_REGISTERED;
+                break;
+            }
+
+            pInfo->Ring = pUserView;
+
+            pIrp->IoStatus.Information = sizeof(MX_OUTPUT_RING_INFORMATION);
+        }
+        break;
+        case IOCTL_MX_QUERY_SYSCALL_STATISTICS:
+        {
+            if (uOutLen < sizeof(MX_SYSCALL_STATISTICS_INFORMATION))
+            {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            PMX_SYSCALL_STATISTICS_INFORMATION pInfo = (PMX_SYSCALL_STATISTICS_INFORMATION)
+                pIrp->AssociatedIrp.SystemBuffer;
+            PMX_SYSCALL_STATISTICS pEntries = (PMX_SYSCALL_STATISTICS)(pInfo + 1);
+
+            ULONG uCount = (ULONG)((uOutLen - sizeof(MX_SYSCALL_STATISTICS_INFORMATION))
+                / sizeof(MX_SYSCALL_STATISTICS));
+            ULONG uReturned = 0;
+            ULONG64 uUnknown = 0;
+            ULONG64 uHandledFaults = 0;
+
+            status = MxQuerySystemCallStatistics(pEntries, uCount, &uReturned, &uUnknown,
+                &uHandledFaults);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            pInfo->Unknown = uUnknown;
+            pInfo->HandledFaults = uHandledFaults;
+            pInfo->Count = uReturned;
+
+            pIrp->IoStatus.Information = sizeof(MX_SYSCALL_STATISTICS_INFORMATION)
+                + uReturned * sizeof(MX_SYSCALL_STATISTICS);
+        }
+        break;
+        case IOCTL_MX_EXECUTE_DIRECT:
+        {
+            status = MxControlDeviceExecuteDirect(pDeviceObject, pIrp);
+
+            // Completed on exit of the program.
+            if (status == STATUS_PENDING)
+            {
+                return status;
+            }
+        }
+        break;
         default:
-            DbgBreakPoint();
-            status = STATUS_NOT_IMPLEMENTED;
+            status = STATUS_INVALID_DEVICE_REQUEST;
         break;
     }
 
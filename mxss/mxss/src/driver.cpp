@@ -2,8 +2,15 @@
 
 #include <monika.h>
 
+#include "console.h"
 #include "device.h"
+#include "image.h"
+#include "pagecache.h"
+#include "process.h"
 #include "provider.h"
+#include "shared.h"
+#include "thread.h"
+#include "warmpool.h"
 
 extern "C"
 NTSTATUS
@@ -16,12 +23,89 @@ DriverEntry(
 
     NTSTATUS status = STATUS_SUCCESS;
 
+    status = MxInitializeSystemCallStatistics();
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    status = MxInitializeSharedPages();
+
+    if (!NT_SUCCESS(status))
+    {
+        MxCleanupSystemCallStatistics();
+        return status;
+    }
+
+    status = MxInitializeImageCache();
+
+    if (!NT_SUCCESS(status))
+    {
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
+        return status;
+    }
+
+    status = MxInitializePageCache();
+
+    if (!NT_SUCCESS(status))
+    {
+        MxCleanupImageCache();
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
+        return status;
+    }
+
+    status = MxInitializeProcessLookaside();
+
+    if (!NT_SUCCESS(status))
+    {
+        MxCleanupPageCache();
+        MxCleanupImageCache();
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
+        return status;
+    }
+
+    status = MxInitializeThreadLookaside();
+
+    if (!NT_SUCCESS(status))
+    {
+        MxCleanupProcessLookaside();
+        MxCleanupPageCache();
+        MxCleanupImageCache();
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
+        return status;
+    }
+
+    status = MxInitializeWarmPool();
+
+    if (!NT_SUCCESS(status))
+    {
+        MxCleanupThreadLookaside();
+        MxCleanupProcessLookaside();
+        MxCleanupPageCache();
+        MxCleanupImageCache();
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
+        return status;
+    }
+
     status = DeviceInit(DriverObject);
 
     if (!NT_SUCCESS(status))
     {
         KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
             "Failed to initialize control driver, status=%x\n", status));
+        MxCleanupWarmPool();
+        MxCleanupThreadLookaside();
+        MxCleanupProcessLookaside();
+        MxCleanupPageCache();
+        MxCleanupImageCache();
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
         return status;
     }
 
@@ -50,7 +134,9 @@ DriverEntry(
         .GetAllocatedProviderName = MxGetAllocatedProviderName,
         .StartSession = MxStartSession,
         .GetConsole = MxGetConsole,
-        .AbiVersion = NTDDI_WIN10_RS1
+        .AbiVersion = NTDDI_WIN10_RS1,
+        .StartSessionAsync = MxStartSessionAsync,
+        .SetWarmPoolSize = MxWarmPoolSetSize
     };
 
     MxAdditionalRoutines.Size = sizeof(MA_PICO_ROUTINES);
@@ -63,9 +149,18 @@ DriverEntry(
 
     if (!NT_SUCCESS(status))
     {
+        MxCleanupWarmPool();
+        MxCleanupThreadLookaside();
+        MxCleanupProcessLookaside();
+        MxCleanupPageCache();
+        MxCleanupImageCache();
+        MxCleanupSharedPages();
+        MxCleanupSystemCallStatistics();
         return status;
     }
 
+    CoInitializeWslTracking();
+
     DriverObject->DriverUnload = DriverUnload;
 
     return STATUS_SUCCESS;
@@ -78,6 +173,12 @@ DriverUnload(
 )
 {
     DeviceCleanup(DriverObject);
+    CoCleanupWslTracking();
+
+    // Pooled processes have no session to run for once the driver goes.
+    MxCleanupWarmPool();
 
     // TODO: Unregister Pico provider when such an API exists.
+    // Until then, Monix processes may still be around, so the statistics and the shared page
+    // updater have to stay too.
 }
@@ -0,0 +1,976 @@
+#include "file.h"
+
+#include <monika.h>
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+// A push lock rather than a fast mutex, files are opened and read through with it held.
+static
+PMX_FILE_TABLE
+MxFileTableLock(
+    _Inout_ PMX_FILE_TABLE pFileTable
+)
+{
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&pFileTable->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    return pFileTable;
+}
+
+static
+VOID
+MxFileTableUnlock(
+    _Inout_ PMX_FILE_TABLE pFileTable
+)
+{
+    ExReleasePushLockExclusiveEx(&pFileTable->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+static
+BOOLEAN
+MxFileIsOpen(
+    _In_ const MX_FILE* pFile
+)
+{
+    return pFile->Handle != NULL || pFile->OutputRing != NULL || pFile->Pipe != NULL;
+}
+
+NTSTATUS
+MxFileTableAllocate(
+    _Out_ PMX_FILE_TABLE* pPFileTable
+)
+{
+    PMX_FILE_TABLE pFileTable = (PMX_FILE_TABLE)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_FILE_TABLE), MX_POOL_TAG);
+
+    if (pFileTable == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    pFileTable->ReferenceCount = 1;
+    ExInitializePushLock(&pFileTable->Lock);
+
+    *pPFileTable = pFileTable;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileTableReference(
+    _Inout_ PMX_FILE_TABLE pFileTable
+)
+{
+    ULONG_PTR uNewCount = InterlockedIncrementSizeT(&pFileTable->ReferenceCount);
+
+    UNREFERENCED_PARAMETER(uNewCount);
+    ASSERT(uNewCount != 1);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxFileTableFree(
+    _Inout_ PMX_FILE_TABLE pFileTable
+)
+{
+    ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pFileTable->ReferenceCount);
+    ASSERT(uNewCount + 1 > uNewCount);
+
+    if (uNewCount != 0)
+    {
+        return;
+    }
+
+    for (SIZE_T i = 0; i < MX_FILE_TABLE_SIZE; ++i)
+    {
+        if (pFileTable->Files[i].Handle != NULL)
+        {
+            ZwClose(pFileTable->Files[i].Handle);
+        }
+
+        if (pFileTable->Files[i].ReadBuffer != NULL)
+        {
+            ExFreePoolWithTag(pFileTable->Files[i].ReadBuffer, MX_POOL_TAG);
+        }
+
+        if (pFileTable->Files[i].OutputRing != NULL)
+        {
+            MxOutputRingFree(pFileTable->Files[i].OutputRing);
+        }
+
+        if (pFileTable->Files[i].CachedFile != NULL)
+        {
+            MxCachedFileFree(pFileTable->Files[i].CachedFile);
+        }
+
+        if (pFileTable->Files[i].Pipe != NULL)
+        {
+            MxPipeCloseEnd(pFileTable->Files[i].Pipe,
+                (pFileTable->Files[i].Flags & MX_FILE_PIPE_WRITER) != 0);
+        }
+    }
+
+    if (pFileTable->RootDirectory != NULL)
+    {
+        ZwClose(pFileTable->RootDirectory);
+    }
+
+    ExFreePoolWithTag(pFileTable, MX_POOL_TAG);
+}
+
+NTSTATUS
+MxFileTableOpenConsole(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ PEPROCESS pHostProcess
+)
+{
+    HANDLE hdlConsole = NULL;
+    AUTO_RESOURCE(hdlConsole, ZwClose);
+    HANDLE hdlInput = NULL;
+    AUTO_RESOURCE(hdlInput, ZwClose);
+    HANDLE hdlOutput = NULL;
+    AUTO_RESOURCE(hdlOutput, ZwClose);
+    HANDLE hdlError = NULL;
+    AUTO_RESOURCE(hdlError, ZwClose);
+
+    // The console attachment itself is cached by lxmonika for the lifetime of the host.
+    MX_RETURN_IF_FAIL(MaUtilGetHostConsole(pHostProcess, &hdlConsole, &hdlInput, &hdlOutput));
+    MX_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(hdlOutput, &hdlError));
+
+    // A VT console moving to the start of the next line on "\n" already behaves like a Unix
+    // terminal. Sampled once here, the mode is not worth a condrv round trip on every write.
+    ULONG uFlags = 0;
+    ULONG uMode = 0;
+    if (NT_SUCCESS(MaUtilGetConsoleMode(hdlConsole, hdlOutput, &uMode))
+        && (uMode & MX_CONSOLE_VIRTUAL_TERMINAL_PROCESSING)
+        && !(uMode & MX_CONSOLE_DISABLE_NEWLINE_AUTO_RETURN))
+    {
+        uFlags |= MX_FILE_RAW;
+    }
+
+    pFileTable->Files[MX_FD_STDIN].Handle = hdlInput;
+    hdlInput = NULL;
+    pFileTable->Files[MX_FD_STDOUT].Handle = hdlOutput;
+    pFileTable->Files[MX_FD_STDOUT].Flags = uFlags;
+    hdlOutput = NULL;
+    pFileTable->Files[MX_FD_STDERR].Handle = hdlError;
+    pFileTable->Files[MX_FD_STDERR].Flags = uFlags;
+    hdlError = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileTableCopy(
+    _In_ PMX_FILE_TABLE pFileTable,
+    _Out_ PMX_FILE_TABLE* pPNewFileTable
+)
+{
+    PMX_FILE_TABLE pNewFileTable = NULL;
+    MX_RETURN_IF_FAIL(MxFileTableAllocate(&pNewFileTable));
+    AUTO_RESOURCE(pNewFileTable, MxFileTableFree);
+
+    // Other threads may be opening or closing files meanwhile.
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    if (pFileTable->RootDirectory != NULL)
+    {
+        MX_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(pFileTable->RootDirectory,
+            &pNewFileTable->RootDirectory));
+    }
+
+    // Like fork(2), the child gets its own descriptors referring to the same open files.
+    // Data already read ahead stays with the parent, the one that actually consumed it.
+    for (SIZE_T i = 0; i < MX_FILE_TABLE_SIZE; ++i)
+    {
+        if (pFileTable->Files[i].Handle != NULL)
+        {
+            MX_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(pFileTable->Files[i].Handle,
+                &pNewFileTable->Files[i].Handle));
+        }
+
+        if (pFileTable->Files[i].OutputRing != NULL)
+        {
+            MxOutputRingReference(pFileTable->Files[i].OutputRing);
+            pNewFileTable->Files[i].OutputRing = pFileTable->Files[i].OutputRing;
+        }
+
+        if (pFileTable->Files[i].CachedFile != NULL)
+        {
+            MxCachedFileReference(pFileTable->Files[i].CachedFile);
+            pNewFileTable->Files[i].CachedFile = pFileTable->Files[i].CachedFile;
+        }
+
+        if (pFileTable->Files[i].Pipe != NULL)
+        {
+            MxPipeOpenEnd(pFileTable->Files[i].Pipe,
+                (pFileTable->Files[i].Flags & MX_FILE_PIPE_WRITER) != 0);
+            pNewFileTable->Files[i].Pipe = pFileTable->Files[i].Pipe;
+        }
+
+        pNewFileTable->Files[i].Flags = pFileTable->Files[i].Flags;
+        pNewFileTable->Files[i].Offset = pFileTable->Files[i].Offset;
+    }
+
+    *pPNewFileTable = pNewFileTable;
+    pNewFileTable = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileTableAttachOutputRing(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ PMX_OUTPUT_RING pRing
+)
+{
+    // Standard error too, mxhost is the terminal.
+    const INT pFds[] = { MX_FD_STDOUT, MX_FD_STDERR };
+
+    for (INT fd : pFds)
+    {
+        if (pFileTable->Files[fd].OutputRing != NULL)
+        {
+            MxOutputRingFree(pFileTable->Files[fd].OutputRing);
+        }
+
+        MxOutputRingReference(pRing);
+        pFileTable->Files[fd].OutputRing = pRing;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileTableSetRoot(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ HANDLE hdlRoot
+)
+{
+    HANDLE hdlNewRoot = NULL;
+    MX_RETURN_IF_FAIL(MaUtilDuplicateKernelHandle(hdlRoot, &hdlNewRoot));
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    if (pFileTable->RootDirectory != NULL)
+    {
+        ZwClose(pFileTable->RootDirectory);
+    }
+
+    pFileTable->RootDirectory = hdlNewRoot;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileTableGet(
+    _In_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _Out_ PMX_FILE pFile
+)
+{
+    RtlZeroMemory(pFile, sizeof(MX_FILE));
+
+    if (fd < 0 || fd >= MX_FILE_TABLE_SIZE)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    if (!MxFileIsOpen(&pFileTable->Files[fd]))
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    *pFile = pFileTable->Files[fd];
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxFileAllocateReadBuffer(
+    _Inout_ PMX_FILE pFile
+)
+{
+    if (pFile->ReadBuffer == NULL)
+    {
+        pFile->ReadBuffer = (PCHAR)
+            ExAllocatePoolZero(PagedPool, MX_FILE_READ_BUFFER_SIZE, MX_POOL_TAG);
+
+        if (pFile->ReadBuffer == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// For files the page cache has turned down. Called with the table locked.
+static
+NTSTATUS
+MxFileReadThrough(
+    _Inout_ PMX_FILE pFile,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    MX_RETURN_IF_FAIL(MxFileAllocateReadBuffer(pFile));
+
+    IO_STATUS_BLOCK ioStatus;
+    ioStatus.Information = 0;
+
+    LARGE_INTEGER liOffset = { .QuadPart = (LONGLONG)pFile->Offset };
+
+    // Nothing is kept ahead, the next read may come after a seek.
+    NTSTATUS status = ZwReadFile(
+        pFile->Handle,
+        NULL,
+        NULL,
+        NULL,
+        &ioStatus,
+        pFile->ReadBuffer,
+        (ULONG)min(uSize, MX_FILE_READ_BUFFER_SIZE),
+        &liOffset,
+        NULL
+    );
+
+    if (status == STATUS_END_OF_FILE || (NT_SUCCESS(status) && ioStatus.Information == 0))
+    {
+        return STATUS_END_OF_FILE;
+    }
+
+    MX_RETURN_IF_FAIL(status);
+
+    __try
+    {
+        memcpy(pBuffer, pFile->ReadBuffer, ioStatus.Information);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    pFile->Offset += ioStatus.Information;
+    *pURead = ioStatus.Information;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxFileReadSeekable(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    PMX_CACHED_FILE pCachedFile = NULL;
+    AUTO_RESOURCE(pCachedFile, MxCachedFileFree);
+    ULONG64 uOffset = 0;
+
+    {
+        PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+        AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+        PMX_FILE pFile = &pFileTable->Files[fd];
+
+        if (!(pFile->Flags & MX_FILE_SEEKABLE))
+        {
+            return STATUS_INVALID_HANDLE;
+        }
+
+        if (pFile->CachedFile == NULL)
+        {
+            return MxFileReadThrough(pFile, pBuffer, uSize, pURead);
+        }
+
+        MxCachedFileReference(pFile->CachedFile);
+        pCachedFile = pFile->CachedFile;
+        uOffset = pFile->Offset;
+    }
+
+    // Copied without the lock, which may take a while for large reads of cold pages.
+    MX_RETURN_IF_FAIL(MxCachedFileRead(pCachedFile, uOffset, pBuffer, uSize, pURead));
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    // Unless the descriptor has been closed in the meantime. Threads reading the same
+    // descriptor at once may read the same data, as on Linux before 3.14.
+    if (pFileTable->Files[fd].CachedFile == pCachedFile)
+    {
+        pFileTable->Files[fd].Offset = uOffset + *pURead;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Pipes are used without the lock, so that other threads are not held up by blocked ones.
+static
+NTSTATUS
+MxFileReferencePipe(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _In_ ULONG uEnd,
+    _Out_ PMX_PIPE* pPPipe
+)
+{
+    *pPPipe = NULL;
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    PMX_FILE pFile = &pFileTable->Files[fd];
+
+    if (!(pFile->Flags & uEnd))
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    MxPipeReference(pFile->Pipe);
+    *pPPipe = pFile->Pipe;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxFileCopyOut(
+    _Out_writes_bytes_(uSize) PVOID pBuffer,
+    _In_reads_bytes_(uSize) const VOID* pSource,
+    _In_ SIZE_T uSize
+)
+{
+    __try
+    {
+        memcpy(pBuffer, pSource, uSize);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Puts back what the caller of a console read had no room for. Called with the table locked.
+static
+NTSTATUS
+MxFileReturnReadAhead(
+    _Inout_ PMX_FILE pFile,
+    _Inout_ PCHAR* pPReadBuffer,
+    _In_ ULONG uOffset,
+    _In_ ULONG uLength
+)
+{
+    if (pFile->ReadOffset == pFile->ReadLength)
+    {
+        if (pFile->ReadBuffer != NULL)
+        {
+            ExFreePoolWithTag(pFile->ReadBuffer, MX_POOL_TAG);
+        }
+
+        pFile->ReadBuffer = *pPReadBuffer;
+        *pPReadBuffer = NULL;
+        pFile->ReadOffset = uOffset;
+        pFile->ReadLength = uLength;
+
+        return STATUS_SUCCESS;
+    }
+
+    if (uOffset == uLength)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    // Another thread read the console meanwhile, and left some of it behind. Ours goes after
+    // that. The buffer is never made smaller than MX_FILE_READ_BUFFER_SIZE, it is filled again
+    // once drained.
+    ULONG uPending = pFile->ReadLength - pFile->ReadOffset;
+    ULONG uTotal = uPending + (uLength - uOffset);
+
+    PCHAR pMerged = (PCHAR)ExAllocatePoolZero(PagedPool, max(uTotal, MX_FILE_READ_BUFFER_SIZE),
+        MX_POOL_TAG);
+
+    if (pMerged == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    memcpy(pMerged, pFile->ReadBuffer + pFile->ReadOffset, uPending);
+    memcpy(pMerged + uPending, *pPReadBuffer + uOffset, uLength - uOffset);
+
+    ExFreePoolWithTag(pFile->ReadBuffer, MX_POOL_TAG);
+    pFile->ReadBuffer = pMerged;
+    pFile->ReadOffset = 0;
+    pFile->ReadLength = uTotal;
+
+    return STATUS_SUCCESS;
+}
+
+// Console reads block until something is typed, so the lock is not held across them. The
+// read-ahead buffer is taken out of the descriptor while it is being filled, and only looked at
+// with the lock held otherwise.
+static
+NTSTATUS
+MxFileReadConsole(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    PCHAR pReadBuffer = NULL;
+    AUTO_RESOURCE(pReadBuffer, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+    HANDLE hdlConsole = NULL;
+    ULONG uFlags = 0;
+
+    {
+        PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+        AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+        PMX_FILE pFile = &pFileTable->Files[fd];
+
+        // Output-only descriptors, like the write end of a pipe.
+        if (pFile->Handle == NULL
+            || (pFile->Flags & (MX_FILE_SEEKABLE | MX_FILE_PIPE_READER | MX_FILE_PIPE_WRITER)))
+        {
+            return STATUS_INVALID_HANDLE;
+        }
+
+        // Like a terminal, return what is there instead of blocking for the rest.
+        if (pFile->ReadOffset != pFile->ReadLength)
+        {
+            SIZE_T uCopy = min(uSize, (SIZE_T)(pFile->ReadLength - pFile->ReadOffset));
+            MX_RETURN_IF_FAIL(MxFileCopyOut(pBuffer, pFile->ReadBuffer + pFile->ReadOffset,
+                uCopy));
+
+            pFile->ReadOffset += (ULONG)uCopy;
+            *pURead = uCopy;
+
+            return STATUS_SUCCESS;
+        }
+
+        // MxFileClose leaves the console alone, so the handle outlives the lock.
+        hdlConsole = pFile->Handle;
+        uFlags = pFile->Flags;
+        pReadBuffer = pFile->ReadBuffer;
+        pFile->ReadBuffer = NULL;
+        pFile->ReadOffset = 0;
+        pFile->ReadLength = 0;
+    }
+
+    if (pReadBuffer == NULL)
+    {
+        pReadBuffer = (PCHAR)
+            ExAllocatePoolZero(PagedPool, MX_FILE_READ_BUFFER_SIZE, MX_POOL_TAG);
+
+        if (pReadBuffer == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    ULONG uLength = 0;
+
+    while (uLength == 0)
+    {
+        IO_STATUS_BLOCK ioStatus;
+        ioStatus.Information = 0;
+
+        NTSTATUS status = ZwReadFile(
+            hdlConsole,
+            NULL,
+            NULL,
+            NULL,
+            &ioStatus,
+            pReadBuffer,
+            MX_FILE_READ_BUFFER_SIZE,
+            NULL,
+            NULL
+        );
+
+        // Ctrl+Z on a console, or all writers of a pipe gone.
+        if (status == STATUS_END_OF_FILE || status == STATUS_PIPE_BROKEN
+            || (NT_SUCCESS(status) && ioStatus.Information == 0))
+        {
+            return STATUS_END_OF_FILE;
+        }
+
+        MX_RETURN_IF_FAIL(status);
+
+        uLength = (ULONG)ioStatus.Information;
+
+        if (!(uFlags & MX_FILE_RAW))
+        {
+            // Cooked console input ends lines with "\r\n".
+            ULONG uKept = 0;
+            for (ULONG i = 0; i < uLength; ++i)
+            {
+                if (pReadBuffer[i] == '\r' && i + 1 < uLength && pReadBuffer[i + 1] == '\n')
+                {
+                    continue;
+                }
+                pReadBuffer[uKept++] = pReadBuffer[i];
+            }
+            uLength = uKept;
+        }
+    }
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    SIZE_T uCopy = min(uSize, (SIZE_T)uLength);
+    NTSTATUS status = MxFileCopyOut(pBuffer, pReadBuffer, uCopy);
+
+    // Nothing is lost to a bad buffer, the next read gets it all.
+    if (!NT_SUCCESS(status))
+    {
+        uCopy = 0;
+    }
+
+    MX_RETURN_IF_FAIL(MxFileReturnReadAhead(&pFileTable->Files[fd], &pReadBuffer, (ULONG)uCopy,
+        uLength));
+    MX_RETURN_IF_FAIL(status);
+
+    *pURead = uCopy;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileRead(
+    _In_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    *pURead = 0;
+
+    // Other threads may close fd, and open something else there, at any time. Each path below
+    // checks the descriptor again with the table locked.
+    MX_FILE file;
+    MX_RETURN_IF_FAIL(MxFileTableGet(pFileTable, fd, &file));
+
+    if (uSize == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (file.Flags & MX_FILE_SEEKABLE)
+    {
+        return MxFileReadSeekable(pFileTable, fd, pBuffer, uSize, pURead);
+    }
+
+    if (file.Flags & MX_FILE_PIPE_READER)
+    {
+        PMX_PIPE pPipe = NULL;
+        MX_RETURN_IF_FAIL(MxFileReferencePipe(pFileTable, fd, MX_FILE_PIPE_READER, &pPipe));
+
+        NTSTATUS status = MxPipeRead(pPipe, pBuffer, uSize, pURead);
+        MxPipeFree(pPipe);
+
+        return status;
+    }
+
+    return MxFileReadConsole(pFileTable, fd, pBuffer, uSize, pURead);
+}
+
+NTSTATUS
+MxFileOpen(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ PCUNICODE_STRING pPath,
+    _Out_ PINT pFd
+)
+{
+    *pFd = -1;
+
+    // Only set up before the process first runs, so it cannot change under us.
+    if (pFileTable->RootDirectory == NULL)
+    {
+        return STATUS_OBJECT_PATH_NOT_FOUND;
+    }
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(
+        &objAttributes,
+        (PUNICODE_STRING)pPath,
+        OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE | OBJ_FORCE_ACCESS_CHECK,
+        pFileTable->RootDirectory,
+        NULL
+    );
+
+    // Checked against the caller, since links inside the root may still lead out of it.
+    HANDLE hdlFile = NULL;
+    IO_STATUS_BLOCK ioStatus;
+    MX_RETURN_IF_FAIL(ZwCreateFile(
+        &hdlFile,
+        FILE_GENERIC_READ,
+        &objAttributes,
+        &ioStatus,
+        NULL,
+        0,
+        FILE_SHARE_VALID_FLAGS,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+        NULL,
+        0
+    ));
+    AUTO_RESOURCE(hdlFile, ZwClose);
+
+    // Whatever the page cache turns down is read through the file system instead.
+    PMX_CACHED_FILE pCachedFile = NULL;
+    MxPageCacheGet(hdlFile, &pCachedFile);
+    AUTO_RESOURCE(pCachedFile, MxCachedFileFree);
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    INT fd = 0;
+    while (fd < MX_FILE_TABLE_SIZE && MxFileIsOpen(&pFileTable->Files[fd]))
+    {
+        ++fd;
+    }
+
+    if (fd == MX_FILE_TABLE_SIZE)
+    {
+        return STATUS_TOO_MANY_OPENED_FILES;
+    }
+
+    PMX_FILE pFile = &pFileTable->Files[fd];
+
+    // Flags first, so that the slot never looks like the console.
+    pFile->Flags = MX_FILE_SEEKABLE;
+    pFile->Offset = 0;
+    pFile->CachedFile = pCachedFile;
+    pCachedFile = NULL;
+    pFile->Handle = hdlFile;
+    hdlFile = NULL;
+
+    *pFd = fd;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileClose(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd
+)
+{
+    if (fd < 0 || fd >= MX_FILE_TABLE_SIZE)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    HANDLE hdlFile = NULL;
+    AUTO_RESOURCE(hdlFile, ZwClose);
+    PMX_CACHED_FILE pCachedFile = NULL;
+    AUTO_RESOURCE(pCachedFile, MxCachedFileFree);
+    PMX_PIPE pPipe = NULL;
+    BOOLEAN bPipeWriter = FALSE;
+
+    {
+        PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+        AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+        PMX_FILE pFile = &pFileTable->Files[fd];
+
+        if (!MxFileIsOpen(pFile))
+        {
+            return STATUS_INVALID_HANDLE;
+        }
+
+        // Reads and writes on the console use their descriptors without the lock, so those stay
+        // open for as long as the table.
+        if (!(pFile->Flags & (MX_FILE_SEEKABLE | MX_FILE_PIPE_READER | MX_FILE_PIPE_WRITER)))
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        // Released once the lock is. The read-ahead buffer stays with the slot for the next file.
+        hdlFile = pFile->Handle;
+        pFile->Handle = NULL;
+        pCachedFile = pFile->CachedFile;
+        pFile->CachedFile = NULL;
+        pPipe = pFile->Pipe;
+        pFile->Pipe = NULL;
+        bPipeWriter = (pFile->Flags & MX_FILE_PIPE_WRITER) != 0;
+        pFile->Flags = 0;
+        pFile->Offset = 0;
+    }
+
+    if (pPipe != NULL)
+    {
+        MxPipeCloseEnd(pPipe, bPipeWriter);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileSeek(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _In_ LONG64 iOffset,
+    _In_ INT iWhence,
+    _Out_ PULONG64 pUNewOffset
+)
+{
+    *pUNewOffset = 0;
+
+    if (fd < 0 || fd >= MX_FILE_TABLE_SIZE)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    PMX_FILE pFile = &pFileTable->Files[fd];
+
+    if (!(pFile->Flags & MX_FILE_SEEKABLE))
+    {
+        // ESPIPE, for the console as well.
+        return STATUS_INVALID_HANDLE;
+    }
+
+    LONG64 iBase = 0;
+
+    switch (iWhence)
+    {
+        case MX_SEEK_SET:
+            break;
+        case MX_SEEK_CUR:
+            iBase = (LONG64)pFile->Offset;
+            break;
+        case MX_SEEK_END:
+        {
+            if (pFile->CachedFile != NULL)
+            {
+                iBase = (LONG64)pFile->CachedFile->Size;
+                break;
+            }
+
+            IO_STATUS_BLOCK ioStatus;
+            FILE_STANDARD_INFORMATION fileInfo;
+            MX_RETURN_IF_FAIL(ZwQueryInformationFile(
+                pFile->Handle,
+                &ioStatus,
+                &fileInfo,
+                sizeof(fileInfo),
+                FileStandardInformation
+            ));
+
+            iBase = fileInfo.EndOfFile.QuadPart;
+        }
+        break;
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    // Past the end is fine, reads there just return nothing.
+    if ((iOffset > 0 && iBase > MAXLONG64 - iOffset) || iBase + iOffset < 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    pFile->Offset = (ULONG64)(iBase + iOffset);
+    *pUNewOffset = pFile->Offset;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileCreatePipe(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _Out_writes_(2) PINT pFds
+)
+{
+    pFds[0] = -1;
+    pFds[1] = -1;
+
+    PMX_PIPE pPipe = NULL;
+    MX_RETURN_IF_FAIL(MxPipeCreate(&pPipe));
+    AUTO_RESOURCE(pPipe, MxPipeFree);
+
+    PMX_FILE_TABLE pLockedTable = MxFileTableLock(pFileTable);
+    AUTO_RESOURCE(pLockedTable, MxFileTableUnlock);
+
+    INT pNewFds[2];
+    INT fd = 0;
+
+    for (INT i = 0; i < 2; ++i)
+    {
+        while (fd < MX_FILE_TABLE_SIZE && MxFileIsOpen(&pFileTable->Files[fd]))
+        {
+            ++fd;
+        }
+
+        if (fd == MX_FILE_TABLE_SIZE)
+        {
+            return STATUS_TOO_MANY_OPENED_FILES;
+        }
+
+        pNewFds[i] = fd++;
+    }
+
+    const ULONG pEnds[] = { MX_FILE_PIPE_READER, MX_FILE_PIPE_WRITER };
+
+    for (INT i = 0; i < 2; ++i)
+    {
+        PMX_FILE pFile = &pFileTable->Files[pNewFds[i]];
+
+        MxPipeOpenEnd(pPipe, pEnds[i] == MX_FILE_PIPE_WRITER);
+        pFile->Pipe = pPipe;
+        pFile->Flags = pEnds[i];
+        pFile->Offset = 0;
+
+        pFds[i] = pNewFds[i];
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxFileWritePipe(
+    _Inout_ PMX_FILE_TABLE pFileTable,
+    _In_ INT fd,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pUWritten
+)
+{
+    *pUWritten = 0;
+
+    if (fd < 0 || fd >= MX_FILE_TABLE_SIZE)
+    {
+        return STATUS_INVALID_HANDLE;
+    }
+
+    PMX_PIPE pPipe = NULL;
+    MX_RETURN_IF_FAIL(MxFileReferencePipe(pFileTable, fd, MX_FILE_PIPE_WRITER, &pPipe));
+    AUTO_RESOURCE(pPipe, MxPipeFree);
+
+    return MxPipeWrite(pPipe, pBuffer, uSize, pUWritten);
+}
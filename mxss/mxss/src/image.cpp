@@ -0,0 +1,526 @@
+#include "image.h"
+
+#include "os.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+// Stored in place of a large-page section that could not be created, so that it is not retried.
+#define MX_IMAGE_NO_LARGE_PAGES ((PVOID)(LONG_PTR)-1)
+
+// Most recently used first.
+static LIST_ENTRY MxImageCache;
+static ULONG MxImageCacheCount = 0;
+static FAST_MUTEX MxImageCacheLock;
+// Signaled by the memory manager while available memory is low.
+static PKEVENT MxLowMemoryEvent = NULL;
+
+extern "C"
+NTSTATUS
+MxImageQueryKey(
+    _In_ HANDLE hdlFile,
+    _Out_ PMX_IMAGE_KEY pKey
+)
+{
+    RtlZeroMemory(pKey, sizeof(*pKey));
+
+    IO_STATUS_BLOCK ioStatus;
+
+    MX_RETURN_IF_FAIL(ZwQueryInformationFile(
+        hdlFile,
+        &ioStatus,
+        &pKey->FileId,
+        sizeof(pKey->FileId),
+        FileIdInformation
+    ));
+
+    FILE_NETWORK_OPEN_INFORMATION fileInfo;
+    MX_RETURN_IF_FAIL(ZwQueryInformationFile(
+        hdlFile,
+        &ioStatus,
+        &fileInfo,
+        sizeof(fileInfo),
+        FileNetworkOpenInformation
+    ));
+
+    pKey->LastWriteTime = fileInfo.LastWriteTime;
+    pKey->EndOfFile = fileInfo.EndOfFile;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxImageRead(
+    _In_ HANDLE hdlFile,
+    _Out_writes_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uOffset,
+    _In_ SIZE_T uSize
+)
+{
+    IO_STATUS_BLOCK ioStatus;
+    SIZE_T uRead = 0;
+    LARGE_INTEGER liOffset;
+    while (uRead < uSize)
+    {
+        liOffset.QuadPart = uOffset + uRead;
+        MX_RETURN_IF_FAIL(ZwReadFile(
+            hdlFile,
+            NULL,
+            NULL,
+            NULL,
+            &ioStatus,
+            (PCHAR)pBuffer + uRead,
+            (ULONG)(uSize - uRead),
+            &liOffset,
+            NULL
+        ));
+        uRead += ioStatus.Information;
+    }
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxImageLoad(
+    _In_ HANDLE hdlFile,
+    _Out_ PMX_IMAGE* pPImage
+)
+{
+    *pPImage = NULL;
+
+    PMX_IMAGE pImage = (PMX_IMAGE)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_IMAGE), MX_POOL_TAG);
+    if (pImage == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    pImage->ReferenceCount = 1;
+    AUTO_RESOURCE(pImage, MxImageFree);
+
+    ElfW(Ehdr)& elfHeader = pImage->Header;
+    MX_RETURN_IF_FAIL(MxImageRead(hdlFile, &elfHeader, 0, sizeof(ElfW(Ehdr))));
+
+    if (!IS_ELF(elfHeader)
+        || (elfHeader.e_phentsize != sizeof(ElfW(Phdr)))
+        || elfHeader.e_phnum < 1
+        || elfHeader.e_type != ET_EXEC)
+    {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    SIZE_T szPhdrsCount = elfHeader.e_phnum;
+    SIZE_T szPhdrsBytes = sizeof(ElfW(Phdr)) * szPhdrsCount;
+
+    pImage->ProgramHeaders = (ElfW(Phdr)*)
+        ExAllocatePoolZero(PagedPool, szPhdrsBytes, MX_POOL_TAG);
+    if (pImage->ProgramHeaders == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    MX_RETURN_IF_FAIL(MxImageRead(hdlFile, pImage->ProgramHeaders, elfHeader.e_phoff,
+        szPhdrsBytes));
+
+    pImage->LargePageSections = (PVOID*)
+        ExAllocatePoolZero(PagedPool, sizeof(PVOID) * szPhdrsCount, MX_POOL_TAG);
+    if (pImage->LargePageSections == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    ElfW(Phdr)* pProgramHeaders = pImage->ProgramHeaders;
+
+    ElfW(Addr) pImageStartVm = (ElfW(Addr))-1;
+    ElfW(Addr) pImageEndVm = 0;
+
+    for (SIZE_T i = 0; i < szPhdrsCount; ++i)
+    {
+        if (pProgramHeaders[i].p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        if ((ALIGN_DOWN_BY(pProgramHeaders[i].p_offset, PAGE_SIZE)
+                != pProgramHeaders[i].p_offset)
+            && (ALIGN_DOWN_BY(pProgramHeaders[i].p_vaddr, PAGE_SIZE)
+                != pProgramHeaders[i].p_vaddr))
+        {
+            return STATUS_INVALID_IMAGE_FORMAT;
+        }
+
+        // TODO: Handle the alignment.
+
+        pImageStartVm = min(pImageStartVm, pProgramHeaders[i].p_vaddr);
+        pImageEndVm = max(pImageEndVm, pProgramHeaders[i].p_vaddr + pProgramHeaders[i].p_memsz);
+    }
+
+    pImage->Start = pImageStartVm;
+    pImage->End = pImageEndVm;
+
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        STANDARD_RIGHTS_REQUIRED
+            | SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY | SECTION_EXTEND_SIZE,
+        NULL,
+        NULL,
+        PAGE_EXECUTE_WRITECOPY,
+        SEC_COMMIT,
+        hdlFile
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY,
+        NULL,
+        KernelMode,
+        &pImage->Section,
+        NULL
+    ));
+
+    *pPImage = pImage;
+    pImage = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxImageCreateLargePages(
+    _In_ HANDLE hdlFile,
+    _In_ const ElfW(Phdr)& programHeader,
+    _In_ SIZE_T uSize,
+    _Out_ PVOID* pPSection
+)
+{
+    *pPSection = NULL;
+
+    LARGE_INTEGER liSize
+    {
+        .QuadPart = (LONGLONG)uSize
+    };
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    // Needs SeLockMemoryPrivilege, which kernel-mode callers always have.
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objAttributes,
+        &liSize,
+        PAGE_EXECUTE_READWRITE,
+        SEC_COMMIT | SEC_LARGE_PAGES,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PVOID pSection = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+    AUTO_RESOURCE(pSection, [](auto p) { ObDereferenceObject(p); });
+
+    PVOID pSystemView = NULL;
+    SIZE_T szSystemView = 0;
+    MX_RETURN_IF_FAIL(MmMapViewInSystemSpace(pSection, &pSystemView, &szSystemView));
+
+    NTSTATUS status = MxImageRead(hdlFile, pSystemView, programHeader.p_offset, uSize);
+    MmUnmapViewInSystemSpace(pSystemView);
+    MX_RETURN_IF_FAIL(status);
+
+    *pPSection = pSection;
+    pSection = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+// Takes the image out of the cache, and its reference along with it onto pFreeList.
+static
+VOID
+MxImageEvict(
+    _Inout_ PMX_IMAGE pImage,
+    _Inout_ PLIST_ENTRY pFreeList
+)
+{
+    RemoveEntryList(&pImage->Link);
+    --MxImageCacheCount;
+
+    InsertTailList(pFreeList, &pImage->Link);
+}
+
+static
+VOID
+MxImageFreeList(
+    _Inout_ PLIST_ENTRY pFreeList
+)
+{
+    while (!IsListEmpty(pFreeList))
+    {
+        PLIST_ENTRY pEntry = RemoveHeadList(pFreeList);
+        MxImageFree(CONTAINING_RECORD(pEntry, MX_IMAGE, Link));
+    }
+}
+
+NTSTATUS
+MxInitializeImageCache()
+{
+    InitializeListHead(&MxImageCache);
+    ExInitializeFastMutex(&MxImageCacheLock);
+
+    UNICODE_STRING strEventName = RTL_CONSTANT_STRING(L"\\KernelObjects\\LowMemoryCondition");
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, &strEventName, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlEvent = NULL;
+    if (NT_SUCCESS(ZwOpenEvent(&hdlEvent, SYNCHRONIZE, &objAttributes)))
+    {
+        // Without it, only the entry limit keeps the cache in check.
+        ObReferenceObjectByHandle(hdlEvent, SYNCHRONIZE, *ExEventObjectType, KernelMode,
+            (PVOID*)&MxLowMemoryEvent, NULL);
+        ZwClose(hdlEvent);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxCleanupImageCache()
+{
+    LIST_ENTRY freeList;
+    InitializeListHead(&freeList);
+
+    ExAcquireFastMutex(&MxImageCacheLock);
+    while (!IsListEmpty(&MxImageCache))
+    {
+        MxImageEvict(CONTAINING_RECORD(MxImageCache.Flink, MX_IMAGE, Link), &freeList);
+    }
+    ExReleaseFastMutex(&MxImageCacheLock);
+
+    MxImageFreeList(&freeList);
+
+    if (MxLowMemoryEvent != NULL)
+    {
+        ObDereferenceObject(MxLowMemoryEvent);
+        MxLowMemoryEvent = NULL;
+    }
+}
+
+NTSTATUS
+MxImageGet(
+    _In_ HANDLE hdlFile,
+    _Out_ PMX_IMAGE* pPImage
+)
+{
+    *pPImage = NULL;
+
+    MX_IMAGE_KEY key;
+    if (!NT_SUCCESS(MxImageQueryKey(hdlFile, &key)))
+    {
+        // No stable identity to key on, like on some network file systems.
+        return MxImageLoad(hdlFile, pPImage);
+    }
+
+    // Evicted images are only freed once the lock is released.
+    LIST_ENTRY freeList;
+    InitializeListHead(&freeList);
+    PLIST_ENTRY pFreeList = &freeList;
+    AUTO_RESOURCE(pFreeList, MxImageFreeList);
+
+    const auto Lookup = [&]() -> PMX_IMAGE
+    {
+        if (MxLowMemoryEvent != NULL && KeReadStateEvent(MxLowMemoryEvent))
+        {
+            while (!IsListEmpty(&MxImageCache))
+            {
+                MxImageEvict(CONTAINING_RECORD(MxImageCache.Flink, MX_IMAGE, Link), &freeList);
+            }
+        }
+
+        for (PLIST_ENTRY pEntry = MxImageCache.Flink; pEntry != &MxImageCache;
+            pEntry = pEntry->Flink)
+        {
+            PMX_IMAGE pImage = CONTAINING_RECORD(pEntry, MX_IMAGE, Link);
+
+            if (memcmp(&pImage->Key.FileId, &key.FileId, sizeof(key.FileId)) != 0)
+            {
+                continue;
+            }
+
+            if (pImage->Key.LastWriteTime.QuadPart != key.LastWriteTime.QuadPart
+                || pImage->Key.EndOfFile.QuadPart != key.EndOfFile.QuadPart)
+            {
+                // The file has changed since, this one will never be hit again.
+                MxImageEvict(pImage, &freeList);
+                return NULL;
+            }
+
+            InterlockedIncrementSizeT(&pImage->ReferenceCount);
+            RemoveEntryList(&pImage->Link);
+            InsertHeadList(&MxImageCache, &pImage->Link);
+            return pImage;
+        }
+
+        return NULL;
+    };
+
+    ExAcquireFastMutex(&MxImageCacheLock);
+    PMX_IMAGE pImage = Lookup();
+    ExReleaseFastMutex(&MxImageCacheLock);
+
+    if (pImage != NULL)
+    {
+        *pPImage = pImage;
+        return STATUS_SUCCESS;
+    }
+
+    MX_RETURN_IF_FAIL(MxImageLoad(hdlFile, &pImage));
+    pImage->Key = key;
+
+    ExAcquireFastMutex(&MxImageCacheLock);
+
+    // Someone else may have loaded the same file in the meantime.
+    PMX_IMAGE pExisting = Lookup();
+
+    if (pExisting == NULL)
+    {
+        // One reference for the cache, one for the caller.
+        InterlockedIncrementSizeT(&pImage->ReferenceCount);
+        InsertHeadList(&MxImageCache, &pImage->Link);
+        ++MxImageCacheCount;
+
+        if (MxImageCacheCount > MX_IMAGE_CACHE_MAX_ENTRIES)
+        {
+            MxImageEvict(CONTAINING_RECORD(MxImageCache.Blink, MX_IMAGE, Link), &freeList);
+        }
+    }
+
+    ExReleaseFastMutex(&MxImageCacheLock);
+
+    if (pExisting != NULL)
+    {
+        MxImageFree(pImage);
+        pImage = pExisting;
+    }
+
+    *pPImage = pImage;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxImageGetLargePages(
+    _In_ PMX_IMAGE pImage,
+    _In_ HANDLE hdlFile,
+    _In_ SIZE_T uIndex,
+    _Out_ PVOID* pPSection,
+    _Out_ PSIZE_T pSize
+)
+{
+    *pPSection = NULL;
+    *pSize = 0;
+
+    const ElfW(Phdr)& programHeader = pImage->ProgramHeaders[uIndex];
+    SIZE_T uSize = ALIGN_DOWN_BY(min(programHeader.p_filesz, programHeader.p_memsz),
+        MX_IMAGE_LARGE_PAGE_SIZE);
+
+    // Large pages cannot be reprotected or copied on write page by page.
+    if (programHeader.p_type != PT_LOAD
+        || (programHeader.p_flags & (PF_W | PF_X)) != PF_X
+        || uSize == 0
+        || ALIGN_DOWN_BY(programHeader.p_vaddr, MX_IMAGE_LARGE_PAGE_SIZE)
+            != programHeader.p_vaddr)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    PVOID pSection = InterlockedCompareExchangePointer(
+        &pImage->LargePageSections[uIndex], NULL, NULL);
+
+    if (pSection == NULL)
+    {
+        // Contiguous physical memory rarely becomes available later, so failures are final.
+        NTSTATUS status = MxImageCreateLargePages(hdlFile, programHeader, uSize, &pSection);
+        PVOID pCreated = NT_SUCCESS(status) ? pSection : MX_IMAGE_NO_LARGE_PAGES;
+
+        pSection = InterlockedCompareExchangePointer(
+            &pImage->LargePageSections[uIndex], pCreated, NULL);
+
+        if (pSection == NULL)
+        {
+            pSection = pCreated;
+        }
+        else if (pCreated != MX_IMAGE_NO_LARGE_PAGES)
+        {
+            // Someone else got there first.
+            ObDereferenceObject(pCreated);
+        }
+    }
+
+    if (pSection == MX_IMAGE_NO_LARGE_PAGES)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *pPSection = pSection;
+    *pSize = uSize;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxImageFree(
+    _In_ PMX_IMAGE pImage
+)
+{
+    ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pImage->ReferenceCount);
+    ASSERT(uNewCount + 1 > uNewCount);
+
+    if (uNewCount != 0)
+    {
+        return;
+    }
+
+    if (pImage->Section != NULL)
+    {
+        ObDereferenceObject(pImage->Section);
+    }
+
+    if (pImage->LargePageSections != NULL)
+    {
+        for (SIZE_T i = 0; i < pImage->Header.e_phnum; ++i)
+        {
+            PVOID pSection = pImage->LargePageSections[i];
+            if (pSection != NULL && pSection != MX_IMAGE_NO_LARGE_PAGES)
+            {
+                ObDereferenceObject(pSection);
+            }
+        }
+
+        ExFreePoolWithTag(pImage->LargePageSections, MX_POOL_TAG);
+    }
+
+    if (pImage->ProgramHeaders != NULL)
+    {
+        ExFreePoolWithTag(pImage->ProgramHeaders, MX_POOL_TAG);
+    }
+
+    ExFreePoolWithTag(pImage, MX_POOL_TAG);
+}
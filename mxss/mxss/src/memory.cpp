@@ -0,0 +1,994 @@
+#include "memory.h"
+
+#include "os.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+// A push lock rather than a fast mutex, the Zw memory calls must stay at PASSIVE_LEVEL.
+static
+PMX_MEMORY
+MxMemoryLock(
+    _Inout_ PMX_MEMORY pMemory
+)
+{
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&pMemory->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    return pMemory;
+}
+
+static
+VOID
+MxMemoryUnlock(
+    _Inout_ PMX_MEMORY pMemory
+)
+{
+    ExReleasePushLockExclusiveEx(&pMemory->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+static
+ULONG
+MxMemoryProtectionToWindows(
+    _In_ ULONG uProtection
+)
+{
+    // Copy-on-write, so that forked children get their own copies of the pages.
+    static const ULONG table[2][2][2] =
+    {
+        // Not executable
+        {
+            // Not writable
+            { PAGE_NOACCESS, PAGE_READONLY },
+            // Writable
+            { PAGE_WRITECOPY, PAGE_WRITECOPY }
+        },
+        // Executable
+        {
+            // Not writable
+            { PAGE_EXECUTE, PAGE_EXECUTE_READ },
+            // Writable
+            { PAGE_EXECUTE_WRITECOPY, PAGE_EXECUTE_WRITECOPY }
+        }
+    };
+
+    return table[(bool)(uProtection & MX_PROT_EXEC)][(bool)(uProtection & MX_PROT_WRITE)]
+        [(bool)(uProtection & MX_PROT_READ)];
+}
+
+// Reserves, but does not commit, a view of a new pagefile-backed section.
+static
+NTSTATUS
+MxMemoryReserve(
+    _In_ HANDLE hdlProcess,
+    _Inout_ PVOID* pBase,
+    _In_ SIZE_T uSize
+)
+{
+    LARGE_INTEGER liSize
+    {
+        .QuadPart = (LONGLONG)uSize
+    };
+
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        STANDARD_RIGHTS_REQUIRED
+            | SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+        NULL,
+        &liSize,
+        PAGE_EXECUTE_READWRITE,
+        SEC_RESERVE,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PVOID pRequested = *pBase;
+    SIZE_T szViewSize = uSize;
+    MX_RETURN_IF_FAIL(ZwMapViewOfSection(
+        hdlSection,
+        hdlProcess,
+        pBase,
+        0,
+        0,
+        NULL,
+        &szViewSize,
+        ViewShare,
+        MX_MEM_PICO,
+        PAGE_EXECUTE_READWRITE
+    ));
+
+    if (pRequested != NULL && *pBase != pRequested)
+    {
+        ZwUnmapViewOfSection(hdlProcess, *pBase);
+        *pBase = NULL;
+        return STATUS_CONFLICTING_ADDRESSES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Commits [uStart, uEnd) of pMapping.
+static
+NTSTATUS
+MxMemoryCommit(
+    _In_ HANDLE hdlProcess,
+    _In_ PMX_MAPPING pMapping,
+    _In_ ULONG_PTR uStart,
+    _In_ ULONG_PTR uEnd
+)
+{
+    PVOID pBase = (PVOID)uStart;
+    SIZE_T uSize = uEnd - uStart;
+
+    // Commits only take plain protections, copy-on-write is applied afterwards.
+    MX_RETURN_IF_FAIL(ZwAllocateVirtualMemory(
+        hdlProcess,
+        &pBase,
+        0,
+        &uSize,
+        MEM_COMMIT,
+        PAGE_READWRITE
+    ));
+
+    return ZwProtectVirtualMemory(
+        hdlProcess,
+        &pBase,
+        &uSize,
+        pMapping->Protect,
+        NULL
+    );
+}
+
+// Extends the committed part of the stack down to the page containing uAddress, and a chunk
+// more below it. The lowest committed page is always a guard page, except once the stack has
+// reached its limit. The lowest page of the reservation is never committed at all.
+static
+NTSTATUS
+MxMemoryGrowStack(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ HANDLE hdlProcess,
+    _In_ ULONG_PTR uAddress
+)
+{
+    PMX_MAPPING pStack = &pMemory->Stack;
+    ULONG_PTR uLimit = pStack->Base + PAGE_SIZE;
+    ULONG_PTR uPage = ALIGN_DOWN_BY(uAddress, PAGE_SIZE);
+
+    if (uPage < uLimit || uPage > pMemory->StackBottom)
+    {
+        return STATUS_STACK_OVERFLOW;
+    }
+
+    ULONG_PTR uNewBottom = (uPage - uLimit >= MX_MEMORY_COMMIT_CHUNK)
+        ? uPage - MX_MEMORY_COMMIT_CHUNK : uLimit;
+
+    if (uNewBottom < pMemory->StackBottom)
+    {
+        MX_RETURN_IF_FAIL(MxMemoryCommit(hdlProcess, pStack, uNewBottom, pMemory->StackBottom));
+    }
+
+    PVOID pBase = NULL;
+    SIZE_T uSize = 0;
+
+    // The old guard page, if it has not already been cleared by the fault itself.
+    if (pMemory->StackBottom < pStack->Base + pStack->Size)
+    {
+        pBase = (PVOID)pMemory->StackBottom;
+        uSize = PAGE_SIZE;
+        MX_RETURN_IF_FAIL(ZwProtectVirtualMemory(hdlProcess, &pBase, &uSize, pStack->Protect,
+            NULL));
+    }
+
+    pMemory->StackBottom = uNewBottom;
+
+    if (uNewBottom < uPage)
+    {
+        pBase = (PVOID)uNewBottom;
+        uSize = PAGE_SIZE;
+        MX_RETURN_IF_FAIL(ZwProtectVirtualMemory(hdlProcess, &pBase, &uSize,
+            pStack->Protect | PAGE_GUARD, NULL));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Returns the mapping containing uAddress, and the end of its usable part. Otherwise, returns
+// NULL and the start of the next mapping above uAddress, or 0 if there is none.
+static
+PMX_MAPPING
+MxMemoryFind(
+    _In_ PMX_MEMORY pMemory,
+    _In_ ULONG_PTR uAddress,
+    _Out_ PULONG_PTR pUEnd
+)
+{
+    if (uAddress >= pMemory->Break.Base && uAddress < pMemory->BreakCurrent)
+    {
+        *pUEnd = ALIGN_UP_BY(pMemory->BreakCurrent, PAGE_SIZE);
+        return &pMemory->Break;
+    }
+
+    ULONG_PTR uNext = MAXULONG_PTR;
+
+    if (pMemory->Break.Size != 0 && pMemory->Break.Base > uAddress)
+    {
+        uNext = pMemory->Break.Base;
+    }
+
+    for (PLIST_ENTRY pEntry = pMemory->Mappings.Flink; pEntry != &pMemory->Mappings;
+        pEntry = pEntry->Flink)
+    {
+        PMX_MAPPING pMapping = CONTAINING_RECORD(pEntry, MX_MAPPING, Link);
+
+        if (uAddress >= pMapping->Base && uAddress - pMapping->Base < pMapping->Size)
+        {
+            *pUEnd = pMapping->Base + pMapping->Size;
+            return pMapping;
+        }
+
+        if (pMapping->Base > uAddress)
+        {
+            uNext = min(uNext, pMapping->Base);
+        }
+    }
+
+    *pUEnd = (uNext == MAXULONG_PTR) ? 0 : uNext;
+    return NULL;
+}
+
+NTSTATUS
+MxMemoryAllocate(
+    _Out_ PMX_MEMORY* pPMemory
+)
+{
+    PMX_MEMORY pMemory = (PMX_MEMORY)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_MEMORY), MX_POOL_TAG);
+
+    if (pMemory == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    InitializeListHead(&pMemory->Mappings);
+    ExInitializePushLock(&pMemory->Lock);
+
+    *pPMemory = pMemory;
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxMemoryFree(
+    _In_ PMX_MEMORY pMemory
+)
+{
+    while (!IsListEmpty(&pMemory->Mappings))
+    {
+        PLIST_ENTRY pEntry = RemoveHeadList(&pMemory->Mappings);
+        ExFreePoolWithTag(CONTAINING_RECORD(pEntry, MX_MAPPING, Link), MX_POOL_TAG);
+    }
+
+    ExFreePoolWithTag(pMemory, MX_POOL_TAG);
+}
+
+NTSTATUS
+MxMemoryCopy(
+    _In_ PMX_MEMORY pMemory,
+    _Out_ PMX_MEMORY* pPNewMemory
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    PMX_MEMORY pNewMemory = NULL;
+    MX_RETURN_IF_FAIL(MxMemoryAllocate(&pNewMemory));
+    AUTO_RESOURCE(pNewMemory, MxMemoryFree);
+
+    for (PLIST_ENTRY pEntry = pMemory->Mappings.Flink; pEntry != &pMemory->Mappings;
+        pEntry = pEntry->Flink)
+    {
+        PMX_MAPPING pNewMapping = (PMX_MAPPING)
+            ExAllocatePoolZero(PagedPool, sizeof(MX_MAPPING), MX_POOL_TAG);
+
+        if (pNewMapping == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+
+        *pNewMapping = *CONTAINING_RECORD(pEntry, MX_MAPPING, Link);
+        InsertTailList(&pNewMemory->Mappings, &pNewMapping->Link);
+    }
+
+    pNewMemory->Break.Base = pMemory->Break.Base;
+    pNewMemory->Break.Size = pMemory->Break.Size;
+    pNewMemory->Break.Protect = pMemory->Break.Protect;
+    pNewMemory->BreakCurrent = pMemory->BreakCurrent;
+    pNewMemory->BreakCommitted = pMemory->BreakCommitted;
+    pNewMemory->Stack.Base = pMemory->Stack.Base;
+    pNewMemory->Stack.Size = pMemory->Stack.Size;
+    pNewMemory->Stack.Protect = pMemory->Stack.Protect;
+    pNewMemory->StackBottom = pMemory->StackBottom;
+
+    *pPNewMemory = pNewMemory;
+    pNewMemory = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxMemoryInitializeBreak(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ HANDLE hdlProcess,
+    _In_ ULONG_PTR uImageEnd
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    PVOID pBase = (PVOID)ALIGN_UP_BY(uImageEnd, PAGE_SIZE);
+    MX_RETURN_IF_FAIL(MxMemoryReserve(hdlProcess, &pBase, MX_MEMORY_BREAK_RESERVE));
+
+    pMemory->Break.Base = (ULONG_PTR)pBase;
+    pMemory->Break.Size = MX_MEMORY_BREAK_RESERVE;
+    pMemory->Break.Protect = MxMemoryProtectionToWindows(MX_PROT_READ | MX_PROT_WRITE);
+    pMemory->BreakCurrent = (ULONG_PTR)pBase;
+    pMemory->BreakCommitted = (ULONG_PTR)pBase;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxMemoryInitializeStack(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ HANDLE hdlProcess,
+    _Out_ PVOID* pStackTop
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    *pStackTop = NULL;
+
+    PVOID pBase = NULL;
+    MX_RETURN_IF_FAIL(MxMemoryReserve(hdlProcess, &pBase, MX_MEMORY_STACK_RESERVE));
+
+    ULONG_PTR uTop = (ULONG_PTR)pBase + MX_MEMORY_STACK_RESERVE;
+
+    pMemory->Stack.Base = (ULONG_PTR)pBase;
+    pMemory->Stack.Size = MX_MEMORY_STACK_RESERVE;
+    pMemory->Stack.Protect = MxMemoryProtectionToWindows(MX_PROT_READ | MX_PROT_WRITE);
+    pMemory->StackBottom = uTop;
+
+    // Just the top chunk, with the guard page below it.
+    NTSTATUS status = MxMemoryGrowStack(pMemory, hdlProcess, uTop - PAGE_SIZE);
+
+    if (!NT_SUCCESS(status))
+    {
+        ZwUnmapViewOfSection(hdlProcess, pBase);
+        RtlZeroMemory(&pMemory->Stack, sizeof(pMemory->Stack));
+        pMemory->StackBottom = 0;
+        return status;
+    }
+
+    *pStackTop = (PVOID)uTop;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxMemoryMap(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ HANDLE hdlProcess,
+    _In_opt_ PVOID pAddress,
+    _In_ SIZE_T uSize,
+    _In_ ULONG uProtection,
+    _In_ ULONG uFlags,
+    _Out_ PVOID* pMapped
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    *pMapped = NULL;
+
+    // Only private anonymous memory for now, there is nothing to share it with.
+    if (uSize == 0 || uSize > MAXULONG_PTR - PAGE_SIZE
+        || (uFlags & (MX_MAP_SHARED | MX_MAP_PRIVATE)) != MX_MAP_PRIVATE
+        || !(uFlags & MX_MAP_ANONYMOUS)
+        || (ULONG_PTR)pAddress != ALIGN_DOWN_BY((ULONG_PTR)pAddress, PAGE_SIZE)
+        || ((uFlags & MX_MAP_FIXED) && pAddress == NULL))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    uSize = ALIGN_UP_BY(uSize, PAGE_SIZE);
+
+    PMX_MAPPING pMapping = (PMX_MAPPING)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_MAPPING), MX_POOL_TAG);
+    if (pMapping == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pMapping, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    // Existing mappings are never replaced, MX_MAP_FIXED fails on a conflict instead.
+    PVOID pBase = pAddress;
+    NTSTATUS status = MxMemoryReserve(hdlProcess, &pBase, uSize);
+
+    if (!NT_SUCCESS(status) && pAddress != NULL && !(uFlags & MX_MAP_FIXED))
+    {
+        // Just a hint.
+        pBase = NULL;
+        status = MxMemoryReserve(hdlProcess, &pBase, uSize);
+    }
+
+    MX_RETURN_IF_FAIL(status);
+
+    pMapping->Base = (ULONG_PTR)pBase;
+    pMapping->Size = uSize;
+    pMapping->Protect = MxMemoryProtectionToWindows(uProtection);
+
+    InsertTailList(&pMemory->Mappings, &pMapping->Link);
+    pMapping = NULL;
+
+    *pMapped = pBase;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxMemoryUnmap(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ HANDLE hdlProcess,
+    _In_ PVOID pAddress,
+    _In_ SIZE_T uSize
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    ULONG_PTR uStart = (ULONG_PTR)pAddress;
+
+    if (uSize == 0 || uStart != ALIGN_DOWN_BY(uStart, PAGE_SIZE)
+        || uSize > MAXULONG_PTR - PAGE_SIZE - uStart)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG_PTR uEnd = uStart + ALIGN_UP_BY(uSize, PAGE_SIZE);
+
+    const auto Overlaps = [&](PMX_MAPPING pMapping)
+    {
+        return pMapping->Base < uEnd && uStart < pMapping->Base + pMapping->Size;
+    };
+
+    const auto Contains = [&](PMX_MAPPING pMapping)
+    {
+        return uStart <= pMapping->Base && pMapping->Base + pMapping->Size <= uEnd;
+    };
+
+    // Check everything first, so that a failed call leaves all mappings in place.
+    if (pMemory->Break.Size != 0 && Overlaps(&pMemory->Break))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (PLIST_ENTRY pEntry = pMemory->Mappings.Flink; pEntry != &pMemory->Mappings;
+        pEntry = pEntry->Flink)
+    {
+        PMX_MAPPING pMapping = CONTAINING_RECORD(pEntry, MX_MAPPING, Link);
+
+        if (Overlaps(pMapping) && !Contains(pMapping))
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+    }
+
+    // Like munmap(2), ranges with nothing mapped are fine.
+    PLIST_ENTRY pEntry = pMemory->Mappings.Flink;
+    while (pEntry != &pMemory->Mappings)
+    {
+        PMX_MAPPING pMapping = CONTAINING_RECORD(pEntry, MX_MAPPING, Link);
+        pEntry = pEntry->Flink;
+
+        if (Contains(pMapping))
+        {
+            ZwUnmapViewOfSection(hdlProcess, (PVOID)pMapping->Base);
+            RemoveEntryList(&pMapping->Link);
+            ExFreePoolWithTag(pMapping, MX_POOL_TAG);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxMemoryPrepareLocked(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ PVOID pAddress,
+    _In_ SIZE_T uSize
+)
+{
+    ULONG_PTR uStart = ALIGN_DOWN_BY((ULONG_PTR)pAddress, PAGE_SIZE);
+    ULONG_PTR uEnd = (ULONG_PTR)pAddress + uSize;
+
+    if (uEnd < uStart)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    // Buffers on the stack that have not been touched yet, deeper than the guard page.
+    if (pMemory->Stack.Size != 0 && uStart < pMemory->StackBottom
+        && uEnd > pMemory->Stack.Base)
+    {
+        MX_RETURN_IF_FAIL(MxMemoryGrowStack(pMemory, ZwCurrentProcess(),
+            max(uStart, pMemory->Stack.Base)));
+    }
+
+    while (uStart < uEnd)
+    {
+        ULONG_PTR uMappingEnd = 0;
+        PMX_MAPPING pMapping = MxMemoryFind(pMemory, uStart, &uMappingEnd);
+
+        if (pMapping == NULL)
+        {
+            if (uMappingEnd == 0)
+            {
+                break;
+            }
+
+            uStart = uMappingEnd;
+            continue;
+        }
+
+        ULONG_PTR uCommitEnd = min(uMappingEnd, ALIGN_UP_BY(uEnd, PAGE_SIZE));
+
+        MEMORY_BASIC_INFORMATION mbi;
+        MX_RETURN_IF_FAIL(ZwQueryVirtualMemory(ZwCurrentProcess(), (PVOID)uStart,
+            MemoryBasicInformation, &mbi, sizeof(mbi), NULL));
+
+        uCommitEnd = min(uCommitEnd, (ULONG_PTR)mbi.BaseAddress + mbi.RegionSize);
+
+        if (mbi.State == MEM_RESERVE)
+        {
+            MX_RETURN_IF_FAIL(MxMemoryCommit(ZwCurrentProcess(), pMapping, uStart, uCommitEnd));
+
+            if (pMapping == &pMemory->Break)
+            {
+                pMemory->BreakCommitted = max(pMemory->BreakCommitted, uCommitEnd);
+            }
+        }
+
+        uStart = uCommitEnd;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+ULONG_PTR
+MxMemorySetBreak(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ ULONG_PTR uBreak
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    if (pMemory->Break.Size == 0 || uBreak < pMemory->Break.Base
+        || uBreak - pMemory->Break.Base > pMemory->Break.Size)
+    {
+        return pMemory->BreakCurrent;
+    }
+
+    ULONG_PTR uOldBreak = pMemory->BreakCurrent;
+    pMemory->BreakCurrent = uBreak;
+
+    // Pages stay committed when the break shrinks, and must come back zeroed.
+    ULONG_PTR uDirtyEnd = min(uBreak, pMemory->BreakCommitted);
+
+    if (uDirtyEnd > uOldBreak)
+    {
+        NTSTATUS status = MxMemoryPrepareLocked(pMemory, (PVOID)uOldBreak,
+            uDirtyEnd - uOldBreak);
+
+        if (NT_SUCCESS(status))
+        {
+            __try
+            {
+                memset((PVOID)uOldBreak, 0, uDirtyEnd - uOldBreak);
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                status = STATUS_ACCESS_VIOLATION;
+            }
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            pMemory->BreakCurrent = uOldBreak;
+        }
+    }
+
+    return pMemory->BreakCurrent;
+}
+
+NTSTATUS
+MxMemoryPrepare(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ PVOID pAddress,
+    _In_ SIZE_T uSize
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    return MxMemoryPrepareLocked(pMemory, pAddress, uSize);
+}
+
+NTSTATUS
+MxMemoryHandleFault(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ ULONG_PTR uAddress,
+    _In_ ULONG_PTR uAccess
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    // The guard page itself, or something further down that skipped it.
+    if (pMemory->Stack.Size != 0 && uAddress >= pMemory->Stack.Base
+        && uAddress < pMemory->StackBottom + PAGE_SIZE)
+    {
+        return MxMemoryGrowStack(pMemory, ZwCurrentProcess(), uAddress);
+    }
+
+    ULONG_PTR uMappingEnd = 0;
+    PMX_MAPPING pMapping = MxMemoryFind(pMemory, uAddress, &uMappingEnd);
+
+    if (pMapping == NULL || pMapping->Protect == PAGE_NOACCESS)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    ULONG_PTR uStart = ALIGN_DOWN_BY(uAddress, PAGE_SIZE);
+
+    MEMORY_BASIC_INFORMATION mbi;
+    MX_RETURN_IF_FAIL(ZwQueryVirtualMemory(ZwCurrentProcess(), (PVOID)uStart,
+        MemoryBasicInformation, &mbi, sizeof(mbi), NULL));
+
+    if (mbi.State != MEM_RESERVE)
+    {
+        // Another thread may have committed it in the meantime. Otherwise, this is a real access
+        // violation, like a write to read-only memory.
+        ULONG uProtect = mbi.Protect & ~(PAGE_GUARD | PAGE_NOCACHE | PAGE_WRITECOMBINE);
+        BOOLEAN bAllowed;
+
+        switch (uAccess)
+        {
+            case MX_MEMORY_ACCESS_READ:
+                bAllowed = uProtect != PAGE_NOACCESS;
+                break;
+            case MX_MEMORY_ACCESS_WRITE:
+                bAllowed = uProtect == PAGE_READWRITE || uProtect == PAGE_WRITECOPY
+                    || uProtect == PAGE_EXECUTE_READWRITE || uProtect == PAGE_EXECUTE_WRITECOPY;
+                break;
+            case MX_MEMORY_ACCESS_EXECUTE:
+                bAllowed = uProtect == PAGE_EXECUTE || uProtect == PAGE_EXECUTE_READ
+                    || uProtect == PAGE_EXECUTE_READWRITE || uProtect == PAGE_EXECUTE_WRITECOPY;
+                break;
+            default:
+                bAllowed = FALSE;
+                break;
+        }
+
+        return (mbi.State == MEM_COMMIT && !(mbi.Protect & PAGE_GUARD) && bAllowed)
+            ? STATUS_SUCCESS : STATUS_ACCESS_VIOLATION;
+    }
+
+    // A few pages at once, programs rarely touch just one.
+    ULONG_PTR uEnd = min(uStart + MX_MEMORY_COMMIT_CHUNK,
+        min(uMappingEnd, (ULONG_PTR)mbi.BaseAddress + mbi.RegionSize));
+
+    MX_RETURN_IF_FAIL(MxMemoryCommit(ZwCurrentProcess(), pMapping, uStart, uEnd));
+
+    if (pMapping == &pMemory->Break)
+    {
+        pMemory->BreakCommitted = max(pMemory->BreakCommitted, uEnd);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Whether uProtect is one MxMemoryProtectionToWindows could have returned.
+static
+BOOLEAN
+MxMemoryIsKnownProtection(
+    _In_ ULONG uProtect
+)
+{
+    for (ULONG uProtection = 0; uProtection <= (MX_PROT_READ | MX_PROT_WRITE | MX_PROT_EXEC);
+        ++uProtection)
+    {
+        if (MxMemoryProtectionToWindows(uProtection) == uProtect)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Maps the data part of a restored region as a copy-on-write view of a checkpoint.
+static
+NTSTATUS
+MxMemoryMapData(
+    _In_ HANDLE hdlProcess,
+    _In_ const MX_MEMORY_REGION* pRegion,
+    _In_ HANDLE hdlSection,
+    _In_ ULONG64 uSectionOffset
+)
+{
+    PVOID pBase = (PVOID)pRegion->DataStart;
+    SIZE_T szViewSize = pRegion->DataEnd - pRegion->DataStart;
+    LARGE_INTEGER liSectionOffset
+    {
+        .QuadPart = (LONGLONG)uSectionOffset
+    };
+
+    MX_RETURN_IF_FAIL(ZwMapViewOfSection(
+        hdlSection,
+        hdlProcess,
+        &pBase,
+        0,
+        szViewSize,
+        &liSectionOffset,
+        &szViewSize,
+        ViewShare,
+        MX_MEM_PICO,
+        PAGE_EXECUTE_WRITECOPY
+    ));
+
+    NTSTATUS status = STATUS_CONFLICTING_ADDRESSES;
+
+    if (pBase == (PVOID)pRegion->DataStart)
+    {
+        PVOID pProtectBase = pBase;
+        status = ZwProtectVirtualMemory(hdlProcess, &pProtectBase, &szViewSize,
+            pRegion->Protect, NULL);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        ZwUnmapViewOfSection(hdlProcess, pBase);
+    }
+
+    return status;
+}
+
+NTSTATUS
+MxMemoryQueryRegions(
+    _In_ PMX_MEMORY pMemory,
+    _Out_writes_to_opt_(uCount, *pUCount) PMX_MEMORY_REGION pRegions,
+    _In_ ULONG uCount,
+    _Out_ PULONG pUCount
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    ULONG uFound = 0;
+
+    const auto Add = [&](const MX_MEMORY_REGION& region)
+    {
+        if (uFound < uCount && pRegions != NULL)
+        {
+            pRegions[uFound] = region;
+        }
+        ++uFound;
+    };
+
+    if (pMemory->Break.Size != 0)
+    {
+        Add(MX_MEMORY_REGION
+        {
+            .Kind = MX_MEMORY_REGION_BREAK,
+            .Protect = pMemory->Break.Protect,
+            .Base = pMemory->Break.Base,
+            .Size = pMemory->Break.Size,
+            .DataStart = pMemory->Break.Base,
+            .DataEnd = pMemory->BreakCommitted,
+            .Break = pMemory->BreakCurrent
+        });
+    }
+
+    if (pMemory->Stack.Size != 0)
+    {
+        Add(MX_MEMORY_REGION
+        {
+            .Kind = MX_MEMORY_REGION_STACK,
+            .Protect = pMemory->Stack.Protect,
+            .Base = pMemory->Stack.Base,
+            .Size = pMemory->Stack.Size,
+            .DataStart = pMemory->StackBottom,
+            .DataEnd = pMemory->Stack.Base + pMemory->Stack.Size
+        });
+    }
+
+    for (PLIST_ENTRY pEntry = pMemory->Mappings.Flink; pEntry != &pMemory->Mappings;
+        pEntry = pEntry->Flink)
+    {
+        PMX_MAPPING pMapping = CONTAINING_RECORD(pEntry, MX_MAPPING, Link);
+
+        Add(MX_MEMORY_REGION
+        {
+            .Kind = MX_MEMORY_REGION_MAPPING,
+            .Protect = pMapping->Protect,
+            .Base = pMapping->Base,
+            .Size = pMapping->Size,
+            .DataStart = pMapping->Base,
+            .DataEnd = pMapping->Base + pMapping->Size
+        });
+    }
+
+    *pUCount = uFound;
+    return (uFound > uCount) ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxMemoryRestoreRegion(
+    _Inout_ PMX_MEMORY pMemory,
+    _In_ HANDLE hdlProcess,
+    _In_ const MX_MEMORY_REGION* pRegion,
+    _In_opt_ HANDLE hdlSection,
+    _In_ ULONG64 uSectionOffset
+)
+{
+    PMX_MEMORY pLockedMemory = MxMemoryLock(pMemory);
+    AUTO_RESOURCE(pLockedMemory, MxMemoryUnlock);
+
+    ULONG_PTR uEnd = pRegion->Base + pRegion->Size;
+
+    // Regions come from a file, so nothing about them is taken for granted.
+    if (pRegion->Size == 0 || uEnd < pRegion->Base
+        || pRegion->Base != ALIGN_DOWN_BY(pRegion->Base, PAGE_SIZE)
+        || pRegion->Size != ALIGN_DOWN_BY(pRegion->Size, PAGE_SIZE)
+        || pRegion->DataStart != ALIGN_DOWN_BY(pRegion->DataStart, PAGE_SIZE)
+        || pRegion->DataEnd != ALIGN_DOWN_BY(pRegion->DataEnd, PAGE_SIZE)
+        || pRegion->DataStart < pRegion->Base || pRegion->DataEnd > uEnd
+        || pRegion->DataStart > pRegion->DataEnd
+        || (pRegion->DataEnd != pRegion->DataStart && hdlSection == NULL)
+        || !MxMemoryIsKnownProtection(pRegion->Protect))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Everything but the data part has to be one reservation, or the region could not be
+    // unmapped or committed the usual way afterwards.
+    switch (pRegion->Kind)
+    {
+        case MX_MEMORY_REGION_MAPPING:
+        {
+            if (pRegion->DataStart != pRegion->Base || pRegion->DataEnd != uEnd)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+        case MX_MEMORY_REGION_BREAK:
+        {
+            if (pMemory->Break.Size != 0 || pRegion->DataStart != pRegion->Base
+                || pRegion->Break < pRegion->Base || pRegion->Break > uEnd)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+        case MX_MEMORY_REGION_STACK:
+        {
+            if (pMemory->Stack.Size != 0 || pRegion->DataEnd != uEnd)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        break;
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    PMX_MAPPING pMapping = NULL;
+    AUTO_RESOURCE(pMapping, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    if (pRegion->Kind == MX_MEMORY_REGION_MAPPING)
+    {
+        pMapping = (PMX_MAPPING)ExAllocatePoolZero(PagedPool, sizeof(MX_MAPPING), MX_POOL_TAG);
+        if (pMapping == NULL)
+        {
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    if (pRegion->DataEnd != pRegion->DataStart)
+    {
+        MX_RETURN_IF_FAIL(MxMemoryMapData(hdlProcess, pRegion, hdlSection, uSectionOffset));
+    }
+
+    // The parts still to be committed, below the stack and above the break.
+    PVOID pReserveBase = NULL;
+    SIZE_T szReserveSize = 0;
+
+    if (pRegion->Kind == MX_MEMORY_REGION_BREAK)
+    {
+        pReserveBase = (PVOID)pRegion->DataEnd;
+        szReserveSize = uEnd - pRegion->DataEnd;
+    }
+    else if (pRegion->Kind == MX_MEMORY_REGION_STACK)
+    {
+        pReserveBase = (PVOID)pRegion->Base;
+        szReserveSize = pRegion->DataStart - pRegion->Base;
+    }
+
+    if (szReserveSize != 0)
+    {
+        NTSTATUS status = MxMemoryReserve(hdlProcess, &pReserveBase, szReserveSize);
+        if (!NT_SUCCESS(status))
+        {
+            if (pRegion->DataEnd != pRegion->DataStart)
+            {
+                ZwUnmapViewOfSection(hdlProcess, (PVOID)pRegion->DataStart);
+            }
+            return status;
+        }
+    }
+
+    switch (pRegion->Kind)
+    {
+        case MX_MEMORY_REGION_MAPPING:
+        {
+            pMapping->Base = pRegion->Base;
+            pMapping->Size = pRegion->Size;
+            pMapping->Protect = pRegion->Protect;
+
+            InsertTailList(&pMemory->Mappings, &pMapping->Link);
+            pMapping = NULL;
+        }
+        break;
+        case MX_MEMORY_REGION_BREAK:
+        {
+            pMemory->Break.Base = pRegion->Base;
+            pMemory->Break.Size = pRegion->Size;
+            pMemory->Break.Protect = pRegion->Protect;
+            pMemory->BreakCurrent = pRegion->Break;
+            pMemory->BreakCommitted = pRegion->DataEnd;
+        }
+        break;
+        case MX_MEMORY_REGION_STACK:
+        {
+            pMemory->Stack.Base = pRegion->Base;
+            pMemory->Stack.Size = pRegion->Size;
+            pMemory->Stack.Protect = pRegion->Protect;
+            pMemory->StackBottom = pRegion->DataStart;
+
+            // Put the guard page back, unless the stack had already reached its limit.
+            if (pRegion->DataStart != pRegion->DataEnd
+                && pRegion->DataStart > pRegion->Base + PAGE_SIZE)
+            {
+                PVOID pGuardBase = (PVOID)pRegion->DataStart;
+                SIZE_T szGuardSize = PAGE_SIZE;
+                ZwProtectVirtualMemory(hdlProcess, &pGuardBase, &szGuardSize,
+                    pRegion->Protect | PAGE_GUARD, NULL);
+            }
+        }
+        break;
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,333 @@
+#include "pagecache.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+// Most recently used first.
+static LIST_ENTRY MxPageCache;
+static ULONG MxPageCacheCount = 0;
+static SIZE_T MxPageCacheBytes = 0;
+static FAST_MUTEX MxPageCacheLock;
+// Signaled by the memory manager while available memory is low.
+static PKEVENT MxPageCacheLowMemoryEvent = NULL;
+
+static
+NTSTATUS
+MxPageCacheLoad(
+    _In_ HANDLE hdlFile,
+    _In_ const MX_IMAGE_KEY* pKey,
+    _Out_ PMX_CACHED_FILE* pPCachedFile
+)
+{
+    *pPCachedFile = NULL;
+
+    PMX_CACHED_FILE pCachedFile = (PMX_CACHED_FILE)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_CACHED_FILE), MX_POOL_TAG);
+    if (pCachedFile == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    pCachedFile->ReferenceCount = 1;
+    pCachedFile->Key = *pKey;
+    AUTO_RESOURCE(pCachedFile, MxCachedFileFree);
+
+    if (pKey->EndOfFile.QuadPart != 0)
+    {
+        OBJECT_ATTRIBUTES objAttributes;
+        InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+        HANDLE hdlSection = NULL;
+        MX_RETURN_IF_FAIL(ZwCreateSection(
+            &hdlSection,
+            SECTION_MAP_READ | SECTION_QUERY,
+            &objAttributes,
+            NULL,
+            PAGE_READONLY,
+            SEC_COMMIT,
+            hdlFile
+        ));
+        AUTO_RESOURCE(hdlSection, ZwClose);
+
+        MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+            hdlSection,
+            SECTION_MAP_READ | SECTION_QUERY,
+            NULL,
+            KernelMode,
+            &pCachedFile->Section,
+            NULL
+        ));
+
+        // Nothing is read yet, pages come in as the first reader touches them.
+        SIZE_T szView = 0;
+        MX_RETURN_IF_FAIL(MmMapViewInSystemSpace(pCachedFile->Section, &pCachedFile->View,
+            &szView));
+
+        pCachedFile->Size = (SIZE_T)pKey->EndOfFile.QuadPart;
+    }
+
+    *pPCachedFile = pCachedFile;
+    pCachedFile = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+// Takes the file out of the cache, and its reference along with it onto pFreeList.
+static
+VOID
+MxPageCacheEvict(
+    _Inout_ PMX_CACHED_FILE pCachedFile,
+    _Inout_ PLIST_ENTRY pFreeList
+)
+{
+    RemoveEntryList(&pCachedFile->Link);
+    --MxPageCacheCount;
+    MxPageCacheBytes -= pCachedFile->Size;
+
+    InsertTailList(pFreeList, &pCachedFile->Link);
+}
+
+static
+VOID
+MxPageCacheFreeList(
+    _Inout_ PLIST_ENTRY pFreeList
+)
+{
+    while (!IsListEmpty(pFreeList))
+    {
+        PLIST_ENTRY pEntry = RemoveHeadList(pFreeList);
+        MxCachedFileFree(CONTAINING_RECORD(pEntry, MX_CACHED_FILE, Link));
+    }
+}
+
+NTSTATUS
+MxInitializePageCache()
+{
+    InitializeListHead(&MxPageCache);
+    ExInitializeFastMutex(&MxPageCacheLock);
+
+    UNICODE_STRING strEventName = RTL_CONSTANT_STRING(L"\\KernelObjects\\LowMemoryCondition");
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, &strEventName, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlEvent = NULL;
+    if (NT_SUCCESS(ZwOpenEvent(&hdlEvent, SYNCHRONIZE, &objAttributes)))
+    {
+        // Without it, only the limits keep the cache in check.
+        ObReferenceObjectByHandle(hdlEvent, SYNCHRONIZE, *ExEventObjectType, KernelMode,
+            (PVOID*)&MxPageCacheLowMemoryEvent, NULL);
+        ZwClose(hdlEvent);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxCleanupPageCache()
+{
+    LIST_ENTRY freeList;
+    InitializeListHead(&freeList);
+
+    ExAcquireFastMutex(&MxPageCacheLock);
+    while (!IsListEmpty(&MxPageCache))
+    {
+        MxPageCacheEvict(CONTAINING_RECORD(MxPageCache.Flink, MX_CACHED_FILE, Link), &freeList);
+    }
+    ExReleaseFastMutex(&MxPageCacheLock);
+
+    MxPageCacheFreeList(&freeList);
+
+    if (MxPageCacheLowMemoryEvent != NULL)
+    {
+        ObDereferenceObject(MxPageCacheLowMemoryEvent);
+        MxPageCacheLowMemoryEvent = NULL;
+    }
+}
+
+NTSTATUS
+MxPageCacheGet(
+    _In_ HANDLE hdlFile,
+    _Out_ PMX_CACHED_FILE* pPCachedFile
+)
+{
+    *pPCachedFile = NULL;
+
+    // Unlike executables, files without a stable identity are not worth a private mapping.
+    MX_IMAGE_KEY key;
+    MX_RETURN_IF_FAIL(MxImageQueryKey(hdlFile, &key));
+
+    if (key.EndOfFile.QuadPart < 0 || key.EndOfFile.QuadPart > MX_PAGE_CACHE_MAX_FILE_SIZE)
+    {
+        return STATUS_FILE_TOO_LARGE;
+    }
+
+    // Evicted files are only unmapped once the lock is released.
+    LIST_ENTRY freeList;
+    InitializeListHead(&freeList);
+    PLIST_ENTRY pFreeList = &freeList;
+    AUTO_RESOURCE(pFreeList, MxPageCacheFreeList);
+
+    const auto Lookup = [&]() -> PMX_CACHED_FILE
+    {
+        if (MxPageCacheLowMemoryEvent != NULL && KeReadStateEvent(MxPageCacheLowMemoryEvent))
+        {
+            while (!IsListEmpty(&MxPageCache))
+            {
+                MxPageCacheEvict(CONTAINING_RECORD(MxPageCache.Flink, MX_CACHED_FILE, Link),
+                    &freeList);
+            }
+        }
+
+        for (PLIST_ENTRY pEntry = MxPageCache.Flink; pEntry != &MxPageCache;
+            pEntry = pEntry->Flink)
+        {
+            PMX_CACHED_FILE pCachedFile = CONTAINING_RECORD(pEntry, MX_CACHED_FILE, Link);
+
+            if (memcmp(&pCachedFile->Key.FileId, &key.FileId, sizeof(key.FileId)) != 0)
+            {
+                continue;
+            }
+
+            if (pCachedFile->Key.LastWriteTime.QuadPart != key.LastWriteTime.QuadPart
+                || pCachedFile->Key.EndOfFile.QuadPart != key.EndOfFile.QuadPart)
+            {
+                // The file has changed since, this one will never be hit again. Descriptors
+                // still holding it keep reading the old size.
+                MxPageCacheEvict(pCachedFile, &freeList);
+                return NULL;
+            }
+
+            InterlockedIncrementSizeT(&pCachedFile->ReferenceCount);
+            RemoveEntryList(&pCachedFile->Link);
+            InsertHeadList(&MxPageCache, &pCachedFile->Link);
+            return pCachedFile;
+        }
+
+        return NULL;
+    };
+
+    ExAcquireFastMutex(&MxPageCacheLock);
+    PMX_CACHED_FILE pCachedFile = Lookup();
+    ExReleaseFastMutex(&MxPageCacheLock);
+
+    if (pCachedFile != NULL)
+    {
+        *pPCachedFile = pCachedFile;
+        return STATUS_SUCCESS;
+    }
+
+    MX_RETURN_IF_FAIL(MxPageCacheLoad(hdlFile, &key, &pCachedFile));
+
+    ExAcquireFastMutex(&MxPageCacheLock);
+
+    // Someone else may have mapped the same file in the meantime.
+    PMX_CACHED_FILE pExisting = Lookup();
+
+    if (pExisting == NULL)
+    {
+        // One reference for the cache, one for the caller.
+        InterlockedIncrementSizeT(&pCachedFile->ReferenceCount);
+        InsertHeadList(&MxPageCache, &pCachedFile->Link);
+        ++MxPageCacheCount;
+        MxPageCacheBytes += pCachedFile->Size;
+
+        // Never the new file itself, it is at the head and no larger than the byte limit.
+        while (MxPageCacheCount > MX_PAGE_CACHE_MAX_ENTRIES
+            || MxPageCacheBytes > MX_PAGE_CACHE_MAX_BYTES)
+        {
+            MxPageCacheEvict(CONTAINING_RECORD(MxPageCache.Blink, MX_CACHED_FILE, Link),
+                &freeList);
+        }
+    }
+
+    ExReleaseFastMutex(&MxPageCacheLock);
+
+    if (pExisting != NULL)
+    {
+        MxCachedFileFree(pCachedFile);
+        pCachedFile = pExisting;
+    }
+
+    *pPCachedFile = pCachedFile;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxCachedFileRead(
+    _In_ PMX_CACHED_FILE pCachedFile,
+    _In_ ULONG64 uOffset,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    *pURead = 0;
+
+    if (uOffset >= pCachedFile->Size)
+    {
+        return STATUS_END_OF_FILE;
+    }
+
+    SIZE_T uCopy = min(uSize, pCachedFile->Size - (SIZE_T)uOffset);
+
+    // Faults on the view are paging I/O. Errors there, like a file truncated under us, surface
+    // as exceptions just like faults on the destination.
+    __try
+    {
+        memcpy(pBuffer, (PCHAR)pCachedFile->View + uOffset, uCopy);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    *pURead = uCopy;
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxCachedFileReference(
+    _Inout_ PMX_CACHED_FILE pCachedFile
+)
+{
+    ULONG_PTR uNewCount = InterlockedIncrementSizeT(&pCachedFile->ReferenceCount);
+
+    UNREFERENCED_PARAMETER(uNewCount);
+    ASSERT(uNewCount != 1);
+}
+
+VOID
+MxCachedFileFree(
+    _In_ PMX_CACHED_FILE pCachedFile
+)
+{
+    ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pCachedFile->ReferenceCount);
+    ASSERT(uNewCount + 1 > uNewCount);
+
+    if (uNewCount != 0)
+    {
+        return;
+    }
+
+    if (pCachedFile->View != NULL)
+    {
+        MmUnmapViewInSystemSpace(pCachedFile->View);
+    }
+
+    if (pCachedFile->Section != NULL)
+    {
+        ObDereferenceObject(pCachedFile->Section);
+    }
+
+    ExFreePoolWithTag(pCachedFile, MX_POOL_TAG);
+}
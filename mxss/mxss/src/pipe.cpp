@@ -0,0 +1,584 @@
+#include "pipe.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+static_assert((MX_PIPE_RING_SIZE & (MX_PIPE_RING_SIZE - 1)) == 0,
+    "MX_PIPE_RING_SIZE must be a power of two");
+
+static
+VOID
+MxPipeLock(
+    _Inout_ PMX_PIPE pPipe
+)
+{
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&pPipe->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+}
+
+static
+VOID
+MxPipeUnlock(
+    _Inout_ PMX_PIPE pPipe
+)
+{
+    ExReleasePushLockExclusiveEx(&pPipe->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+// Called with the pipe unlocked, but inside the critical region entered by MxPipeRead and
+// MxPipeWrite. Termination cannot take the thread in the middle of a wait there, with a loan
+// posted or a reference held, so it is polled for instead.
+static
+NTSTATUS
+MxPipeWait(
+    _In_ PKEVENT pEvent
+)
+{
+    LARGE_INTEGER liTimeout = { .QuadPart = -10 * 1000 * MX_PIPE_WAIT_POLL_INTERVAL };
+
+    while (TRUE)
+    {
+        if (PsIsThreadTerminating(PsGetCurrentThread()))
+        {
+            return STATUS_THREAD_IS_TERMINATING;
+        }
+
+        NTSTATUS status = KeWaitForSingleObject(pEvent, Executive, KernelMode, FALSE,
+            &liTimeout);
+
+        if (status != STATUS_TIMEOUT)
+        {
+            return status;
+        }
+    }
+}
+
+// Either side may be user memory.
+static
+NTSTATUS
+MxPipeCopy(
+    _Out_writes_bytes_(uSize) PVOID pDestination,
+    _In_reads_bytes_(uSize) const VOID* pSource,
+    _In_ SIZE_T uSize
+)
+{
+    __try
+    {
+        memcpy(pDestination, pSource, uSize);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_ACCESS_VIOLATION;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// The lock is never held while checking the user side, and the copies under it only have a
+// page gone or protected to deal with.
+static
+NTSTATUS
+MxPipeProbe(
+    _In_ PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _In_ BOOLEAN bWrite
+)
+{
+    __try
+    {
+        if (bWrite)
+        {
+            ProbeForWrite(pBuffer, uSize, 1);
+        }
+        else
+        {
+            ProbeForRead(pBuffer, uSize, 1);
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return GetExceptionCode();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxPipeCopyToRing(
+    _Inout_ PMX_PIPE pPipe,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize
+)
+{
+    SIZE_T uIndex = (SIZE_T)(pPipe->Head & (MX_PIPE_RING_SIZE - 1));
+    SIZE_T uFirst = min(uSize, MX_PIPE_RING_SIZE - uIndex);
+
+    MX_RETURN_IF_FAIL(MxPipeCopy(pPipe->Ring + uIndex, pBuffer, uFirst));
+    MX_RETURN_IF_FAIL(MxPipeCopy(pPipe->Ring, (PCHAR)pBuffer + uFirst, uSize - uFirst));
+
+    pPipe->Head += uSize;
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxPipeCopyFromRing(
+    _Inout_ PMX_PIPE pPipe,
+    _Out_writes_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize
+)
+{
+    SIZE_T uIndex = (SIZE_T)(pPipe->Tail & (MX_PIPE_RING_SIZE - 1));
+    SIZE_T uFirst = min(uSize, MX_PIPE_RING_SIZE - uIndex);
+
+    MX_RETURN_IF_FAIL(MxPipeCopy(pBuffer, pPipe->Ring + uIndex, uFirst));
+    MX_RETURN_IF_FAIL(MxPipeCopy((PCHAR)pBuffer + uFirst, pPipe->Ring, uSize - uFirst));
+
+    pPipe->Tail += uSize;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxPipeCreate(
+    _Out_ PMX_PIPE* pPPipe
+)
+{
+    *pPPipe = NULL;
+
+    // Nonpaged for the events.
+    PMX_PIPE pPipe = (PMX_PIPE)
+        ExAllocatePoolZero(NonPagedPoolNx, sizeof(MX_PIPE), MX_POOL_TAG);
+
+    if (pPipe == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    pPipe->Ring = (PCHAR)ExAllocatePoolZero(PagedPool, MX_PIPE_RING_SIZE, MX_POOL_TAG);
+
+    if (pPipe->Ring == NULL)
+    {
+        ExFreePoolWithTag(pPipe, MX_POOL_TAG);
+        return STATUS_NO_MEMORY;
+    }
+
+    pPipe->ReferenceCount = 1;
+    ExInitializePushLock(&pPipe->Lock);
+    KeInitializeEvent(&pPipe->Readable, NotificationEvent, FALSE);
+    KeInitializeEvent(&pPipe->Writable, NotificationEvent, TRUE);
+    KeInitializeEvent(&pPipe->LoanDone, NotificationEvent, FALSE);
+
+    *pPPipe = pPipe;
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxPipeReference(
+    _Inout_ PMX_PIPE pPipe
+)
+{
+    ULONG_PTR uNewCount = InterlockedIncrementSizeT(&pPipe->ReferenceCount);
+
+    UNREFERENCED_PARAMETER(uNewCount);
+    ASSERT(uNewCount != 1);
+}
+
+VOID
+MxPipeFree(
+    _In_ PMX_PIPE pPipe
+)
+{
+    ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pPipe->ReferenceCount);
+    ASSERT(uNewCount + 1 > uNewCount);
+
+    if (uNewCount != 0)
+    {
+        return;
+    }
+
+    // Loans only live as long as a write, which holds a reference.
+    ASSERT(pPipe->Loan == NULL);
+
+    ExFreePoolWithTag(pPipe->Ring, MX_POOL_TAG);
+    ExFreePoolWithTag(pPipe, MX_POOL_TAG);
+}
+
+VOID
+MxPipeOpenEnd(
+    _Inout_ PMX_PIPE pPipe,
+    _In_ BOOLEAN bWriter
+)
+{
+    MxPipeReference(pPipe);
+
+    MxPipeLock(pPipe);
+
+    if (bWriter)
+    {
+        ++pPipe->Writers;
+    }
+    else
+    {
+        ++pPipe->Readers;
+    }
+
+    MxPipeUnlock(pPipe);
+}
+
+VOID
+MxPipeCloseEnd(
+    _Inout_ PMX_PIPE pPipe,
+    _In_ BOOLEAN bWriter
+)
+{
+    MxPipeLock(pPipe);
+
+    if (bWriter)
+    {
+        ASSERT(pPipe->Writers != 0);
+
+        if (--pPipe->Writers == 0)
+        {
+            KeSetEvent(&pPipe->Readable, IO_NO_INCREMENT, FALSE);
+        }
+    }
+    else
+    {
+        ASSERT(pPipe->Readers != 0);
+
+        // Wakes writers waiting for room as well as those waiting on their loan.
+        if (--pPipe->Readers == 0)
+        {
+            KeSetEvent(&pPipe->Writable, IO_NO_INCREMENT, FALSE);
+            KeSetEvent(&pPipe->LoanDone, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    MxPipeUnlock(pPipe);
+
+    MxPipeFree(pPipe);
+}
+
+static
+NTSTATUS
+MxPipeReadInCriticalRegion(
+    _Inout_ PMX_PIPE pPipe,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    MxPipeLock(pPipe);
+
+    while (pPipe->Head == pPipe->Tail && pPipe->Loan == NULL)
+    {
+        if (pPipe->Writers == 0)
+        {
+            MxPipeUnlock(pPipe);
+            return STATUS_END_OF_FILE;
+        }
+
+        KeClearEvent(&pPipe->Readable);
+        MxPipeUnlock(pPipe);
+
+        MX_RETURN_IF_FAIL(MxPipeWait(&pPipe->Readable));
+
+        MxPipeLock(pPipe);
+    }
+
+    // What is in the ring was written before the loan.
+    SIZE_T uRing = (SIZE_T)min(pPipe->Head - pPipe->Tail, (ULONG64)uSize);
+    NTSTATUS status = MxPipeCopyFromRing(pPipe, pBuffer, uRing);
+
+    if (NT_SUCCESS(status))
+    {
+        *pURead = uRing;
+    }
+
+    PMX_PIPE_LOAN pLoan = pPipe->Loan;
+
+    if (NT_SUCCESS(status) && pLoan != NULL && *pURead < uSize)
+    {
+        // The only copy of these bytes, straight from the pages of the writer.
+        SIZE_T uLoan = min(pLoan->Size - pLoan->Taken, uSize - *pURead);
+        status = MxPipeCopy((PCHAR)pBuffer + *pURead, pLoan->Buffer + pLoan->Taken, uLoan);
+
+        if (NT_SUCCESS(status))
+        {
+            pLoan->Taken += uLoan;
+            *pURead += uLoan;
+
+            if (pLoan->Taken == pLoan->Size)
+            {
+                pPipe->Loan = NULL;
+                KeSetEvent(&pPipe->LoanDone, IO_NO_INCREMENT, FALSE);
+            }
+        }
+    }
+
+    if (*pURead != 0)
+    {
+        KeSetEvent(&pPipe->Writable, IO_NO_INCREMENT, FALSE);
+        // Whatever came before the fault is still handed out.
+        status = STATUS_SUCCESS;
+    }
+
+    MxPipeUnlock(pPipe);
+
+    return status;
+}
+
+NTSTATUS
+MxPipeRead(
+    _Inout_ PMX_PIPE pPipe,
+    _Out_writes_bytes_to_(uSize, *pURead) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pURead
+)
+{
+    *pURead = 0;
+
+    MX_RETURN_IF_FAIL(MxPipeProbe(pBuffer, uSize, TRUE));
+
+    KeEnterCriticalRegion();
+    NTSTATUS status = MxPipeReadInCriticalRegion(pPipe, pBuffer, uSize, pURead);
+    KeLeaveCriticalRegion();
+
+    return status;
+}
+
+static
+NTSTATUS
+MxPipeWriteRing(
+    _Inout_ PMX_PIPE pPipe,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pUWritten
+)
+{
+    *pUWritten = 0;
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    MxPipeLock(pPipe);
+
+    while (*pUWritten < uSize)
+    {
+        if (pPipe->Readers == 0)
+        {
+            status = STATUS_PIPE_BROKEN;
+            break;
+        }
+
+        SIZE_T uSpace = MX_PIPE_RING_SIZE - (SIZE_T)(pPipe->Head - pPipe->Tail);
+
+        if (pPipe->Loan != NULL || uSpace == 0)
+        {
+            KeClearEvent(&pPipe->Writable);
+            MxPipeUnlock(pPipe);
+
+            status = MxPipeWait(&pPipe->Writable);
+
+            MxPipeLock(pPipe);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        SIZE_T uCopy = min(uSpace, uSize - *pUWritten);
+        status = MxPipeCopyToRing(pPipe, (PCHAR)pBuffer + *pUWritten, uCopy);
+
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        *pUWritten += uCopy;
+        KeSetEvent(&pPipe->Readable, IO_NO_INCREMENT, FALSE);
+    }
+
+    MxPipeUnlock(pPipe);
+
+    return status;
+}
+
+static
+NTSTATUS
+MxPipeLockPages(
+    _Inout_ PMDL pMdl
+)
+{
+    __try
+    {
+        MmProbeAndLockPages(pMdl, UserMode, IoReadAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return GetExceptionCode();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Posts the pages of a large write for readers to copy from, and waits until they have.
+static
+NTSTATUS
+MxPipeLend(
+    _Inout_ PMX_PIPE pPipe,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pUTaken
+)
+{
+    *pUTaken = 0;
+
+    PMDL pMdl = IoAllocateMdl(pBuffer, (ULONG)uSize, FALSE, FALSE, NULL);
+
+    if (pMdl == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    NTSTATUS status = MxPipeLockPages(pMdl);
+
+    if (!NT_SUCCESS(status))
+    {
+        IoFreeMdl(pMdl);
+        return status;
+    }
+
+    // Mapped once here, readers in other processes cannot see the user address.
+    PCHAR pSystemBuffer = (PCHAR)MmGetSystemAddressForMdlSafe(pMdl,
+        NormalPagePriority | MdlMappingNoExecute);
+
+    if (pSystemBuffer == NULL)
+    {
+        MmUnlockPages(pMdl);
+        IoFreeMdl(pMdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    MX_PIPE_LOAN loan
+    {
+        .Buffer = pSystemBuffer,
+        .Size = uSize,
+        .Taken = 0
+    };
+
+    MxPipeLock(pPipe);
+
+    while (pPipe->Loan != NULL && pPipe->Readers != 0)
+    {
+        KeClearEvent(&pPipe->Writable);
+        MxPipeUnlock(pPipe);
+
+        status = MxPipeWait(&pPipe->Writable);
+
+        MxPipeLock(pPipe);
+
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+    }
+
+    if (NT_SUCCESS(status) && pPipe->Readers == 0)
+    {
+        status = STATUS_PIPE_BROKEN;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        pPipe->Loan = &loan;
+        KeSetEvent(&pPipe->Readable, IO_NO_INCREMENT, FALSE);
+
+        while (pPipe->Loan == &loan && pPipe->Readers != 0)
+        {
+            KeClearEvent(&pPipe->LoanDone);
+            MxPipeUnlock(pPipe);
+
+            status = MxPipeWait(&pPipe->LoanDone);
+
+            MxPipeLock(pPipe);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+        }
+
+        // Taken back if the readers left or we are going away. Readers only copy from it with
+        // the lock held, so nobody touches the pages once it is off the pipe.
+        if (pPipe->Loan == &loan)
+        {
+            pPipe->Loan = NULL;
+            KeSetEvent(&pPipe->Writable, IO_NO_INCREMENT, FALSE);
+
+            if (NT_SUCCESS(status))
+            {
+                status = STATUS_PIPE_BROKEN;
+            }
+        }
+    }
+
+    MxPipeUnlock(pPipe);
+
+    MmUnlockPages(pMdl);
+    IoFreeMdl(pMdl);
+
+    *pUTaken = loan.Taken;
+    return status;
+}
+
+NTSTATUS
+MxPipeWrite(
+    _Inout_ PMX_PIPE pPipe,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pUWritten
+)
+{
+    *pUWritten = 0;
+
+    MX_RETURN_IF_FAIL(MxPipeProbe(pBuffer, uSize, FALSE));
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    KeEnterCriticalRegion();
+
+    while (*pUWritten < uSize && NT_SUCCESS(status))
+    {
+        PCHAR pCurrent = (PCHAR)pBuffer + *pUWritten;
+        SIZE_T uLeft = uSize - *pUWritten;
+        SIZE_T uDone = 0;
+
+        if (uLeft >= MX_PIPE_LOAN_THRESHOLD)
+        {
+            status = MxPipeLend(pPipe, pCurrent, min(uLeft, MX_PIPE_LOAN_MAX), &uDone);
+        }
+        else
+        {
+            status = MxPipeWriteRing(pPipe, pCurrent, uLeft, &uDone);
+        }
+
+        *pUWritten += uDone;
+    }
+
+    KeLeaveCriticalRegion();
+
+    return status;
+}
@@ -1,18 +1,17 @@
 #include "process.h"
 
 #include "elf.h"
+#include "file.h"
+#include "image.h"
+#include "memory.h"
 #include "os.h"
 #include "provider.h"
+#include "shared.h"
 #include "thread.h"
+#include "uring.h"
 
 #include "AutoResource.h"
 
-#ifdef _WIN64
-#define ElfW(type) Elf64_##type
-#elif defined(_WIN32)
-#define ElfW(type) Elf32_##type
-#endif
-
 #define MX_RETURN_IF_FAIL(s)        \
     do                              \
     {                               \
@@ -24,13 +23,313 @@
 
 #define MX_POOL_TAG ('  xM')
 
-// An unofficial, more descriptive name for the flag.
-// This undocumented flag used to be there to allow compatibility with 16-bit applications only on
-// 32-bit x86 Windows.
-// It forces pages to be allocated with a granularity equal to the processor page boundary (4KB).
-// Recently, the flag has been enabled on all architectures, but only for Pico processes, hence the
-// unofficial name.
-#define MX_MEM_PICO MEM_DOS_LIM
+// Guards the parent and child links of every process. Zeroed push locks are ready to use.
+static EX_PUSH_LOCK MxProcessTreeLock = 0;
+
+static
+VOID
+MxLockProcessTree()
+{
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&MxProcessTreeLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+}
+
+static
+VOID
+MxUnlockProcessTree()
+{
+    ExReleasePushLockExclusiveEx(&MxProcessTreeLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+// Forks and short-lived sessions churn through these at a high rate.
+static LOOKASIDE_LIST_EX MxProcessLookaside;
+
+extern "C"
+NTSTATUS
+MxInitializeProcessLookaside()
+{
+    return ExInitializeLookasideListEx(&MxProcessLookaside, NULL, NULL, PagedPool, 0,
+        sizeof(MX_PROCESS), MX_POOL_TAG, 0);
+}
+
+extern "C"
+VOID
+MxCleanupProcessLookaside()
+{
+    ExDeleteLookasideListEx(&MxProcessLookaside);
+}
+
+// Entries come back from the list as they were freed, so they are zeroed here.
+extern "C"
+PMX_PROCESS
+MxProcessAllocate()
+{
+    PMX_PROCESS pMxProcess = (PMX_PROCESS)ExAllocateFromLookasideListEx(&MxProcessLookaside);
+    if (pMxProcess == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(pMxProcess, sizeof(MX_PROCESS));
+    pMxProcess->ReferenceCount = 1;
+    InitializeListHead(&pMxProcess->Threads);
+    ExInitializeFastMutex(&pMxProcess->ThreadsLock);
+    InitializeListHead(&pMxProcess->Children);
+    InitializeListHead(&pMxProcess->ExitedChildren);
+    InitializeListHead(&pMxProcess->SiblingLink);
+    KeInitializeEvent(&pMxProcess->ChildExited, NotificationEvent, FALSE);
+
+    return pMxProcess;
+}
+
+extern "C"
+NTSTATUS
+MxExecutableNameCreate(
+    _In_ PFILE_OBJECT pFileObject,
+    _Out_ PMX_EXECUTABLE_NAME* pPName
+)
+{
+    *pPName = NULL;
+
+    ULONG uNameLen = 0;
+    ObQueryNameString(pFileObject, NULL, 0, &uNameLen);
+
+    // The name goes right behind the header, in the same allocation.
+    PMX_EXECUTABLE_NAME pName = (PMX_EXECUTABLE_NAME)ExAllocatePoolZero(PagedPool,
+        FIELD_OFFSET(MX_EXECUTABLE_NAME, Name) + uNameLen, MX_POOL_TAG);
+    if (pName == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pName, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    MX_RETURN_IF_FAIL(ObQueryNameString(pFileObject, (POBJECT_NAME_INFORMATION)&pName->Name,
+        uNameLen, &uNameLen));
+
+    pName->ReferenceCount = 1;
+
+    *pPName = pName;
+    pName = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MxExecutableNameFree(
+    _In_ PMX_EXECUTABLE_NAME pName
+)
+{
+    ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pName->ReferenceCount);
+    ASSERT(uNewCount + 1 > uNewCount);
+
+    if (uNewCount == 0)
+    {
+        ExFreePoolWithTag(pName, MX_POOL_TAG);
+    }
+}
+
+// Best effort, lxmonika has checked the placement against the processors there are when the
+// session started.
+static
+VOID
+MxProcessApplyPlacement(
+    _In_ PMX_PROCESS pMxProcess,
+    _In_ PETHREAD pThread
+)
+{
+    if (pMxProcess->Placement.Flags != 0)
+    {
+        MaSetThreadPlacement(pThread, &pMxProcess->Placement);
+    }
+}
+
+// Bytes behind AT_RANDOM, which C libraries seed their stack protector and pointer guard from.
+#define MX_AT_RANDOM_SIZE                       16
+
+static
+NTSTATUS
+MxProcessWriteInitialStack(
+    _In_ PEPROCESS pProcess,
+    _In_ PMX_MEMORY pMemory,
+    _In_ ULONG_PTR uStackPointer,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize
+)
+{
+    KAPC_STATE apcState;
+    KeStackAttachProcess(pProcess, &apcState);
+
+    // Larger blocks reach below the pages committed by MxMemoryInitializeStack.
+    NTSTATUS status = MxMemoryPrepare(pMemory, (PVOID)uStackPointer, uSize);
+
+    if (NT_SUCCESS(status))
+    {
+        __try
+        {
+            memcpy((PVOID)uStackPointer, pBuffer, uSize);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            status = GetExceptionCode();
+        }
+    }
+
+    KeUnstackDetachProcess(&apcState);
+
+    return status;
+}
+
+// Lays out argc, argv, envp, the auxiliary vector and the strings they point to right below
+// uStackTop, as the System V ABI expects them at process entry. Everything is assembled in pool
+// first and copied into the process at once. Returns the stack pointer the main thread starts
+// with, which points to argc.
+static
+NTSTATUS
+MxProcessBuildInitialStack(
+    _In_ PMX_PROCESS pMxProcess,
+    _In_ PEPROCESS pProcess,
+    _In_ ULONG_PTR uStackTop,
+    _In_opt_ const MX_PROCESS_ARGUMENTS* pArguments,
+    _Out_ PULONG_PTR puStackPointer
+)
+{
+    *puStackPointer = 0;
+
+    // Programs expect at least their own name in argv[0].
+    const UNICODE_STRING* pArgs = &pMxProcess->ExecutableName->Name;
+    SIZE_T uArgsCount = 1;
+    const UNICODE_STRING* pEnvironment = NULL;
+    SIZE_T uEnvironmentCount = 0;
+
+    if (pArguments != NULL)
+    {
+        if (pArguments->ArgsCount != 0)
+        {
+            pArgs = pArguments->Args;
+            uArgsCount = pArguments->ArgsCount;
+        }
+
+        pEnvironment = pArguments->Environment;
+        uEnvironmentCount = pArguments->EnvironmentCount;
+    }
+
+    if (uArgsCount + uEnvironmentCount > MX_INITIAL_STACK_MAX / sizeof(ULONG_PTR))
+    {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    const auto StringAt = [&](SIZE_T i) -> const UNICODE_STRING&
+    {
+        return (i < uArgsCount) ? pArgs[i] : pEnvironment[i - uArgsCount];
+    };
+
+    SIZE_T uStringsSize = MX_AT_RANDOM_SIZE;
+
+    for (SIZE_T i = 0; i < uArgsCount + uEnvironmentCount; ++i)
+    {
+        const UNICODE_STRING& str = StringAt(i);
+
+        ULONG uBytes = 0;
+        MX_RETURN_IF_FAIL(RtlUnicodeToUTF8N(NULL, 0, &uBytes, str.Buffer, str.Length));
+
+        uStringsSize += (SIZE_T)uBytes + 1;
+
+        if (uStringsSize > MX_INITIAL_STACK_MAX)
+        {
+            return STATUS_INVALID_BUFFER_SIZE;
+        }
+    }
+
+    ULONG_PTR auxv[][2] =
+    {
+        { AT_PHDR, pMxProcess->ProgramHeaders },
+        { AT_PHENT, sizeof(ElfW(Phdr)) },
+        { AT_PHNUM, pMxProcess->ProgramHeadersCount },
+        { AT_PAGESZ, PAGE_SIZE },
+        { AT_BASE, 0 },
+        { AT_FLAGS, 0 },
+        { AT_ENTRY, pMxProcess->EntryPoint },
+        // Filled in below, once the strings have an address.
+        { AT_RANDOM, 0 },
+        // TODO: AT_SYSINFO_EHDR, once there is a vDSO to point to.
+        { AT_NULL, 0 }
+    };
+
+    // Images without their program headers in a loaded segment get none, rather than a bogus
+    // address.
+    SIZE_T uAuxvSkip = (pMxProcess->ProgramHeaders == 0) ? 3 : 0;
+    SIZE_T uAuxvCount = ARRAYSIZE(auxv) - uAuxvSkip;
+
+    // argc, argv and envp with their terminators, then the auxiliary vector.
+    SIZE_T uVectorSize = (1 + (uArgsCount + 1) + (uEnvironmentCount + 1)) * sizeof(ULONG_PTR)
+        + uAuxvCount * sizeof(auxv[0]);
+
+    // Both ABIs want the stack pointer 16-byte aligned at entry.
+    ULONG_PTR uStrings = ALIGN_DOWN_BY(uStackTop - uStringsSize, 16);
+    ULONG_PTR uStackPointer = ALIGN_DOWN_BY(uStrings - uVectorSize, 16);
+    SIZE_T uSize = uStackTop - uStackPointer;
+
+    PCHAR pBuffer = (PCHAR)ExAllocatePoolZero(PagedPool, uSize, MX_POOL_TAG);
+    if (pBuffer == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pBuffer, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    // Pointers are written as the process will see them, relative to uStackPointer.
+    PULONG_PTR pSlot = (PULONG_PTR)pBuffer;
+    PCHAR pString = pBuffer + (uStrings - uStackPointer);
+    PCHAR pStringsEnd = pString + uStringsSize;
+
+    const auto UserAddress = [&](PVOID p)
+    {
+        return uStackPointer + (ULONG_PTR)((PCHAR)p - pBuffer);
+    };
+
+    // Not cryptographically strong, but distinct for every process.
+    ULONG uSeed = (ULONG)KeQueryPerformanceCounter(NULL).QuadPart
+        ^ HandleToULong(PsGetProcessId(pProcess));
+    for (SIZE_T i = 0; i < MX_AT_RANDOM_SIZE / sizeof(ULONG); ++i)
+    {
+        ((PULONG)pString)[i] = RtlRandomEx(&uSeed);
+    }
+    auxv[ARRAYSIZE(auxv) - 2][1] = UserAddress(pString);
+    pString += MX_AT_RANDOM_SIZE;
+
+    *pSlot++ = uArgsCount;
+
+    for (SIZE_T i = 0; i < uArgsCount + uEnvironmentCount; ++i)
+    {
+        const UNICODE_STRING& str = StringAt(i);
+
+        ULONG uBytes = 0;
+        MX_RETURN_IF_FAIL(RtlUnicodeToUTF8N(pString, (ULONG)(pStringsEnd - pString - 1),
+            &uBytes, str.Buffer, str.Length));
+
+        *pSlot++ = UserAddress(pString);
+        // Already zeroed, so this just skips the terminator.
+        pString += uBytes + 1;
+
+        if (i == uArgsCount - 1)
+        {
+            // End of argv.
+            *pSlot++ = 0;
+        }
+    }
+
+    // End of envp.
+    *pSlot++ = 0;
+
+    memcpy(pSlot, &auxv[uAuxvSkip], uAuxvCount * sizeof(auxv[0]));
+
+    MX_RETURN_IF_FAIL(MxProcessWriteInitialStack(pProcess, pMxProcess->Memory, uStackPointer,
+        pBuffer, uSize));
+
+    *puStackPointer = uStackPointer;
+    return STATUS_SUCCESS;
+}
 
 extern "C"
 NTSTATUS
@@ -39,17 +338,45 @@ MxProcessExecute(
     _In_ PEPROCESS pParentProcess,
     _In_ PEPROCESS pHostProcess,
     _In_opt_ HANDLE hdlCwd,
+    _In_opt_ PMX_OUTPUT_RING pOutputRing,
+    _In_opt_ PMX_FILE_TABLE pFiles,
+    _In_opt_ const MX_PROCESS_ARGUMENTS* pArguments,
+    _In_ ULONG uFlags,
+    _In_opt_ const MA_PICO_SESSION_PLACEMENT* pPlacement,
     _Out_ PMX_PROCESS* pPMxProcess
 )
 {
-    PMX_PROCESS pMxProcess = (PMX_PROCESS)
-        ExAllocatePoolZero(PagedPool, sizeof(MX_PROCESS), MX_POOL_TAG);
+    PMX_PROCESS pMxProcess = MxProcessAllocate();
     if (pMxProcess == NULL)
     {
         return STATUS_NO_MEMORY;
     }
     AUTO_RESOURCE(pMxProcess, MxProcessFree);
-    pMxProcess->ReferenceCount = 1;
+    pMxProcess->ExecuteFlags = uFlags & ~MX_EXECUTE_SUSPENDED;
+
+    if (pPlacement != NULL)
+    {
+        pMxProcess->Placement = *pPlacement;
+    }
+
+    MX_RETURN_IF_FAIL(MxMemoryAllocate(&pMxProcess->Memory));
+
+    if (pFiles != NULL)
+    {
+        MX_RETURN_IF_FAIL(MxFileTableCopy(pFiles, &pMxProcess->Files));
+    }
+    else
+    {
+        MX_RETURN_IF_FAIL(MxFileTableAllocate(&pMxProcess->Files));
+
+        // Hosts without a console still get a process, its standard descriptors are just closed.
+        MxFileTableOpenConsole(pMxProcess->Files, pHostProcess);
+    }
+
+    if (pOutputRing != NULL)
+    {
+        MX_RETURN_IF_FAIL(MxFileTableAttachOutputRing(pMxProcess->Files, pOutputRing));
+    }
 
     OBJECT_ATTRIBUTES objAttributes;
     InitializeObjectAttributes(
@@ -82,6 +409,10 @@ MxProcessExecute(
         NULL
     ));
 
+    // Resolved once here, so that forks do not need to ask the object manager again.
+    MX_RETURN_IF_FAIL(MxExecutableNameCreate(pMxProcess->MainExecutable,
+        &pMxProcess->ExecutableName));
+
     HANDLE hdlParentProcess = NULL;
     MX_RETURN_IF_FAIL(ObOpenObjectByPointer(
         pParentProcess,
@@ -139,35 +470,16 @@ MxProcessExecute(
         return status;
     }
 
-    PVOID pStackBaseAddress = NULL;
-    SIZE_T szStackSize = 0x800000;
-    LARGE_INTEGER liStackSize
-    {
-        .QuadPart = (LONGLONG)szStackSize
-    };
-    HANDLE hdlStackSection = NULL;
-    MX_RETURN_IF_FAIL(ZwCreateSection(
-        &hdlStackSection,
-        STANDARD_RIGHTS_REQUIRED | SECTION_MAP_READ | SECTION_QUERY | SECTION_EXTEND_SIZE,
-        NULL,
-        &liStackSize,
-        PAGE_WRITECOPY,
-        SEC_COMMIT,
-        NULL
-    ));
-    AUTO_RESOURCE(hdlStackSection, ZwClose);
-    MX_RETURN_IF_FAIL(ZwMapViewOfSection(
-        hdlStackSection,
-        hdlProcess,
-        &pStackBaseAddress,
-        0,
-        szStackSize,
-        NULL,
-        &szStackSize,
-        ViewShare,
-        MX_MEM_PICO,
-        PAGE_WRITECOPY
-    ));
+    MX_RETURN_IF_FAIL(MxSharedPageCreate(hdlProcess, pProcess, &pMxProcess->SharedPage));
+
+    // Reserved, and committed as it grows. Most programs never get near the limit.
+    PVOID pStackTop = NULL;
+    MX_RETURN_IF_FAIL(MxMemoryInitializeStack(pMxProcess->Memory, hdlProcess, &pStackTop));
+
+    // Written before the thread exists, so that it starts right on argc.
+    ULONG_PTR uStackPointer = 0;
+    MX_RETURN_IF_FAIL(MxProcessBuildInitialStack(pMxProcess, pProcess, (ULONG_PTR)pStackTop,
+        pArguments, &uStackPointer));
 
     PMX_THREAD pMxThread = NULL;
     MX_RETURN_IF_FAIL(MxThreadAllocate(&pMxThread));
@@ -176,7 +488,7 @@ MxProcessExecute(
     PS_PICO_THREAD_ATTRIBUTES psPicoThreadAttributes
     {
         .Process = hdlProcess,
-        .UserStack = (ULONG_PTR)pStackBaseAddress + szStackSize,
+        .UserStack = uStackPointer,
         .StartRoutine = (ULONG_PTR)pCodeBaseAddress,
         .Context = pMxThread
     };
@@ -205,24 +517,32 @@ MxProcessExecute(
         ObDereferenceObject(pThread);
     });
 
+    MxProcessApplyPlacement(pMxProcess, pThread);
+
     ObReferenceObject(pHostProcess);
     pMxProcess->HostProcess = pHostProcess;
 
     // One more reference for the output. The other reference is given to NT.
     InterlockedIncrementSizeT(&pMxProcess->ReferenceCount);
 
-    pMxProcess->UserStack = pStackBaseAddress;
+    pMxProcess->UserStack = (PVOID)pMxProcess->Memory->Stack.Base;
 
     // These don't need to be dereferenced/terminated anymore.
     pMxProcess->Process = pProcess;
     pProcess = NULL;
     pMxProcess->Thread = pThread;
     pThread = NULL;
+    // One more reference for the thread list.
+    MxThreadReference(pMxThread);
+    InsertTailList(&pMxProcess->Threads, &pMxThread->Link);
     pMxProcess->MxThread = pMxThread;
     pMxThread = NULL;
 
     // We have to properly set the context before allowing execution.
-    MxRoutines.ResumeThread(pMxProcess->Thread, NULL);
+    if (!(uFlags & MX_EXECUTE_SUSPENDED))
+    {
+        MxRoutines.ResumeThread(pMxProcess->Thread, NULL);
+    }
 
     *pPMxProcess = pMxProcess;
     pMxProcess = NULL;
@@ -261,6 +581,11 @@ MxProcessFree(
         ObDereferenceObject(pMxProcess->MainExecutable);
     }
 
+    if (pMxProcess->ExecutableName)
+    {
+        MxExecutableNameFree(pMxProcess->ExecutableName);
+    }
+
     if (pMxProcess->HostProcess)
     {
         ObDereferenceObject(pMxProcess->HostProcess);
@@ -271,7 +596,41 @@ MxProcessFree(
         MxThreadFree(pMxProcess->MxThread);
     }
 
-    ExFreePoolWithTag(pMxProcess, MX_POOL_TAG);
+    while (!IsListEmpty(&pMxProcess->Threads))
+    {
+        PLIST_ENTRY pEntry = RemoveHeadList(&pMxProcess->Threads);
+        MxThreadFree(CONTAINING_RECORD(pEntry, MX_THREAD, Link));
+    }
+
+    if (pMxProcess->Files)
+    {
+        MxFileTableFree(pMxProcess->Files);
+    }
+
+    if (pMxProcess->Uring)
+    {
+        MxUringFree(pMxProcess->Uring);
+    }
+
+    if (pMxProcess->SharedPage)
+    {
+        MxSharedPageFree(pMxProcess->SharedPage);
+    }
+
+    if (pMxProcess->Memory)
+    {
+        MxMemoryFree(pMxProcess->Memory);
+    }
+
+    // Children hold references, so by now there are none left.
+    ASSERT(IsListEmpty(&pMxProcess->Children) && IsListEmpty(&pMxProcess->ExitedChildren));
+
+    if (pMxProcess->Parent)
+    {
+        MxProcessFree(pMxProcess->Parent);
+    }
+
+    ExFreeToLookasideListEx(&MxProcessLookaside, pMxProcess);
 }
 
 extern "C"
@@ -298,86 +657,28 @@ MxProcessMapMainExecutable(
     ));
     AUTO_RESOURCE(hdlMainExecutable, ZwClose);
 
-    const auto ReadToEnd = [&](PVOID pBuffer, SIZE_T uOffset, SIZE_T uSize)
-    {
-        IO_STATUS_BLOCK ioStatus;
-        SIZE_T uRead = 0;
-        LARGE_INTEGER liOffset;
-        while (uRead < uSize)
-        {
-            liOffset.QuadPart = uOffset + uRead;
-            MX_RETURN_IF_FAIL(ZwReadFile(
-                hdlMainExecutable,
-                NULL,
-                NULL,
-                NULL,
-                &ioStatus,
-                (PCHAR)pBuffer + uRead,
-                (ULONG)(uSize - uRead),
-                &liOffset,
-                NULL
-            ));
-            uRead += ioStatus.Information;
-        }
-        return STATUS_SUCCESS;
-    };
-
-    ElfW(Ehdr) elfHeader;
-    MX_RETURN_IF_FAIL(ReadToEnd(&elfHeader, 0, sizeof(ElfW(Ehdr))));
-
-    if (!IS_ELF(elfHeader)
-        || (elfHeader.e_phentsize != sizeof(ElfW(Phdr)))
-        || elfHeader.e_phnum < 1
-        || elfHeader.e_type != ET_EXEC)
-    {
-        return STATUS_INVALID_IMAGE_FORMAT;
-    }
+    // Headers and the file section are shared by every exec of the same, unchanged binary.
+    PMX_IMAGE pImage = NULL;
+    MX_RETURN_IF_FAIL(MxImageGet(hdlMainExecutable, &pImage));
+    AUTO_RESOURCE(pImage, MxImageFree);
 
+    const ElfW(Ehdr)& elfHeader = pImage->Header;
+    const ElfW(Phdr)* pProgramHeaders = pImage->ProgramHeaders;
     SIZE_T szPhdrsCount = elfHeader.e_phnum;
-    SIZE_T szPhdrsBytes = sizeof(ElfW(Phdr)) * szPhdrsCount;
-
-    ElfW(Phdr)* pProgramHeaders = (ElfW(Phdr)*)
-        ExAllocatePoolZero(PagedPool, szPhdrsBytes, MX_POOL_TAG);
-    AUTO_RESOURCE(pProgramHeaders, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
-    MX_RETURN_IF_FAIL(ReadToEnd(pProgramHeaders, elfHeader.e_phoff, szPhdrsBytes));
-
-    ElfW(Addr) pImageStartVm = (ElfW(Addr))-1;
-    ElfW(Addr) pImageEndVm = 0;
-
-    for (SIZE_T i = 0; i < szPhdrsCount; ++i)
-    {
-        if (pProgramHeaders[i].p_type != PT_LOAD)
-        {
-            continue;
-        }
-
-        if ((ALIGN_DOWN_BY(pProgramHeaders[i].p_offset, PAGE_SIZE)
-                != pProgramHeaders[i].p_offset)
-            && (ALIGN_DOWN_BY(pProgramHeaders[i].p_vaddr, PAGE_SIZE)
-                != pProgramHeaders[i].p_vaddr))
-        {
-            return STATUS_INVALID_IMAGE_FORMAT;
-        }
+    ElfW(Addr) pImageEndVm = pImage->End;
 
-        // TODO: Handle the alignment.
-
-        pImageStartVm = min(pImageStartVm, pProgramHeaders[i].p_vaddr);
-        pImageEndVm = max(pImageEndVm, pProgramHeaders[i].p_vaddr + pProgramHeaders[i].p_memsz);
-    }
-
-    // TODO: Reserve a block of memory.
+    // TODO: Relocate the image.
     ElfW(Addr) pImageBase = 0;
 
     HANDLE hdlSection = NULL;
-    MX_RETURN_IF_FAIL(ZwCreateSection(
-        &hdlSection,
-        STANDARD_RIGHTS_REQUIRED
-            | SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY | SECTION_EXTEND_SIZE,
+    MX_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        pImage->Section,
+        OBJ_KERNEL_HANDLE,
         NULL,
+        SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY,
         NULL,
-        PAGE_EXECUTE_WRITECOPY,
-        SEC_COMMIT,
-        hdlMainExecutable
+        KernelMode,
+        &hdlSection
     ));
     AUTO_RESOURCE(hdlSection, ZwClose);
 
@@ -416,6 +717,9 @@ MxProcessMapMainExecutable(
         return table[(bool)(elfFlags & PF_X)][(bool)(elfFlags & PF_W)][(bool)(elfFlags & PF_R)];
     };
 
+    // The zero-filled tails of all segments, one after another, in a single section.
+    SIZE_T szBlankTotal = 0;
+
     for (SIZE_T i = 0; i < szPhdrsCount; ++i)
     {
         if (pProgramHeaders[i].p_type != PT_LOAD)
@@ -423,64 +727,207 @@ MxProcessMapMainExecutable(
             continue;
         }
 
-        // TODO: Handle the alignment.
+        szBlankTotal += ALIGN_UP_BY(pProgramHeaders[i].p_memsz, PAGE_SIZE)
+            - min(ALIGN_UP_BY(pProgramHeaders[i].p_filesz, PAGE_SIZE),
+                ALIGN_UP_BY(pProgramHeaders[i].p_memsz, PAGE_SIZE));
+    }
 
-        ElfW(Addr) pStartOffset = pProgramHeaders[i].p_offset;
-        ElfW(Addr) pFileSize = pProgramHeaders[i].p_filesz;
-        ElfW(Addr) pStartVm = pImageBase + pProgramHeaders[i].p_vaddr;
-        ElfW(Addr) pMemorySize = ALIGN_UP_BY(pProgramHeaders[i].p_memsz, PAGE_SIZE);
+    // A kernel-mode driver cannot map views into a reservation of its own, so check that the
+    // whole span is free up front instead of finding out halfway through.
+    ElfW(Addr) pSpanStart = ALIGN_DOWN_BY(pImageBase + pImage->Start, PAGE_SIZE);
+    ElfW(Addr) pSpanEnd = ALIGN_UP_BY(pImageBase + pImageEndVm, PAGE_SIZE);
+
+    MEMORY_BASIC_INFORMATION mbi;
+    MX_RETURN_IF_FAIL(ZwQueryVirtualMemory(hdlProcess, (PVOID)pSpanStart,
+        MemoryBasicInformation, &mbi, sizeof(mbi), NULL));
+
+    if (mbi.State != MEM_FREE || (ElfW(Addr))mbi.BaseAddress + mbi.RegionSize < pSpanEnd)
+    {
+        return STATUS_CONFLICTING_ADDRESSES;
+    }
+
+    HANDLE hdlBlankSection = NULL;
+    AUTO_RESOURCE(hdlBlankSection, ZwClose);
 
-        LARGE_INTEGER liSectionOffset
+    if (szBlankTotal != 0)
+    {
+        LARGE_INTEGER liBlankSectionSize
         {
-            .QuadPart = (LONGLONG)pStartOffset
+            .QuadPart = (LONGLONG)szBlankTotal
         };
-        PVOID pMapBase = (PVOID)pStartVm;
-        SIZE_T szViewSize = (SIZE_T)pFileSize;
 
-        MX_RETURN_IF_FAIL(ZwMapViewOfSection(
-            hdlSection,
-            hdlProcess,
-            &pMapBase,
-            0,
-            szViewSize,
-            &liSectionOffset,
-            &szViewSize,
-            ViewShare,
-            MX_MEM_PICO,
-            PAGE_EXECUTE_WRITECOPY
+        MX_RETURN_IF_FAIL(ZwCreateSection(
+            &hdlBlankSection,
+            STANDARD_RIGHTS_REQUIRED
+                | SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY | SECTION_EXTEND_SIZE,
+            NULL,
+            &liBlankSectionSize,
+            PAGE_EXECUTE_WRITECOPY,
+            SEC_COMMIT,
+            NULL
         ));
+    }
+
+    SIZE_T szBlankOffset = 0;
+
+    // The file-backed views, to be read ahead all at once.
+    PMEMORY_RANGE_ENTRY pPrefetchRanges = NULL;
+    ULONG_PTR uPrefetchRangesCount = 0;
 
-        if (pMapBase != (PVOID)pStartVm)
+    if (pMxProcess->ExecuteFlags & MX_EXECUTE_PREFAULT)
+    {
+        pPrefetchRanges = (PMEMORY_RANGE_ENTRY)ExAllocatePoolZero(PagedPool,
+            sizeof(MEMORY_RANGE_ENTRY) * szPhdrsCount, MX_POOL_TAG);
+    }
+    AUTO_RESOURCE(pPrefetchRanges, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    // Adjacent segments with the same protection are changed in one call.
+    ElfW(Addr) pProtectStart = 0;
+    ElfW(Addr) pProtectEnd = 0;
+    ULONG uProtect = PAGE_NOACCESS;
+
+    const auto FlushProtection = [&]()
+    {
+        if (pProtectEnd == pProtectStart)
         {
-            return STATUS_CONFLICTING_ADDRESSES;
+            return STATUS_SUCCESS;
         }
 
-        // Map the rest as an anonymous section.
-        if (szViewSize < pMemorySize)
-        {
-            SIZE_T szBlankViewSize = pMemorySize - szViewSize;
+        PVOID pProtectBase = (PVOID)pProtectStart;
+        SIZE_T uNumberOfBytesToProtect = pProtectEnd - pProtectStart;
 
-            LARGE_INTEGER liBlankSectionSize
-            {
-                .QuadPart = (LONGLONG)szBlankViewSize
-            };
+        MX_RETURN_IF_FAIL(ZwProtectVirtualMemory(
+            hdlProcess,
+            &pProtectBase,
+            &uNumberOfBytesToProtect,
+            uProtect,
+            NULL
+        ));
 
-            HANDLE hdlBlankSection = NULL;
-            MX_RETURN_IF_FAIL(ZwCreateSection(
-                &hdlBlankSection,
-                STANDARD_RIGHTS_REQUIRED
-                    | SECTION_MAP_EXECUTE | SECTION_MAP_READ | SECTION_QUERY | SECTION_EXTEND_SIZE,
+        if (uNumberOfBytesToProtect != pProtectEnd - pProtectStart)
+        {
+            return STATUS_CONFLICTING_ADDRESSES;
+        }
+
+        pProtectStart = pProtectEnd;
+        return STATUS_SUCCESS;
+    };
+
+    for (SIZE_T i = 0; i < szPhdrsCount; ++i)
+    {
+        if (pProgramHeaders[i].p_type != PT_LOAD)
+        {
+            continue;
+        }
+
+        // TODO: Handle the alignment.
+
+        ElfW(Addr) pStartOffset = pProgramHeaders[i].p_offset;
+        ElfW(Addr) pStartVm = pImageBase + pProgramHeaders[i].p_vaddr;
+        ElfW(Addr) pMemorySize = ALIGN_UP_BY(pProgramHeaders[i].p_memsz, PAGE_SIZE);
+        SIZE_T szViewSize = (SIZE_T)min(ALIGN_UP_BY(pProgramHeaders[i].p_filesz, PAGE_SIZE),
+            pMemorySize);
+
+        // The leading large pages come from a read-only copy, the rest is mapped as usual.
+        PVOID pLargeSection = NULL;
+        SIZE_T szLargeSize = 0;
+
+        if ((pMxProcess->ExecuteFlags & MX_EXECUTE_LARGE_PAGES)
+            && NT_SUCCESS(MxImageGetLargePages(pImage, hdlMainExecutable, i,
+                &pLargeSection, &szLargeSize)))
+        {
+            HANDLE hdlLargeSection = NULL;
+            PVOID pLargeMapBase = (PVOID)pStartVm;
+            SIZE_T szLargeViewSize = szLargeSize;
+
+            NTSTATUS status = ObOpenObjectByPointer(
+                pLargeSection,
+                OBJ_KERNEL_HANDLE,
                 NULL,
-                &liBlankSectionSize,
-                PAGE_EXECUTE_WRITECOPY,
-                SEC_COMMIT,
-                NULL
+                SECTION_MAP_EXECUTE | SECTION_MAP_READ,
+                NULL,
+                KernelMode,
+                &hdlLargeSection
+            );
+
+            if (NT_SUCCESS(status))
+            {
+                status = ZwMapViewOfSection(
+                    hdlLargeSection,
+                    hdlProcess,
+                    &pLargeMapBase,
+                    0,
+                    szLargeViewSize,
+                    NULL,
+                    &szLargeViewSize,
+                    ViewShare,
+                    MEM_LARGE_PAGES,
+                    PAGE_EXECUTE_READ
+                );
+                ZwClose(hdlLargeSection);
+            }
+
+            if (NT_SUCCESS(status) && pLargeMapBase != (PVOID)pStartVm)
+            {
+                ZwUnmapViewOfSection(hdlProcess, pLargeMapBase);
+                status = STATUS_CONFLICTING_ADDRESSES;
+            }
+
+            // Not worth failing the exec over, small pages work just as well.
+            if (NT_SUCCESS(status))
+            {
+                pStartOffset += szLargeSize;
+                pStartVm += szLargeSize;
+                pMemorySize -= szLargeSize;
+                szViewSize -= szLargeSize;
+            }
+        }
+
+        // A view size of 0 would map the rest of the file, not nothing.
+        if (szViewSize != 0)
+        {
+            LARGE_INTEGER liSectionOffset
+            {
+                .QuadPart = (LONGLONG)pStartOffset
+            };
+            PVOID pMapBase = (PVOID)pStartVm;
+
+            MX_RETURN_IF_FAIL(ZwMapViewOfSection(
+                hdlSection,
+                hdlProcess,
+                &pMapBase,
+                0,
+                szViewSize,
+                &liSectionOffset,
+                &szViewSize,
+                ViewShare,
+                MX_MEM_PICO,
+                PAGE_EXECUTE_WRITECOPY
             ));
-            AUTO_RESOURCE(hdlBlankSection, ZwClose);
+
+            if (pMapBase != (PVOID)pStartVm)
+            {
+                return STATUS_CONFLICTING_ADDRESSES;
+            }
+
+            if (pPrefetchRanges != NULL)
+            {
+                pPrefetchRanges[uPrefetchRangesCount++] =
+                {
+                    .VirtualAddress = pMapBase,
+                    .NumberOfBytes = szViewSize
+                };
+            }
+        }
+
+        // Map the rest from the shared anonymous section.
+        if (szViewSize < pMemorySize)
+        {
+            SIZE_T szBlankViewSize = pMemorySize - szViewSize;
 
             LARGE_INTEGER liBlankSectionOffset
             {
-                .QuadPart = 0
+                .QuadPart = (LONGLONG)szBlankOffset
             };
             PVOID pBlankMapBase = (PVOID)(pStartVm + szViewSize);
 
@@ -502,28 +949,469 @@ MxProcessMapMainExecutable(
             {
                 return STATUS_CONFLICTING_ADDRESSES;
             }
+
+            szBlankOffset += szBlankViewSize;
         }
 
-        SIZE_T uNumberOfBytesToProtect = pMemorySize;
+        ULONG uSegmentProtect = ElfProtectionToWindows(pProgramHeaders[i].p_flags);
 
-        MX_RETURN_IF_FAIL(ZwProtectVirtualMemory(
-            hdlProcess,
-            &pMapBase,
-            &uNumberOfBytesToProtect,
-            ElfProtectionToWindows(pProgramHeaders[i].p_flags),
-            NULL
-        ));
+        if (pStartVm != pProtectEnd || uSegmentProtect != uProtect)
+        {
+            MX_RETURN_IF_FAIL(FlushProtection());
+            pProtectStart = pStartVm;
+            uProtect = uSegmentProtect;
+        }
+
+        pProtectEnd = pStartVm + pMemorySize;
+    }
+
+    MX_RETURN_IF_FAIL(FlushProtection());
+
+    if (uPrefetchRangesCount != 0)
+    {
+        // Only a hint, the pages are faulted in on demand either way.
+        ULONG uPrefetchFlags = 0;
+        ZwSetInformationVirtualMemory(hdlProcess, VmPrefetchInformation, uPrefetchRangesCount,
+            pPrefetchRanges, &uPrefetchFlags, sizeof(uPrefetchFlags));
+    }
+
+    if (pMxProcess->Memory != NULL)
+    {
+        // Programs that never call brk() still run without it.
+        MxMemoryInitializeBreak(pMxProcess->Memory, hdlProcess, pImageBase + pImageEndVm);
+    }
+
+    // Where the program headers ended up, for AT_PHDR. Usually described by PT_PHDR, otherwise
+    // found in whichever loaded segment covers them in the file.
+    pMxProcess->ProgramHeaders = 0;
 
-        if (uNumberOfBytesToProtect != pMemorySize)
+    for (SIZE_T i = 0; i < szPhdrsCount && pMxProcess->ProgramHeaders == 0; ++i)
+    {
+        const ElfW(Phdr)& phdr = pProgramHeaders[i];
+
+        if (phdr.p_type == PT_PHDR)
         {
-            return STATUS_CONFLICTING_ADDRESSES;
+            pMxProcess->ProgramHeaders = (ULONG_PTR)(pImageBase + phdr.p_vaddr);
+        }
+        else if (phdr.p_type == PT_LOAD && phdr.p_offset <= elfHeader.e_phoff
+            && elfHeader.e_phoff + szPhdrsCount * sizeof(ElfW(Phdr))
+                <= phdr.p_offset + phdr.p_filesz)
+        {
+            pMxProcess->ProgramHeaders =
+                (ULONG_PTR)(pImageBase + phdr.p_vaddr + (elfHeader.e_phoff - phdr.p_offset));
         }
     }
 
+    pMxProcess->ProgramHeadersCount = szPhdrsCount;
+    pMxProcess->EntryPoint = (ULONG_PTR)(pImageBase + elfHeader.e_entry);
+
     *pEntryPoint = (PVOID)(pImageBase + elfHeader.e_entry);
     return STATUS_SUCCESS;
 }
 
+extern "C"
+VOID
+MxProcessSetPlacement(
+    _Inout_ PMX_PROCESS pMxProcess,
+    _In_ const MA_PICO_SESSION_PLACEMENT* pPlacement
+)
+{
+    pMxProcess->Placement = *pPlacement;
+    MxProcessApplyPlacement(pMxProcess, pMxProcess->Thread);
+}
+
+extern "C"
+NTSTATUS
+MxProcessSetArguments(
+    _Inout_ PMX_PROCESS pMxProcess,
+    _In_ const MX_PROCESS_ARGUMENTS* pArguments
+)
+{
+    // Nothing has run yet, so the old block is simply written over.
+    ULONG_PTR uStackTop = pMxProcess->Memory->Stack.Base + pMxProcess->Memory->Stack.Size;
+
+    ULONG_PTR uStackPointer = 0;
+    MX_RETURN_IF_FAIL(MxProcessBuildInitialStack(pMxProcess, pMxProcess->Process, uStackTop,
+        pArguments, &uStackPointer));
+
+    CONTEXT ctx
+    {
+        .ContextFlags = CONTEXT_CONTROL
+    };
+    MX_RETURN_IF_FAIL(MxRoutines.GetContextThreadInternal(
+        pMxProcess->Thread,
+        &ctx,
+        KernelMode,
+        UserMode,
+        FALSE
+    ));
+
+#ifdef _M_AMD64
+    ctx.Rsp = uStackPointer;
+#elif defined(_M_ARM64)
+    ctx.Sp = uStackPointer;
+#else
+#error Set the stack pointer for this architecture!
+#endif
+
+    return MxRoutines.SetContextThreadInternal(
+        pMxProcess->Thread,
+        &ctx,
+        KernelMode,
+        UserMode,
+        FALSE
+    );
+}
+
+extern "C"
+NTSTATUS
+MxProcessCreateThread(
+    _Inout_ PMX_PROCESS pMxProcess,
+    _In_ ULONG_PTR uStartRoutine,
+    _In_ ULONG_PTR uArgument,
+    _In_ ULONG_PTR uStackBase,
+    _In_ SIZE_T uStackSize,
+    _Out_ PHANDLE pThreadId
+)
+{
+    *pThreadId = NULL;
+
+    HANDLE hdlProcess = NULL;
+    MX_RETURN_IF_FAIL(ObOpenObjectByPointer(
+        pMxProcess->Process,
+        OBJ_KERNEL_HANDLE,
+        NULL,
+        PROCESS_ALL_ACCESS,
+        *PsProcessType,
+        KernelMode,
+        &hdlProcess
+    ));
+    AUTO_RESOURCE(hdlProcess, ZwClose);
+
+    PMX_THREAD pMxThread = NULL;
+    MX_RETURN_IF_FAIL(MxThreadAllocate(&pMxThread));
+    AUTO_RESOURCE(pMxThread, MxThreadFree);
+
+    pMxThread->StackBase = uStackBase;
+    pMxThread->StackSize = uStackSize;
+
+    PS_PICO_THREAD_ATTRIBUTES psPicoThreadAttributes
+    {
+        .Process = hdlProcess,
+        .UserStack = uStackBase + uStackSize,
+        .StartRoutine = uStartRoutine,
+        .StartParameter1 = uArgument,
+#ifdef _M_AMD64
+        // The first argument register of the System V ABI.
+        .Rdi = uArgument,
+#endif
+        .Context = pMxThread
+    };
+
+    PS_PICO_CREATE_INFO psPicoCreateInfo
+    {
+        .FileObject = pMxProcess->MainExecutable,
+        .ImageFileName = &pMxProcess->ExecutableName->Name
+    };
+
+    HANDLE hdlThread = NULL;
+    MX_RETURN_IF_FAIL(MxRoutines.CreateThread(&psPicoThreadAttributes,
+        &psPicoCreateInfo, &hdlThread));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    // Unlike the main thread, NT holds no reference, only the thread list does.
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlThread,
+        THREAD_ALL_ACCESS,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&pMxThread->Thread,
+        NULL
+    ));
+
+    MxProcessApplyPlacement(pMxProcess, pMxThread->Thread);
+
+    ExAcquireFastMutex(&pMxProcess->ThreadsLock);
+    InsertTailList(&pMxProcess->Threads, &pMxThread->Link);
+    ExReleaseFastMutex(&pMxProcess->ThreadsLock);
+
+    *pThreadId = PsGetThreadId(pMxThread->Thread);
+
+    MxRoutines.ResumeThread(pMxThread->Thread, NULL);
+    pMxThread = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+VOID
+MxProcessAddChild(
+    _Inout_ PMX_PROCESS pMxParentProcess,
+    _Inout_ PMX_PROCESS pMxChildProcess
+)
+{
+    MxLockProcessTree();
+
+    // A parent that is exiting already would never let go of the child.
+    if (!pMxParentProcess->Exited)
+    {
+        InterlockedIncrementSizeT(&pMxParentProcess->ReferenceCount);
+        InterlockedIncrementSizeT(&pMxChildProcess->ReferenceCount);
+        pMxChildProcess->Parent = pMxParentProcess;
+
+        // The child runs as soon as it is created, and may be gone already.
+        InsertTailList(pMxChildProcess->Exited
+            ? &pMxParentProcess->ExitedChildren : &pMxParentProcess->Children,
+            &pMxChildProcess->SiblingLink);
+
+        if (pMxChildProcess->Exited)
+        {
+            KeSetEvent(&pMxParentProcess->ChildExited, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    MxUnlockProcessTree();
+}
+
+extern "C"
+BOOLEAN
+MxProcessHasChildren(
+    _In_ PMX_PROCESS pMxProcess
+)
+{
+    MxLockProcessTree();
+
+    BOOLEAN bHasChildren = !IsListEmpty(&pMxProcess->Children)
+        || !IsListEmpty(&pMxProcess->ExitedChildren);
+
+    MxUnlockProcessTree();
+
+    return bHasChildren;
+}
+
+extern "C"
+VOID
+MxProcessNotifyExit(
+    _Inout_ PMX_PROCESS pMxProcess
+)
+{
+    LIST_ENTRY freeList;
+    InitializeListHead(&freeList);
+
+    MxLockProcessTree();
+
+    // Every thread of the process may race to exit it.
+    if (pMxProcess->Exited)
+    {
+        MxUnlockProcessTree();
+        return;
+    }
+
+    pMxProcess->Exited = TRUE;
+
+    if (pMxProcess->Parent != NULL)
+    {
+        RemoveEntryList(&pMxProcess->SiblingLink);
+        InsertTailList(&pMxProcess->Parent->ExitedChildren, &pMxProcess->SiblingLink);
+        KeSetEvent(&pMxProcess->Parent->ChildExited, IO_NO_INCREMENT, FALSE);
+    }
+
+    PLIST_ENTRY pChildLists[] = { &pMxProcess->Children, &pMxProcess->ExitedChildren };
+    for (PLIST_ENTRY pList : pChildLists)
+    {
+        while (!IsListEmpty(pList))
+        {
+            PLIST_ENTRY pEntry = RemoveHeadList(pList);
+            PMX_PROCESS pMxChildProcess = CONTAINING_RECORD(pEntry, MX_PROCESS, SiblingLink);
+
+            pMxChildProcess->Parent = NULL;
+
+            // The reference of the child. The caller still holds one of its own.
+            ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pMxProcess->ReferenceCount);
+            UNREFERENCED_PARAMETER(uNewCount);
+            ASSERT(uNewCount != 0);
+
+            InsertTailList(&freeList, pEntry);
+        }
+    }
+
+    MxUnlockProcessTree();
+
+    // Outside of the lock, children may drop the last references to their own children.
+    while (!IsListEmpty(&freeList))
+    {
+        PLIST_ENTRY pEntry = RemoveHeadList(&freeList);
+        InitializeListHead(pEntry);
+        MxProcessFree(CONTAINING_RECORD(pEntry, MX_PROCESS, SiblingLink));
+    }
+}
+
+extern "C"
+NTSTATUS
+MxProcessWaitChild(
+    _Inout_ PMX_PROCESS pMxProcess,
+    _In_ INT iPid,
+    _In_ BOOLEAN bWait,
+    _Out_ PINT pIChildPid,
+    _Out_ PNTSTATUS pChildExitStatus
+)
+{
+    *pIChildPid = 0;
+    *pChildExitStatus = STATUS_SUCCESS;
+
+    const auto Matches = [&](PLIST_ENTRY pEntry)
+    {
+        PMX_PROCESS pMxChildProcess = CONTAINING_RECORD(pEntry, MX_PROCESS, SiblingLink);
+        return iPid == -1 || HandleToULong(PsGetProcessId(pMxChildProcess->Process)) == (ULONG)iPid;
+    };
+
+    const auto Find = [&](PLIST_ENTRY pList) -> PLIST_ENTRY
+    {
+        // Any child is always the first one, only specific IDs need a search.
+        for (PLIST_ENTRY pEntry = pList->Flink; pEntry != pList; pEntry = pEntry->Flink)
+        {
+            if (Matches(pEntry))
+            {
+                return pEntry;
+            }
+        }
+
+        return NULL;
+    };
+
+    while (TRUE)
+    {
+        MxLockProcessTree();
+
+        PLIST_ENTRY pReaped = Find(&pMxProcess->ExitedChildren);
+        BOOLEAN bRunning = FALSE;
+
+        if (pReaped != NULL)
+        {
+            RemoveEntryList(pReaped);
+            InitializeListHead(pReaped);
+        }
+        else
+        {
+            bRunning = Find(&pMxProcess->Children) != NULL;
+
+            // Under the lock, so that an exit between here and the wait is not missed.
+            KeClearEvent(&pMxProcess->ChildExited);
+        }
+
+        MxUnlockProcessTree();
+
+        if (pReaped != NULL)
+        {
+            PMX_PROCESS pMxChildProcess = CONTAINING_RECORD(pReaped, MX_PROCESS, SiblingLink);
+            *pIChildPid = (INT)HandleToULong(PsGetProcessId(pMxChildProcess->Process));
+            *pChildExitStatus = pMxChildProcess->ExitStatus;
+
+            // The reference of the parent.
+            MxProcessFree(pMxChildProcess);
+            return STATUS_SUCCESS;
+        }
+
+        if (!bRunning)
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        if (!bWait)
+        {
+            return STATUS_TIMEOUT;
+        }
+
+        // Alertable, so that the parent can still be terminated while it waits.
+        NTSTATUS status = KeWaitForSingleObject(&pMxProcess->ChildExited, UserRequest,
+            UserMode, TRUE, NULL);
+
+        if (status != STATUS_SUCCESS)
+        {
+            return status;
+        }
+    }
+}
+
+extern "C"
+NTSTATUS
+MxProcessGetCallerContext(
+    _In_ ULONG_PTR uReturnValue,
+    _Out_ PCONTEXT pContext
+)
+{
+    PMX_THREAD pMxThread = (PMX_THREAD)MxRoutines.GetThreadContext(PsGetCurrentThread());
+
+    RtlZeroMemory(pContext, sizeof(CONTEXT));
+    pContext->ContextFlags = CONTEXT_ALL;
+    MX_RETURN_IF_FAIL(MxRoutines.GetContextThreadInternal(
+        PsGetCurrentThread(),
+        pContext,
+        KernelMode,
+        UserMode,
+        FALSE
+    ));
+
+#ifdef _M_AMD64
+    pContext->Rax = uReturnValue;
+
+    if (pMxThread != NULL && pMxThread->CurrentSystemCall != NULL)
+    {
+        // Restore the "real" context from system call information.
+        PKTRAP_FRAME pTrapFrame = pMxThread->CurrentSystemCall->TrapFrame;
+        pContext->Rcx = pTrapFrame->Rcx;
+        pContext->Rdx = pTrapFrame->Rdx;
+        pContext->Rbx = pTrapFrame->Rbx;
+        pContext->Rbp = pTrapFrame->Rbp;
+        pContext->Rsi = pTrapFrame->Rsi;
+        pContext->Rdi = pTrapFrame->Rdi;
+        pContext->R8 = pTrapFrame->R8;
+        pContext->R9 = pTrapFrame->R9;
+        pContext->R10 = pTrapFrame->R10;
+        pContext->R11 = pTrapFrame->R11;
+        pContext->EFlags = pTrapFrame->EFlags;
+    }
+#elif defined(_M_ARM64)
+    pContext->X0 = uReturnValue;
+
+    if (pMxThread != NULL && pMxThread->CurrentSystemCall != NULL)
+    {
+        // Restore the "real" context from system call information.
+        PKTRAP_FRAME pTrapFrame = pMxThread->CurrentSystemCall->TrapFrame;
+        pContext->X1 = pTrapFrame->X1;
+        pContext->X2 = pTrapFrame->X2;
+        pContext->X3 = pTrapFrame->X3;
+        pContext->X4 = pTrapFrame->X4;
+        pContext->X5 = pTrapFrame->X5;
+        pContext->X6 = pTrapFrame->X6;
+        pContext->X7 = pTrapFrame->X7;
+        pContext->X8 = pTrapFrame->X8;
+        pContext->X9 = pTrapFrame->X9;
+        pContext->X10 = pTrapFrame->X10;
+        pContext->X11 = pTrapFrame->X11;
+        pContext->X12 = pTrapFrame->X12;
+        pContext->X13 = pTrapFrame->X13;
+        pContext->X14 = pTrapFrame->X14;
+        pContext->X15 = pTrapFrame->X15;
+        pContext->X16 = pTrapFrame->X16;
+        pContext->X17 = pTrapFrame->X17;
+        pContext->X18 = pTrapFrame->X18;
+        pContext->Lr = pTrapFrame->Lr;
+        pContext->Fp = pTrapFrame->Fp;
+        pContext->Pc = pTrapFrame->Pc;
+        pContext->Sp = pTrapFrame->Sp;
+        memcpy(&pContext->Bcr, &pTrapFrame->Bcr, sizeof(pContext->Bcr));
+        memcpy(&pContext->Bvr, &pTrapFrame->Bvr, sizeof(pContext->Bvr));
+        memcpy(&pContext->Wcr, &pTrapFrame->Wcr, sizeof(pContext->Wcr));
+        memcpy(&pContext->Wvr, &pTrapFrame->Wvr, sizeof(pContext->Wvr));
+    }
+#else
+#error Set the context for this architecture!
+#endif
+
+    return STATUS_SUCCESS;
+}
+
 extern "C"
 NTSTATUS
 MxProcessFork(
@@ -531,27 +1419,17 @@ MxProcessFork(
     _Out_ PMX_PROCESS* pPMxProcess
 )
 {
-    PMX_PROCESS pMxProcess = (PMX_PROCESS)
-        ExAllocatePoolZero(PagedPool, sizeof(MX_PROCESS), MX_POOL_TAG);
+    PMX_PROCESS pMxProcess = MxProcessAllocate();
     if (pMxProcess == NULL)
     {
         return STATUS_NO_MEMORY;
     }
     AUTO_RESOURCE(pMxProcess, MxProcessFree);
-    pMxProcess->ReferenceCount = 1;
-
-    ULONG uNameLen = 0;
-    ObQueryNameString(pMxParentProcess->MainExecutable, NULL, 0, &uNameLen);
 
-    POBJECT_NAME_INFORMATION pObNameInfo = (POBJECT_NAME_INFORMATION)
-        ExAllocatePoolZero(PagedPool, uNameLen, MX_POOL_TAG);
-    if (pObNameInfo == NULL)
-    {
-        return STATUS_NO_MEMORY;
-    }
-    AUTO_RESOURCE(pObNameInfo, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
-    MX_RETURN_IF_FAIL(ObQueryNameString(
-        pMxParentProcess->MainExecutable, pObNameInfo, uNameLen, &uNameLen));
+    MX_RETURN_IF_FAIL(MxFileTableCopy(pMxParentProcess->Files, &pMxProcess->Files));
+    MX_RETURN_IF_FAIL(MxMemoryCopy(pMxParentProcess->Memory, &pMxProcess->Memory));
+    pMxProcess->ExecuteFlags = pMxParentProcess->ExecuteFlags;
+    pMxProcess->Placement = pMxParentProcess->Placement;
 
     HANDLE hdlParentProcess = NULL;
     MX_RETURN_IF_FAIL(ObOpenObjectByPointer(
@@ -575,7 +1453,7 @@ MxProcessFork(
     PS_PICO_CREATE_INFO psPicoCreateInfo
     {
         .FileObject = pMxParentProcess->MainExecutable,
-        .ImageFileName = &pObNameInfo->Name
+        .ImageFileName = &pMxParentProcess->ExecutableName->Name
     };
 
     HANDLE hdlProcess = NULL;
@@ -598,17 +1476,16 @@ MxProcessFork(
         ObDereferenceObject(pProcess);
     });
 
-    CONTEXT ctxParent
+    if (pMxParentProcess->SharedPage != NULL)
     {
-        .ContextFlags = CONTEXT_ALL
-    };
-    MX_RETURN_IF_FAIL(MxRoutines.GetContextThreadInternal(
-        pMxParentProcess->Thread,
-        &ctxParent,
-        KernelMode,
-        UserMode,
-        FALSE
-    ));
+        // The clone shares the view of the parent, which would show it the wrong process ID.
+        MX_RETURN_IF_FAIL(ZwUnmapViewOfSection(hdlProcess, MX_SHARED_PAGE_ADDRESS));
+        MX_RETURN_IF_FAIL(MxSharedPageCreate(hdlProcess, pProcess, &pMxProcess->SharedPage));
+    }
+
+    // Like fork(2), only the calling thread is carried over, and sees 0 returned.
+    CONTEXT ctxParent;
+    MX_RETURN_IF_FAIL(MxProcessGetCallerContext(0, &ctxParent));
 
     PMX_THREAD pMxThread = NULL;
     MX_RETURN_IF_FAIL(MxThreadAllocate(&pMxThread));
@@ -651,65 +1528,6 @@ MxProcessFork(
         ObDereferenceObject(pThread);
     });
 
-#ifdef _M_AMD64
-    // Syscall return result.
-    ctxParent.Rax = 0;
-
-    if (pMxParentProcess->MxThread->CurrentSystemCall != NULL)
-    {
-        // Restore the "real" context from system call information.
-        PKTRAP_FRAME pTrapFrame = pMxParentProcess->MxThread->CurrentSystemCall->TrapFrame;
-        ctxParent.Rcx = pTrapFrame->Rcx;
-        ctxParent.Rdx = pTrapFrame->Rdx;
-        ctxParent.Rbx = pTrapFrame->Rbx;
-        ctxParent.Rbp = pTrapFrame->Rbp;
-        ctxParent.Rsi = pTrapFrame->Rsi;
-        ctxParent.Rdi = pTrapFrame->Rdi;
-        ctxParent.R8 = pTrapFrame->R8;
-        ctxParent.R9 = pTrapFrame->R9;
-        ctxParent.R10 = pTrapFrame->R10;
-        ctxParent.R11 = pTrapFrame->R11;
-        ctxParent.EFlags = pTrapFrame->EFlags;
-    }
-#elif defined(_M_ARM64)
-    // Syscall return result.
-    ctxParent.X0 = 0;
-
-    if (pMxParentProcess->MxThread->CurrentSystemCall != NULL)
-    {
-        // Restore the "real" context from system call information.
-        PKTRAP_FRAME pTrapFrame = pMxParentProcess->MxThread->CurrentSystemCall->TrapFrame;
-        ctxParent.X1 = pTrapFrame->X1;
-        ctxParent.X2 = pTrapFrame->X2;
-        ctxParent.X3 = pTrapFrame->X3;
-        ctxParent.X4 = pTrapFrame->X4;
-        ctxParent.X5 = pTrapFrame->X5;
-        ctxParent.X6 = pTrapFrame->X6;
-        ctxParent.X7 = pTrapFrame->X7;
-        ctxParent.X8 = pTrapFrame->X8;
-        ctxParent.X9 = pTrapFrame->X9;
-        ctxParent.X10 = pTrapFrame->X10;
-        ctxParent.X11 = pTrapFrame->X11;
-        ctxParent.X12 = pTrapFrame->X12;
-        ctxParent.X13 = pTrapFrame->X13;
-        ctxParent.X14 = pTrapFrame->X14;
-        ctxParent.X15 = pTrapFrame->X15;
-        ctxParent.X16 = pTrapFrame->X16;
-        ctxParent.X17 = pTrapFrame->X17;
-        ctxParent.X18 = pTrapFrame->X18;
-        ctxParent.Lr = pTrapFrame->Lr;
-        ctxParent.Fp = pTrapFrame->Fp;
-        ctxParent.Pc = pTrapFrame->Pc;
-        ctxParent.Sp = pTrapFrame->Sp;
-        memcpy(&ctxParent.Bcr, &pTrapFrame->Bcr, sizeof(ctxParent.Bcr));
-        memcpy(&ctxParent.Bvr, &pTrapFrame->Bvr, sizeof(ctxParent.Bvr));
-        memcpy(&ctxParent.Wcr, &pTrapFrame->Wcr, sizeof(ctxParent.Wcr));
-        memcpy(&ctxParent.Wvr, &pTrapFrame->Wvr, sizeof(ctxParent.Wvr));
-    }
-#else
-#error Set the context for this architecture!
-#endif
-
     MX_RETURN_IF_FAIL(MxRoutines.SetContextThreadInternal(
         pThread,
         &ctxParent,
@@ -718,12 +1536,17 @@ MxProcessFork(
         FALSE
     ));
 
+    MxProcessApplyPlacement(pMxProcess, pThread);
+
     InterlockedIncrementSizeT(&pMxProcess->ReferenceCount);
 
     pMxProcess->Process = pProcess;
     pProcess = NULL;
     pMxProcess->Thread = pThread;
     pThread = NULL;
+    // One more reference for the thread list.
+    MxThreadReference(pMxThread);
+    InsertTailList(&pMxProcess->Threads, &pMxThread->Link);
     pMxProcess->MxThread = pMxThread;
     pMxThread = NULL;
 
@@ -733,7 +1556,13 @@ MxProcessFork(
     ObReferenceObject(pMxParentProcess->MainExecutable);
     pMxProcess->MainExecutable = pMxParentProcess->MainExecutable;
 
+    InterlockedIncrementSizeT(&pMxParentProcess->ExecutableName->ReferenceCount);
+    pMxProcess->ExecutableName = pMxParentProcess->ExecutableName;
+
     pMxProcess->UserStack = pMxParentProcess->UserStack;
+    pMxProcess->EntryPoint = pMxParentProcess->EntryPoint;
+    pMxProcess->ProgramHeaders = pMxParentProcess->ProgramHeaders;
+    pMxProcess->ProgramHeadersCount = pMxParentProcess->ProgramHeadersCount;
 
     // We have to properly set the context before allowing execution.
     MxRoutines.ResumeThread(pMxProcess->Thread, NULL);
@@ -3,9 +3,13 @@
 #include <monika.h>
 
 #include "console.h"
+#include "file.h"
+#include "memory.h"
+#include "os.h"
 #include "process.h"
 #include "syscall.h"
 #include "thread.h"
+#include "warmpool.h"
 
 #include "AutoResource.h"
 
@@ -28,40 +32,278 @@ MA_PICO_ROUTINES MxAdditionalRoutines
     }                               \
     while (FALSE)
 
+//
+// System call table
+//
+
+// Handlers get all arguments decoded up front, only the first Arity of them are meaningful.
+typedef INT_PTR MX_SYSCALL_HANDLER(_In_ const UINT_PTR* pArgs);
+
+typedef struct _MX_SYSCALL_ENTRY {
+    INT Number;
+    ULONG Arity;
+    PCSTR Name;
+    MX_SYSCALL_HANDLER* Handler;
+} MX_SYSCALL_ENTRY;
+
+// Syscall numbers are defined here:
+// https://github.com/itsmevjnk/sysx/blob/main/exec/syscall.h
+// SysX calls come first, numbered from 0, followed by the Monix extensions, numbered from
+// SYSCALL_MONIX_BASE. Both ranges are dense, so that lookups are just a bounds check.
+static constexpr MX_SYSCALL_ENTRY MxSystemCallTable[] =
+{
+    { SYSCALL_EXIT, 1, "exit", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallExit((INT)pArgs[0]); } },
+    { SYSCALL_READ, 3, "read", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallRead((INT)pArgs[0], (PVOID)pArgs[1], (SIZE_T)pArgs[2]); } },
+    { SYSCALL_WRITE, 3, "write", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallWrite((INT)pArgs[0], (PVOID)pArgs[1], (SIZE_T)pArgs[2]); } },
+    { SYSCALL_FORK, 0, "fork", [](const UINT_PTR*) -> INT_PTR
+        { return SyscallFork(); } },
+    { SYSCALL_URING_SETUP, 1, "uring_setup", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallUringSetup((UINT)pArgs[0]); } },
+    { SYSCALL_URING_ENTER, 1, "uring_enter", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallUringEnter((UINT)pArgs[0]); } },
+    { SYSCALL_MMAP, 6, "mmap", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallMmap((PVOID)pArgs[0], (SIZE_T)pArgs[1], (INT)pArgs[2], (INT)pArgs[3],
+            (INT)pArgs[4], (INT_PTR)pArgs[5]); } },
+    { SYSCALL_MUNMAP, 2, "munmap", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallMunmap((PVOID)pArgs[0], (SIZE_T)pArgs[1]); } },
+    { SYSCALL_BRK, 1, "brk", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallBrk((PVOID)pArgs[0]); } },
+    { SYSCALL_SPAWN, 2, "spawn", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallSpawn((PCSTR)pArgs[0], (INT)pArgs[1]); } },
+    { SYSCALL_THREAD_CREATE, 3, "thread_create", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallThreadCreate((PVOID)pArgs[0], (PVOID)pArgs[1], (SIZE_T)pArgs[2]); } },
+    { SYSCALL_THREAD_EXIT, 1, "thread_exit", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallThreadExit((INT)pArgs[0]); } },
+    { SYSCALL_WAITPID, 3, "waitpid", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallWaitPid((INT)pArgs[0], (PINT)pArgs[1], (INT)pArgs[2]); } },
+    { SYSCALL_CHECKPOINT, 1, "checkpoint", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallCheckpoint((PCSTR)pArgs[0]); } },
+    { SYSCALL_OPEN, 2, "open", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallOpen((PCSTR)pArgs[0], (INT)pArgs[1]); } },
+    { SYSCALL_CLOSE, 1, "close", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallClose((INT)pArgs[0]); } },
+    { SYSCALL_LSEEK, 3, "lseek", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return (INT_PTR)SyscallLseek((INT)pArgs[0], (INT64)pArgs[1], (INT)pArgs[2]); } },
+    { SYSCALL_PIPE, 1, "pipe", [](const UINT_PTR* pArgs) -> INT_PTR
+        { return SyscallPipe((PINT)pArgs[0]); } },
+};
+
+static
+constexpr
+INT
+MxLookupSystemCall(
+    _In_ INT iSysNum
+)
+{
+    if (iSysNum >= 0 && iSysNum < SYSCALL_SYSX_COUNT)
+    {
+        return iSysNum;
+    }
+
+    if (iSysNum >= SYSCALL_MONIX_BASE && iSysNum < SYSCALL_MONIX_BASE + SYSCALL_MONIX_COUNT)
+    {
+        return SYSCALL_SYSX_COUNT + (iSysNum - SYSCALL_MONIX_BASE);
+    }
+
+    return -1;
+}
+
+static_assert(ARRAYSIZE(MxSystemCallTable) == MX_SYSCALL_COUNT);
+static_assert([]()
+{
+    for (INT i = 0; i < (INT)ARRAYSIZE(MxSystemCallTable); ++i)
+    {
+        if (MxLookupSystemCall(MxSystemCallTable[i].Number) != i
+            || MxSystemCallTable[i].Arity > 6)
+        {
+            return false;
+        }
+    }
+    return true;
+}(), "MxSystemCallTable must be sorted and dense within each range.");
+
+//
+// System call statistics
+//
+
+// Per processor, so that counting does not bounce cache lines between processors.
+typedef struct DECLSPEC_CACHEALIGN _MX_SYSCALL_CPU_STATISTICS {
+    volatile LONG64 Calls[MX_SYSCALL_COUNT];
+    volatile LONG64 Cycles[MX_SYSCALL_COUNT];
+    volatile LONG64 Unknown;
+    // Not a system call, but counted for the same readers.
+    volatile LONG64 HandledFaults;
+} MX_SYSCALL_CPU_STATISTICS, *PMX_SYSCALL_CPU_STATISTICS;
+
+static PMX_SYSCALL_CPU_STATISTICS MxSystemCallStatistics = NULL;
+static ULONG MxSystemCallStatisticsCount = 0;
+
+// Interrupt time before which unknown system calls are counted but not logged.
+static volatile LONG64 MxUnknownSystemCallNextLog = 0;
+#define MX_UNKNOWN_SYSCALL_LOG_INTERVAL         (10 * 1000 * 1000)
+
+extern "C"
+NTSTATUS
+MxInitializeSystemCallStatistics()
+{
+    ULONG uCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    PMX_SYSCALL_CPU_STATISTICS pStatistics = (PMX_SYSCALL_CPU_STATISTICS)ExAllocatePoolZero(
+        NonPagedPoolNx, uCount * sizeof(MX_SYSCALL_CPU_STATISTICS), '  xM');
+
+    if (pStatistics == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    MxSystemCallStatistics = pStatistics;
+    MxSystemCallStatisticsCount = uCount;
+
+    return STATUS_SUCCESS;
+}
+
 extern "C"
 VOID
-MxSystemCallDispatch(
-    _In_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+MxCleanupSystemCallStatistics()
+{
+    if (MxSystemCallStatistics != NULL)
+    {
+        ExFreePoolWithTag(MxSystemCallStatistics, '  xM');
+        MxSystemCallStatistics = NULL;
+        MxSystemCallStatisticsCount = 0;
+    }
+}
+
+static
+PMX_SYSCALL_CPU_STATISTICS
+MxGetCpuSystemCallStatistics()
+{
+    ULONG uIndex = KeGetCurrentProcessorNumberEx(NULL);
+
+    if (uIndex >= MxSystemCallStatisticsCount)
+    {
+        return NULL;
+    }
+
+    return &MxSystemCallStatistics[uIndex];
+}
+
+static
+VOID
+MxReportUnknownSystemCall(
+    _In_ INT iSysNum
+)
+{
+    PMX_SYSCALL_CPU_STATISTICS pStatistics = MxGetCpuSystemCallStatistics();
+    if (pStatistics != NULL)
+    {
+        InterlockedIncrement64(&pStatistics->Unknown);
+    }
+
+    // A program probing for syscalls in a loop should not flood the debugger.
+    LONG64 iNow = (LONG64)KeQueryInterruptTime();
+    LONG64 iNextLog = MxUnknownSystemCallNextLog;
+
+    if (iNow >= iNextLog
+        && InterlockedCompareExchange64(&MxUnknownSystemCallNextLog,
+            iNow + MX_UNKNOWN_SYSCALL_LOG_INTERVAL, iNextLog) == iNextLog)
+    {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "Unimplemented syscall: %x\n", iSysNum));
+    }
+}
+
+extern "C"
+NTSTATUS
+MxQuerySystemCallStatistics(
+    _Out_writes_to_(uCount, *pUReturned) PMX_SYSCALL_STATISTICS pEntries,
+    _In_ ULONG uCount,
+    _Out_ PULONG pUReturned,
+    _Out_ PULONG64 pUUnknown,
+    _Out_ PULONG64 pUHandledFaults
+)
+{
+    *pUReturned = 0;
+    *pUUnknown = 0;
+    *pUHandledFaults = 0;
+
+    ULONG uReturned = min(uCount, (ULONG)MX_SYSCALL_COUNT);
+
+    for (ULONG i = 0; i < uReturned; ++i)
+    {
+        pEntries[i] =
+        {
+            .Number = MxSystemCallTable[i].Number,
+            .Arity = MxSystemCallTable[i].Arity
+        };
+        strncpy(pEntries[i].Name, MxSystemCallTable[i].Name, sizeof(pEntries[i].Name) - 1);
+    }
+
+    // Not a snapshot, counters keep moving on other processors while they are summed.
+    for (ULONG uCpu = 0; uCpu < MxSystemCallStatisticsCount; ++uCpu)
+    {
+        PMX_SYSCALL_CPU_STATISTICS pStatistics = &MxSystemCallStatistics[uCpu];
+
+        for (ULONG i = 0; i < uReturned; ++i)
+        {
+            pEntries[i].Calls += (ULONG64)pStatistics->Calls[i];
+            pEntries[i].Cycles += (ULONG64)pStatistics->Cycles[i];
+        }
+
+        *pUUnknown += (ULONG64)pStatistics->Unknown;
+        *pUHandledFaults += (ULONG64)pStatistics->HandledFaults;
+    }
+
+    *pUReturned = uReturned;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// System call dispatch
+//
+
+static
+INT
+MxDecodeSystemCall(
+    _In_ PKTRAP_FRAME pTrapFrame,
+    _Out_writes_(6) UINT_PTR* pArgs
 )
 {
 #ifdef _M_AMD64
-    INT iSysNum = (INT)SystemCall->TrapFrame->Rax;
-    UINT_PTR uArg1 = SystemCall->TrapFrame->Rdi;
-    UINT_PTR uArg2 = SystemCall->TrapFrame->Rsi;
-    UINT_PTR uArg3 = SystemCall->TrapFrame->Rdx;
-    UINT_PTR uArg4 = SystemCall->TrapFrame->R10;
-    UINT_PTR uArg5 = SystemCall->TrapFrame->R8;
-    UINT_PTR uArg6 = SystemCall->TrapFrame->R9;
+    pArgs[0] = pTrapFrame->Rdi;
+    pArgs[1] = pTrapFrame->Rsi;
+    pArgs[2] = pTrapFrame->Rdx;
+    pArgs[3] = pTrapFrame->R10;
+    pArgs[4] = pTrapFrame->R8;
+    pArgs[5] = pTrapFrame->R9;
+    return (INT)pTrapFrame->Rax;
 #elif defined(_M_ARM64)
-    INT iSysNum = (INT)SystemCall->TrapFrame->X8;
-    UINT_PTR uArg1 = SystemCall->TrapFrame->X0;
-    UINT_PTR uArg2 = SystemCall->TrapFrame->X1;
-    UINT_PTR uArg3 = SystemCall->TrapFrame->X2;
-    UINT_PTR uArg4 = SystemCall->TrapFrame->X3;
-    UINT_PTR uArg5 = SystemCall->TrapFrame->X4;
-    UINT_PTR uArg6 = SystemCall->TrapFrame->X5;
+    pArgs[0] = pTrapFrame->X0;
+    pArgs[1] = pTrapFrame->X1;
+    pArgs[2] = pTrapFrame->X2;
+    pArgs[3] = pTrapFrame->X3;
+    pArgs[4] = pTrapFrame->X4;
+    pArgs[5] = pTrapFrame->X5;
+    return (INT)pTrapFrame->X8;
 #else
 #error Detect the syscall arguments for this architecture!
 #endif
+}
 
-    INT_PTR iRet = -1;
+extern "C"
+VOID
+MxSystemCallDispatch(
+    _In_ PPS_PICO_SYSTEM_CALL_INFORMATION SystemCall
+)
+{
+    UINT_PTR pArgs[6];
+    INT iSysNum = MxDecodeSystemCall(SystemCall->TrapFrame, pArgs);
 
-    UNREFERENCED_PARAMETER(uArg1);
-    UNREFERENCED_PARAMETER(uArg2);
-    UNREFERENCED_PARAMETER(uArg3);
-    UNREFERENCED_PARAMETER(uArg4);
-    UNREFERENCED_PARAMETER(uArg5);
-    UNREFERENCED_PARAMETER(uArg6);
+    INT_PTR iRet = -1;
 
     PMX_THREAD pMxThread = (PMX_THREAD)MxRoutines.GetThreadContext(PsGetCurrentThread());
     if (pMxThread != NULL)
@@ -69,33 +311,38 @@ MxSystemCallDispatch(
         pMxThread->CurrentSystemCall = SystemCall;
     }
 
-    // Syscall numbers are defined here:
-    // https://github.com/itsmevjnk/sysx/blob/main/exec/syscall.h
-    switch (iSysNum)
+    INT iIndex = MxLookupSystemCall(iSysNum);
+
+    if (iIndex >= 0)
     {
-        case SYSCALL_EXIT:  // 0
-        {
-            iRet = SyscallExit((INT)uArg1);
-        }
-        break;
-        case SYSCALL_READ:  // 1
-        {
-            DbgBreakPoint();
-        }
-        break;
-        case SYSCALL_WRITE: // 2
+        ULONG64 uStart = ReadTimeStampCounter();
+
+        iRet = MxSystemCallTable[iIndex].Handler(pArgs);
+
+        ULONG64 uCycles = ReadTimeStampCounter() - uStart;
+
+        // Whichever processor we ended up on, the counters are only ever added to.
+        PMX_SYSCALL_CPU_STATISTICS pStatistics = MxGetCpuSystemCallStatistics();
+        if (pStatistics != NULL)
         {
-            iRet = SyscallWrite((INT)uArg1, (PVOID)uArg2, (SIZE_T)uArg3);
+            InterlockedIncrement64(&pStatistics->Calls[iIndex]);
+            InterlockedAdd64(&pStatistics->Cycles[iIndex], (LONG64)uCycles);
         }
-        break;
-        case SYSCALL_FORK:  // 3
+    }
+    // Monix processes pushed on top of another provider leave the calls they do not know to it,
+    // which then sets the return value itself.
+    else if (MxAdditionalRoutines.ForwardSystemCall != NULL
+        && NT_SUCCESS(MxAdditionalRoutines.ForwardSystemCall(SystemCall)))
+    {
+        if (pMxThread != NULL)
         {
-            iRet = SyscallFork();
+            pMxThread->CurrentSystemCall = NULL;
         }
-        break;
-        default:
-            KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
-                "Unimplemented syscall: %x\n", iSysNum));
+        return;
+    }
+    else
+    {
+        MxReportUnknownSystemCall(iSysNum);
     }
 
 #ifdef _M_AMD64
@@ -121,13 +368,81 @@ MxThreadExit(
     UNREFERENCED_PARAMETER(Thread);
 }
 
+//
+// Asynchronous sessions
+//
+
+typedef struct _MX_SESSION {
+    LIST_ENTRY Link;
+    PMX_PROCESS MxProcess;
+    PMA_PICO_SESSION_COMPLETION Completion;
+    PVOID CompletionContext;
+} MX_SESSION, *PMX_SESSION;
+
+// Keyed by the NT process, as the process context may already be gone when NT reports the exit.
+static LIST_ENTRY MxSessionList = { &MxSessionList, &MxSessionList };
+static EX_PUSH_LOCK MxSessionLock = 0;
+
+// Whoever takes the session off the list completes it, so that happens exactly once.
+static
+PMX_SESSION
+MxTakeSession(
+    _In_ PEPROCESS pProcess
+)
+{
+    PMX_SESSION pFound = NULL;
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&MxSessionLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+
+    for (PLIST_ENTRY pEntry = MxSessionList.Flink; pEntry != &MxSessionList;
+        pEntry = pEntry->Flink)
+    {
+        PMX_SESSION pSession = CONTAINING_RECORD(pEntry, MX_SESSION, Link);
+        if (pSession->MxProcess->Process == pProcess)
+        {
+            RemoveEntryList(pEntry);
+            pFound = pSession;
+            break;
+        }
+    }
+
+    ExReleasePushLockExclusiveEx(&MxSessionLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+
+    return pFound;
+}
+
+static
+VOID
+MxCompleteSession(
+    _In_ PMX_SESSION pSession
+)
+{
+    PMX_PROCESS pMxProcess = pSession->MxProcess;
+
+    // Processes terminated from outside never get to SyscallExit.
+    NTSTATUS statusExecute = pMxProcess->Exited
+        ? pMxProcess->ExitStatus : PsGetProcessExitStatus(pMxProcess->Process);
+
+    pSession->Completion(pSession->CompletionContext, statusExecute);
+
+    MxProcessFree(pMxProcess);
+    ExFreePoolWithTag(pSession, '  xM');
+}
+
 extern "C"
 VOID
 MxProcessExit(
     _In_ PEPROCESS Process
 )
 {
-    UNREFERENCED_PARAMETER(Process);
+    PMX_SESSION pSession = MxTakeSession(Process);
+
+    if (pSession != NULL)
+    {
+        MxCompleteSession(pSession);
+    }
 }
 
 extern "C"
@@ -140,13 +455,42 @@ MxDispatchException(
     _In_ KPROCESSOR_MODE PreviousMode
 )
 {
-    UNREFERENCED_PARAMETER(ExceptionRecord);
     UNREFERENCED_PARAMETER(ExceptionFrame);
     UNREFERENCED_PARAMETER(TrapFrame);
     UNREFERENCED_PARAMETER(Chance);
-    UNREFERENCED_PARAMETER(PreviousMode);
 
-    return FALSE;
+    if (PreviousMode != UserMode
+        || (ExceptionRecord->ExceptionCode != STATUS_ACCESS_VIOLATION
+            && ExceptionRecord->ExceptionCode != STATUS_GUARD_PAGE_VIOLATION)
+        || ExceptionRecord->NumberParameters < 2)
+    {
+        return FALSE;
+    }
+
+    PMX_PROCESS pMxProcess = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pMxProcess == NULL || pMxProcess->Memory == NULL)
+    {
+        return FALSE;
+    }
+
+    // Reserved memory touched for the first time, or the stack guard page. Commit the memory
+    // and let the access run again.
+    if (!NT_SUCCESS(MxMemoryHandleFault(pMxProcess->Memory,
+        ExceptionRecord->ExceptionInformation[1], ExceptionRecord->ExceptionInformation[0])))
+    {
+        return FALSE;
+    }
+
+    InterlockedIncrementSizeT(&pMxProcess->HandledFaults);
+
+    PMX_SYSCALL_CPU_STATISTICS pStatistics = MxGetCpuSystemCallStatistics();
+    if (pStatistics != NULL)
+    {
+        InterlockedIncrement64(&pStatistics->HandledFaults);
+    }
+
+    return TRUE;
 }
 
 extern "C"
@@ -171,11 +515,7 @@ MxWalkUserStack(
     _In_ ULONG FrameCount
 )
 {
-    UNREFERENCED_PARAMETER(TrapFrame);
-    UNREFERENCED_PARAMETER(Callers);
-    UNREFERENCED_PARAMETER(FrameCount);
-
-    return 0;
+    return MaUtilWalkUserStack(TrapFrame, Callers, FrameCount);
 }
 
 static UNICODE_STRING MxProviderName = RTL_CONSTANT_STRING(L"Monix-0.0.1-prealpha");
@@ -190,10 +530,54 @@ MxGetAllocatedProviderName(
     return STATUS_SUCCESS;
 }
 
+static
+VOID
+MxSessionResumeProcess(
+    _Inout_ PMX_SESSION pSession,
+    _In_ PMX_PROCESS pMxProcess,
+    _In_ PMA_PICO_SESSION_COMPLETION pCompletion,
+    _In_opt_ PVOID pCompletionContext
+)
+{
+    pSession->MxProcess = pMxProcess;
+    pSession->Completion = pCompletion;
+    pSession->CompletionContext = pCompletionContext;
+
+    // Resumed under the lock, as the session owns the process once the exit can be reported.
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&MxSessionLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    InsertTailList(&MxSessionList, &pSession->Link);
+    MxRoutines.ResumeThread(pMxProcess->Thread, NULL);
+    ExReleasePushLockExclusiveEx(&MxSessionLock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
 extern "C"
 NTSTATUS
-MxStartSession(
-    _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes
+MxSessionStartProcess(
+    _In_ PMX_PROCESS pMxProcess,
+    _In_ PMA_PICO_SESSION_COMPLETION pCompletion,
+    _In_opt_ PVOID pCompletionContext
+)
+{
+    PMX_SESSION pSession = (PMX_SESSION)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_SESSION), '  xM');
+    if (pSession == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+
+    MxSessionResumeProcess(pSession, pMxProcess, pCompletion, pCompletionContext);
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+MxStartSessionProcess(
+    _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+    _In_ ULONG uFlags,
+    _Out_ PMX_PROCESS* pPMxProcess
 )
 {
     PEPROCESS pHostProcess = NULL;
@@ -207,18 +591,115 @@ MxStartSession(
     ));
     AUTO_RESOURCE(pHostProcess, [](auto p) { ObDereferenceObject(p); });
 
+    static UNICODE_STRING strPrefault = RTL_CONSTANT_STRING(L"--prefault");
+    static UNICODE_STRING strLargePages = RTL_CONSTANT_STRING(L"--large-pages");
+
+    for (SIZE_T i = 0; i < Attributes->ProviderArgsCount; ++i)
+    {
+        if (RtlEqualUnicodeString(&Attributes->ProviderArgs[i], &strPrefault, TRUE))
+        {
+            uFlags |= MX_EXECUTE_PREFAULT;
+        }
+        else if (RtlEqualUnicodeString(&Attributes->ProviderArgs[i], &strLargePages, TRUE))
+        {
+            uFlags |= MX_EXECUTE_LARGE_PAGES;
+        }
+    }
+
+    const MA_PICO_SESSION_PLACEMENT* pPlacement = NULL;
+    if (Attributes->Size >= RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Placement))
+    {
+        pPlacement = &Attributes->Placement;
+    }
+
+    MX_PROCESS_ARGUMENTS arguments
+    {
+        .ArgsCount = Attributes->ArgsCount,
+        .Args = Attributes->Args,
+        .EnvironmentCount = Attributes->EnvironmentCount,
+        .Environment = Attributes->Environment
+    };
+
+    // Any failure just means the session starts the usual way.
+    PMX_PROCESS pMxProcess = NULL;
+    if (NT_SUCCESS(MxWarmPoolTake(&Attributes->Args[0], Attributes->CurrentWorkingDirectory,
+        pHostProcess, uFlags, &pMxProcess)))
+    {
+        // Pooled processes were started before anyone knew their arguments.
+        NTSTATUS status = MxProcessSetArguments(pMxProcess, &arguments);
+
+        if (!NT_SUCCESS(status))
+        {
+            // Never resumed, so nothing ran in it yet.
+            MxRoutines.TerminateProcess(pMxProcess->Process, status);
+            MxProcessFree(pMxProcess);
+            pMxProcess = NULL;
+        }
+        else if (pPlacement != NULL)
+        {
+            MxProcessSetPlacement(pMxProcess, pPlacement);
+        }
+    }
+
+    if (pMxProcess == NULL)
+    {
+        // Suspended, so that nothing runs before the process is in the job of the session.
+        MX_RETURN_IF_FAIL(MxProcessExecute(
+            &Attributes->Args[0],
+            pHostProcess,
+            pHostProcess,
+            Attributes->CurrentWorkingDirectory,
+            NULL,
+            NULL,
+            &arguments,
+            uFlags | MX_EXECUTE_SUSPENDED,
+            pPlacement,
+            &pMxProcess
+        ));
+    }
+
+    // Files opened by the session resolve against its root directory, passed as a kernel handle
+    // that lxmonika closes once we return.
+    NTSTATUS status = STATUS_SUCCESS;
+    if (Attributes->RootDirectory != NULL)
+    {
+        status = MxFileTableSetRoot(pMxProcess->Files, Attributes->RootDirectory);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = MaAssignSessionProcess(Attributes, pMxProcess->Process);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // Never resumed, so nothing ran in it yet.
+        MxRoutines.TerminateProcess(pMxProcess->Process, status);
+        MxProcessFree(pMxProcess);
+        return status;
+    }
+
+    if (!(uFlags & MX_EXECUTE_SUSPENDED))
+    {
+        MxRoutines.ResumeThread(pMxProcess->Thread, NULL);
+    }
+
+    *pPMxProcess = pMxProcess;
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+NTSTATUS
+MxStartSession(
+    _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes
+)
+{
     PMX_PROCESS pNewProcess;
-    MX_RETURN_IF_FAIL(MxProcessExecute(
-        &Attributes->Args[0],
-        pHostProcess,
-        pHostProcess,
-        Attributes->CurrentWorkingDirectory,
-        &pNewProcess
-    ));
+    MX_RETURN_IF_FAIL(MxStartSessionProcess(Attributes, 0, &pNewProcess));
     AUTO_RESOURCE(pNewProcess, MxProcessFree);
 
     MX_RETURN_IF_FAIL(KeWaitForSingleObject(
-        pNewProcess->Thread,
+        pNewProcess->Process,
         Executive,
         KernelMode,
         FALSE,
@@ -232,6 +713,40 @@ MxStartSession(
     return statusExecute;
 }
 
+extern "C"
+NTSTATUS
+MxStartSessionAsync(
+    _In_ PMA_PICO_SESSION_ATTRIBUTES Attributes,
+    _In_ PMA_PICO_SESSION_COMPLETION Completion,
+    _In_opt_ PVOID CompletionContext
+)
+{
+    // Allocated first, so that nothing can fail once the process runs.
+    PMX_SESSION pSession = (PMX_SESSION)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_SESSION), '  xM');
+    if (pSession == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pSession, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    // Suspended, so that the exit cannot be reported before the session is on the list.
+    PMX_PROCESS pNewProcess;
+    MX_RETURN_IF_FAIL(MxStartSessionProcess(Attributes, MX_EXECUTE_SUSPENDED, &pNewProcess));
+
+    // Taken before the process runs, since the session frees its context when it exits.
+    if (Attributes->Size >= RTL_SIZEOF_THROUGH_FIELD(MA_PICO_SESSION_ATTRIBUTES, Process))
+    {
+        ObReferenceObject(pNewProcess->Process);
+        Attributes->Process = pNewProcess->Process;
+    }
+
+    MxSessionResumeProcess(pSession, pNewProcess, Completion, CompletionContext);
+    pSession = NULL;
+
+    return STATUS_PENDING;
+}
+
 extern "C"
 NTSTATUS
 MxGetConsole(
@@ -243,20 +758,6 @@ MxGetConsole(
 {
     PMX_PROCESS pMxProcess = (PMX_PROCESS)MxRoutines.GetProcessContext(Process);
 
-    HANDLE hdlConsole = NULL;
-    MX_RETURN_IF_FAIL(CoAttachKernelConsole(pMxProcess->HostProcess, &hdlConsole));
-    AUTO_RESOURCE(hdlConsole, ZwClose);
-
-    if (Input != NULL || Output != NULL)
-    {
-        MX_RETURN_IF_FAIL(CoOpenStandardHandles(hdlConsole, Input, Output));
-    }
-
-    if (Console != NULL)
-    {
-        *Console = hdlConsole;
-        hdlConsole = NULL;
-    }
-
-    return STATUS_SUCCESS;
+    // Shares the console attachment of the host with every other caller.
+    return MaUtilGetHostConsole(pMxProcess->HostProcess, Console, Input, Output);
 }
@@ -0,0 +1,247 @@
+#include "ring.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+NTSTATUS
+MxOutputRingCreate(
+    _In_ ULONG uSize,
+    _In_ HANDLE hdlEvent,
+    _Out_ PMX_OUTPUT_RING* pPRing,
+    _Out_ PVOID* pUserView
+)
+{
+    *pPRing = NULL;
+    *pUserView = NULL;
+
+    if (uSize < MX_OUTPUT_RING_MIN_SIZE || uSize > MX_OUTPUT_RING_MAX_SIZE
+        || (uSize & (uSize - 1)) != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PKEVENT pEvent = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlEvent,
+        EVENT_MODIFY_STATE,
+        *ExEventObjectType,
+        ExGetPreviousMode(),
+        (PVOID*)&pEvent,
+        NULL
+    ));
+    AUTO_RESOURCE(pEvent, [](auto p) { ObDereferenceObject(p); });
+
+    // Pagefile-backed, so that the view of mxhost goes away with it no matter what.
+    LARGE_INTEGER liSize
+    {
+        .QuadPart = (LONGLONG)(FIELD_OFFSET(MX_OUTPUT_RING_HEADER, Data) + uSize)
+    };
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objAttributes,
+        &liSize,
+        PAGE_READWRITE,
+        SEC_COMMIT,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PVOID pSection = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+    AUTO_RESOURCE(pSection, [](auto p) { ObDereferenceObject(p); });
+
+    PVOID pSystemView = NULL;
+    SIZE_T szSystemView = 0;
+    MX_RETURN_IF_FAIL(MmMapViewInSystemSpace(pSection, &pSystemView, &szSystemView));
+    AUTO_RESOURCE(pSystemView, MmUnmapViewInSystemSpace);
+
+    PMX_OUTPUT_RING pRing = (PMX_OUTPUT_RING)
+        ExAllocatePoolZero(NonPagedPoolNx, sizeof(MX_OUTPUT_RING), MX_POOL_TAG);
+    if (pRing == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pRing, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    PVOID pMapBase = NULL;
+    SIZE_T szViewSize = 0;
+    MX_RETURN_IF_FAIL(ZwMapViewOfSection(
+        hdlSection,
+        ZwCurrentProcess(),
+        &pMapBase,
+        0,
+        0,
+        NULL,
+        &szViewSize,
+        ViewUnmap,
+        0,
+        PAGE_READWRITE
+    ));
+
+    // The section is zero-filled, only the size has to be published.
+    PMX_OUTPUT_RING_HEADER pHeader = (PMX_OUTPUT_RING_HEADER)pSystemView;
+    pHeader->Size = uSize;
+
+    pRing->ReferenceCount = 1;
+    pRing->Section = pSection;
+    pRing->Header = pHeader;
+    pRing->Size = uSize;
+    pRing->Event = pEvent;
+    ExInitializeFastMutex(&pRing->Lock);
+
+    pSection = NULL;
+    pSystemView = NULL;
+    pEvent = NULL;
+
+    *pPRing = pRing;
+    pRing = NULL;
+    *pUserView = pMapBase;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxOutputRingReference(
+    _Inout_ PMX_OUTPUT_RING pRing
+)
+{
+    ULONG_PTR uNewCount = InterlockedIncrementSizeT(&pRing->ReferenceCount);
+
+    UNREFERENCED_PARAMETER(uNewCount);
+    ASSERT(uNewCount != 1);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxOutputRingFree(
+    _Inout_ PMX_OUTPUT_RING pRing
+)
+{
+    ULONG_PTR uNewCount = InterlockedDecrementSizeT(&pRing->ReferenceCount);
+    ASSERT(uNewCount + 1 > uNewCount);
+
+    if (uNewCount != 0)
+    {
+        return;
+    }
+
+    MmUnmapViewInSystemSpace(pRing->Header);
+    ObDereferenceObject(pRing->Section);
+    ObDereferenceObject(pRing->Event);
+
+    ExFreePoolWithTag(pRing, MX_POOL_TAG);
+}
+
+VOID
+MxOutputRingDetach(
+    _Inout_ PMX_OUTPUT_RING pRing
+)
+{
+    InterlockedExchange(&pRing->Detached, TRUE);
+}
+
+NTSTATUS
+MxOutputRingWrite(
+    _Inout_ PMX_OUTPUT_RING pRing,
+    _In_reads_bytes_(uSize) PVOID pBuffer,
+    _In_ SIZE_T uSize,
+    _Out_ PSIZE_T pUWritten
+)
+{
+    *pUWritten = 0;
+
+    LARGE_INTEGER liDelay
+    {
+        .QuadPart = -10 * 1000
+    };
+
+    for (ULONG uWaited = 0; ; ++uWaited)
+    {
+        if (pRing->Detached)
+        {
+            return STATUS_PORT_DISCONNECTED;
+        }
+
+        ExAcquireFastMutex(&pRing->Lock);
+
+        PMX_OUTPUT_RING_HEADER pHeader = pRing->Header;
+        ULONG uHead = pRing->Head;
+        ULONG uUsed = uHead - ReadULongAcquire(&pHeader->Tail);
+
+        if (uUsed > pRing->Size)
+        {
+            // mxhost has scribbled over the counters. Stop trusting the ring.
+            ExReleaseFastMutex(&pRing->Lock);
+            MxOutputRingDetach(pRing);
+            return STATUS_DATA_ERROR;
+        }
+
+        ULONG uFree = pRing->Size - uUsed;
+
+        if (uFree == 0)
+        {
+            ExReleaseFastMutex(&pRing->Lock);
+
+            if (uWaited >= MX_OUTPUT_RING_FULL_TIMEOUT_MS)
+            {
+                return STATUS_IO_TIMEOUT;
+            }
+
+            KeDelayExecutionThread(KernelMode, FALSE, &liDelay);
+            continue;
+        }
+
+        // Short writes are fine, the caller comes back for the rest.
+        ULONG uCount = (ULONG)min(uSize, (SIZE_T)uFree);
+        ULONG uOffset = uHead & (pRing->Size - 1);
+        ULONG uFirst = min(uCount, pRing->Size - uOffset);
+
+        __try
+        {
+            memcpy(pHeader->Data + uOffset, pBuffer, uFirst);
+            memcpy(pHeader->Data, (PCHAR)pBuffer + uFirst, uCount - uFirst);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            ExReleaseFastMutex(&pRing->Lock);
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        pRing->Head = uHead + uCount;
+        WriteULongRelease(&pHeader->Head, pRing->Head);
+
+        ExReleaseFastMutex(&pRing->Lock);
+
+        if (InterlockedExchange(&pHeader->Waiting, FALSE))
+        {
+            KeSetEvent(pRing->Event, IO_NO_INCREMENT, FALSE);
+        }
+
+        *pUWritten = uCount;
+        return STATUS_SUCCESS;
+    }
+}
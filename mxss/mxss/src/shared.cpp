@@ -0,0 +1,265 @@
+#include "shared.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+static LIST_ENTRY MxSharedPageList;
+static FAST_MUTEX MxSharedPageLock;
+// Set while MxSharedPageList is not empty, so that the updater sleeps when there is no work.
+static KEVENT MxSharedPagePending;
+static KEVENT MxSharedPageStop;
+static PETHREAD MxSharedPageUpdater = NULL;
+
+static
+VOID
+MxUpdateSharedPage(
+    _Inout_ PMX_SHARED_PAGE_DATA pData
+)
+{
+    LARGE_INTEGER liSystemTime;
+    KeQuerySystemTimePrecise(&liSystemTime);
+    ULONG64 uPerformanceCounter = 0;
+    ULONG64 uInterruptTime = KeQueryInterruptTimePrecise(&uPerformanceCounter);
+
+    // Full barriers, the fields must not be seen outside of the odd window.
+    InterlockedIncrement((volatile LONG*)&pData->Sequence);
+
+    pData->InterruptTime = (INT64)uInterruptTime;
+    pData->SystemTime = liSystemTime.QuadPart;
+    pData->PerformanceCounter = (INT64)uPerformanceCounter;
+
+    InterlockedIncrement((volatile LONG*)&pData->Sequence);
+}
+
+static
+VOID
+MxSharedPageUpdaterMain(
+    _In_ PVOID pContext
+)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    LARGE_INTEGER liInterval
+    {
+        .QuadPart = -MX_SHARED_PAGE_UPDATE_INTERVAL
+    };
+
+    PVOID pWaitObjects[] = { &MxSharedPageStop, &MxSharedPagePending };
+
+    while (TRUE)
+    {
+        NTSTATUS status = KeWaitForMultipleObjects(ARRAYSIZE(pWaitObjects), pWaitObjects,
+            WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+
+        if (status == STATUS_WAIT_0)
+        {
+            break;
+        }
+
+        // Pagefile-backed views, so this has to happen at PASSIVE_LEVEL and not in a DPC.
+        ExAcquireFastMutex(&MxSharedPageLock);
+
+        for (PLIST_ENTRY pEntry = MxSharedPageList.Flink; pEntry != &MxSharedPageList;
+            pEntry = pEntry->Flink)
+        {
+            MxUpdateSharedPage(CONTAINING_RECORD(pEntry, MX_SHARED_PAGE, Link)->Data);
+        }
+
+        ExReleaseFastMutex(&MxSharedPageLock);
+
+        if (KeWaitForSingleObject(&MxSharedPageStop, Executive, KernelMode, FALSE,
+            &liInterval) == STATUS_WAIT_0)
+        {
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+MxInitializeSharedPages()
+{
+    InitializeListHead(&MxSharedPageList);
+    ExInitializeFastMutex(&MxSharedPageLock);
+    KeInitializeEvent(&MxSharedPagePending, NotificationEvent, FALSE);
+    KeInitializeEvent(&MxSharedPageStop, NotificationEvent, FALSE);
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlThread = NULL;
+    MX_RETURN_IF_FAIL(PsCreateSystemThread(
+        &hdlThread,
+        THREAD_ALL_ACCESS,
+        &objAttributes,
+        NULL,
+        NULL,
+        MxSharedPageUpdaterMain,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    NTSTATUS status = ObReferenceObjectByHandle(
+        hdlThread,
+        SYNCHRONIZE,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&MxSharedPageUpdater,
+        NULL
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        // Without a reference there is nothing to wait on, but the thread must not outlive us.
+        KeSetEvent(&MxSharedPageStop, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(hdlThread, FALSE, NULL);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxCleanupSharedPages()
+{
+    if (MxSharedPageUpdater != NULL)
+    {
+        KeSetEvent(&MxSharedPageStop, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(MxSharedPageUpdater, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(MxSharedPageUpdater);
+        MxSharedPageUpdater = NULL;
+    }
+}
+
+NTSTATUS
+MxSharedPageCreate(
+    _In_ HANDLE hdlProcess,
+    _In_ PEPROCESS pProcess,
+    _Out_ PMX_SHARED_PAGE* pPSharedPage
+)
+{
+    *pPSharedPage = NULL;
+
+    LARGE_INTEGER liSize
+    {
+        .QuadPart = PAGE_SIZE
+    };
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objAttributes,
+        &liSize,
+        PAGE_READWRITE,
+        SEC_COMMIT,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PVOID pSection = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+    AUTO_RESOURCE(pSection, [](auto p) { ObDereferenceObject(p); });
+
+    PVOID pSystemView = NULL;
+    SIZE_T szSystemView = 0;
+    MX_RETURN_IF_FAIL(MmMapViewInSystemSpace(pSection, &pSystemView, &szSystemView));
+    AUTO_RESOURCE(pSystemView, MmUnmapViewInSystemSpace);
+
+    PMX_SHARED_PAGE pSharedPage = (PMX_SHARED_PAGE)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_SHARED_PAGE), MX_POOL_TAG);
+    if (pSharedPage == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pSharedPage, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    // Filled in before the process can see it, so that the first read is already valid.
+    PMX_SHARED_PAGE_DATA pData = (PMX_SHARED_PAGE_DATA)pSystemView;
+    LARGE_INTEGER liFrequency;
+    KeQueryPerformanceCounter(&liFrequency);
+    LARGE_INTEGER liSystemTime;
+    KeQuerySystemTimePrecise(&liSystemTime);
+
+    pData->ProcessId = HandleToULong(PsGetProcessId(pProcess));
+    pData->BootTime = liSystemTime.QuadPart - (INT64)KeQueryInterruptTime();
+    pData->PerformanceFrequency = liFrequency.QuadPart;
+    MxUpdateSharedPage(pData);
+
+    PVOID pMapBase = MX_SHARED_PAGE_ADDRESS;
+    SIZE_T szViewSize = PAGE_SIZE;
+    MX_RETURN_IF_FAIL(ZwMapViewOfSection(
+        hdlSection,
+        hdlProcess,
+        &pMapBase,
+        0,
+        szViewSize,
+        NULL,
+        &szViewSize,
+        ViewShare,
+        0,
+        PAGE_READONLY
+    ));
+
+    if (pMapBase != MX_SHARED_PAGE_ADDRESS)
+    {
+        ZwUnmapViewOfSection(hdlProcess, pMapBase);
+        return STATUS_CONFLICTING_ADDRESSES;
+    }
+
+    pSharedPage->Section = pSection;
+    pSharedPage->Data = pData;
+
+    pSection = NULL;
+    pSystemView = NULL;
+
+    ExAcquireFastMutex(&MxSharedPageLock);
+    InsertTailList(&MxSharedPageList, &pSharedPage->Link);
+    KeSetEvent(&MxSharedPagePending, IO_NO_INCREMENT, FALSE);
+    ExReleaseFastMutex(&MxSharedPageLock);
+
+    *pPSharedPage = pSharedPage;
+    pSharedPage = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxSharedPageFree(
+    _In_ PMX_SHARED_PAGE pSharedPage
+)
+{
+    ExAcquireFastMutex(&MxSharedPageLock);
+    RemoveEntryList(&pSharedPage->Link);
+    if (IsListEmpty(&MxSharedPageList))
+    {
+        KeClearEvent(&MxSharedPagePending);
+    }
+    ExReleaseFastMutex(&MxSharedPageLock);
+
+    MmUnmapViewInSystemSpace(pSharedPage->Data);
+    ObDereferenceObject(pSharedPage->Section);
+
+    ExFreePoolWithTag(pSharedPage, MX_POOL_TAG);
+}
@@ -1,11 +1,21 @@
 #include "syscall.h"
 
 #include <intsafe.h>
+#include <intrin.h>
+#ifdef _M_ARM64
+#include <arm64_neon.h>
+#endif
 
+#include "checkpoint.h"
 #include "console.h"
+#include "file.h"
+#include "memory.h"
 #include "process.h"
 #include "provider.h"
 #include "thread.h"
+#include "uring.h"
+
+#include "AutoResource.h"
 
 extern "C"
 INT
@@ -14,26 +24,49 @@ SyscallExit(
 )
 {
     PEPROCESS pCurrentProcess = PsGetCurrentProcess();
+    PETHREAD pCurrentThread = PsGetCurrentThread();
+
+    PMX_THREAD pThreadContext = (PMX_THREAD)MxRoutines.GetThreadContext(pCurrentThread);
+
+    // Only the main thread holds a reference for NT, the others belong to the thread list.
+    BOOLEAN bNtReference = TRUE;
 
     PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(pCurrentProcess);
     if (pContext != NULL)
     {
+        bNtReference = (pThreadContext == pContext->MxThread);
+
         // TODO: Do some conversion to/from NTSTATUS values?
         pContext->ExitStatus = status;
 
+#if DBG
+        // Only worth a query for the options that change how the executable faults in. The
+        // count includes the faults NT resolved on its own, like first touches of the image.
+        if (pContext->ExecuteFlags & (MX_EXECUTE_PREFAULT | MX_EXECUTE_LARGE_PAGES))
+        {
+            VM_COUNTERS vmCounters;
+            if (NT_SUCCESS(ZwQueryInformationProcess(ZwCurrentProcess(), ProcessVmCounters,
+                &vmCounters, sizeof(vmCounters), NULL)))
+            {
+                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_TRACE_LEVEL,
+                    "Process %lu exited after %lu page faults, %Iu handled by Monix\n",
+                    HandleToULong(PsGetProcessId(pCurrentProcess)), vmCounters.PageFaultCount,
+                    pContext->HandledFaults));
+            }
+        }
+#endif
+
+        MxProcessNotifyExit(pContext);
+
         // We do not need a context attached to our process anymore.
         MxProcessFree(pContext);
         pContext = NULL;
     }
 
-    // Actually not suicide, we will still return.
+    // Actually not suicide, we will still return. The other threads go down with the process.
     MxRoutines.TerminateProcess(pCurrentProcess, status);
 
-    // Currently Monix processes are single-threaded.
-    PETHREAD pCurrentThread = PsGetCurrentThread();
-
-    PMX_THREAD pThreadContext = (PMX_THREAD)MxRoutines.GetThreadContext(pCurrentThread);
-    if (pThreadContext != NULL)
+    if (pThreadContext != NULL && bNtReference)
     {
         MxThreadFree(pThreadContext);
         pThreadContext = NULL;
@@ -48,6 +81,114 @@ SyscallExit(
     return 0;
 }
 
+extern "C"
+INT_PTR
+SyscallRead(
+    _In_ INT fd,
+    _Out_writes_bytes_opt_(size) PVOID buffer,
+    _In_ SIZE_T size
+)
+{
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+
+    // Pico syscalls come in with KernelMode as the previous mode, nothing below probes for us.
+    __try
+    {
+        ProbeForWrite(buffer, size, 1);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return -1;
+    }
+
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL)
+    {
+        return -1;
+    }
+
+    // The kernel does not take the faults that would commit the buffer on demand.
+    if (!NT_SUCCESS(MxMemoryPrepare(pContext->Memory, buffer, size)))
+    {
+        return -1;
+    }
+
+    SIZE_T uRead = 0;
+    NTSTATUS status = MxFileRead(pContext->Files, fd, buffer, size, &uRead);
+
+    // Like SysX, 0 means end of file and -1 any error.
+    if (status == STATUS_END_OF_FILE)
+    {
+        return 0;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        return -1;
+    }
+
+    return (INT_PTR)uRead;
+}
+
+// Returns the offset of the first '\n' in the buffer, or uSize if there is none.
+static
+SIZE_T
+MxFindNewLine(
+    _In_reads_(uSize) PCCH pBuffer,
+    _In_ SIZE_T uSize
+)
+{
+    SIZE_T i = 0;
+
+#ifdef _M_AMD64
+    const __m128i vNewLine = _mm_set1_epi8('\n');
+
+    for (; i + sizeof(__m128i) <= uSize; i += sizeof(__m128i))
+    {
+        __m128i vChunk = _mm_loadu_si128((const __m128i*)(pBuffer + i));
+        ULONG uMask = (ULONG)_mm_movemask_epi8(_mm_cmpeq_epi8(vChunk, vNewLine));
+
+        if (uMask != 0)
+        {
+            ULONG uIndex;
+            _BitScanForward(&uIndex, uMask);
+            return i + uIndex;
+        }
+    }
+#elif defined(_M_ARM64)
+    const uint8x16_t vNewLine = vdupq_n_u8('\n');
+
+    for (; i + sizeof(uint8x16_t) <= uSize; i += sizeof(uint8x16_t))
+    {
+        uint8x16_t vEqual = vceqq_u8(vld1q_u8((const uint8_t*)(pBuffer + i)), vNewLine);
+        // No movemask on NEON. Shifting-narrowing keeps one nibble per byte instead.
+        ULONG64 uMask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vEqual), 4)), 0);
+
+        if (uMask != 0)
+        {
+            ULONG uIndex;
+            _BitScanForward64(&uIndex, uMask);
+            return i + uIndex / 4;
+        }
+    }
+#endif
+
+    for (; i < uSize; ++i)
+    {
+        if (pBuffer[i] == '\n')
+        {
+            return i;
+        }
+    }
+
+    return uSize;
+}
+
 extern "C"
 INT_PTR
 SyscallWrite(
@@ -56,13 +197,17 @@ SyscallWrite(
     _In_ SIZE_T size
 )
 {
-    // Yes, this is our "FD table".
-    if (fd != 1 && fd != 2)
+    if (buffer == NULL)
     {
         return -1;
     }
 
-    if (buffer == NULL)
+    // Like SyscallRead, the previous mode is KernelMode and the source is not probed elsewhere.
+    __try
+    {
+        ProbeForRead(buffer, size, 1);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
     {
         return -1;
     }
@@ -70,7 +215,6 @@ SyscallWrite(
     INT_PTR returnValue = 0;
     SIZE_T written = 0;
 
-    HANDLE hdlConsole = NULL;
     HANDLE hdlOutput = NULL;
 
     const auto WriteToEnd = [&](PCHAR pBuffer, PULONG uCount)
@@ -121,8 +265,13 @@ SyscallWrite(
     }
 
     NTSTATUS status;
+    MX_FILE file;
+    PMX_FILE pFile;
 
-    status = CoAttachKernelConsole(PsGetProcessId(pContext->HostProcess), &hdlConsole);
+    // A copy, taken with the table locked. Its handle and ring are only used for the console,
+    // which is never closed.
+    status = MxFileTableGet(pContext->Files, fd, &file);
+    pFile = &file;
 
     if (!NT_SUCCESS(status))
     {
@@ -130,32 +279,57 @@ SyscallWrite(
         goto end;
     }
 
-    status = CoOpenStandardHandles(hdlConsole, NULL, &hdlOutput);
+    // Files are only opened for reading, and their handles are not safe to use unlocked.
+    if (pFile->Flags & (MX_FILE_SEEKABLE | MX_FILE_PIPE_READER))
+    {
+        returnValue = -1;
+        goto end;
+    }
 
-    if (!NT_SUCCESS(status))
+    // The kernel does not take the faults that would commit the buffer on demand. Pipes also
+    // need the pages of large writes to be there to lock them.
+    if (!NT_SUCCESS(MxMemoryPrepare(pContext->Memory, buffer, size)))
     {
         returnValue = -1;
         goto end;
     }
 
-    while (written < size)
+    if (pFile->Flags & MX_FILE_PIPE_WRITER)
     {
-        __try
+        SIZE_T uPipeWritten = 0;
+        status = MxFileWritePipe(pContext->Files, fd, buffer, size, &uPipeWritten);
+
+        // Like Linux without SIGPIPE, a broken pipe fails the write once nothing got through.
+        written = uPipeWritten;
+        returnValue = NT_SUCCESS(status) ? 0 : -1;
+        goto end;
+    }
+
+    if (pFile->OutputRing != NULL)
+    {
+        SIZE_T uRingWritten = 0;
+        status = MxOutputRingWrite(pFile->OutputRing, buffer, size, &uRingWritten);
+
+        if (NT_SUCCESS(status) || status == STATUS_ACCESS_VIOLATION)
         {
-            SIZE_T uMaxWrite = min(size - written, ULONG_MAX);
+            written = uRingWritten;
+            returnValue = NT_SUCCESS(status) ? 0 : -1;
+            goto end;
+        }
 
-            PCHAR pCurrentBuffer = (PCHAR)buffer + written;
-            PCHAR pNextNewLine = (PCHAR)memchr(pCurrentBuffer, '\n', uMaxWrite);
+        // mxhost is gone or stuck, the console is still there.
+    }
 
-            if (pNextNewLine != NULL)
-            {
-                uMaxWrite = min(uMaxWrite, (SIZE_T)(pNextNewLine - pCurrentBuffer));
-            }
+    hdlOutput = pFile->Handle;
 
-            if (uMaxWrite > 0)
+    if (pFile->Flags & MX_FILE_RAW)
+    {
+        while (written < size)
+        {
+            __try
             {
-                ULONG uCurrentWritten = (ULONG)uMaxWrite;
-                status = WriteToEnd(pCurrentBuffer, &uCurrentWritten);
+                ULONG uCurrentWritten = (ULONG)min(size - written, ULONG_MAX);
+                status = WriteToEnd((PCHAR)buffer + written, &uCurrentWritten);
 
                 written += uCurrentWritten;
 
@@ -165,26 +339,116 @@ SyscallWrite(
                     goto end;
                 }
             }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                returnValue = -1;
+                goto end;
+            }
+        }
+    }
+    else
+    {
+        // Small writes from threads we did not create can still be staged on the stack.
+        CHAR pStackBuffer[256];
+        PCHAR pStage = pStackBuffer;
+        SIZE_T uStageSize = sizeof(pStackBuffer);
+
+        PMX_THREAD pThreadContext = (PMX_THREAD)MxRoutines.GetThreadContext(PsGetCurrentThread());
+        if (pThreadContext != NULL)
+        {
+            if (pThreadContext->WriteBuffer == NULL)
+            {
+                pThreadContext->WriteBuffer = (PCHAR)
+                    ExAllocatePoolZero(PagedPool, MX_THREAD_WRITE_BUFFER_SIZE, '  xM');
+            }
 
-            if (pNextNewLine != NULL)
+            if (pThreadContext->WriteBuffer != NULL)
             {
-                CHAR pWinNewLine[] = "\r\n";
-                ULONG count = sizeof(pWinNewLine) - 1;
-                status = WriteToEnd(pWinNewLine, &count);
+                pStage = pThreadContext->WriteBuffer;
+                uStageSize = MX_THREAD_WRITE_BUFFER_SIZE;
+            }
+        }
 
-                if (!NT_SUCCESS(status))
+        SIZE_T uStaged = 0;
+        // Input bytes behind the staged output, only reported as written once flushed.
+        SIZE_T uPending = 0;
+        SIZE_T uConsumed = 0;
+
+        const auto Flush = [&]()
+        {
+            ULONG uCount = (ULONG)uStaged;
+            status = WriteToEnd(pStage, &uCount);
+
+            if (NT_SUCCESS(status))
+            {
+                written += uPending;
+                uStaged = 0;
+                uPending = 0;
+            }
+
+            return status;
+        };
+
+        while (uConsumed < size)
+        {
+            __try
+            {
+                // Always leave room for a "\r\n" pair.
+                if (uStageSize - uStaged < 2)
                 {
-                    returnValue = -1;
-                    goto end;
+                    status = Flush();
+
+                    if (!NT_SUCCESS(status))
+                    {
+                        returnValue = -1;
+                        goto end;
+                    }
                 }
 
-                ++written;
+                PCHAR pCurrentBuffer = (PCHAR)buffer + uConsumed;
+                SIZE_T uScan = min(size - uConsumed, uStageSize - uStaged);
+                SIZE_T uLine = MxFindNewLine(pCurrentBuffer, uScan);
+
+                memcpy(pStage + uStaged, pCurrentBuffer, uLine);
+                uStaged += uLine;
+                uPending += uLine;
+                uConsumed += uLine;
+
+                if (uLine < uScan)
+                {
+                    if (uStageSize - uStaged < 2)
+                    {
+                        status = Flush();
+
+                        if (!NT_SUCCESS(status))
+                        {
+                            returnValue = -1;
+                            goto end;
+                        }
+                    }
+
+                    pStage[uStaged++] = '\r';
+                    pStage[uStaged++] = '\n';
+                    ++uPending;
+                    ++uConsumed;
+                }
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                returnValue = -1;
+                goto end;
             }
         }
-        __except (EXCEPTION_EXECUTE_HANDLER)
+
+        if (uStaged != 0)
         {
-            returnValue = -1;
-            goto end;
+            status = Flush();
+
+            if (!NT_SUCCESS(status))
+            {
+                returnValue = -1;
+                goto end;
+            }
         }
     }
 end:
@@ -193,16 +457,6 @@ end:
         returnValue = written;
     }
 
-    if (hdlOutput != NULL)
-    {
-        ZwClose(hdlOutput);
-    }
-
-    if (hdlConsole != NULL)
-    {
-        ZwClose(hdlConsole);
-    }
-
     return returnValue;
 }
 
@@ -229,7 +483,710 @@ SyscallFork()
 
     INT iNewPid = (INT)(ULONG_PTR)PsGetProcessId(pChildContext->Process);
 
+    MxProcessAddChild(pContext, pChildContext);
     MxProcessFree(pChildContext);
 
     return iNewPid;
 }
+
+extern "C"
+INT_PTR
+SyscallUringSetup(
+    _In_ UINT entries
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || pContext->Uring != NULL)
+    {
+        return -1;
+    }
+
+    PMX_URING pUring = NULL;
+    PVOID pUserView = NULL;
+    NTSTATUS status = MxUringCreate(entries, &pUring, &pUserView);
+
+    if (!NT_SUCCESS(status))
+    {
+        return -1;
+    }
+
+    // Two threads setting up a ring at once: keep the first one.
+    if (InterlockedCompareExchangePointer((PVOID*)&pContext->Uring, pUring, NULL) != NULL)
+    {
+        ZwUnmapViewOfSection(ZwCurrentProcess(), pUserView);
+        MxUringFree(pUring);
+        return -1;
+    }
+
+    return (INT_PTR)pUserView;
+}
+
+static
+INT64
+SyscallUringSubmit(
+    _In_ PMX_URING_SQE pSqe
+)
+{
+    // The entry is our own copy, but its buffer is whatever the process put in the ring. Going
+    // through the syscalls gets it the same probes as a direct read or write.
+    switch (pSqe->Opcode)
+    {
+        case MX_URING_OP_NOP:
+            return 0;
+        case MX_URING_OP_READ:
+            return SyscallRead(pSqe->Fd, (PVOID)(ULONG_PTR)pSqe->Buffer, (SIZE_T)pSqe->Size);
+        case MX_URING_OP_WRITE:
+            return SyscallWrite(pSqe->Fd, (PVOID)(ULONG_PTR)pSqe->Buffer, (SIZE_T)pSqe->Size);
+        default:
+            return -1;
+    }
+}
+
+extern "C"
+INT_PTR
+SyscallUringEnter(
+    _In_ UINT toSubmit
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL)
+    {
+        return -1;
+    }
+
+    // Set once by SyscallUringSetup, and kept until the process is gone.
+    PMX_URING pUring = (PMX_URING)ReadPointerAcquire((PVOID volatile*)&pContext->Uring);
+
+    if (pUring == NULL)
+    {
+        return -1;
+    }
+
+    // Everything is done synchronously, so completions are all there by the time we return.
+    return (INT_PTR)MxUringEnter(pUring, toSubmit, SyscallUringSubmit);
+}
+
+extern "C"
+INT_PTR
+SyscallMmap(
+    _In_opt_ PVOID address,
+    _In_ SIZE_T length,
+    _In_ INT prot,
+    _In_ INT flags,
+    _In_ INT fd,
+    _In_ INT_PTR offset
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    // No file mappings yet.
+    if (pContext == NULL || fd != -1 || offset != 0)
+    {
+        return -1;
+    }
+
+    PVOID pMapped = NULL;
+    NTSTATUS status = MxMemoryMap(pContext->Memory, ZwCurrentProcess(), address, length,
+        (ULONG)prot, (ULONG)flags, &pMapped);
+
+    // MAP_FAILED.
+    if (!NT_SUCCESS(status))
+    {
+        return -1;
+    }
+
+    return (INT_PTR)pMapped;
+}
+
+extern "C"
+INT
+SyscallMunmap(
+    _In_ PVOID address,
+    _In_ SIZE_T length
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL)
+    {
+        return -1;
+    }
+
+    NTSTATUS status = MxMemoryUnmap(pContext->Memory, ZwCurrentProcess(), address, length);
+
+    if (!NT_SUCCESS(status))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+extern "C"
+INT_PTR
+SyscallBrk(
+    _In_opt_ PVOID address
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL)
+    {
+        return -1;
+    }
+
+    // Like the Linux system call, failures just return the current break.
+    return (INT_PTR)MxMemorySetBreak(pContext->Memory, (ULONG_PTR)address);
+}
+
+// Copies a NUL-terminated path from the calling process into pUtf8Path, without the NUL.
+static
+NTSTATUS
+SyscallCopyPath(
+    _In_z_ PCSTR path,
+    _Out_writes_to_(MX_SPAWN_PATH_MAX, *pULength) PCHAR pUtf8Path,
+    _Out_ PSIZE_T pULength
+)
+{
+    SIZE_T uPathLength = 0;
+    *pULength = 0;
+
+    __try
+    {
+        ProbeForRead((PVOID)path, sizeof(CHAR), 1);
+
+        while (uPathLength < MX_SPAWN_PATH_MAX && path[uPathLength] != '\0')
+        {
+            pUtf8Path[uPathLength] = path[uPathLength];
+            ++uPathLength;
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (uPathLength == 0 || uPathLength == MX_SPAWN_PATH_MAX)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *pULength = uPathLength;
+    return STATUS_SUCCESS;
+}
+
+// Copies a path from the calling process into a new string, whose buffer the caller frees.
+static
+NTSTATUS
+SyscallCapturePath(
+    _In_ PMX_PROCESS pContext,
+    _In_z_ PCSTR path,
+    _Out_ PUNICODE_STRING pPath
+)
+{
+    PCHAR pUtf8Path = (PCHAR)ExAllocatePoolZero(PagedPool, MX_SPAWN_PATH_MAX, '  xM');
+    if (pUtf8Path == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pUtf8Path, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    SIZE_T uPathLength = 0;
+    NTSTATUS status = SyscallCopyPath(path, pUtf8Path, &uPathLength);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // Monix has no working directory yet, so the closest thing is where the caller came from.
+    UNICODE_STRING strDirectory = { 0 };
+
+    if (pUtf8Path[0] != '\\')
+    {
+        strDirectory = pContext->ExecutableName->Name;
+        while (strDirectory.Length != 0
+            && strDirectory.Buffer[strDirectory.Length / sizeof(WCHAR) - 1] != L'\\')
+        {
+            strDirectory.Length -= sizeof(WCHAR);
+        }
+    }
+
+    ULONG uPathBytes = 0;
+    if (!NT_SUCCESS(RtlUTF8ToUnicodeN(NULL, 0, &uPathBytes, pUtf8Path, (ULONG)uPathLength))
+        || (SIZE_T)strDirectory.Length + uPathBytes > UNICODE_STRING_MAX_BYTES)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    UNICODE_STRING strPath
+    {
+        .Length = 0,
+        .MaximumLength = (USHORT)(strDirectory.Length + uPathBytes),
+        .Buffer = (PWCH)ExAllocatePoolZero(PagedPool,
+            (SIZE_T)strDirectory.Length + uPathBytes, '  xM')
+    };
+    if (strPath.Buffer == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    PWCH pPathBuffer = strPath.Buffer;
+    AUTO_RESOURCE(pPathBuffer, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    RtlCopyUnicodeString(&strPath, &strDirectory);
+
+    if (!NT_SUCCESS(RtlUTF8ToUnicodeN(strPath.Buffer + strPath.Length / sizeof(WCHAR),
+        uPathBytes, &uPathBytes, pUtf8Path, (ULONG)uPathLength)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    strPath.Length += (USHORT)uPathBytes;
+
+    *pPath = strPath;
+    pPathBuffer = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+// Copies a Unix path from the calling process into a new string relative to the session root,
+// whose buffer the caller frees.
+static
+NTSTATUS
+SyscallCaptureRootPath(
+    _In_z_ PCSTR path,
+    _Out_ PUNICODE_STRING pPath
+)
+{
+    PCHAR pUtf8Path = (PCHAR)ExAllocatePoolZero(PagedPool, MX_SPAWN_PATH_MAX, '  xM');
+    if (pUtf8Path == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pUtf8Path, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    SIZE_T uPathLength = 0;
+    NTSTATUS status = SyscallCopyPath(path, pUtf8Path, &uPathLength);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    // Absolute paths start at the root too, there is nothing above it.
+    PCHAR pRelativePath = pUtf8Path;
+    while (uPathLength != 0 && *pRelativePath == '/')
+    {
+        ++pRelativePath;
+        --uPathLength;
+    }
+
+    if (uPathLength == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // NT takes backslashes as separators as well, so both have to be checked for "..".
+    SIZE_T uComponentStart = 0;
+    for (SIZE_T i = 0; i <= uPathLength; ++i)
+    {
+        if (i < uPathLength && pRelativePath[i] != '/' && pRelativePath[i] != '\\')
+        {
+            continue;
+        }
+
+        if (i - uComponentStart == 2 && pRelativePath[uComponentStart] == '.'
+            && pRelativePath[uComponentStart + 1] == '.')
+        {
+            return STATUS_OBJECT_PATH_SYNTAX_BAD;
+        }
+
+        if (i < uPathLength)
+        {
+            pRelativePath[i] = '\\';
+        }
+
+        uComponentStart = i + 1;
+    }
+
+    ULONG uPathBytes = 0;
+    if (!NT_SUCCESS(RtlUTF8ToUnicodeN(NULL, 0, &uPathBytes, pRelativePath, (ULONG)uPathLength))
+        || uPathBytes > UNICODE_STRING_MAX_BYTES)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    UNICODE_STRING strPath
+    {
+        .Length = 0,
+        .MaximumLength = (USHORT)uPathBytes,
+        .Buffer = (PWCH)ExAllocatePoolZero(PagedPool, uPathBytes, '  xM')
+    };
+    if (strPath.Buffer == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    PWCH pPathBuffer = strPath.Buffer;
+    AUTO_RESOURCE(pPathBuffer, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    if (!NT_SUCCESS(RtlUTF8ToUnicodeN(strPath.Buffer, uPathBytes, &uPathBytes, pRelativePath,
+        (ULONG)uPathLength)))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+    strPath.Length = (USHORT)uPathBytes;
+
+    *pPath = strPath;
+    pPathBuffer = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+extern "C"
+INT
+SyscallSpawn(
+    _In_z_ PCSTR path,
+    _In_ INT flags
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || path == NULL || (flags & ~MX_SPAWN_WAIT) != 0)
+    {
+        return -1;
+    }
+
+    UNICODE_STRING strPath;
+    if (!NT_SUCCESS(SyscallCapturePath(pContext, path, &strPath)))
+    {
+        return -1;
+    }
+    PWCH pPathBuffer = strPath.Buffer;
+    AUTO_RESOURCE(pPathBuffer, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    // Built directly from the image, so none of the parent's address space is cloned.
+    PMX_PROCESS pChildContext = NULL;
+    NTSTATUS status = MxProcessExecute(
+        &strPath,
+        PsGetCurrentProcess(),
+        pContext->HostProcess,
+        NULL,
+        NULL,
+        pContext->Files,
+        NULL,
+        pContext->ExecuteFlags,
+        &pContext->Placement,
+        &pChildContext
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        return -1;
+    }
+    AUTO_RESOURCE(pChildContext, MxProcessFree);
+
+    if (!(flags & MX_SPAWN_WAIT))
+    {
+        MxProcessAddChild(pContext, pChildContext);
+        return (INT)(ULONG_PTR)PsGetProcessId(pChildContext->Process);
+    }
+
+    // Alertable, so that the parent can still be terminated while it waits.
+    status = KeWaitForSingleObject(pChildContext->Process, Executive, UserMode, TRUE, NULL);
+
+    if (status != STATUS_SUCCESS)
+    {
+        return -1;
+    }
+
+    return (INT)pChildContext->ExitStatus;
+}
+
+extern "C"
+INT
+SyscallThreadCreate(
+    _In_ PVOID entry,
+    _In_opt_ PVOID argument,
+    _In_ SIZE_T stackSize
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || entry == NULL || stackSize > MX_MEMORY_STACK_RESERVE)
+    {
+        return -1;
+    }
+
+    if (stackSize == 0)
+    {
+        stackSize = MX_THREAD_DEFAULT_STACK_SIZE;
+    }
+
+    stackSize = ALIGN_UP_BY(stackSize, PAGE_SIZE);
+
+    PVOID pStack = NULL;
+    if (!NT_SUCCESS(MxMemoryMap(pContext->Memory, ZwCurrentProcess(), NULL, stackSize,
+        MX_PROT_READ | MX_PROT_WRITE, MX_MAP_PRIVATE | MX_MAP_ANONYMOUS, &pStack)))
+    {
+        return -1;
+    }
+
+    // Like the main stack, the top is committed up front and the rest as it is touched.
+    SIZE_T uInitialSize = min(stackSize, MX_MEMORY_COMMIT_CHUNK);
+    MxMemoryPrepare(pContext->Memory, (PCHAR)pStack + stackSize - uInitialSize, uInitialSize);
+
+    HANDLE hdlThreadId = NULL;
+    NTSTATUS status = MxProcessCreateThread(pContext, (ULONG_PTR)entry, (ULONG_PTR)argument,
+        (ULONG_PTR)pStack, stackSize, &hdlThreadId);
+
+    if (!NT_SUCCESS(status))
+    {
+        MxMemoryUnmap(pContext->Memory, ZwCurrentProcess(), pStack, stackSize);
+        return -1;
+    }
+
+    return (INT)HandleToULong(hdlThreadId);
+}
+
+extern "C"
+INT
+SyscallThreadExit(
+    _In_ INT status
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+    PETHREAD pCurrentThread = PsGetCurrentThread();
+    PMX_THREAD pThreadContext = (PMX_THREAD)MxRoutines.GetThreadContext(pCurrentThread);
+
+    if (pContext == NULL || pThreadContext == NULL)
+    {
+        return SyscallExit(status);
+    }
+
+    ExAcquireFastMutex(&pContext->ThreadsLock);
+
+    // The last thread takes the process with it, and its status becomes the exit status.
+    BOOLEAN bLastThread = pContext->Threads.Flink == &pThreadContext->Link
+        && pContext->Threads.Blink == &pThreadContext->Link;
+
+    if (!bLastThread)
+    {
+        RemoveEntryList(&pThreadContext->Link);
+    }
+
+    ExReleaseFastMutex(&pContext->ThreadsLock);
+
+    if (bLastThread)
+    {
+        return SyscallExit(status);
+    }
+
+    if (pThreadContext->StackSize != 0)
+    {
+        // This thread never goes back to user mode, nothing runs on the stack anymore.
+        MxMemoryUnmap(pContext->Memory, ZwCurrentProcess(), (PVOID)pThreadContext->StackBase,
+            pThreadContext->StackSize);
+    }
+
+    if (pThreadContext == pContext->MxThread)
+    {
+        // The reference NT holds. The process keeps its own until it goes away.
+        MxThreadFree(pThreadContext);
+    }
+
+    // The reference of the thread list.
+    MxThreadFree(pThreadContext);
+    pThreadContext = NULL;
+
+    MxRoutines.TerminateThread(pCurrentThread, status, TRUE);
+
+    return 0;
+}
+
+extern "C"
+INT
+SyscallWaitPid(
+    _In_ INT pid,
+    _Out_opt_ PINT status,
+    _In_ INT options
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || (pid <= 0 && pid != -1) || (options & ~MX_WAIT_NOHANG) != 0)
+    {
+        return -1;
+    }
+
+    INT iChildPid = 0;
+    NTSTATUS exitStatus = STATUS_SUCCESS;
+    NTSTATUS waitStatus = MxProcessWaitChild(pContext, pid, !(options & MX_WAIT_NOHANG),
+        &iChildPid, &exitStatus);
+
+    // A success code, so it has to be checked first.
+    if (waitStatus == STATUS_TIMEOUT)
+    {
+        return 0;
+    }
+
+    if (!NT_SUCCESS(waitStatus))
+    {
+        return -1;
+    }
+
+    if (status != NULL)
+    {
+        __try
+        {
+            ProbeForWrite(status, sizeof(INT), sizeof(INT));
+            *status = (INT)exitStatus;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            // The child is reaped either way, like on Linux.
+            return -1;
+        }
+    }
+
+    return iChildPid;
+}
+
+extern "C"
+INT
+SyscallCheckpoint(
+    _In_z_ PCSTR path
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || path == NULL)
+    {
+        return -1;
+    }
+
+    UNICODE_STRING strPath;
+    if (!NT_SUCCESS(SyscallCapturePath(pContext, path, &strPath)))
+    {
+        return -1;
+    }
+    PWCH pPathBuffer = strPath.Buffer;
+    AUTO_RESOURCE(pPathBuffer, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    // Restored processes resume from the same system call, with 1 returned instead.
+    if (!NT_SUCCESS(MxProcessCheckpoint(pContext, &strPath)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+extern "C"
+INT
+SyscallOpen(
+    _In_z_ PCSTR path,
+    _In_ INT flags
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    // O_RDONLY is 0, anything else would need write access to the file.
+    if (pContext == NULL || path == NULL || flags != 0)
+    {
+        return -1;
+    }
+
+    UNICODE_STRING strPath;
+    if (!NT_SUCCESS(SyscallCaptureRootPath(path, &strPath)))
+    {
+        return -1;
+    }
+    PWCH pPathBuffer = strPath.Buffer;
+    AUTO_RESOURCE(pPathBuffer, [](auto p) { ExFreePoolWithTag(p, '  xM'); });
+
+    INT fd = -1;
+    if (!NT_SUCCESS(MxFileOpen(pContext->Files, &strPath, &fd)))
+    {
+        return -1;
+    }
+
+    return fd;
+}
+
+extern "C"
+INT
+SyscallClose(
+    _In_ INT fd
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || !NT_SUCCESS(MxFileClose(pContext->Files, fd)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+extern "C"
+INT64
+SyscallLseek(
+    _In_ INT fd,
+    _In_ INT64 offset,
+    _In_ INT whence
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL)
+    {
+        return -1;
+    }
+
+    ULONG64 uNewOffset = 0;
+    if (!NT_SUCCESS(MxFileSeek(pContext->Files, fd, offset, whence, &uNewOffset)))
+    {
+        return -1;
+    }
+
+    return (INT64)uNewOffset;
+}
+
+extern "C"
+INT
+SyscallPipe(
+    _Out_writes_(2) PINT fds
+)
+{
+    PMX_PROCESS pContext = (PMX_PROCESS)MxRoutines.GetProcessContext(PsGetCurrentProcess());
+
+    if (pContext == NULL || fds == NULL)
+    {
+        return -1;
+    }
+
+    // The kernel does not take the faults that would commit the array on demand.
+    MxMemoryPrepare(pContext->Memory, fds, 2 * sizeof(INT));
+
+    INT pFds[2];
+    if (!NT_SUCCESS(MxFileCreatePipe(pContext->Files, pFds)))
+    {
+        return -1;
+    }
+
+    __try
+    {
+        ProbeForWrite(fds, sizeof(pFds), sizeof(INT));
+        memcpy(fds, pFds, sizeof(pFds));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        MxFileClose(pContext->Files, pFds[0]);
+        MxFileClose(pContext->Files, pFds[1]);
+        return -1;
+    }
+
+    return 0;
+}
@@ -1,18 +1,33 @@
 #include "thread.h"
 
+static LOOKASIDE_LIST_EX MxThreadLookaside;
+
+NTSTATUS
+MxInitializeThreadLookaside()
+{
+    return ExInitializeLookasideListEx(&MxThreadLookaside, NULL, NULL, PagedPool, 0,
+        sizeof(MX_THREAD), '  xM', 0);
+}
+
+VOID
+MxCleanupThreadLookaside()
+{
+    ExDeleteLookasideListEx(&MxThreadLookaside);
+}
+
 NTSTATUS
 MxThreadAllocate(
     _Out_ PMX_THREAD* pPMxThread
 )
 {
-    PMX_THREAD pMxThread = (PMX_THREAD)
-        ExAllocatePoolZero(PagedPool, sizeof(MX_THREAD), '  xM');
+    PMX_THREAD pMxThread = (PMX_THREAD)ExAllocateFromLookasideListEx(&MxThreadLookaside);
 
     if (pMxThread == NULL)
     {
         return STATUS_NO_MEMORY;
     }
 
+    RtlZeroMemory(pMxThread, sizeof(MX_THREAD));
     pMxThread->ReferenceCount = 1;
 
     *pPMxThread = pMxThread;
@@ -45,5 +60,15 @@ MxThreadFree(
         return;
     }
 
-    ExFreePoolWithTag(pMxThread, '  xM');
+    if (pMxThread->Thread != NULL)
+    {
+        ObDereferenceObject(pMxThread->Thread);
+    }
+
+    if (pMxThread->WriteBuffer != NULL)
+    {
+        ExFreePoolWithTag(pMxThread->WriteBuffer, '  xM');
+    }
+
+    ExFreeToLookasideListEx(&MxThreadLookaside, pMxThread);
 }
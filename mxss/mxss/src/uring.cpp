@@ -0,0 +1,215 @@
+#include "uring.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+static
+PMX_URING
+MxUringLock(
+    _Inout_ PMX_URING pUring
+)
+{
+    KeEnterCriticalRegion();
+    ExAcquirePushLockExclusiveEx(&pUring->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    return pUring;
+}
+
+static
+VOID
+MxUringUnlock(
+    _Inout_ PMX_URING pUring
+)
+{
+    ExReleasePushLockExclusiveEx(&pUring->Lock, EX_DEFAULT_PUSH_LOCK_FLAGS);
+    KeLeaveCriticalRegion();
+}
+
+NTSTATUS
+MxUringCreate(
+    _In_ ULONG uEntries,
+    _Out_ PMX_URING* pPUring,
+    _Out_ PVOID* pUserView
+)
+{
+    *pPUring = NULL;
+    *pUserView = NULL;
+
+    if (uEntries == 0 || uEntries > MX_URING_MAX_ENTRIES || (uEntries & (uEntries - 1)) != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG uSqOffset = (ULONG)ALIGN_UP_BY(sizeof(MX_URING_HEADER), alignof(MX_URING_SQE));
+    ULONG uCqOffset = (ULONG)ALIGN_UP_BY(uSqOffset + uEntries * sizeof(MX_URING_SQE),
+        alignof(MX_URING_CQE));
+
+    LARGE_INTEGER liSize
+    {
+        .QuadPart = (LONGLONG)(uCqOffset + uEntries * sizeof(MX_URING_CQE))
+    };
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlSection = NULL;
+    MX_RETURN_IF_FAIL(ZwCreateSection(
+        &hdlSection,
+        SECTION_ALL_ACCESS,
+        &objAttributes,
+        &liSize,
+        PAGE_READWRITE,
+        SEC_COMMIT,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlSection, ZwClose);
+
+    PVOID pSection = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlSection,
+        SECTION_ALL_ACCESS,
+        NULL,
+        KernelMode,
+        &pSection,
+        NULL
+    ));
+    AUTO_RESOURCE(pSection, [](auto p) { ObDereferenceObject(p); });
+
+    PVOID pSystemView = NULL;
+    SIZE_T szSystemView = 0;
+    MX_RETURN_IF_FAIL(MmMapViewInSystemSpace(pSection, &pSystemView, &szSystemView));
+    AUTO_RESOURCE(pSystemView, MmUnmapViewInSystemSpace);
+
+    PMX_URING pUring = (PMX_URING)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_URING), MX_POOL_TAG);
+    if (pUring == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pUring, [](auto p) { ExFreePoolWithTag(p, MX_POOL_TAG); });
+
+    // Not inherited by forked children, which set up their own rings.
+    PVOID pMapBase = NULL;
+    SIZE_T szViewSize = 0;
+    MX_RETURN_IF_FAIL(ZwMapViewOfSection(
+        hdlSection,
+        ZwCurrentProcess(),
+        &pMapBase,
+        0,
+        0,
+        NULL,
+        &szViewSize,
+        ViewUnmap,
+        0,
+        PAGE_READWRITE
+    ));
+
+    // The section is zero-filled, only the layout has to be published.
+    PMX_URING_HEADER pHeader = (PMX_URING_HEADER)pSystemView;
+    pHeader->Entries = uEntries;
+    pHeader->SqOffset = uSqOffset;
+    pHeader->CqOffset = uCqOffset;
+
+    pUring->Section = pSection;
+    pUring->Header = pHeader;
+    pUring->Sq = (PMX_URING_SQE)((PCHAR)pHeader + uSqOffset);
+    pUring->Cq = (PMX_URING_CQE)((PCHAR)pHeader + uCqOffset);
+    pUring->Entries = uEntries;
+    ExInitializePushLock(&pUring->Lock);
+
+    pSection = NULL;
+    pSystemView = NULL;
+
+    *pPUring = pUring;
+    pUring = NULL;
+    *pUserView = pMapBase;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxUringFree(
+    _In_ PMX_URING pUring
+)
+{
+    // The user view goes away with the process.
+    MmUnmapViewInSystemSpace(pUring->Header);
+    ObDereferenceObject(pUring->Section);
+
+    ExFreePoolWithTag(pUring, MX_POOL_TAG);
+}
+
+ULONG
+MxUringEnter(
+    _Inout_ PMX_URING pUring,
+    _In_ ULONG uMaxSubmit,
+    _In_ INT64 (*pfnSubmit)(_In_ PMX_URING_SQE pSqe)
+)
+{
+    PMX_URING_HEADER pHeader = pUring->Header;
+    PMX_URING_SQE pSq = pUring->Sq;
+    PMX_URING_CQE pCq = pUring->Cq;
+
+    ULONG uMask = pUring->Entries - 1;
+    ULONG uSubmitted = 0;
+
+    while (uSubmitted < uMaxSubmit)
+    {
+        MX_URING_SQE sqe;
+
+        {
+            PMX_URING pLockedUring = MxUringLock(pUring);
+            AUTO_RESOURCE(pLockedUring, MxUringUnlock);
+
+            ULONG uSqTail = ReadULongAcquire((volatile ULONG*)&pHeader->SqTail);
+            ULONG uQueued = uSqTail - pUring->SqHead;
+
+            // Nothing left, or garbage from the process.
+            if (uQueued == 0 || uQueued > pUring->Entries)
+            {
+                break;
+            }
+
+            // Room is kept for the completions of entries other threads are still submitting.
+            ULONG uCqHead = ReadULongAcquire((volatile ULONG*)&pHeader->CqHead);
+            if (pUring->CqTail + pUring->InFlight - uCqHead >= pUring->Entries)
+            {
+                break;
+            }
+
+            // A private copy, the process may keep changing the shared one.
+            sqe = pSq[pUring->SqHead & uMask];
+            ++pUring->SqHead;
+            WriteULongRelease((volatile ULONG*)&pHeader->SqHead, pUring->SqHead);
+            ++pUring->InFlight;
+        }
+
+        // Without the lock, reads may block for a long time.
+        INT64 iResult = pfnSubmit(&sqe);
+
+        {
+            PMX_URING pLockedUring = MxUringLock(pUring);
+            AUTO_RESOURCE(pLockedUring, MxUringUnlock);
+
+            PMX_URING_CQE pCqe = &pCq[pUring->CqTail & uMask];
+            pCqe->UserData = sqe.UserData;
+            pCqe->Result = iResult;
+            ++pUring->CqTail;
+            --pUring->InFlight;
+            WriteULongRelease((volatile ULONG*)&pHeader->CqTail, pUring->CqTail);
+        }
+
+        ++uSubmitted;
+    }
+
+    return uSubmitted;
+}
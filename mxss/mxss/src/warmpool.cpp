@@ -0,0 +1,535 @@
+#include "warmpool.h"
+
+#include <monika.h>
+
+#include "file.h"
+#include "image.h"
+#include "process.h"
+#include "provider.h"
+
+#include "AutoResource.h"
+
+#define MX_RETURN_IF_FAIL(s)        \
+    do                              \
+    {                               \
+        NTSTATUS status__ = (s);    \
+        if (!NT_SUCCESS(status__))  \
+            return status__;        \
+    }                               \
+    while (FALSE)
+
+#define MX_POOL_TAG ('  xM')
+
+typedef struct _MX_WARM_POOL_ENTRY {
+    LIST_ENTRY Link;
+    MX_IMAGE_KEY Key;
+    // Pooled processes inherit the token of their parent, so they never cross logon sessions.
+    LUID AuthenticationId;
+    // MX_EXECUTE_* flags of the processes, without MX_EXECUTE_SUSPENDED.
+    ULONG Flags;
+    // Not retried before the next session for the executable, which a broken file may never get.
+    BOOLEAN RefillFailed;
+    PMX_EXECUTABLE_NAME Name;
+    // The host of the latest session, parent of the processes created from here on.
+    PEPROCESS HostProcess;
+    SIZE_T ReadyCount;
+    PMX_PROCESS Ready[MA_WARM_POOL_SIZE_MAX];
+} MX_WARM_POOL_ENTRY, *PMX_WARM_POOL_ENTRY;
+
+// Most recently used first.
+static LIST_ENTRY MxWarmPoolEntries;
+static ULONG MxWarmPoolEntryCount = 0;
+static FAST_MUTEX MxWarmPoolLock;
+static SIZE_T MxWarmPoolSize = 0;
+// Set whenever an entry may be short of processes.
+static KEVENT MxWarmPoolPending;
+static KEVENT MxWarmPoolStop;
+static PETHREAD MxWarmPoolRefiller = NULL;
+
+static
+VOID
+MxWarmPoolDiscard(
+    _In_ PMX_PROCESS pMxProcess
+)
+{
+    // Never resumed, so nothing ran in it yet.
+    MxRoutines.TerminateProcess(pMxProcess->Process, STATUS_CANCELLED);
+    MxProcessFree(pMxProcess);
+}
+
+static
+VOID
+MxWarmPoolEntryFree(
+    _In_ PMX_WARM_POOL_ENTRY pEntry
+)
+{
+    for (SIZE_T i = 0; i < pEntry->ReadyCount; ++i)
+    {
+        MxWarmPoolDiscard(pEntry->Ready[i]);
+    }
+
+    if (pEntry->Name != NULL)
+    {
+        MxExecutableNameFree(pEntry->Name);
+    }
+
+    if (pEntry->HostProcess != NULL)
+    {
+        ObDereferenceObject(pEntry->HostProcess);
+    }
+
+    ExFreePoolWithTag(pEntry, MX_POOL_TAG);
+}
+
+static
+VOID
+MxWarmPoolFreeList(
+    _Inout_ PLIST_ENTRY pList
+)
+{
+    while (!IsListEmpty(pList))
+    {
+        MxWarmPoolEntryFree(CONTAINING_RECORD(RemoveHeadList(pList), MX_WARM_POOL_ENTRY, Link));
+    }
+}
+
+// Must be called with MxWarmPoolLock held.
+static
+PMX_WARM_POOL_ENTRY
+MxWarmPoolFind(
+    _In_ PMX_IMAGE_KEY pKey,
+    _In_ PLUID pAuthenticationId,
+    _In_ ULONG uFlags
+)
+{
+    for (PLIST_ENTRY pLink = MxWarmPoolEntries.Flink; pLink != &MxWarmPoolEntries;
+        pLink = pLink->Flink)
+    {
+        PMX_WARM_POOL_ENTRY pEntry = CONTAINING_RECORD(pLink, MX_WARM_POOL_ENTRY, Link);
+
+        if (RtlEqualMemory(&pEntry->Key, pKey, sizeof(*pKey))
+            && RtlEqualLuid(&pEntry->AuthenticationId, pAuthenticationId)
+            && pEntry->Flags == uFlags)
+        {
+            return pEntry;
+        }
+    }
+
+    return NULL;
+}
+
+static
+NTSTATUS
+MxWarmPoolQueryAuthenticationId(
+    _In_ PEPROCESS pProcess,
+    _Out_ PLUID pAuthenticationId
+)
+{
+    PACCESS_TOKEN pToken = PsReferencePrimaryToken(pProcess);
+    NTSTATUS status = SeQueryAuthenticationIdToken(pToken, pAuthenticationId);
+    PsDereferencePrimaryToken(pToken);
+
+    return status;
+}
+
+// Creates one process at a time without the lock held, until every entry is full or failed.
+static
+VOID
+MxWarmPoolRefill()
+{
+    while (KeReadStateEvent(&MxWarmPoolStop) == 0)
+    {
+        MX_IMAGE_KEY key = { };
+        LUID authenticationId = { };
+        ULONG uFlags = 0;
+        PMX_EXECUTABLE_NAME pName = NULL;
+        PEPROCESS pHostProcess = NULL;
+
+        ExAcquireFastMutex(&MxWarmPoolLock);
+
+        for (PLIST_ENTRY pLink = MxWarmPoolEntries.Flink; pLink != &MxWarmPoolEntries;
+            pLink = pLink->Flink)
+        {
+            PMX_WARM_POOL_ENTRY pEntry = CONTAINING_RECORD(pLink, MX_WARM_POOL_ENTRY, Link);
+
+            if (!pEntry->RefillFailed && pEntry->ReadyCount < MxWarmPoolSize)
+            {
+                key = pEntry->Key;
+                authenticationId = pEntry->AuthenticationId;
+                uFlags = pEntry->Flags;
+                pName = pEntry->Name;
+                InterlockedIncrementSizeT(&pName->ReferenceCount);
+                pHostProcess = pEntry->HostProcess;
+                ObReferenceObject(pHostProcess);
+                break;
+            }
+        }
+
+        ExReleaseFastMutex(&MxWarmPoolLock);
+
+        if (pName == NULL)
+        {
+            return;
+        }
+
+        PMX_PROCESS pMxProcess = NULL;
+        // Placed, and given its arguments, by MxStartSession once it is handed out.
+        NTSTATUS status = MxProcessExecute(&pName->Name, pHostProcess, pHostProcess, NULL,
+            NULL, NULL, NULL, uFlags | MX_EXECUTE_SUSPENDED, NULL, &pMxProcess);
+
+        MxExecutableNameFree(pName);
+        ObDereferenceObject(pHostProcess);
+
+        ExAcquireFastMutex(&MxWarmPoolLock);
+
+        // Looked up again, the entry may have been evicted or the pool shrunk in the meantime.
+        PMX_WARM_POOL_ENTRY pEntry = MxWarmPoolFind(&key, &authenticationId, uFlags);
+
+        if (!NT_SUCCESS(status))
+        {
+            if (pEntry != NULL)
+            {
+                pEntry->RefillFailed = TRUE;
+            }
+        }
+        else if (pEntry != NULL && pEntry->ReadyCount < MxWarmPoolSize)
+        {
+            pEntry->Ready[pEntry->ReadyCount++] = pMxProcess;
+            pMxProcess = NULL;
+        }
+
+        ExReleaseFastMutex(&MxWarmPoolLock);
+
+        if (pMxProcess != NULL)
+        {
+            MxWarmPoolDiscard(pMxProcess);
+        }
+    }
+}
+
+static
+VOID
+MxWarmPoolRefillerMain(
+    _In_ PVOID pContext
+)
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    PVOID pWaitObjects[] = { &MxWarmPoolStop, &MxWarmPoolPending };
+
+    while (TRUE)
+    {
+        NTSTATUS status = KeWaitForMultipleObjects(ARRAYSIZE(pWaitObjects), pWaitObjects,
+            WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+
+        if (status == STATUS_WAIT_0)
+        {
+            break;
+        }
+
+        MxWarmPoolRefill();
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Starts keeping processes ready for the executable. Races with another session for the same
+// key are resolved by keeping the entry that made it to the list first.
+static
+NTSTATUS
+MxWarmPoolInsert(
+    _In_ HANDLE hdlExecutable,
+    _In_ PMX_IMAGE_KEY pKey,
+    _In_ PLUID pAuthenticationId,
+    _In_ ULONG uFlags,
+    _In_ PEPROCESS pHostProcess
+)
+{
+    PMX_WARM_POOL_ENTRY pEntry = (PMX_WARM_POOL_ENTRY)
+        ExAllocatePoolZero(PagedPool, sizeof(MX_WARM_POOL_ENTRY), MX_POOL_TAG);
+    if (pEntry == NULL)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    AUTO_RESOURCE(pEntry, MxWarmPoolEntryFree);
+
+    pEntry->Key = *pKey;
+    pEntry->AuthenticationId = *pAuthenticationId;
+    pEntry->Flags = uFlags;
+    pEntry->HostProcess = pHostProcess;
+    ObReferenceObject(pHostProcess);
+
+    PFILE_OBJECT pFileObject = NULL;
+    MX_RETURN_IF_FAIL(ObReferenceObjectByHandle(
+        hdlExecutable,
+        FILE_GENERIC_READ | FILE_GENERIC_EXECUTE,
+        *IoFileObjectType,
+        KernelMode,
+        (PVOID*)&pFileObject,
+        NULL
+    ));
+    AUTO_RESOURCE(pFileObject, [](auto p) { ObDereferenceObject(p); });
+
+    // The full path, as the refills have no working directory to resolve against.
+    MX_RETURN_IF_FAIL(MxExecutableNameCreate(pFileObject, &pEntry->Name));
+
+    LIST_ENTRY evicted;
+    InitializeListHead(&evicted);
+
+    ExAcquireFastMutex(&MxWarmPoolLock);
+
+    if (MxWarmPoolSize != 0 && MxWarmPoolFind(pKey, pAuthenticationId, uFlags) == NULL)
+    {
+        InsertHeadList(&MxWarmPoolEntries, &pEntry->Link);
+        pEntry = NULL;
+
+        if (++MxWarmPoolEntryCount > MX_WARM_POOL_MAX_ENTRIES)
+        {
+            InsertHeadList(&evicted, RemoveTailList(&MxWarmPoolEntries));
+            --MxWarmPoolEntryCount;
+        }
+    }
+
+    ExReleaseFastMutex(&MxWarmPoolLock);
+
+    MxWarmPoolFreeList(&evicted);
+    KeSetEvent(&MxWarmPoolPending, IO_NO_INCREMENT, FALSE);
+
+    return STATUS_SUCCESS;
+}
+
+// Gives a pooled process to a new host, the same way MxProcessExecute sets up a fresh one.
+static
+NTSTATUS
+MxWarmPoolAttachHost(
+    _Inout_ PMX_PROCESS pMxProcess,
+    _In_ PEPROCESS pHostProcess
+)
+{
+    PMX_FILE_TABLE pFiles = NULL;
+    MX_RETURN_IF_FAIL(MxFileTableAllocate(&pFiles));
+
+    // Hosts without a console still get a process, its standard descriptors are just closed.
+    MxFileTableOpenConsole(pFiles, pHostProcess);
+
+    MxFileTableFree(pMxProcess->Files);
+    pMxProcess->Files = pFiles;
+
+    ObReferenceObject(pHostProcess);
+    ObDereferenceObject(pMxProcess->HostProcess);
+    pMxProcess->HostProcess = pHostProcess;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxInitializeWarmPool()
+{
+    InitializeListHead(&MxWarmPoolEntries);
+    ExInitializeFastMutex(&MxWarmPoolLock);
+    KeInitializeEvent(&MxWarmPoolPending, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&MxWarmPoolStop, NotificationEvent, FALSE);
+
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(&objAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    HANDLE hdlThread = NULL;
+    MX_RETURN_IF_FAIL(PsCreateSystemThread(
+        &hdlThread,
+        THREAD_ALL_ACCESS,
+        &objAttributes,
+        NULL,
+        NULL,
+        MxWarmPoolRefillerMain,
+        NULL
+    ));
+    AUTO_RESOURCE(hdlThread, ZwClose);
+
+    NTSTATUS status = ObReferenceObjectByHandle(
+        hdlThread,
+        SYNCHRONIZE,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&MxWarmPoolRefiller,
+        NULL
+    );
+
+    if (!NT_SUCCESS(status))
+    {
+        // Without a reference there is nothing to wait on, but the thread must not outlive us.
+        KeSetEvent(&MxWarmPoolStop, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(hdlThread, FALSE, NULL);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MxCleanupWarmPool()
+{
+    if (MxWarmPoolRefiller != NULL)
+    {
+        KeSetEvent(&MxWarmPoolStop, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(MxWarmPoolRefiller, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(MxWarmPoolRefiller);
+        MxWarmPoolRefiller = NULL;
+    }
+
+    LIST_ENTRY removed;
+    InitializeListHead(&removed);
+
+    ExAcquireFastMutex(&MxWarmPoolLock);
+
+    MxWarmPoolSize = 0;
+    while (!IsListEmpty(&MxWarmPoolEntries))
+    {
+        InsertTailList(&removed, RemoveHeadList(&MxWarmPoolEntries));
+    }
+    MxWarmPoolEntryCount = 0;
+
+    ExReleaseFastMutex(&MxWarmPoolLock);
+
+    MxWarmPoolFreeList(&removed);
+}
+
+NTSTATUS
+MxWarmPoolSetSize(
+    _In_ SIZE_T Size
+)
+{
+    if (Size > MA_WARM_POOL_SIZE_MAX)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (MxWarmPoolRefiller == NULL)
+    {
+        // Already cleaned up, nothing would fill the pool.
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    LIST_ENTRY removed;
+    InitializeListHead(&removed);
+
+    ExAcquireFastMutex(&MxWarmPoolLock);
+
+    if (Size < MxWarmPoolSize)
+    {
+        while (!IsListEmpty(&MxWarmPoolEntries))
+        {
+            InsertTailList(&removed, RemoveHeadList(&MxWarmPoolEntries));
+        }
+        MxWarmPoolEntryCount = 0;
+    }
+    MxWarmPoolSize = Size;
+
+    ExReleaseFastMutex(&MxWarmPoolLock);
+
+    MxWarmPoolFreeList(&removed);
+    KeSetEvent(&MxWarmPoolPending, IO_NO_INCREMENT, FALSE);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MxWarmPoolTake(
+    _In_ PUNICODE_STRING pExecutablePath,
+    _In_opt_ HANDLE hdlCwd,
+    _In_ PEPROCESS pHostProcess,
+    _In_ ULONG uFlags,
+    _Out_ PMX_PROCESS* pPMxProcess
+)
+{
+    *pPMxProcess = NULL;
+
+    if (MxWarmPoolSize == 0)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    uFlags &= ~MX_EXECUTE_SUSPENDED;
+
+    // Opened the same way as by MxProcessExecute, so that a hit runs the file a miss would.
+    OBJECT_ATTRIBUTES objAttributes;
+    InitializeObjectAttributes(
+        &objAttributes,
+        pExecutablePath,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+        hdlCwd,
+        NULL
+    );
+
+    IO_STATUS_BLOCK ioStatus;
+
+    HANDLE hdlExecutable = NULL;
+    MX_RETURN_IF_FAIL(ZwOpenFile(
+        &hdlExecutable,
+        FILE_GENERIC_READ | FILE_GENERIC_EXECUTE,
+        &objAttributes,
+        &ioStatus,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_SYNCHRONOUS_IO_NONALERT
+    ));
+    AUTO_RESOURCE(hdlExecutable, ZwClose);
+
+    // Replaced or rewritten files get a new key, and their stale processes age out.
+    MX_IMAGE_KEY key;
+    MX_RETURN_IF_FAIL(MxImageQueryKey(hdlExecutable, &key));
+
+    LUID authenticationId;
+    MX_RETURN_IF_FAIL(MxWarmPoolQueryAuthenticationId(pHostProcess, &authenticationId));
+
+    PMX_PROCESS pMxProcess = NULL;
+
+    ExAcquireFastMutex(&MxWarmPoolLock);
+
+    PMX_WARM_POOL_ENTRY pEntry = MxWarmPoolFind(&key, &authenticationId, uFlags);
+
+    if (pEntry != NULL)
+    {
+        RemoveEntryList(&pEntry->Link);
+        InsertHeadList(&MxWarmPoolEntries, &pEntry->Link);
+
+        ObReferenceObject(pHostProcess);
+        ObDereferenceObject(pEntry->HostProcess);
+        pEntry->HostProcess = pHostProcess;
+        pEntry->RefillFailed = FALSE;
+
+        if (pEntry->ReadyCount != 0)
+        {
+            pMxProcess = pEntry->Ready[--pEntry->ReadyCount];
+        }
+    }
+
+    ExReleaseFastMutex(&MxWarmPoolLock);
+
+    if (pEntry == NULL)
+    {
+        // Only for the sessions that follow, this one starts the usual way.
+        MxWarmPoolInsert(hdlExecutable, &key, &authenticationId, uFlags, pHostProcess);
+        return STATUS_NOT_FOUND;
+    }
+
+    KeSetEvent(&MxWarmPoolPending, IO_NO_INCREMENT, FALSE);
+
+    if (pMxProcess == NULL)
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    // Somebody may have terminated it while it waited.
+    NTSTATUS status = PsGetProcessExitStatus(pMxProcess->Process) == STATUS_PENDING
+        ? MxWarmPoolAttachHost(pMxProcess, pHostProcess)
+        : STATUS_NOT_FOUND;
+
+    if (!NT_SUCCESS(status))
+    {
+        MxWarmPoolDiscard(pMxProcess);
+        return status;
+    }
+
+    *pPMxProcess = pMxProcess;
+
+    return STATUS_SUCCESS;
+}